@@ -0,0 +1,203 @@
+
+#include "AnalyzeConfig.h"
+#include "runtime/MultiStage.h"
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <map>
+
+namespace {
+  // contexts with more candidates per key event are reported
+  const auto max_candidates = size_t{ 32 };
+  // inputs without leading key are tried on every key event
+  const auto max_generic_inputs = size_t{ 8 };
+  // unordered presses and negated keys are matched by trying permutations
+  const auto max_async_events = size_t{ 4 };
+
+  struct Finding {
+    int line_no;
+    std::string message;
+  };
+
+  // like Stage's input index
+  Key get_leading_key(const KeySequence& input) {
+    if (input.empty())
+      return Key::none;
+    const auto& first = input.front();
+    if (first.state != KeyState::Down ||
+        first.key == Key::any ||
+        first.key == Key::timeout)
+      return Key::none;
+    return first.key;
+  }
+
+  size_t count_async_events(const KeySequence& input) {
+    return static_cast<size_t>(std::count_if(input.begin(), input.end(),
+      [](const KeyEvent& event) {
+        return (event.state == KeyState::DownAsync ||
+                event.state == KeyState::Not);
+      }));
+  }
+
+  bool contains_any_key(const KeySequence& input) {
+    return std::any_of(input.begin(), input.end(),
+      [](const KeyEvent& event) { return event.key == Key::any; });
+  }
+
+  bool is_no_might_match(const KeySequence& input) {
+    return (!input.empty() && input.front().state == KeyState::NoMightMatch);
+  }
+
+  bool has_window_filter(const Config::Context& context) {
+    return (!context.window_class_filter.string.empty() ||
+      !context.window_title_filter.string.empty() ||
+      !context.window_path_filter.string.empty());
+  }
+
+  size_t get_sequence_bytes(const KeySequence& sequence) {
+    return sizeof(KeySequence) + (sequence.size() > KeySequence::inline_capacity ?
+      sequence.size() * sizeof(KeyEvent) : 0);
+  }
+
+  Stage::Context to_stage_context(const Config::Context& config_context) {
+    auto context = Stage::Context();
+    for (const auto& input : config_context.inputs)
+      context.inputs.push_back({ input.input, input.output_index });
+    context.outputs = config_context.outputs;
+    for (const auto& command : config_context.command_outputs)
+      context.command_outputs.push_back({ command.output, command.index });
+    context.device_filter = config_context.device_filter;
+    context.device_id_filter = config_context.device_id_filter;
+    context.modifier_filter = config_context.modifier_filter;
+    context.invert_modifier_filter = config_context.invert_modifier_filter;
+    context.fallthrough = config_context.fallthrough;
+    return context;
+  }
+
+  struct ContextCost {
+    size_t inputs;
+    // inputs without leading key plus the largest group with the same one
+    size_t candidates;
+    size_t async_inputs;
+    size_t bytes;
+    bool always_active;
+  };
+
+  ContextCost analyze_context(const Config::Context& context,
+      int context_index, std::vector<Finding>& findings) {
+    auto cost = ContextCost{ };
+    cost.inputs = context.inputs.size();
+    cost.always_active = !has_window_filter(context);
+
+    auto generic_inputs = size_t{ };
+    auto inputs_by_key = std::map<Key, size_t>();
+    const auto add_finding = [&](int line_no, std::string message) {
+      findings.push_back({ line_no, std::move(message) });
+    };
+    for (const auto& input : context.inputs) {
+      const auto key = get_leading_key(input.input);
+      if (key == Key::none)
+        ++generic_inputs;
+      else
+        ++inputs_by_key[key];
+
+      const auto async_events = count_async_events(input.input);
+      if (async_events)
+        ++cost.async_inputs;
+      if (async_events >= max_async_events)
+        add_finding(input.line_no, std::to_string(async_events) +
+          " unordered or negated keys are matched in every order");
+      if (contains_any_key(input.input))
+        add_finding(input.line_no, "Any is tried on every key event");
+      else if (is_no_might_match(input.input))
+        add_finding(input.line_no,
+          "no-might-match input is tried on every key event");
+      cost.bytes += get_sequence_bytes(input.input) + sizeof(Config::Input);
+    }
+    for (const auto& output : context.outputs)
+      cost.bytes += get_sequence_bytes(output);
+    for (const auto& command : context.command_outputs)
+      cost.bytes += get_sequence_bytes(command.output);
+
+    auto largest_group = size_t{ };
+    for (const auto& [key, count] : inputs_by_key)
+      largest_group = std::max(largest_group, count);
+    cost.candidates = generic_inputs + largest_group;
+
+    const auto line_no = (context.inputs.empty() ? 0 :
+      context.inputs.front().line_no);
+    if (generic_inputs > max_generic_inputs)
+      add_finding(line_no, "context " + std::to_string(context_index) +
+        " has " + std::to_string(generic_inputs) +
+        " inputs without leading key, which are tried on every key event");
+    else if (cost.candidates > max_candidates)
+      add_finding(line_no, "context " + std::to_string(context_index) +
+        " tries up to " + std::to_string(cost.candidates) +
+        " inputs per key event");
+    return cost;
+  }
+} // namespace
+
+std::string analyze_config(const Config& config) {
+  auto report = std::string();
+  auto findings = std::vector<Finding>();
+  auto buffer = std::array<char, 256>();
+
+  const auto add_stage = [&](size_t stage_index, size_t begin, size_t end) {
+    auto contexts = std::vector<Stage::Context>();
+    for (auto i = begin; i < end; ++i)
+      contexts.push_back(to_stage_context(config.contexts[i]));
+    const auto stage = Stage(std::move(contexts), config.logical_keys,
+      config.forward_modifiers);
+    const auto& capacity = stage.capacity();
+
+    std::snprintf(buffer.data(), buffer.size(),
+      "stage %zu: %zu contexts, longest input %zu events, "
+      "longest sequence %zu events, %zu bytes buffers%s\n"
+      "%8s %6s %8s %11s %8s %8s\n",
+      stage_index, end - begin, capacity.max_input_length,
+      2 * capacity.max_input_length + KeySequence::inline_capacity,
+      stage.buffer_footprint(),
+      (stage.has_minimal_policy() ? ", minimal matching" : ""),
+      "context", "line", "inputs", "candidates", "async", "bytes");
+    report += buffer.data();
+
+    auto always_candidates = size_t{ };
+    auto all_candidates = size_t{ };
+    for (auto i = begin; i < end; ++i) {
+      const auto& context = config.contexts[i];
+      const auto cost = analyze_context(context, static_cast<int>(i), findings);
+      all_candidates += cost.candidates;
+      if (cost.always_active)
+        always_candidates += cost.candidates;
+      std::snprintf(buffer.data(), buffer.size(),
+        "%8zu %6d %8zu %11zu %8zu %8zu\n", i,
+        (context.inputs.empty() ? 0 : context.inputs.front().line_no),
+        cost.inputs, cost.candidates, cost.async_inputs, cost.bytes);
+      report += buffer.data();
+    }
+    std::snprintf(buffer.data(), buffer.size(),
+      "candidates per key event: %zu in contexts without window filter, "
+      "%zu when all are active\n\n", always_candidates, all_candidates);
+    report += buffer.data();
+  };
+
+  auto stage_index = size_t{ };
+  auto begin = size_t{ };
+  for (auto i = size_t{ 1 }; i <= config.contexts.size(); ++i)
+    if (i == config.contexts.size() || config.contexts[i].begin_stage) {
+      add_stage(stage_index++, begin, i);
+      begin = i;
+    }
+
+  if (findings.empty())
+    return report + "No mappings slow down matching\n";
+
+  std::stable_sort(findings.begin(), findings.end(),
+    [](const Finding& a, const Finding& b) { return a.line_no < b.line_no; });
+  report += "Mappings which slow down matching:\n";
+  for (const auto& finding : findings)
+    report += "  line " + std::to_string(finding.line_no) + ": " +
+      finding.message + "\n";
+  return report;
+}
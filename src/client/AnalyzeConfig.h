@@ -0,0 +1,8 @@
+#pragma once
+
+#include "config/Config.h"
+#include <string>
+
+// builds the stages like keymapperd and reports what matching them costs,
+// mappings which slow matching down are listed with their line
+std::string analyze_config(const Config& config);
@@ -3,12 +3,18 @@
 #include "config/get_key_name.h"
 #include "config/ParseKeySequence.h"
 #include "common/output.h"
+#include <algorithm>
+#include <array>
+#include <cstdio>
 #include <sstream>
 #include <utility>
 
 extern bool execute_terminal_command(const std::string& command);
 
 namespace {
+  // long injected sequences are sent in multiple messages
+  const auto max_inject_chunk_size = size_t{ 1024 };
+
   KeySequence replace_logical_keys(KeySequence sequence) {
     for (auto& event : sequence) {
       if (event.key == Key::Shift)
@@ -21,6 +27,65 @@ namespace {
     return sequence;
   }
 
+  // maps the counters of the inputs back to the lines of the configuration,
+  // the most expensive first
+  std::string format_profile_report(const Config& config,
+      const InputProfiles& profiles) {
+    if (profiles.empty())
+      return "Profiling is not enabled, add @profile to the configuration\n";
+
+    struct Entry {
+      int line_no;
+      const InputProfile* profile;
+    };
+    auto entries = std::vector<Entry>();
+    auto untried = 0;
+    auto total = InputProfile{ };
+    const auto contexts = std::min(profiles.size(), config.contexts.size());
+    for (auto i = size_t{ }; i < contexts; ++i) {
+      const auto& inputs = config.contexts[i].inputs;
+      const auto count = std::min(profiles[i].size(), inputs.size());
+      for (auto j = size_t{ }; j < count; ++j) {
+        const auto& profile = profiles[i][j];
+        if (!profile.invocations) {
+          ++untried;
+          continue;
+        }
+        entries.push_back({ inputs[j].line_no, &profile });
+        total.invocations += profile.invocations;
+        total.nanoseconds += profile.nanoseconds;
+      }
+    }
+    std::sort(entries.begin(), entries.end(),
+      [](const Entry& a, const Entry& b) {
+        return a.profile->nanoseconds > b.profile->nanoseconds;
+      });
+
+    auto report = std::string();
+    auto buffer = std::array<char, 128>();
+    std::snprintf(buffer.data(), buffer.size(),
+      "%llu matches took %.3f ms\n%6s %12s %12s %12s %12s %8s\n",
+      static_cast<unsigned long long>(total.invocations),
+      static_cast<double>(total.nanoseconds) / 1000000.0,
+      "line", "invocations", "might match", "match", "total us", "ns/call");
+    report += buffer.data();
+    for (const auto& [line_no, profile] : entries) {
+      std::snprintf(buffer.data(), buffer.size(),
+        "%6s %12llu %12llu %12llu %12.1f %8llu\n",
+        (line_no ? std::to_string(line_no).c_str() : "-"),
+        static_cast<unsigned long long>(profile->invocations),
+        static_cast<unsigned long long>(profile->might_matches),
+        static_cast<unsigned long long>(profile->matches),
+        static_cast<double>(profile->nanoseconds) / 1000.0,
+        static_cast<unsigned long long>(
+          profile->nanoseconds / profile->invocations));
+      report += buffer.data();
+    }
+    if (untried)
+      report += std::to_string(untried) + " mappings were never tried\n";
+    return report;
+  }
+
   KeySequence ensure_all_keys_up(KeySequence sequence) {
     static std::vector<Key> s_keys_down;
     s_keys_down.clear();
@@ -38,8 +103,27 @@ namespace {
       sequence.emplace_back(key, KeyState::Up);
     return sequence;
   }
+
+  // the window attributes, which are referred to by the contexts
+  FocusedWindow::Attributes get_window_attributes(
+      const std::vector<Config::Context>& contexts) {
+    auto attributes = FocusedWindow::Attributes{ };
+    for (const auto& context : contexts) {
+      if (!context.window_class_filter.string.empty())
+        attributes |= FocusedWindow::Class;
+      if (!context.window_title_filter.string.empty())
+        attributes |= FocusedWindow::Title;
+      if (!context.window_path_filter.string.empty())
+        attributes |= FocusedWindow::Path;
+    }
+    return attributes;
+  }
 } // namespace
 
+ClientState::ClientState(std::unique_ptr<IServerPort> server)
+  : m_server(std::move(server)) {
+}
+
 void ClientState::on_execute_action_message(int triggered_action) {
   const auto& actions = m_config_file.config().actions;
   if (triggered_action >= 0 &&
@@ -57,7 +141,12 @@ void ClientState::on_virtual_key_state_message(Key key, KeyState state) {
 }
 
 void ClientState::on_set_virtual_key_state_message(Key key, KeyState state) {
-  m_server.send_set_virtual_key_state(key, state);
+  m_server->send_set_virtual_key_state(key, state);
+}
+
+void ClientState::on_set_virtual_key_states_message(
+    const std::vector<Key>& keys, KeyState state) {
+  m_server->send_set_virtual_key_states(keys, state);
 }
 
 bool ClientState::on_set_config_file_message(std::string filename) {
@@ -76,20 +165,41 @@ bool ClientState::is_focused_window_inaccessible() const {
 
 std::optional<Socket> ClientState::connect_server() {
   verbose("Connecting to keymapperd");
-  if (m_server.connect())
-    return m_server.socket();
+  if (m_server->connect())
+    return m_server->socket();
   error("Connecting to keymapperd failed");
   return { };
 }
 
 bool ClientState::read_server_messages(std::optional<Duration> timeout) {
-  return m_server.read_messages(*this, timeout);
+  return m_server->read_messages(*this, timeout);
 }
 
+#if !defined(_WIN32)
+std::optional<Duration> ClientState::get_event_fds(std::vector<int>& fds,
+    Duration poll_interval, bool update_config) const {
+  auto timeout = std::optional<Duration>();
+  fds.push_back(m_server->socket());
+  if (!m_control.get_event_fds(fds))
+    timeout = poll_interval;
+  if (m_active && !m_focused_window.get_event_fds(fds))
+    timeout = poll_interval;
+  if (update_config)
+    if (const auto config_timeout = m_config_file.get_event_fds(
+          fds, poll_interval))
+      timeout = std::min(timeout.value_or(*config_timeout), *config_timeout);
+  if (const auto delay = pending_update_delay())
+    timeout = std::min(timeout.value_or(*delay), *delay);
+  return timeout;
+}
+#endif
+
 void ClientState::on_server_disconnected() {
   m_control.reset();
-  m_server.disconnect();
-  m_focused_window.shutdown();
+  m_server->disconnect();
+  // the focused window detection and the configuration are kept,
+  // so only the prepared message needs to be sent after reconnecting
+  m_server->prepare_reconnect(m_config_file.config());
 }
 
 bool ClientState::load_config(std::filesystem::path filename) {
@@ -121,7 +231,9 @@ bool ClientState::load_config(std::filesystem::path filename) {
 }
 
 bool ClientState::update_config(bool check_modified) {
-  if (!m_config_file.update(check_modified))
+  // modified files are read in the background, while the loop keeps running
+  if (!(check_modified ? m_config_file.update_in_background() :
+                         m_config_file.update(false)))
     return false;
   message("Configuration updated");
   return true;
@@ -129,13 +241,18 @@ bool ClientState::update_config(bool check_modified) {
 
 bool ClientState::send_config() {
   verbose("Sending configuration");
-  if (!m_server.send_config(m_config_file.config())) {
+  // the keyboard layout is updated before reading the configuration
+  m_injected_sequences.clear();
+  if (!m_server->send_config(m_config_file.config())) {
     error("Sending configuration failed");
     return false;
   }
 
   m_control.set_virtual_key_aliases(
     m_config_file.config().virtual_key_aliases);
+
+  m_context_matcher = ContextMatcher(m_config_file.config().contexts);
+  update_window_attributes();
   
   clear_active_contexts();
   if (m_active) {
@@ -155,7 +272,7 @@ void ClientState::toggle_active() {
 }
 
 bool ClientState::send_validate_state() {
-  return m_server.send_validate_state();
+  return m_server->send_validate_state();
 }
 
 bool ClientState::initialize_contexts() {
@@ -163,35 +280,74 @@ bool ClientState::initialize_contexts() {
   return m_focused_window.initialize();
 }
 
+void ClientState::update_window_attributes() {
+  // only query what is needed, but everything for verbose output
+  // and for recording
+  m_focused_window.set_attributes(g_verbose_output || m_focus_log ?
+    FocusedWindow::All : get_window_attributes(m_config_file.config().contexts));
+}
+
 void ClientState::clear_active_contexts() {
   m_active_contexts.clear();
+  m_contexts_matched = false;
+  m_title_update_pending = false;
 }
 
 bool ClientState::update_active_contexts() {
   if (!m_active)
     return false;
 
+  const auto focus_query_time = Clock::now();
   if (m_focused_window.update()) {
+    m_context_switch_times = { };
+    m_context_switch_times.focus_changed = to_timestamp(focus_query_time);
     verbose("Detected focused window changed:");
     verbose("  class = '%s'", m_focused_window.window_class().c_str());
     verbose("  title = '%s'", m_focused_window.window_title().c_str());
     verbose("  path = '%s'", m_focused_window.window_path().c_str());
+    if (m_focus_log)
+      m_focus_log->write(m_focused_window.window_class(),
+        m_focused_window.window_title(), m_focused_window.window_path(),
+        focus_query_time);
   }
   else {
-    if (!m_active_contexts.empty())
+    if (m_contexts_matched && !m_title_update_pending)
       return false;
   }
 
-  m_new_active_contexts.clear();
-  const auto& contexts = m_config_file.config().contexts;
-  for (auto i = 0; i < static_cast<int>(contexts.size()); ++i)
-    if (contexts[i].matches(
-        m_focused_window.window_class(),
-        m_focused_window.window_title(),
-        m_focused_window.window_path()))
-      m_new_active_contexts.push_back(i);
+  const auto& window_class = m_focused_window.window_class();
+  const auto& window_title = m_focused_window.window_title();
+  const auto& window_path = m_focused_window.window_path();
+  if (m_contexts_matched && window_class == m_matched_class &&
+      window_path == m_matched_path) {
+    // title changes are skipped when they do not change any title
+    // filter's result and are rate limited otherwise
+    if (!m_context_matcher.title_filters_differ(m_matched_title,
+          window_title)) {
+      m_matched_title = window_title;
+      m_title_update_pending = false;
+      return false;
+    }
+    const auto interval = std::chrono::milliseconds(
+      m_config_file.config().title_update_interval_ms);
+    if (focus_query_time < m_title_update_time + interval) {
+      m_title_update_pending = true;
+      return false;
+    }
+    m_title_update_time = focus_query_time;
+  }
+  m_title_update_pending = false;
+  m_contexts_matched = true;
+  m_matched_class = window_class;
+  m_matched_title = window_title;
+  m_matched_path = window_path;
+
+  m_context_matcher.match(window_class, window_title, window_path,
+    &m_new_active_contexts);
 
   if (m_new_active_contexts != m_active_contexts) {
+    if (m_context_switch_times.focus_changed)
+      m_context_switch_times.contexts_matched = to_timestamp(Clock::now());
     verbose("Active contexts updated");
     m_active_contexts.swap(m_new_active_contexts);
     return true;
@@ -199,9 +355,25 @@ bool ClientState::update_active_contexts() {
   return false;
 }
 
+std::optional<Duration> ClientState::pending_update_delay() const {
+  if (!m_title_update_pending)
+    return { };
+  const auto interval = std::chrono::milliseconds(
+    m_config_file.config().title_update_interval_ms);
+  return std::max(Duration::zero(),
+    Duration(m_title_update_time + interval - Clock::now()));
+}
+
 bool ClientState::send_active_contexts() {
   verbose("Sending active contexts (%u)", m_active_contexts.size());
-  return m_server.send_active_contexts(m_active_contexts);
+  m_control.on_active_contexts_changed(m_active_contexts);
+  // only a focus change which updated the contexts is measured
+  auto times = std::exchange(m_context_switch_times, { });
+  if (times.contexts_matched)
+    times.sent = to_timestamp(Clock::now());
+  else
+    times = { };
+  return m_server->send_active_contexts(m_active_contexts, times);
 }
 
 std::optional<Socket> ClientState::listen_for_control_connections() {
@@ -216,12 +388,27 @@ void ClientState::read_control_messages() {
   m_control.read_messages(*this);
 }
 
+bool ClientState::record_focus_log(const std::filesystem::path& filename) {
+  m_focus_log = std::make_unique<FocusLogWriter>();
+  if (!m_focus_log->open(filename, Clock::now())) {
+    m_focus_log.reset();
+    return false;
+  }
+  update_window_attributes();
+  return true;
+}
+
 void ClientState::on_next_key_info_message(Key key, DeviceDesc device) {
   extern const char* current_system;
   auto ss = std::stringstream();
   ss << "key_name = '" << get_key_name(key) << "'\n";
   ss << "scan_code = 0x" << std::hex << std::uppercase << std::setfill('0') << std::setw(4) << *key << "\n";
   ss << "system = '" << current_system << "'\n";
+
+  // temporarily query all attributes of the focused window
+  m_focused_window.set_attributes(FocusedWindow::All);
+  if (update_active_contexts())
+    send_active_contexts();
   if (!m_focused_window.window_title().empty())
     ss << "title = '" << m_focused_window.window_title() << "'\n";
   if (!m_focused_window.window_class().empty())
@@ -232,6 +419,7 @@ void ClientState::on_next_key_info_message(Key key, DeviceDesc device) {
     ss << "device = '" << device.name << "'\n";
   if (!device.id.empty())
     ss << "device-id = '" << device.id << "'\n";
+  update_window_attributes();
   auto next_key_info = ss.str();
   next_key_info.pop_back();
   if (!m_control.reply_next_key_info(next_key_info))
@@ -247,14 +435,50 @@ void ClientState::on_next_key_info_requested_message() {
 }
 
 void ClientState::request_next_key_info() {
-  m_server.send_request_next_key_info();
+  m_server->send_request_next_key_info();
 }
 
-bool ClientState::on_inject_input_message(const std::string& string) try {
+void ClientState::on_statistics_message(const std::string& statistics) {
+  m_control.reply_statistics(statistics);
+}
+
+void ClientState::on_statistics_requested_message(bool recent_events) {
+  // reply at once when the server is not connected
+  if (!m_server->send_request_statistics(recent_events))
+    m_control.reply_statistics("");
+}
+
+void ClientState::on_input_profiles_message(const InputProfiles& profiles) {
+  m_control.reply_statistics(
+    format_profile_report(m_config_file.config(), profiles));
+}
+
+void ClientState::on_profile_report_requested_message() {
+  if (!m_server->send_request_input_profiles())
+    m_control.reply_statistics("");
+}
+
+const KeySequence& ClientState::get_injected_sequence(
+    const std::string& string) {
+  auto& entries = m_injected_sequences;
+  const auto it = std::find_if(entries.begin(), entries.end(),
+    [&](const InjectedSequence& entry) { return entry.string == string; });
+  if (it != entries.end()) {
+    std::rotate(it, std::next(it), entries.end());
+    return entries.back().sequence;
+  }
+
   static auto s_parse_sequence = ParseKeySequence();
-  const auto sequence = ensure_all_keys_up(
+  auto sequence = ensure_all_keys_up(
     replace_logical_keys(s_parse_sequence(string, false)));
-  m_server.send_inject_input(sequence);
+  if (entries.size() >= max_injected_sequences)
+    entries.erase(entries.begin());
+  entries.push_back({ string, std::move(sequence) });
+  return entries.back().sequence;
+}
+
+bool ClientState::on_inject_input_message(const std::string& string) try {
+  m_server->send_inject_input(get_injected_sequence(string));
   return true;
 }
 catch (...) {
@@ -263,10 +487,24 @@ catch (...) {
 
 
 bool ClientState::on_inject_output_message(const std::string& string) try {
-  static auto s_parse_sequence = ParseKeySequence();
-  const auto sequence = ensure_all_keys_up(
-    replace_logical_keys(s_parse_sequence(string, false)));
-  m_server.send_inject_output(sequence);
+  const auto& sequence = get_injected_sequence(string);
+  // split only where no key is hold
+  auto begin = sequence.begin();
+  auto keys_down = 0;
+  for (auto it = sequence.begin(); it != sequence.end(); ) {
+    if (it->state == KeyState::Down)
+      ++keys_down;
+    else if (it->state == KeyState::Up && keys_down > 0)
+      --keys_down;
+    ++it;
+    if ((keys_down == 0 && it - begin >= 
+          static_cast<std::ptrdiff_t>(max_inject_chunk_size)) ||
+        it == sequence.end()) {
+      if (!m_server->send_inject_output(KeySequence(begin, it)))
+        return false;
+      begin = it;
+    }
+  }
   return true;
 }
 catch (...) {
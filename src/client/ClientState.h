@@ -4,11 +4,16 @@
 #include "client/ConfigFile.h"
 #include "client/ServerPort.h"
 #include "client/ControlPort.h"
+#include "client/FocusLog.h"
+#include "config/ContextMatcher.h"
 
 class ClientState : public ServerPort::MessageHandler,
                     public ControlPort::MessageHandler {
 public:
+  explicit ClientState(std::unique_ptr<IServerPort> server =
+    std::make_unique<ServerPort>());
   const std::filesystem::path& config_filename() const;
+  const Config& config() const { return m_config_file.config(); }
   bool is_focused_window_inaccessible() const;
   bool is_active() const { return m_active; }
 
@@ -16,6 +21,12 @@ public:
   bool update_config(bool check_modified);
   std::optional<Socket> connect_server();
   bool read_server_messages(std::optional<Duration> timeout = { });
+#if !defined(_WIN32)
+  // adds the file descriptors, which are readable when something needs to
+  // be updated, returns the time after which it needs to be updated anyway
+  std::optional<Duration> get_event_fds(std::vector<int>& fds,
+    Duration poll_interval, bool update_config) const;
+#endif
   void on_server_disconnected();
   bool initialize_contexts();
   bool send_config();
@@ -24,33 +35,67 @@ public:
   void clear_active_contexts();
   bool update_active_contexts();
   bool send_active_contexts();
+  // time until a rate limited title change needs to be applied
+  std::optional<Duration> pending_update_delay() const;
   std::optional<Socket> listen_for_control_connections();
   std::optional<Socket> accept_control_connection();
   void read_control_messages();
   void request_next_key_info();
+  // records the attributes of each focused window
+  bool record_focus_log(const std::filesystem::path& filename);
 
 protected:
   // server messages
   void on_execute_action_message(int triggered_action) override;
   void on_virtual_key_state_message(Key key, KeyState state) override;
   void on_next_key_info_message(Key key, DeviceDesc device) override;
+  void on_statistics_message(const std::string& statistics) override;
+  void on_input_profiles_message(const InputProfiles& profiles) override;
 
   // control messages
   void on_set_virtual_key_state_message(Key key, KeyState state) override;
+  void on_set_virtual_key_states_message(const std::vector<Key>& keys,
+    KeyState state) override;
   bool on_set_config_file_message(std::string filename) override;
   void on_next_key_info_requested_message() override;
+  void on_statistics_requested_message(bool recent_events) override;
+  void on_profile_report_requested_message() override;
   bool on_inject_input_message(const std::string& string) override;
   bool on_inject_output_message(const std::string& string) override;
 
   virtual void show_next_key_info(const std::string& next_key_info);
 
 private:
+  struct InjectedSequence {
+    std::string string;
+    KeySequence sequence;
+  };
+  static constexpr size_t max_injected_sequences = 16;
+
+  void update_window_attributes();
+  // the parsed sequence of an injected string, throws when it is invalid
+  const KeySequence& get_injected_sequence(const std::string& string);
+
   ConfigFile m_config_file;
   std::vector<ConfigFile> m_recent_config_files;
-  ServerPort m_server;
+  std::unique_ptr<IServerPort> m_server;
   ControlPort m_control;
   FocusedWindow m_focused_window;
+  std::unique_ptr<FocusLogWriter> m_focus_log;
+  ContextMatcher m_context_matcher;
   std::vector<int> m_active_contexts;
   std::vector<int> m_new_active_contexts;
+  // of the last focus change, until the contexts are sent
+  ContextSwitchTimes m_context_switch_times{ };
+  // the window the active contexts were matched for
+  bool m_contexts_matched{ };
+  std::string m_matched_class;
+  std::string m_matched_title;
+  std::string m_matched_path;
+  Clock::time_point m_title_update_time;
+  bool m_title_update_pending{ };
   bool m_active{ true };
+  // the recently injected strings, most recently used last. They are
+  // parsed again when the configuration or keyboard layout was updated
+  std::vector<InjectedSequence> m_injected_sequences;
 };
@@ -0,0 +1,346 @@
+
+#include "ConfigCache.h"
+#include "config/StringTyper.h"
+#include "common/Connection.h"
+#include "common/parse_regex.h"
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+
+namespace {
+  const auto cache_magic = uint32_t{ 0x4b434643 };
+
+  constexpr auto version = std::string_view(
+#if __has_include("common/_version.h")
+# include "common/_version.h"
+#endif
+  );
+
+  // FNV-1a, which unlike std::hash is stable between builds
+  uint64_t get_hash(const void* data, size_t size,
+      uint64_t hash = 14695981039346656037ull) {
+    const auto bytes = static_cast<const unsigned char*>(data);
+    for (auto i = size_t{ }; i < size; ++i)
+      hash = (hash ^ bytes[i]) * 1099511628211ull;
+    return hash;
+  }
+
+  uint64_t get_hash(std::string_view string) {
+    return get_hash(string.data(), string.size());
+  }
+
+  std::optional<std::vector<char>> read_file(const std::filesystem::path& filename) {
+    auto is = std::ifstream(filename, std::ios::binary | std::ios::ate);
+    if (!is.good())
+      return { };
+    const auto size = static_cast<std::streamoff>(is.tellg());
+    if (size < 0)
+      return { };
+    auto contents = std::vector<char>(static_cast<size_t>(size));
+    is.seekg(0);
+    if (!is.read(contents.data(), size))
+      return { };
+    return contents;
+  }
+
+  std::optional<uint64_t> get_file_hash(const std::filesystem::path& filename) {
+    if (auto contents = read_file(filename))
+      return get_hash(contents->data(), contents->size());
+    return { };
+  }
+
+  std::filesystem::path get_cache_directory() {
+#if defined(_WIN32)
+    if (auto path = ::_wgetenv(L"LOCALAPPDATA"); path && *path)
+      return std::filesystem::path(path) / "keymapper";
+#else
+    if (auto path = std::getenv("XDG_CACHE_HOME"); path && *path)
+      return std::filesystem::path(path) / "keymapper";
+    if (auto path = std::getenv("HOME"); path && *path)
+      return std::filesystem::path(path) / ".cache" / "keymapper";
+#endif
+    return { };
+  }
+
+  std::filesystem::path get_cache_filename(
+      const std::filesystem::path& filename) {
+    auto directory = get_cache_directory();
+    if (directory.empty())
+      return { };
+    const auto& native = filename.native();
+    const auto hash = get_hash(native.data(),
+      native.size() * sizeof(native[0]));
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.cache",
+      static_cast<unsigned long long>(hash));
+    return directory / name;
+  }
+
+  void write_key_sequence(Serializer& s, const KeySequence& sequence) {
+    static_assert(std::is_trivially_copyable_v<KeyEvent>);
+    s.write(static_cast<uint32_t>(sequence.size()));
+    s.write(sequence.data(), sequence.size() * sizeof(KeyEvent));
+  }
+
+  void write_filter(Serializer& s, const Filter& filter) {
+    s.write(filter.string);
+    s.write(filter.invert);
+  }
+
+  void write_config(Serializer& s, const Config& config) {
+    s.write(static_cast<uint32_t>(config.contexts.size()));
+    for (const auto& context : config.contexts) {
+      write_filter(s, context.window_class_filter);
+      write_filter(s, context.window_title_filter);
+      write_filter(s, context.window_path_filter);
+      write_filter(s, context.device_filter);
+      write_filter(s, context.device_id_filter);
+      write_key_sequence(s, context.modifier_filter);
+
+      s.write(static_cast<uint32_t>(context.inputs.size()));
+      for (const auto& input : context.inputs) {
+        write_key_sequence(s, input.input);
+        s.write(static_cast<int32_t>(input.output_index));
+        s.write(static_cast<int32_t>(input.line_no));
+      }
+
+      s.write(static_cast<uint32_t>(context.outputs.size()));
+      for (const auto& output : context.outputs)
+        write_key_sequence(s, output);
+
+      s.write(static_cast<uint32_t>(context.command_outputs.size()));
+      for (const auto& command : context.command_outputs) {
+        write_key_sequence(s, command.output);
+        s.write(static_cast<int32_t>(command.index));
+      }
+
+      s.write(context.system_filter_matched);
+      s.write(context.invert_modifier_filter);
+      s.write(context.fallthrough);
+      s.write(context.begin_stage);
+    }
+
+    s.write(static_cast<uint32_t>(config.actions.size()));
+    for (const auto& action : config.actions)
+      s.write(action.terminal_command);
+
+    s.write(static_cast<uint32_t>(config.virtual_key_aliases.size()));
+    for (const auto& [name, key] : config.virtual_key_aliases) {
+      s.write(name);
+      s.write(key);
+    }
+
+    s.write(static_cast<uint32_t>(config.grab_device_filters.size()));
+    for (const auto& filter : config.grab_device_filters) {
+      write_filter(s, filter);
+      s.write(filter.by_id);
+    }
+
+    s.write(static_cast<uint32_t>(config.server_directives.size()));
+    for (const auto& directive : config.server_directives)
+      s.write(directive);
+    s.write(static_cast<int32_t>(config.title_update_interval_ms));
+
+    const auto& logical_keys = config.logical_keys.definitions();
+    s.write(static_cast<uint32_t>(logical_keys.size()));
+    for (const auto& [logical, left, right] : logical_keys) {
+      s.write(logical);
+      s.write(left);
+      s.write(right);
+    }
+
+    s.write(static_cast<uint32_t>(config.forward_modifiers.size()));
+    for (auto key : config.forward_modifiers)
+      s.write(key);
+  }
+
+  // each element takes at least a byte
+  uint32_t read_count(Deserializer& d) {
+    const auto count = d.read<uint32_t>();
+    return (d.can_read(count) ? count : 0);
+  }
+
+  std::string read_string(Deserializer& d) {
+    const auto size = d.read<uint32_t>();
+    auto string = std::string();
+    if (d.can_read(size)) {
+      string.resize(size);
+      d.read(string.data(), size);
+    }
+    return string;
+  }
+
+  KeySequence read_key_sequence(Deserializer& d) {
+    auto sequence = KeySequence();
+    const auto size = d.read<uint32_t>();
+    if (d.can_read(size * sizeof(KeyEvent))) {
+      sequence.resize(size);
+      d.read(sequence.data(), size * sizeof(KeyEvent));
+    }
+    return sequence;
+  }
+
+  Filter read_filter(Deserializer& d) {
+    auto filter = Filter{ };
+    filter.string = read_string(d);
+    d.read(&filter.invert);
+    if (is_regex(filter.string))
+      filter.regex = parse_regex(filter.string);
+    return filter;
+  }
+
+  Config read_config(Deserializer& d) {
+    auto config = Config{ };
+    config.contexts.resize(read_count(d));
+    for (auto& context : config.contexts) {
+      context.window_class_filter = read_filter(d);
+      context.window_title_filter = read_filter(d);
+      context.window_path_filter = read_filter(d);
+      context.device_filter = read_filter(d);
+      context.device_id_filter = read_filter(d);
+      context.modifier_filter = read_key_sequence(d);
+
+      context.inputs.resize(read_count(d));
+      for (auto& input : context.inputs) {
+        input.input = read_key_sequence(d);
+        input.output_index = d.read<int32_t>();
+        input.line_no = d.read<int32_t>();
+      }
+
+      context.outputs.resize(read_count(d));
+      for (auto& output : context.outputs)
+        output = read_key_sequence(d);
+
+      context.command_outputs.resize(read_count(d));
+      for (auto& command : context.command_outputs) {
+        command.output = read_key_sequence(d);
+        command.index = d.read<int32_t>();
+      }
+
+      d.read(&context.system_filter_matched);
+      d.read(&context.invert_modifier_filter);
+      d.read(&context.fallthrough);
+      d.read(&context.begin_stage);
+    }
+
+    config.actions.resize(read_count(d));
+    for (auto& action : config.actions)
+      action.terminal_command = read_string(d);
+
+    config.virtual_key_aliases.resize(read_count(d));
+    for (auto& [name, key] : config.virtual_key_aliases) {
+      name = read_string(d);
+      key = d.read<Key>();
+    }
+
+    config.grab_device_filters.resize(read_count(d));
+    for (auto& filter : config.grab_device_filters) {
+      static_cast<Filter&>(filter) = read_filter(d);
+      d.read(&filter.by_id);
+    }
+
+    config.server_directives.resize(read_count(d));
+    for (auto& directive : config.server_directives)
+      directive = read_string(d);
+    config.title_update_interval_ms = d.read<int32_t>();
+
+    auto logical_keys = std::vector<LogicalKeys::Definition>(read_count(d));
+    for (auto& [logical, left, right] : logical_keys) {
+      logical = d.read<Key>();
+      left = d.read<Key>();
+      right = d.read<Key>();
+    }
+    config.logical_keys = LogicalKeys(std::move(logical_keys));
+
+    config.forward_modifiers.resize(read_count(d));
+    for (auto& key : config.forward_modifiers)
+      key = d.read<Key>();
+
+    return config;
+  }
+} // namespace
+
+uint64_t get_layout_hash() {
+  // hash of the keys the printable characters are typed with
+  auto characters = std::string();
+  for (auto c = ' '; c <= '~'; ++c)
+    characters.push_back(c);
+
+  auto hash = get_hash(nullptr, 0);
+  StringTyper().type(characters,
+    [&](Key key, StringTyper::Modifiers modifiers) {
+      hash = get_hash(&key, sizeof(key), hash);
+      hash = get_hash(&modifiers, sizeof(modifiers), hash);
+    });
+  return hash;
+}
+
+std::optional<Config> read_config_cache(const std::filesystem::path& filename,
+    std::string_view contents, std::vector<std::string>* included_files) try {
+  const auto cache_filename = get_cache_filename(filename);
+  if (cache_filename.empty())
+    return { };
+  auto data = read_file(cache_filename);
+  if (!data)
+    return { };
+  auto d = Deserializer(std::move(*data));
+  if (d.read<uint32_t>() != cache_magic ||
+      read_string(d) != version ||
+      d.read<uint64_t>() != get_hash(contents) ||
+      d.read<uint64_t>() != get_layout_hash())
+    return { };
+
+  // check that no included file changed
+  included_files->clear();
+  const auto count = read_count(d);
+  for (auto i = 0u; i < count; ++i) {
+    auto include_filename = read_string(d);
+    const auto hash = d.read<uint64_t>();
+    if (get_file_hash(include_filename) != hash)
+      return { };
+    included_files->push_back(std::move(include_filename));
+  }
+
+  auto config = read_config(d);
+  if (d.read<uint32_t>() != cache_magic || d.can_read(1))
+    return { };
+  return config;
+}
+catch (const std::exception&) {
+  return { };
+}
+
+void write_config_cache(const std::filesystem::path& filename,
+    std::string_view contents, const Config& config,
+    const std::vector<std::string>& included_files) {
+  const auto cache_filename = get_cache_filename(filename);
+  if (cache_filename.empty())
+    return;
+
+  auto s = Serializer();
+  s.write(cache_magic);
+  s.write(version);
+  s.write(get_hash(contents));
+  s.write(get_layout_hash());
+  s.write(static_cast<uint32_t>(included_files.size()));
+  for (const auto& include_filename : included_files) {
+    const auto hash = get_file_hash(include_filename);
+    if (!hash)
+      return;
+    s.write(include_filename);
+    s.write(*hash);
+  }
+  write_config(s, config);
+  s.write(cache_magic);
+
+  // replace at once, so a concurrent read never sees a partial file
+  auto error = std::error_code{ };
+  std::filesystem::create_directories(cache_filename.parent_path(), error);
+  auto temp_filename = cache_filename;
+  temp_filename += ".tmp";
+  auto os = std::ofstream(temp_filename, std::ios::binary);
+  if (!os.write(s.data(), static_cast<std::streamsize>(s.size())))
+    return;
+  os.close();
+  std::filesystem::rename(temp_filename, cache_filename, error);
+}
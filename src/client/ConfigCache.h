@@ -0,0 +1,18 @@
+#pragma once
+
+#include "config/Config.h"
+#include <filesystem>
+#include <optional>
+#include <string_view>
+
+// The parsed configuration is stored in a binary file, which is used
+// as long as the configuration and included files, the keyboard layout
+// and the version did not change.
+std::optional<Config> read_config_cache(const std::filesystem::path& filename,
+  std::string_view contents, std::vector<std::string>* included_files);
+void write_config_cache(const std::filesystem::path& filename,
+  std::string_view contents, const Config& config,
+  const std::vector<std::string>& included_files);
+
+// identifies the keyboard layout, which strings are typed with
+uint64_t get_layout_hash();
@@ -1,65 +1,148 @@
 
 #include "ConfigFile.h"
-#include "config/ParseConfig.h"
+#include "ConfigCache.h"
+#include "config/OptimizeConfig.h"
+#include "config/StringTyper.h"
 #include "common/output.h"
+#include <algorithm>
 #include <cstdio>
 #include <fstream>
-
-#if defined(_WIN32)
-
-#include "common/windows/win.h"
+#include <iterator>
 
 namespace {
-  std::time_t filetime_to_time_t(const FILETIME& ft) {
-    auto ull = ULARGE_INTEGER{ };
-    ull.LowPart = ft.dwLowDateTime;
-    ull.HighPart = ft.dwHighDateTime;
-    return ull.QuadPart / 10000000ULL - 11644473600ULL;
-  }
+  // wait for bursts of changes while saving to settle
+  const auto change_settle_time = std::chrono::milliseconds(100);
 
-  std::time_t get_modify_time(const std::filesystem::path& filename) {
-    auto file_attr_data = WIN32_FILE_ATTRIBUTE_DATA{ };
-    if (!GetFileAttributesExW(filename.c_str(),
-        GetFileExInfoStandard, &file_attr_data))
-      return { };
-    return filetime_to_time_t(file_attr_data.ftLastWriteTime);
-  }
+  const auto pending_read_poll_interval = std::chrono::milliseconds(10);
 } // namespace
 
-#else // !defined(_WIN32)
+std::vector<std::filesystem::path> ConfigFile::get_filenames() const {
+  auto filenames = std::vector<std::filesystem::path>{ m_filename };
+  filenames.insert(filenames.end(),
+    m_included_files.begin(), m_included_files.end());
+  return filenames;
+}
 
-#include <sys/stat.h>
+std::vector<ConfigFile::FileTime> ConfigFile::get_modify_times() const {
+  auto modify_times = std::vector<FileTime>();
+  for (const auto& filename : get_filenames()) {
+    auto error = std::error_code{ };
+    modify_times.push_back(std::filesystem::last_write_time(filename, error));
+  }
+  return modify_times;
+}
 
-namespace {
-  std::time_t get_modify_time(const std::string& filename) {
-    using stat_t = struct stat;
-    auto st = stat_t{ };
-    if (::stat(filename.c_str(), &st) == 0)
-      return st.st_mtime;
-    return { };
+bool ConfigFile::is_modified() {
+  if (m_watcher.is_watching()) {
+    const auto now = Clock::now();
+    if (m_watcher.check_changed())
+      m_change_time = now;
+    if (!m_change_time || now < *m_change_time + change_settle_time)
+      return false;
+    m_change_time.reset();
   }
-} // namespace
+  return (get_modify_times() != m_modify_times);
+}
 
-#endif // !defined(_WIN32)
+#if !defined(_WIN32)
+std::optional<Duration> ConfigFile::get_event_fds(std::vector<int>& fds,
+    Duration poll_interval) const {
+  // until the pending read finished
+  if (m_pending_read.valid())
+    return pending_read_poll_interval;
+  if (!m_watcher.is_watching())
+    return poll_interval;
+  fds.push_back(m_watcher.event_fd());
+  if (m_change_time)
+    return std::max(Duration::zero(), Duration(
+      *m_change_time + change_settle_time - Clock::now()));
+  return { };
+}
+#endif
 
 bool ConfigFile::load(std::filesystem::path filename) {
   m_filename = std::move(filename);
-  m_modify_time = { -1 };
-  return update();
+  m_included_files.clear();
+  m_modify_times.clear();
+  return update(false);
 }
 
 bool ConfigFile::update(bool check_modified) {
-  const auto modify_time = get_modify_time(m_filename);
-  if (check_modified && 
-      modify_time == m_modify_time)
+  if (check_modified && !is_modified())
+    return false;
+
+  // a read in the background is superseded
+  if (m_pending_read.valid())
+    m_pending_read.wait();
+  m_pending_read = { };
+
+  m_modify_times = get_modify_times();
+  prepare_read();
+  return apply(read(m_filename, *m_parse_config));
+}
+
+bool ConfigFile::update_in_background() {
+  if (m_pending_read.valid()) {
+    if (m_pending_read.wait_for(Duration::zero()) !=
+          std::future_status::ready)
+      return false;
+    return apply(m_pending_read.get());
+  }
+
+  if (!is_modified())
     return false;
-  m_modify_time = modify_time;
+
+  m_modify_times = get_modify_times();
+  prepare_read();
+  m_pending_read = std::async(std::launch::async,
+    [filename = m_filename, parse_config = m_parse_config]() {
+      return read(filename, *parse_config);
+    });
+  return false;
+}
+
+void ConfigFile::prepare_read() {
+  // the keyboard layout might have changed since the last read
+  StringTyper::update_layout();
+
+  // the parser's checkpoints depend on the keyboard layout
+  if (const auto layout_hash = get_layout_hash();
+      layout_hash != m_layout_hash) {
+    m_parse_config = std::make_shared<ParseConfig>();
+    m_layout_hash = layout_hash;
+  }
+}
+
+auto ConfigFile::read(const std::filesystem::path& filename,
+    ParseConfig& parse_config) -> std::optional<ReadResult> {
   try {
-    auto is = std::ifstream(m_filename);
+    auto is = std::ifstream(filename, std::ios::ate);
     if (is.good()) {
-      auto parse = ParseConfig();
-      m_config = parse(is, m_filename.parent_path());
-      return true;
+      // read at once, newlines might still be translated
+      auto contents = std::string(static_cast<size_t>(is.tellg()), '\0');
+      is.seekg(0);
+      is.read(contents.data(), static_cast<std::streamsize>(contents.size()));
+      contents.resize(static_cast<size_t>(is.gcount()));
+
+      // use cached configuration while nothing changed
+      auto result = ReadResult{ };
+      if (auto config = read_config_cache(filename, contents,
+            &result.included_files)) {
+        verbose("Using cached configuration");
+        result.config = std::move(*config);
+      }
+      else {
+        result.config = parse_config(contents, filename.parent_path());
+        result.included_files = parse_config.included_files();
+
+        const auto optimized = optimize_config(result.config);
+        if (optimized.merged_contexts || optimized.removed_mappings)
+          verbose("Merged %d contexts and removed %d shadowed mappings",
+            optimized.merged_contexts, optimized.removed_mappings);
+        write_config_cache(filename, contents, result.config,
+          result.included_files);
+      }
+      return result;
     }
     else {
       error("Opening configuration file failed");
@@ -68,5 +151,20 @@ bool ConfigFile::update(bool check_modified) {
   catch (const std::exception& ex) {
     error("%s", ex.what());
   }
-  return false;
+  return { };
+}
+
+bool ConfigFile::apply(std::optional<ReadResult> result) {
+  // a failed read keeps the current configuration
+  if (result) {
+    m_config = std::move(result->config);
+
+    // also watch files, which were included since
+    if (result->included_files != m_included_files) {
+      m_included_files = std::move(result->included_files);
+      m_modify_times = get_modify_times();
+    }
+  }
+  m_watcher.watch(get_filenames());
+  return result.has_value();
 }
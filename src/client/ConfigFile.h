@@ -1,20 +1,58 @@
 #pragma once
 
 #include "config/Config.h"
-#include <ctime>
+#include "config/ParseConfig.h"
+#include "client/FileWatcher.h"
+#include "common/Duration.h"
+#include <optional>
 #include <string>
 #include <filesystem>
+#include <future>
+#include <memory>
 
 class ConfigFile {
 public:
   bool load(std::filesystem::path filename);
   bool update(bool check_modified = true);
+  // reads the modified file on a worker thread, while the current
+  // configuration is kept. Returns true when the new one was applied
+  bool update_in_background();
   const Config& config() const { return m_config; }
   const std::filesystem::path& filename() const { return m_filename; }
   explicit operator bool() const { return !m_filename.empty(); }
+#if !defined(_WIN32)
+  // adds the file descriptor, which is readable when a file might have
+  // changed, returns the time after which update needs to be called anyway
+  std::optional<Duration> get_event_fds(std::vector<int>& fds,
+    Duration poll_interval) const;
+#endif
 
 private:
+  using FileTime = std::filesystem::file_time_type;
+
+  struct ReadResult {
+    Config config;
+    std::vector<std::string> included_files;
+  };
+
+  static std::optional<ReadResult> read(
+    const std::filesystem::path& filename, ParseConfig& parse_config);
+  std::vector<std::filesystem::path> get_filenames() const;
+  std::vector<FileTime> get_modify_times() const;
+  bool is_modified();
+  void prepare_read();
+  bool apply(std::optional<ReadResult> result);
+
   std::filesystem::path m_filename;
-  std::time_t m_modify_time{ -1 };
+  std::vector<std::string> m_included_files;
+  std::vector<FileTime> m_modify_times;
+  FileWatcher m_watcher;
+  std::optional<Clock::time_point> m_change_time;
+  // kept to only re-parse the changed include files, shared with
+  // the pending read
+  std::shared_ptr<ParseConfig> m_parse_config{
+    std::make_shared<ParseConfig>() };
+  std::future<std::optional<ReadResult>> m_pending_read;
+  uint64_t m_layout_hash{ };
   Config m_config;
 };
@@ -4,6 +4,19 @@
 #include <algorithm>
 #include <utility>
 
+namespace {
+  // a subscriber which does not read is disconnected
+  const auto max_send_queue_size = size_t{ 256 * 1024 };
+
+  void write_active_contexts(Serializer& s,
+      const std::vector<int>& active_contexts) {
+    s.write(MessageType::active_contexts_changed);
+    s.write(static_cast<uint32_t>(active_contexts.size()));
+    for (auto index : active_contexts)
+      s.write(static_cast<int32_t>(index));
+  }
+} // namespace
+
 ControlPort::ControlPort() 
   : m_host("keymapperctl") {
 }
@@ -12,6 +25,7 @@ void ControlPort::reset() {
   m_host.shutdown();
   m_virtual_keys_down = { };
   m_virtual_key_aliases = { };
+  m_active_contexts = { };
   m_controls.clear();
 }
 
@@ -39,9 +53,72 @@ void ControlPort::on_virtual_key_state_changed(Key key, KeyState state) {
   if (is_virtual_key(key)) {
     m_virtual_keys_down[*key - *Key::first_virtual] = (state == KeyState::Down);
     send_virtual_key_toggle_notification(key);
+
+    const auto name = get_virtual_key_name(key);
+    send_subscribers([&](Serializer& s) {
+      s.write(MessageType::virtual_key_changed);
+      s.write(name);
+      s.write(get_virtual_key_state(key));
+    });
   }
 }
 
+void ControlPort::on_active_contexts_changed(
+    const std::vector<int>& active_contexts) {
+  if (active_contexts == m_active_contexts)
+    return;
+  m_active_contexts = active_contexts;
+  send_subscribers([&](Serializer& s) {
+    write_active_contexts(s, m_active_contexts);
+  });
+}
+
+// failing subscribers are disconnected by read_messages
+template<typename F>
+void ControlPort::send_subscribers(F&& write_message) {
+  for (auto& [socket, control] : m_controls)
+    if (control.subscribed) {
+      control.connection.queue_message(control.send_queue, write_message);
+      flush_send_queue(control);
+    }
+}
+
+bool ControlPort::flush_send_queue(Control& control) {
+  return (control.connection.send_queued(control.send_queue) &&
+    control.send_queue.size() <= max_send_queue_size);
+}
+
+// replies to subscribers are queued, so they are not mixed with pending events
+template<typename F>
+bool ControlPort::send_message(Connection& connection, F&& write_message) {
+  auto control = get_control(connection);
+  if (!control || !control->subscribed)
+    return connection.send_message(write_message);
+  connection.queue_message(control->send_queue, write_message);
+  return flush_send_queue(*control);
+}
+
+void ControlPort::on_subscribe(Connection& connection) {
+  auto control = get_control(connection);
+  if (!control)
+    return;
+  control->subscribed = true;
+
+  // start with the current state
+  for (auto key = *Key::first_virtual; key < *Key::last_virtual; ++key)
+    if (m_virtual_keys_down[key - *Key::first_virtual]) {
+      const auto name = get_virtual_key_name(static_cast<Key>(key));
+      send_message(connection, [&](Serializer& s) {
+        s.write(MessageType::virtual_key_changed);
+        s.write(name);
+        s.write(KeyState::Down);
+      });
+    }
+  send_message(connection, [&](Serializer& s) {
+    write_active_contexts(s, m_active_contexts);
+  });
+}
+
 void ControlPort::send_virtual_key_toggle_notification(Key key) {
   for (auto& [socket, control] : m_controls)
     if (control.requested_virtual_key_toggle_notification == key) {
@@ -67,6 +144,15 @@ Key ControlPort::get_virtual_key(const std::string_view name) const {
   return (is_virtual_key(key) ? key : Key::none);
 }
 
+std::string ControlPort::get_virtual_key_name(Key key) const {
+  const auto& aliases = m_virtual_key_aliases;
+  const auto it = std::find_if(aliases.begin(), aliases.end(),
+    [&](const auto& pair) { return pair.second == key; });
+  if (it != aliases.end())
+    return it->first;
+  return "Virtual" + std::to_string(*key - *Key::first_virtual);
+}
+
 KeyState ControlPort::get_virtual_key_state(Key key) const {
   if (is_virtual_key(key))
     return (m_virtual_keys_down[*key - *Key::first_virtual] ? 
@@ -75,7 +161,7 @@ KeyState ControlPort::get_virtual_key_state(Key key) const {
 }
 
 bool ControlPort::send_virtual_key_state(Connection& connection, Key key, KeyState state) {
-  return connection.send_message([&](Serializer& s) {
+  return send_message(connection, [&](Serializer& s) {
     s.write(MessageType::virtual_key_state);
     s.write(key);
     s.write(state);
@@ -121,7 +207,8 @@ void ControlPort::disconnect_by_instance_id(const std::string& id) {
 
 void ControlPort::read_messages(MessageHandler& handler) {
   for (auto it = m_controls.begin(); it != m_controls.end(); ) {
-    if (!read_messages(it->second.connection, handler)) {
+    if (!flush_send_queue(it->second) ||
+        !read_messages(it->second.connection, handler)) {
       it = m_controls.erase(it);
     }
     else {
@@ -130,6 +217,20 @@ void ControlPort::read_messages(MessageHandler& handler) {
   }
 }
 
+#if !defined(_WIN32)
+bool ControlPort::get_event_fds(std::vector<int>& fds) const {
+  if (m_host.listen_socket() != invalid_socket)
+    fds.push_back(m_host.listen_socket());
+  auto queued = false;
+  for (const auto& [socket, control] : m_controls) {
+    fds.push_back(socket);
+    if (!control.send_queue.empty())
+      queued = true;
+  }
+  return !queued;
+}
+#endif
+
 void ControlPort::on_next_key_info_requested(Connection& connection) {
   if (auto control = get_control(connection))
     control->requested_next_key_info = true;
@@ -139,7 +240,7 @@ bool ControlPort::reply_next_key_info(const std::string& key_info) {
   auto requested = false;
   for (auto& [socket, control] : m_controls)
     if (std::exchange(control.requested_next_key_info, false)) {
-      control.connection.send_message([&](Serializer& s) {
+      send_message(control.connection, [&](Serializer& s) {
         s.write(MessageType::next_key_info);
         s.write(key_info);
       });
@@ -148,6 +249,15 @@ bool ControlPort::reply_next_key_info(const std::string& key_info) {
   return requested;
 }
 
+void ControlPort::reply_statistics(const std::string& statistics) {
+  for (auto& [socket, control] : m_controls)
+    if (std::exchange(control.requested_statistics, false))
+      send_message(control.connection, [&](Serializer& s) {
+        s.write(MessageType::statistics);
+        s.write(statistics);
+      });
+}
+
 bool ControlPort::read_messages(Connection& connection, 
     MessageHandler& handler) {
   return connection.read_messages(Duration::zero(), 
@@ -165,6 +275,20 @@ bool ControlPort::read_messages(Connection& connection,
           send_virtual_key_state(connection, key);
           break;
         }
+        case MessageType::set_virtual_key_states: {
+          // only applied when all keys were found
+          auto keys = std::vector<Key>(d.read<uint32_t>());
+          for (auto& key : keys)
+            key = get_virtual_key(d.read_string());
+          const auto state = d.read<KeyState>();
+          const auto found = std::find(keys.begin(), keys.end(),
+            Key::none) == keys.end();
+          if (found)
+            handler.on_set_virtual_key_states_message(keys, state);
+          send_virtual_key_state(connection, Key::none,
+            (found ? KeyState::Down : KeyState::Not));
+          break;
+        }
         case MessageType::request_virtual_key_toggle_notification: {
           on_virtual_key_toggle_notification_requested(connection,
             get_virtual_key(d.read_string()));
@@ -198,6 +322,22 @@ bool ControlPort::read_messages(Connection& connection,
             (result ? KeyState::Down : KeyState::Up));
           break;
         }
+        case MessageType::subscribe: {
+          on_subscribe(connection);
+          break;
+        }
+        case MessageType::statistics: {
+          if (auto control = get_control(connection))
+            control->requested_statistics = true;
+          handler.on_statistics_requested_message(d.read<bool>());
+          break;
+        }
+        case MessageType::input_profile: {
+          if (auto control = get_control(connection))
+            control->requested_statistics = true;
+          handler.on_profile_report_requested_message();
+          break;
+        }
         default: 
           break;
       }
@@ -17,16 +17,28 @@ public:
   std::optional<Socket> accept();
   void set_virtual_key_aliases(std::vector<std::pair<std::string, Key>> aliases);
   void on_virtual_key_state_changed(Key key, KeyState state);
+  void on_active_contexts_changed(const std::vector<int>& active_contexts);
   bool reply_next_key_info(const std::string& key_info);
+  // also replies the profile report
+  void reply_statistics(const std::string& statistics);
 
   struct MessageHandler {
     virtual void on_set_virtual_key_state_message(Key key, KeyState state) = 0;
+    virtual void on_set_virtual_key_states_message(
+      const std::vector<Key>& keys, KeyState state) = 0;
     virtual bool on_set_config_file_message(std::string filename) = 0;
     virtual void on_next_key_info_requested_message() = 0;
+    virtual void on_statistics_requested_message(bool recent_events) = 0;
+    virtual void on_profile_report_requested_message() = 0;
     virtual bool on_inject_input_message(const std::string& string) = 0;
     virtual bool on_inject_output_message(const std::string& string) = 0;
   };
   void read_messages(MessageHandler& handler);
+#if !defined(_WIN32)
+  // adds the listening and connected sockets,
+  // returns false while messages are queued for sending
+  bool get_event_fds(std::vector<int>& fds) const;
+#endif
 
 private:
   struct Control {
@@ -34,12 +46,24 @@ private:
     std::string instance_id;
     Key requested_virtual_key_toggle_notification{ };
     bool requested_next_key_info{ };
+    bool requested_statistics{ };
+    // subscribers are sent all changes through a queue,
+    // so a slow reader does not block
+    bool subscribed{ };
+    std::vector<char> send_queue;
   };
 
   Control* get_control(const Connection& connection);
   Key get_virtual_key(const std::string_view name) const;
+  std::string get_virtual_key_name(Key key) const;
   KeyState get_virtual_key_state(Key key) const;
   bool read_messages(Connection& connection, MessageHandler& handler);
+  template<typename F>
+  bool send_message(Connection& connection, F&& write_message);
+  bool flush_send_queue(Control& control);
+  template<typename F>
+  void send_subscribers(F&& write_message);
+  void on_subscribe(Connection& connection);
   bool send_virtual_key_state(Connection& connection, Key key);
   bool send_virtual_key_state(Connection& connection, Key key, KeyState state);
   void send_virtual_key_toggle_notification(Key key);
@@ -52,5 +76,6 @@ private:
   Host m_host;
   std::array<bool, *Key::last_virtual - *Key::first_virtual> m_virtual_keys_down{ };
   std::vector<std::pair<std::string, Key>> m_virtual_key_aliases;
+  std::vector<int> m_active_contexts;
   std::map<Socket, Control> m_controls;
 };
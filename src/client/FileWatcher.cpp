@@ -0,0 +1,259 @@
+
+#include "FileWatcher.h"
+#include <algorithm>
+
+#if defined(_WIN32)
+
+#include "common/windows/win.h"
+
+namespace {
+  std::vector<std::filesystem::path> get_directories(
+      const std::vector<std::filesystem::path>& filenames) {
+    auto directories = std::vector<std::filesystem::path>();
+    for (const auto& filename : filenames) {
+      auto directory = filename.parent_path();
+      if (directory.empty())
+        directory = ".";
+      if (std::find(directories.begin(), directories.end(),
+            directory) == directories.end())
+        directories.push_back(std::move(directory));
+    }
+    return directories;
+  }
+} // namespace
+
+class FileWatcherImpl {
+private:
+  std::vector<HANDLE> m_handles;
+
+public:
+  ~FileWatcherImpl() {
+    reset();
+  }
+
+  void reset() {
+    for (auto handle : m_handles)
+      FindCloseChangeNotification(handle);
+    m_handles.clear();
+  }
+
+  bool watch(const std::vector<std::filesystem::path>& filenames) {
+    reset();
+    for (const auto& directory : get_directories(filenames)) {
+      const auto handle = FindFirstChangeNotificationW(directory.c_str(),
+        FALSE, FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_LAST_WRITE);
+      if (handle == INVALID_HANDLE_VALUE) {
+        reset();
+        return false;
+      }
+      m_handles.push_back(handle);
+    }
+    return true;
+  }
+
+  bool is_watching() const {
+    return !m_handles.empty();
+  }
+
+  bool check_changed() {
+    auto changed = false;
+    for (auto handle : m_handles)
+      if (WaitForSingleObject(handle, 0) == WAIT_OBJECT_0) {
+        FindNextChangeNotification(handle);
+        changed = true;
+      }
+    return changed;
+  }
+};
+
+#elif defined(__linux__)
+
+#include <unistd.h>
+#include <sys/inotify.h>
+
+class FileWatcherImpl {
+private:
+  int m_fd{ -1 };
+  std::vector<int> m_watch_descriptors;
+  std::vector<std::string> m_filenames;
+
+public:
+  ~FileWatcherImpl() {
+    reset();
+  }
+
+  void reset() {
+    if (m_fd >= 0)
+      ::close(m_fd);
+    m_fd = -1;
+    m_watch_descriptors.clear();
+    m_filenames.clear();
+  }
+
+  bool watch(const std::vector<std::filesystem::path>& filenames) {
+    reset();
+    m_fd = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (m_fd < 0)
+      return false;
+
+    // editors often replace files, so their directories are watched
+    const auto mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE |
+      IN_DELETE | IN_MODIFY | IN_ATTRIB;
+    for (const auto& filename : filenames) {
+      auto directory = filename.parent_path();
+      if (directory.empty())
+        directory = ".";
+      // adding a directory twice returns the same descriptor
+      const auto wd = ::inotify_add_watch(m_fd, directory.c_str(), mask);
+      if (wd < 0) {
+        reset();
+        return false;
+      }
+      m_watch_descriptors.push_back(wd);
+      m_filenames.push_back(filename.filename().string());
+    }
+    return true;
+  }
+
+  bool is_watching() const {
+    return (m_fd >= 0);
+  }
+
+  int event_fd() const {
+    return m_fd;
+  }
+
+  bool check_changed() {
+    if (m_fd < 0)
+      return false;
+
+    alignas(inotify_event) char buffer[4096];
+    auto changed = false;
+    for (;;) {
+      const auto size = ::read(m_fd, buffer, sizeof(buffer));
+      if (size <= 0)
+        break;
+      for (auto offset = ssize_t{ }; offset < size; ) {
+        const auto& event = *reinterpret_cast<const inotify_event*>(
+          buffer + offset);
+        if (event.mask & IN_Q_OVERFLOW)
+          changed = true;
+        else if (event.len)
+          for (auto i = 0u; i < m_filenames.size(); ++i)
+            if (m_watch_descriptors[i] == event.wd &&
+                m_filenames[i] == event.name)
+              changed = true;
+        offset += static_cast<ssize_t>(sizeof(inotify_event) + event.len);
+      }
+    }
+    return changed;
+  }
+};
+
+#else // !defined(__linux__)
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/event.h>
+
+class FileWatcherImpl {
+private:
+  int m_kqueue{ -1 };
+  std::vector<int> m_fds;
+
+public:
+  ~FileWatcherImpl() {
+    reset();
+  }
+
+  void reset() {
+    for (auto fd : m_fds)
+      ::close(fd);
+    m_fds.clear();
+    if (m_kqueue >= 0)
+      ::close(m_kqueue);
+    m_kqueue = -1;
+  }
+
+  bool watch(const std::vector<std::filesystem::path>& filenames) {
+    reset();
+    m_kqueue = ::kqueue();
+    if (m_kqueue < 0)
+      return false;
+
+    // watch the files and their directories, which are written
+    // to when the files are replaced
+    auto paths = std::vector<std::filesystem::path>();
+    for (const auto& filename : filenames) {
+      auto directory = filename.parent_path();
+      if (directory.empty())
+        directory = ".";
+      if (std::find(paths.begin(), paths.end(), directory) == paths.end())
+        paths.push_back(std::move(directory));
+      paths.push_back(filename);
+    }
+    for (const auto& path : paths) {
+      const auto fd = ::open(path.c_str(), O_EVTONLY | O_CLOEXEC);
+      if (fd < 0)
+        continue;
+      m_fds.push_back(fd);
+      using kevent_t = struct kevent;
+      auto change = kevent_t{ };
+      EV_SET(&change, fd, EVFILT_VNODE, EV_ADD | EV_CLEAR,
+        NOTE_WRITE | NOTE_EXTEND | NOTE_DELETE | NOTE_RENAME |
+        NOTE_ATTRIB, 0, nullptr);
+      if (::kevent(m_kqueue, &change, 1, nullptr, 0, nullptr) < 0) {
+        reset();
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool is_watching() const {
+    return (m_kqueue >= 0);
+  }
+
+  int event_fd() const {
+    return m_kqueue;
+  }
+
+  bool check_changed() {
+    if (m_kqueue < 0)
+      return false;
+
+    using kevent_t = struct kevent;
+    kevent_t events[16];
+    const auto timeout = timespec{ };
+    const auto count = ::kevent(m_kqueue, nullptr, 0,
+      events, 16, &timeout);
+    return (count > 0);
+  }
+};
+
+#endif
+
+FileWatcher::FileWatcher()
+  : m_impl(std::make_unique<FileWatcherImpl>()) {
+}
+FileWatcher::FileWatcher(FileWatcher&& rhs) noexcept = default;
+FileWatcher& FileWatcher::operator=(FileWatcher&& rhs) noexcept = default;
+FileWatcher::~FileWatcher() = default;
+
+bool FileWatcher::watch(const std::vector<std::filesystem::path>& filenames) {
+  return (m_impl && m_impl->watch(filenames));
+}
+
+bool FileWatcher::is_watching() const {
+  return (m_impl && m_impl->is_watching());
+}
+
+bool FileWatcher::check_changed() {
+  return (m_impl && m_impl->check_changed());
+}
+
+#if !defined(_WIN32)
+int FileWatcher::event_fd() const {
+  return (m_impl ? m_impl->event_fd() : -1);
+}
+#endif
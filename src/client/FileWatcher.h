@@ -0,0 +1,29 @@
+#pragma once
+
+#include <filesystem>
+#include <memory>
+#include <vector>
+
+// Gets notified by the system when files in the directories of the
+// watched files change. It can report changes of other files in these
+// directories, so the files themselves still need to be checked.
+class FileWatcher {
+public:
+  FileWatcher();
+  FileWatcher(FileWatcher&& rhs) noexcept;
+  FileWatcher& operator=(FileWatcher&& rhs) noexcept;
+  ~FileWatcher();
+
+  // returns false when watching is not available
+  bool watch(const std::vector<std::filesystem::path>& filenames);
+  bool is_watching() const;
+  // returns true when a file changed since the last call
+  bool check_changed();
+#if !defined(_WIN32)
+  // readable when a file might have changed
+  int event_fd() const;
+#endif
+
+private:
+  std::unique_ptr<class FileWatcherImpl> m_impl;
+};
@@ -0,0 +1,94 @@
+
+#include "FocusLog.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+
+namespace {
+  FILE* open_file(const std::filesystem::path& filename, bool write) {
+#if defined(_WIN32)
+    return ::_wfopen(filename.c_str(), write ? L"wb" : L"rb");
+#else
+    return std::fopen(filename.c_str(), write ? "wb" : "rb");
+#endif
+  }
+
+  // separators within the attributes are replaced
+  void append_field(std::string& line, const std::string& field) {
+    line.push_back('\t');
+    for (auto c : field)
+      line.push_back(c == '\t' || c == '\n' || c == '\r' ? ' ' : c);
+  }
+
+  bool read_line(FILE* file, std::string& line) {
+    line.clear();
+    for (;;) {
+      const auto c = std::fgetc(file);
+      if (c == EOF)
+        return !line.empty();
+      if (c == '\n')
+        return true;
+      line.push_back(static_cast<char>(c));
+    }
+  }
+} // namespace
+
+FocusLogWriter::~FocusLogWriter() {
+  if (m_file)
+    std::fclose(m_file);
+}
+
+bool FocusLogWriter::open(const std::filesystem::path& filename,
+    Clock::time_point start) {
+  m_file = open_file(filename, true);
+  m_start = start;
+  return (m_file != nullptr);
+}
+
+void FocusLogWriter::write(const std::string& window_class,
+    const std::string& window_title, const std::string& window_path,
+    Clock::time_point time) {
+  if (!m_file)
+    return;
+  const auto elapsed = std::chrono::duration_cast<
+    std::chrono::milliseconds>(std::max(time - m_start, Clock::duration::zero()));
+  m_line = std::to_string(elapsed.count());
+  append_field(m_line, window_class);
+  append_field(m_line, window_title);
+  append_field(m_line, window_path);
+  m_line.push_back('\n');
+  // focus changes are rare, so each is written at once
+  std::fwrite(m_line.data(), 1, m_line.size(), m_file);
+  std::fflush(m_file);
+}
+
+FocusLogReader::~FocusLogReader() {
+  if (m_file)
+    std::fclose(m_file);
+}
+
+bool FocusLogReader::open(const std::filesystem::path& filename) {
+  m_file = open_file(filename, false);
+  return (m_file != nullptr);
+}
+
+bool FocusLogReader::read(FocusLogRecord& record) {
+  if (!m_file || !read_line(m_file, m_line))
+    return false;
+
+  std::string* const fields[] = { &record.window_class,
+    &record.window_title, &record.window_path };
+  auto tab = m_line.find('\t');
+  if (tab == std::string::npos)
+    return false;
+  record.time = std::strtoull(m_line.c_str(), nullptr, 10);
+  for (auto field : fields) {
+    const auto begin = tab + 1;
+    tab = m_line.find('\t', begin);
+    if (tab == std::string::npos && field != fields[2])
+      return false;
+    field->assign(m_line, begin, tab == std::string::npos ?
+      std::string::npos : tab - begin);
+  }
+  return true;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "common/Duration.h"
+#include <cstdio>
+#include <filesystem>
+#include <string>
+
+// A text recording of the focused window's attributes, which
+// keymapper_bench replays against the contexts of a configuration.
+// Each line contains the milliseconds since the recording started and
+// the class, title and path, separated by tabs.
+struct FocusLogRecord {
+  uint64_t time;
+  std::string window_class;
+  std::string window_title;
+  std::string window_path;
+};
+
+class FocusLogWriter {
+public:
+  FocusLogWriter() = default;
+  FocusLogWriter(const FocusLogWriter&) = delete;
+  FocusLogWriter& operator=(const FocusLogWriter&) = delete;
+  ~FocusLogWriter();
+
+  bool open(const std::filesystem::path& filename, Clock::time_point start);
+  void write(const std::string& window_class, const std::string& window_title,
+    const std::string& window_path, Clock::time_point time);
+
+private:
+  FILE* m_file{ };
+  Clock::time_point m_start;
+  std::string m_line;
+};
+
+class FocusLogReader {
+public:
+  FocusLogReader() = default;
+  FocusLogReader(const FocusLogReader&) = delete;
+  FocusLogReader& operator=(const FocusLogReader&) = delete;
+  ~FocusLogReader();
+
+  bool open(const std::filesystem::path& filename);
+  // returns false at the end of the log
+  bool read(FocusLogRecord& record);
+
+private:
+  FILE* m_file{ };
+  std::string m_line;
+};
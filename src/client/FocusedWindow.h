@@ -2,9 +2,18 @@
 
 #include <memory>
 #include <string>
+#include <vector>
 
 class FocusedWindow {
 public:
+  enum Attribute {
+    Class = (1 << 0),
+    Title = (1 << 1),
+    Path  = (1 << 2),
+    All   = (Class | Title | Path),
+  };
+  using Attributes = int;
+
   FocusedWindow();
   FocusedWindow(FocusedWindow&& rhs) noexcept;
   FocusedWindow& operator=(FocusedWindow&& rhs) noexcept;
@@ -12,11 +21,18 @@ public:
 
   bool initialize();
   void shutdown();
+  // only the set attributes are queried and compared
+  void set_attributes(Attributes attributes);
   bool update();
   const std::string& window_class() const;
   const std::string& window_title() const;
   const std::string& window_path() const;
   bool is_inaccessible() const;
+#if !defined(_WIN32)
+  // adds the file descriptors, which are readable when the focused window
+  // might have changed, returns false when it also needs to be polled
+  bool get_event_fds(std::vector<int>& fds) const;
+#endif
 
 private:
   std::unique_ptr<class FocusedWindowImpl> m_impl;
@@ -0,0 +1,118 @@
+
+#include "LocalServerPort.h"
+#include "config/build_multi_stage.h"
+
+LocalServerPort::LocalServerPort(LocalChannelPtr channel)
+  : m_channel(std::move(channel)) {
+}
+
+bool LocalServerPort::connected() const {
+  return m_channel->connected.load(std::memory_order_acquire);
+}
+
+template<typename F>
+bool LocalServerPort::send(F&& message) {
+  if (!connected())
+    return false;
+  // the queue records the calls as messages
+  message(static_cast<IClientPort::MessageHandler&>(m_channel->to_server));
+  m_channel->wake_server();
+  return true;
+}
+
+bool LocalServerPort::connect() {
+  // otherwise the server could take it for the previous connection
+  if (m_channel->accepted.load(std::memory_order_acquire))
+    return false;
+  m_channel->connected.store(true, std::memory_order_release);
+  m_channel->wake_connect();
+  return true;
+}
+
+void LocalServerPort::disconnect() {
+  m_channel->connected.store(false, std::memory_order_release);
+  m_channel->wake_server();
+
+  // the messages of the connection are not handled anymore
+  auto message = LocalChannel::ClientMessage{ };
+  while (m_channel->to_client.pop(message))
+    ;
+  drain_local_channel(m_channel->client_fd());
+}
+
+bool LocalServerPort::send_config(const Config& config) {
+  return send([&](IClientPort::MessageHandler& server) {
+    server.on_grab_device_filters_message(config.grab_device_filters);
+    server.on_configuration_message(build_multi_stage(config));
+    server.on_directives_message(config.server_directives);
+  });
+}
+
+bool LocalServerPort::send_active_contexts(const std::vector<int>& indices,
+    const ContextSwitchTimes& times) {
+  return send([&](IClientPort::MessageHandler& server) {
+    server.on_active_contexts_message(indices, times);
+  });
+}
+
+bool LocalServerPort::send_validate_state() {
+  return send([&](IClientPort::MessageHandler& server) {
+    server.on_validate_state_message();
+  });
+}
+
+bool LocalServerPort::send_set_virtual_key_state(Key key, KeyState state) {
+  return send([&](IClientPort::MessageHandler& server) {
+    server.on_set_virtual_key_state_message(key, state);
+  });
+}
+
+bool LocalServerPort::send_set_virtual_key_states(
+    const std::vector<Key>& keys, KeyState state) {
+  return send([&](IClientPort::MessageHandler& server) {
+    server.on_set_virtual_key_states_message(keys, state);
+  });
+}
+
+bool LocalServerPort::send_request_next_key_info() {
+  return send([&](IClientPort::MessageHandler& server) {
+    server.on_request_next_key_info_message();
+  });
+}
+
+bool LocalServerPort::send_inject_input(const KeySequence& sequence) {
+  return send([&](IClientPort::MessageHandler& server) {
+    server.on_inject_input_message(sequence);
+  });
+}
+
+bool LocalServerPort::send_inject_output(const KeySequence& sequence) {
+  return send([&](IClientPort::MessageHandler& server) {
+    server.on_inject_output_message(sequence);
+  });
+}
+
+bool LocalServerPort::send_request_statistics(bool recent_events) {
+  return send([&](IClientPort::MessageHandler& server) {
+    server.on_request_statistics_message(recent_events);
+  });
+}
+
+bool LocalServerPort::send_request_input_profiles() {
+  return send([&](IClientPort::MessageHandler& server) {
+    server.on_request_input_profiles_message();
+  });
+}
+
+bool LocalServerPort::read_messages(MessageHandler& handler,
+    std::optional<Duration> timeout) {
+  if (m_channel->to_client.empty() && connected() &&
+      timeout != Duration::zero())
+    wait_for_local_channel(m_channel->client_fd(), timeout);
+  drain_local_channel(m_channel->client_fd());
+
+  auto message = LocalChannel::ClientMessage{ };
+  while (m_channel->to_client.pop(message))
+    message(handler);
+  return connected();
+}
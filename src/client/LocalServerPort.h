@@ -0,0 +1,36 @@
+#pragma once
+
+#include "server/LocalClientPort.h"
+
+// The counterpart of LocalClientPort, the stages are built from the
+// configuration directly, instead of being serialized
+class LocalServerPort : public IServerPort {
+public:
+  explicit LocalServerPort(LocalChannelPtr channel);
+  Socket socket() const override { return m_channel->client_fd(); }
+  bool connect() override;
+  void disconnect() override;
+  bool send_config(const Config& config) override;
+  // there is nothing to prepare, send_config builds the stages at once
+  void prepare_reconnect(const Config&) override { }
+  bool send_active_contexts(const std::vector<int>& indices,
+    const ContextSwitchTimes& times) override;
+  bool send_validate_state() override;
+  bool send_set_virtual_key_state(Key key, KeyState state) override;
+  bool send_set_virtual_key_states(const std::vector<Key>& keys,
+    KeyState state) override;
+  bool send_request_next_key_info() override;
+  bool send_inject_input(const KeySequence& sequence) override;
+  bool send_inject_output(const KeySequence& sequence) override;
+  bool send_request_statistics(bool recent_events) override;
+  bool send_request_input_profiles() override;
+  bool read_messages(MessageHandler& handler,
+    std::optional<Duration> timeout) override;
+
+private:
+  bool connected() const;
+  template<typename F> // void(IClientPort::MessageHandler&)
+  bool send(F&& message);
+
+  LocalChannelPtr m_channel;
+};
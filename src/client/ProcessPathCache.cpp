@@ -0,0 +1,121 @@
+
+#include "ProcessPathCache.h"
+#include <algorithm>
+#include <array>
+
+#if defined(_WIN32)
+# include "common/windows/win.h"
+#elif defined(__APPLE__)
+# include <libproc.h>
+#else
+# include <cstdio>
+# include <cstdlib>
+# include <cstring>
+#endif
+
+namespace {
+#if defined(_WIN32)
+  struct Process {
+    HANDLE handle;
+    explicit Process(int pid)
+      : handle(OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION,
+          FALSE, static_cast<DWORD>(pid))) {
+    }
+    ~Process() {
+      if (handle)
+        CloseHandle(handle);
+    }
+  };
+
+  uint64_t get_process_start_time(int pid) {
+    const auto process = Process(pid);
+    auto creation_time = FILETIME{ };
+    auto exit_time = FILETIME{ };
+    auto kernel_time = FILETIME{ };
+    auto user_time = FILETIME{ };
+    if (!process.handle ||
+        !GetProcessTimes(process.handle, &creation_time,
+          &exit_time, &kernel_time, &user_time))
+      return 0;
+    return (static_cast<uint64_t>(creation_time.dwHighDateTime) << 32) |
+      creation_time.dwLowDateTime;
+  }
+
+  std::string get_process_path(int pid) {
+    const auto process = Process(pid);
+    auto buffer = std::array<wchar_t, 1024>();
+    auto size = static_cast<DWORD>(buffer.size());
+    if (!process.handle ||
+        !QueryFullProcessImageNameW(process.handle, 0, buffer.data(), &size))
+      return { };
+    return wide_to_utf8(buffer.data());
+  }
+
+#elif defined(__APPLE__)
+  uint64_t get_process_start_time(int pid) {
+    auto info = proc_bsdinfo{ };
+    if (proc_pidinfo(pid, PROC_PIDTBSDINFO, 0, &info,
+          sizeof(info)) != sizeof(info))
+      return 0;
+    return info.pbi_start_tvsec * 1000000ull + info.pbi_start_tvusec;
+  }
+
+  std::string get_process_path(int pid) {
+    char buffer[PROC_PIDPATHINFO_MAXSIZE];
+    if (proc_pidpath(pid, buffer, sizeof(buffer)) > 0)
+      return buffer;
+    return { };
+  }
+
+#else
+  uint64_t get_process_start_time(int pid) {
+    char path[32];
+    std::snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    const auto file = std::fopen(path, "r");
+    if (!file)
+      return 0;
+    auto buffer = std::array<char, 1024>();
+    const auto size = std::fread(buffer.data(), 1, buffer.size() - 1, file);
+    std::fclose(file);
+    buffer[size] = '\0';
+
+    // the start time is the 22nd field, counting from the
+    // state after the command name, which can contain spaces
+    auto it = std::strrchr(buffer.data(), ')');
+    for (auto i = 0; it && i < 20; ++i)
+      it = std::strchr(it + 1, ' ');
+    return (it ? std::strtoull(it + 1, nullptr, 10) : 0);
+  }
+
+  std::string get_process_path(int pid) {
+    char path[32];
+    std::snprintf(path, sizeof(path), "/proc/%d/exe", pid);
+    const auto resolved = ::realpath(path, nullptr);
+    if (!resolved)
+      return { };
+    auto result = std::string(resolved);
+    ::free(resolved);
+    return result;
+  }
+#endif
+} // namespace
+
+const std::string& ProcessPathCache::get_path(int pid) {
+  static const auto s_empty = std::string();
+  if (pid <= 0)
+    return s_empty;
+
+  const auto start_time = get_process_start_time(pid);
+  const auto it = std::find_if(m_entries.begin(), m_entries.end(),
+    [&](const Entry& entry) { return entry.pid == pid; });
+  if (it != m_entries.end()) {
+    if (it->start_time == start_time && start_time)
+      return it->path;
+    m_entries.erase(it);
+  }
+
+  if (m_entries.size() >= max_entries)
+    m_entries.erase(m_entries.begin());
+  m_entries.push_back({ pid, start_time, get_process_path(pid) });
+  return m_entries.back().path;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Caches the executable paths of processes. Since process ids are reused,
+// an entry is only valid as long as the start time of the process matches.
+class ProcessPathCache {
+public:
+  // the returned reference is valid until the next call
+  const std::string& get_path(int pid);
+
+private:
+  struct Entry {
+    int pid;
+    uint64_t start_time;
+    std::string path;
+  };
+  static constexpr size_t max_entries = 32;
+
+  std::vector<Entry> m_entries;
+};
@@ -1,89 +1,145 @@
 
 #include "ServerPort.h"
+#include "common/CompactSequence.h"
 #include "common/MessageType.h"
+#include <algorithm>
+#include <iterator>
+#include <string_view>
+#include <unordered_map>
+
+#if !defined(_WIN32)
+# include "common/unix/SealedMemory.h"
+# include <unistd.h>
+#endif
 
 namespace {
   void write_key_sequence(Serializer& s, const KeySequence& sequence) {
+    static_assert(std::is_trivially_copyable_v<KeyEvent>);
     s.write(static_cast<uint32_t>(sequence.size()));
-    for (const auto& event : sequence)
-      s.write(event);
+    s.write(sequence.data(), sequence.size() * sizeof(KeyEvent));
+  }
+
+  // estimate of the size written by write_contexts, mostly references
+  size_t get_contexts_size(const std::vector<Config::Context>& contexts) {
+    auto size = sizeof(uint32_t);
+    for (const auto& context : contexts)
+      size += 16 + 4 * (context.inputs.size() + context.outputs.size() +
+        context.command_outputs.size());
+    return size;
   }
-  
+
+  InputProfiles read_input_profiles(Deserializer& d) {
+    static_assert(std::is_trivially_copyable_v<InputProfile>);
+    auto profiles = InputProfiles();
+    const auto count = d.read<uint32_t>();
+    for (auto i = 0u; i < count && d.can_read(sizeof(uint32_t)); ++i) {
+      const auto size = d.read<uint32_t>();
+      if (!d.can_read(size * sizeof(InputProfile)))
+        break;
+      auto& context = profiles.emplace_back(size);
+      d.read(context.data(), size * sizeof(InputProfile));
+    }
+    return profiles;
+  }
+
   void write_filter(Serializer& s, const Filter& filter) {
     s.write(filter.string);
     s.write(filter.invert);
   }
 
-  void write_contexts(Serializer& s, 
-      const std::vector<Config::Context>& contexts) {
-    s.write(static_cast<uint32_t>(contexts.size()));
-    for (const auto& context : contexts) {
-      // begin stage
-      s.write(context.begin_stage);
-
-      // inputs
-      s.write(static_cast<uint32_t>(context.inputs.size()));
-      for (const auto& input : context.inputs) {
-        write_key_sequence(s, input.input);
-        s.write(static_cast<int32_t>(input.output_index));
-      }
+  // sequences and strings are written by write_ref, as table indices
+  template<typename F> // void(Serializer&, const T&)
+  void write_context(Serializer& s, const Config::Context& context,
+      F&& write_ref) {
+    // flags
+    s.write(static_cast<uint8_t>(
+      (context.begin_stage ? 0x01 : 0) |
+      (context.device_filter.invert ? 0x02 : 0) |
+      (context.device_id_filter.invert ? 0x04 : 0) |
+      (context.invert_modifier_filter ? 0x08 : 0) |
+      (context.fallthrough ? 0x10 : 0)));
 
-      // outputs
-      s.write(static_cast<uint32_t>(context.outputs.size()));
-      for (const auto& output : context.outputs)
-        write_key_sequence(s, output);
+    // inputs
+    s.write_varint(static_cast<uint32_t>(context.inputs.size()));
+    for (const auto& input : context.inputs) {
+      write_ref(s, input.input);
+      s.write_signed_varint(static_cast<int32_t>(input.output_index));
+    }
 
-      // command outputs
-      s.write(static_cast<uint32_t>(context.command_outputs.size()));
-      for (const auto& command : context.command_outputs) {
-        write_key_sequence(s, command.output);
-        s.write(static_cast<int32_t>(command.index));
-      }
+    // outputs
+    s.write_varint(static_cast<uint32_t>(context.outputs.size()));
+    for (const auto& output : context.outputs)
+      write_ref(s, output);
 
-      // device filter
-      write_filter(s, context.device_filter);
-      
-      // device-id filter
-      write_filter(s, context.device_id_filter);
-      
-      // modifier filter
-      write_key_sequence(s, context.modifier_filter);
-      s.write(context.invert_modifier_filter);
-
-      // fallthrough
-      s.write(context.fallthrough);
+    // command outputs
+    s.write_varint(static_cast<uint32_t>(context.command_outputs.size()));
+    for (const auto& command : context.command_outputs) {
+      write_ref(s, command.output);
+      s.write_signed_varint(static_cast<int32_t>(command.index));
     }
+
+    // device filter, device-id filter and modifier filter
+    write_ref(s, context.device_filter.string);
+    write_ref(s, context.device_id_filter.string);
+    write_ref(s, context.modifier_filter);
   }
 
   void write_grab_device_filters(Serializer& s, 
       const std::vector<GrabDeviceFilter>& device_filters) {
-    s.write(static_cast<uint32_t>(device_filters.size()));
+    s.write_varint(static_cast<uint32_t>(device_filters.size()));
     for (const auto& device_filter : device_filters) {
       write_filter(s, device_filter);
       s.write(device_filter.by_id);
     }
   }
 
+  void write_logical_keys(Serializer& s, const LogicalKeys& logical_keys) {
+    const auto& definitions = logical_keys.definitions();
+    s.write_varint(static_cast<uint32_t>(definitions.size()));
+    for (const auto& [logical, left, right] : definitions) {
+      s.write(logical);
+      s.write(left);
+      s.write(right);
+    }
+  }
+
+  void write_forward_modifiers(Serializer& s, const std::vector<Key>& keys) {
+    s.write_varint(static_cast<uint32_t>(keys.size()));
+    for (auto key : keys)
+      s.write(key);
+  }
+
   void write_directives(Serializer& s,
       const std::vector<std::string>& directives) {
-    s.write(static_cast<uint32_t>(directives.size()));
+    s.write_varint(static_cast<uint32_t>(directives.size()));
     for (const auto& directive : directives)
       s.write(directive);
   }
 
-  void write_active_contexts(Serializer& s, const std::vector<int>& indices) {
-    s.write(static_cast<uint32_t>(indices.size()));
-    for (const auto& index : indices)
-      s.write(static_cast<uint32_t>(index));
+  // ascending, each as difference to the previous
+  void write_index_deltas(Serializer& s, const std::vector<int>& indices) {
+    s.write_varint(static_cast<uint32_t>(indices.size()));
+    auto previous = 0;
+    for (auto index : indices)
+      s.write_varint(static_cast<uint32_t>(index - std::exchange(previous, index)));
   }
 } // namespace
 
-ServerPort::ServerPort() 
-  : m_host("keymapper") {
+ServerPort::ServerPort(std::string ipc_id) 
+  : m_host(std::move(ipc_id)) {
 }
 
 bool ServerPort::connect() {
+  if (!m_reconnect_message.size())
+    reset_sent_state();
+  m_sent_active_contexts.clear();
   m_connection = m_host.connect();
+#if !defined(_WIN32)
+  // send messages through shared memory when server accepts
+  if (m_connection &&
+      !m_connection.create_send_ring(std::chrono::seconds(1)))
+    m_connection.disconnect();
+#endif
   return static_cast<bool>(m_connection);
 }
 
@@ -91,20 +147,223 @@ void ServerPort::disconnect() {
   m_connection.disconnect();
 }
 
+void ServerPort::reset_sent_state() {
+  m_sent_context_hashes.clear();
+  m_sent_configuration_hash = { };
+  m_cached_configuration_hashes.clear();
+  m_sent_sequences.clear();
+  m_sent_sequence_indices.clear();
+  m_sent_strings.clear();
+  m_sent_string_indices.clear();
+}
+
+void ServerPort::prepare_reconnect(const Config& config) {
+  // the next server starts without any of the sent state
+  reset_sent_state();
+  m_reconnect_message.truncate(0);
+  write_config(m_reconnect_message, config);
+}
+
+uint32_t ServerPort::add_sent_sequence(const KeySequence& sequence) {
+  const auto hash = std::hash<std::string_view>{ }(std::string_view(
+    reinterpret_cast<const char*>(sequence.data()),
+    sequence.size() * sizeof(KeyEvent)));
+  const auto [begin, end] = m_sent_sequence_indices.equal_range(hash);
+  for (auto it = begin; it != end; ++it)
+    if (m_sent_sequences[it->second] == sequence)
+      return it->second;
+  const auto index = static_cast<uint32_t>(m_sent_sequences.size());
+  m_sent_sequences.push_back(sequence);
+  m_sent_sequence_indices.emplace(hash, index);
+  return index;
+}
+
+uint32_t ServerPort::add_sent_string(const std::string& string) {
+  const auto index = static_cast<uint32_t>(m_sent_strings.size());
+  const auto [it, inserted] = m_sent_string_indices.emplace(string, index);
+  if (inserted)
+    m_sent_strings.push_back(string);
+  return it->second;
+}
+
 bool ServerPort::send_config(const Config& config) {
-  return m_connection.send_message([&](Serializer& s) {
-    s.write(MessageType::configuration);
-    write_grab_device_filters(s, config.grab_device_filters);    
-    write_contexts(s, config.contexts);
-    write_directives(s, config.server_directives);
-  });
+  auto message = Serializer();
+  if (m_reconnect_message.size())
+    std::swap(message, m_reconnect_message);
+  else
+    write_config(message, config);
+  if (message.size() <= configuration_chunk_size)
+    return m_connection.send_message([&](Serializer& s) {
+      s.write(message.data(), message.size());
+    });
+
+#if !defined(_WIN32)
+  const auto fd = SealedMemory::create(message.data(), message.size());
+  if (fd >= 0) {
+    const auto passed = m_connection.send_descriptor(fd);
+    ::close(fd);
+    if (passed)
+      return m_connection.send_message([&](Serializer& s) {
+        s.write(MessageType::configuration_memory);
+        s.write(static_cast<uint64_t>(message.size()));
+      });
+  }
+#endif
+
+  for (auto offset = size_t{ }; offset < message.size(); ) {
+    const auto size = std::min(configuration_chunk_size,
+      message.size() - offset);
+    const auto last = (offset + size == message.size());
+    if (!m_connection.send_message([&](Serializer& s) {
+          s.write(MessageType::configuration_chunk);
+          s.write(last);
+          s.write(static_cast<uint32_t>(size));
+          s.write(message.data() + offset, size);
+        }))
+      return false;
+    offset += size;
+  }
+  return true;
 }
 
-bool ServerPort::send_active_contexts(const std::vector<int>& indices) {
-  return m_connection.send_message([&](Serializer& s) {
-    s.write(MessageType::active_contexts);
+void ServerPort::write_config(Serializer& s, const Config& config) {
+  // after the first configuration only changed contexts are sent,
+  // unchanged ones are identified by their index in the last one
+  const auto update = !m_sent_context_hashes.empty();
+  auto previous_indices = std::unordered_map<size_t, int32_t>();
+  for (auto i = 0u; i < m_sent_context_hashes.size(); ++i)
+    previous_indices.emplace(m_sent_context_hashes[i], static_cast<int32_t>(i));
+  m_sent_context_hashes.clear();
+
+  const auto message_begin = s.size();
+  s.reserve(get_contexts_size(config.contexts));
+  s.write(update ? MessageType::configuration_update : 
+                   MessageType::configuration);
+  const auto hash_offset = s.size();
+  s.write(uint64_t{ });
+  const auto filters_begin = s.size();
+  write_grab_device_filters(s, config.grab_device_filters);
+  write_logical_keys(s, config.logical_keys);
+  write_forward_modifiers(s, config.forward_modifiers);
+  const auto filters_hash = std::hash<std::string_view>{ }(
+    std::string_view(s.data() + filters_begin, s.size() - filters_begin));
+
+  // contexts refer to sequences and strings by their index in the tables
+  // of the connection, the entries new to the tables are sent before them
+  const auto first_new_sequence = m_sent_sequences.size();
+  const auto first_new_string = m_sent_strings.size();
+  const auto write_ref = [&](Serializer& s, const auto& value) {
+    if constexpr (std::is_same_v<std::decay_t<decltype(value)>, KeySequence>)
+      s.write_varint(add_sent_sequence(value));
+    else
+      s.write_varint(add_sent_string(value));
+  };
+  auto& c = m_context_buffer;
+  c.truncate(0);
+  c.write_varint(static_cast<uint32_t>(config.contexts.size()));
+  for (const auto& context : config.contexts) {
+    const auto index_offset = c.size();
+    if (update)
+      c.write_signed_varint(-1);
+
+    // hash serialized context
+    const auto begin = c.size();
+    write_context(c, context, write_ref);
+    const auto hash = std::hash<std::string_view>{ }(
+      std::string_view(c.data() + begin, c.size() - begin));
+    m_sent_context_hashes.push_back(hash);
+
+    if (update)
+      if (auto it = previous_indices.find(hash); it != previous_indices.end()) {
+        c.truncate(index_offset);
+        c.write_signed_varint(it->second);
+      }
+  }
+  s.write_varint(static_cast<uint32_t>(
+    m_sent_sequences.size() - first_new_sequence));
+  for (auto i = first_new_sequence; i < m_sent_sequences.size(); ++i)
+    write_compact_sequence(s, m_sent_sequences[i]);
+  s.write_varint(static_cast<uint32_t>(
+    m_sent_strings.size() - first_new_string));
+  for (auto i = first_new_string; i < m_sent_strings.size(); ++i)
+    s.write(m_sent_strings[i]);
+  s.write(c.data(), c.size());
+
+  const auto directives_begin = s.size();
+  write_directives(s, config.server_directives);
+
+  // the configuration is identified by the hashes of its parts
+  auto hashes = m_sent_context_hashes;
+  hashes.push_back(filters_hash);
+  hashes.push_back(std::hash<std::string_view>{ }(std::string_view(
+    s.data() + directives_begin, s.size() - directives_begin)));
+  const auto hash = std::hash<std::string_view>{ }(std::string_view(
+    reinterpret_cast<const char*>(hashes.data()),
+    hashes.size() * sizeof(size_t)));
+  s.write_at(hash_offset, static_cast<uint64_t>(hash));
+
+  const auto previous_hash = std::exchange(m_sent_configuration_hash, hash);
+  if (hash == previous_hash)
+    return;
+
+  // the server does the same, when it receives the configuration
+  auto& cached = m_cached_configuration_hashes;
+  if (previous_hash)
+    cached.push_back(previous_hash);
+  const auto it = std::find(cached.begin(), cached.end(), hash);
+  const auto is_cached = (it != cached.end());
+  if (is_cached)
+    cached.erase(it);
+  if (cached.size() > max_cached_configurations)
+    cached.erase(cached.begin());
+
+  if (is_cached) {
+    s.truncate(message_begin);
+    s.write(MessageType::activate_configuration);
+    s.write(static_cast<uint64_t>(hash));
+  }
+}
+
+void ServerPort::write_active_contexts(Serializer& s,
+    const std::vector<int>& indices) {
+  const auto sorted = std::is_sorted(indices.begin(), indices.end());
+  if (sorted && !m_sent_active_contexts.empty()) {
+    m_added_contexts.clear();
+    m_removed_contexts.clear();
+    std::set_difference(indices.begin(), indices.end(),
+      m_sent_active_contexts.begin(), m_sent_active_contexts.end(),
+      std::back_inserter(m_added_contexts));
+    std::set_difference(m_sent_active_contexts.begin(),
+      m_sent_active_contexts.end(), indices.begin(), indices.end(),
+      std::back_inserter(m_removed_contexts));
+    if (m_added_contexts.size() + m_removed_contexts.size() < indices.size()) {
+      s.write(MessageType::active_contexts_delta);
+      write_index_deltas(s, m_removed_contexts);
+      write_index_deltas(s, m_added_contexts);
+      m_sent_active_contexts = indices;
+      return;
+    }
+  }
+  s.write(MessageType::active_contexts);
+  s.write(static_cast<uint32_t>(indices.size()));
+  for (const auto& index : indices)
+    s.write(static_cast<uint32_t>(index));
+  // deltas can only be applied to a sorted list
+  if (sorted)
+    m_sent_active_contexts = indices;
+  else
+    m_sent_active_contexts.clear();
+}
+
+bool ServerPort::send_active_contexts(const std::vector<int>& indices,
+    const ContextSwitchTimes& times) {
+  const auto sent = m_connection.send_message([&](Serializer& s) {
     write_active_contexts(s, indices);
+    s.write(times);
   });
+  if (!sent)
+    m_sent_active_contexts.clear();
+  return sent;
 }
 
 bool ServerPort::send_validate_state() {
@@ -121,6 +380,17 @@ bool ServerPort::send_set_virtual_key_state(Key key, KeyState state) {
   });
 }
 
+bool ServerPort::send_set_virtual_key_states(const std::vector<Key>& keys,
+    KeyState state) {
+  return m_connection.send_message([&](Serializer& s) {
+    s.write(MessageType::set_virtual_key_states);
+    s.write(static_cast<uint32_t>(keys.size()));
+    for (auto key : keys)
+      s.write(key);
+    s.write(state);
+  });
+}
+
 bool ServerPort::send_request_next_key_info() {
   return m_connection.send_message([&](Serializer& s) {
     s.write(MessageType::next_key_info);
@@ -141,14 +411,29 @@ bool ServerPort::send_inject_output(const KeySequence& sequence) {
   });
 }
 
+bool ServerPort::send_request_statistics(bool recent_events) {
+  return m_connection.send_message([&](Serializer& s) {
+    s.write(MessageType::statistics);
+    s.write(recent_events);
+  });
+}
+
+bool ServerPort::send_request_input_profiles() {
+  return m_connection.send_message([&](Serializer& s) {
+    s.write(MessageType::input_profile);
+  });
+}
+
 bool ServerPort::read_messages(MessageHandler& handler,
     std::optional<Duration> timeout) {
   return m_connection.read_messages(timeout,
     [&](Deserializer& d) {
       switch (d.read<MessageType>()) {
         case MessageType::execute_action: {
-          handler.on_execute_action_message(
-            static_cast<int>(d.read<uint32_t>()));
+          const auto count = d.read<uint32_t>();
+          for (auto i = 0u; i < count && d.can_read(sizeof(uint32_t)); ++i)
+            handler.on_execute_action_message(
+              static_cast<int>(d.read<uint32_t>()));
           break;
         }
         case MessageType::virtual_key_state: {
@@ -157,12 +442,29 @@ bool ServerPort::read_messages(MessageHandler& handler,
           handler.on_virtual_key_state_message(key, state);
           break;
         }
+        case MessageType::virtual_key_states: {
+          const auto count = d.read<uint32_t>();
+          for (auto i = 0u; i < count; ++i) {
+            const auto key = d.read<Key>();
+            const auto state = d.read<KeyState>();
+            handler.on_virtual_key_state_message(key, state);
+          }
+          break;
+        }
         case MessageType::next_key_info: {
           const auto key = d.read<Key>();
           auto device_desc = DeviceDesc{ d.read_string(), d.read_string() };
           handler.on_next_key_info_message(key, std::move(device_desc));
           break;
         }
+        case MessageType::statistics: {
+          handler.on_statistics_message(d.read_string());
+          break;
+        }
+        case MessageType::input_profile: {
+          handler.on_input_profiles_message(read_input_profiles(d));
+          break;
+        }
         default: break;
       }
     });
@@ -4,30 +4,99 @@
 #include "common/MessageType.h"
 #include "config/Config.h"
 #include "common/DeviceDesc.h"
+#include "common/InputProfile.h"
+#include "common/ContextSwitchTimes.h"
 #include <memory>
+#include <unordered_map>
+#include <vector>
 
-class ServerPort {
+class IServerPort {
 public:
-  ServerPort();
-  Socket socket() const { return m_connection.socket(); }
-  bool connect();
-  void disconnect();
-  bool send_config(const Config& config);
-  bool send_active_contexts(const std::vector<int>& indices);
-  bool send_validate_state();
-  bool send_set_virtual_key_state(Key key, KeyState state);
-  bool send_request_next_key_info();
-  bool send_inject_input(const KeySequence& sequence);
-  bool send_inject_output(const KeySequence& sequence);
-
   struct MessageHandler {
     virtual void on_execute_action_message(int action_index) = 0;
     virtual void on_virtual_key_state_message(Key key, KeyState state) = 0;
     virtual void on_next_key_info_message(Key key, DeviceDesc device) = 0;
+    virtual void on_statistics_message(const std::string& statistics) = 0;
+    virtual void on_input_profiles_message(const InputProfiles& profiles) = 0;
   };
-  bool read_messages(MessageHandler& handler, std::optional<Duration> timeout);
+
+  virtual ~IServerPort() = default;
+  virtual Socket socket() const = 0;
+  virtual bool connect() = 0;
+  virtual void disconnect() = 0;
+  virtual bool send_config(const Config& config) = 0;
+  // prepares the configuration for the next connection, while the server
+  // is unreachable, so the next send_config can send it at once
+  virtual void prepare_reconnect(const Config& config) = 0;
+  virtual bool send_active_contexts(const std::vector<int>& indices,
+    const ContextSwitchTimes& times) = 0;
+  virtual bool send_validate_state() = 0;
+  virtual bool send_set_virtual_key_state(Key key, KeyState state) = 0;
+  virtual bool send_set_virtual_key_states(const std::vector<Key>& keys,
+    KeyState state) = 0;
+  virtual bool send_request_next_key_info() = 0;
+  virtual bool send_inject_input(const KeySequence& sequence) = 0;
+  virtual bool send_inject_output(const KeySequence& sequence) = 0;
+  // or the recent events
+  virtual bool send_request_statistics(bool recent_events) = 0;
+  virtual bool send_request_input_profiles() = 0;
+  virtual bool read_messages(MessageHandler& handler,
+    std::optional<Duration> timeout) = 0;
+};
+
+class ServerPort : public IServerPort {
+public:
+  explicit ServerPort(std::string ipc_id = "keymapper");
+  Socket socket() const override { return m_connection.socket(); }
+  bool connect() override;
+  void disconnect() override;
+  bool send_config(const Config& config) override;
+  // serializes the configuration for the next connection
+  void prepare_reconnect(const Config& config) override;
+  // the configuration message, only the changed contexts after the first,
+  // or the activation, when the server still has the configuration
+  void write_config(Serializer& s, const Config& config);
+  bool send_active_contexts(const std::vector<int>& indices,
+    const ContextSwitchTimes& times) override;
+  // the active contexts message, or only the added and removed indices,
+  // when this is shorter than the list of the last sent
+  void write_active_contexts(Serializer& s, const std::vector<int>& indices);
+  bool send_validate_state() override;
+  bool send_set_virtual_key_state(Key key, KeyState state) override;
+  bool send_set_virtual_key_states(const std::vector<Key>& keys,
+    KeyState state) override;
+  bool send_request_next_key_info() override;
+  bool send_inject_input(const KeySequence& sequence) override;
+  bool send_inject_output(const KeySequence& sequence) override;
+  bool send_request_statistics(bool recent_events) override;
+  bool send_request_input_profiles() override;
+  bool read_messages(MessageHandler& handler,
+    std::optional<Duration> timeout) override;
 
 private:
+  uint32_t add_sent_sequence(const KeySequence& sequence);
+  uint32_t add_sent_string(const std::string& string);
+  void reset_sent_state();
+
   Host m_host;
   Connection m_connection;
+  // of the contexts of the last configuration sent
+  std::vector<size_t> m_sent_context_hashes;
+  size_t m_sent_configuration_hash{ };
+  // of the replaced configurations the server keeps, the most recent last
+  std::vector<size_t> m_cached_configuration_hashes;
+  // each distinct sequence is only sent once per connection
+  std::vector<KeySequence> m_sent_sequences;
+  std::unordered_multimap<size_t, uint32_t> m_sent_sequence_indices;
+  // as are the filter strings
+  std::vector<std::string> m_sent_strings;
+  std::unordered_map<std::string, uint32_t> m_sent_string_indices;
+  Serializer m_context_buffer;
+  // the active contexts the server received last
+  std::vector<int> m_sent_active_contexts;
+  std::vector<int> m_added_contexts;
+  std::vector<int> m_removed_contexts;
+  // the configuration message for the next connection, the sent state
+  // above already refers to it
+  Serializer m_reconnect_message;
 };
@@ -34,12 +34,20 @@ bool interpret_commandline(Settings& settings, int argc, char* argv[]) {
     else if (argument == T("--check")) {
       settings.check_config = true;
     }
+    else if (argument == T("--analyze")) {
+      settings.analyze_config = true;
+    }
     else if (argument == T("--no-tray")) {
       settings.no_tray_icon = true;
     }
     else if (argument == T("--no-notify")) {
       settings.no_notify = true;
     }
+    else if (argument == T("--record-focus")) {
+      if (++i >= argc)
+        return false;
+      settings.record_focus_filename = argv[i];
+    }
     else {
       return false;
     }
@@ -64,6 +72,8 @@ void print_help_message() {
     "  --no-notify          do not show notifications.\n"
     "  --no-tray            do not show tray icon.\n"
     "  --check              check the config for errors and exit.\n"
+    "  --analyze            report the runtime cost of the config and exit.\n"
+    "  --record-focus <file> record the focused windows for keymapper_bench.\n"
     "  -h, --help           print this help.\n"
     "\n"
     "%s\n"
@@ -9,8 +9,11 @@ struct Settings {
   bool auto_update_config{ };
   bool verbose{ };
   bool check_config{ };
+  bool analyze_config{ };
   bool no_tray_icon{ };
   bool no_notify{ };
+  // the focused window changes are recorded for keymapper_bench
+  std::filesystem::path record_focus_filename;
 };
 
 #if defined(_WIN32)
@@ -0,0 +1,106 @@
+
+#include "EmbeddedClient.h"
+#include "client/LocalServerPort.h"
+#include "common/output.h"
+#include <csignal>
+#include <cmath>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+
+namespace {
+  // for the sources, which cannot be waited for
+  const auto poll_interval = std::chrono::milliseconds(50);
+} // namespace
+
+EmbeddedClient::EmbeddedClient(LocalChannelPtr channel)
+  : m_state(std::make_unique<LocalServerPort>(std::move(channel))) {
+  if (::pipe(m_stop_pipe.data()) == 0)
+    for (auto fd : m_stop_pipe)
+      ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+EmbeddedClient::~EmbeddedClient() {
+  stop();
+  for (auto fd : m_stop_pipe)
+    if (fd >= 0)
+      ::close(fd);
+}
+
+bool EmbeddedClient::load_config(const std::filesystem::path& filename) {
+  verbose("Loading configuration file '%s'", filename.c_str());
+  return m_state.load_config(filename);
+}
+
+void EmbeddedClient::start() {
+  m_stop.store(false);
+  m_thread = std::thread(&EmbeddedClient::run, this);
+}
+
+void EmbeddedClient::stop() {
+  if (!m_thread.joinable())
+    return;
+  m_stop.store(true);
+  [[maybe_unused]] const auto result = ::write(m_stop_pipe[1], "", 1);
+  m_thread.join();
+}
+
+void EmbeddedClient::run() {
+  // the main thread handles the signals
+  auto signals = sigset_t{ };
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGUSR1);
+  ::pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+  if (!m_state.initialize_contexts())
+    error("Initializing focused window detection failed");
+
+  // connecting fails, until the server dropped the previous connection
+  while (!m_stop.load()) {
+    if (m_state.connect_server() && m_state.send_config()) {
+      m_state.listen_for_control_connections();
+      verbose("Entering update loop");
+      update_loop();
+      verbose("Connection to keymapperd lost");
+    }
+    m_state.on_server_disconnected();
+    wait_until_readable({ m_stop_pipe[0] }, poll_interval);
+  }
+}
+
+void EmbeddedClient::wait_until_readable(const std::vector<int>& fds,
+    std::optional<Duration> timeout) {
+  m_poll_fds.clear();
+  for (auto fd : fds)
+    m_poll_fds.push_back({ fd, POLLIN, 0 });
+  const auto milliseconds = (timeout ? static_cast<int>(std::ceil(
+    std::chrono::duration<double, std::milli>(*timeout).count())) : -1);
+  ::poll(m_poll_fds.data(), static_cast<nfds_t>(m_poll_fds.size()),
+    milliseconds);
+}
+
+void EmbeddedClient::update_loop() {
+  auto fds = std::vector<int>();
+  while (!m_stop.load()) {
+    if (m_state.update_config(true) && !m_state.send_config())
+      return;
+
+    if (m_state.update_active_contexts() && !m_state.send_active_contexts())
+      return;
+
+    if (!m_state.read_server_messages(Duration::zero()))
+      return;
+
+    m_state.accept_control_connection();
+    m_state.read_control_messages();
+
+    // wait until any of the sources needs to be updated
+    fds.clear();
+    fds.push_back(m_stop_pipe[0]);
+    wait_until_readable(fds,
+      m_state.get_event_fds(fds, poll_interval, true));
+  }
+}
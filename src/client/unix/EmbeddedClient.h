@@ -0,0 +1,35 @@
+#pragma once
+
+#include "client/ClientState.h"
+#include "server/LocalClientPort.h"
+#include <atomic>
+#include <poll.h>
+#include <thread>
+
+// Runs the client in a thread of the keymapperd process, connected
+// through a LocalChannel. There is no tray icon and no notifications,
+// the configuration file is updated, when it was modified.
+class EmbeddedClient {
+public:
+  explicit EmbeddedClient(LocalChannelPtr channel);
+  EmbeddedClient(const EmbeddedClient&) = delete;
+  EmbeddedClient& operator=(const EmbeddedClient&) = delete;
+  ~EmbeddedClient();
+
+  bool load_config(const std::filesystem::path& filename);
+  void start();
+  void stop();
+
+private:
+  void run();
+  // returns when the connection was lost
+  void update_loop();
+  void wait_until_readable(const std::vector<int>& fds,
+    std::optional<Duration> timeout);
+
+  ClientState m_state;
+  std::thread m_thread;
+  std::atomic<bool> m_stop{ };
+  std::array<int, 2> m_stop_pipe{ -1, -1 };
+  std::vector<pollfd> m_poll_fds;
+};
@@ -3,7 +3,9 @@
 
 #include "FocusedWindowImpl.h"
 #include <Carbon/Carbon.h>
-#include <libproc.h>
+#include <array>
+#include <fcntl.h>
+#include <unistd.h>
 
 namespace {
   #pragma clang diagnostic push
@@ -27,13 +29,10 @@ namespace {
     return string;
   }
 
-  std::string get_process_path(const ProcessSerialNumber& psn) {
+  int get_process_pid(const ProcessSerialNumber& psn) {
     auto pid = pid_t{ };
     GetProcessPID(&psn, &pid);
-    char buffer[PROC_PIDPATHINFO_MAXSIZE];
-    if (proc_pidpath(pid, buffer, sizeof(buffer)) > 0)
-      return buffer;
-    return { };
+    return static_cast<int>(pid);
   }
 
   ProcessSerialNumber get_front_process() {
@@ -42,13 +41,41 @@ namespace {
     return psn;
   }
   #pragma clang diagnostic pop
+
+  AXUIElementRef copy_focused_window(AXUIElementRef application) {
+    auto window = CFTypeRef{ };
+    if (AXUIElementCopyAttributeValue(application,
+          kAXFocusedWindowAttribute, &window) != kAXErrorSuccess)
+      return nullptr;
+    return static_cast<AXUIElementRef>(window);
+  }
+
+  std::string get_window_title(AXUIElementRef window) {
+    auto title = CFTypeRef{ };
+    if (!window || AXUIElementCopyAttributeValue(window,
+          kAXTitleAttribute, &title) != kAXErrorSuccess)
+      return { };
+    auto string = std::string();
+    if (CFGetTypeID(title) == CFStringGetTypeID())
+      string = to_string(static_cast<CFStringRef>(title));
+    CFRelease(title);
+    return string;
+  }
 } // namespace
 
+// Gets notified by the system about application switches and, when
+// accessibility is granted, about focused window and title changes of the
+// front application. The notifications are dispatched while the client
+// runs the main run loop and are signalled through a pipe.
 class FocusedWindowCarbon : public FocusedWindowSystem {
 private:
   FocusedWindowData& m_data;
   EventHandlerUPP m_event_handler_upp{ };
   EventHandlerRef m_event_handler_ref{ };
+  std::array<int, 2> m_notify_pipe{ -1, -1 };
+  AXObserverRef m_observer{ };
+  AXUIElementRef m_application{ };
+  AXUIElementRef m_window{ };
   bool m_front_app_changed{ };
 
 public:
@@ -60,11 +87,20 @@ public:
   FocusedWindowCarbon& operator=(const FocusedWindowCarbon&) = delete;
 
   ~FocusedWindowCarbon() {
+    stop_observing();
     RemoveEventHandler(m_event_handler_ref);
     DisposeEventHandlerUPP(m_event_handler_upp);    
+    for (auto fd : m_notify_pipe)
+      if (fd >= 0)
+        ::close(fd);
   }
 
   bool initialize() {
+    if (::pipe(m_notify_pipe.data()) != 0)
+      return false;
+    for (auto fd : m_notify_pipe)
+      ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+
     auto event_target = GetApplicationEventTarget();
     m_event_handler_upp = NewEventHandlerUPP(&FocusedWindowCarbon::event_handler_callback);
     auto event_type = EventTypeSpec{ kEventClassApplication, kEventAppFrontSwitched };
@@ -76,8 +112,23 @@ public:
     return true;
   }
 
+  int event_fd() const override {
+    return m_notify_pipe[0];
+  }
+
+  void invalidate() override {
+    if (m_application) {
+      observe_window(copy_focused_window(m_application));
+      notify();
+    }
+  }
+
   bool update() override {
+    // dispatch notifications, when the client did not run the run loop
     CFRunLoopRunInMode(kCFRunLoopDefaultMode, 0, false);
+
+    auto buffer = std::array<char, 64>();
+    while (::read(m_notify_pipe[0], buffer.data(), buffer.size()) > 0) { }
     return std::exchange(m_front_app_changed, false);
   }
 
@@ -98,8 +149,82 @@ private:
 
   void handle_front_app_changed(const ProcessSerialNumber& psn) {
     m_data.window_class = get_process_name(psn);
-    m_data.window_path = get_process_path(psn);
+    m_data.window_pid = get_process_pid(psn);
+    observe_application(m_data.window_pid);
+    notify();
+  }
+
+  void notify() {
     m_front_app_changed = true;
+    ::write(m_notify_pipe[1], "", 1);
+  }
+
+  static void observer_callback(AXObserverRef, AXUIElementRef element,
+      CFStringRef notification, void* context) {
+    static_cast<FocusedWindowCarbon*>(context)->handle_notification(
+      element, notification);
+  }
+
+  void handle_notification(AXUIElementRef element, CFStringRef notification) {
+    if (CFStringCompare(notification, kAXFocusedWindowChangedNotification, 0) ==
+          kCFCompareEqualTo) {
+      CFRetain(element);
+      observe_window(element);
+    }
+    if (!(m_data.attributes & FocusedWindow::Title))
+      return;
+    auto title = get_window_title(m_window);
+    if (title == m_data.window_title)
+      return;
+    m_data.window_title = std::move(title);
+    notify();
+  }
+
+  void observe_application(int pid) {
+    stop_observing();
+    m_data.window_title.clear();
+    if (AXObserverCreate(static_cast<pid_t>(pid), &observer_callback,
+          &m_observer) != kAXErrorSuccess) {
+      m_observer = nullptr;
+      return;
+    }
+    m_application = AXUIElementCreateApplication(static_cast<pid_t>(pid));
+    AXObserverAddNotification(m_observer, m_application,
+      kAXFocusedWindowChangedNotification, this);
+    CFRunLoopAddSource(CFRunLoopGetMain(),
+      AXObserverGetRunLoopSource(m_observer), kCFRunLoopDefaultMode);
+    observe_window(copy_focused_window(m_application));
+  }
+
+  // takes ownership of window
+  void observe_window(AXUIElementRef window) {
+    if (m_window) {
+      AXObserverRemoveNotification(m_observer, m_window,
+        kAXTitleChangedNotification);
+      CFRelease(m_window);
+    }
+    m_window = window;
+    if (!m_window)
+      return;
+    if (m_data.attributes & FocusedWindow::Title) {
+      AXObserverAddNotification(m_observer, m_window,
+        kAXTitleChangedNotification, this);
+      m_data.window_title = get_window_title(m_window);
+    }
+  }
+
+  void stop_observing() {
+    observe_window(nullptr);
+    if (m_application) {
+      CFRelease(m_application);
+      m_application = nullptr;
+    }
+    if (m_observer) {
+      CFRunLoopRemoveSource(CFRunLoopGetMain(),
+        AXObserverGetRunLoopSource(m_observer), kCFRunLoopDefaultMode);
+      CFRelease(m_observer);
+      m_observer = nullptr;
+    }
   }
 };
 
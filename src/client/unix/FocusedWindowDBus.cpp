@@ -71,8 +71,21 @@ public:
     return true;
   }
 
+  int event_fd() const override {
+    auto fd = -1;
+    if (!dbus_connection_get_unix_fd(m_connection, &fd))
+      return -1;
+    return fd;
+  }
+
   bool update() override {
-    dbus_connection_read_write_dispatch(m_connection, 0);
+    // dispatch all messages, since the descriptor is only readable
+    // until they were read, and send the replies right away
+    dbus_connection_read_write(m_connection, 0);
+    while (dbus_connection_dispatch(m_connection) ==
+        DBUS_DISPATCH_DATA_REMAINS)
+      ;
+    dbus_connection_flush(m_connection);
     return std::exchange(m_updated, false);
   }
 
@@ -103,7 +116,7 @@ private:
           DBUS_TYPE_INVALID)) {
         m_data.window_title = window_title;
         m_data.window_class = window_class;
-        m_data.window_path = "";
+        m_data.window_pid = 0;
         m_updated = true;
       }
       reply = dbus_message_new_method_return(message);
@@ -1,6 +1,9 @@
 
 #include "FocusedWindowImpl.h"
 #include "common/output.h"
+#include <cstdlib>
+#include <string>
+#include <unistd.h>
 
 using MakeFocusedWindowSystem = std::unique_ptr<FocusedWindowSystem>(FocusedWindowData*);
 MakeFocusedWindowSystem make_focused_window_x11;
@@ -8,24 +11,69 @@ MakeFocusedWindowSystem make_focused_window_dbus;
 MakeFocusedWindowSystem make_focused_window_wlroots;
 MakeFocusedWindowSystem make_focused_window_carbon;
 
+namespace {
+  using ProbeSystem = bool();
+
+  bool has_environment_variable(const char* name) {
+    const auto value = std::getenv(name);
+    return (value && *value);
+  }
+
+  bool has_runtime_file(const char* name) {
+    const auto runtime_dir = std::getenv("XDG_RUNTIME_DIR");
+    return (runtime_dir && *runtime_dir &&
+      ::access((std::string(runtime_dir) + "/" + name).c_str(), F_OK) == 0);
+  }
+
+  [[maybe_unused]] bool has_x11_display() {
+    return has_environment_variable("DISPLAY");
+  }
+
+  [[maybe_unused]] bool has_session_bus() {
+    return (has_environment_variable("DBUS_SESSION_BUS_ADDRESS") ||
+      has_runtime_file("bus"));
+  }
+
+  [[maybe_unused]] bool has_wayland_display() {
+    // the default display is used when it is not set
+    return (has_environment_variable("WAYLAND_DISPLAY") ||
+      has_runtime_file("wayland-0"));
+  }
+
+  [[maybe_unused]] bool is_always_available() {
+    return true;
+  }
+} // namespace
+
 bool FocusedWindowImpl::initialize() {
 
-  const auto systems = std::initializer_list<std::pair<const char*, MakeFocusedWindowSystem*>>{
+  // connecting to backends, which the session does not provide,
+  // can take a while, so the environment is checked first
+  struct System {
+    const char* name;
+    ProbeSystem* probe;
+    MakeFocusedWindowSystem* make;
+  };
+  const auto systems = std::initializer_list<System>{
 #if defined(ENABLE_X11)
-      { "X11", &make_focused_window_x11 },
+      { "X11", &has_x11_display, &make_focused_window_x11 },
 #endif
 #if defined(ENABLE_DBUS)
-      { "D-BUS", &make_focused_window_dbus },
+      { "D-BUS", &has_session_bus, &make_focused_window_dbus },
 #endif
 #if defined(ENABLE_WAYLAND)
-      { "wlroots", &make_focused_window_wlroots },
+      { "wlroots", &has_wayland_display, &make_focused_window_wlroots },
 #endif
 #if defined(ENABLE_CARBON)
-      { "Carbon", &make_focused_window_carbon },
+      { "Carbon", &is_always_available, &make_focused_window_carbon },
 #endif
     };
 
-  for (auto [name, make_system] : systems) {
+  for (auto [name, probe, make_system] : systems) {
+    if (!probe()) {
+      verbose("  %s support: not in session", name);
+      continue;
+    }
     auto system = make_system(this);
     verbose("  %s support: %s", name, (system ? "initialized" : "not available"));
     if (system)
@@ -38,6 +86,13 @@ void FocusedWindowImpl::shutdown() {
   m_systems.clear();
 }
 
+void FocusedWindowImpl::set_attributes(FocusedWindow::Attributes attributes) {
+  const auto added = (attributes & ~std::exchange(this->attributes, attributes));
+  if (added)
+    for (auto& system : m_systems)
+      system->invalidate();
+}
+
 bool FocusedWindowImpl::update() {
   for (auto& system : m_systems)
     if (system->update())
@@ -45,6 +100,21 @@ bool FocusedWindowImpl::update() {
   return false;
 }
 
+bool FocusedWindowImpl::get_event_fds(std::vector<int>& fds) const {
+  auto polled = false;
+  for (auto& system : m_systems) {
+    if (const auto fd = system->event_fd(); fd >= 0)
+      fds.push_back(fd);
+    else
+      polled = true;
+  }
+  return !polled;
+}
+
+const std::string& FocusedWindowImpl::window_path() {
+  return m_process_paths.get_path(window_pid);
+}
+
 //-------------------------------------------------------------------------
 
 FocusedWindow::FocusedWindow()
@@ -62,6 +132,10 @@ void FocusedWindow::shutdown() {
   m_impl->shutdown();
 }
 
+void FocusedWindow::set_attributes(Attributes attributes) {
+  m_impl->set_attributes(attributes);
+}
+
 bool FocusedWindow::update() {
   return m_impl->update();
 }
@@ -75,22 +149,13 @@ const std::string& FocusedWindow::window_title() const {
 }
 
 const std::string& FocusedWindow::window_path() const {
-  return m_impl->window_path;
+  return m_impl->window_path();
 }
 
-bool FocusedWindow::is_inaccessible() const {
-  return true;
+bool FocusedWindow::get_event_fds(std::vector<int>& fds) const {
+  return m_impl->get_event_fds(fds);
 }
 
-//-------------------------------------------------------------------------
-
-std::string get_process_path_by_pid(int pid) {
-  char path[32];
-  std::snprintf(path, sizeof(path), "/proc/%d/exe", pid);
-  const auto resolved = ::realpath(path, nullptr);
-  if (!resolved)
-    return { };
-  auto result = std::string(resolved);
-  ::free(resolved);
-  return result;
+bool FocusedWindow::is_inaccessible() const {
+  return true;
 }
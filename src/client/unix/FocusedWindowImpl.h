@@ -1,29 +1,39 @@
 #pragma once
 
 #include "client/FocusedWindow.h"
+#include "client/ProcessPathCache.h"
 #include <vector>
 #include <utility>
 
 struct FocusedWindowData {
+  FocusedWindow::Attributes attributes{ FocusedWindow::All };
   std::string window_class;
   std::string window_title;
-  std::string window_path;
+  // path is only resolved when requested
+  int window_pid{ };
 };
 
 class FocusedWindowSystem {
 public:
   virtual ~FocusedWindowSystem() = default;
   virtual bool update() = 0;
+  // called when more attributes are required
+  virtual void invalidate() { }
+  // readable when the focused window might have changed,
+  // when there is none, update is polled
+  virtual int event_fd() const { return -1; }
 };
 
 class FocusedWindowImpl : public FocusedWindowData {
 private:
   std::vector<std::unique_ptr<FocusedWindowSystem>> m_systems;
+  ProcessPathCache m_process_paths;
 
 public:
   bool initialize();
   void shutdown();
+  void set_attributes(FocusedWindow::Attributes attributes);
   bool update();
+  bool get_event_fds(std::vector<int>& fds) const;
+  const std::string& window_path();
 };
-
-std::string get_process_path_by_pid(int pid);
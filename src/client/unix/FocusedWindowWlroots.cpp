@@ -3,6 +3,7 @@
 
 #include "FocusedWindowImpl.h"
 #include <cstring>
+#include <poll.h>
 #include <wayland-client.h>
 #include "wlr-foreign-toplevel-management-unstable-v1-client-protocol.h"
 
@@ -45,12 +46,29 @@ public:
     return true;
   }
 
-  bool update() {
-    wl_display_roundtrip(m_display);
+  int event_fd() const override {
+    return wl_display_get_fd(m_display);
+  }
+
+  bool update() override {
+    // dispatch the events which arrived, without waiting for the compositor
+    while (wl_display_prepare_read(m_display) != 0)
+      wl_display_dispatch_pending(m_display);
+    wl_display_flush(m_display);
+    if (is_readable())
+      wl_display_read_events(m_display);
+    else
+      wl_display_cancel_read(m_display);
+    wl_display_dispatch_pending(m_display);
     return std::exchange(m_updated, false);
   }
 
 private:
+  bool is_readable() const {
+    auto poll_fd = pollfd{ wl_display_get_fd(m_display), POLLIN, 0 };
+    return (::poll(&poll_fd, 1, 0) > 0 && (poll_fd.revents & POLLIN));
+  }
+
   struct Toplevel {
     FocusedWindowWLRoots* self{ };
     std::string title;
@@ -108,7 +126,7 @@ private:
     if (&toplevel == m_active_toplevel) {
       m_data.window_title = toplevel.title;
       m_data.window_class = toplevel.app_id;
-      m_data.window_path = "";
+      m_data.window_pid = 0;
       m_updated = true;
     }
   }
@@ -1,23 +1,48 @@
-
 #if defined(ENABLE_X11)
 
 #include "FocusedWindowImpl.h"
-# include <X11/X.h>
-# include <X11/Xlib.h>
-# include <X11/Xatom.h>
-# include <X11/Xutil.h>
-# include <X11/Xos.h>
+#include <cstdlib>
+#include <cstring>
+#include <optional>
+#include <string_view>
+#include <xcb/xcb.h>
+#include <xcb/xcbext.h>
 
+// All properties are requested in one batch, which is sent without waiting.
+// The replies are only polled, the event fd becomes readable when they arrive.
 class FocusedWindowX11 : public FocusedWindowSystem {
 private:
+  struct FreeDeleter {
+    void operator()(void* ptr) const { std::free(ptr); }
+  };
+  using PropertyReply = std::unique_ptr<xcb_get_property_reply_t, FreeDeleter>;
+
+  // the sequence is reset, once the reply arrived
+  struct Property {
+    xcb_get_property_cookie_t cookie;
+    PropertyReply reply;
+  };
+
+  struct Batch {
+    xcb_window_t window;
+    Property active_window;
+    Property title;
+    Property class_;
+    Property pid;
+  };
+
   FocusedWindowData& m_data;
-  Display* m_display{ };
-  Window m_root_window{ };
-  Atom m_net_active_window_atom{ };
-  Atom m_net_wm_name_atom{ };
-  Atom m_net_wm_pid_atom{ };
-  Atom m_utf8_string_atom{ };
-  Window m_focused_window{ };
+  xcb_connection_t* m_connection{ };
+  xcb_window_t m_root_window{ };
+  xcb_atom_t m_net_active_window_atom{ };
+  xcb_atom_t m_net_wm_name_atom{ };
+  xcb_atom_t m_net_wm_pid_atom{ };
+  xcb_atom_t m_utf8_string_atom{ };
+  xcb_window_t m_focused_window{ };
+  bool m_properties_changed{ true };
+  bool m_invalidated{ };
+  // requests sent, whose replies did not arrive yet
+  std::optional<Batch> m_batch;
 
 public:
   explicit FocusedWindowX11(FocusedWindowData* data)
@@ -28,107 +53,219 @@ public:
   FocusedWindowX11& operator=(const FocusedWindowX11&) = delete;
 
   ~FocusedWindowX11() {
-    if (m_display)
-      XCloseDisplay(m_display);
+    if (m_connection)
+      xcb_disconnect(m_connection);
   }
 
   bool initialize() {
-    m_display = XOpenDisplay(nullptr);
-    if (!m_display)
+    auto screen_number = 0;
+    m_connection = xcb_connect(nullptr, &screen_number);
+    if (xcb_connection_has_error(m_connection))
       return false;
 
-    m_root_window = XRootWindow(m_display, 0);
-    m_net_active_window_atom = XInternAtom(m_display, "_NET_ACTIVE_WINDOW", False);
-    m_net_wm_name_atom = XInternAtom(m_display, "_NET_WM_NAME", False);
-    m_net_wm_pid_atom = XInternAtom(m_display, "_NET_WM_PID", False);
-    m_utf8_string_atom = XInternAtom(m_display, "UTF8_STRING", False);
-    XSetErrorHandler([](Display*, XErrorEvent*) { return 0; });
+    auto screens = xcb_setup_roots_iterator(xcb_get_setup(m_connection));
+    for (; screens.rem && screen_number > 0; --screen_number)
+      xcb_screen_next(&screens);
+    if (!screens.rem)
+      return false;
+    m_root_window = screens.data->root;
+
+    const char* const names[] = { "_NET_ACTIVE_WINDOW", "_NET_WM_NAME",
+      "_NET_WM_PID", "UTF8_STRING" };
+    xcb_atom_t* const atoms[] = { &m_net_active_window_atom,
+      &m_net_wm_name_atom, &m_net_wm_pid_atom, &m_utf8_string_atom };
+    xcb_intern_atom_cookie_t cookies[4];
+    for (auto i = 0; i < 4; ++i)
+      cookies[i] = xcb_intern_atom(m_connection, 0,
+        static_cast<uint16_t>(std::strlen(names[i])), names[i]);
+    for (auto i = 0; i < 4; ++i) {
+      const auto reply = xcb_intern_atom_reply(m_connection, cookies[i], nullptr);
+      if (!reply)
+        return false;
+      *atoms[i] = reply->atom;
+      std::free(reply);
+    }
+
+    // get notified when the active window changes
+    select_property_events(m_root_window, true);
+    xcb_flush(m_connection);
     return true;
   }
 
-  bool update() override {
-    const auto window = get_focused_window();
-    auto window_title = get_window_title(window);
-    if (window == m_focused_window &&
-        window_title == m_data.window_title)
-      return false;
+  int event_fd() const override {
+    return xcb_get_file_descriptor(m_connection);
+  }
 
-    // window handles can become invalid any time
-    auto window_class = get_window_class(window);
-    if (window_class.empty() || window_title.empty())
+  void invalidate() override {
+    m_properties_changed = true;
+    m_invalidated = true;
+  }
+
+  bool update() override {
+    if (xcb_connection_has_error(m_connection))
       return false;
 
-    m_focused_window = window;
-    m_data.window_class = std::move(window_class);
-    m_data.window_title = std::move(window_title);
-    m_data.window_path = get_window_path(window);
-    return true;
+    // replies are read along with the events
+    read_events();
+    if (!m_batch) {
+      // only query properties after they changed
+      if (!m_properties_changed)
+        return false;
+      m_properties_changed = false;
+      send_batch(m_focused_window, true);
+      read_events();
+    }
+    return receive_batch();
   }
 
 private:
-  Window get_focused_window() {
-    auto type = Atom{ };
-    auto format = 0;
-    auto length = 0ul;
-    auto rest = 0ul;
-    auto data = std::add_pointer_t<unsigned char>{ };
-    if (XGetWindowProperty(m_display, m_root_window, m_net_active_window_atom,
-          0L, sizeof(Window), False, XA_WINDOW, &type, &format,
-          &length, &rest, &data) == Success &&
-        data) {
-      auto result = *reinterpret_cast<Window*>(data);
-      XFree(data);
-      return result;
+  void read_events() {
+    while (auto event = xcb_poll_for_event(m_connection)) {
+      if ((event->response_type & 0x7F) == XCB_PROPERTY_NOTIFY) {
+        const auto& notify = *reinterpret_cast<xcb_property_notify_event_t*>(event);
+        if (notify.atom == m_net_active_window_atom ||
+            (notify.atom == m_net_wm_name_atom &&
+             (m_data.attributes & FocusedWindow::Title)))
+          m_properties_changed = true;
+      }
+      std::free(event);
     }
-    return { };
   }
 
-  std::string get_window_class(Window window) {
-    auto ch = XClassHint{ };
-    if (window &&
-        XGetClassHint(m_display, window, &ch) != 0) {
-      auto result = std::string(ch.res_name);
-      XFree(ch.res_name);
-      XFree(ch.res_class);
-      return result;
-    }
-    return { };
+  xcb_get_property_cookie_t get_property(xcb_window_t window,
+      xcb_atom_t property, xcb_atom_t type, uint32_t length) {
+    return xcb_get_property_unchecked(m_connection, 0, window,
+      property, type, 0, length);
+  }
+
+  // the properties of the last focused window are requested along,
+  // so usually no second round trip is needed
+  void send_batch(xcb_window_t window, bool active_window) {
+    const auto attributes = m_data.attributes;
+    auto& batch = m_batch.emplace();
+    batch.window = window;
+    if (active_window)
+      batch.active_window.cookie = get_property(m_root_window,
+        m_net_active_window_atom, XCB_ATOM_WINDOW, 1);
+    if (window && (attributes & FocusedWindow::Title))
+      batch.title.cookie = get_property(window, m_net_wm_name_atom,
+        m_utf8_string_atom, 1024);
+    if (window && (attributes & FocusedWindow::Class))
+      batch.class_.cookie = get_property(window, XCB_ATOM_WM_CLASS,
+        XCB_ATOM_STRING, 1024);
+    if (window && (attributes & FocusedWindow::Path))
+      batch.pid.cookie = get_property(window, m_net_wm_pid_atom,
+        XCB_ATOM_CARDINAL, 1);
+    xcb_flush(m_connection);
+  }
+
+  // returns false when the reply did not arrive yet,
+  // the reply stays null when the request failed
+  bool poll_reply(Property& property) {
+    if (!property.cookie.sequence)
+      return true;
+    auto data = std::add_pointer_t<void>{ };
+    auto error = std::add_pointer_t<xcb_generic_error_t>{ };
+    if (!xcb_poll_for_reply(m_connection, property.cookie.sequence,
+          &data, &error))
+      return false;
+    property.cookie.sequence = 0;
+    property.reply.reset(static_cast<xcb_get_property_reply_t*>(data));
+    std::free(error);
+    return true;
+  }
+
+  void discard_reply(Property& property) {
+    if (property.cookie.sequence)
+      xcb_discard_reply(m_connection, property.cookie.sequence);
   }
 
-  std::string get_window_title(Window window) {
-    auto type = Atom{ };
-    auto format = 0;
-    auto length = 0ul;
-    auto rest = 0ul;
-    auto data = std::add_pointer_t<unsigned char>{ };
-    if (window &&
-        XGetWindowProperty(m_display, window, m_net_wm_name_atom, 0, 1024,
-          False, m_utf8_string_atom, &type, &format, &length,
-          &rest, &data) == Success &&
-        data) {
-      auto result = std::string(reinterpret_cast<const char*>(data));
-      XFree(data);
-      return result;
+  static std::string_view get_string(const PropertyReply& reply) {
+    if (!reply || reply->format != 8)
+      return { };
+    const auto data = static_cast<const char*>(xcb_get_property_value(reply.get()));
+    const auto length = static_cast<size_t>(xcb_get_property_value_length(reply.get()));
+    // only up to the first null, which separates the class from the name
+    return std::string_view(data, strnlen(data, length));
+  }
+
+  static uint32_t get_value(const PropertyReply& reply) {
+    if (!reply || reply->format != 32 ||
+        xcb_get_property_value_length(reply.get()) < 4)
+      return 0;
+    return *static_cast<const uint32_t*>(xcb_get_property_value(reply.get()));
+  }
+
+  bool receive_batch() {
+    auto& batch = *m_batch;
+    const auto requested_active_window = (batch.active_window.cookie.sequence != 0);
+    if (!poll_reply(batch.active_window))
+      return false;
+    if (requested_active_window) {
+      const auto window = get_value(batch.active_window.reply);
+      if (window != batch.window) {
+        // the focus changed, request the properties of the new window
+        discard_reply(batch.title);
+        discard_reply(batch.class_);
+        discard_reply(batch.pid);
+        send_batch(window, false);
+        read_events();
+        return receive_batch();
+      }
     }
-    return { };
+    if (!poll_reply(batch.title) ||
+        !poll_reply(batch.class_) ||
+        !poll_reply(batch.pid))
+      return false;
+
+    const auto done = std::move(*m_batch);
+    m_batch.reset();
+    return apply_properties(done.window, get_string(done.title.reply),
+      get_string(done.class_.reply),
+      static_cast<int>(get_value(done.pid.reply)));
   }
 
-  std::string get_window_path(Window window) {
-    auto type = Atom{ };
-    auto format = 0;
-    auto length = 0ul;
-    auto rest = 0ul;
-    auto data = std::add_pointer_t<unsigned char>{ };
-    if (window &&
-        XGetWindowProperty(m_display, window, m_net_wm_pid_atom, 0, 1,
-          False, XA_CARDINAL, &type, &format, &length,
-          &rest, &data) == Success &&
-        data) {
-      const auto pid = *reinterpret_cast<unsigned long*>(data);
-      XFree(data);
-      return get_process_path_by_pid(pid);
+  bool apply_properties(xcb_window_t window, std::string_view window_title,
+      std::string_view window_class, int window_pid) {
+    if (window != m_focused_window || m_invalidated)
+      select_window_events(window);
+
+    const auto attributes = m_data.attributes;
+    if (window == m_focused_window && !m_invalidated &&
+        window_title == m_data.window_title)
+      return false;
+
+    // window handles can become invalid any time
+    if (!window ||
+        (window_class.empty() && (attributes & FocusedWindow::Class)) ||
+        (window_title.empty() && (attributes & FocusedWindow::Title))) {
+      // retry, properties might not be set yet
+      m_properties_changed = true;
+      return false;
     }
-    return { };
+
+    m_focused_window = window;
+    m_invalidated = false;
+    m_data.window_class = window_class;
+    m_data.window_title = window_title;
+    m_data.window_pid = window_pid;
+    return true;
+  }
+
+  void select_property_events(xcb_window_t window, bool enabled) {
+    const auto mask = uint32_t{ enabled ?
+      XCB_EVENT_MASK_PROPERTY_CHANGE : XCB_EVENT_MASK_NO_EVENT };
+    xcb_change_window_attributes(m_connection, window,
+      XCB_CW_EVENT_MASK, &mask);
+  }
+
+  void select_window_events(xcb_window_t window) {
+    // get notified when the title of the focused window changes
+    if (m_focused_window)
+      select_property_events(m_focused_window, false);
+    if (window && (m_data.attributes & FocusedWindow::Title))
+      select_property_events(window, true);
+    xcb_flush(m_connection);
   }
 };
 
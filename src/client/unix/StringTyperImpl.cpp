@@ -3,6 +3,8 @@
 #include "common/output.h"
 #include <codecvt>
 #include <locale>
+#include <mutex>
+#include <stdexcept>
 
 #pragma GCC diagnostic ignored "-Wdeprecated-declarations"
 #pragma clang diagnostic ignored "-Wdeprecated-declarations"
@@ -14,8 +16,27 @@ MakeStringTyperImpl make_string_typer_carbon;
 MakeStringTyperImpl make_string_typer_generic;
 
 std::u32string utf8_to_utf32(std::string_view utf8_string) {
-  auto utf8to32 = std::wstring_convert<std::codecvt_utf8<char32_t>, char32_t>();
-  return utf8to32.from_bytes(utf8_string.begin(), utf8_string.end());
+  // decode directly, constructing a std::wstring_convert is expensive
+  auto utf32_string = std::u32string();
+  utf32_string.reserve(utf8_string.size());
+  for (auto it = utf8_string.begin(); it != utf8_string.end(); ) {
+    const auto lead = static_cast<unsigned char>(*it++);
+    const auto length = (lead < 0x80 ? 0 : lead < 0xC2 ? -1 :
+      lead < 0xE0 ? 1 : lead < 0xF0 ? 2 : lead < 0xF5 ? 3 : -1);
+    if (length < 0 || std::distance(it, utf8_string.end()) < length)
+      throw std::range_error("Invalid UTF-8 string");
+
+    auto character = static_cast<char32_t>(length ?
+      lead & (0x3F >> length) : lead);
+    for (auto i = 0; i < length; ++i) {
+      const auto next = static_cast<unsigned char>(*it++);
+      if ((next & 0xC0) != 0x80)
+        throw std::range_error("Invalid UTF-8 string");
+      character = (character << 6) | (next & 0x3F);
+    }
+    utf32_string.push_back(character);
+  }
+  return utf32_string;
 }
 
 std::string utf16_to_utf8(std::u16string_view utf16_string) {
@@ -121,7 +142,13 @@ void StringTyperImpl::type(std::string_view string, const AddKey& add_key) const
 
 //-------------------------------------------------------------------------
 
-StringTyper::StringTyper() {
+std::shared_ptr<const StringTyperImpl> StringTyper::get_layout(bool update) {
+  static auto s_mutex = std::mutex();
+  static auto s_layout = std::shared_ptr<const StringTyperImpl>();
+  auto lock = std::lock_guard<std::mutex>(s_mutex);
+  if (s_layout && !update)
+    return s_layout;
+
   const auto systems = std::initializer_list<std::pair<const char*, MakeStringTyperImpl*>>{
 #if defined(ENABLE_WAYLAND)
     { "Wayland", &make_string_typer_wayland },
@@ -137,17 +164,22 @@ StringTyper::StringTyper() {
 
   for (auto [name, make_system] : systems)
     if (auto system = make_system()) {
-      m_impl = std::move(system);
+      s_layout = std::move(system);
       verbose("Initialized string typing with %s layout", name);
       break;
     }
+  return s_layout;
 }
 
-StringTyper::StringTyper(StringTyper&& rhs) noexcept = default;
-StringTyper& StringTyper::operator=(StringTyper&& rhs) noexcept = default;
-StringTyper::~StringTyper() = default;
+StringTyper::StringTyper() {
+  get_layout(false);
+}
+
+void StringTyper::update_layout() {
+  get_layout(true);
+}
 
 void StringTyper::type(std::string_view string, const AddKey& add_key) const {
-  if (m_impl)
-    m_impl->type(string, add_key);
+  if (auto layout = get_layout(false))
+    layout->type(string, add_key);
 }
@@ -1,6 +1,7 @@
 
 #include "TrayIcon.h"
 #include "common/output.h"
+#include <cstdlib>
 
 using MakeTrayIconImpl = std::unique_ptr<TrayIcon::IImpl>();
 MakeTrayIconImpl make_tray_icon_gtk;
@@ -12,6 +13,15 @@ TrayIcon::~TrayIcon() = default;
 
 void TrayIcon::initialize(Handler* handler, bool show_reload) {
 #if defined(ENABLE_APPINDICATOR)
+  // initializing GTK without a display only fails slowly
+  const auto has_display = [](const char* name) {
+    const auto value = std::getenv(name);
+    return (value && *value);
+  };
+  if (!has_display("DISPLAY") && !has_display("WAYLAND_DISPLAY")) {
+    verbose("No display for tray icon");
+    return;
+  }
   if (auto impl = make_tray_icon_gtk()) 
     if (impl->initialize(handler, show_reload)) {
       m_impl = std::move(impl);
@@ -20,6 +30,12 @@ void TrayIcon::initialize(Handler* handler, bool show_reload) {
 #endif
 }
 
+std::optional<Duration> TrayIcon::get_event_fds(std::vector<int>& fds) {
+  if (m_impl)
+    return m_impl->get_event_fds(fds);
+  return { };
+}
+
 void TrayIcon::update() {
   if (m_impl)
     m_impl->update();
@@ -1,6 +1,9 @@
 #pragma once
 
+#include "common/Duration.h"
 #include <memory>
+#include <optional>
+#include <vector>
 
 class TrayIcon {
 public:
@@ -18,6 +21,7 @@ public:
   public:
     virtual ~IImpl() = default;
     virtual bool initialize(Handler* handler, bool show_reload) = 0;
+    virtual std::optional<Duration> get_event_fds(std::vector<int>& fds) = 0;
     virtual void update() = 0;
   };
 
@@ -27,6 +31,9 @@ public:
   ~TrayIcon();
 
   void initialize(Handler* handler, bool show_reload);
+  // adds the file descriptors, which are readable when it needs to be
+  // updated, returns the time after which it needs to be updated anyway
+  std::optional<Duration> get_event_fds(std::vector<int>& fds);
   void update();
 
 private:
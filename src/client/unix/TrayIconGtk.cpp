@@ -2,6 +2,7 @@
 #if defined(ENABLE_APPINDICATOR)
 
 #include "TrayIcon.h"
+#include <utility>
 #include <gtk/gtk.h>
 #if __has_include(<libayatana-appindicator/app-indicator.h>)
 # include <libayatana-appindicator/app-indicator.h>
@@ -34,9 +35,16 @@ private:
   }
     
   AppIndicator* m_app_indicator{ };
+  // state of the main context between preparing and dispatching
+  std::vector<GPollFD> m_poll_fds;
+  gint m_poll_fd_count{ };
+  gint m_max_priority{ };
+  bool m_prepared{ };
 
 public:
   ~TrayIconGtk() {
+    if (m_prepared)
+      g_main_context_release(g_main_context_default());
     if (m_app_indicator)
       g_object_unref(m_app_indicator);
   }
@@ -77,9 +85,46 @@ public:
     return true;
   }
 
+  // the main context is iterated like g_main_context_iteration does,
+  // but the waiting is done by the caller, along with its other sources
+  std::optional<Duration> get_event_fds(std::vector<int>& fds) override {
+    const auto context = g_main_context_default();
+    if (!m_prepared) {
+      // retry when another thread owns the context
+      if (!g_main_context_acquire(context))
+        return std::chrono::milliseconds(50);
+      g_main_context_prepare(context, &m_max_priority);
+      m_prepared = true;
+    }
+    auto timeout = gint{ };
+    for (;;) {
+      const auto size = static_cast<gint>(m_poll_fds.size());
+      m_poll_fd_count = g_main_context_query(context, m_max_priority,
+        &timeout, m_poll_fds.data(), size);
+      if (m_poll_fd_count <= size)
+        break;
+      m_poll_fds.resize(static_cast<size_t>(m_poll_fd_count));
+    }
+    for (auto i = 0; i < m_poll_fd_count; ++i)
+      fds.push_back(m_poll_fds[static_cast<size_t>(i)].fd);
+    if (timeout < 0)
+      return { };
+    return std::chrono::milliseconds(timeout);
+  }
+
   void update() override {
-    while (gtk_events_pending())
-      gtk_main_iteration();
+    if (!std::exchange(m_prepared, false)) {
+      while (gtk_events_pending())
+        gtk_main_iteration();
+      return;
+    }
+    // get the state of the descriptors, which were waited for
+    const auto context = g_main_context_default();
+    g_poll(m_poll_fds.data(), static_cast<guint>(m_poll_fd_count), 0);
+    if (g_main_context_check(context, m_max_priority,
+          m_poll_fds.data(), m_poll_fd_count))
+      g_main_context_dispatch(context);
+    g_main_context_release(context);
   }
 };
 
@@ -0,0 +1,49 @@
+#include "common/output.h"
+#include <csignal>
+#include <cerrno>
+#include <string>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char** environ;
+
+namespace {
+  void catch_child([[maybe_unused]] int sig_num) {
+    // signals of children exiting at once are merged
+    const auto saved_errno = errno;
+    auto child_status = 0;
+    while (::waitpid(-1, &child_status, WNOHANG) > 0)
+      ;
+    errno = saved_errno;
+  }
+} // namespace
+
+bool execute_terminal_command(const std::string& command) {
+  // spawn does not copy the address space like fork,
+  // so it does not get slower with the size of the process
+  static const auto s_file_actions = []() {
+    // the children are reaped once they exited
+    ::signal(SIGCHLD, &catch_child);
+
+    auto actions = posix_spawn_file_actions_t{ };
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, 
+      STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    if (!g_verbose_output) {
+      posix_spawn_file_actions_addopen(&actions, 
+        STDOUT_FILENO, "/dev/null", O_RDWR, 0);
+      posix_spawn_file_actions_addopen(&actions, 
+        STDERR_FILENO, "/dev/null", O_RDWR, 0);
+    }
+    return actions;
+  }();
+
+  auto pid = pid_t{ };
+  char sh[] = "sh";
+  char c[] = "-c";
+  char* argv[] = { sh, c, const_cast<char*>(command.c_str()), nullptr };
+  return (posix_spawn(&pid, "/bin/sh", &s_file_actions, 
+    nullptr, argv, environ) == 0);
+}
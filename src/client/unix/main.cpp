@@ -1,16 +1,21 @@
 
 #include "TrayIcon.h"
+#include "client/AnalyzeConfig.h"
 #include "client/Settings.h"
 #include "client/ClientState.h"
 #include "config/StringTyper.h"
 #include "common/output.h"
 #include <sstream>
-#include <csignal>
+#include <future>
+#include <cmath>
 #include <unistd.h>
-#include <fcntl.h>
-#include <sys/wait.h>
+#include <poll.h>
 #include <pwd.h>
 
+#if defined(ENABLE_CARBON)
+# include <CoreFoundation/CoreFoundation.h>
+#endif
+
 namespace {
   class ClientStateImpl final : public ClientState, public TrayIcon::Handler {
   public:
@@ -24,7 +29,8 @@ namespace {
   };
   
   const auto system_config_path = std::filesystem::path("/etc/");
-  const auto update_interval = std::chrono::milliseconds(50);
+  // for the sources, which cannot be waited for
+  const auto poll_interval = std::chrono::milliseconds(50);
 
   Settings g_settings;
   bool g_shutdown;
@@ -79,16 +85,56 @@ namespace {
     g_shutdown = true;
   }
 
-  void catch_child([[maybe_unused]] int sig_num) {
-    auto child_status = 0;
-    ::wait(&child_status);
+#if defined(ENABLE_CARBON)
+  // runs the main run loop, which dispatches the system notifications,
+  // until one of the descriptors is readable or the timeout elapsed
+  void wait_until_readable(const std::vector<int>& fds,
+      std::optional<Duration> timeout, std::vector<pollfd>&) {
+    const auto run_loop = CFRunLoopGetMain();
+    const auto callback = [](CFFileDescriptorRef, CFOptionFlags, void*) {
+      CFRunLoopStop(CFRunLoopGetMain());
+    };
+    auto descriptors = std::vector<std::pair<CFFileDescriptorRef,
+      CFRunLoopSourceRef>>();
+    for (auto fd : fds) {
+      const auto descriptor = CFFileDescriptorCreate(nullptr, fd, false,
+        callback, nullptr);
+      CFFileDescriptorEnableCallBacks(descriptor, kCFFileDescriptorReadCallBack);
+      const auto source = CFFileDescriptorCreateRunLoopSource(nullptr,
+        descriptor, 0);
+      CFRunLoopAddSource(run_loop, source, kCFRunLoopDefaultMode);
+      descriptors.emplace_back(descriptor, source);
+    }
+
+    const auto seconds = (timeout ?
+      std::chrono::duration<double>(*timeout).count() : 1.0e10);
+    CFRunLoopRunInMode(kCFRunLoopDefaultMode, seconds, false);
+
+    for (auto [descriptor, source] : descriptors) {
+      CFRunLoopRemoveSource(run_loop, source, kCFRunLoopDefaultMode);
+      CFRelease(source);
+      CFFileDescriptorInvalidate(descriptor);
+      CFRelease(descriptor);
+    }
+  }
+#else
+  // returns when one of the descriptors is readable or the timeout elapsed
+  void wait_until_readable(const std::vector<int>& fds,
+      std::optional<Duration> timeout, std::vector<pollfd>& poll_fds) {
+    poll_fds.clear();
+    for (auto fd : fds)
+      poll_fds.push_back({ fd, POLLIN, 0 });
+    const auto milliseconds = (timeout ? static_cast<int>(std::ceil(
+      std::chrono::duration<double, std::milli>(*timeout).count())) : -1);
+    // interrupted by a signal, the sources are updated anyway
+    ::poll(poll_fds.data(), static_cast<nfds_t>(poll_fds.size()),
+      milliseconds);
   }
+#endif
 
-  void main_loop() {
-    auto tray_icon = TrayIcon();
-    if (!g_settings.no_tray_icon)
-      tray_icon.initialize(&g_state, !g_settings.auto_update_config);
-      
+  void main_loop(TrayIcon& tray_icon) {
+    auto fds = std::vector<int>();
+    auto poll_fds = std::vector<pollfd>();
     while (!g_shutdown) {
       if (g_settings.auto_update_config &&
           g_state.update_config(true))
@@ -99,33 +145,78 @@ namespace {
         if (!g_state.send_active_contexts())
           return;
 
-      if (!g_state.read_server_messages(update_interval))
+      if (!g_state.read_server_messages(Duration::zero()))
         return;
 
       g_state.accept_control_connection();
       g_state.read_control_messages();
       tray_icon.update();
+      if (g_shutdown)
+        break;
+
+      // wait until any of the sources needs to be updated
+      fds.clear();
+      auto timeout = g_state.get_event_fds(fds, poll_interval,
+        g_settings.auto_update_config);
+      if (const auto tray_timeout = tray_icon.get_event_fds(fds))
+        timeout = std::min(timeout.value_or(*tray_timeout), *tray_timeout);
+      wait_until_readable(fds, timeout, poll_fds);
     }
   }
 
+  // on startup the configuration is parsed and the server is connected
+  // in parallel, while the focused window detection is initialized on the
+  // main thread (some backends expect it)
+  bool start_up() {
+    auto config_loaded = std::async(std::launch::async, []() {
+      verbose("Loading configuration file '%s'",
+        g_settings.config_file_path.c_str());
+      return g_state.load_config(g_settings.config_file_path);
+    });
+    auto server_connected = std::async(std::launch::async, []() {
+      return g_state.connect_server().has_value();
+    });
+    const auto contexts_initialized = g_state.initialize_contexts();
+
+    // exit when there is no configuration and user cannot update it
+    if (!config_loaded.get() && g_settings.no_tray_icon) {
+      server_connected.wait();
+      return false;
+    }
+    if (!server_connected.get())
+      return false;
+
+    if (!g_state.send_config())
+      return false;
+
+    return contexts_initialized;
+  }
+
+  // the focused window detection is still initialized
+  bool reconnect() {
+    if (!g_state.connect_server())
+      return false;
+
+    return g_state.send_config();
+  }
+
   int connection_loop() {
-    for (;;) {
+    auto tray_icon = TrayIcon();
+    for (auto first = true; ; first = false) {
       if (g_shutdown)
         return 0;
 
-      if (!g_state.connect_server())
-        return 1;
-
-      if (!g_state.send_config())
+      if (!(first ? start_up() : reconnect()))
         return 1;
 
-      if (!g_state.initialize_contexts())
-        return 1;
+      // once the configuration was sent, so connecting is not delayed
+      if (first && !g_settings.no_tray_icon)
+        tray_icon.initialize(&g_state, !g_settings.auto_update_config);
 
       g_state.listen_for_control_connections();
 
       verbose("Entering update loop");
-      main_loop();
+      main_loop(tray_icon);
       verbose("Connection to keymapperd lost");
 
       g_state.on_server_disconnected();
@@ -178,19 +269,6 @@ namespace {
   }
 } // namespace
 
-bool execute_terminal_command(const std::string& command) {
-  if (fork() == 0) {
-    dup2(open("/dev/null", O_RDONLY), STDIN_FILENO);
-    if (!g_verbose_output) {
-      dup2(open("/dev/null", O_RDWR), STDOUT_FILENO);
-      dup2(open("/dev/null", O_RDWR), STDERR_FILENO);
-    }
-    execl("/bin/sh", "sh", "-c", command.c_str(), nullptr);
-    exit(1);
-  }
-  return true;
-}
-
 int main(int argc, char* argv[]) {
   if (!interpret_commandline(g_settings, argc, argv)) {
     print_help_message();
@@ -210,13 +288,18 @@ int main(int argc, char* argv[]) {
     return 0;
   }
 
-  ::signal(SIGCHLD, &catch_child);
-
-  verbose("Loading configuration file '%s'", g_settings.config_file_path.c_str());
-  if (!g_state.load_config(g_settings.config_file_path)) {
-    // exit when there is no configuration and user cannot update it
-    if (g_settings.no_tray_icon)
+  if (g_settings.analyze_config) {
+    if (!g_state.load_config(g_settings.config_file_path))
       return 1;
+    message("%s", analyze_config(g_state.config()).c_str());
+    return 0;
   }
+
+  if (!g_settings.record_focus_filename.empty() &&
+      !g_state.record_focus_log(g_settings.record_focus_filename)) {
+    error("Opening focus log file failed");
+    return 1;
+  }
+
   return connection_loop();
 }
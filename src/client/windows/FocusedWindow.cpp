@@ -1,58 +1,187 @@
 
 #include "client/FocusedWindow.h"
+#include "client/ProcessPathCache.h"
 #include "common/windows/win.h"
-#include <psapi.h>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstring>
-
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+
+namespace {
+  const auto max_title_length = 1024;
+  // a hung window does not delay the query longer
+  const auto title_query_timeout_ms = 100;
+  // the update does not wait longer, it is picked up by the next
+  const auto max_update_wait = std::chrono::milliseconds(10);
+} // namespace
+
+// The attributes are queried by a worker thread, so a hung window can not
+// stall the client. The results are picked up by the next update.
 class FocusedWindowImpl {
 private:
-  HWND m_current_window{ };
-  std::wstring m_current_title;
+  struct Properties {
+    HWND window;
+    std::string class_;
+    std::string title;
+    std::string path;
+  };
+
+  // accessed by both threads
+  std::mutex m_mutex;
+  std::condition_variable m_condition;
+  std::thread m_thread;
+  bool m_shutdown{ };
+  bool m_query_pending{ };
+  bool m_force_update{ };
+  FocusedWindow::Attributes m_attributes{ FocusedWindow::All };
+  std::optional<Properties> m_result;
+  std::atomic<HWND> m_current_window{ };
+
+  // accessed by worker thread
+  HWND m_queried_window{ };
+  std::wstring m_queried_title;
+  ProcessPathCache m_process_paths;
+
+  // accessed by main thread
   std::string m_class;
   std::string m_title;
   std::string m_path;
 
 public:
+  FocusedWindowImpl() = default;
+  FocusedWindowImpl(const FocusedWindowImpl&) = delete;
+  FocusedWindowImpl& operator=(const FocusedWindowImpl&) = delete;
+
+  ~FocusedWindowImpl() {
+    shutdown();
+  }
+
   HWND current() const { return m_current_window; }
   const std::string& window_class() const { return m_class; }
   const std::string& window_title() const { return m_title; }
   const std::string& window_path() const { return m_path; }
 
+  bool initialize() {
+    if (!m_thread.joinable())
+      m_thread = std::thread(&FocusedWindowImpl::thread_func, this);
+    return true;
+  }
+
+  void shutdown() {
+    if (!m_thread.joinable())
+      return;
+    {
+      auto lock = std::lock_guard(m_mutex);
+      m_shutdown = true;
+    }
+    m_condition.notify_all();
+    m_thread.join();
+  }
+
+  void set_attributes(FocusedWindow::Attributes attributes) {
+    // force update when more attributes are required
+    auto lock = std::lock_guard(m_mutex);
+    if (attributes & ~std::exchange(m_attributes, attributes))
+      m_force_update = true;
+  }
+
   bool update() {
-    const auto hwnd = GetForegroundWindow();
-    if (!hwnd)
+    if (!m_thread.joinable())
       return false;
 
-    const auto max_title_length = 1024;
-    auto buffer = std::array<wchar_t, max_title_length>();
-    GetWindowTextW(hwnd, buffer.data(), static_cast<int>(buffer.size()));
-
-    if (hwnd == m_current_window &&
-        !lstrcmpW(buffer.data(), m_current_title.c_str()))
+    auto lock = std::unique_lock(m_mutex);
+    if (!m_query_pending) {
+      m_query_pending = true;
+      m_condition.notify_all();
+    }
+    // usually the result is available at once
+    m_condition.wait_for(lock, max_update_wait,
+      [&]() { return !m_query_pending; });
+    if (!m_result)
       return false;
 
-    m_current_window = hwnd;
-    m_current_title = buffer.data();
-
-    GetClassNameW(hwnd, buffer.data(), static_cast<int>(buffer.size()));
-    m_class = wide_to_utf8(buffer.data());
-    m_title = wide_to_utf8(m_current_title);
-
-#if (PSAPI_VERSION >= 2)
-    m_path.clear();
-    auto pid = DWORD{ };
-    auto buffer_size = DWORD{ buffer.size() };
-    if (GetWindowThreadProcessId(hwnd, &pid))
-      if (const auto handle = OpenProcess(PROCESS_QUERY_INFORMATION | PROCESS_VM_READ, FALSE, pid)) {
-        if (QueryFullProcessImageNameW(handle, 0, buffer.data(), &buffer_size))
-          m_path = wide_to_utf8(buffer.data());
-        CloseHandle(handle);
-      }
-#endif
+    auto result = std::move(*m_result);
+    m_result.reset();
+    lock.unlock();
 
+    m_current_window = result.window;
+    m_class = std::move(result.class_);
+    m_title = std::move(result.title);
+    m_path = std::move(result.path);
     return true;
   }
+
+private:
+  void thread_func() {
+    auto lock = std::unique_lock(m_mutex);
+    for (;;) {
+      m_condition.wait(lock,
+        [&]() { return (m_query_pending || m_shutdown); });
+      if (m_shutdown)
+        break;
+      const auto attributes = m_attributes;
+      const auto force_update = std::exchange(m_force_update, false);
+      lock.unlock();
+
+      auto result = query(attributes, force_update);
+
+      lock.lock();
+      if (result)
+        m_result = std::move(result);
+      m_query_pending = false;
+      m_condition.notify_all();
+    }
+  }
+
+  std::wstring get_window_title(HWND hwnd) {
+    auto buffer = std::array<wchar_t, max_title_length>();
+    auto length = DWORD_PTR{ };
+    // fall back to the title the system keeps, when the window is hung
+    if (!SendMessageTimeoutW(hwnd, WM_GETTEXT, buffer.size(),
+          reinterpret_cast<LPARAM>(buffer.data()),
+          SMTO_ABORTIFHUNG | SMTO_BLOCK, title_query_timeout_ms, &length))
+      InternalGetWindowText(hwnd, buffer.data(),
+        static_cast<int>(buffer.size()));
+    buffer.back() = L'\0';
+    return buffer.data();
+  }
+
+  std::optional<Properties> query(FocusedWindow::Attributes attributes,
+      bool force_update) {
+    const auto hwnd = GetForegroundWindow();
+    if (!hwnd)
+      return std::nullopt;
+
+    auto title = std::wstring();
+    if (attributes & FocusedWindow::Title)
+      title = get_window_title(hwnd);
+
+    if (hwnd == m_queried_window && !force_update &&
+        title == m_queried_title)
+      return std::nullopt;
+
+    m_queried_window = hwnd;
+    m_queried_title = title;
+
+    auto result = Properties{ hwnd, { }, wide_to_utf8(title), { } };
+    if (attributes & FocusedWindow::Class) {
+      auto buffer = std::array<wchar_t, max_title_length>();
+      GetClassNameW(hwnd, buffer.data(), static_cast<int>(buffer.size()));
+      result.class_ = wide_to_utf8(buffer.data());
+    }
+
+    if (attributes & FocusedWindow::Path) {
+      auto process_id = DWORD{ };
+      GetWindowThreadProcessId(hwnd, &process_id);
+      result.path = m_process_paths.get_path(static_cast<int>(process_id));
+    }
+    return result;
+  }
 };
 
 FocusedWindow::FocusedWindow()
@@ -64,10 +193,15 @@ FocusedWindow& FocusedWindow::operator=(FocusedWindow&& rhs) noexcept = default;
 FocusedWindow::~FocusedWindow() = default;
 
 bool FocusedWindow::initialize() {
-  return true;
+  return m_impl->initialize();
 }
 
 void FocusedWindow::shutdown() {
+  m_impl->shutdown();
+}
+
+void FocusedWindow::set_attributes(Attributes attributes) {
+  m_impl->set_attributes(attributes);
 }
 
 bool FocusedWindow::update() {
@@ -6,6 +6,7 @@
 #include <array>
 #include <cassert>
 #include <map>
+#include <mutex>
 
 namespace {
   std::vector<std::pair<UINT, UINT>> get_vk_scan_codes() {
@@ -137,14 +138,23 @@ public:
 
 //-------------------------------------------------------------------------
 
-StringTyper::StringTyper() 
-  : m_impl(std::make_unique<StringTyperImpl>()) {
+std::shared_ptr<const StringTyperImpl> StringTyper::get_layout(bool update) {
+  static auto s_mutex = std::mutex();
+  static auto s_layout = std::shared_ptr<const StringTyperImpl>();
+  auto lock = std::lock_guard<std::mutex>(s_mutex);
+  if (!s_layout || update)
+    s_layout = std::make_shared<const StringTyperImpl>();
+  return s_layout;
 }
 
-StringTyper::StringTyper(StringTyper&& rhs) noexcept = default;
-StringTyper& StringTyper::operator=(StringTyper&& rhs) noexcept = default;
-StringTyper::~StringTyper() = default;
+StringTyper::StringTyper() {
+  get_layout(false);
+}
+
+void StringTyper::update_layout() {
+  get_layout(true);
+}
 
 void StringTyper::type(std::string_view string, const AddKey& add_key) const {
-  m_impl->type(string, add_key);
+  get_layout(false)->type(string, add_key);
 }
@@ -1,6 +1,7 @@
 
 #include "common/windows/win.h"
 #include <string>
+#include <unordered_map>
 
 namespace {
   bool file_exists(const std::wstring& filename) {
@@ -53,14 +54,23 @@ namespace {
 } // namespace
 
 bool execute_terminal_command(const std::string& command_utf8) {
-  auto command = utf8_to_wide(command_utf8);
-  const auto filename = get_filename(command);
-  if (!filename.empty() && 
-      !contains_terminal_control_characters(command.substr(filename.size()))) {
-    return create_process(command.data());
+  // resolving the filename queries the file system repeatedly,
+  // so the command lines of the action commands are cached
+  static auto s_command_lines = std::unordered_map<std::string, std::wstring>();
+  const auto it = s_command_lines.find(command_utf8);
+  auto command = (it != s_command_lines.end() ? it->second : std::wstring());
+  if (command.empty()) {
+    command = utf8_to_wide(command_utf8);
+    const auto filename = get_filename(command);
+    if (filename.empty() || 
+        contains_terminal_control_characters(command.substr(filename.size())))
+      command.insert(0, L"CMD /C ");
+    if (s_command_lines.size() < 256)
+      s_command_lines.emplace(command_utf8, command);
   }
-  else {
-    command.insert(0, L"CMD /C ");
-    return create_process(command.data());
+  if (!create_process(command.data())) {
+    s_command_lines.erase(command_utf8);
+    return false;
   }
+  return true;
 }
@@ -1,4 +1,5 @@
 
+#include "client/AnalyzeConfig.h"
 #include "client/Settings.h"
 #include "client/ClientState.h"
 #include "common/windows/LimitSingleInstance.h"
@@ -27,6 +28,7 @@ namespace {
   const auto TIMER_UPDATE_CONFIG = 1;
   const auto TIMER_UPDATE_CONTEXT = 2;
   const auto TIMER_CREATE_TRAY_ICON = 3;
+  const auto TIMER_PENDING_CONTEXT = 4;
   const auto IDI_EXIT = 1;
   const auto IDI_ACTIVE = 2;
   const auto IDI_HELP = 3;
@@ -45,6 +47,8 @@ namespace {
   bool g_session_changed;
   HWND g_window;
   NOTIFYICONDATAW g_tray_icon;
+  HWINEVENTHOOK g_foreground_hook;
+  HWINEVENTHOOK g_name_change_hook;
 
   void ClientStateImpl::show_next_key_info(
       const std::string& next_key_info) {
@@ -70,6 +74,55 @@ namespace {
     g_state.send_validate_state();
   }
 
+  void update_context() {
+    if (g_state.update_active_contexts())
+      g_state.send_active_contexts();
+    validate_state();
+
+    // apply a rate limited title change later
+    if (const auto delay = g_state.pending_update_delay())
+      SetTimer(g_window, TIMER_PENDING_CONTEXT, static_cast<UINT>(
+        std::chrono::ceil<std::chrono::milliseconds>(*delay).count()), NULL);
+  }
+
+  void CALLBACK handle_name_change(HWINEVENTHOOK, DWORD, HWND hwnd,
+      LONG object_id, LONG child_id, DWORD, DWORD) {
+    if (object_id == OBJID_WINDOW && child_id == CHILDID_SELF &&
+        hwnd == GetForegroundWindow())
+      update_context();
+  }
+
+  void CALLBACK handle_foreground_change(HWINEVENTHOOK, DWORD, HWND hwnd,
+      LONG, LONG, DWORD, DWORD) {
+    // only listen to title changes of the foreground window's process
+    if (g_name_change_hook)
+      UnhookWinEvent(std::exchange(g_name_change_hook, nullptr));
+    auto process_id = DWORD{ };
+    if (hwnd && GetWindowThreadProcessId(hwnd, &process_id))
+      g_name_change_hook = SetWinEventHook(
+        EVENT_OBJECT_NAMECHANGE, EVENT_OBJECT_NAMECHANGE, nullptr,
+        &handle_name_change, process_id, 0, WINEVENT_OUTOFCONTEXT);
+    update_context();
+  }
+
+  bool hook_focus_changes() {
+    g_foreground_hook = SetWinEventHook(
+      EVENT_SYSTEM_FOREGROUND, EVENT_SYSTEM_FOREGROUND, nullptr,
+      &handle_foreground_change, 0, 0, WINEVENT_OUTOFCONTEXT);
+    if (!g_foreground_hook)
+      return false;
+    handle_foreground_change(g_foreground_hook, EVENT_SYSTEM_FOREGROUND,
+      GetForegroundWindow(), OBJID_WINDOW, CHILDID_SELF, 0, 0);
+    return true;
+  }
+
+  void unhook_focus_changes() {
+    if (g_name_change_hook)
+      UnhookWinEvent(std::exchange(g_name_change_hook, nullptr));
+    if (g_foreground_hook)
+      UnhookWinEvent(std::exchange(g_foreground_hook, nullptr));
+  }
+
   bool connect() {
     if (auto socket = g_state.connect_server(); 
         socket && WSAAsyncSelect(*socket, g_window, 
@@ -161,6 +214,8 @@ namespace {
 
       case WM_WTSSESSION_CHANGE:
         g_session_changed = true;
+        if (g_foreground_hook)
+          update_context();
         return 0;
 
       case WM_APP_TRAY_NOTIFY:
@@ -228,9 +283,11 @@ namespace {
 
       case WM_TIMER: {
         if (wparam == TIMER_UPDATE_CONTEXT) {
-          if (g_state.update_active_contexts())
-            g_state.send_active_contexts();
-          validate_state();
+          update_context();
+        }
+        else if (wparam == TIMER_PENDING_CONTEXT) {
+          KillTimer(g_window, TIMER_PENDING_CONTEXT);
+          update_context();
         }
         else if (wparam == TIMER_UPDATE_CONFIG) {
           if (g_state.update_config(true))
@@ -310,6 +367,19 @@ int WINAPI wWinMain(HINSTANCE instance, HINSTANCE, LPWSTR, int) {
     return 0;
   }
 
+  if (g_settings.analyze_config) {
+    if (!g_state.load_config(g_settings.config_file_path))
+      return 1;
+    message("%s", analyze_config(g_state.config()).c_str());
+    return 0;
+  }
+
+  if (!g_settings.record_focus_filename.empty() &&
+      !g_state.record_focus_log(g_settings.record_focus_filename)) {
+    error("Opening focus log file failed");
+    return 1;
+  }
+
   const auto single_instance = LimitSingleInstance(
     "Global\\{0A7DECF3-1D6B-44B3-9596-0584BEC2A0C8}");
   if (single_instance.is_another_instance_running()) {
@@ -367,7 +437,12 @@ int WINAPI wWinMain(HINSTANCE instance, HINSTANCE, LPWSTR, int) {
     UOI_TIMERPROC_EXCEPTION_SUPPRESSION, &disable, sizeof(disable));
   if (g_settings.auto_update_config)
     SetTimer(g_window, TIMER_UPDATE_CONFIG, update_config_interval_ms, NULL);
-  SetTimer(g_window, TIMER_UPDATE_CONTEXT, update_context_inverval_ms, NULL);
+
+  // fall back to polling when focus changes can not be hooked
+  if (!hook_focus_changes()) {
+    verbose("Hooking focus changes failed");
+    SetTimer(g_window, TIMER_UPDATE_CONTEXT, update_context_inverval_ms, NULL);
+  }
 
   auto message = MSG{ };
   while (GetMessageW(&message, nullptr, 0, 0) > 0) {
@@ -375,6 +450,7 @@ int WINAPI wWinMain(HINSTANCE instance, HINSTANCE, LPWSTR, int) {
     DispatchMessageW(&message);
   }
   verbose("Exiting");
+  unhook_focus_changes();
 
   if (!g_settings.no_tray_icon)
     Shell_NotifyIconW(NIM_DELETE, &g_tray_icon);
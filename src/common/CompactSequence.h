@@ -0,0 +1,39 @@
+#pragma once
+
+#include "Connection.h"
+#include "runtime/KeyEvent.h"
+
+// Each event is a varint of the key code's difference to the previous one,
+// the state and whether a value follows, so most take one or two bytes.
+inline void write_compact_sequence(Serializer& s, const KeySequence& sequence) {
+  s.write_varint(static_cast<uint32_t>(sequence.size()));
+  auto previous = int32_t{ };
+  for (const auto& event : sequence) {
+    const auto key = static_cast<int32_t>(event.key);
+    const auto delta = key - previous;
+    previous = key;
+    const auto zigzag = (static_cast<uint32_t>(delta) << 1) ^
+      static_cast<uint32_t>(delta >> 31);
+    s.write_varint((zigzag << 5) | (event.value ? 0x10u : 0u) |
+      static_cast<uint32_t>(event.state));
+    if (event.value)
+      s.write_varint(event.value);
+  }
+}
+
+inline KeySequence read_compact_sequence(Deserializer& d) {
+  auto sequence = KeySequence();
+  const auto size = d.read_varint();
+  auto previous = int32_t{ };
+  for (auto i = 0u; i < size && d.can_read(1); ++i) {
+    const auto bits = d.read_varint();
+    const auto zigzag = bits >> 5;
+    const auto delta = static_cast<int32_t>((zigzag >> 1) ^ (~(zigzag & 1) + 1));
+    previous += delta;
+    const auto value = ((bits & 0x10) ? d.read_varint() : 0);
+    sequence.emplace_back(static_cast<Key>(previous),
+      static_cast<KeyState>(bits & 0x0F),
+      static_cast<KeyEvent::value_t>(value));
+  }
+  return sequence;
+}
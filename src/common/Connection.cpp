@@ -1,5 +1,6 @@
 
 #include "Connection.h"
+#include <algorithm>
 
 #if defined(_WIN32)
 
@@ -9,6 +10,9 @@
 
 #else // !defined(_WIN32)
 
+#include "unix/SharedRing.h"
+#include <array>
+#include <thread>
 #include <utility>
 #include <unistd.h>
 #include <sys/socket.h>
@@ -27,13 +31,19 @@ timeval to_timeval(const Duration& duration) {
   };
 }
 
-bool block_until_readable(Socket socket_fd, std::optional<Duration> timeout) {
+bool block_until_readable(Socket socket_fd, std::optional<Duration> timeout,
+    Socket other_fd) {
   auto read_set = fd_set{ };
   for (;;) {
     FD_ZERO(&read_set);
     FD_SET(socket_fd, &read_set);
+    auto max_fd = socket_fd;
+    if (other_fd != invalid_socket) {
+      FD_SET(other_fd, &read_set);
+      max_fd = std::max(max_fd, other_fd);
+    }
     auto timeoutval = (timeout ? to_timeval(timeout.value()) : timeval{ });
-    const auto result = ::select(static_cast<int>(socket_fd) + 1,
+    const auto result = ::select(static_cast<int>(max_fd) + 1,
       &read_set, nullptr, nullptr, (timeout ? &timeoutval : nullptr));
     if (result == -1 && errno == EINTR)
       continue;
@@ -41,6 +51,8 @@ bool block_until_readable(Socket socket_fd, std::optional<Duration> timeout) {
   }
 }
 
+Connection::Connection() = default;
+
 Connection::Connection(Socket socket) 
   : m_socket_fd(socket) {
 }
@@ -48,7 +60,13 @@ Connection::Connection(Socket socket)
 Connection::Connection(Connection&& rhs) noexcept
   : m_socket_fd(std::exchange(rhs.m_socket_fd, invalid_socket)),
     m_serializer(std::move(rhs.m_serializer)),
-    m_deserializer(std::move(rhs.m_deserializer)) {
+    m_deserializer(std::move(rhs.m_deserializer))
+#if !defined(_WIN32)
+    , m_send_ring(std::move(rhs.m_send_ring)),
+    m_receive_ring(std::move(rhs.m_receive_ring)),
+    m_received_fds(std::move(rhs.m_received_fds))
+#endif
+  {
 }
 
 Connection& Connection::operator=(Connection&& rhs) noexcept {
@@ -56,6 +74,11 @@ Connection& Connection::operator=(Connection&& rhs) noexcept {
   std::swap(m_socket_fd, tmp.m_socket_fd);
   std::swap(m_serializer, tmp.m_serializer);
   std::swap(m_deserializer, tmp.m_deserializer);
+#if !defined(_WIN32)
+  std::swap(m_send_ring, tmp.m_send_ring);
+  std::swap(m_receive_ring, tmp.m_receive_ring);
+  std::swap(m_received_fds, tmp.m_received_fds);
+#endif
   return *this;
 }
 
@@ -63,6 +86,18 @@ Connection::~Connection() {
   disconnect();
 }
 
+size_t Connection::buffer_footprint() const {
+  auto bytes = m_serializer.buffer.capacity() +
+    m_deserializer.buffer.capacity();
+#if !defined(_WIN32)
+  if (m_send_ring)
+    bytes += SharedRing::capacity;
+  if (m_receive_ring)
+    bytes += SharedRing::capacity;
+#endif
+  return bytes;
+}
+
 void Connection::disconnect() {
   if (m_socket_fd != invalid_socket) {
     ::close(m_socket_fd);
@@ -70,13 +105,29 @@ void Connection::disconnect() {
   }
   m_serializer.buffer.clear();
   m_deserializer.buffer.clear();
+  m_deserializer.pos = 0;
+#if !defined(_WIN32)
+  m_send_ring.reset();
+  m_receive_ring.reset();
+  for (auto fd : m_received_fds)
+    ::close(fd);
+  m_received_fds.clear();
+#endif
 }
 
 bool Connection::wait_for_message(std::optional<Duration> timeout) {
+#if !defined(_WIN32)
+  if (m_receive_ring && !m_receive_ring->empty())
+    return true;
+#endif
   return block_until_readable(m_socket_fd, timeout);
 }
 
 bool Connection::send(const char* buffer, size_t length) {
+#if !defined(_WIN32)
+  if (m_send_ring)
+    return send_to_ring(buffer, length);
+#endif
   while (length != 0) {
     const auto result = ::send(m_socket_fd, buffer,
       static_cast<int>(length), 0);
@@ -90,11 +141,47 @@ bool Connection::send(const char* buffer, size_t length) {
   return true;
 }
 
+bool Connection::send_queued(std::vector<char>& queue) {
+  if (queue.empty())
+    return true;
+#if !defined(_WIN32)
+  if (m_send_ring) {
+    if (!send_to_ring(queue.data(), queue.size()))
+      return false;
+    queue.clear();
+    return true;
+  }
+#endif
+  auto sent = size_t{ };
+  while (sent < queue.size()) {
+    const auto result = ::send(m_socket_fd, queue.data() + sent,
+      static_cast<int>(queue.size() - sent), 0);
+#if defined(_WIN32)
+    if (result == -1 && WSAGetLastError() == WSAEWOULDBLOCK)
+      break;
+#else
+    if (result == -1 && errno == EINTR)
+      continue;
+    if (result == -1 && errno == EWOULDBLOCK)
+      break;
+#endif
+    if (result <= 0)
+      return false;
+    sent += static_cast<size_t>(result);
+  }
+  queue.erase(queue.begin(), queue.begin() + static_cast<std::ptrdiff_t>(sent));
+  return true;
+}
+
 int Connection::recv(char* buffer, size_t length) {
   auto read = 0;
   while (length != 0) {
+#if defined(_WIN32)
     const auto result = ::recv(m_socket_fd, buffer,
       static_cast<int>(length), 0);
+#else
+    const auto result = recv_keep_descriptors(buffer, length);
+#endif
 #if defined(_WIN32)
     if (result == -1 && WSAGetLastError() == WSAEWOULDBLOCK)
       break;
@@ -113,12 +200,21 @@ int Connection::recv(char* buffer, size_t length) {
   return read;
 }
 
-bool Connection::recv(std::vector<char>& buffer) {
-  const auto buffer_grow_size = 1024;
-  auto pos = buffer.size();
+bool Connection::recv(std::vector<char>& buffer, bool* limited) {
+  *limited = false;
+#if !defined(_WIN32)
+  if (m_receive_ring)
+    return recv_from_ring(buffer, limited);
+#endif
+  const auto begin = buffer.size();
+  auto pos = begin;
   for (;;) {
+    if (pos - begin >= recv_max_size) {
+      *limited = true;
+      break;
+    }
     if (pos == buffer.size())
-      buffer.resize(buffer.size() + buffer_grow_size);
+      buffer.resize(buffer.size() + recv_grow_size);
     const auto result = recv(buffer.data() + pos, buffer.size() - pos);
     if (result < 0)
       return false;
@@ -129,3 +225,178 @@ bool Connection::recv(std::vector<char>& buffer) {
   buffer.resize(pos);
   return true;
 }
+
+#if !defined(_WIN32)
+
+bool Connection::create_send_ring(std::optional<Duration> timeout) {
+  // tell the other side also when creating failed
+  auto ring = SharedRing::create();
+  if (!send_fd(ring ? ring.fd() : -1))
+    return false;
+  ring.close_fd();
+
+  auto accepted = false;
+  if (!block_until_readable(m_socket_fd, timeout) ||
+      !read(&accepted))
+    return false;
+  if (accepted)
+    m_send_ring = std::make_unique<SharedRing>(std::move(ring));
+  return true;
+}
+
+bool Connection::accept_receive_ring(std::optional<Duration> timeout) {
+  const auto fd = recv_fd(timeout);
+  if (!fd)
+    return false;
+  auto ring = (*fd >= 0 ? SharedRing::map(*fd) : SharedRing());
+  const auto accepted = static_cast<bool>(ring);
+  if (!send(accepted))
+    return false;
+  if (accepted)
+    m_receive_ring = std::make_unique<SharedRing>(std::move(ring));
+  return true;
+}
+
+bool Connection::send_fd(int fd) {
+  // the descriptor is passed along with a byte
+  auto byte = char{ };
+  auto iov = iovec{ &byte, 1 };
+  auto msg = msghdr{ };
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = { };
+  if (fd >= 0) {
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    const auto cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    std::memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  }
+  for (;;) {
+    const auto result = ::sendmsg(m_socket_fd, &msg, 0);
+    if (result == -1 && (errno == EINTR || errno == EWOULDBLOCK))
+      continue;
+    return (result == 1);
+  }
+}
+
+std::optional<int> Connection::recv_fd(std::optional<Duration> timeout) {
+  auto byte = char{ };
+  auto iov = iovec{ &byte, 1 };
+  auto msg = msghdr{ };
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = { };
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  if (!block_until_readable(m_socket_fd, timeout))
+    return { };
+  for (;;) {
+    const auto result = ::recvmsg(m_socket_fd, &msg, 0);
+    if (result == -1 && errno == EINTR)
+      continue;
+    if (result != 1)
+      return { };
+    break;
+  }
+  const auto cmsg = CMSG_FIRSTHDR(&msg);
+  if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+      cmsg->cmsg_type != SCM_RIGHTS)
+    return -1;
+  auto fd = -1;
+  std::memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+  return fd;
+}
+
+bool Connection::send_descriptor(int fd) {
+  return (m_send_ring && fd >= 0 && send_fd(fd));
+}
+
+int Connection::receive_descriptor() {
+  // the byte it was passed with may not be drained yet,
+  // but it was sent before the message
+  auto byte = char{ };
+  while (m_received_fds.empty())
+    if (recv_keep_descriptors(&byte, 1) != 1)
+      return -1;
+  const auto fd = m_received_fds.front();
+  m_received_fds.erase(m_received_fds.begin());
+  return fd;
+}
+
+int Connection::recv_keep_descriptors(char* buffer, size_t length) {
+  auto iov = iovec{ buffer, length };
+  auto msg = msghdr{ };
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = { };
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  const auto result = ::recvmsg(m_socket_fd, &msg, 0);
+  for (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      auto fd = -1;
+      std::memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+      m_received_fds.push_back(fd);
+    }
+  return static_cast<int>(result);
+}
+
+bool Connection::send_to_ring(const char* buffer, size_t length) {
+  // wait while ring is full, but not while the other side is stuck
+  const auto max_stall = std::chrono::seconds(1);
+  auto stalled_since = Clock::now();
+  for (;;) {
+    auto ring_doorbell = false;
+    const auto written = m_send_ring->write(buffer, length, &ring_doorbell);
+    if (ring_doorbell) {
+      const auto doorbell = char{ };
+      const auto result = ::send(m_socket_fd, &doorbell, 1, 0);
+      if (result == -1 && errno != EINTR && errno != EWOULDBLOCK)
+        return false;
+    }
+    buffer += written;
+    length -= written;
+    if (length == 0)
+      return true;
+
+    if (written)
+      stalled_since = Clock::now();
+    else if (Clock::now() - stalled_since > max_stall)
+      return false;
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
+bool Connection::recv_from_ring(std::vector<char>& buffer, bool* limited) {
+  // drain doorbell, which also detects when the other side disconnected
+  auto doorbell = std::array<char, 64>{ };
+  for (;;) {
+    const auto result = recv(doorbell.data(), doorbell.size());
+    if (result < 0)
+      return false;
+    if (result < static_cast<int>(doorbell.size()))
+      break;
+  }
+
+  const auto begin = buffer.size();
+  for (;;) {
+    const auto pos = buffer.size();
+    if (pos - begin >= recv_max_size) {
+      *limited = true;
+      return true;
+    }
+    buffer.resize(pos + recv_grow_size);
+    const auto result = m_receive_ring->read(buffer.data() + pos,
+      recv_grow_size);
+    if (result < 0)
+      return false;
+    buffer.resize(pos + static_cast<size_t>(result));
+    if (static_cast<size_t>(result) < recv_grow_size)
+      return true;
+  }
+}
+
+#endif // !defined(_WIN32)
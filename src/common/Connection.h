@@ -2,6 +2,7 @@
 
 #include <cstdint>
 #include <cstring>
+#include <memory>
 #include <string>
 #include <vector>
 #include <optional>
@@ -16,10 +17,20 @@ using Socket = int;
 
 constexpr Socket invalid_socket = ~Socket{ };
 
-bool block_until_readable(Socket socket, std::optional<Duration> timeout);
+#if !defined(_WIN32)
+class SharedRing;
+#endif
+
+// returns when one of the sockets is readable or on timeout
+bool block_until_readable(Socket socket, std::optional<Duration> timeout,
+  Socket other_socket = invalid_socket);
 
 class Serializer {
 public:
+  void reserve(size_t size) {
+    buffer.reserve(buffer.size() + size);
+  }
+
   void write(const void* data, size_t size) {
     const auto offset = buffer.size();
     buffer.resize(buffer.size() + size);
@@ -36,6 +47,31 @@ public:
     write(string.data(), string.size());
   }
 
+  // 7 bits per byte, small values take a single byte
+  void write_varint(uint32_t value) {
+    while (value >= 0x80) {
+      write(static_cast<uint8_t>(value | 0x80));
+      value >>= 7;
+    }
+    write(static_cast<uint8_t>(value));
+  }
+
+  // small negative values also take a single byte
+  void write_signed_varint(int32_t value) {
+    write_varint((static_cast<uint32_t>(value) << 1) ^
+      static_cast<uint32_t>(value >> 31));
+  }
+
+  template<typename T, typename = std::enable_if_t<std::is_trivially_copyable_v<T>>>
+  void write_at(size_t offset, const T& value) {
+    std::memcpy(buffer.data() + offset, &value, sizeof(T));
+  }
+
+  size_t size() const { return buffer.size(); }
+  const char* data() const { return buffer.data(); }
+  // discards what was written after size
+  void truncate(size_t size) { buffer.resize(size); }
+
 private:
   friend class Connection;
   std::vector<char> buffer;
@@ -43,9 +79,21 @@ private:
 
 class Deserializer {
 public:
+  Deserializer() = default;
+  explicit Deserializer(std::vector<char> data)
+    : buffer(std::move(data)), begin(buffer.data()), it(begin),
+      end(begin + buffer.size()) {
+  }
+  // reads memory, which is owned by the caller
+  Deserializer(const char* data, size_t size)
+    : begin(data), it(data), end(data + size) {
+  }
+  Deserializer(Deserializer&&) noexcept = default;
+  Deserializer& operator=(Deserializer&&) noexcept = default;
+
   void read(void* data, size_t size) {
     if (size && can_read(size)) {
-      std::memcpy(data, &*it, size);
+      std::memcpy(data, it, size);
       it += size;
     }
   }
@@ -69,20 +117,44 @@ public:
     return result;
   }
 
+  uint32_t read_varint() {
+    auto value = uint32_t{ };
+    for (auto shift = 0; shift < 35 && can_read(1); shift += 7) {
+      const auto byte = read<uint8_t>();
+      value |= static_cast<uint32_t>(byte & 0x7F) << shift;
+      if (!(byte & 0x80))
+        break;
+    }
+    return value;
+  }
+
+  int32_t read_signed_varint() {
+    const auto value = read_varint();
+    return static_cast<int32_t>((value >> 1) ^ (~(value & 1) + 1));
+  }
+
   bool can_read(size_t length) const { 
-    return (it - buffer.begin() + length <= buffer.size()); 
+    return (static_cast<size_t>(end - it) >= length); 
   }
 
+  const char* data() const { return begin; }
+  size_t position() const { return static_cast<size_t>(it - begin); }
+  void seek(size_t position) { it = begin + position; }
+
 private:
   friend class Connection;
   std::vector<char> buffer;
-  std::vector<char>::iterator it;
+  const char* begin{ };
+  const char* it{ };
+  const char* end{ };
+  // begin of data not yet deserialized
+  size_t pos{ };
 };
 
 class Connection {
   using Size = uint32_t;
 public:
-  Connection() = default;
+  Connection();
   explicit Connection(Socket socket);
   Connection(Connection&& rhs) noexcept;
   Connection& operator=(Connection&& rhs) noexcept;
@@ -91,6 +163,23 @@ public:
   Socket socket() const { return m_socket_fd; }
   explicit operator bool() const { return m_socket_fd != invalid_socket; }
   void disconnect();
+  // bytes of the send and receive buffers, including shared memory
+  size_t buffer_footprint() const;
+
+#if !defined(_WIN32)
+  // lets the data sent to the other side pass through shared memory,
+  // the socket only wakes it up. Fails when it did not respond
+  bool create_send_ring(std::optional<Duration> timeout);
+  // maps the shared memory passed by create_send_ring when possible
+  bool accept_receive_ring(std::optional<Duration> timeout);
+  // passes a file descriptor, which the other side can take when it reads
+  // the next message. Only possible while sending through shared memory,
+  // the socket then only carries the doorbell
+  bool send_descriptor(int fd);
+  // the descriptor passed before the current message or -1.
+  // The caller takes ownership
+  int receive_descriptor();
+#endif
 
   template<typename T>
   bool send(const T& value) {
@@ -104,17 +193,32 @@ public:
 
   template<typename F> // void(Serializer&)
   bool send_message(F&& write_message) {
-    // serialize messages to buffer
+    // serialize messages to buffer, after room for the size
     auto& buffer = m_serializer.buffer;
-    buffer.clear();
+    buffer.resize(sizeof(Size));
     write_message(m_serializer);
 
-    // send message size and buffer
-    auto size = static_cast<Size>(buffer.size());
-    return send(reinterpret_cast<char*>(&size), sizeof(size)) &&
-           send(buffer.data(), buffer.size());
+    // send message size and buffer at once
+    const auto size = static_cast<Size>(buffer.size() - sizeof(Size));
+    std::memcpy(buffer.data(), &size, sizeof(Size));
+    return send(buffer.data(), buffer.size());
+  }
+
+  // appends a message to a queue, which is sent by send_queued
+  template<typename F> // void(Serializer&)
+  void queue_message(std::vector<char>& queue, F&& write_message) {
+    auto& buffer = m_serializer.buffer;
+    buffer.resize(sizeof(Size));
+    write_message(m_serializer);
+    const auto size = static_cast<Size>(buffer.size() - sizeof(Size));
+    std::memcpy(buffer.data(), &size, sizeof(Size));
+    queue.insert(queue.end(), buffer.begin(), buffer.end());
   }
 
+  // sends as much of the queue as possible without blocking
+  // and removes what was sent, returns false on error
+  bool send_queued(std::vector<char>& queue);
+
   template<typename F> // void(Deserializer&)
   bool read_messages(std::optional<Duration> timeout, F&& deserialize) {
     // block until message can be read or timeout
@@ -122,35 +226,65 @@ public:
         !wait_for_message(timeout))
       return false;
 
-    // read into buffer until it would block
     auto& buffer = m_deserializer.buffer;
-    if (!recv(buffer))
-      return false;
-
-    // deserialize complete messages
-    m_deserializer.it = buffer.begin();
-    while (m_deserializer.can_read(sizeof(Size))) {
-      const auto size = m_deserializer.read<Size>();
-      if (!m_deserializer.can_read(size)) {
-        m_deserializer.it -= sizeof(Size);
-        break;
+    auto& pos = m_deserializer.pos;
+    for (auto limited = true; limited; ) {
+      // move rest of last read to front only when buffer would grow
+      if (pos == buffer.size()) {
+        buffer.clear();
+        pos = 0;
       }
-      const auto end = m_deserializer.it + size;
-      deserialize(m_deserializer);
-      if (m_deserializer.it != end)
+      else if (pos && buffer.size() + recv_grow_size > buffer.capacity()) {
+        buffer.erase(buffer.begin(), buffer.begin() + pos);
+        pos = 0;
+      }
+
+      // read into buffer until it would block or the limit is reached,
+      // which is continued after the complete messages were deserialized
+      if (!recv(buffer, &limited))
         return false;
+
+      // deserialize complete messages
+      m_deserializer.begin = buffer.data();
+      m_deserializer.end = buffer.data() + buffer.size();
+      m_deserializer.it = buffer.data() + pos;
+      while (m_deserializer.can_read(sizeof(Size))) {
+        const auto size = m_deserializer.read<Size>();
+        if (!m_deserializer.can_read(size)) {
+          m_deserializer.it -= sizeof(Size);
+          break;
+        }
+        const auto end = m_deserializer.it + size;
+        deserialize(m_deserializer);
+        if (m_deserializer.it != end)
+          return false;
+      }
+      pos = m_deserializer.position();
     }
-    buffer.erase(buffer.begin(), m_deserializer.it);
     return true;
   }
 
 private:
+  static constexpr size_t recv_grow_size = 1024;
+  static constexpr size_t recv_max_size = 256 * 1024;
+
   bool wait_for_message(std::optional<Duration> timeout);
   bool send(const char* buffer, size_t length);
   int recv(char* buffer, size_t length);
-  bool recv(std::vector<char>& buffer);
+  bool recv(std::vector<char>& buffer, bool* limited);
 
   Socket m_socket_fd{ invalid_socket };
   Serializer m_serializer;
   Deserializer m_deserializer;
+#if !defined(_WIN32)
+  bool send_fd(int fd);
+  std::optional<int> recv_fd(std::optional<Duration> timeout);
+  bool send_to_ring(const char* buffer, size_t length);
+  bool recv_from_ring(std::vector<char>& buffer, bool* limited);
+  int recv_keep_descriptors(char* buffer, size_t length);
+
+  std::unique_ptr<SharedRing> m_send_ring;
+  std::unique_ptr<SharedRing> m_receive_ring;
+  std::vector<int> m_received_fds;
+#endif
 };
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "Duration.h"
+#include <cstdint>
+
+// Timestamps of the steps from a focus change until the new contexts are
+// active, in nanoseconds of the monotonic clock, which all processes share.
+// They are zero when the contexts were not updated because of a focus change.
+struct ContextSwitchTimes {
+  // when the client started querying the focused window
+  uint64_t focus_changed;
+  // when the client matched the contexts
+  uint64_t contexts_matched;
+  // when the client sent the active contexts
+  uint64_t sent;
+  // when the server read the message
+  uint64_t received;
+};
+
+inline uint64_t to_timestamp(Clock::time_point time) {
+  return static_cast<uint64_t>(std::chrono::duration_cast<
+    std::chrono::nanoseconds>(time.time_since_epoch()).count());
+}
+
+inline Clock::time_point from_timestamp(uint64_t timestamp) {
+  return Clock::time_point(std::chrono::duration_cast<Clock::duration>(
+    std::chrono::nanoseconds(timestamp)));
+}
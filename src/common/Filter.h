@@ -1,12 +1,13 @@
 #pragma once
 
+#include "Regex.h"
 #include <string>
 #include <optional>
-#include <regex>
+#include <vector>
 
 struct Filter {
   std::string string;
-  std::optional<std::regex> regex;
+  std::optional<Regex> regex;
   bool invert{ };
 
   bool matches(const std::string& text, bool substring) const {
@@ -17,7 +18,7 @@ struct Filter {
     if (string.empty())
       return true;
     if (regex.has_value())
-      return std::regex_search(text, *regex);
+      return regex->search(text);
     return (substring ?
       text.find(string) != std::string::npos :
       text == string);
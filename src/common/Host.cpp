@@ -2,7 +2,7 @@
 #include "Host.h"
 #include <thread>
 
-inline size_t get_version_hash() {
+size_t get_version_hash() {
   return std::hash<std::string_view>{ }(
 #if __has_include("_version.h")
 # include "_version.h"
@@ -127,6 +127,14 @@ bool Host::listen() {
   return true;
 }
 
+bool Host::adopt(Socket listen_fd) {
+  if (listen_fd == invalid_socket)
+    return false;
+  m_listen_fd = listen_fd;
+  make_non_blocking(m_listen_fd);
+  return true;
+}
+
 void Host::shutdown() {
   if (m_listen_fd != invalid_socket) {
     ::close(m_listen_fd);
@@ -2,6 +2,9 @@
 
 #include "Connection.h"
 
+// identifies the version, which client and server need to match
+size_t get_version_hash();
+
 class Host {
 public:
   explicit Host(std::string ipc_id);
@@ -11,6 +14,8 @@ public:
   Socket listen_socket() const { return m_listen_fd; }
 
   bool listen();
+  // continues listening on the socket of another process
+  bool adopt(Socket listen_fd);
   void shutdown();
   Connection accept(std::optional<Duration> timeout = std::nullopt);
   Connection connect(std::optional<Duration> timeout = std::nullopt);
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// counters of matching an input, collected while profiling is enabled
+struct InputProfile {
+  uint64_t invocations;
+  uint64_t might_matches;
+  uint64_t matches;
+  uint64_t nanoseconds;
+};
+
+// indexed by context and input
+using InputProfiles = std::vector<std::vector<InputProfile>>;
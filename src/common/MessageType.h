@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
 
 enum class MessageType : uint8_t {
@@ -16,4 +17,25 @@ enum class MessageType : uint8_t {
   next_key_info,
   inject_input,
   inject_output,
+  configuration_update,
+  subscribe,
+  virtual_key_changed,
+  active_contexts_changed,
+  statistics,
+  input_profile,
+  activate_configuration,
+  configuration_chunk,
+  set_virtual_key_states,
+  virtual_key_states,
+  active_contexts_delta,
+  configuration_memory,
 };
+
+// number of replaced configurations, which the server keeps, so the client
+// can activate them again. Both sides evict the least recently used
+constexpr size_t max_cached_configurations = 4;
+
+// larger configuration messages are passed in shared memory where possible,
+// otherwise split into chunks of this size, so neither side has to receive
+// the whole message at once
+constexpr size_t configuration_chunk_size = 64 * 1024;
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+#if defined(ENABLE_RE2)
+# include <stdexcept>
+# include <re2/re2.h>
+#else
+# include <regex>
+#endif
+
+// Regular expression of a filter. By default std::regex with ECMAScript
+// grammar is used. Building with ENABLE_RE2 selects RE2, which guarantees
+// linear time matching, but does not support backreferences and
+// lookaround assertions. Identical patterns share one compiled instance.
+class Regex {
+public:
+  Regex(std::string_view pattern, bool icase);
+  bool search(const std::string& text) const;
+  // identical patterns return the same instance
+  const void* instance() const { return m_impl.get(); }
+  // estimated bytes of the compiled expression
+  size_t memory_usage() const { return m_memory_usage; }
+
+private:
+#if defined(ENABLE_RE2)
+  using Impl = re2::RE2;
+#else
+  using Impl = std::regex;
+#endif
+  static std::shared_ptr<const Impl> compile(std::string_view pattern, bool icase);
+  static std::shared_ptr<const Impl> get_shared(std::string_view pattern, bool icase);
+  static size_t estimate_memory_usage(const Impl& impl, std::string_view pattern);
+
+  std::shared_ptr<const Impl> m_impl;
+  size_t m_memory_usage{ };
+};
+
+inline Regex::Regex(std::string_view pattern, bool icase)
+  : m_impl(get_shared(pattern, icase)),
+    m_memory_usage(estimate_memory_usage(*m_impl, pattern)) {
+}
+
+inline std::shared_ptr<const Regex::Impl> Regex::get_shared(
+    std::string_view pattern, bool icase) {
+  // pool of compiled patterns, which are still referenced
+  static auto s_mutex = std::mutex();
+  static auto s_pool = std::map<std::pair<std::string, bool>,
+    std::weak_ptr<const Impl>>();
+
+  auto lock = std::lock_guard<std::mutex>(s_mutex);
+  auto key = std::make_pair(std::string(pattern), icase);
+  if (auto it = s_pool.find(key); it != s_pool.end())
+    if (auto impl = it->second.lock())
+      return impl;
+
+  auto impl = compile(pattern, icase);
+  for (auto it = s_pool.begin(); it != s_pool.end(); )
+    it = (it->second.expired() ? s_pool.erase(it) : std::next(it));
+  s_pool[std::move(key)] = impl;
+  return impl;
+}
+
+#if defined(ENABLE_RE2)
+
+inline std::shared_ptr<const Regex::Impl> Regex::compile(
+    std::string_view pattern, bool icase) {
+  auto options = re2::RE2::Options();
+  options.set_case_sensitive(!icase);
+  options.set_log_errors(false);
+  auto impl = std::make_shared<const Impl>(
+    re2::StringPiece(pattern.data(), pattern.size()), options);
+  if (!impl->ok())
+    throw std::invalid_argument(impl->error());
+  return impl;
+}
+
+inline bool Regex::search(const std::string& text) const {
+  return re2::RE2::PartialMatch(text, *m_impl);
+}
+
+inline size_t Regex::estimate_memory_usage(const Impl& impl, std::string_view) {
+  // program size is the number of instructions, the reverse program and
+  // the DFA caches are built on demand and not counted
+  return sizeof(Impl) + 16 * static_cast<size_t>(impl.ProgramSize());
+}
+
+#else // !defined(ENABLE_RE2)
+
+inline std::shared_ptr<const Regex::Impl> Regex::compile(
+    std::string_view pattern, bool icase) {
+  return std::make_shared<const Impl>(pattern.data(), pattern.size(),
+    (icase ? std::regex::ECMAScript | std::regex::icase :
+             std::regex::ECMAScript));
+}
+
+inline bool Regex::search(const std::string& text) const {
+  return std::regex_search(text, *m_impl);
+}
+
+inline size_t Regex::estimate_memory_usage(const Impl&,
+    std::string_view pattern) {
+  // the NFA has about one or two states of 48 to 64 bytes per character
+  return sizeof(Impl) + 96 * pattern.size();
+}
+
+#endif // !defined(ENABLE_RE2)
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// counters of a stage of a configuration, collected while profiling
+// is enabled
+struct StageProfile {
+  // events the stage updated and output
+  uint64_t events_in;
+  uint64_t events_out;
+  // mappings which might match, so the stage held back its input
+  uint64_t might_match_holds;
+  // timeouts, virtual and action keys of previous stages passed on
+  uint64_t forwarded_server_events;
+  uint64_t update_nanoseconds;
+  // updates of the active contexts, which changed the stage's contexts
+  uint64_t context_updates;
+  uint64_t context_nanoseconds;
+};
+
+// indexed by stage
+using StageProfiles = std::vector<StageProfile>;
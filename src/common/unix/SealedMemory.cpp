@@ -0,0 +1,110 @@
+
+#include "SealedMemory.h"
+#include <cerrno>
+#include <cstring>
+#include <utility>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__APPLE__)
+# include <cstdio>
+#endif
+
+namespace {
+  bool write_all(int fd, const char* data, size_t size) {
+    while (size) {
+      const auto result = ::write(fd, data, size);
+      if (result < 0 && errno == EINTR)
+        continue;
+      if (result <= 0)
+        return false;
+      data += result;
+      size -= static_cast<size_t>(result);
+    }
+    return true;
+  }
+
+  bool verify_sealed_memory(int fd, size_t size) {
+    using stat_t = struct stat;
+    auto st = stat_t{ };
+    if (::fstat(fd, &st) != 0 ||
+        static_cast<size_t>(st.st_size) != size)
+      return false;
+#if defined(__linux__)
+    const auto required = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE;
+    const auto seals = ::fcntl(fd, F_GET_SEALS);
+    if (seals < 0 || (seals & required) != required)
+      return false;
+#endif
+    return true;
+  }
+} // namespace
+
+int SealedMemory::create(const char* data, size_t size) {
+#if defined(__linux__)
+  // written without mapping it, so it can be sealed against writing
+  const auto fd = ::memfd_create("keymapper-config",
+    MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0)
+    return -1;
+  if (!write_all(fd, data, size) ||
+      ::fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+        F_SEAL_WRITE | F_SEAL_SEAL) != 0) {
+    ::close(fd);
+    return -1;
+  }
+  return fd;
+#else
+  static auto s_counter = 0;
+  char name[32];
+  std::snprintf(name, sizeof(name), "/keymapper-config.%d.%d",
+    static_cast<int>(::getpid()), s_counter++);
+  const auto fd = ::shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0)
+    return -1;
+  ::shm_unlink(name);
+  // shared memory objects can only be written through a mapping
+  auto ptr = MAP_FAILED;
+  if (::ftruncate(fd, static_cast<off_t>(size)) == 0)
+    ptr = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (ptr == MAP_FAILED) {
+    ::close(fd);
+    return -1;
+  }
+  std::memcpy(ptr, data, size);
+  ::munmap(ptr, size);
+  return fd;
+#endif
+}
+
+SealedMemory SealedMemory::map(int fd, size_t size) {
+  auto memory = SealedMemory();
+  if (size && verify_sealed_memory(fd, size)) {
+    const auto ptr = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (ptr != MAP_FAILED) {
+      memory.m_data = static_cast<const char*>(ptr);
+      memory.m_size = size;
+    }
+  }
+  ::close(fd);
+  return memory;
+}
+
+SealedMemory::SealedMemory(SealedMemory&& rhs) noexcept
+  : m_data(std::exchange(rhs.m_data, nullptr)),
+    m_size(std::exchange(rhs.m_size, 0)) {
+}
+
+SealedMemory& SealedMemory::operator=(SealedMemory&& rhs) noexcept {
+  auto tmp = std::move(rhs);
+  std::swap(m_data, tmp.m_data);
+  std::swap(m_size, tmp.m_size);
+  return *this;
+}
+
+SealedMemory::~SealedMemory() {
+  if (m_data)
+    ::munmap(const_cast<char*>(m_data), m_size);
+}
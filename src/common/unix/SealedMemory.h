@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstddef>
+
+// Copy of a buffer in shared memory, which is passed to another process by
+// its file descriptor. On Linux it is sealed, so the receiver can rely on
+// neither its size nor its content to change while it is read.
+class SealedMemory {
+public:
+  // returns the file descriptor or -1
+  static int create(const char* data, size_t size);
+  // maps the memory read-only, takes ownership of the file descriptor
+  static SealedMemory map(int fd, size_t size);
+
+  SealedMemory() = default;
+  SealedMemory(SealedMemory&& rhs) noexcept;
+  SealedMemory& operator=(SealedMemory&& rhs) noexcept;
+  ~SealedMemory();
+
+  explicit operator bool() const { return m_data != nullptr; }
+  const char* data() const { return m_data; }
+  size_t size() const { return m_size; }
+
+private:
+  const char* m_data{ };
+  size_t m_size{ };
+};
@@ -0,0 +1,160 @@
+
+#include "SharedRing.h"
+#include <algorithm>
+#include <cstring>
+#include <new>
+#include <utility>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__APPLE__)
+# include <cstdio>
+#endif
+
+namespace {
+  int create_shared_memory(size_t size) {
+#if defined(__linux__)
+    // the consumer verifies that it can not be resized
+    const auto fd = ::memfd_create("keymapper",
+      MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0)
+      return -1;
+    if (::ftruncate(fd, static_cast<off_t>(size)) != 0 ||
+        ::fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0) {
+      ::close(fd);
+      return -1;
+    }
+    return fd;
+#else
+    // shared memory objects can not be resized once their size is set
+    static auto s_counter = 0;
+    char name[32];
+    std::snprintf(name, sizeof(name), "/keymapper.%d.%d",
+      static_cast<int>(::getpid()), s_counter++);
+    const auto fd = ::shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+      return -1;
+    ::shm_unlink(name);
+    if (::ftruncate(fd, static_cast<off_t>(size)) != 0) {
+      ::close(fd);
+      return -1;
+    }
+    return fd;
+#endif
+  }
+
+  bool verify_shared_memory(int fd, size_t size) {
+    using stat_t = struct stat;
+    auto st = stat_t{ };
+    if (::fstat(fd, &st) != 0 ||
+        static_cast<size_t>(st.st_size) != size)
+      return false;
+#if defined(__linux__)
+    // an unprivileged producer must not be able to truncate it
+    const auto seals = ::fcntl(fd, F_GET_SEALS);
+    if (seals < 0 || (seals & (F_SEAL_SHRINK | F_SEAL_GROW)) !=
+                             (F_SEAL_SHRINK | F_SEAL_GROW))
+      return false;
+#endif
+    return true;
+  }
+} // namespace
+
+SharedRing SharedRing::create() {
+  auto ring = SharedRing();
+  ring.m_fd = create_shared_memory(mapping_size);
+  if (ring.m_fd < 0)
+    return { };
+  auto ptr = ::mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE,
+    MAP_SHARED, ring.m_fd, 0);
+  if (ptr == MAP_FAILED)
+    return { };
+  ring.m_header = new (ptr) Header{ };
+  ring.m_data = static_cast<char*>(ptr) + (mapping_size - capacity);
+  return ring;
+}
+
+SharedRing SharedRing::map(int fd) {
+  auto ring = SharedRing();
+  ring.m_fd = fd;
+  if (!verify_shared_memory(fd, mapping_size))
+    return { };
+  auto ptr = ::mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE,
+    MAP_SHARED, ring.m_fd, 0);
+  if (ptr == MAP_FAILED)
+    return { };
+  ring.m_header = static_cast<Header*>(ptr);
+  ring.m_data = static_cast<char*>(ptr) + (mapping_size - capacity);
+  ring.close_fd();
+  return ring;
+}
+
+SharedRing::SharedRing(SharedRing&& rhs) noexcept
+  : m_header(std::exchange(rhs.m_header, nullptr)),
+    m_data(std::exchange(rhs.m_data, nullptr)),
+    m_fd(std::exchange(rhs.m_fd, -1)) {
+}
+
+SharedRing& SharedRing::operator=(SharedRing&& rhs) noexcept {
+  auto tmp = std::move(rhs);
+  std::swap(m_header, tmp.m_header);
+  std::swap(m_data, tmp.m_data);
+  std::swap(m_fd, tmp.m_fd);
+  return *this;
+}
+
+SharedRing::~SharedRing() {
+  if (m_header)
+    ::munmap(m_header, mapping_size);
+  close_fd();
+}
+
+void SharedRing::close_fd() {
+  if (m_fd >= 0) {
+    ::close(m_fd);
+    m_fd = -1;
+  }
+}
+
+size_t SharedRing::write(const char* data, size_t size, bool* ring_doorbell) {
+  const auto head = m_header->head.load(std::memory_order_relaxed);
+  const auto tail = m_header->tail.load(std::memory_order_acquire);
+  const auto used = head - tail;
+  if (used > capacity)
+    return 0;
+  size = std::min(size, static_cast<size_t>(capacity - used));
+
+  const auto offset = static_cast<size_t>(head % capacity);
+  const auto first = std::min(size, capacity - offset);
+  std::memcpy(m_data + offset, data, first);
+  std::memcpy(m_data, data + first, size - first);
+  m_header->head.store(head + size);
+
+  // consumer resets doorbell before reading
+  *ring_doorbell = (size && m_header->doorbell.exchange(1) == 0);
+  return size;
+}
+
+bool SharedRing::empty() const {
+  return (m_header->head.load() ==
+          m_header->tail.load(std::memory_order_relaxed));
+}
+
+int64_t SharedRing::read(char* data, size_t size) {
+  m_header->doorbell.store(0);
+  const auto head = m_header->head.load();
+  const auto tail = m_header->tail.load(std::memory_order_relaxed);
+  const auto available = head - tail;
+  if (available > capacity)
+    return -1;
+  size = std::min(size, static_cast<size_t>(available));
+
+  const auto offset = static_cast<size_t>(tail % capacity);
+  const auto first = std::min(size, capacity - offset);
+  std::memcpy(data, m_data + offset, first);
+  std::memcpy(data + first, m_data, size - first);
+  m_header->tail.store(tail + size, std::memory_order_release);
+  return static_cast<int64_t>(size);
+}
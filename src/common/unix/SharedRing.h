@@ -0,0 +1,50 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Single producer, single consumer byte stream in memory, which is shared
+// with another process by passing its file descriptor. The producer rings
+// the doorbell once, until the consumer has read the available data.
+class SharedRing {
+public:
+  static constexpr size_t capacity = 256 * 1024;
+
+  // producer creates, consumer maps the passed file descriptor,
+  // which the ring takes ownership of
+  static SharedRing create();
+  static SharedRing map(int fd);
+
+  SharedRing() = default;
+  SharedRing(SharedRing&& rhs) noexcept;
+  SharedRing& operator=(SharedRing&& rhs) noexcept;
+  ~SharedRing();
+
+  explicit operator bool() const { return m_header != nullptr; }
+  int fd() const { return m_fd; }
+  void close_fd();
+
+  // producer, returns the number of bytes written, which is less when full.
+  // ring_doorbell is set when the consumer needs to be woken up
+  size_t write(const char* data, size_t size, bool* ring_doorbell);
+
+  // consumer, resets the doorbell, so it needs to be drained before.
+  // returns the number of bytes read or -1 when the state is invalid
+  bool empty() const;
+  int64_t read(char* data, size_t size);
+
+private:
+  struct Header {
+    std::atomic<uint64_t> head;
+    std::atomic<uint64_t> tail;
+    std::atomic<uint32_t> doorbell;
+  };
+  static_assert(std::atomic<uint64_t>::is_always_lock_free &&
+                std::atomic<uint32_t>::is_always_lock_free);
+  static constexpr size_t mapping_size = 64 + capacity;
+
+  Header* m_header{ };
+  char* m_data{ };
+  int m_fd{ -1 };
+};
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "runtime/KeyEvent.h"
+#include "runtime/LogicalKeys.h"
 #include "common/Filter.h"
 
 struct Config {
@@ -8,6 +9,8 @@ struct Config {
     KeySequence input;
     // positive for direct-, negative for command output
     int output_index;
+    // line in the file which defined the mapping, 0 when generated
+    int line_no{ };
   };
 
   struct CommandOutput {
@@ -52,4 +55,11 @@ struct Config {
   std::vector<std::pair<std::string, Key>> virtual_key_aliases;
   std::vector<GrabDeviceFilter> grab_device_filters;
   std::vector<std::string> server_directives;
+  // the keys the logical keys in the contexts stand for
+  LogicalKeys logical_keys;
+  // keys which are forwarded by each stage, unless they are mapped
+  std::vector<Key> forward_modifiers;
+  // minimum time between updates of the active contexts,
+  // when only the window title changes
+  int title_update_interval_ms{ 100 };
 };
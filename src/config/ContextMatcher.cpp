@@ -0,0 +1,207 @@
+
+#include "ContextMatcher.h"
+#include <algorithm>
+#include <deque>
+
+namespace {
+  size_t get_hash(const std::string& window_class,
+      const std::string& window_title, const std::string& window_path) {
+    auto hash = std::hash<std::string>{ }(window_class);
+    hash = hash * 31 + std::hash<std::string>{ }(window_title);
+    hash = hash * 31 + std::hash<std::string>{ }(window_path);
+    return hash;
+  }
+} // namespace
+
+ContextMatcher::AttributeMatcher::AttributeMatcher(bool substring)
+  : m_substring(substring) {
+  // root node
+  m_nodes.push_back({ { }, 0, -1, -1 });
+}
+
+int ContextMatcher::AttributeMatcher::add_filter(const Filter& filter) {
+  if (filter.string.empty())
+    return -1;
+
+  const auto [it, inserted] = m_filter_ids.emplace(filter.string,
+    static_cast<int>(m_filter_ids.size()));
+  const auto filter_id = it->second;
+  if (!inserted)
+    return filter_id;
+
+  if (filter.regex.has_value())
+    m_regexes.emplace_back(filter_id, *filter.regex);
+  else if (m_substring)
+    add_substring(filter.string, filter_id);
+  else
+    m_exact_ids.emplace(filter.string, filter_id);
+  return filter_id;
+}
+
+void ContextMatcher::AttributeMatcher::add_substring(
+    const std::string& string, int filter_id) {
+  auto node = 0;
+  for (auto c : string) {
+    auto& next = m_nodes[node].next;
+    const auto it = std::lower_bound(next.begin(), next.end(),
+      std::make_pair(c, 0));
+    if (it != next.end() && it->first == c) {
+      node = it->second;
+      continue;
+    }
+    const auto new_node = static_cast<int>(m_nodes.size());
+    next.insert(it, { c, new_node });
+    m_nodes.push_back({ { }, 0, -1, -1 });
+    node = new_node;
+  }
+  m_nodes[node].output_filter_id = filter_id;
+}
+
+int ContextMatcher::AttributeMatcher::get_next(int node, char c) const {
+  for (;;) {
+    const auto& next = m_nodes[node].next;
+    const auto it = std::lower_bound(next.begin(), next.end(),
+      std::make_pair(c, 0));
+    if (it != next.end() && it->first == c)
+      return it->second;
+    if (node == 0)
+      return 0;
+    node = m_nodes[node].fail;
+  }
+}
+
+void ContextMatcher::AttributeMatcher::build_fail_links() {
+  // breadth first, so the fail links of shorter prefixes are known
+  auto queue = std::deque<int>();
+  for (const auto& [c, child] : m_nodes[0].next) {
+    m_nodes[child].fail = 0;
+    queue.push_back(child);
+  }
+  while (!queue.empty()) {
+    const auto node = queue.front();
+    queue.pop_front();
+    for (const auto& [c, child] : m_nodes[node].next) {
+      const auto fail = get_next(m_nodes[node].fail, c);
+      m_nodes[child].fail = fail;
+      m_nodes[child].output_link = (m_nodes[fail].output_filter_id >= 0 ?
+        fail : m_nodes[fail].output_link);
+      queue.push_back(child);
+    }
+  }
+}
+
+void ContextMatcher::AttributeMatcher::finalize() {
+  build_fail_links();
+  m_results.resize(m_filter_ids.size());
+}
+
+const std::vector<bool>& ContextMatcher::AttributeMatcher::match(
+    const std::string& text) {
+  std::fill(m_results.begin(), m_results.end(), false);
+
+  if (auto it = m_exact_ids.find(text); it != m_exact_ids.end())
+    m_results[it->second] = true;
+
+  if (m_nodes.size() > 1) {
+    auto node = 0;
+    for (auto c : text) {
+      node = get_next(node, c);
+      for (auto output = (m_nodes[node].output_filter_id >= 0 ?
+             node : m_nodes[node].output_link);
+           output >= 0; output = m_nodes[output].output_link)
+        m_results[m_nodes[output].output_filter_id] = true;
+    }
+  }
+
+  for (const auto& [filter_id, regex] : m_regexes)
+    m_results[filter_id] = regex.search(text);
+
+  return m_results;
+}
+
+//-------------------------------------------------------------------------
+
+ContextMatcher::ContextMatcher(const std::vector<Config::Context>& contexts) {
+  m_contexts.reserve(contexts.size());
+  for (const auto& context : contexts)
+    m_contexts.push_back({
+      m_class.add_filter(context.window_class_filter),
+      m_title.add_filter(context.window_title_filter),
+      m_path.add_filter(context.window_path_filter),
+      context.window_class_filter.invert,
+      context.window_title_filter.invert,
+      context.window_path_filter.invert,
+    });
+  m_class.finalize();
+  m_title.finalize();
+  m_path.finalize();
+}
+
+void ContextMatcher::match(const std::string& window_class,
+    const std::string& window_title,
+    const std::string& window_path,
+    std::vector<int>* indices) {
+  if (!m_caching)
+    return evaluate(window_class, window_title, window_path, indices);
+
+  const auto hash = get_hash(window_class, window_title, window_path);
+
+  if (auto it = m_cache_index.find(hash); it != m_cache_index.end()) {
+    const auto entry = it->second;
+    if (entry->window_class == window_class &&
+        entry->window_title == window_title &&
+        entry->window_path == window_path) {
+      m_cache.splice(m_cache.begin(), m_cache, entry);
+      *indices = entry->indices;
+      return;
+    }
+    // replace entry with colliding hash
+    m_cache.erase(entry);
+    m_cache_index.erase(it);
+  }
+
+  evaluate(window_class, window_title, window_path, indices);
+
+  if (m_cache.size() >= max_cache_entries) {
+    // evict least recently used
+    m_cache_index.erase(m_cache.back().hash);
+    m_cache.pop_back();
+  }
+  m_cache.push_front({ hash, window_class, window_title,
+    window_path, *indices });
+  m_cache_index[hash] = m_cache.begin();
+}
+
+void ContextMatcher::set_caching(bool enabled) {
+  m_caching = enabled;
+  m_cache.clear();
+  m_cache_index.clear();
+}
+
+bool ContextMatcher::title_filters_differ(const std::string& window_title_a,
+    const std::string& window_title_b) {
+  m_title_results = m_title.match(window_title_a);
+  return (m_title.match(window_title_b) != m_title_results);
+}
+
+void ContextMatcher::evaluate(const std::string& window_class,
+    const std::string& window_title,
+    const std::string& window_path,
+    std::vector<int>* indices) {
+  const auto& class_results = m_class.match(window_class);
+  const auto& title_results = m_title.match(window_title);
+  const auto& path_results = m_path.match(window_path);
+  const auto matches = [](const std::vector<bool>& results,
+      int filter_id, bool invert) {
+    return (filter_id < 0 || results[filter_id]) ^ invert;
+  };
+
+  indices->clear();
+  for (auto i = size_t{ }; i < m_contexts.size(); ++i) {
+    const auto& context = m_contexts[i];
+    if (matches(class_results, context.class_id, context.invert_class) &&
+        matches(title_results, context.title_id, context.invert_title) &&
+        matches(path_results, context.path_id, context.invert_path))
+      indices->push_back(static_cast<int>(i));
+  }
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include "Config.h"
+#include <list>
+#include <unordered_map>
+
+// Matches the window filters of all contexts at once. Identical filters
+// are only evaluated once, exact filters are looked up and substring
+// filters are searched for in a single pass over the text.
+// The results for the recently focused windows are cached.
+class ContextMatcher {
+public:
+  ContextMatcher() = default;
+  explicit ContextMatcher(const std::vector<Config::Context>& contexts);
+
+  // fills the sorted indices of the matching contexts
+  void match(const std::string& window_class,
+    const std::string& window_title,
+    const std::string& window_path,
+    std::vector<int>* indices);
+  // whether the titles match different title filters,
+  // otherwise changing between them does not change the matching contexts
+  bool title_filters_differ(const std::string& window_title_a,
+    const std::string& window_title_b);
+  // evaluates the filters for every window, for benchmarking
+  void set_caching(bool enabled);
+
+private:
+  class AttributeMatcher {
+  public:
+    explicit AttributeMatcher(bool substring = false);
+
+    // returns -1 for empty filters
+    int add_filter(const Filter& filter);
+    void finalize();
+    // results are indexed by the filter id
+    const std::vector<bool>& match(const std::string& text);
+
+  private:
+    // Aho-Corasick automaton of the substring filters
+    struct Node {
+      std::vector<std::pair<char, int>> next;
+      int fail;
+      int output_filter_id;
+      int output_link;
+    };
+    int get_next(int node, char c) const;
+    void add_substring(const std::string& string, int filter_id);
+    void build_fail_links();
+
+    bool m_substring;
+    std::unordered_map<std::string, int> m_filter_ids;
+    std::unordered_map<std::string, int> m_exact_ids;
+    std::vector<std::pair<int, Regex>> m_regexes;
+    std::vector<Node> m_nodes;
+    std::vector<bool> m_results;
+  };
+
+  void evaluate(const std::string& window_class,
+    const std::string& window_title,
+    const std::string& window_path,
+    std::vector<int>* indices);
+
+  struct CacheEntry {
+    size_t hash;
+    std::string window_class;
+    std::string window_title;
+    std::string window_path;
+    std::vector<int> indices;
+  };
+  static constexpr size_t max_cache_entries = 64;
+
+  struct ContextFilters {
+    int class_id;
+    int title_id;
+    int path_id;
+    bool invert_class;
+    bool invert_title;
+    bool invert_path;
+  };
+
+  AttributeMatcher m_class{ false };
+  AttributeMatcher m_title{ true };
+  AttributeMatcher m_path{ true };
+  std::vector<bool> m_title_results;
+  std::vector<ContextFilters> m_contexts;
+  // most recently used first
+  std::list<CacheEntry> m_cache;
+  bool m_caching{ true };
+  std::unordered_map<size_t, std::list<CacheEntry>::iterator> m_cache_index;
+};
@@ -0,0 +1,137 @@
+
+#include "OptimizeConfig.h"
+#include <algorithm>
+#include <unordered_map>
+
+namespace {
+  uint64_t get_hash(const KeySequence& sequence) {
+    // FNV-1a
+    auto hash = uint64_t{ 14695981039346656037ull };
+    for (const auto& event : sequence)
+      hash = (hash ^ (static_cast<uint64_t>(event.key) << 20 |
+                      static_cast<uint64_t>(event.state) << 16 |
+                      event.value)) * 1099511628211ull;
+    return hash;
+  }
+
+  bool equal(const Filter& a, const Filter& b) {
+    return (a.string == b.string && a.invert == b.invert);
+  }
+
+  bool has_equal_filters(const Config::Context& a, const Config::Context& b) {
+    return (equal(a.window_class_filter, b.window_class_filter) &&
+            equal(a.window_title_filter, b.window_title_filter) &&
+            equal(a.window_path_filter, b.window_path_filter) &&
+            equal(a.device_filter, b.device_filter) &&
+            equal(a.device_id_filter, b.device_id_filter) &&
+            a.modifier_filter == b.modifier_filter &&
+            a.invert_modifier_filter == b.invert_modifier_filter &&
+            a.system_filter_matched == b.system_filter_matched);
+  }
+
+  bool has_context_active_input(const Config::Context& context) {
+    return std::any_of(context.inputs.begin(), context.inputs.end(),
+      [](const Config::Input& input) {
+        return (input.input.front().key == Key::ContextActive);
+      });
+  }
+
+  void append_context(Config::Context& context, Config::Context&& next) {
+    const auto output_offset = static_cast<int>(context.outputs.size());
+    for (auto& input : next.inputs) {
+      if (input.output_index >= 0)
+        input.output_index += output_offset;
+      context.inputs.push_back(std::move(input));
+    }
+    for (auto& output : next.outputs)
+      context.outputs.push_back(std::move(output));
+    // a later command output overrides an earlier one
+    for (auto& command : next.command_outputs)
+      context.command_outputs.push_back(std::move(command));
+  }
+
+  int merge_contexts(std::vector<Config::Context>& contexts) {
+    auto merged = size_t{ };
+    for (auto i = size_t{ 1 }; i < contexts.size(); ++i) {
+      auto& context = contexts[i];
+      const auto prev_index = i - merged - 1;
+      auto& prev = contexts[prev_index];
+      // a fallthrough context before would also activate the next context.
+      // only the first ContextActive input of a context is applied
+      const auto can_merge = (!prev.fallthrough && !context.fallthrough &&
+        !context.begin_stage && has_equal_filters(prev, context) &&
+        (prev_index == 0 || !contexts[prev_index - 1].fallthrough) &&
+        !(has_context_active_input(prev) && has_context_active_input(context)));
+
+      if (can_merge) {
+        append_context(prev, std::move(context));
+        ++merged;
+      }
+      else if (merged) {
+        contexts[i - merged] = std::move(context);
+      }
+    }
+    contexts.resize(contexts.size() - merged);
+    return static_cast<int>(merged);
+  }
+
+  void remove_unreferenced_outputs(Config::Context& context) {
+    auto& outputs = context.outputs;
+    auto output_indices = std::vector<int>(outputs.size(), -1);
+    for (const auto& input : context.inputs)
+      if (input.output_index >= 0)
+        output_indices[input.output_index] = 0;
+
+    auto count = 0;
+    for (auto i = size_t{ }; i < outputs.size(); ++i)
+      if (output_indices[i] >= 0) {
+        output_indices[i] = count;
+        if (static_cast<size_t>(count) != i)
+          outputs[count] = std::move(outputs[i]);
+        ++count;
+      }
+    outputs.resize(count);
+
+    for (auto& input : context.inputs)
+      if (input.output_index >= 0)
+        input.output_index = output_indices[input.output_index];
+  }
+
+  int remove_shadowed_mappings(Config::Context& context) {
+    // an input can not match, when an equal input before has a
+    // direct output or is the same command
+    auto& inputs = context.inputs;
+    auto earlier_inputs = std::unordered_map<uint64_t, std::vector<size_t>>();
+    auto kept = size_t{ };
+    for (auto i = size_t{ }; i < inputs.size(); ++i) {
+      auto& earlier = earlier_inputs[get_hash(inputs[i].input)];
+      const auto shadowed = std::any_of(earlier.begin(), earlier.end(),
+        [&](size_t j) {
+          return (inputs[j].input == inputs[i].input &&
+            (inputs[j].output_index >= 0 ||
+             inputs[j].output_index == inputs[i].output_index));
+        });
+      if (shadowed)
+        continue;
+      earlier.push_back(kept);
+      if (kept != i)
+        inputs[kept] = std::move(inputs[i]);
+      ++kept;
+    }
+
+    const auto removed = static_cast<int>(inputs.size() - kept);
+    if (removed) {
+      inputs.resize(kept);
+      remove_unreferenced_outputs(context);
+    }
+    return removed;
+  }
+} // namespace
+
+OptimizeConfigResult optimize_config(Config& config) {
+  auto result = OptimizeConfigResult{ };
+  result.merged_contexts = merge_contexts(config.contexts);
+  for (auto& context : config.contexts)
+    result.removed_mappings += remove_shadowed_mappings(context);
+  return result;
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include "Config.h"
+
+struct OptimizeConfigResult {
+  int merged_contexts;
+  int removed_mappings;
+};
+
+// Merges adjacent contexts, which are always active together, and removes
+// mappings, which can never match because of an equal input before.
+OptimizeConfigResult optimize_config(Config& config);
@@ -6,12 +6,17 @@
 #include "common/expand_path.h"
 #include <cassert>
 #include <cctype>
+#include <cstring>
 #include <istream>
 #include <algorithm>
 #include <iterator>
 #include <fstream>
+#include <sstream>
 #include <utility>
 #include <charconv>
+#include <atomic>
+#include <future>
+#include <thread>
 
 #if defined(__linux)
 const char* current_system = "Linux";
@@ -58,6 +63,10 @@ namespace {
       }) != cend(sequence);
   }
 
+  bool contains(const KeySequence& sequence, const KeyEvent& event) {
+    return std::find(cbegin(sequence), cend(sequence), event) != cend(sequence);
+  }
+
   template<typename T>
   bool contains(const std::vector<T>& vector, const T& item) {
     return std::find(cbegin(vector), cend(vector), item) != cend(vector);
@@ -173,6 +182,35 @@ namespace {
     return false;
   }
 
+  // FNV-1a
+  const auto hash_offset_basis = uint64_t{ 14695981039346656037ull };
+
+  uint64_t get_hash(std::string_view string,
+      uint64_t hash = hash_offset_basis) {
+    for (auto c : string)
+      hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+    return hash;
+  }
+
+  uint64_t combine_hash(uint64_t hash, uint64_t value) {
+    return get_hash(std::string_view(
+      reinterpret_cast<const char*>(&value), sizeof(value)), hash);
+  }
+
+  std::optional<std::string> read_file(const std::string& filename) {
+    auto is = std::ifstream(filename, std::ios::binary | std::ios::ate);
+    if (!is.good())
+      return { };
+    // read at once, instead of character by character
+    auto contents = std::string(static_cast<size_t>(is.tellg()), '\0');
+    is.seekg(0);
+    is.read(contents.data(), static_cast<std::streamsize>(contents.size()));
+    contents.resize(static_cast<size_t>(is.gcount()));
+    return contents;
+  }
+
+  const auto max_preprocess_cache_size = size_t{ 1024 };
+
   int get_formal_argument_count(std::string_view expression) {
     auto max = 0;
     auto it = expression.begin();
@@ -184,17 +222,110 @@ namespace {
   }
 } // namespace
 
+// parses the files included by the main file on worker threads,
+// the fragments are taken in the order of the include directives
+class ParseConfig::ParallelIncludes {
+public:
+  ParallelIncludes(IncludeBase base,
+      std::vector<std::pair<size_t, std::string>> includes)
+    : m_base(std::move(base)),
+      m_includes(std::move(includes)),
+      m_promises(m_includes.size()) {
+
+    for (auto& promise : m_promises)
+      m_fragments.push_back(promise.get_future());
+    const auto thread_count = std::min(m_includes.size(),
+      static_cast<size_t>(std::max(std::thread::hardware_concurrency(), 1u)));
+    for (auto i = size_t{ }; i < thread_count; ++i)
+      m_threads.emplace_back(&ParallelIncludes::run, this);
+  }
+
+  ParallelIncludes(const ParallelIncludes&) = delete;
+  ParallelIncludes& operator=(const ParallelIncludes&) = delete;
+
+  ~ParallelIncludes() {
+    // do not start parsing the fragments which were not taken
+    m_next = m_includes.size();
+    for (auto& thread : m_threads)
+      thread.join();
+  }
+
+  const IncludeBase& base() const { return m_base; }
+
+  // the main file line after the last include
+  size_t end_line() const {
+    return (m_includes.empty() ? 0 : m_includes.back().first + 1);
+  }
+
+  std::optional<IncludeFragment> take(size_t line, const std::string& filename) {
+    // skip includes which were not reached, e.g. because of a system filter
+    while (m_taken < m_includes.size() && m_includes[m_taken].first < line)
+      ++m_taken;
+    if (m_taken == m_includes.size() ||
+        m_includes[m_taken].first != line ||
+        m_includes[m_taken].second != filename)
+      return { };
+    return m_fragments[m_taken++].get();
+  }
+
+private:
+  void run() {
+    for (;;) {
+      const auto index = m_next++;
+      if (index >= m_includes.size())
+        break;
+      m_promises[index].set_value(parse_include_fragment(
+        m_base, m_includes[index].second));
+    }
+  }
+
+  const IncludeBase m_base;
+  const std::vector<std::pair<size_t, std::string>> m_includes;
+  std::vector<std::promise<IncludeFragment>> m_promises;
+  std::vector<std::future<IncludeFragment>> m_fragments;
+  std::atomic<size_t> m_next{ };
+  size_t m_taken{ };
+  std::vector<std::thread> m_threads;
+};
+
+ParseConfig::ParseConfig() = default;
+ParseConfig::ParseConfig(ParseConfig&&) = default;
+ParseConfig& ParseConfig::operator=(ParseConfig&&) = default;
+
+ParseConfig::~ParseConfig() = default;
+
 Config ParseConfig::operator()(std::istream& is,
+    const std::filesystem::path& base_path) {
+  auto contents = std::ostringstream();
+  contents << is.rdbuf();
+  return (*this)(contents.str(), base_path);
+}
+
+Config ParseConfig::operator()(std::string_view contents,
     const std::filesystem::path& base_path) try {
   m_base_path = base_path;
   m_filename = { };
   m_line_no = 0;
   m_include_level = 0;
+  m_included_files.clear();
+  m_included_file_hashes.clear();
+  m_parsed_hash = get_hash(base_path.string());
+  // keep checkpoints restored by a failed parse
+  m_include_checkpoints.merge(m_new_include_checkpoints);
+  m_new_include_checkpoints.clear();
+  m_main_lines = nullptr;
+  m_parallel_includes.reset();
+  ++m_definitions_version;
   m_preprocess_level = 0;
   m_config = { };
   m_commands.clear();
+  m_command_indices.clear();
   m_macros.clear();
+  m_preprocess_cache.clear();
   m_logical_keys.clear();
+  m_logical_key_indices.clear();
+  m_parsed_inputs.clear();
+  m_parsed_outputs.clear();
   m_system_filter_matched = true;
   m_after_empty_context_block = false;
   m_enforce_lowercase_commands = { };
@@ -212,7 +343,7 @@ Config ParseConfig::operator()(std::istream& is,
   add_logical_key("Alt", Key::AltLeft, Key::AltRight);
   add_logical_key("Meta", Key::MetaLeft, Key::MetaRight);
   
-  parse_file(is);
+  parse_file(contents);
 
   // check if there is a mapping for each command (to reduce typing errors)
   if (!m_allow_unmapped_commands)
@@ -220,9 +351,6 @@ Config ParseConfig::operator()(std::istream& is,
       if (!command.mapped)
         throw ConfigError("Command '" + command.name + "' was not mapped");
 
-  // prepend forward-modifier mappings in each stage. e.g.: ShiftLeft >> ShiftLeft
-  prepend_forward_modifier_mappings();
-
   // remove contexts of other systems or which are empty
   optimize_contexts();
 
@@ -231,14 +359,27 @@ Config ParseConfig::operator()(std::istream& is,
     const auto& [name, both, left, right] = *it;
     replace_logical_key(both, left, right);
   }
+  auto definitions = std::vector<LogicalKeys::Definition>();
+  for (const auto& logical_key : m_logical_keys)
+    definitions.push_back({ logical_key.both, logical_key.left,
+      logical_key.right });
+  m_config.logical_keys = LogicalKeys(std::move(definitions));
+  m_config.forward_modifiers = m_forward_modifiers;
 
   suppress_forwarded_modifiers_in_outputs();
 
+  // toggling virtual keys by ContextActive needs to settle
+  check_context_active_cycles();
+
   // collect virtual key aliases
   for (const auto& [name, value] : m_macros)
     if (auto key = get_key_by_name(value); is_virtual_key(key))
       m_config.virtual_key_aliases.emplace_back(name, key);
 
+  // keep checkpoints of the last successful parse
+  m_include_checkpoints.swap(m_new_include_checkpoints);
+  m_new_include_checkpoints.clear();
+
   return std::move(m_config);
 }
 catch (const ConfigError&) {
@@ -261,15 +402,20 @@ void ParseConfig::error(std::string message) const {
   throw ConfigError(std::move(message));
 }
 
-void ParseConfig::parse_file(std::istream& is, std::string filename) {
-  auto prev_filename = std::exchange(m_filename, std::move(filename));
-  const auto prev_line_no = std::exchange(m_line_no, 0);
-
+auto ParseConfig::read_lines(std::string_view contents) -> std::vector<Line> {
+  auto lines = std::vector<Line>();
   auto line = std::string();
   auto prev_line = std::string();
-  while (is.good()) {
-    std::getline(is, line);
-    ++m_line_no;
+  auto line_no = 0;
+  auto hash = hash_offset_basis;
+  // like std::getline, a final newline is followed by an empty line
+  for (auto position = size_t{ }; position != std::string_view::npos; ) {
+    const auto newline = contents.find('\n', position);
+    line.assign(contents.substr(position, newline - position));
+    position = (newline == std::string_view::npos ? newline : newline + 1);
+    ++line_no;
+    hash = get_hash(line, hash);
+    hash = get_hash("\n", hash);
 
     // allow to break lines with '\'
     auto end = line.end();
@@ -282,13 +428,323 @@ void ParseConfig::parse_file(std::istream& is, std::string filename) {
       line = std::move(prev_line) + std::move(line);
       prev_line.clear();
     }
-    parse_line(line);
+    lines.push_back({ line_no, std::exchange(hash, hash_offset_basis),
+      std::move(line) });
+  }
+  return lines;
+}
+
+void ParseConfig::parse_file(std::string_view contents,
+    std::string filename) {
+  auto lines = read_lines(contents);
+  auto prev_filename = std::exchange(m_filename, std::move(filename));
+  const auto prev_line_no = std::exchange(m_line_no, 0);
+
+  // the includes of the main file can be parsed concurrently
+  const auto main_file = (m_include_level == 0);
+  const struct Guard {
+    ParseConfig& parse;
+    bool main_file;
+    ~Guard() {
+      if (main_file) {
+        parse.m_main_lines = nullptr;
+        parse.m_parallel_includes.reset();
+      }
+    }
+  } reset_main_lines{ *this, main_file };
+  if (main_file)
+    m_main_lines = &lines;
+
+  for (auto i = size_t{ }; i < lines.size(); ++i) {
+    m_line_no = lines[i].line_no;
+    m_parsed_hash = combine_hash(m_parsed_hash, lines[i].hash);
+    if (main_file)
+      m_main_line_index = i;
+    parse_line(lines[i].text);
   }
 
   m_line_no = prev_line_no;
   m_filename = std::move(prev_filename);
 }
 
+void ParseConfig::parse_include(std::string filename) {
+  // only the state after files included by the main file is restored
+  const auto top_level = (m_include_level == 0);
+  if (top_level && restore_include_checkpoint(filename))
+    return;
+
+  auto fragment = std::optional<IncludeFragment>();
+  auto contents = std::optional<std::string>();
+  if (top_level)
+    fragment = take_include_fragment(filename);
+  if (!fragment) {
+    contents = read_file(filename);
+    if (!contents)
+      error("Opening include file '" + filename + "' failed");
+  }
+
+  if (++m_include_level > 10)
+    error("Recursive includes detected");
+
+  const auto hash_before = m_parsed_hash;
+  const auto files_begin = m_included_files.size();
+  m_included_files.push_back(filename);
+  const auto merged = fragment.has_value();
+  if (fragment) {
+    m_included_file_hashes.push_back(fragment->file_hash);
+    merge_include_fragment(std::move(*fragment));
+  }
+  else {
+    m_included_file_hashes.push_back(get_hash(*contents));
+    parse_file(*contents, filename);
+  }
+
+  --m_include_level;
+
+  if (top_level) {
+    auto& checkpoint = m_new_include_checkpoints[hash_before];
+    checkpoint.filename = std::move(filename);
+    checkpoint.file_hashes.clear();
+    for (auto i = files_begin; i < m_included_files.size(); ++i)
+      checkpoint.file_hashes.emplace_back(m_included_files[i],
+        m_included_file_hashes[i]);
+    checkpoint.hash_after = m_parsed_hash;
+    checkpoint.state = save_state();
+
+    if (!merged)
+      parse_following_includes();
+  }
+}
+
+void ParseConfig::parse_following_includes() {
+  if (!m_main_lines)
+    return;
+
+  // keep the fragments, while they were parsed from the current state.
+  // Restart when the file parsed in order defined commands, which the
+  // following files might map
+  if (m_parallel_includes &&
+      m_main_line_index < m_parallel_includes->end_line() &&
+      is_include_base_valid(m_parallel_includes->base()) &&
+      m_parallel_includes->base().commands.size() == m_commands.size())
+    return;
+
+  // collect the directly following include directives
+  auto includes = std::vector<std::pair<size_t, std::string>>();
+  for (auto i = m_main_line_index + 1; i < m_main_lines->size(); ++i) {
+    const auto& text = (*m_main_lines)[i].text;
+    auto it = text.begin();
+    skip_space(&it, text.end());
+    if (it == text.end() || *it == '#' || *it == ';')
+      continue;
+    try {
+      const auto line = preprocess(std::string(it, text.end()));
+      auto begin = line.begin();
+      const auto end = line.end();
+      if (!skip(&begin, end, "@") || read_ident(&begin, end) != "include")
+        break;
+      skip_space(&begin, end);
+      includes.emplace_back(i, (m_base_path /
+        expand_path(read_value(&begin, end))).string());
+    }
+    catch (const std::exception&) {
+      // reported when the line is parsed
+      break;
+    }
+  }
+  m_parallel_includes.reset();
+  if (includes.empty())
+    return;
+
+  auto base = IncludeBase{
+    m_definitions_version,
+    m_macros,
+    m_logical_keys,
+    m_commands,
+    m_enforce_lowercase_commands,
+    m_allow_unmapped_commands,
+  };
+  m_parallel_includes = std::make_unique<ParallelIncludes>(
+    std::move(base), std::move(includes));
+}
+
+auto ParseConfig::parse_include_fragment(const IncludeBase& base,
+    const std::string& filename) -> IncludeFragment {
+  auto fragment = IncludeFragment{ };
+  auto contents = read_file(filename);
+  if (!contents)
+    return fragment;
+  fragment.file_hash = get_hash(*contents);
+
+  auto parse = ParseConfig();
+  parse.m_parsing_fragment = true;
+  parse.m_macros = base.macros;
+  parse.m_logical_keys = base.logical_keys;
+  for (auto i = size_t{ }; i < parse.m_logical_keys.size(); ++i)
+    parse.m_logical_key_indices.emplace(parse.m_logical_keys[i].name, i);
+  parse.m_commands = base.commands;
+  for (auto i = size_t{ }; i < parse.m_commands.size(); ++i)
+    parse.m_command_indices.emplace(parse.m_commands[i].name, i);
+  parse.m_enforce_lowercase_commands = base.enforce_lowercase_commands;
+  parse.m_allow_unmapped_commands = base.allow_unmapped_commands;
+  // a context block at the beginning can fall through to the current context
+  parse.m_after_empty_context_block = true;
+  parse.m_config.contexts.emplace_back();
+
+  auto lines = read_lines(*contents);
+  try {
+    for (auto& line : lines) {
+      parse.m_line_no = line.line_no;
+      parse.parse_line(line.text);
+      fragment.line_hashes.push_back(line.hash);
+    }
+  }
+  catch (const std::exception&) {
+    // the file is parsed again in order, which also reports the error
+    return fragment;
+  }
+  fragment.parsed = true;
+  fragment.config = std::move(parse.m_config);
+  fragment.commands = std::move(parse.m_commands);
+  fragment.unmapped_commands = std::move(parse.m_unmapped_commands);
+  fragment.system_filter_matched = parse.m_system_filter_matched;
+  fragment.after_empty_context_block = parse.m_after_empty_context_block;
+  return fragment;
+}
+
+bool ParseConfig::is_include_base_valid(const IncludeBase& base) const {
+  return (base.definitions_version == m_definitions_version &&
+          base.enforce_lowercase_commands == m_enforce_lowercase_commands &&
+          base.allow_unmapped_commands == m_allow_unmapped_commands);
+}
+
+auto ParseConfig::take_include_fragment(const std::string& filename)
+    -> std::optional<IncludeFragment> {
+  if (!m_main_lines || !m_parallel_includes)
+    return { };
+  auto fragment = m_parallel_includes->take(m_main_line_index, filename);
+  if (!fragment || !fragment->parsed ||
+      !is_include_base_valid(m_parallel_includes->base()))
+    return { };
+
+  // commands, which were defined in the meantime, could have been mapped
+  for (const auto& name : fragment->unmapped_commands)
+    if (find_command(name))
+      return { };
+  return fragment;
+}
+
+void ParseConfig::merge_include_fragment(IncludeFragment fragment) {
+  for (auto hash : fragment.line_hashes)
+    m_parsed_hash = combine_hash(m_parsed_hash, hash);
+
+  // number the commands in the order they were defined
+  auto command_indices = std::vector<int>();
+  for (auto& command : fragment.commands) {
+    auto current = find_command(command.name);
+    if (!current) {
+      const auto output_index = -static_cast<int>(m_commands.size() + 1);
+      m_command_indices.emplace(command.name, m_commands.size());
+      m_commands.push_back({ command.name, output_index, false });
+      current = &m_commands.back();
+    }
+    current->mapped |= command.mapped;
+    command_indices.push_back(current->index);
+  }
+  const auto get_command_index = [&](int index) {
+    return command_indices[static_cast<size_t>(-index - 1)];
+  };
+
+  // terminal command actions are numbered in order
+  const auto action_offset = m_config.actions.size();
+  const auto action_count = fragment.config.actions.size();
+  const auto offset_actions = [&](KeySequence& sequence) {
+    for (auto& event : sequence)
+      if (event.key >= Key::first_action &&
+          *event.key < *Key::first_action + action_count)
+        event.key = static_cast<Key>(*event.key + action_offset);
+  };
+  for (auto& action : fragment.config.actions)
+    m_config.actions.push_back(std::move(action));
+
+  auto& contexts = fragment.config.contexts;
+  if (m_after_empty_context_block && contexts.front().fallthrough)
+    current_context().fallthrough = true;
+
+  for (auto it = std::next(contexts.begin()); it != contexts.end(); ++it) {
+    auto& context = *it;
+    for (auto& input : context.inputs)
+      if (input.output_index < 0)
+        input.output_index = get_command_index(input.output_index);
+    for (auto& command_output : context.command_outputs) {
+      command_output.index = get_command_index(command_output.index);
+      offset_actions(command_output.output);
+    }
+    for (auto& output : context.outputs)
+      offset_actions(output);
+    m_config.contexts.push_back(std::move(context));
+  }
+  m_system_filter_matched = fragment.system_filter_matched;
+  m_after_empty_context_block = fragment.after_empty_context_block;
+}
+
+bool ParseConfig::restore_include_checkpoint(const std::string& filename) {
+  // everything parsed before and all read files must be unchanged
+  const auto it = m_include_checkpoints.find(m_parsed_hash);
+  if (it == m_include_checkpoints.end() ||
+      it->second.filename != filename)
+    return false;
+  for (const auto& [file, hash] : it->second.file_hashes) {
+    const auto contents = read_file(file);
+    if (!contents || get_hash(*contents) != hash)
+      return false;
+  }
+
+  restore_state(it->second.state);
+  for (const auto& [file, hash] : it->second.file_hashes) {
+    m_included_files.push_back(file);
+    m_included_file_hashes.push_back(hash);
+  }
+  m_parsed_hash = it->second.hash_after;
+  m_new_include_checkpoints.emplace(it->first, std::move(it->second));
+  m_include_checkpoints.erase(it);
+  return true;
+}
+
+ParseConfig::State ParseConfig::save_state() const {
+  return {
+    m_config,
+    m_commands,
+    m_macros,
+    m_logical_keys,
+    m_system_filter_matched,
+    m_after_empty_context_block,
+    m_enforce_lowercase_commands,
+    m_allow_unmapped_commands,
+    m_forward_modifiers,
+  };
+}
+
+void ParseConfig::restore_state(const State& state) {
+  m_config = state.config;
+  m_commands = state.commands;
+  m_command_indices.clear();
+  for (auto i = size_t{ }; i < m_commands.size(); ++i)
+    m_command_indices.emplace(m_commands[i].name, i);
+  m_macros = state.macros;
+  m_preprocess_cache.clear();
+  m_logical_keys = state.logical_keys;
+  m_logical_key_indices.clear();
+  for (auto i = size_t{ }; i < m_logical_keys.size(); ++i)
+    m_logical_key_indices.emplace(m_logical_keys[i].name, i);
+  m_system_filter_matched = state.system_filter_matched;
+  m_after_empty_context_block = state.after_empty_context_block;
+  m_enforce_lowercase_commands = state.enforce_lowercase_commands;
+  m_allow_unmapped_commands = state.allow_unmapped_commands;
+  m_forward_modifiers = state.forward_modifiers;
+  ++m_definitions_version;
+}
+
 void ParseConfig::parse_line(std::string& line) {
   auto it = line.begin();
   auto end = line.end();
@@ -297,18 +753,24 @@ void ParseConfig::parse_line(std::string& line) {
   auto first_ident = read_ident(&it, end);
   skip_space(&it, end);
   if (skip(&it, end, "=")) {
+    if (m_parsing_fragment)
+      error("Definition in concurrently parsed file");
     skip_space(&it, end);
     if (!parse_logical_key_definition(first_ident, it, end))
       parse_macro(std::move(first_ident), it, end);
     return;
   }
 
-  line = preprocess(std::move(line));
+  // most lines are parsed as they are
+  if (needs_preprocessing(line.begin(), line.end()))
+    line = preprocess(std::move(line));
   it = line.begin();
   end = line.end();
   skip_space(&it, end);
 
   if (skip(&it, end, "@")) {
+    if (m_parsing_fragment)
+      error("Directive in concurrently parsed file");
     parse_directive(it, end);
   }
   else if (skip(&it, end, "[")) {
@@ -340,6 +802,10 @@ void ParseConfig::parse_line(std::string& line) {
 }
 
 void ParseConfig::parse_mapping(It it, It end) {
+  // the context which was current when the file was included is unknown
+  if (m_parsing_fragment && m_config.contexts.size() == 1)
+    error("Mapping before first context in concurrently parsed file");
+
   const auto begin = it;
   auto first_ident = read_ident(&it, end);
   skip_space(&it, end);
@@ -353,6 +819,8 @@ void ParseConfig::parse_mapping(It it, It end) {
       // mapping undefined command
       if (!m_allow_unmapped_commands)
         error("Unknown command '" + first_ident + "'");
+      if (m_parsing_fragment)
+        m_unmapped_commands.push_back(first_ident);
 
       // still validate output
       parse_output(it, end);
@@ -396,17 +864,7 @@ void ParseConfig::parse_directive(It it, const It end) {
   if (ident == "include") {
     auto filename = (m_base_path / 
       expand_path(read_value(&it, end))).string();
-
-    auto is = std::ifstream(filename);
-    if (!is.good())
-      error("Opening include file '" + filename + "' failed");
-
-    if (++m_include_level > 10)
-      error("Recursive includes detected");
-
-    parse_file(is, std::move(filename));
-
-    --m_include_level;
+    parse_include(std::move(filename));
   }
   else if (ident == "grab-device") {
     add_grab_device_filter(false, false);
@@ -433,6 +891,49 @@ void ParseConfig::parse_directive(It it, const It end) {
     if (read_optional_bool())
       m_config.server_directives.push_back(ident);
   }
+  else if (ident == "profile") {
+    if (read_optional_bool())
+      m_config.server_directives.push_back(ident);
+  }
+  else if (ident == "optimize-output") {
+    if (read_optional_bool())
+      m_config.server_directives.push_back(ident);
+  }
+  else if (ident == "concurrent-output") {
+    if (read_optional_bool())
+      m_config.server_directives.push_back(ident);
+  }
+  else if (ident == "early-output") {
+    if (read_optional_bool())
+      m_config.server_directives.push_back(ident);
+  }
+  else if (ident == "inject-rate") {
+    // injected events per millisecond, 0 sends them at once
+    const auto rate = try_read_number(&it, end);
+    if (!rate)
+      error("Invalid inject rate");
+    m_config.server_directives.push_back(ident + " " + std::to_string(*rate));
+  }
+  else if (ident == "wheel-aggregation") {
+    // milliseconds unmapped wheel events are combined, 0 disables it
+    const auto window = try_read_number(&it, end);
+    if (!window)
+      error("Invalid wheel aggregation");
+    m_config.server_directives.push_back(ident + " " + std::to_string(*window));
+  }
+  else if (ident == "match-engine") {
+    // overrides how the server matches the inputs of each stage
+    const auto engine = read_ident(&it, end);
+    if (engine != "interpreted" && engine != "indexed" && engine != "compiled")
+      error("Invalid match engine");
+    m_config.server_directives.push_back(ident + " " + engine);
+  }
+  else if (ident == "title-update-interval") {
+    const auto interval = try_read_number(&it, end);
+    if (!interval)
+      error("Invalid title update interval");
+    m_config.title_update_interval_ms = *interval;
+  }
   else {
     error("Unknown directive '" + ident + "'");
   }
@@ -503,10 +1004,8 @@ std::vector<Key> ParseConfig::parse_forward_modifiers_list(It* it, const It end)
     if (name.empty())
       error("Key name expected");
 
-    const auto it2 = std::find_if(m_logical_keys.begin(), m_logical_keys.end(),
-      [&](const LogicalKey& key) { return key.name == name; });
-    if (it2 != m_logical_keys.end()) {
-      for (auto key : { it2->left, it2->right })
+    if (const auto logical_key = find_logical_key(name)) {
+      for (auto key : { logical_key->left, logical_key->right })
         if (!contains(modifiers, key))
           modifiers.push_back(key);
     }
@@ -635,18 +1134,24 @@ void ParseConfig::parse_command_and_mapping(const It in_begin, const It in_end,
 
 KeySequence ParseConfig::parse_input(It it, It end) {
   skip_space(&it, end);
-  return m_parse_sequence(std::string(it, end), true,
+  auto string = std::string(it, end);
+  // key names resolve to the same keys during a parse
+  if (auto cached = m_parsed_inputs.find(string);
+      cached != m_parsed_inputs.end())
+    return cached->second;
+
+  auto sequence = m_parse_sequence(string, true,
     std::bind(&ParseConfig::get_key_by_name, this, _1));
+  m_parsed_inputs.emplace(std::move(string), sequence);
+  return sequence;
 }
 
 Key ParseConfig::get_key_by_name(std::string_view name) const {
   if (const auto key = ::get_key_by_name(name); key != Key::none)
     return key;
 
-  const auto it = std::find_if(m_logical_keys.begin(), m_logical_keys.end(),
-    [&](const LogicalKey& key) { return key.name == name; });
-  if (it != m_logical_keys.end())
-    return it->both;
+  if (const auto logical_key = find_logical_key(name))
+    return logical_key->both;
 
   return { };
 }
@@ -660,17 +1165,30 @@ Key ParseConfig::add_terminal_command_action(std::string_view command) {
 
 KeySequence ParseConfig::parse_output(It it, It end) {
   skip_space(&it, end);
-  auto sequence = m_parse_sequence(std::string(it, end), false,
+  auto string = std::string(it, end);
+  if (auto cached = m_parsed_outputs.find(string);
+      cached != m_parsed_outputs.end())
+    return cached->second;
+
+  const auto action_count = m_config.actions.size();
+  auto sequence = m_parse_sequence(string, false,
     std::bind(&ParseConfig::get_key_by_name, this, _1),
     std::bind(&ParseConfig::add_terminal_command_action, this, _1));
   if (contains(sequence, Key::ContextActive))
     error("Not allowed key ContextActive");
+
+  // each terminal command adds an action
+  if (m_config.actions.size() == action_count)
+    m_parsed_outputs.emplace(std::move(string), sequence);
   return sequence;
 }
 
 void ParseConfig::parse_macro(std::string name, It it, It end) {
-  if (m_system_filter_matched)
+  if (m_system_filter_matched) {
     m_macros[std::move(name)] = preprocess(it, end, false);
+    m_preprocess_cache.clear();
+    ++m_definitions_version;
+  }
 }
 
 bool ParseConfig::parse_logical_key_definition(
@@ -746,6 +1264,7 @@ std::string ParseConfig::apply_builtin_macro(const std::string& ident,
     if (!count.has_value())
       error("Number expected");
     auto result = std::string();
+    result.reserve(std::max(*count, 0) * (arguments[0].size() + 1));
     for (auto i = 0; i < *count; ++i) {
       result.append(arguments[0]);
       result.append(" ");
@@ -808,6 +1327,40 @@ std::string ParseConfig::substitute_variables(std::string string) const {
   return result;
 }
 
+// whether preprocessing changes more than the leading space
+bool ParseConfig::needs_preprocessing(It it, const It end) const {
+  skip_space(&it, end);
+  while (it != end) {
+    const auto begin = it;
+    if (skip_ident(&it, end)) {
+      auto arglist = it;
+      if (m_macros.find(make_string_view(begin, it)) != m_macros.end() ||
+          skip_arglist(&arglist, end))
+        return true;
+    }
+    else if (std::strchr("\"'$/", *it) &&
+             (skip_string(&it, end) ||
+              skip_terminal_command(&it, end) ||
+              skip_regular_expression(&it, end))) {
+      // only variables referring to macros are substituted
+      for (auto var = begin; skip_until(&var, it, '$'); ) {
+        skip(&var, it, '{');
+        const auto ident = var;
+        skip_ident(&var, it);
+        if (m_macros.find(make_string_view(ident, var)) != m_macros.end())
+          return true;
+      }
+    }
+    else if (*it == '#' || *it == ';') {
+      return true;
+    }
+    else {
+      ++it;
+    }
+  }
+  return false;
+}
+
 std::string ParseConfig::preprocess(std::string expression) const {
   if (++m_preprocess_level > 30)
     error("Recursive macro instantiation");
@@ -827,7 +1380,17 @@ std::string ParseConfig::preprocess(std::string expression) const {
       return preprocess(macro->second);
     return expression;
   }
-  return preprocess(expression.begin(), expression.end());
+
+  // the result only depends on the macros defined
+  const auto cached = m_preprocess_cache.find(expression);
+  if (cached != m_preprocess_cache.end())
+    return cached->second;
+
+  auto result = preprocess(expression.begin(), expression.end());
+  if (m_preprocess_cache.size() >= max_preprocess_cache_size)
+    m_preprocess_cache.clear();
+  m_preprocess_cache.emplace(std::move(expression), result);
+  return result;
 }
 
 std::string ParseConfig::preprocess(It it, const It end, 
@@ -843,18 +1406,23 @@ std::string ParseConfig::preprocess(It it, const It end,
     auto begin = it;
     if (skip_ident(&it, end)) {
       // an ident
-      auto ident = std::string(begin, it);
+      const auto ident_view = make_string_view(begin, it);
       begin = it;
       if (!skip_arglist(&it, end)) {
-        result.append(preprocess(std::move(ident)));
+        // only copy the identifiers, which need to be substituted
+        if (m_macros.find(ident_view) != m_macros.end())
+          result.append(preprocess(std::string(ident_view)));
+        else
+          result.append(ident_view);
       }
       else if (!apply_arguments) {
         // do not apply arguments during macro definition
-        result.append(std::move(ident));
-        result.append(std::string(begin, it));
+        result.append(ident_view);
+        result.append(begin, it);
       }
       else {
         // apply macro arguments
+        auto ident = std::string(ident_view);
         auto arguments = get_argument_list(make_string_view(begin, it));
         for (auto& argument : arguments)
           argument = preprocess(std::move(argument));
@@ -898,10 +1466,16 @@ Config::Context& ParseConfig::current_context() {
 }
 
 auto ParseConfig::find_command(const std::string& name) -> Command* {
-  const auto it = std::find_if(
-    begin(m_commands), end(m_commands),
-    [&](const Command& c) { return c.name == name; });
-  return (it != cend(m_commands) ? &*it : nullptr);
+  const auto it = m_command_indices.find(name);
+  return (it != m_command_indices.end() ? &m_commands[it->second] : nullptr);
+}
+
+auto ParseConfig::find_logical_key(std::string_view name) const
+    -> const LogicalKey* {
+  // C++17 does not allow to find by string_view
+  const auto it = m_logical_key_indices.find(std::string(name));
+  return (it != m_logical_key_indices.end() ?
+    &m_logical_keys[it->second] : nullptr);
 }
 
 void ParseConfig::add_command(KeySequence input, std::string name) {
@@ -912,10 +1486,11 @@ void ParseConfig::add_command(KeySequence input, std::string name) {
   if (!command) {
     // command outputs have a negative index
     const auto output_index = -static_cast<int>(m_commands.size() + 1);
+    m_command_indices.emplace(name, m_commands.size());
     m_commands.push_back({ std::move(name), output_index, false });
     command = &m_commands.back();
   }
-  context.inputs.push_back({ std::move(input), command->index });
+  context.inputs.push_back({ std::move(input), command->index, m_line_no });
 }
 
 void ParseConfig::add_mapping(KeySequence input, KeySequence output) {
@@ -923,7 +1498,8 @@ void ParseConfig::add_mapping(KeySequence input, KeySequence output) {
   auto& context = current_context();
   context.inputs.push_back({
     std::move(input),
-    static_cast<int>(context.outputs.size())
+    static_cast<int>(context.outputs.size()),
+    m_line_no
   });
   context.outputs.push_back(std::move(output));
 }
@@ -948,13 +1524,14 @@ void ParseConfig::add_mapping(const std::string& name, KeySequence output) {
 
 Key ParseConfig::add_logical_key(std::string name, Key left, Key right) {
   const auto both = static_cast<Key>(*Key::first_logical + m_logical_keys.size());
+  m_logical_key_indices.emplace(name, m_logical_keys.size());
   m_logical_keys.push_back({ std::move(name), both, left, right });
+  ++m_definitions_version;
   return both;
 }
 
 void ParseConfig::replace_logical_key(Key both, Key left, Key right) {
-  auto& contexts = m_config.contexts;
-  for (auto& context : contexts) {
+  for (auto& context : m_config.contexts) {
     // replace !<both> with !<left> !<right>
     for (auto& input : context.inputs)
       replace_not_key(input.input, both, left, right);
@@ -962,51 +1539,22 @@ void ParseConfig::replace_logical_key(Key both, Key left, Key right) {
       replace_not_key(output, both, left, right);
     for (auto& command : context.command_outputs)
       replace_not_key(command.output, both, left, right);
+    replace_not_key(context.modifier_filter, both, left, right);
 
-    // duplicate command and replace the logical with a physical key
-    for (auto it = begin(context.inputs); it != end(context.inputs); ++it)
-      if (contains(it->input, both)) {
-        // duplicate and replace with <left> and <right>
-        it = context.inputs.insert(it, *it);
-        replace_key(it->input, both, left);
-        ++it;
-        replace_key(it->input, both, right);
-
-        // when directly mapped output also contains logical key,
-        // then duplicate output and replace with <right>
-        if (it->output_index >= 0) {
-          auto& output = context.outputs[it->output_index];
-          if (contains(output, both)) {
-            it->output_index = static_cast<int>(context.outputs.size());
-            context.outputs.push_back(output);
-            replace_key(context.outputs.back(), both, right);
-          }
-        }
-      }
-
-    // replace logical key with <left>
-    for (auto& output : context.outputs)
-      replace_key(output, both, left);
+    // inputs and modifier filters keep the logical key, which is matched
+    // with either key. Directly mapped outputs of inputs containing it
+    // output the key which was matched
+    auto matched_outputs = std::vector<bool>(context.outputs.size());
+    for (const auto& input : context.inputs)
+      if (input.output_index >= 0 && contains(input.input, both))
+        matched_outputs[input.output_index] = true;
+
+    // replace logical key with <left> in the other outputs
+    for (auto i = size_t{ }; i < context.outputs.size(); ++i)
+      if (!matched_outputs[i])
+        replace_key(context.outputs[i], both, left);
     for (auto& command : context.command_outputs)
       replace_key(command.output, both, left);
-
-    // replace !<both> with !<left> !<right> in context modifier
-    replace_not_key(context.modifier_filter, both, left, right);
-  }
-
-  // insert fallthrough context and replace the logical with a physical key
-  for (auto it = begin(contexts); it != end(contexts); ++it) {
-    if (contains(it->modifier_filter, both)) {
-      // duplicate and replace with <left> and <right>
-      it = contexts.insert(it, *it);
-      it->inputs.clear();
-      it->outputs.clear();
-      it->command_outputs.clear();
-      it->fallthrough = true;
-      replace_key(it->modifier_filter, both, left);
-      ++it;
-      replace_key(it->modifier_filter, both, right);
-    }
   }
 }
 
@@ -1048,29 +1596,21 @@ void ParseConfig::optimize_contexts() {
   }
 }
 
-void ParseConfig::prepend_forward_modifier_mappings() {
-  for (auto& context : m_config.contexts)
-    if (context.begin_stage)
-      for (auto it = m_forward_modifiers.rbegin(); 
-           it != m_forward_modifiers.rend(); ++it) {
-        const auto key = *it;
-        context.inputs.insert(context.inputs.begin(), {
-          KeySequence{ 
-            KeyEvent(key, KeyState::Down),
-            KeyEvent(key, KeyState::UpAsync)
-          },
-          static_cast<int>(context.outputs.size())
-        });
-        context.outputs.push_back({
-          KeyEvent(key, KeyState::Down)
-        });
-      }
-}
-
 void ParseConfig::suppress_forwarded_modifiers_in_outputs() {
   if (m_forward_modifiers.empty())
     return;
 
+  // index command outputs by command, -1 is at 0, -2 at 1...
+  auto command_outputs = std::vector<std::vector<KeySequence*>>(
+    m_commands.size());
+  for (auto& context : m_config.contexts)
+    for (auto& command : context.command_outputs) {
+      const auto offset = static_cast<size_t>(-command.index - 1);
+      if (offset >= command_outputs.size())
+        command_outputs.resize(offset + 1);
+      command_outputs[offset].push_back(&command.output);
+    }
+
   for (auto& context : m_config.contexts) {
     for (auto key : m_forward_modifiers) {
       const auto down_event = KeyEvent(key, KeyState::Down);
@@ -1081,19 +1621,95 @@ void ParseConfig::suppress_forwarded_modifiers_in_outputs() {
           output.insert(output.begin(), not_event);
       };
 
+      // also pressed by a logical key standing for it
+      const auto contains_down = [&](const KeySequence& input) {
+        return std::any_of(input.begin(), input.end(),
+          [&](const KeyEvent& event) {
+            return (event.state == KeyState::Down &&
+              m_config.logical_keys.equivalent(event.key, key));
+          });
+      };
+
       for (auto& input : context.inputs)
-        if (contains(input.input, down_event)) {
+        if (contains_down(input.input)) {
           if (input.output_index >= 0) {
             prepend_not_event(context.outputs[input.output_index]);
           }
           else {
-            for (auto& following_context : m_config.contexts) {
-              for (auto& command : following_context.command_outputs)
-                if (command.index == input.output_index)
-                  prepend_not_event(command.output);
-            }
+            const auto offset = static_cast<size_t>(-input.output_index - 1);
+            if (offset < command_outputs.size())
+              for (auto output : command_outputs[offset])
+                prepend_not_event(*output);
           }
         }
     }
   }
 }
+
+void ParseConfig::check_context_active_cycles() const {
+  // the ContextActive mappings of a context toggle virtual keys when it is
+  // activated and (after ^) when it is deactivated. This can (de)activate
+  // contexts, whose modifier filters contain the keys, and so on. When a
+  // toggling transition is reached again, the toggles could go on forever
+  const auto& contexts = m_config.contexts;
+  struct Toggle {
+    Key key;
+    int line_no;
+  };
+  // indexed by context * 2 + (deactivated ? 1 : 0)
+  auto toggles = std::vector<std::vector<Toggle>>(contexts.size() * 2);
+  const auto add_toggles = [&](size_t index, const KeySequence& output,
+      int line_no) {
+    auto transition = index * 2;
+    for (const auto& event : output) {
+      if (event.state == KeyState::OutputOnRelease)
+        transition = index * 2 + 1;
+      else if (is_virtual_key(event.key) && event.state != KeyState::Up)
+        toggles[transition].push_back({ event.key, line_no });
+    }
+  };
+  for (auto i = size_t{ }; i < contexts.size(); ++i)
+    for (const auto& input : contexts[i].inputs) {
+      if (input.input.empty() ||
+          input.input.front().key != Key::ContextActive)
+        continue;
+      if (input.output_index >= 0) {
+        add_toggles(i, contexts[i].outputs[input.output_index], input.line_no);
+        continue;
+      }
+      // a command can be mapped in every context
+      for (const auto& context : contexts)
+        for (const auto& command : context.command_outputs)
+          if (command.index == input.output_index)
+            add_toggles(i, command.output, input.line_no);
+    }
+
+  enum class Mark { none, visiting, done };
+  auto marks = std::vector<Mark>(toggles.size());
+  const auto visit = [&](size_t node, const auto& visit) -> void {
+    marks[node] = Mark::visiting;
+    for (const auto& toggle : toggles[node])
+      for (auto j = size_t{ }; j < contexts.size(); ++j) {
+        if (!contains(contexts[j].modifier_filter, toggle.key))
+          continue;
+        for (auto next : { j * 2, j * 2 + 1 }) {
+          // toggling a key of its own filter can only change its state
+          if (next == node)
+            continue;
+          if (marks[next] == Mark::visiting) {
+            auto message = "ContextActive toggles Virtual" +
+              std::to_string(*toggle.key - *Key::first_virtual) + " in a cycle";
+            if (toggle.line_no)
+              message += " in line " + std::to_string(toggle.line_no);
+            throw ConfigError(message);
+          }
+          if (marks[next] == Mark::none)
+            visit(next, visit);
+        }
+      }
+    marks[node] = Mark::done;
+  };
+  for (auto node = size_t{ }; node < toggles.size(); ++node)
+    if (marks[node] == Mark::none)
+      visit(node, visit);
+}
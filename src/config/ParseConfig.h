@@ -6,6 +6,9 @@
 #include <iosfwd>
 #include <filesystem>
 #include <map>
+#include <memory>
+#include <optional>
+#include <unordered_map>
 
 class ParseConfig {
 public:
@@ -13,8 +16,18 @@ public:
     using std::runtime_error::runtime_error;
   };
 
+  ParseConfig();
+  ParseConfig(ParseConfig&&);
+  ParseConfig& operator=(ParseConfig&&);
+  ~ParseConfig();
+
   Config operator()(std::istream& is,
     const std::filesystem::path& base_path = { });
+  Config operator()(std::string_view contents,
+    const std::filesystem::path& base_path = { });
+
+  // the files included by the last parsed configuration
+  const std::vector<std::string>& included_files() const { return m_included_files; }
 
 private:
   struct Command {
@@ -31,9 +44,76 @@ private:
   };
 
   using It = std::string::const_iterator;
+  using Macros = std::map<std::string, std::string, std::less<>>;
+
+  // state, which can be modified by an include file
+  struct State {
+    Config config;
+    std::vector<Command> commands;
+    Macros macros;
+    std::vector<LogicalKey> logical_keys;
+    bool system_filter_matched;
+    bool after_empty_context_block;
+    bool enforce_lowercase_commands;
+    bool allow_unmapped_commands;
+    std::vector<Key> forward_modifiers;
+  };
+
+  // state after a file included by the main file, keyed by the hash of
+  // everything parsed before. Valid while the read files did not change
+  struct IncludeCheckpoint {
+    std::string filename;
+    std::vector<std::pair<std::string, uint64_t>> file_hashes;
+    uint64_t hash_after;
+    State state;
+  };
+
+  // a logical line, with the hash of the physical lines it was joined from
+  struct Line {
+    int line_no;
+    uint64_t hash;
+    std::string text;
+  };
+
+  // the state the files included by the main file are parsed from
+  // concurrently. They must not define macros or logical keys
+  struct IncludeBase {
+    uint64_t definitions_version;
+    Macros macros;
+    std::vector<LogicalKey> logical_keys;
+    std::vector<Command> commands;
+    bool enforce_lowercase_commands;
+    bool allow_unmapped_commands;
+  };
+
+  // the result of parsing an include file concurrently, the first context
+  // stands in for the context which was current when it was included
+  struct IncludeFragment {
+    bool parsed;
+    uint64_t file_hash;
+    std::vector<uint64_t> line_hashes;
+    Config config;
+    std::vector<Command> commands;
+    std::vector<std::string> unmapped_commands;
+    bool system_filter_matched;
+    bool after_empty_context_block;
+  };
+  class ParallelIncludes;
 
   [[noreturn]] void error(std::string message) const;
-  void parse_file(std::istream& is, std::string filename = "");
+  static std::vector<Line> read_lines(std::string_view contents);
+  void parse_file(std::string_view contents, std::string filename = "");
+  void parse_include(std::string filename);
+  void parse_following_includes();
+  static IncludeFragment parse_include_fragment(const IncludeBase& base,
+    const std::string& filename);
+  bool is_include_base_valid(const IncludeBase& base) const;
+  std::optional<IncludeFragment> take_include_fragment(
+    const std::string& filename);
+  void merge_include_fragment(IncludeFragment fragment);
+  bool restore_include_checkpoint(const std::string& filename);
+  State save_state() const;
+  void restore_state(const State& state);
   void parse_line(std::string& line);
   void parse_directive(It begin, It end);
   void parse_context(It begin, It end);
@@ -49,6 +129,7 @@ private:
   KeySequence parse_output(It begin, It end);
   std::vector<Key> parse_forward_modifiers_list(It* it, It end);
   std::string substitute_variables(std::string string) const;
+  bool needs_preprocessing(It it, It end) const;
   std::string preprocess(It begin, It end, bool apply_arguments = true) const;
   std::string preprocess(std::string expression) const;
   std::string apply_builtin_macro(const std::string& ident,
@@ -60,11 +141,12 @@ private:
   Key get_key_by_name(std::string_view name) const;
   Key add_terminal_command_action(std::string_view command);
   void optimize_contexts();
-  void prepend_forward_modifier_mappings();
   void suppress_forwarded_modifiers_in_outputs();
+  void check_context_active_cycles() const;
 
   Config::Context& current_context();
   Command* find_command(const std::string& name);
+  const LogicalKey* find_logical_key(std::string_view name) const;
   void add_command(KeySequence input, std::string name);
   void add_mapping(KeySequence input, KeySequence output);
   void add_mapping(const std::string& name, KeySequence output);
@@ -72,13 +154,35 @@ private:
   std::filesystem::path m_base_path;
   std::string m_filename;
   int m_include_level{ };
+  std::vector<std::string> m_included_files;
+  std::vector<uint64_t> m_included_file_hashes;
+  // hash of the lines parsed so far
+  uint64_t m_parsed_hash{ };
+  std::unordered_map<uint64_t, IncludeCheckpoint> m_include_checkpoints;
+  std::unordered_map<uint64_t, IncludeCheckpoint> m_new_include_checkpoints;
+  // the lines of the main file, while it is parsed
+  std::vector<Line>* m_main_lines{ };
+  size_t m_main_line_index{ };
+  std::unique_ptr<ParallelIncludes> m_parallel_includes;
+  // incremented whenever macros or logical keys change
+  uint64_t m_definitions_version{ };
+  // set while parsing an include file concurrently
+  bool m_parsing_fragment{ };
+  std::vector<std::string> m_unmapped_commands;
   mutable int m_preprocess_level{ };
   int m_line_no{ };
   Config m_config;
   std::vector<Command> m_commands;
-  std::map<std::string, std::string> m_macros;
+  std::unordered_map<std::string, size_t> m_command_indices;
+  Macros m_macros;
+  // results of preprocessed expressions, while no macro changed
+  mutable std::unordered_map<std::string, std::string> m_preprocess_cache;
   std::vector<LogicalKey> m_logical_keys;
+  std::unordered_map<std::string, size_t> m_logical_key_indices;
   ParseKeySequence m_parse_sequence;
+  // the key sequences parsed during the current parse
+  std::unordered_map<std::string, KeySequence> m_parsed_inputs;
+  std::unordered_map<std::string, KeySequence> m_parsed_outputs;
   bool m_system_filter_matched{ true };
   bool m_after_empty_context_block{ };
   bool m_enforce_lowercase_commands{ };
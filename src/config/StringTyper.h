@@ -16,15 +16,15 @@ public:
   using Modifiers = int;
   using AddKey = std::function<void(Key, Modifiers)>;
 
+  // the table of the keyboard layout is built once and shared by all
+  // instances, until it is explicitly updated
   StringTyper();
-  StringTyper(StringTyper&& rhs) noexcept;
-  StringTyper& operator=(StringTyper&& rhs) noexcept;
-  ~StringTyper();
+  static void update_layout();
 
   void type(std::string_view string, const AddKey& add_key) const;
 
 private:
-  std::unique_ptr<class StringTyperImpl> m_impl;
+  static std::shared_ptr<const class StringTyperImpl> get_layout(bool update);
 };
 
 template<typename T>
@@ -0,0 +1,30 @@
+
+#include "build_multi_stage.h"
+
+MultiStagePtr build_multi_stage(const Config& config) {
+  auto stages = std::vector<StagePtr>();
+  auto contexts = std::vector<Stage::Context>();
+  for (const auto& config_context : config.contexts) {
+    if (config_context.begin_stage && !contexts.empty()) {
+      stages.emplace_back(std::make_unique<Stage>(std::move(contexts),
+        config.logical_keys, config.forward_modifiers));
+      contexts = { };
+    }
+    auto& context = contexts.emplace_back();
+    for (const auto& input : config_context.inputs)
+      context.inputs.push_back({ input.input, input.output_index });
+    context.outputs = config_context.outputs;
+    for (const auto& output : config_context.command_outputs)
+      context.command_outputs.push_back({ output.output, output.index });
+    context.device_filter = config_context.device_filter;
+    context.device_id_filter = config_context.device_id_filter;
+    context.modifier_filter = config_context.modifier_filter;
+    context.invert_modifier_filter = config_context.invert_modifier_filter;
+    context.fallthrough = config_context.fallthrough;
+  }
+  if (!contexts.empty())
+    stages.emplace_back(std::make_unique<Stage>(std::move(contexts),
+      config.logical_keys, config.forward_modifiers));
+
+  return std::make_unique<MultiStage>(std::move(stages));
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include "Config.h"
+#include "runtime/MultiStage.h"
+
+// builds the stages of a configuration directly, without serializing it,
+// a new stage begins at each context with begin_stage set
+MultiStagePtr build_multi_stage(const Config& config);
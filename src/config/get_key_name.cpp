@@ -3,8 +3,7 @@
 #include <cctype>
 #include <cstring>
 #include <string>
-#include <algorithm>
-#include <vector>
+#include <unordered_map>
 #include <sstream>
 
 namespace {
@@ -208,18 +207,20 @@ const char* get_key_name(const Key& key) {
     case Key::any:                return "Any";
     case Key::ContextActive:      return "ContextActive";
 
+    // common logical keys
+    case Key::Shift:              return "Shift";
+    case Key::Control:            return "Control";
+    case Key::Alt:                return "Alt";
+    case Key::Meta:               return "Meta";
+
     case Key::none:
     case Key::timeout:
     case Key::last_keyboard_key:
     case Key::first_virtual:
     case Key::last_virtual:
-    case Key::first_logical:
     case Key::last_logical:
     case Key::first_action:
     case Key::last_action:
-    case Key::Control:
-    case Key::Alt:
-    case Key::Meta:
       break;
   }
   return nullptr;
@@ -260,45 +261,27 @@ Key get_key_by_name(std::string_view name) {
       return Key::none;
   }
 
-  // generate vector of all key name/key pairs, sorted by name
+  // generate hash map of all key names and aliases
   static const auto s_key_map =
     []() {
-      auto map = std::vector<std::pair<std::string_view, Key>>();
-      map.reserve(200);
+      auto map = std::unordered_map<std::string_view, Key>();
+      map.reserve(256);
 
       for (auto key_code = 1; key_code < 0xFFFF; ++key_code) {
         const auto key = static_cast<Key>(key_code);
         if (auto name = get_key_name(key))
-          map.emplace_back(name, key);
+          map.emplace(name, key);
       }
-      std::sort(begin(map), end(map),
-        [](const auto& a, const auto& b) { return a.first < b.first; });
 
+      // allow some aliases
+      map.emplace("OSLeft", Key::MetaLeft);
+      map.emplace("OSRight", Key::MetaRight);
       return map;
     }();
 
-  // binary search for key name
-  const auto it = std::lower_bound(cbegin(s_key_map), cend(s_key_map), name,
-    [](const auto& kv, const auto& name) { return kv.first < name; });
-  if (it != cend(s_key_map) && it->first == name)
+  if (const auto it = s_key_map.find(name); it != s_key_map.end())
     return it->second;
 
-  // common logical keys
-  if (name == "Shift")
-    return Key::Shift;
-  if (name == "Control")
-    return Key::Control;
-  if (name == "Alt")
-    return Key::Alt;
-  if (name == "Meta")
-    return Key::Meta;
-
-  // allow some aliases
-  if (name == "OSLeft")
-    return Key::MetaLeft;
-  if (name == "OSRight")
-    return Key::MetaRight;
-
   return Key::none;
 }
 
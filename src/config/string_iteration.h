@@ -109,10 +109,12 @@ void trim_space(ForwardIt begin, ForwardIt* end) {
 template<typename ForwardIt>
 bool skip_ident(ForwardIt* it, ForwardIt end) {
   const auto begin = *it;
-  while (*it != end && 
-     (std::isalnum(static_cast<unsigned char>(**it)) || 
-      **it == '_' ||
-      **it == '-'))
+  // not locale dependent, unlike std::isalnum
+  const auto is_ident_char = [](char c) {
+    return ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+            (c >= '0' && c <= '9') || c == '_' || c == '-');
+  };
+  while (*it != end && is_ident_char(**it))
     ++(*it);
   return (*it != begin);
 }
@@ -7,6 +7,7 @@ ClientPort::ClientPort()
 
 bool ClientPort::connect(std::optional<Duration> timeout) {
   m_connection = m_host.connect(timeout);
+  m_virtual_key_states.clear();
   return static_cast<bool>(m_connection);
 }
 
@@ -25,6 +26,17 @@ bool ClientPort::send_set_virtual_key_state(std::string_view name, KeyState stat
   });
 }
 
+bool ClientPort::send_set_virtual_key_states(
+    const std::vector<std::string>& names, KeyState state) {
+  return m_connection.send_message([&](Serializer& s) {
+    s.write(MessageType::set_virtual_key_states);
+    s.write(static_cast<uint32_t>(names.size()));
+    for (const auto& name : names)
+      s.write(name);
+    s.write(state);
+  });
+}
+
 bool ClientPort::send_request_virtual_key_toggle_notification(std::string_view name) {
   return m_connection.send_message([&](Serializer& s) {
     s.write(MessageType::request_virtual_key_toggle_notification);
@@ -78,15 +90,58 @@ bool ClientPort::send_type_string(const std::string& string) {
   });
 }
 
+bool ClientPort::send_subscribe() {
+  return m_connection.send_message([&](Serializer& s) {
+    s.write(MessageType::subscribe);
+  });
+}
+
+bool ClientPort::send_request_statistics(bool recent_events) {
+  return m_connection.send_message([&](Serializer& s) {
+    s.write(MessageType::statistics);
+    s.write(recent_events);
+  });
+}
+
+bool ClientPort::send_request_profile_report() {
+  return m_connection.send_message([&](Serializer& s) {
+    s.write(MessageType::input_profile);
+  });
+}
+
 bool ClientPort::read_virtual_key_state(std::optional<Duration> timeout, 
     std::optional<KeyState>* result) {
+  // replies of pipelined requests can be received at once
+  if (m_virtual_key_states.empty() &&
+      !m_connection.read_messages(timeout,
+        [&](Deserializer& d) {
+          switch (d.read<MessageType>()) {
+            case MessageType::virtual_key_state: {
+              d.read<Key>();
+              m_virtual_key_states.push_back(d.read<KeyState>());
+              break;
+            }
+            default: 
+              break;
+          }
+        }))
+    return false;
+
+  if (!m_virtual_key_states.empty()) {
+    result->emplace(m_virtual_key_states.front());
+    m_virtual_key_states.pop_front();
+  }
+  return true;
+}
+
+bool ClientPort::read_next_key_info(std::optional<Duration> timeout, 
+    std::string* result) {
   return m_connection.read_messages(timeout,
     [&](Deserializer& d) {
       switch (d.read<MessageType>()) {
-        case MessageType::virtual_key_state: {
-          d.read<Key>();
-          const auto state = d.read<KeyState>();
-          result->emplace(state);
+        case MessageType::next_key_info: {
+          if (result)
+            *result = d.read_string();
           break;
         }
         default: 
@@ -95,14 +150,38 @@ bool ClientPort::read_virtual_key_state(std::optional<Duration> timeout,
     });
 }
 
-bool ClientPort::read_next_key_info(std::optional<Duration> timeout, 
+bool ClientPort::read_statistics(std::optional<Duration> timeout, 
+    std::optional<std::string>* result) {
+  return m_connection.read_messages(timeout,
+    [&](Deserializer& d) {
+      switch (d.read<MessageType>()) {
+        case MessageType::statistics: {
+          result->emplace(d.read_string());
+          break;
+        }
+        default: 
+          break;
+      }
+    });
+}
+
+bool ClientPort::read_subscribed_events(std::optional<Duration> timeout, 
     std::string* result) {
   return m_connection.read_messages(timeout,
     [&](Deserializer& d) {
       switch (d.read<MessageType>()) {
-        case MessageType::next_key_info: {
-          if (result)
-            *result = d.read_string();
+        case MessageType::virtual_key_changed: {
+          result->append(d.read_string());
+          result->append(d.read<KeyState>() == KeyState::Down ?
+            " pressed\n" : " released\n");
+          break;
+        }
+        case MessageType::active_contexts_changed: {
+          result->append("contexts");
+          const auto count = d.read<uint32_t>();
+          for (auto i = 0u; i < count && d.can_read(sizeof(int32_t)); ++i)
+            result->append(" " + std::to_string(d.read<int32_t>()));
+          result->append("\n");
           break;
         }
         default: 
@@ -3,6 +3,7 @@
 #include "runtime/KeyEvent.h"
 #include "common/Host.h"
 #include "common/MessageType.h"
+#include <deque>
 #include <memory>
 
 class ClientPort {
@@ -11,6 +12,8 @@ public:
   bool connect(std::optional<Duration> timeout);
   bool send_get_virtual_key_state(std::string_view name);
   bool send_set_virtual_key_state(std::string_view name, KeyState state);
+  bool send_set_virtual_key_states(const std::vector<std::string>& names,
+    KeyState state);
   bool send_request_virtual_key_toggle_notification(std::string_view name);
   bool send_set_instance_id(std::string_view id);
   bool send_set_config_file(const std::string& filename);
@@ -18,12 +21,22 @@ public:
   bool send_inject_input(const std::string& string);
   bool send_inject_output(const std::string& string);
   bool send_type_string(const std::string& string);
+  bool send_subscribe();
+  bool send_request_statistics(bool recent_events);
+  bool send_request_profile_report();
   bool read_virtual_key_state(std::optional<Duration> timeout, 
     std::optional<KeyState>* result);
   bool read_next_key_info(std::optional<Duration> timeout, 
     std::string* result);
+  // also the reply of the profile report, result is empty on timeout
+  bool read_statistics(std::optional<Duration> timeout, 
+    std::optional<std::string>* result);
+  // appends a line per received virtual key or active contexts change
+  bool read_subscribed_events(std::optional<Duration> timeout, 
+    std::string* result);
 
 private:
   Host m_host;
   Connection m_connection;
+  std::deque<KeyState> m_virtual_key_states;
 };
@@ -1,123 +1,191 @@
 
 #include "Settings.h"
 #include "common/output.h"
+#include <algorithm>
 #include <optional>
 
 #if defined(_WIN32)
+# include "common/windows/win.h"
+#endif
 
-#include "common/windows/win.h"
-
-bool interpret_commandline(Settings& settings, int argc, wchar_t* argv[]) {
-# define T(text) L##text
-
-  auto timeout = std::optional<Duration>();
-  for (auto i = 1; i < argc; i++) {
-    const auto argument = std::wstring_view(argv[i]);
-    const auto to_utf8 = wide_to_utf8;
-#else // !defined(_WIN32)
+namespace {
+  bool interpret_arguments(Settings& settings, 
+      const std::vector<std::string>& arguments) {
+    const auto count = static_cast<int>(arguments.size());
+    auto timeout = std::optional<Duration>();
+    for (auto i = 0; i < count; i++) {
+      const auto& argument = arguments[i];
+
+      const auto read_sequence = [&]() {
+        auto sequence = std::string();
+        while (i + 1 < count && arguments[i + 1].rfind('-', 0) != 0)
+          sequence += arguments[++i] + " ";
+        return sequence;
+      };
+
+      if (argument == "--timeout") {
+        if (++i >= count)
+          return false;
+
+        timeout = std::chrono::milliseconds(std::stoi(arguments[i]));
+        if (timeout < std::chrono::seconds::zero() || timeout > std::chrono::hours(24))
+          timeout.reset();
+      }
+      else if (argument == "--instance") {
+        if (++i >= count)
+          return false;
+
+        settings.requests.push_back({ RequestType::set_instance_id, arguments[i] });
+      }
+      else if (argument == "--wait") {
+        if (++i >= count)
+          return false;
+
+        timeout = std::chrono::milliseconds(std::stoi(arguments[i]));
+        settings.requests.push_back({ RequestType::wait, "", timeout });
+      }
+      else if (argument == "--stdout") {
+        settings.requests.push_back({ RequestType::stdout_result });
+      }
+      else if (argument == "--restart") {
+        settings.requests.push_back({ RequestType::restart, "", timeout });
+      }
+      else if (argument == "--next-key-info") {
+        settings.requests.push_back({ RequestType::next_key_info, "", timeout });
+      }    
+      else if (argument == "--subscribe") {
+        settings.requests.push_back({ RequestType::subscribe, "", timeout });
+      }
+      else if (argument == "--stats") {
+        settings.requests.push_back({ RequestType::statistics, "", timeout });
+      }
+      else if (argument == "--recent-events") {
+        settings.requests.push_back({ RequestType::recent_events, "", timeout });
+      }
+      else if (argument == "--profile-report") {
+        settings.requests.push_back({ RequestType::profile_report, "", timeout });
+      }
+      else if (argument == "--batch") {
+        settings.requests.push_back({ RequestType::batch, "", timeout });
+      }
+      else if (argument == "--set-config") {
+        if (++i >= count)
+          return false;
+
+        settings.requests.push_back({ RequestType::set_config_file, 
+          arguments[i], timeout });
+      }
+      else if (argument == "--input") {
+        settings.requests.push_back({ RequestType::inject_input,
+          read_sequence(), timeout });
+      }
+      else if (argument == "--output") {
+        settings.requests.push_back({ RequestType::inject_output,
+          read_sequence(), timeout });
+      }
+      else if (argument == "--type") {
+        if (++i >= count)
+          return false;
 
-bool interpret_commandline(Settings& settings, int argc, char* argv[]) {
-# define T(text) text
-
-  auto timeout = std::optional<Duration>();
-  for (auto i = 1; i < argc; i++) {
-    const auto argument = std::string_view(argv[i]);
-    using to_utf8 = std::string;
-#endif // !defined(_WIN32)
-
-    const auto read_sequence = [&]() {
-      auto sequence = std::string();
-      while (i + 1 < argc && *argv[i + 1] != '-')
-        sequence += to_utf8(argv[++i]) + " ";
-      return sequence;
-    };
-
-    if (argument == T("--timeout")) {
-      if (++i >= argc)
-        return false;
-
-      timeout = std::chrono::milliseconds(std::stoi(to_utf8(argv[i])));
-      if (timeout < std::chrono::seconds::zero() || timeout > std::chrono::hours(24))
-        timeout.reset();
-    }
-    else if (argument == T("--instance")) {
-      if (++i >= argc)
-        return false;
+#if defined(_WIN32)
+        // expand $(command) by calling command and capturing output
+        extern std::wstring expand_command(std::wstring_view argument);
+        auto string = wide_to_utf8(expand_command(utf8_to_wide(arguments[i])));
+#else
+        auto string = arguments[i];
+#endif
 
-      const auto id = to_utf8(argv[i]);
-      settings.requests.push_back({ RequestType::set_instance_id, id });
+        settings.requests.push_back({ RequestType::type_string, 
+          std::move(string), timeout });
+      }
+      else {
+        const auto request_type = [&]() -> std::optional<RequestType> {
+          if (argument == "--press") return RequestType::press;
+          if (argument == "--release") return RequestType::release;
+          if (argument == "--toggle") return RequestType::toggle;
+          if (argument == "--is-pressed") return RequestType::is_pressed;
+          if (argument == "--is-released") return RequestType::is_released;
+          if (argument == "--wait-pressed") return RequestType::wait_pressed;
+          if (argument == "--wait-released") return RequestType::wait_released;
+          if (argument == "--wait-toggled") return RequestType::wait_toggled;
+          return std::nullopt;
+        }();
+        if (!request_type)
+          return false;
+        if (++i >= count)
+          return false;
+
+        auto string = arguments[i];
+        // setting several keys, which are separated by spaces
+        if (*request_type == RequestType::press ||
+            *request_type == RequestType::release ||
+            *request_type == RequestType::toggle)
+          while (i + 1 < count && arguments[i + 1].rfind("--", 0) != 0)
+            string += " " + arguments[++i];
+
+        settings.requests.push_back({ *request_type, 
+          std::move(string), timeout });
+      }
     }
-    else if (argument == T("--wait")) {
-      if (++i >= argc)
-        return false;
+    return true;
+  }
 
-      timeout = std::chrono::milliseconds(std::stoi(to_utf8(argv[i])));
-      settings.requests.push_back({ RequestType::wait, "", timeout });
-    }
-    else if (argument == T("--stdout")) {
-      settings.requests.push_back({ RequestType::stdout_result });
-    }
-    else if (argument == T("--restart")) {
-      settings.requests.push_back({ RequestType::restart, "", timeout });
+  // splits at spaces, double quotes group arguments
+  std::vector<std::string> split_arguments(std::string_view line) {
+    auto arguments = std::vector<std::string>();
+    auto argument = std::optional<std::string>();
+    auto in_quotes = false;
+    for (auto c : line) {
+      if (c == '"') {
+        in_quotes = !in_quotes;
+        if (!argument)
+          argument.emplace();
+      }
+      else if (!in_quotes && (c == ' ' || c == '\t' || c == '\r')) {
+        if (argument)
+          arguments.push_back(std::move(*argument));
+        argument.reset();
+      }
+      else {
+        if (!argument)
+          argument.emplace();
+        argument->push_back(c);
+      }
     }
-    else if (argument == T("--next-key-info")) {
-      settings.requests.push_back({ RequestType::next_key_info, "", timeout });
-    }    
-    else if (argument == T("--set-config")) {
-      if (++i >= argc)
-        return false;
-
-      settings.requests.push_back({ RequestType::set_config_file, 
-        to_utf8(argv[i]), timeout });
-    }
-    else if (argument == T("--input")) {
-      settings.requests.push_back({ RequestType::inject_input,
-        read_sequence(), timeout });
-    }
-    else if (argument == T("--output")) {
-      settings.requests.push_back({ RequestType::inject_output,
-        read_sequence(), timeout });
-    }
-    else if (argument == T("--type")) {
-      if (++i >= argc)
-        return false;
+    if (argument)
+      arguments.push_back(std::move(*argument));
+    return arguments;
+  }
+} // namespace
 
 #if defined(_WIN32)
-      // expand $(command) by calling command and capturing output
-      extern std::wstring expand_command(std::wstring_view argument);
-      auto string = to_utf8(expand_command(argv[i]));
+bool interpret_commandline(Settings& settings, int argc, wchar_t* argv[]) {
+  auto arguments = std::vector<std::string>();
+  for (auto i = 1; i < argc; i++)
+    arguments.push_back(wide_to_utf8(argv[i]));
 #else
-      auto string = to_utf8(argv[i]);
+bool interpret_commandline(Settings& settings, int argc, char* argv[]) {
+  auto arguments = std::vector<std::string>(argv + 1, argv + argc);
 #endif
-
-      settings.requests.push_back({ RequestType::type_string, 
-        std::move(string), timeout });
-    }
-    else {
-      const auto request_type = [&]() -> std::optional<RequestType> {
-        if (argument == T("--press")) return RequestType::press;
-        if (argument == T("--release")) return RequestType::release;
-        if (argument == T("--toggle")) return RequestType::toggle;
-        if (argument == T("--is-pressed")) return RequestType::is_pressed;
-        if (argument == T("--is-released")) return RequestType::is_released;
-        if (argument == T("--wait-pressed")) return RequestType::wait_pressed;
-        if (argument == T("--wait-released")) return RequestType::wait_released;
-        if (argument == T("--wait-toggled")) return RequestType::wait_toggled;
-        return std::nullopt;
-      }();
-      if (!request_type)
-        return false;
-      if (++i >= argc)
-        return false;
-
-      settings.requests.push_back({ *request_type, 
-        to_utf8(argv[i]), timeout });
-    }
+  try {
+    if (!interpret_arguments(settings, arguments))
+      return false;
   }
-  if (settings.requests.empty())
+  catch (const std::exception&) {
     return false;
+  }
+  return !settings.requests.empty();
+}
 
-  return true;
+bool interpret_line(Settings& settings, std::string_view line) try {
+  settings = { };
+  return (interpret_arguments(settings, split_arguments(line)) &&
+    !settings.requests.empty() &&
+    std::none_of(settings.requests.begin(), settings.requests.end(),
+      [](const Request& request) { return request.type == RequestType::batch; }));
+}
+catch (const std::exception&) {
+  return false;
 }
 
 void print_help_message() {
@@ -129,12 +197,18 @@ Usage: keymapperctl [--operation]
   --output <sequence>   injects an output key sequence.
   --type "string"       types a string of characters.
   --next-key-info       outputs information about the next key press.
+  --stats               outputs the event counters and latencies of the
+                        keymapperd process.
+  --recent-events       outputs the last input and output events of the
+                        keymapperd process.
+  --profile-report      outputs how often and how long each mapping was
+                        matched, when the configuration contains @profile.
   --set-config "file"   sets a new configuration.
   --is-pressed <key>    sets the result code 0 when a virtual key is down.
   --is-released <key>   sets the result code 0 when a virtual key is up.
-  --press <key>         presses a virtual key.
-  --release <key>       releases a virtual key.
-  --toggle <key>        toggles a virtual key.
+  --press <keys>        presses one or more virtual keys.
+  --release <keys>      releases one or more virtual keys.
+  --toggle <keys>       toggles one or more virtual keys.
   --wait-pressed <key>  waits until a virtual key is pressed.
   --wait-released <key> waits until a virtual key is released.
   --wait-toggled <key>  waits until a virtual key is toggled.
@@ -143,6 +217,10 @@ Usage: keymapperctl [--operation]
   --instance <id>       replaces another keymapperctl process with the same id.
   --restart             starts processing the first operation again.
   --stdout              outputs the result code.
+  --subscribe           outputs each change of a virtual key or the
+                        active contexts, until the timeout elapsed.
+  --batch               reads operations line by line from stdin and
+                        outputs the result code of each line.
   -h, --help            print this help.
 
 %s
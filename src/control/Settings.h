@@ -2,6 +2,7 @@
 
 #include "common/Duration.h"
 #include <string>
+#include <string_view>
 #include <vector>
 #include <optional>
 
@@ -23,6 +24,11 @@ enum class RequestType {
   inject_input,
   inject_output,
   type_string,
+  batch,
+  subscribe,
+  statistics,
+  recent_events,
+  profile_report,
 };
 
 struct Request {
@@ -40,4 +46,6 @@ bool interpret_commandline(Settings& settings, int argc, wchar_t* argv[]);
 #else
 bool interpret_commandline(Settings& settings, int argc, char* argv[]);
 #endif
+// interprets one line of arguments read in batch mode
+bool interpret_line(Settings& settings, std::string_view line);
 void print_help_message();
@@ -1,8 +1,11 @@
 
 #include "control/Settings.h"
 #include "control/ClientPort.h"
+#include <algorithm>
 #include <thread>
 #include <filesystem>
+#include <iostream>
+#include <sstream>
 
 namespace {
   enum Result : int {
@@ -19,6 +22,9 @@ namespace {
     std::optional<KeyState> state;
   };
   
+  // number of received lines, which are sent at once in batch mode
+  const auto max_pipelined_lines = size_t{ 256 };
+
   Settings g_settings;
   ClientPort g_client;
   std::string g_instance_id;
@@ -32,13 +38,6 @@ namespace {
     return { Result::yes, state };
   }
 
-  SendResult set_key_state(std::string_view key, KeyState state, 
-      std::optional<Duration> timeout) {
-    if (!g_client.send_set_virtual_key_state(key, state))
-      return { Result::connection_failed };
-    return read_virtual_key_state(timeout);
-  }
-
   SendResult get_key_state(std::string_view key, 
       std::optional<Duration>timeout) {
     if (!g_client.send_get_virtual_key_state(key))
@@ -91,57 +90,148 @@ namespace {
     return Result::yes;
   }
 
-  Result inject_input(const std::string& string, std::optional<Duration>timeout) {
-    if (!g_client.send_inject_input(string))
+  Result read_statistics(std::optional<Duration> timeout) {
+    auto statistics = std::optional<std::string>();
+    if (!g_client.read_statistics(timeout, &statistics))
       return Result::connection_failed;
-    return to_result(read_virtual_key_state(timeout));
+    if (!statistics)
+      return Result::timeout;
+    // keymapperd is not connected
+    if (statistics->empty())
+      return Result::no;
+    std::fputs(statistics->c_str(), stdout);
+    std::fflush(stdout);
+    return Result::yes;
   }
 
-  Result inject_output(const std::string& string, std::optional<Duration>timeout) {
-    if (!g_client.send_inject_output(string))
+  Result request_statistics(bool recent_events,
+      std::optional<Duration> timeout) {
+    if (!g_client.send_request_statistics(recent_events))
       return Result::connection_failed;
-    return to_result(read_virtual_key_state(timeout));
+    return read_statistics(timeout);
   }
 
-  Result type_string(const std::string& string, std::optional<Duration>timeout) {
-    if (!g_client.send_type_string(string))
+  Result request_profile_report(std::optional<Duration> timeout) {
+    if (!g_client.send_request_profile_report())
       return Result::connection_failed;
-    return to_result(read_virtual_key_state(timeout));
+    return read_statistics(timeout);
   }
 
-  Result make_request(const Request& request, const Result& last_result) {
+  Result subscribe(std::optional<Duration> timeout) {
+    if (!g_client.send_subscribe())
+      return Result::connection_failed;
+    const auto end = (timeout ? 
+      std::make_optional(Clock::now() + 
+        std::chrono::duration_cast<Clock::duration>(*timeout)) :
+      std::nullopt);
+    for (;;) {
+      auto remaining = std::optional<Duration>();
+      if (end)
+        remaining = std::max(Duration(*end - Clock::now()), Duration::zero());
+      auto events = std::string();
+      if (!g_client.read_subscribed_events(remaining, &events))
+        return Result::connection_failed;
+      std::fputs(events.c_str(), stdout);
+      std::fflush(stdout);
+      if (end && Clock::now() >= *end)
+        return Result::timeout;
+    }
+  }
+
+  // requests which are answered with a single virtual key state
+  bool is_pipelined(RequestType type) {
+    switch (type) {
+      case RequestType::press:
+      case RequestType::release:
+      case RequestType::toggle:
+      case RequestType::is_pressed:
+      case RequestType::is_released:
+      case RequestType::inject_input:
+      case RequestType::inject_output:
+      case RequestType::type_string:
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  // several keys are set by a single message
+  bool send_set_virtual_key_state(const std::string& names, KeyState state) {
+    if (names.find(' ') == std::string::npos)
+      return g_client.send_set_virtual_key_state(names, state);
+    auto keys = std::vector<std::string>();
+    auto stream = std::istringstream(names);
+    for (auto name = std::string(); stream >> name; )
+      keys.push_back(name);
+    return g_client.send_set_virtual_key_states(keys, state);
+  }
+
+  bool send_request(const Request& request) {
     switch (request.type) {
       case RequestType::press:
+        return send_set_virtual_key_state(request.string, KeyState::Down);
       case RequestType::release:
-      case RequestType::toggle: {
-        const auto [result, state] = set_key_state(request.string,
-            (request.type == RequestType::press ? KeyState::Down :
-             request.type == RequestType::release ? KeyState::Up :
-             KeyState::Not), request.timeout);
-        if (result == Result::yes) {
-          if (state == KeyState::Up || state == KeyState::Down)
-            return Result::yes;
-          return Result::key_not_found;
-        }
-        return result;
-      }
+        return send_set_virtual_key_state(request.string, KeyState::Up);
+      case RequestType::toggle:
+        return send_set_virtual_key_state(request.string, KeyState::Not);
+      case RequestType::is_pressed:
+      case RequestType::is_released:
+        return g_client.send_get_virtual_key_state(request.string);
+      case RequestType::inject_input:
+        return g_client.send_inject_input(request.string);
+      case RequestType::inject_output:
+        return g_client.send_inject_output(request.string);
+      case RequestType::type_string:
+        return g_client.send_type_string(request.string);
+      default:
+        return false;
+    }
+  }
+
+  Result read_response(const Request& request) {
+    const auto send_result = read_virtual_key_state(request.timeout);
+    const auto [result, state] = send_result;
+    if (result != Result::yes)
+      return result;
+
+    switch (request.type) {
+      case RequestType::press:
+      case RequestType::release:
+      case RequestType::toggle:
+        if (state == KeyState::Up || state == KeyState::Down)
+          return Result::yes;
+        return Result::key_not_found;
 
       case RequestType::is_pressed:
-      case RequestType::is_released: {
-        const auto [result, state] = get_key_state(request.string, request.timeout);
-        if (result == Result::yes) {
-          if (state == KeyState::Down)
-            return (request.type == RequestType::is_pressed ?
-              Result::yes : Result::no);
-          
-          if (state == KeyState::Up)
-            return (request.type == RequestType::is_released ?
-              Result::yes : Result::no);
-          
-          return Result::key_not_found;
-        }
-        return result;
-      }
+      case RequestType::is_released:
+        if (state == KeyState::Down)
+          return (request.type == RequestType::is_pressed ?
+            Result::yes : Result::no);
+        
+        if (state == KeyState::Up)
+          return (request.type == RequestType::is_released ?
+            Result::yes : Result::no);
+        
+        return Result::key_not_found;
+
+      default:
+        return to_result(send_result);
+    }
+  }
+
+  Result make_request(const Request& request, const Result& last_result) {
+    switch (request.type) {
+      case RequestType::press:
+      case RequestType::release:
+      case RequestType::toggle:
+      case RequestType::is_pressed:
+      case RequestType::is_released:
+      case RequestType::inject_input:
+      case RequestType::inject_output:
+      case RequestType::type_string:
+        if (!send_request(request))
+          return Result::connection_failed;
+        return read_response(request);
 
       case RequestType::wait_pressed:
       case RequestType::wait_released:
@@ -170,25 +260,95 @@ namespace {
         break;
 
       case RequestType::restart:
+      case RequestType::batch:
         break;
 
+      case RequestType::subscribe:
+        return subscribe(request.timeout);
+
       case RequestType::set_config_file:
         return set_config_file(request.string, request.timeout);
       
       case RequestType::next_key_info:
         return request_next_key_info(request.timeout);
 
-      case RequestType::inject_input:
-        return inject_input(request.string, request.timeout);
+      case RequestType::statistics:
+        return request_statistics(false, request.timeout);
 
-      case RequestType::inject_output:
-        return inject_output(request.string, request.timeout);
+      case RequestType::recent_events:
+        return request_statistics(true, request.timeout);
 
-      case RequestType::type_string:
-        return type_string(request.string, request.timeout);
+      case RequestType::profile_report:
+        return request_profile_report(request.timeout);
     }
     return last_result;
   }
+
+  struct Line {
+    Settings settings;
+    bool valid;
+  };
+
+  bool is_pipelined(const Line& line) {
+    return line.valid &&
+      std::all_of(line.settings.requests.begin(), line.settings.requests.end(),
+        [](const Request& request) { return is_pipelined(request.type); });
+  }
+
+  void output_result(Result result) {
+    std::fputc('0' + static_cast<int>(result), stdout);
+    std::fputc('\n', stdout);
+  }
+
+  // reads lines of operations from stdin and outputs a result per line.
+  // the requests of all lines which were already received are sent at
+  // once, before the replies are read
+  Result run_batch() {
+    std::ios::sync_with_stdio(false);
+    auto lines = std::vector<Line>();
+    auto string = std::string();
+    while (std::getline(std::cin, string)) {
+      lines.clear();
+      do {
+        auto& line = lines.emplace_back();
+        line.valid = interpret_line(line.settings, string);
+      } while (lines.size() < max_pipelined_lines &&
+               std::cin.rdbuf()->in_avail() > 0 &&
+               std::getline(std::cin, string));
+
+      for (auto begin = size_t{ }; begin < lines.size(); ) {
+        auto end = begin;
+        for (; end < lines.size() && is_pipelined(lines[end]); ++end)
+          for (const auto& request : lines[end].settings.requests)
+            if (!send_request(request))
+              return Result::connection_failed;
+
+        for (; begin < end; ++begin) {
+          auto result = Result::yes;
+          for (const auto& request : lines[begin].settings.requests)
+            result = read_response(request);
+          if (result == Result::connection_failed)
+            return result;
+          output_result(result);
+        }
+
+        // other lines are processed one by one
+        if (begin < lines.size()) {
+          const auto& line = lines[begin++];
+          auto result = (line.valid ? Result::yes : Result::invalid_arguments);
+          if (line.valid)
+            for (const auto& request : line.settings.requests)
+              result = make_request(request, result);
+          if (result == Result::connection_failed)
+            return result;
+          output_result(result);
+          std::fflush(stdout);
+        }
+      }
+      std::fflush(stdout);
+    }
+    return Result::yes;
+  }
 } // namespace
 
 #if defined(_WIN32)
@@ -221,6 +381,9 @@ RESTART:
 
       goto RESTART;
     }
+    else if (request.type == RequestType::batch) {
+      result = run_batch();
+    }
     else {
       result = make_request(request, result);
     }
@@ -0,0 +1,74 @@
+
+#include "keymapper.h"
+#include "config/ParseConfig.h"
+#include "config/ContextMatcher.h"
+#include "config/build_multi_stage.h"
+#include <sstream>
+
+namespace keymapper {
+
+ProgramPtr Program::parse(const std::string& config) {
+  auto parse_config = ParseConfig();
+  auto stream = std::istringstream(config);
+  auto program = std::shared_ptr<Program>(new Program());
+  program->m_config = std::make_unique<Config>(parse_config(stream));
+  program->m_stage = build_multi_stage(*program->m_config);
+  return program;
+}
+
+Program::Program() = default;
+Program::~Program() = default;
+
+size_t Program::context_count() const {
+  return m_config->contexts.size();
+}
+
+const std::string& Program::action_command(Key action_key) const {
+  static const auto none = std::string();
+  const auto index = static_cast<size_t>(*action_key - *Key::first_action);
+  if (!is_action_key(action_key) || index >= m_config->actions.size())
+    return none;
+  return m_config->actions[index].terminal_command;
+}
+
+Instance::Instance(ProgramPtr program)
+  : m_program(std::move(program)),
+    m_stage(m_program->m_stage->clone_configuration()),
+    m_context_matcher(std::make_unique<ContextMatcher>(
+      m_program->m_config->contexts)) {
+}
+
+Instance::~Instance() = default;
+
+ConstKeySequenceRange Instance::set_active_contexts(
+    const std::vector<int>& indices) {
+  m_output = m_stage->set_active_client_contexts(indices);
+  return { m_output.cbegin(), m_output.cend() };
+}
+
+ConstKeySequenceRange Instance::set_active_contexts(
+    const std::string& window_class, const std::string& window_title,
+    const std::string& window_path) {
+  m_context_matcher->match(window_class, window_title, window_path,
+    &m_context_indices);
+  return set_active_contexts(m_context_indices);
+}
+
+ConstKeySequenceRange Instance::update(KeyEvent event, int device_index) {
+  m_output.clear();
+  m_stage->update(event, device_index, m_output);
+  return { m_output.cbegin(), m_output.cend() };
+}
+
+ConstKeySequenceRange Instance::update(ConstKeySequenceRange events,
+    int device_index) {
+  m_output.clear();
+  m_stage->update(events, device_index, m_output);
+  return { m_output.cbegin(), m_output.cend() };
+}
+
+bool Instance::is_clear() const {
+  return m_stage->is_clear();
+}
+
+} // namespace keymapper
@@ -0,0 +1,69 @@
+#pragma once
+
+// The matching engine of keymapper, for embedding it in other programs.
+// It neither depends on the client or the server, nor on global state.
+
+#include "runtime/KeyEvent.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+struct Config;
+class MultiStage;
+class ContextMatcher;
+
+namespace keymapper {
+  // a parsed configuration, which can be shared by several instances
+  class Program {
+  public:
+    // throws std::runtime_error, when the configuration is invalid
+    static std::shared_ptr<const Program> parse(const std::string& config);
+
+    Program(const Program&) = delete;
+    Program& operator=(const Program&) = delete;
+    ~Program();
+
+    size_t context_count() const;
+    // the terminal command of an action key in the output
+    const std::string& action_command(Key action_key) const;
+
+  private:
+    friend class Instance;
+    Program();
+
+    std::unique_ptr<Config> m_config;
+    // the stages, which are cloned for each instance
+    std::unique_ptr<MultiStage> m_stage;
+  };
+  using ProgramPtr = std::shared_ptr<const Program>;
+
+  // the state of matching the input of one seat
+  class Instance {
+  public:
+    explicit Instance(ProgramPtr program);
+    Instance(const Instance&) = delete;
+    Instance& operator=(const Instance&) = delete;
+    ~Instance();
+
+    const ProgramPtr& program() const { return m_program; }
+    // returns the output of activating and deactivating contexts
+    ConstKeySequenceRange set_active_contexts(const std::vector<int>& indices);
+    // activates the contexts, which match the focused window
+    ConstKeySequenceRange set_active_contexts(const std::string& window_class,
+      const std::string& window_title, const std::string& window_path = { });
+    // returns the output, which is valid until the next call. It can
+    // contain virtual keys, action keys and timeouts, which are handled
+    // by the caller
+    ConstKeySequenceRange update(KeyEvent event, int device_index = 0);
+    ConstKeySequenceRange update(ConstKeySequenceRange events,
+      int device_index = 0);
+    bool is_clear() const;
+
+  private:
+    ProgramPtr m_program;
+    std::unique_ptr<MultiStage> m_stage;
+    std::unique_ptr<ContextMatcher> m_context_matcher;
+    std::vector<int> m_context_indices;
+    KeySequence m_output;
+  };
+} // namespace keymapper
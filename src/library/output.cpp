@@ -0,0 +1,7 @@
+
+#include "common/output.h"
+
+// the library does not print, the hosting program reports errors
+void message(const char* format, ...) { }
+void error(const char* format, ...) { }
+void verbose(const char* format, ...) { }
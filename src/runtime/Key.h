@@ -513,6 +513,10 @@ constexpr bool is_action_key(Key key) {
   return (key >= Key::first_action && key <= Key::last_action);
 }
 
+constexpr bool is_logical_key(Key key) {
+  return (key >= Key::first_logical && key <= Key::last_logical);
+}
+
 constexpr bool is_common_modifier(Key key) {
   switch (key) {
     case Key::ShiftLeft:
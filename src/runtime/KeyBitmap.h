@@ -0,0 +1,50 @@
+#pragma once
+
+#include "Key.h"
+#include <bitset>
+#include <limits>
+#include <vector>
+
+// Set of keys with O(1) test/set/reset, indexed by the key code.
+class KeyBitmap {
+public:
+  // every key code is in range, so no checked access is needed
+  bool test(Key key) const { return m_bits[*key]; }
+  void set(Key key) { m_bits[*key] = true; }
+  void reset(Key key) { m_bits[*key] = false; }
+  void reset() { m_bits.reset(); }
+  bool none() const { return m_bits.none(); }
+  size_t count() const { return m_bits.count(); }
+
+private:
+  std::bitset<std::numeric_limits<uint16_t>::max() + 1> m_bits;
+};
+
+// Set of keys with O(1) insert/erase/contains, which is cleared in time
+// proportional to the number of inserts since the last clear.
+class KeySet {
+public:
+  bool contains(Key key) const { return m_bitmap.test(key); }
+  bool empty() const { return m_keys.empty(); }
+  void reserve(size_t size) { m_keys.reserve(size); }
+  size_t capacity() const { return m_keys.capacity(); }
+
+  void insert(Key key) {
+    if (!m_bitmap.test(key)) {
+      m_bitmap.set(key);
+      m_keys.push_back(key);
+    }
+  }
+
+  void erase(Key key) { m_bitmap.reset(key); }
+
+  void clear() {
+    for (auto key : m_keys)
+      m_bitmap.reset(key);
+    m_keys.clear();
+  }
+
+private:
+  KeyBitmap m_bitmap;
+  std::vector<Key> m_keys;
+};
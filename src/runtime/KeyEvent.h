@@ -1,8 +1,13 @@
 #pragma once
 
 #include "Key.h"
+#include <algorithm>
 #include <cstdint>
 #include <cstddef>
+#include <initializer_list>
+#include <iterator>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 // Async means that the key can be pressed/released any time afterwards (but
@@ -68,14 +73,231 @@ inline bool is_not_timeout(const KeyEvent& event) {
   return (event.key == Key::timeout && is_not_timeout(event.state));
 }
 
-class KeySequence : public std::vector<KeyEvent> {
+// A vector of KeyEvents, which stores short sequences inline
+// and only allocates when the inline capacity is exceeded.
+class KeySequence {
 public:
-  KeySequence() = default;
-  KeySequence(std::initializer_list<KeyEvent> keys)
-    : std::vector<KeyEvent>(keys) {
+  static constexpr size_t inline_capacity = 8;
+
+  using value_type = KeyEvent;
+  using size_type = size_t;
+  using difference_type = std::ptrdiff_t;
+  using reference = KeyEvent&;
+  using const_reference = const KeyEvent&;
+  using pointer = KeyEvent*;
+  using const_pointer = const KeyEvent*;
+  using iterator = KeyEvent*;
+  using const_iterator = const KeyEvent*;
+  using reverse_iterator = std::reverse_iterator<iterator>;
+  using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+  KeySequence() noexcept = default;
+  KeySequence(std::initializer_list<KeyEvent> events) {
+    assign(events.begin(), events.end());
+  }
+  template<typename It, typename = decltype(*std::declval<It>())>
+  KeySequence(It first, It last) {
+    assign(first, last);
+  }
+  KeySequence(const KeySequence& rhs) {
+    assign(rhs.begin(), rhs.end());
+  }
+  KeySequence(KeySequence&& rhs) noexcept {
+    move_from(rhs);
+  }
+  KeySequence& operator=(const KeySequence& rhs) {
+    if (this != &rhs)
+      assign(rhs.begin(), rhs.end());
+    return *this;
+  }
+  KeySequence& operator=(KeySequence&& rhs) noexcept {
+    if (this != &rhs) {
+      deallocate();
+      move_from(rhs);
+    }
+    return *this;
   }
+  KeySequence& operator=(std::initializer_list<KeyEvent> events) {
+    assign(events.begin(), events.end());
+    return *this;
+  }
+  ~KeySequence() {
+    deallocate();
+  }
+
+  template<typename It>
+  void assign(It first, It last) {
+    clear();
+    reserve(static_cast<size_t>(std::distance(first, last)));
+    for (; first != last; ++first)
+      m_data[m_size++] = *first;
+  }
+
+  iterator begin() noexcept { return m_data; }
+  iterator end() noexcept { return m_data + m_size; }
+  const_iterator begin() const noexcept { return m_data; }
+  const_iterator end() const noexcept { return m_data + m_size; }
+  const_iterator cbegin() const noexcept { return m_data; }
+  const_iterator cend() const noexcept { return m_data + m_size; }
+  reverse_iterator rbegin() noexcept { return reverse_iterator(end()); }
+  reverse_iterator rend() noexcept { return reverse_iterator(begin()); }
+  const_reverse_iterator rbegin() const noexcept { return const_reverse_iterator(end()); }
+  const_reverse_iterator rend() const noexcept { return const_reverse_iterator(begin()); }
+
+  bool empty() const noexcept { return (m_size == 0); }
+  size_t size() const noexcept { return m_size; }
+  size_t capacity() const noexcept { return m_capacity; }
+  KeyEvent* data() noexcept { return m_data; }
+  const KeyEvent* data() const noexcept { return m_data; }
+  KeyEvent& operator[](size_t index) { return m_data[index]; }
+  const KeyEvent& operator[](size_t index) const { return m_data[index]; }
+  KeyEvent& front() { return m_data[0]; }
+  const KeyEvent& front() const { return m_data[0]; }
+  KeyEvent& back() { return m_data[m_size - 1]; }
+  const KeyEvent& back() const { return m_data[m_size - 1]; }
+
+  void clear() noexcept { m_size = 0; }
+  void pop_back() { --m_size; }
+
+  void reserve(size_t capacity) {
+    if (capacity <= m_capacity)
+      return;
+    auto data = new KeyEvent[capacity];
+    std::copy(begin(), end(), data);
+    if (!is_inline())
+      delete[] m_data;
+    m_data = data;
+    m_capacity = static_cast<uint32_t>(capacity);
+  }
+
+  void resize(size_t size, const KeyEvent& value = { }) {
+    const auto fill = value;
+    if (size > m_size) {
+      grow(size);
+      std::fill(end(), m_data + size, fill);
+    }
+    m_size = static_cast<uint32_t>(size);
+  }
+
+  void push_back(KeyEvent event) {
+    grow(m_size + 1);
+    m_data[m_size++] = event;
+  }
+
+  template<typename... Args>
+  KeyEvent& emplace_back(Args&&... args) {
+    push_back(KeyEvent(std::forward<Args>(args)...));
+    return back();
+  }
+
+  iterator insert(const_iterator pos, KeyEvent event) {
+    return insert(pos, &event, &event + 1);
+  }
+
+  template<typename It>
+  iterator insert(const_iterator pos, It first, It last) {
+    const auto offset = static_cast<size_t>(pos - m_data);
+    const auto count = static_cast<size_t>(std::distance(first, last));
+    if (!count)
+      return m_data + offset;
+    if (m_size + count > m_capacity || overlaps(first)) {
+      // copy first, range could be part of this sequence
+      auto events = KeySequence(first, last);
+      grow(m_size + count);
+      return insert(m_data + offset, events.begin(), events.end());
+    }
+    std::copy_backward(m_data + offset, end(), end() + count);
+    std::copy(first, last, m_data + offset);
+    m_size += static_cast<uint32_t>(count);
+    return m_data + offset;
+  }
+
+  iterator erase(const_iterator pos) {
+    return erase(pos, pos + 1);
+  }
+
+  iterator erase(const_iterator first, const_iterator last) {
+    const auto offset = static_cast<size_t>(first - m_data);
+    const auto count = static_cast<size_t>(last - first);
+    std::copy(m_data + offset + count, end(), m_data + offset);
+    m_size -= static_cast<uint32_t>(count);
+    return m_data + offset;
+  }
+
+  void swap(KeySequence& rhs) noexcept {
+    auto tmp = std::move(rhs);
+    rhs = std::move(*this);
+    *this = std::move(tmp);
+  }
+
+  bool operator==(const KeySequence& rhs) const {
+    return std::equal(begin(), end(), rhs.begin(), rhs.end());
+  }
+  bool operator!=(const KeySequence& rhs) const {
+    return !(*this == rhs);
+  }
+
+private:
+  bool is_inline() const noexcept {
+    return (m_data == m_inline);
+  }
+
+  template<typename It>
+  bool overlaps(It it) const noexcept {
+    if constexpr (std::is_convertible_v<It, const KeyEvent*>) {
+      const auto pointer = static_cast<const KeyEvent*>(it);
+      return (pointer >= m_data && pointer < m_data + m_size);
+    }
+    return false;
+  }
+
+  void grow(size_t size) {
+    if (size > m_capacity)
+      reserve(std::max(size, size_t{ m_capacity } * 2));
+  }
+
+  void deallocate() noexcept {
+    if (!is_inline())
+      delete[] m_data;
+    m_data = m_inline;
+    m_capacity = inline_capacity;
+    m_size = 0;
+  }
+
+  void move_from(KeySequence& rhs) noexcept {
+    if (rhs.is_inline()) {
+      std::copy(rhs.begin(), rhs.end(), m_inline);
+      m_data = m_inline;
+      m_capacity = inline_capacity;
+    }
+    else {
+      m_data = rhs.m_data;
+      m_capacity = rhs.m_capacity;
+    }
+    m_size = rhs.m_size;
+    rhs.m_data = rhs.m_inline;
+    rhs.m_capacity = inline_capacity;
+    rhs.m_size = 0;
+  }
+
+  KeyEvent* m_data{ m_inline };
+  uint32_t m_size{ };
+  uint32_t m_capacity{ inline_capacity };
+  KeyEvent m_inline[inline_capacity];
 };
 
+inline void swap(KeySequence& a, KeySequence& b) noexcept { a.swap(b); }
+inline KeySequence::iterator begin(KeySequence& s) { return s.begin(); }
+inline KeySequence::iterator end(KeySequence& s) { return s.end(); }
+inline KeySequence::const_iterator begin(const KeySequence& s) { return s.begin(); }
+inline KeySequence::const_iterator end(const KeySequence& s) { return s.end(); }
+inline KeySequence::const_iterator cbegin(const KeySequence& s) { return s.begin(); }
+inline KeySequence::const_iterator cend(const KeySequence& s) { return s.end(); }
+inline KeySequence::reverse_iterator rbegin(KeySequence& s) { return s.rbegin(); }
+inline KeySequence::reverse_iterator rend(KeySequence& s) { return s.rend(); }
+inline KeySequence::const_reverse_iterator rbegin(const KeySequence& s) { return s.rbegin(); }
+inline KeySequence::const_reverse_iterator rend(const KeySequence& s) { return s.rend(); }
+
 template<typename It>
 class Range {
 public:
@@ -103,5 +325,8 @@ private:
   Iterator m_end;
 };
 
+template<typename It> It begin(const Range<It>& range) { return range.begin(); }
+template<typename It> It end(const Range<It>& range) { return range.end(); }
+
 using ConstKeySequenceRange = Range<KeySequence::const_iterator>;
 using KeySequenceRange = Range<KeySequence::iterator>;
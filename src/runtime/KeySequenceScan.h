@@ -0,0 +1,231 @@
+#pragma once
+
+#include "KeyEvent.h"
+#include <cstddef>
+#include <cstdint>
+
+// Linear scans over KeyEvents and Keys, which compare several elements
+// at once where SIMD instructions are available. The vectorized paths
+// rely on the little-endian layout of KeyEvent (key in the low 16 bits,
+// followed by state and value), which is checked by the tests.
+#if defined(__AVX2__)
+# include <immintrin.h>
+# define KEY_SEQUENCE_SCAN_AVX2
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+# include <emmintrin.h>
+# define KEY_SEQUENCE_SCAN_SSE2
+#elif defined(__ARM_NEON) && defined(__aarch64__) && !defined(__ARM_BIG_ENDIAN)
+# include <arm_neon.h>
+# define KEY_SEQUENCE_SCAN_NEON
+#endif
+
+namespace key_scan {
+  using StateMask = uint32_t;
+
+  constexpr StateMask state_mask(KeyState state) {
+    return StateMask{ 1 } << static_cast<int>(state);
+  }
+
+  template<typename... S>
+  constexpr StateMask states(S... state) {
+    return (state_mask(state) | ...);
+  }
+
+  namespace detail {
+    const auto key_bits = uint32_t{ 0x0000FFFF };
+    const auto state_bits = uint32_t{ 0x000F0000 };
+    const auto all_bits = uint32_t{ 0xFFFFFFFF };
+
+    // layout independent, compiles to a plain load on little-endian
+    inline uint32_t to_word(const KeyEvent& event) {
+      return static_cast<uint32_t>(event.key) |
+        (static_cast<uint32_t>(event.state) << 16) |
+        (static_cast<uint32_t>(event.value) << 20);
+    }
+
+    // matches when (word & mask) equals one of the values
+    struct Pattern {
+      uint32_t mask;
+      uint32_t values[16];
+      int count;
+    };
+
+    inline Pattern make_pattern(uint32_t mask, uint32_t value) {
+      auto pattern = Pattern{ mask, { value }, 1 };
+      return pattern;
+    }
+
+    inline Pattern make_state_pattern(StateMask states) {
+      auto pattern = Pattern{ state_bits, { }, 0 };
+      for (auto state = 0; state < 16; ++state)
+        if (states & (StateMask{ 1 } << state))
+          pattern.values[pattern.count++] = static_cast<uint32_t>(state) << 16;
+      return pattern;
+    }
+
+    inline bool matches(const Pattern& pattern, uint32_t word) {
+      word &= pattern.mask;
+      for (auto i = 0; i < pattern.count; ++i)
+        if (word == pattern.values[i])
+          return true;
+      return false;
+    }
+
+    inline int lowest_bit(uint32_t bits) {
+#if defined(__GNUC__)
+      return __builtin_ctz(bits);
+#else
+      auto index = 0;
+      for (; !(bits & 1); bits >>= 1)
+        ++index;
+      return index;
+#endif
+    }
+
+    inline int highest_bit(uint32_t bits) {
+#if defined(__GNUC__)
+      return 31 - __builtin_clz(bits);
+#else
+      auto index = -1;
+      for (; bits; bits >>= 1)
+        ++index;
+      return index;
+#endif
+    }
+
+#if defined(KEY_SEQUENCE_SCAN_AVX2)
+    const auto events_per_block = size_t{ 8 };
+
+    // returns one bit per matching event
+    inline uint32_t match_block(const KeyEvent* events, const Pattern& pattern) {
+      const auto words = _mm256_and_si256(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(events)),
+        _mm256_set1_epi32(static_cast<int>(pattern.mask)));
+      auto result = _mm256_setzero_si256();
+      for (auto i = 0; i < pattern.count; ++i)
+        result = _mm256_or_si256(result, _mm256_cmpeq_epi32(words,
+          _mm256_set1_epi32(static_cast<int>(pattern.values[i]))));
+      return static_cast<uint32_t>(
+        _mm256_movemask_ps(_mm256_castsi256_ps(result)));
+    }
+#elif defined(KEY_SEQUENCE_SCAN_SSE2)
+    const auto events_per_block = size_t{ 4 };
+
+    inline uint32_t match_block(const KeyEvent* events, const Pattern& pattern) {
+      const auto words = _mm_and_si128(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(events)),
+        _mm_set1_epi32(static_cast<int>(pattern.mask)));
+      auto result = _mm_setzero_si128();
+      for (auto i = 0; i < pattern.count; ++i)
+        result = _mm_or_si128(result, _mm_cmpeq_epi32(words,
+          _mm_set1_epi32(static_cast<int>(pattern.values[i]))));
+      return static_cast<uint32_t>(
+        _mm_movemask_ps(_mm_castsi128_ps(result)));
+    }
+#elif defined(KEY_SEQUENCE_SCAN_NEON)
+    const auto events_per_block = size_t{ 4 };
+
+    inline uint32_t match_block(const KeyEvent* events, const Pattern& pattern) {
+      const auto words = vandq_u32(
+        vld1q_u32(reinterpret_cast<const uint32_t*>(events)),
+        vdupq_n_u32(pattern.mask));
+      auto result = vdupq_n_u32(0);
+      for (auto i = 0; i < pattern.count; ++i)
+        result = vorrq_u32(result,
+          vceqq_u32(words, vdupq_n_u32(pattern.values[i])));
+      const uint32_t lane_bits[4] = { 1, 2, 4, 8 };
+      return vaddvq_u32(vandq_u32(result, vld1q_u32(lane_bits)));
+    }
+#endif
+
+    // index of first matching event or count
+    inline size_t find(const KeyEvent* events, size_t count,
+        const Pattern& pattern) {
+      auto i = size_t{ };
+#if defined(KEY_SEQUENCE_SCAN_AVX2) || defined(KEY_SEQUENCE_SCAN_SSE2) || \
+    defined(KEY_SEQUENCE_SCAN_NEON)
+      for (; i + events_per_block <= count; i += events_per_block)
+        if (const auto bits = match_block(events + i, pattern))
+          return i + static_cast<size_t>(lowest_bit(bits));
+#endif
+      for (; i < count; ++i)
+        if (matches(pattern, to_word(events[i])))
+          return i;
+      return count;
+    }
+
+    // index of last matching event or count
+    inline size_t rfind(const KeyEvent* events, size_t count,
+        const Pattern& pattern) {
+      auto i = count;
+#if defined(KEY_SEQUENCE_SCAN_AVX2) || defined(KEY_SEQUENCE_SCAN_SSE2) || \
+    defined(KEY_SEQUENCE_SCAN_NEON)
+      for (; i >= events_per_block; i -= events_per_block)
+        if (const auto bits = match_block(
+              events + i - events_per_block, pattern))
+          return i - events_per_block + static_cast<size_t>(highest_bit(bits));
+#endif
+      while (i-- > 0)
+        if (matches(pattern, to_word(events[i])))
+          return i;
+      return count;
+    }
+  } // namespace detail
+
+  inline size_t find_key(const KeyEvent* events, size_t count, Key key) {
+    return detail::find(events, count, detail::make_pattern(
+      detail::key_bits, static_cast<uint32_t>(key)));
+  }
+
+  inline size_t rfind_key(const KeyEvent* events, size_t count, Key key) {
+    return detail::rfind(events, count, detail::make_pattern(
+      detail::key_bits, static_cast<uint32_t>(key)));
+  }
+
+  inline size_t find_event(const KeyEvent* events, size_t count,
+      const KeyEvent& event) {
+    return detail::find(events, count, detail::make_pattern(
+      detail::all_bits, detail::to_word(event)));
+  }
+
+  inline size_t find_state(const KeyEvent* events, size_t count,
+      StateMask states) {
+    return detail::find(events, count, detail::make_state_pattern(states));
+  }
+
+  inline size_t rfind_state(const KeyEvent* events, size_t count,
+      StateMask states) {
+    return detail::rfind(events, count, detail::make_state_pattern(states));
+  }
+
+  // index of first key or count
+  inline size_t find_key(const Key* keys, size_t count, Key key) {
+    auto i = size_t{ };
+#if defined(KEY_SEQUENCE_SCAN_SSE2)
+    const auto value = _mm_set1_epi16(static_cast<short>(key));
+    for (; i + 8 <= count; i += 8) {
+      const auto equal = _mm_cmpeq_epi16(value,
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + i)));
+      if (const auto bits = static_cast<uint32_t>(_mm_movemask_epi8(equal)))
+        return i + static_cast<size_t>(detail::lowest_bit(bits) / 2);
+    }
+#elif defined(KEY_SEQUENCE_SCAN_NEON)
+    const auto value = vdupq_n_u16(static_cast<uint16_t>(key));
+    for (; i + 8 <= count; i += 8) {
+      const auto equal = vceqq_u16(value,
+        vld1q_u16(reinterpret_cast<const uint16_t*>(keys + i)));
+      // narrow to 4 bits per key
+      const auto bits = vget_lane_u64(vreinterpret_u64_u8(
+        vshrn_n_u16(equal, 4)), 0);
+      if (bits)
+        return i + static_cast<size_t>(__builtin_ctzll(bits) / 4);
+    }
+#endif
+    for (; i < count; ++i)
+      if (keys[i] == key)
+        return i;
+    return count;
+  }
+} // namespace key_scan
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "Key.h"
+#include <algorithm>
+#include <vector>
+
+// The keys logical keys like Shift stand for. The mappings keep the logical
+// keys, which are matched with either of their keys and output as the key
+// which was matched. A definition's keys can be logical keys defined before.
+class LogicalKeys {
+public:
+  struct Definition {
+    Key logical;
+    Key left;
+    Key right;
+  };
+
+  LogicalKeys() = default;
+
+  explicit LogicalKeys(std::vector<Definition> definitions)
+      : m_definitions(std::move(definitions)) {
+    for (const auto& [logical, left, right] : m_definitions) {
+      if (!is_logical_key(logical))
+        continue;
+      const auto index = static_cast<size_t>(*logical - *Key::first_logical);
+      if (index >= m_keys.size())
+        m_keys.resize(index + 1);
+      auto keys = std::vector<Key>();
+      for (auto key : { left, right })
+        if (!is_logical_key(key))
+          keys.push_back(key);
+        else
+          for (auto resolved : this->keys(key))
+            keys.push_back(resolved);
+      m_keys[index] = std::move(keys);
+    }
+  }
+
+  bool empty() const { return m_definitions.empty(); }
+  const std::vector<Definition>& definitions() const { return m_definitions; }
+
+  // the physical keys of a logical key, the first is output by default
+  const std::vector<Key>& keys(Key logical) const {
+    static const auto none = std::vector<Key>();
+    const auto index = static_cast<size_t>(*logical - *Key::first_logical);
+    return (is_logical_key(logical) && index < m_keys.size() ?
+      m_keys[index] : none);
+  }
+
+  // whether the keys are equal or one is a logical key standing for the other
+  bool equivalent(Key a, Key b) const {
+    if (a == b)
+      return true;
+    if (is_logical_key(a))
+      return contains(keys(a), b);
+    if (is_logical_key(b))
+      return contains(keys(b), a);
+    return false;
+  }
+
+private:
+  static bool contains(const std::vector<Key>& keys, Key key) {
+    return std::find(keys.begin(), keys.end(), key) != keys.end();
+  }
+
+  std::vector<Definition> m_definitions;
+  // resolved keys, indexed by logical key
+  std::vector<std::vector<Key>> m_keys;
+};
@@ -1,7 +1,9 @@
 
+#include "KeySequenceScan.h"
 #include "MatchKeySequence.h"
 #include <cassert>
 #include <algorithm>
+#include <array>
 
 namespace {
   bool unifiable(KeyState a, KeyState b) {
@@ -46,12 +48,125 @@ namespace {
       return timeout_unifiable(a, b);
     return unifiable(a.state, b.state);
   }
+
+  bool is_down(const KeyEvent& event) {
+    return (event.state == KeyState::Down ||
+            event.state == KeyState::DownMatched);
+  }
 } // namespace
 
-MatchResult MatchKeySequence::operator()(ConstKeySequenceRange expression,
-                                         ConstKeySequenceRange sequence,
-                                         std::vector<Key>* any_key_matches,
-                                         KeyEvent* input_timeout_event) const {
+std::optional<CompiledKeySequence> CompiledKeySequence::compile(
+    const KeySequence& expression) {
+  const auto max_async = 64u;
+  const auto max_keys = 0xFFFFu;
+
+  auto compiled = CompiledKeySequence();
+  auto& keys = compiled.m_keys;
+  auto async = std::vector<std::pair<Key, uint8_t>>();
+  auto async_count = 0u;
+  auto not_keys = std::vector<Key>();
+  auto arrival_not_keys = std::vector<Key>();
+
+  const auto add_keys = [&](auto begin, auto end) {
+    const auto range_begin = keys.size();
+    keys.insert(keys.end(), begin, end);
+    return KeyRange{ static_cast<uint16_t>(range_begin),
+                     static_cast<uint16_t>(keys.size()) };
+  };
+
+  const auto add_state = [&](const KeyEvent& event) {
+    auto& state = compiled.m_states.emplace_back();
+    state.event = event;
+    state.arrival_not_keys = add_keys(arrival_not_keys.begin(), arrival_not_keys.end());
+    state.not_keys = add_keys(not_keys.begin(), not_keys.end());
+    state.pending.begin = static_cast<uint16_t>(keys.size());
+    for (const auto& [key, index] : async) {
+      keys.push_back(key);
+      compiled.m_pending_async.resize(keys.size());
+      compiled.m_pending_async.back() = index;
+    }
+    state.pending.end = static_cast<uint16_t>(keys.size());
+    arrival_not_keys.clear();
+  };
+
+  for (const auto& ee : expression) {
+    if (ee.key == Key::any || ee.key == Key::none)
+      return std::nullopt;
+
+    // keep track of Not keys like the interpreter does
+    if (ee.state == KeyState::Down)
+      not_keys.erase(std::remove(not_keys.begin(), not_keys.end(), ee.key),
+        not_keys.end());
+    for (auto key : not_keys)
+      if (std::find(arrival_not_keys.begin(), arrival_not_keys.end(),
+            key) == arrival_not_keys.end())
+        arrival_not_keys.push_back(key);
+
+    if (ee.key == Key::timeout) {
+      add_state(ee);
+    }
+    else if (ee.state == KeyState::Down) {
+      add_state(ee);
+      // a Down can only be passed by a direct match,
+      // which removes the async events of the key
+      async.erase(std::remove_if(async.begin(), async.end(),
+        [&](const auto& a) { return a.first == ee.key; }), async.end());
+    }
+    else if (ee.state == KeyState::Up) {
+      // an Up can also be passed by an async match,
+      // so its removal is tracked while matching
+      add_state(ee);
+    }
+    else if (ee.state == KeyState::UpAsync) {
+      if (async_count == max_async)
+        return std::nullopt;
+      async.emplace_back(ee.key, static_cast<uint8_t>(async_count++));
+    }
+    else if (ee.state == KeyState::Not) {
+      not_keys.push_back(ee.key);
+    }
+    else {
+      return std::nullopt;
+    }
+  }
+
+  // final state
+  for (auto key : not_keys)
+    if (std::find(arrival_not_keys.begin(), arrival_not_keys.end(),
+          key) == arrival_not_keys.end())
+      arrival_not_keys.push_back(key);
+  add_state(KeyEvent{ });
+
+  if (keys.size() > max_keys)
+    return std::nullopt;
+
+  auto& features = compiled.m_features;
+  if (!compiled.m_pending_async.empty())
+    features |= Feature::async;
+  for (const auto& state : compiled.m_states) {
+    if (state.not_keys.begin != state.not_keys.end ||
+        state.arrival_not_keys.begin != state.arrival_not_keys.end)
+      features |= Feature::not_keys;
+    if (state.event.key == Key::timeout)
+      features |= Feature::timeout;
+    else if (state.event.key != Key::none &&
+             state.event.state == KeyState::Up)
+      features |= Feature::up_states;
+  }
+  return compiled;
+}
+
+size_t CompiledKeySequence::memory_usage() const {
+  return m_states.capacity() * sizeof(State) +
+    m_keys.capacity() * sizeof(Key) +
+    m_pending_async.capacity() * sizeof(uint8_t);
+}
+
+MatchResult MatchKeySequence::match(ConstKeySequenceRange expression,
+                                    ConstKeySequenceRange sequence,
+                                    std::vector<Key>* any_key_matches,
+                                    KeyEvent* input_timeout_event,
+                                    Scratch& scratch) {
   assert(!expression.empty() && !sequence.empty());
   assert(any_key_matches && input_timeout_event);
   any_key_matches->clear();
@@ -60,9 +175,16 @@ MatchResult MatchKeySequence::operator()(ConstKeySequenceRange expression,
   auto e = 0u;
   auto s = 0u;
   auto is_no_might_match = false;
-  m_async.clear();
-  m_not_keys.clear();
-  m_ignore_ups.clear();
+  scratch.async.clear();
+  scratch.async_keys.clear();
+  scratch.async_any_key = false;
+  scratch.not_keys.clear();
+  scratch.ignore_ups.clear();
+
+  // whether an async can be unified with a key
+  const auto maybe_async = [&](Key key) {
+    return (scratch.async_any_key || scratch.async_keys.contains(key));
+  };
 
   while (e < expression.size() || s < sequence.size()) {
     const auto& se = (s < sequence.size() ? sequence[s] : matches_none);
@@ -72,23 +194,24 @@ MatchResult MatchKeySequence::operator()(ConstKeySequenceRange expression,
 
     // undo adding to Not keys
     if (ee.state == KeyState::Down)
-      m_not_keys.erase(
-        std::remove(m_not_keys.begin(), m_not_keys.end(), ee.key), m_not_keys.end());
+      scratch.not_keys.erase(ee.key);
 
     // check if key must not be down
     if ((se.state == KeyState::Down || 
          se.state == KeyState::DownMatched) &&
-        std::count(m_not_keys.begin(), m_not_keys.end(), se.key))
+        scratch.not_keys.contains(se.key))
       return MatchResult::no_match;;
 
     if (ee.state == KeyState::DownAsync ||
         ee.state == KeyState::UpAsync) {
-      m_async.push_back(ee);
+      scratch.async.push_back(ee);
+      scratch.async_keys.insert(ee.key);
+      scratch.async_any_key |= (ee.key == Key::any);
       ++e;
     }
     else if (ee.state == KeyState::Not && ee.key != Key::timeout) {
       // add to Not keys
-      m_not_keys.push_back(ee.key);
+      scratch.not_keys.insert(ee.key);
       ++e;
     }
     else if (unifiable(se, ee)) {
@@ -100,9 +223,10 @@ MatchResult MatchKeySequence::operator()(ConstKeySequenceRange expression,
         any_key_matches->push_back(se.key);
 
       // remove from async
-      m_async.erase(std::remove_if(begin(m_async), end(m_async),
-        [&](const KeyEvent& e) { return (se.key == e.key); }), 
-        end(m_async));
+      if (scratch.async_keys.contains(se.key))
+        scratch.async.erase(std::remove_if(begin(scratch.async), end(scratch.async),
+          [&](const KeyEvent& e) { return (se.key == e.key); }), 
+          end(scratch.async));
     }
     else if (ee.key == Key::timeout && se == matches_none) {
       // when a timeout is encountered and sequence ended
@@ -119,13 +243,14 @@ MatchResult MatchKeySequence::operator()(ConstKeySequenceRange expression,
         return MatchResult::no_match;
 
       // try to match sequence event with async
-      auto it = std::find_if(begin(m_async), end(m_async),
-        [&](const KeyEvent& e) {
-          return (e.state == async_state &&
-            unifiable(se.key, e.key));
-        });
+      auto it = (!maybe_async(se.key) ? end(scratch.async) :
+        std::find_if(begin(scratch.async), end(scratch.async),
+          [&](const KeyEvent& e) {
+            return (e.state == async_state &&
+              unifiable(se.key, e.key));
+          }));
 
-      if (it != end(m_async)) {
+      if (it != end(scratch.async)) {
         // mark async as matched
         it->state = se.state;
         ++s;
@@ -139,23 +264,25 @@ MatchResult MatchKeySequence::operator()(ConstKeySequenceRange expression,
       }
 
       // try to match expression event with async
-      it = std::find_if(begin(m_async), end(m_async),
-        [&](const KeyEvent& e) { return unifiable(ee, e); });
+      it = (scratch.async.empty() || (ee.key != Key::any && !maybe_async(ee.key)) ? 
+        end(scratch.async) :
+        std::find_if(begin(scratch.async), end(scratch.async),
+          [&](const KeyEvent& e) { return unifiable(ee, e); }));
 
-      if (it != end(m_async)) {
+      if (it != end(scratch.async)) {
         // remove async
-        m_async.erase(it);
+        scratch.async.erase(it);
         ++e;
         continue;
       }
 
-      if (ee.state == KeyState::Down) {
+      if (ee.state == KeyState::Down && scratch.async_keys.contains(ee.key)) {
         // look for unmatched async up and async down
         // which means that it does not matter if key was released in between
-        it = std::find(begin(m_async), end(m_async), 
+        it = std::find(begin(scratch.async), end(scratch.async), 
           KeyEvent(ee.key, KeyState::DownAsync));
-        if (it != end(m_async) && 
-            it != begin(m_async) && 
+        if (it != end(scratch.async) && 
+            it != begin(scratch.async) && 
             *std::prev(it) == KeyEvent(ee.key, KeyState::UpAsync)) {
           ++e;
           continue;
@@ -167,7 +294,7 @@ MatchResult MatchKeySequence::operator()(ConstKeySequenceRange expression,
           // ignore additional events at the front of history
           if (se != matches_none) {
             if (se.state == KeyState::Down)
-              m_ignore_ups.push_back(se.key);
+              scratch.ignore_ups.insert(se.key);
             ++s;
             continue;
           }
@@ -177,7 +304,7 @@ MatchResult MatchKeySequence::operator()(ConstKeySequenceRange expression,
         else {
           // also ignore Ups of ignored Downs
           if (se.state == KeyState::Up &&
-              std::count(m_ignore_ups.begin(), m_ignore_ups.end(), se.key)) {
+              scratch.ignore_ups.contains(se.key)) {
             ++s;
             continue;
           }
@@ -193,3 +320,181 @@ MatchResult MatchKeySequence::operator()(ConstKeySequenceRange expression,
   return MatchResult::match;
 }
 
+
+void MatchKeySequence::Scratch::reserve(size_t expression_length) {
+  async.reserve(expression_length);
+  async_keys.reserve(expression_length);
+  not_keys.reserve(expression_length);
+  ignore_ups.reserve(expression_length);
+}
+
+size_t MatchKeySequence::Scratch::buffer_footprint() const {
+  return async.capacity() * sizeof(KeyEvent) +
+    (async_keys.capacity() + not_keys.capacity() +
+     ignore_ups.capacity()) * sizeof(Key);
+}
+
+MatchResult MatchKeySequence::match(const CompiledKeySequence& expression,
+                                    ConstKeySequenceRange sequence,
+                                    std::vector<Key>* any_key_matches,
+                                    KeyEvent* input_timeout_event,
+                                    CompiledKeySequence::Cursor* cursor) {
+  assert(!sequence.empty());
+  assert(any_key_matches && input_timeout_event);
+  any_key_matches->clear();
+
+  using Kernel = MatchResult(*)(const CompiledKeySequence&,
+    ConstKeySequenceRange, KeyEvent*, CompiledKeySequence::Cursor*);
+  static constexpr auto kernels = std::array<Kernel, 16>{
+    &match_kernel<0>,  &match_kernel<1>,  &match_kernel<2>,  &match_kernel<3>,
+    &match_kernel<4>,  &match_kernel<5>,  &match_kernel<6>,  &match_kernel<7>,
+    &match_kernel<8>,  &match_kernel<9>,  &match_kernel<10>, &match_kernel<11>,
+    &match_kernel<12>, &match_kernel<13>, &match_kernel<14>, &match_kernel<15>,
+  };
+  return kernels[expression.m_features](
+    expression, sequence, input_timeout_event, cursor);
+}
+
+// specialized for the features an expression uses, branches
+// for the unused ones are removed at compile time
+template<uint8_t Features>
+MatchResult MatchKeySequence::match_kernel(const CompiledKeySequence& expression,
+                                           ConstKeySequenceRange sequence,
+                                           KeyEvent* input_timeout_event,
+                                           CompiledKeySequence::Cursor* cursor) {
+  using KeyRange = CompiledKeySequence::KeyRange;
+  constexpr auto has_not_keys = ((Features & CompiledKeySequence::not_keys) != 0);
+  constexpr auto has_async = ((Features & CompiledKeySequence::async) != 0);
+  constexpr auto has_up_states = ((Features & CompiledKeySequence::up_states) != 0);
+  constexpr auto has_timeout = ((Features & CompiledKeySequence::timeout) != 0);
+
+  // start from the beginning or resume from cursor
+  auto c = (cursor ? *cursor : CompiledKeySequence::Cursor{ });
+  if (c.failed)
+    return MatchResult::no_match;
+  assert(c.position <= sequence.size());
+
+  const auto& keys = expression.m_keys;
+  const auto contains = [&](KeyRange range, Key key) {
+    const auto count = static_cast<size_t>(range.end - range.begin);
+    return (key_scan::find_key(keys.data() + range.begin, count, key) != count);
+  };
+  const auto async_bit = [&](uint16_t index) {
+    return uint64_t{ 1 } << expression.m_pending_async[index];
+  };
+
+  auto saved = false;
+  const auto fail = [&]() {
+    // the prefix cannot match, whatever is appended
+    if (cursor)
+      cursor->failed = true;
+    return MatchResult::no_match;
+  };
+
+  for (;;) {
+    const auto& state = expression.m_states[c.state];
+    auto& s = c.position;
+
+    // the rest depends on the events which follow,
+    // save the first state at the end of the sequence
+    if (cursor && !saved && s >= sequence.size()) {
+      *cursor = c;
+      saved = true;
+    }
+
+    // check if key must not be down
+    if constexpr (has_not_keys) {
+      if (s < sequence.size()) {
+        const auto& se = sequence[s];
+        if (is_down(se) && contains(
+              (c.arrived ? state.arrival_not_keys : state.not_keys), se.key))
+          return fail();
+      }
+      c.arrived = false;
+    }
+
+    const auto& ee = state.event;
+    if (ee.key == Key::none) {
+      if (s >= sequence.size())
+        return MatchResult::match;
+    }
+    else {
+      if (s < sequence.size() && (has_timeout ?
+            unifiable(sequence[s], ee) :
+            (sequence[s].key == ee.key &&
+             unifiable(sequence[s].state, ee.state)))) {
+        // direct match
+        if constexpr (has_async && has_up_states)
+          if (ee.state == KeyState::Up)
+            for (auto i = state.pending.begin; i < state.pending.end; ++i)
+              if (keys[i] == ee.key)
+                c.removed_async |= async_bit(i);
+        ++s;
+        ++c.state;
+        if constexpr (has_not_keys)
+          c.arrived = true;
+        continue;
+      }
+      if constexpr (has_timeout)
+        if (s >= sequence.size() && ee.key == Key::timeout) {
+          // when a timeout is encountered and sequence ended
+          *input_timeout_event = ee;
+          return MatchResult::might_match;
+        }
+    }
+
+    if (s < sequence.size()) {
+      const auto& se = sequence[s];
+      if constexpr (has_async)
+        if (se.state == KeyState::Up) {
+          // try to match sequence event with pending async
+          auto matched = false;
+          for (auto i = state.pending.begin; i < state.pending.end; ++i) {
+            const auto bit = async_bit(i);
+            if (keys[i] == se.key &&
+                !((c.consumed_async | c.removed_async) & bit)) {
+              c.consumed_async |= bit;
+              matched = true;
+              break;
+            }
+          }
+          if (matched) {
+            ++s;
+            continue;
+          }
+        }
+
+      // ignore already matched events in sequence
+      if (se.state == KeyState::DownMatched) {
+        ++s;
+        continue;
+      }
+    }
+
+    if constexpr (has_async && has_up_states)
+      if (ee.state == KeyState::Up &&
+          ee.key != Key::timeout && ee.key != Key::none) {
+        // try to match expression event with async, which consumed an Up
+        auto matched = false;
+        for (auto i = state.pending.begin; i < state.pending.end; ++i) {
+          const auto bit = async_bit(i);
+          if (keys[i] == ee.key && (c.consumed_async & bit) &&
+              !(c.removed_async & bit)) {
+            c.removed_async |= bit;
+            matched = true;
+            break;
+          }
+        }
+        if (matched) {
+          ++c.state;
+          if constexpr (has_not_keys)
+            c.arrived = true;
+          continue;
+        }
+      }
+
+    if (s < sequence.size())
+      return fail();
+    return MatchResult::might_match;
+  }
+}
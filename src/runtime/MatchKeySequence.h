@@ -1,20 +1,135 @@
 #pragma once
 
 #include "KeyEvent.h"
+#include "KeyBitmap.h"
+#include <optional>
 
 enum class MatchResult { no_match, might_match, match };
 
+// An input expression compiled to a linear automaton. Each state waits
+// for the Down or Up of a key or for a timeout. While waiting, Ups of
+// pending async keys and already matched events are consumed, keys which
+// must not be down reject. The state's sets are resolved at compile time.
+// Expressions containing Any, DownAsync or NoMightMatch are not supported
+// and are still interpreted by MatchKeySequence. The features an expression
+// uses select a matcher kernel, which skips the checks of the other ones.
+class CompiledKeySequence {
+public:
+  // state of a match, which can be resumed once events were appended
+  // to the sequence. A failed match can never succeed for this prefix.
+  struct Cursor {
+    uint32_t state{ };
+    uint32_t position{ };
+    uint64_t consumed_async{ };
+    uint64_t removed_async{ };
+    bool arrived{ true };
+    bool failed{ };
+  };
+
+  static std::optional<CompiledKeySequence> compile(
+    const KeySequence& expression);
+  // bytes of the states and key sets
+  size_t memory_usage() const;
+
+private:
+  friend class MatchKeySequence;
+
+  enum Feature : uint8_t {
+    not_keys  = 1 << 0,
+    async     = 1 << 1,
+    up_states = 1 << 2,
+    timeout   = 1 << 3,
+  };
+
+  struct KeyRange {
+    uint16_t begin;
+    uint16_t end;
+  };
+
+  struct State {
+    // Key::none for the final state
+    KeyEvent event;
+    // Not keys checked once when state is entered
+    KeyRange arrival_not_keys;
+    // Not keys checked while waiting in state
+    KeyRange not_keys;
+    // UpAsync events, which can still consume an Up while waiting
+    KeyRange pending;
+  };
+
+  std::vector<State> m_states;
+  std::vector<Key> m_keys;
+  // index of async event (bit in consumed mask) for each pending key
+  std::vector<uint8_t> m_pending_async;
+  // combination of Features
+  uint8_t m_features{ };
+};
+
+// The matching itself is stateless, the interpreter only needs some
+// temporary buffers. So the static functions can be called from several
+// threads at once, as long as each one passes its own Scratch.
 class MatchKeySequence {
 public:
+  // temporary buffers of the interpreter
+  struct Scratch {
+    std::vector<KeyEvent> async;
+    // keys which were added to async
+    KeySet async_keys;
+    bool async_any_key{ };
+    KeySet not_keys;
+    KeySet ignore_ups;
+
+    // for matching expressions up to this length without allocating
+    void reserve(size_t expression_length);
+    size_t buffer_footprint() const;
+  };
+
+  static MatchResult match(
+    ConstKeySequenceRange expression,
+    ConstKeySequenceRange sequence,
+    std::vector<Key>* any_key_matches,
+    KeyEvent* input_timeout_event,
+    Scratch& scratch);
+
+  static MatchResult match(
+    const CompiledKeySequence& expression,
+    ConstKeySequenceRange sequence,
+    std::vector<Key>* any_key_matches,
+    KeyEvent* input_timeout_event,
+    CompiledKeySequence::Cursor* cursor = nullptr);
+
+  // using the own scratch
   MatchResult operator()(
     ConstKeySequenceRange expression,
     ConstKeySequenceRange sequence,
     std::vector<Key>* any_key_matches,
-    KeyEvent* input_timeout_event) const;
+    KeyEvent* input_timeout_event) const {
+    return match(expression, sequence, any_key_matches,
+      input_timeout_event, m_scratch);
+  }
+
+  MatchResult operator()(
+    const CompiledKeySequence& expression,
+    ConstKeySequenceRange sequence,
+    std::vector<Key>* any_key_matches,
+    KeyEvent* input_timeout_event,
+    CompiledKeySequence::Cursor* cursor = nullptr) const {
+    return match(expression, sequence, any_key_matches,
+      input_timeout_event, cursor);
+  }
+
+  void reserve(size_t expression_length) {
+    m_scratch.reserve(expression_length);
+  }
+  size_t buffer_footprint() const { return m_scratch.buffer_footprint(); }
 
 private:
-  // temporary buffer
-  mutable std::vector<KeyEvent> m_async;
-  mutable std::vector<Key> m_not_keys;
-  mutable std::vector<Key> m_ignore_ups;
+  template<uint8_t Features>
+  static MatchResult match_kernel(
+    const CompiledKeySequence& expression,
+    ConstKeySequenceRange sequence,
+    KeyEvent* input_timeout_event,
+    CompiledKeySequence::Cursor* cursor);
+
+  mutable Scratch m_scratch;
 };
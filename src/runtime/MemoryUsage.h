@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+
+// Bytes held by the structures of a configuration, estimated from the
+// sizes and capacities of their containers.
+struct MemoryUsage {
+  // inputs, outputs and filters as configured
+  size_t contexts;
+  // input indices, signatures, compiled inputs and match cursors
+  size_t matching;
+  // events, ranges and output tables of the inputs and outputs
+  size_t arena;
+  // compiled regular expressions of the device filters
+  size_t regexes;
+  // reserved for matching and for the output
+  size_t buffers;
+
+  size_t total() const {
+    return contexts + matching + arena + regexes + buffers;
+  }
+
+  MemoryUsage& operator+=(const MemoryUsage& other) {
+    contexts += other.contexts;
+    matching += other.matching;
+    arena += other.arena;
+    regexes += other.regexes;
+    buffers += other.buffers;
+    return *this;
+  }
+};
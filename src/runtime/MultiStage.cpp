@@ -1,19 +1,260 @@
 
 #include "MultiStage.h"
+#include <algorithm>
+#include <chrono>
+#include <optional>
 
 namespace {
+  using Remap = std::vector<std::pair<Key, Key>>;
+
+  uint64_t nanoseconds_since(std::chrono::steady_clock::time_point start) {
+    return static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count());
+  }
+
   bool is_server_event(const KeyEvent& event) {
     return (event.key == Key::timeout ||
       is_virtual_key(event.key) ||
       is_action_key(event.key));
   }
+
+  bool is_remappable(Key key) {
+    return (is_keyboard_key(key) || is_mouse_button(key));
+  }
+
+  bool is_single_key_input(const KeySequence& input) {
+    return (input.size() == 2 &&
+      input[0].state == KeyState::Down && input[0].value == 0 &&
+      input[1].state == KeyState::UpAsync && input[1].value == 0 &&
+      input[0].key == input[1].key && is_remappable(input[0].key));
+  }
+
+  bool is_single_key_output(const KeySequence& output) {
+    return (output.size() == 1 &&
+      output[0].state == KeyState::Down && output[0].value == 0 &&
+      is_remappable(output[0].key));
+  }
+
+  // the mappings of a stage with a single unfiltered context, whose
+  // mappings permute single keys, sorted by input key. Other mappings
+  // would press one key for several, which a stage tracks
+  std::optional<Remap> get_stage_remap(const Stage& stage) {
+    const auto& contexts = stage.contexts();
+    if (contexts.size() != 1)
+      return { };
+    const auto& context = contexts.front();
+    if (context.device_filter || context.device_id_filter ||
+        !context.modifier_filter.empty() || context.invert_modifier_filter ||
+        context.fallthrough || !context.command_outputs.empty())
+      return { };
+
+    auto remap = Remap();
+    for (const auto& input : context.inputs) {
+      const auto index = static_cast<size_t>(input.output_index);
+      if (input.output_index < 0 || index >= context.outputs.size() ||
+          !is_single_key_input(input.input) ||
+          !is_single_key_output(context.outputs[index]))
+        return { };
+      remap.emplace_back(input.input[0].key, context.outputs[index][0].key);
+    }
+
+    // the first mapping of a key applies
+    const auto by_key = [](const auto& a, const auto& b) { 
+      return a.first < b.first;
+    };
+    std::stable_sort(remap.begin(), remap.end(), by_key);
+    remap.erase(std::unique(remap.begin(), remap.end(),
+      [](const auto& a, const auto& b) { return a.first == b.first; }),
+      remap.end());
+
+    auto outputs = std::vector<Key>();
+    for (const auto& [key, mapped] : remap)
+      outputs.push_back(mapped);
+    std::sort(outputs.begin(), outputs.end());
+    if (!std::equal(outputs.begin(), outputs.end(), remap.begin(),
+          remap.end(), [](Key key, const auto& pair) {
+            return key == pair.first; }))
+      return { };
+    return remap;
+  }
+
+  Key remap_key(const Remap& remap, Key key) {
+    const auto it = std::lower_bound(remap.begin(), remap.end(), key,
+      [](const auto& a, Key key) { return a.first < key; });
+    return (it != remap.end() && it->first == key ? it->second : key);
+  }
+
+  // remaps applied one after the other
+  Remap compose(const Remap& first, const Remap& second) {
+    auto result = Remap();
+    for (const auto& [key, mapped] : first)
+      result.emplace_back(key, remap_key(second, mapped));
+    for (const auto& [key, mapped] : second)
+      if (remap_key(first, key) == key)
+        result.emplace_back(key, mapped);
+    std::sort(result.begin(), result.end());
+    result.erase(std::remove_if(result.begin(), result.end(),
+      [](const auto& pair) { return pair.first == pair.second; }),
+      result.end());
+    return result;
+  }
 } // namespace
 
 MultiStage::MultiStage(std::vector<StagePtr> stages) 
-  : m_stages(std::move(stages)) {
+  : m_stages(std::move(stages)),
+    m_stage_active_contexts(m_stages.size()) {
 
-  for (const auto& stage : m_stages)
+  // a stage's output is the input of the next stage
+  auto buffer_size = size_t{ };
+  for (const auto& stage : m_stages) {
     m_context_count += stage->contexts().size();
+    const auto& capacity = stage->capacity();
+    buffer_size = std::max(buffer_size, 2 * capacity.max_output_length +
+      capacity.max_output_keys_down + capacity.max_input_length);
+  }
+  m_output_buffer.reserve(buffer_size);
+  m_input_buffer.reserve(buffer_size);
+  m_context_active_buffer.reserve(buffer_size);
+  m_indices_buffer.reserve(m_context_count);
+  build_fused_stages();
+  build_stage_virtual_keys();
+}
+
+// the first stage is always updated, it detects the exit sequence and
+// its keys are validated
+void MultiStage::build_fused_stages() {
+  m_stage_fused.assign(m_stages.size(), -1);
+  for (auto i = size_t{ 1 }; i < m_stages.size(); ++i) {
+    auto remap = get_stage_remap(*m_stages[i]);
+    if (!remap)
+      continue;
+    if (m_stage_fused[i - 1] < 0) {
+      m_stage_fused[i] = static_cast<int>(m_fused_stages.size());
+      m_fused_stages.push_back({ i, i, { }, { }, { }, { } });
+    }
+    else {
+      m_stage_fused[i] = m_stage_fused[i - 1];
+    }
+    auto& fused = m_fused_stages.back();
+    fused.remaps.push_back(std::move(*remap));
+    fused.active.push_back(false);
+    fused.end = i + 1;
+  }
+}
+
+void MultiStage::build_stage_virtual_keys() {
+  m_stage_virtual_keys.resize(m_stages.size());
+  auto keys = KeyBitmap();
+  for (auto i = size_t{ }; i < m_stages.size(); ++i) {
+    auto& virtual_keys = m_stage_virtual_keys[i];
+    keys.reset();
+    if (!m_stages[i]->get_referenced_keys(keys)) {
+      // it might match any key
+      virtual_keys.set();
+      continue;
+    }
+    for (auto key = *Key::first_virtual; key <= *Key::last_virtual; ++key)
+      if (keys.test(static_cast<Key>(key)))
+        virtual_keys.set(key - *Key::first_virtual);
+  }
+}
+
+// timeouts and virtual key toggles are applied in all stages,
+// but only those waiting for a timeout or referring to the key need them
+bool MultiStage::is_broadcast_to(size_t stage_index, const KeyEvent& event) const {
+  if (m_broadcast_to_all)
+    return true;
+  if (event.key == Key::timeout)
+    return m_stages[stage_index]->is_waiting_for_timeout();
+  return m_stage_virtual_keys[stage_index].test(
+    *event.key - *Key::first_virtual);
+}
+
+void MultiStage::apply_fused_stages(FusedStages& fused,
+    const KeySequence& input, KeySequence& output) {
+  for (auto event : input) {
+    // server events and keys which are never remapped are forwarded,
+    // they are not released by a matching Up
+    if (is_server_event(event) || !is_remappable(event.key)) {
+      output.push_back(event);
+      continue;
+    }
+    if (event.state == KeyState::Down) {
+      const auto it = std::find_if(fused.keys_down.begin(),
+        fused.keys_down.end(), [&](const auto& pair) {
+          return pair.first == event.key; });
+      if (it != fused.keys_down.end()) {
+        event.key = it->second;
+      }
+      else {
+        const auto key = event.key;
+        event.key = remap_key(fused.table, key);
+        fused.keys_down.emplace_back(key, event.key);
+      }
+    }
+    else if (event.state == KeyState::Up) {
+      // released as what it was pressed as, even when the table changed
+      const auto it = std::find_if(fused.keys_down.begin(),
+        fused.keys_down.end(), [&](const auto& pair) {
+          return pair.first == event.key; });
+      // like a stage, releases of keys which are not held are dropped
+      if (it == fused.keys_down.end())
+        continue;
+      event.key = it->second;
+      fused.keys_down.erase(it);
+    }
+    output.push_back(event);
+  }
+}
+
+size_t MultiStage::buffer_footprint() const {
+  auto bytes = (m_output_buffer.capacity() + m_input_buffer.capacity() +
+    m_context_active_buffer.capacity()) * sizeof(KeyEvent) +
+    m_indices_buffer.capacity() * sizeof(int);
+  for (const auto& stage : m_stages)
+    bytes += stage->buffer_footprint();
+  return bytes;
+}
+
+MemoryUsage MultiStage::memory_usage() const {
+  auto usage = MemoryUsage{ };
+  auto counted_regexes = std::vector<const void*>();
+  for (const auto& stage : m_stages)
+    usage += stage->memory_usage(&counted_regexes);
+
+  const auto remap_bytes = [](const Remap& remap) {
+    return remap.capacity() * sizeof(Remap::value_type);
+  };
+  for (const auto& fused : m_fused_stages) {
+    usage.arena += remap_bytes(fused.table) + remap_bytes(fused.keys_down) +
+      fused.remaps.capacity() * sizeof(Remap) + fused.active.capacity() / 8;
+    for (const auto& remap : fused.remaps)
+      usage.arena += remap_bytes(remap);
+  }
+  usage.arena += m_fused_stages.capacity() * sizeof(FusedStages) +
+    m_stage_fused.capacity() * sizeof(int) +
+    m_stage_virtual_keys.capacity() * sizeof(VirtualKeys);
+
+  // the stages' buffers were already added
+  usage.buffers += (m_output_buffer.capacity() + m_input_buffer.capacity() +
+    m_context_active_buffer.capacity()) * sizeof(KeyEvent) +
+    m_indices_buffer.capacity() * sizeof(int) +
+    m_active_client_contexts.capacity() * sizeof(int) +
+    m_stage_profiles.capacity() * sizeof(StageProfile);
+  for (const auto& indices : m_stage_active_contexts)
+    usage.buffers += indices.capacity() * sizeof(int);
+  return usage;
+}
+
+MultiStagePtr MultiStage::clone_configuration() const {
+  auto stages = std::vector<StagePtr>();
+  for (const auto& stage : m_stages)
+    stages.push_back(std::make_unique<Stage>(stage->contexts(),
+      stage->logical_keys(), stage->forward_modifiers()));
+  auto clone = std::make_unique<MultiStage>(std::move(stages));
+  clone->m_configuration_hash = m_configuration_hash;
+  return clone;
 }
 
 bool MultiStage::has_mouse_mappings() const {
@@ -28,18 +269,45 @@ bool MultiStage::has_device_filters() const {
 
 bool MultiStage::is_clear() const {
   return std::all_of(begin(m_stages), end(m_stages), 
-    [](const auto& stage) { return stage->is_clear(); });
+      [](const auto& stage) { return stage->is_clear(); }) &&
+    std::all_of(begin(m_fused_stages), end(m_fused_stages),
+      [](const auto& fused) { return fused.keys_down.empty(); });
 }
 
 std::vector<Key> MultiStage::get_output_keys_down() const {
   if (m_stages.empty())
     return { };
-  return m_stages.back()->get_output_keys_down();
+  const auto fused = m_stage_fused.back();
+  if (fused < 0)
+    return m_stages.back()->get_output_keys_down();
+
+  // the keys of the last updated stage, as they were remapped
+  const auto& stages = m_fused_stages[static_cast<size_t>(fused)];
+  auto keys = m_stages[stages.begin - 1]->get_output_keys_down();
+  for (auto& key : keys) {
+    const auto it = std::find_if(stages.keys_down.begin(),
+      stages.keys_down.end(), [&](const auto& pair) {
+        return pair.first == key; });
+    key = (it != stages.keys_down.end() ? it->second :
+      remap_key(stages.table, key));
+  }
+  // keys can be remapped to the same key
+  for (auto it = keys.begin(); it != keys.end(); ++it)
+    keys.erase(std::remove(std::next(it), keys.end(), *it), keys.end());
+  return keys;
+}
+
+std::vector<Key> MultiStage::get_input_keys_down() const {
+  if (m_stages.empty())
+    return { };
+  return m_stages.front()->get_input_keys_down();
 }
 
-void MultiStage::evaluate_device_filters(const std::vector<DeviceDesc>& device_descs) {
+bool MultiStage::evaluate_device_filters(const std::vector<DeviceDesc>& device_descs) {
+  auto changed = false;
   for (auto& stage : m_stages)
-    stage->evaluate_device_filters(device_descs);
+    changed |= stage->evaluate_device_filters(device_descs);
+  return changed;
 }
 
 KeySequence MultiStage::set_active_client_contexts(const std::vector<int>& indices) {
@@ -47,21 +315,26 @@ KeySequence MultiStage::set_active_client_contexts(const std::vector<int>& indic
 
   // set active contexts of each stage (translate so each starts at 0)
   auto context_offset = 0;
-  for (auto& stage : m_stages) {
-    // output of previous stage is input of current
-    std::swap(m_context_active_buffer, m_output_buffer);
-    m_output_buffer.clear();
-    for (const auto& event : m_context_active_buffer) 
-      if (is_server_event(event)) {
-        // forward to server
-        m_output_buffer.push_back(event);
-      }
-      else {
-        auto output = stage->update(event, Stage::no_device_index);
-        m_output_buffer.insert(m_output_buffer.end(), 
-          output.begin(), output.end());
-        stage->reuse_buffer(std::move(output));
-      }
+  for (auto i = size_t{ }; i < m_stages.size(); ++i) {
+    auto& stage = m_stages[i];
+    const auto fused = m_stage_fused[i];
+    if (fused < 0 || m_fused_stages[static_cast<size_t>(fused)].begin == i) {
+      // output of previous stage is input of current
+      std::swap(m_context_active_buffer, m_output_buffer);
+      m_output_buffer.clear();
+      if (fused >= 0)
+        apply_fused_stages(m_fused_stages[static_cast<size_t>(fused)], m_context_active_buffer,
+          m_output_buffer);
+      else
+        for (const auto& event : m_context_active_buffer) 
+          if (is_server_event(event)) {
+            // forward to server
+            m_output_buffer.push_back(event);
+          }
+          else {
+            stage->update(event, Stage::no_device_index, m_output_buffer);
+          }
+    }
 
     const auto indices_begin = context_offset;
     const auto indices_end = context_offset + static_cast<int>(stage->contexts().size());
@@ -70,50 +343,265 @@ KeySequence MultiStage::set_active_client_contexts(const std::vector<int>& indic
     for (auto index : indices)
       if (index >= indices_begin && index < indices_end)
         m_indices_buffer.push_back(index - indices_begin);
+
+    // fused stages only compose the remaps of the active ones
+    if (fused >= 0) {
+      auto& stages = m_fused_stages[static_cast<size_t>(fused)];
+      stages.active[i - stages.begin] = !m_indices_buffer.empty();
+      if (i + 1 == stages.end) {
+        stages.table.clear();
+        for (auto j = size_t{ }; j < stages.remaps.size(); ++j)
+          if (stages.active[j])
+            stages.table = compose(stages.table, stages.remaps[j]);
+      }
+      continue;
+    }
+
+    // only update stages whose contexts changed, a switch also cancels
+    // the output on release of contexts a modifier filter deactivated
+    if (m_indices_buffer == m_stage_active_contexts[i] && stage->is_clear())
+      continue;
+    m_stage_active_contexts[i] = m_indices_buffer;
+
+    const auto profiling = !m_stage_profiles.empty();
+    const auto start = (profiling ? std::chrono::steady_clock::now() :
+      std::chrono::steady_clock::time_point{ });
     auto output = stage->set_active_client_contexts(m_indices_buffer);
     m_output_buffer.insert(m_output_buffer.end(), 
       output.begin(), output.end());
+    if (profiling) {
+      auto& profile = m_stage_profiles[i];
+      ++profile.context_updates;
+      profile.events_out += output.size();
+      profile.context_nanoseconds += nanoseconds_since(start);
+    }
     stage->reuse_buffer(std::move(output));
   }
   return m_output_buffer;
 }
 
-KeySequence MultiStage::update(KeyEvent event, int device_index) {  
+KeySequence MultiStage::update(KeyEvent event, int device_index) {
+  apply_input(event, device_index);
+  return std::move(m_output_buffer);
+}
+
+void MultiStage::update(KeyEvent event, int device_index, KeySequence& output) {
+  apply_input(event, device_index);
+  output.insert(output.end(), m_output_buffer.begin(), m_output_buffer.end());
+  m_output_buffer.clear();
+}
+
+void MultiStage::update(ConstKeySequenceRange events, int device_index,
+    KeySequence& output) {
+  // whether a timeout or virtual key is also applied in the other stages
+  // depends on their state, so these are applied one by one
+  const auto has_broadcast_event = std::any_of(events.begin(), events.end(),
+    [](const KeyEvent& event) {
+      return (event.key == Key::timeout || is_virtual_key(event.key));
+    });
+  if (has_broadcast_event) {
+    for (const auto& event : events)
+      update(event, device_index, output);
+    return;
+  }
+
+  // each stage updates all events, before the next stage gets its output
+  m_output_buffer.insert(m_output_buffer.end(), events.begin(), events.end());
+  apply_stages(nullptr, device_index);
+  output.insert(output.end(), m_output_buffer.begin(), m_output_buffer.end());
+  m_output_buffer.clear();
+}
+
+bool MultiStage::pass_through(const KeyEvent& event) {
+  if (m_stages.empty())
+    return false;
+
+  // fused stages are not updated, keys pass them when they are not remapped
+  const auto find_key_down = [&](FusedStages& fused) {
+    return std::find_if(fused.keys_down.begin(), fused.keys_down.end(),
+      [&](const auto& pair) { return pair.first == event.key; });
+  };
+  for (auto i = size_t{ }; i < m_stages.size(); ++i) {
+    if (const auto index = m_stage_fused[i]; index >= 0) {
+      auto& fused = m_fused_stages[static_cast<size_t>(index)];
+      if (fused.begin != i)
+        continue;
+      const auto it = find_key_down(fused);
+      if (!is_remappable(event.key) || (event.state == KeyState::Down ?
+            (it != fused.keys_down.end() ||
+             remap_key(fused.table, event.key) != event.key) :
+            (it == fused.keys_down.end() || it->second != event.key)))
+        return false;
+    }
+    else if (!m_stages[i]->can_pass_through(event)) {
+      return false;
+    }
+  }
+
+  for (auto i = size_t{ }; i < m_stages.size(); ++i) {
+    if (const auto index = m_stage_fused[i]; index < 0) {
+      m_stages[i]->pass_through(event);
+    }
+    else if (auto& fused = m_fused_stages[static_cast<size_t>(index)];
+        fused.begin == i) {
+      // held like a key pressed through the fused stages
+      if (event.state == KeyState::Down)
+        fused.keys_down.emplace_back(event.key, event.key);
+      else
+        fused.keys_down.erase(find_key_down(fused));
+    }
+  }
+  return true;
+}
+
+uint64_t MultiStage::match_count() const {
+  auto count = uint64_t{ };
+  for (const auto& stage : m_stages)
+    count += stage->match_count();
+  return count;
+}
+
+uint64_t MultiStage::might_match_count() const {
+  auto count = uint64_t{ };
+  for (const auto& stage : m_stages)
+    count += stage->might_match_count();
+  return count;
+}
+
+void MultiStage::set_profiling(bool enabled) {
+  for (auto& stage : m_stages)
+    stage->set_profiling(enabled);
+  if (!enabled)
+    m_stage_profiles.clear();
+  else if (m_stage_profiles.empty())
+    m_stage_profiles.resize(m_stages.size());
+}
+
+void MultiStage::set_reference_matching(bool enabled) {
+  for (auto& stage : m_stages)
+    stage->set_reference_matching(enabled);
+  m_fused_stages.clear();
+  m_broadcast_to_all = enabled;
+  if (enabled)
+    m_stage_fused.assign(m_stages.size(), -1);
+  else
+    build_fused_stages();
+}
+
+void MultiStage::set_early_output(bool enabled) {
+  for (auto& stage : m_stages)
+    stage->set_early_output(enabled);
+}
+
+void MultiStage::set_match_engine(std::optional<Stage::MatchEngine> engine) {
+  for (auto& stage : m_stages)
+    stage->set_match_engine(engine);
+}
+
+std::vector<Stage::MatchEngine> MultiStage::match_engines() const {
+  auto engines = std::vector<Stage::MatchEngine>();
+  for (const auto& stage : m_stages)
+    engines.push_back(stage->match_engine());
+  return engines;
+}
+
+InputProfiles MultiStage::input_profiles() const {
+  auto profiles = InputProfiles();
+  for (const auto& stage : m_stages) {
+    const auto& stage_profiles = stage->input_profiles();
+    if (stage_profiles.empty())
+      return { };
+    profiles.insert(profiles.end(),
+      stage_profiles.begin(), stage_profiles.end());
+  }
+  return profiles;
+}
+
+bool MultiStage::is_holding_back() const {
+  return std::any_of(begin(m_stages), end(m_stages),
+    [](const auto& stage) { return stage->is_holding_back(); });
+}
+
+bool MultiStage::get_referenced_keys(KeyBitmap& keys) const {
+  auto succeeded = true;
+  for (const auto& stage : m_stages)
+    if (!stage->get_referenced_keys(keys))
+      succeeded = false;
+  return succeeded;
+}
+
+void MultiStage::apply_input(KeyEvent event, int device_index) {
   m_output_buffer.push_back(event);
-  
+  apply_stages((event.key == Key::timeout || is_virtual_key(event.key) ?
+    &event : nullptr), device_index);
+}
+
+void MultiStage::apply_stages(const KeyEvent* broadcast_event,
+    int device_index) {
+  const auto profiling = !m_stage_profiles.empty();
   auto first_stage = true;
-  for (const auto& stage : m_stages) {
+  for (auto i = size_t{ }; i < m_stages.size(); ++i) {
+    const auto& stage = m_stages[i];
+    const auto start = (profiling ? std::chrono::steady_clock::now() :
+      std::chrono::steady_clock::time_point{ });
+    if (const auto fused = m_stage_fused[i]; fused >= 0) {
+      auto& stages = m_fused_stages[static_cast<size_t>(fused)];
+      if (stages.begin == i) {
+        std::swap(m_input_buffer, m_output_buffer);
+        m_output_buffer.clear();
+        apply_fused_stages(stages, m_input_buffer, m_output_buffer);
+
+        // counted for the first of the fused stages
+        if (profiling) {
+          auto& profile = m_stage_profiles[i];
+          profile.events_in += m_input_buffer.size();
+          profile.events_out += m_output_buffer.size();
+          profile.update_nanoseconds += nanoseconds_since(start);
+        }
+      }
+      continue;
+    }
+
+    auto events_in = uint64_t{ };
     const auto update_stage = [&](const KeyEvent& event) {
-      auto output = stage->update(event, device_index);
-      m_output_buffer.insert(m_output_buffer.end(), 
-        output.begin(), output.end());
-      stage->reuse_buffer(std::move(output));
+      ++events_in;
+      if (stage->pass_through(event))
+        m_output_buffer.push_back(event);
+      else
+        stage->update(event, device_index, m_output_buffer);
     };
 
     // output of previous stage is input of current
     std::swap(m_input_buffer, m_output_buffer);
     m_output_buffer.clear();
+    const auto might_matches = stage->might_match_count();
 
-    // apply timeout in all stages
-    if (event.key == Key::timeout && !first_stage)
-      update_stage(event);
-
-    // toggle virtual key in all stages
-    if (!first_stage && is_virtual_key(event.key))
-      update_stage(event);
+    // apply timeout and toggle virtual key in the other stages
+    if (!first_stage && broadcast_event &&
+        is_broadcast_to(i, *broadcast_event))
+      update_stage(*broadcast_event);
 
+    auto forwarded = uint64_t{ };
     for (const auto& input : m_input_buffer)
       if (!first_stage && is_server_event(input)) {
         // forward to server
         m_output_buffer.push_back(input);
+        ++forwarded;
       }
       else {
         update_stage(input);
       }
 
+    if (profiling) {
+      auto& profile = m_stage_profiles[i];
+      profile.events_in += events_in;
+      profile.events_out += m_output_buffer.size() - forwarded;
+      profile.might_match_holds += stage->might_match_count() - might_matches;
+      profile.forwarded_server_events += forwarded;
+      profile.update_nanoseconds += nanoseconds_since(start);
+    }
     first_stage = false;
   }
-  return std::move(m_output_buffer);
 }
 
 void MultiStage::reuse_buffer(KeySequence&& buffer) {
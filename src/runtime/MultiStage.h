@@ -1,6 +1,8 @@
 #pragma once
 
 #include "Stage.h"
+#include "common/StageProfile.h"
+#include <bitset>
 
 using StagePtr = std::unique_ptr<Stage>;
 using MultiStagePtr = std::unique_ptr<class MultiStage>;
@@ -8,26 +10,98 @@ using MultiStagePtr = std::unique_ptr<class MultiStage>;
 class MultiStage {
 public:
   explicit MultiStage(std::vector<StagePtr> stages = { });
+  // the same contexts, without the state, e.g. for another seat
+  MultiStagePtr clone_configuration() const;
 
   const size_t context_count() const { return m_context_count; }
+  // identifies the configuration, so a replaced one can be activated again
+  size_t configuration_hash() const { return m_configuration_hash; }
+  void set_configuration_hash(size_t hash) { m_configuration_hash = hash; }
   const std::vector<StagePtr>& stages() const { return m_stages; }
   const std::vector<int>& active_client_contexts() const { return m_active_client_contexts; }
+  // bytes reserved for the buffers of all stages
+  size_t buffer_footprint() const;
+  MemoryUsage memory_usage() const;
   bool has_mouse_mappings() const;
   bool has_device_filters() const;
+  uint64_t match_count() const;
+  uint64_t might_match_count() const;
+  // also counts and times the events flowing through each stage
+  void set_profiling(bool enabled);
+  // empty while profiling is disabled
+  const StageProfiles& stage_profiles() const { return m_stage_profiles; }
+  // also updates remapping stages separately, before contexts are activated
+  void set_reference_matching(bool enabled);
+  // lets each stage output the press of a held back key early,
+  // when all its mappings of the key start with it
+  void set_early_output(bool enabled);
+  // overrides the match engine each stage chose
+  void set_match_engine(std::optional<Stage::MatchEngine> engine);
+  std::vector<Stage::MatchEngine> match_engines() const;
+  // of all stages, indexed by the client's context index
+  InputProfiles input_profiles() const;
 
   bool is_clear() const;
   std::vector<Key> get_output_keys_down() const;
-  void evaluate_device_filters(const std::vector<DeviceDesc>& device_descs);
+  std::vector<Key> get_input_keys_down() const;
+  // returns whether a context's has_matching_device changed
+  bool evaluate_device_filters(const std::vector<DeviceDesc>& device_descs);
   KeySequence set_active_client_contexts(const std::vector<int>& indices);
   KeySequence update(KeyEvent event, int device_index);
+  // appends the output to a caller-owned sequence
+  void update(KeyEvent event, int device_index, KeySequence& output);
+  // applies the events of one input frame, with the same output
+  // as updating each of them
+  void update(ConstKeySequenceRange events, int device_index,
+    KeySequence& output);
+  // forwards event unchanged when no stage needs to update it
+  bool pass_through(const KeyEvent& event);
+  bool is_holding_back() const;
+  bool get_referenced_keys(KeyBitmap& keys) const;
   void reuse_buffer(KeySequence&& buffer);
   void validate_state(const std::function<bool(Key)>& is_down);
   bool should_exit() const;
 
 private:
+  using Remap = std::vector<std::pair<Key, Key>>;
+  using VirtualKeys = std::bitset<*Key::last_virtual - *Key::first_virtual + 1>;
+
+  // consecutive stages, which only remap single keys, are applied as one
+  // table instead of updating each of them
+  struct FusedStages {
+    size_t begin;
+    size_t end;
+    // the remaps of the stages, sorted by input key
+    std::vector<Remap> remaps;
+    std::vector<bool> active;
+    // composition of the remaps of the active stages
+    Remap table;
+    // the keys pressed and the keys they were remapped to
+    Remap keys_down;
+  };
+
+  void apply_input(KeyEvent event, int device_index);
+  void apply_stages(const KeyEvent* broadcast_event, int device_index);
+  void build_fused_stages();
+  void build_stage_virtual_keys();
+  bool is_broadcast_to(size_t stage_index, const KeyEvent& event) const;
+  void apply_fused_stages(FusedStages& fused, const KeySequence& input,
+    KeySequence& output);
+
   size_t m_context_count{ };
+  size_t m_configuration_hash{ };
   std::vector<StagePtr> m_stages;
   std::vector<int> m_active_client_contexts;
+  // active client contexts of each stage, starting at 0
+  std::vector<std::vector<int>> m_stage_active_contexts;
+  std::vector<FusedStages> m_fused_stages;
+  // index in m_fused_stages or -1, indexed by stage
+  std::vector<int> m_stage_fused;
+  // the virtual keys each stage refers to
+  std::vector<VirtualKeys> m_stage_virtual_keys;
+  bool m_broadcast_to_all{ };
+  // empty while profiling is disabled
+  StageProfiles m_stage_profiles;
 
   // temporary buffer
   KeySequence m_output_buffer;
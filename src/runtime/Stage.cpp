@@ -1,25 +1,30 @@
 
 #include "Stage.h"
+#include "KeySequenceScan.h"
+#include "Tracepoints.h"
 #include <cassert>
 #include <algorithm>
 #include <array>
+#include <chrono>
 #include <iterator>
 #include <limits>
+#include <numeric>
+#include <unordered_map>
 
 namespace {
   const auto exit_sequence = std::array{ Key::ShiftLeft, Key::Escape, Key::K };
 
   KeySequence::const_iterator find_key(const KeySequence& sequence, Key key) {
-    return std::find_if(begin(sequence), end(sequence),
-      [&](const auto& ev) { return ev.key == key; });
+    return sequence.begin() +
+      key_scan::find_key(sequence.data(), sequence.size(), key);
   }
 
-  KeySequence::const_iterator rfind_key(const KeySequence& sequence, Key key) {
-    auto it = std::find_if(rbegin(sequence), rend(sequence),
-      [&](const auto& ev) { return ev.key == key; });
-    if (it != rend(sequence))
-      return std::next(it).base();
-    return end(sequence);
+  template<typename R>
+  auto rfind_key(const R& sequence, Key key) {
+    const auto first = begin(sequence);
+    const auto count = static_cast<size_t>(end(sequence) - first);
+    const auto index = key_scan::rfind_key(first, count, key);
+    return (index < count ? first + index : end(sequence));
   }
 
   template<typename It, typename T>
@@ -27,58 +32,129 @@ namespace {
     return std::find(begin, end, v) != end;
   }
 
+  bool contains(const KeyEvent* begin, const KeyEvent* end,
+      const KeyEvent& event) {
+    const auto count = static_cast<size_t>(end - begin);
+    return (key_scan::find_event(begin, count, event) != count);
+  }
+
   template<typename R, typename T>
   bool contains(const R& range, const T& v) {
     return contains(begin(range), end(range), v);
   }
 
-  bool is_non_optional(const KeyEvent& e) {
-    return (e.state == KeyState::Up || e.state == KeyState::Down);
-  }
-
   bool has_non_optional(const KeySequence& sequence) {
-    return std::any_of(begin(sequence), end(sequence), is_non_optional);
+    return (key_scan::find_state(sequence.data(), sequence.size(),
+      key_scan::states(KeyState::Up, KeyState::Down)) != sequence.size());
   }
 
   bool has_unmatched_down(ConstKeySequenceRange sequence) {
-    return std::any_of(begin(sequence), end(sequence),
-      [](const KeyEvent& e) { return (e.state == KeyState::Down); });
+    return (key_scan::find_state(sequence.begin(), sequence.size(),
+      key_scan::states(KeyState::Down)) != sequence.size());
   }
 
   // sort outputs by growing negative index (to allow binary search)
-  std::vector<Stage::Context> sort_command_outputs(
-      std::vector<Stage::Context> contexts) {
-    for (auto& context : contexts)
-      std::sort(begin(context.command_outputs), end(context.command_outputs),
-        [](const Stage::CommandOutput& a, const Stage::CommandOutput& b) { 
-          return a.index > b.index; 
-        });
-    return contexts;
-  }
-
-  bool has_mouse_mappings(const KeySequence& sequence) {
+  bool has_mouse_mappings(const KeySequence& sequence,
+      const LogicalKeys& logical_keys) {
+    const auto is_mouse_key = [](Key key) {
+      return is_mouse_button(key) || is_mouse_wheel(key);
+    };
     return std::any_of(begin(sequence), end(sequence),
-      [](const KeyEvent& event) {
-        return is_mouse_button(event.key) || is_mouse_wheel(event.key);
+      [&](const KeyEvent& event) {
+        const auto& keys = logical_keys.keys(event.key);
+        return is_mouse_key(event.key) ||
+          std::any_of(keys.begin(), keys.end(), is_mouse_key);
       });
   }
 
-  bool has_mouse_mappings(const std::vector<Stage::Context>& contexts) {
+  bool has_mouse_mappings(const std::vector<Stage::Context>& contexts,
+      const LogicalKeys& logical_keys) {
     for (const auto& context : contexts) {
-      if (has_mouse_mappings(context.modifier_filter))
+      if (has_mouse_mappings(context.modifier_filter, logical_keys))
         return true;
       for (const auto& input : context.inputs)
-        if (has_mouse_mappings(input.input))
+        if (has_mouse_mappings(input.input, logical_keys))
           return true;
     }
     return false;
   }
 
+  bool has_logical_key(const KeySequence& sequence) {
+    return std::any_of(begin(sequence), end(sequence),
+      [](const KeyEvent& event) { return is_logical_key(event.key); });
+  }
+
+  void replace_key(KeySequence& sequence, Key key, Key replacement) {
+    for (auto& event : sequence)
+      if (event.key == key)
+        event.key = replacement;
+  }
+
+  // logical keys are output as their left key, the definitions are
+  // replaced in reverse order, since their keys can be logical keys
+  KeySequence resolve_logical_keys(KeySequence sequence,
+      const LogicalKeys& logical_keys) {
+    if (!has_logical_key(sequence))
+      return sequence;
+    const auto& definitions = logical_keys.definitions();
+    for (auto it = definitions.rbegin(); it != definitions.rend(); ++it)
+      replace_key(sequence, it->logical, it->left);
+    return sequence;
+  }
+
+  // binds each logical key of an input to its left and to its right key,
+  // the key bound is also output by the direct output. The variants are
+  // ordered like the mappings were duplicated by the first release
+  std::vector<std::pair<KeySequence, KeySequence>> get_logical_variants(
+      const KeySequence& input, const KeySequence& output,
+      const LogicalKeys& logical_keys) {
+    using Variant = std::pair<KeySequence, KeySequence>;
+    auto variants = std::vector<Variant>{ { input, output } };
+    auto expanded = std::vector<Variant>();
+    const auto& definitions = logical_keys.definitions();
+    for (auto it = definitions.rbegin(); it != definitions.rend(); ++it) {
+      const auto& [logical, left, right] = *it;
+      const auto bind = [&](Variant variant, Key key) {
+        replace_key(variant.first, logical, key);
+        replace_key(variant.second, logical, key);
+        return variant;
+      };
+      expanded.clear();
+      for (const auto& variant : variants) {
+        expanded.push_back(bind(variant, left));
+        if (std::any_of(variant.first.begin(), variant.first.end(),
+              [&](const KeyEvent& event) { return event.key == logical; }))
+          expanded.push_back(bind(variant, right));
+      }
+      variants.swap(expanded);
+    }
+    return variants;
+  }
+
+  uint64_t get_hash(const KeySequence& sequence) {
+    // FNV-1a
+    auto hash = uint64_t{ 14695981039346656037ull };
+    for (const auto& event : sequence)
+      hash = (hash ^ (static_cast<uint64_t>(event.key) << 20 |
+                      static_cast<uint64_t>(event.state) << 16 |
+                      event.value)) * 1099511628211ull;
+    return hash;
+  }
+
   bool has_device_filter(const Stage::Context& context) {
     return (context.device_filter ||
             context.device_id_filter);
   }
 
+  std::string get_device_filter_key(const Stage::Context& context) {
+    auto key = context.device_filter.string;
+    key.push_back(context.device_filter.invert ? '!' : '=');
+    key.push_back('\0');
+    key += context.device_id_filter.string;
+    key.push_back(context.device_id_filter.invert ? '!' : '=');
+    return key;
+  }
+
   bool has_device_filter(const std::vector<Stage::Context>& contexts) {
     for (const auto& context : contexts)
       if (has_device_filter(context))
@@ -91,6 +167,22 @@ namespace {
       sequence.front().state == KeyState::NoMightMatch);
   }
 
+  bool has_minimal_policy(const std::vector<Stage::Context>& contexts) {
+    for (const auto& context : contexts) {
+      if (has_device_filter(context) ||
+          !context.modifier_filter.empty() ||
+          context.invert_modifier_filter)
+        return false;
+      for (const auto& input : context.inputs)
+        for (const auto& event : input.input)
+          if (event.key == Key::timeout ||
+              event.key == Key::any ||
+              event.state == KeyState::NoMightMatch)
+            return false;
+    }
+    return true;
+  }
+
   bool has_no_might_match_mapping(const std::vector<Stage::Context>& contexts) {
     for (const auto& context : contexts)
       for (const auto& input : context.inputs)
@@ -99,96 +191,990 @@ namespace {
     return false;
   }
 
-  const KeyEvent* find_last_down_event(ConstKeySequenceRange sequence) {
-    auto last = std::add_pointer_t<const KeyEvent>{ };
-    for (const auto& event : sequence)
-      if (event.state == KeyState::Down ||
-          event.state == KeyState::DownMatched)
-        last = &event;
-    return last;
+  size_t get_max_no_might_match_length(const std::vector<Stage::Context>& contexts) {
+    auto length = size_t{ };
+    for (const auto& context : contexts)
+      for (const auto& input : context.inputs)
+        if (is_no_might_match_mapping(input.input))
+          length = std::max(length, input.input.size());
+    return length;
   }
 
-  const KeyEvent* find_last_non_optional(ConstKeySequenceRange sequence) {
-    auto last = std::add_pointer_t<const KeyEvent>{ };
-    for (const auto& event : sequence)
-      if (is_non_optional(event))
-        last = &event;
-    return last;
+  Stage::Capacity get_capacity(const std::vector<Stage::Context>& contexts) {
+    auto capacity = Stage::Capacity{ };
+    const auto add_output = [&](const KeySequence& output) {
+      capacity.max_output_length =
+        std::max(capacity.max_output_length, output.size());
+      const auto keys_down = static_cast<size_t>(std::count_if(
+        output.begin(), output.end(), [](const KeyEvent& event) {
+          return (event.state == KeyState::Down);
+        }));
+      capacity.max_output_keys_down =
+        std::max(capacity.max_output_keys_down, keys_down);
+    };
+    for (const auto& context : contexts) {
+      capacity.max_context_inputs =
+        std::max(capacity.max_context_inputs, context.inputs.size());
+      for (const auto& input : context.inputs)
+        capacity.max_input_length =
+          std::max(capacity.max_input_length, input.input.size());
+      for (const auto& output : context.outputs)
+        add_output(output);
+      for (const auto& command : context.command_outputs)
+        add_output(command.output);
+    }
+    return capacity;
   }
 
-  KeyEvent get_trigger_event(const Trigger& trigger) {
-    if (const auto* event = std::get_if<KeyEvent>(&trigger))
-      return *event;
+  template<typename T>
+  size_t get_reserved_bytes(const T& buffer) {
+    return buffer.capacity() * sizeof(typename T::value_type);
+  }
 
-    if (const auto* key = std::get_if<Key>(&trigger))
-      return KeyEvent{ *key, KeyState::Down };
+  template<typename T>
+  size_t get_nested_reserved_bytes(const std::vector<T>& buffers) {
+    auto bytes = get_reserved_bytes(buffers);
+    for (const auto& buffer : buffers)
+      bytes += get_reserved_bytes(buffer);
+    return bytes;
+  }
 
-    const auto& input = *std::get<const KeySequence*>(trigger);
+  // short sequences are stored inline
+  size_t get_allocated_bytes(const KeySequence& sequence) {
+    return (sequence.capacity() > KeySequence::inline_capacity ?
+      get_reserved_bytes(sequence) : 0);
+  }
+
+  const KeyEvent* find_last_with_state(ConstKeySequenceRange sequence,
+      key_scan::StateMask states) {
+    const auto index = key_scan::rfind_state(
+      sequence.begin(), sequence.size(), states);
+    return (index < sequence.size() ? sequence.begin() + index : nullptr);
+  }
+
+  const KeyEvent* find_last_down_event(ConstKeySequenceRange sequence) {
+    return find_last_with_state(sequence,
+      key_scan::states(KeyState::Down, KeyState::DownMatched));
+  }
+
+  const KeyEvent* find_last_non_optional(ConstKeySequenceRange sequence) {
+    return find_last_with_state(sequence,
+      key_scan::states(KeyState::Up, KeyState::Down));
+  }
+
+  KeyEvent get_input_trigger_event(const KeySequence& input) {
     if (auto event = find_last_non_optional(input))
       return *event;
-
     return input.back();
   }
 
+  KeyEvent get_trigger_event(const Trigger& trigger) {
+    return trigger.event;
+  }
+
   Key get_trigger_key(const Trigger& trigger) {
-    return get_trigger_event(trigger).key;
+    return trigger.event.key;
   }
 
   ConstKeySequenceRange without_first(ConstKeySequenceRange sequence) {
     return { std::next(sequence.begin()), sequence.end() };
   }
+
+  // an input starting with a Down of a specific key can only match
+  // a sequence, which contains this key before the first event,
+  // which is not DownMatched (or at it)
+  Key get_leading_key(const KeySequence& input) {
+    const auto& first = input.front();
+    if (first.state != KeyState::Down ||
+        first.key == Key::any ||
+        first.key == Key::timeout)
+      return Key::none;
+    return first.key;
+  }
+
+  uint64_t get_key_signature(Key key) {
+    return (uint64_t{ 1 } << (*key % 64));
+  }
+
+  // every event of a sequence, which is not DownMatched, needs to be
+  // unified with an event of the input. So an input can only match when
+  // the sequence's signature is a subset of the input's signature
+  uint64_t get_input_signature(const KeySequence& input,
+      const LogicalKeys& logical_keys) {
+    if (is_no_might_match_mapping(input))
+      return ~uint64_t{ };
+    auto signature = uint64_t{ };
+    for (const auto& event : input) {
+      if (event.key == Key::any)
+        return ~uint64_t{ };
+      signature |= get_key_signature(event.key);
+      for (auto key : logical_keys.keys(event.key))
+        signature |= get_key_signature(key);
+    }
+    return signature;
+  }
+
+  uint64_t get_sequence_signature(ConstKeySequenceRange sequence) {
+    auto signature = uint64_t{ };
+    for (const auto& event : sequence)
+      if (event.state != KeyState::DownMatched)
+        signature |= get_key_signature(event.key);
+    return signature;
+  }
+
+  Stage::MatchEngine choose_match_engine(
+      const std::vector<Stage::Context>& contexts) {
+    // inputs without a leading key, ones which cannot be compiled
+    // and ones with conditions, which are costly to interpret
+    auto inputs = size_t{ };
+    auto generic = size_t{ };
+    auto uncompiled = size_t{ };
+    auto conditions = size_t{ };
+    for (const auto& context : contexts)
+      for (const auto& input : context.inputs) {
+        ++inputs;
+        if (get_leading_key(input.input) == Key::none)
+          ++generic;
+        if (std::any_of(input.input.begin(), input.input.end(),
+              [](const KeyEvent& event) {
+                return (event.key == Key::any ||
+                        event.state == KeyState::DownAsync ||
+                        event.state == KeyState::NoMightMatch);
+              }))
+          ++uncompiled;
+        else if (std::any_of(input.input.begin(), input.input.end(),
+              [](const KeyEvent& event) {
+                return (event.key == Key::timeout ||
+                        event.state == KeyState::Not);
+              }))
+          ++conditions;
+      }
+
+    // one or two plain inputs are matched faster than looked up
+    if (inputs <= 2 && !conditions)
+      return Stage::MatchEngine::interpreted;
+    if (2 * uncompiled > inputs)
+      return (2 * generic > inputs ? Stage::MatchEngine::interpreted :
+        Stage::MatchEngine::indexed);
+    return Stage::MatchEngine::compiled;
+  }
 } // namespace
 
-Stage::Stage(std::vector<Context> contexts)
-  : m_contexts(sort_command_outputs(std::move(contexts))),
-    m_has_mouse_mappings(::has_mouse_mappings(m_contexts)),
+const char* get_match_engine_name(Stage::MatchEngine engine) {
+  switch (engine) {
+    case Stage::MatchEngine::interpreted: return "interpreted";
+    case Stage::MatchEngine::indexed: return "indexed";
+    case Stage::MatchEngine::compiled: return "compiled";
+  }
+  return "";
+}
+
+std::optional<Stage::MatchEngine> get_match_engine(std::string_view name) {
+  for (auto engine : { Stage::MatchEngine::interpreted,
+      Stage::MatchEngine::indexed, Stage::MatchEngine::compiled })
+    if (name == get_match_engine_name(engine))
+      return engine;
+  return std::nullopt;
+}
+
+struct Stage::GeneralPolicy {
+  static constexpr bool timeouts = true;
+  static constexpr bool any_key = true;
+  static constexpr bool no_might_match = true;
+  static constexpr bool device_filters = true;
+  static constexpr bool modifier_filters = true;
+};
+
+// the checks of the unused features are removed at compile time
+struct Stage::MinimalPolicy {
+  static constexpr bool timeouts = false;
+  static constexpr bool any_key = false;
+  static constexpr bool no_might_match = false;
+  static constexpr bool device_filters = false;
+  static constexpr bool modifier_filters = false;
+};
+
+Stage::Stage(std::vector<Context> contexts, LogicalKeys logical_keys,
+    std::vector<Key> forward_modifiers)
+  : m_contexts(std::move(contexts)),
+    m_logical_keys(std::move(logical_keys)),
+    m_forward_modifiers(std::move(forward_modifiers)),
+    m_capacity(get_capacity(m_contexts)),
+    m_has_mouse_mappings(::has_mouse_mappings(m_contexts, m_logical_keys)),
     m_has_device_filter(::has_device_filter(m_contexts)),
-    m_has_no_might_match_mapping(::has_no_might_match_mapping(m_contexts)) {
+    m_has_no_might_match_mapping(::has_no_might_match_mapping(m_contexts)),
+    m_minimal_policy(::has_minimal_policy(m_contexts)),
+    m_default_match_engine(choose_match_engine(m_contexts)),
+    m_match_engine(m_default_match_engine) {
+  for (auto key : m_forward_modifiers)
+    m_forward_modifier_keys.set(key);
+  reserve_buffers();
+  build_fallthrough_contexts();
+  build_device_filter_groups();
+  build_input_triggers();
+  build_event_arena();
+  build_output_ops();
+  build_output_tables();
+  build_modifier_filter_masks();
+  build_early_output_conflicts();
+  update_mapped_keys();
+
+  // the matching structures of larger configurations are built, when a
+  // context becomes active
+  m_input_indices.resize(m_contexts.size());
+  m_input_signatures.resize(m_contexts.size());
+  m_compiled_inputs.resize(m_contexts.size());
+  m_match_cursors.resize(m_contexts.size());
+  m_context_materialized.resize(m_contexts.size());
+  if (m_contexts.size() <= max_materialized_contexts)
+    for (auto i = 0; i < static_cast<int>(m_contexts.size()); ++i)
+      materialize_context(i);
+
+  // history holds a Down and an Up for each event of the input
+  if (m_has_no_might_match_mapping) {
+    m_state.history.reserve(4 * get_max_no_might_match_length(m_contexts));
+    m_prev_history.reserve(m_state.history.capacity());
+  }
+}
+
+// so the first complex chord after a configuration update does not allocate
+void Stage::reserve_buffers() {
+  const auto& c = m_capacity;
+  // the input is matched with the keys which are still hold
+  const auto sequence_size = 2 * c.max_input_length + KeySequence::inline_capacity;
+  const auto keys_down = c.max_output_keys_down + c.max_input_length;
+  const auto output_size = 2 * c.max_output_length + keys_down;
+
+  m_state.sequence.reserve(sequence_size);
+  m_prev_sequence.reserve(sequence_size);
+  m_match_cursor_sequence.reserve(sequence_size);
+  m_output_buffer.reserve(output_size);
+  m_state.key_repeat_output.reserve(output_size);
+  m_state.output_down.reserve(keys_down);
+  m_prev_output_down.reserve(keys_down);
+  m_release_buffer.reserve(keys_down);
+  m_state.output_on_release.reserve(keys_down);
+  m_state.passed_keys.reserve(keys_down);
+  m_any_key_matches.reserve(c.max_input_length);
+  m_match.reserve(c.max_input_length);
+  m_leading_keys.reserve(c.max_input_length);
+  m_candidate_inputs.reserve(c.max_context_inputs);
+  m_active_contexts.reserve(m_contexts.size());
+  m_prev_active_contexts.reserve(m_contexts.size());
+  m_active_client_contexts.reserve(m_contexts.size());
+}
+
+size_t Stage::buffer_footprint() const {
+  return get_reserved_bytes(m_state.sequence) +
+    get_reserved_bytes(m_prev_sequence) +
+    get_reserved_bytes(m_match_cursor_sequence) +
+    get_reserved_bytes(m_state.history) +
+    get_reserved_bytes(m_prev_history) +
+    get_reserved_bytes(m_output_buffer) +
+    get_reserved_bytes(m_state.key_repeat_output) +
+    get_reserved_bytes(m_state.output_down) +
+    get_reserved_bytes(m_prev_output_down) +
+    get_reserved_bytes(m_release_buffer) +
+    get_reserved_bytes(m_state.output_on_release) +
+    get_reserved_bytes(m_state.passed_keys) +
+    get_reserved_bytes(m_any_key_matches) +
+    m_match.buffer_footprint() +
+    get_reserved_bytes(m_leading_keys) +
+    get_reserved_bytes(m_candidate_inputs) +
+    get_reserved_bytes(m_active_contexts) +
+    get_nested_reserved_bytes(m_device_active_contexts) +
+    get_reserved_bytes(m_prev_active_contexts) +
+    get_reserved_bytes(m_active_client_contexts);
+}
+
+MemoryUsage Stage::memory_usage(
+    std::vector<const void*>* counted_regexes) const {
+  auto regexes = std::vector<const void*>();
+  if (!counted_regexes)
+    counted_regexes = &regexes;
+
+  auto usage = MemoryUsage{ };
+  usage.contexts = get_reserved_bytes(m_contexts);
+  const auto add_filter = [&](const Filter& filter) {
+    usage.contexts += filter.string.capacity();
+    if (!filter.regex)
+      return;
+    const auto instance = filter.regex->instance();
+    if (std::find(counted_regexes->begin(), counted_regexes->end(),
+          instance) != counted_regexes->end())
+      return;
+    counted_regexes->push_back(instance);
+    usage.regexes += filter.regex->memory_usage();
+  };
+  for (const auto& context : m_contexts) {
+    usage.contexts += get_reserved_bytes(context.inputs) +
+      get_reserved_bytes(context.outputs) +
+      get_reserved_bytes(context.command_outputs) +
+      get_allocated_bytes(context.modifier_filter) +
+      context.matching_devices.capacity() / 8;
+    for (const auto& input : context.inputs)
+      usage.contexts += get_allocated_bytes(input.input);
+    for (const auto& output : context.outputs)
+      usage.contexts += get_allocated_bytes(output);
+    for (const auto& command : context.command_outputs)
+      usage.contexts += get_allocated_bytes(command.output);
+    add_filter(context.device_filter);
+    add_filter(context.device_id_filter);
+  }
+
+  usage.matching = get_reserved_bytes(m_input_indices) +
+    get_reserved_bytes(m_forward_modifiers) +
+    get_reserved_bytes(m_forward_modifier_outputs) +
+    get_nested_reserved_bytes(m_compiled_inputs) +
+    get_nested_reserved_bytes(m_input_triggers) +
+    get_nested_reserved_bytes(m_input_signatures) +
+    get_nested_reserved_bytes(m_match_cursors) +
+    m_context_materialized.capacity() / 8 +
+    get_reserved_bytes(m_materialized_contexts);
+  for (const auto& index : m_input_indices)
+    usage.matching += get_reserved_bytes(index.keyed) +
+      get_reserved_bytes(index.generic);
+  for (const auto& inputs : m_compiled_inputs)
+    for (const auto& input : inputs)
+      if (input)
+        usage.matching += input->memory_usage();
+  for (const auto& [desc, results] : m_device_filter_results)
+    usage.matching += sizeof(desc) + desc.capacity() + results.capacity() / 8;
+
+  usage.arena = get_reserved_bytes(m_events) +
+    get_nested_reserved_bytes(m_input_ranges) +
+    get_nested_reserved_bytes(m_output_ranges) +
+    get_nested_reserved_bytes(m_command_output_ranges) +
+    get_nested_reserved_bytes(m_input_variants) +
+    get_nested_reserved_bytes(m_input_variant_offsets) +
+    get_nested_reserved_bytes(m_variant_output_ranges) +
+    get_reserved_bytes(m_output_ops) +
+    get_nested_reserved_bytes(m_input_outputs) +
+    get_nested_reserved_bytes(m_command_output_tables) +
+    get_reserved_bytes(m_modifier_filter_keys) +
+    get_reserved_bytes(m_modifier_filter_masks) +
+    get_nested_reserved_bytes(m_early_output_conflicts) +
+    get_reserved_bytes(m_device_filter_groups) +
+    get_reserved_bytes(m_fallthrough_contexts);
+
+  usage.buffers = buffer_footprint() +
+    get_nested_reserved_bytes(m_input_profiles);
+  return usage;
+}
+
+void Stage::set_profiling(bool enabled) {
+  if (!enabled) {
+    m_input_profiles.clear();
+    return;
+  }
+  if (!m_input_profiles.empty())
+    return;
+  m_input_profiles.resize(m_contexts.size());
+  for (auto i = size_t{ }; i < m_contexts.size(); ++i)
+    m_input_profiles[i].resize(m_contexts[i].inputs.size());
+}
+
+void Stage::set_reference_matching(bool enabled) {
+  m_reference_matching = enabled;
+  m_state.key_repeat.reset();
+  m_active_contexts_modifiers.reset();
+}
+
+void Stage::set_match_engine(std::optional<MatchEngine> engine) {
+  const auto match_engine = engine.value_or(m_default_match_engine);
+  if (match_engine == m_match_engine)
+    return;
+  m_match_engine = match_engine;
+
+  // rebuild the matching structures which are built
+  for (auto i = 0; i < static_cast<int>(m_contexts.size()); ++i)
+    if (m_context_materialized[i]) {
+      release_context(i);
+      materialize_context(i);
+    }
+  ++m_match_cursor_generation;
+  m_state.key_repeat.reset();
+}
+
+void Stage::set_early_output(bool enabled) {
+  m_early_output = enabled;
+}
+
+void Stage::build_early_output_conflicts() {
+  m_early_output_conflicts.resize(m_contexts.size());
+  for (auto i = size_t{ }; i < m_contexts.size(); ++i) {
+    const auto& context = m_contexts[i];
+    auto& conflicts = m_early_output_conflicts[i];
+    for (const auto& input : context.inputs) {
+      if (input.input.empty())
+        continue;
+      const auto& first = input.input.front();
+      if (first.state != KeyState::Down || !is_device_key(first.key)) {
+        // Any, logical keys, Not... can start with each key
+        conflicts = { Key::any };
+        break;
+      }
+      const auto* output = (input.output_index >= 0 ?
+        &context.outputs[input.output_index] : nullptr);
+      if (!output || output->empty() ||
+          output->front() != KeyEvent(first.key, KeyState::Down))
+        conflicts.push_back(first.key);
+    }
+    std::sort(conflicts.begin(), conflicts.end());
+    conflicts.erase(std::unique(conflicts.begin(), conflicts.end()),
+      conflicts.end());
+    conflicts.shrink_to_fit();
+  }
+}
+
+void Stage::build_fallthrough_contexts() {
+  m_fallthrough_contexts.resize(m_contexts.size());
+  m_context_active.resize(m_contexts.size());
+  auto target = static_cast<int>(m_contexts.size()) - 1;
+  for (auto i = target; i >= 0; --i) {
+    if (!m_contexts[i].fallthrough)
+      target = i;
+    m_fallthrough_contexts[i] = target;
+  }
+}
+
+void Stage::build_device_filter_groups() {
+  if (!m_has_device_filter)
+    return;
+
+  // contexts with identical filters are only evaluated once
+  auto groups = std::unordered_map<std::string, int>();
+  m_device_filter_groups.resize(m_contexts.size());
+  for (auto i = 0; i < static_cast<int>(m_contexts.size()); ++i) {
+    const auto& context = m_contexts[i];
+    m_device_filter_groups[i] = (!has_device_filter(context) ? i :
+      groups.emplace(get_device_filter_key(context), i).first->second);
+  }
+}
+
+size_t Stage::materialized_context_count() const {
+  return static_cast<size_t>(std::count(m_context_materialized.begin(),
+    m_context_materialized.end(), true));
+}
+
+void Stage::materialize_context(int context_index) {
+  build_input_index(context_index);
+  build_input_signatures(context_index);
+  compile_inputs(context_index);
+  m_context_materialized[context_index] = true;
+}
+
+void Stage::release_context(int context_index) {
+  m_input_indices[context_index] = { };
+  m_input_signatures[context_index] = { };
+  m_compiled_inputs[context_index] = { };
+  m_match_cursors[context_index] = { };
+  m_context_materialized[context_index] = false;
+}
+
+// the contexts the client set active and the ones their mappings are
+// added to are built, the least recently active ones beyond the limit
+// are released
+void Stage::materialize_active_contexts() {
+  auto& order = m_materialized_contexts;
+  auto active = size_t{ };
+  for (auto index : m_active_client_contexts) {
+    index = fallthrough_context(index);
+    const auto it = std::find(order.end() - static_cast<std::ptrdiff_t>(active),
+      order.end(), index);
+    if (it != order.end())
+      continue;
+    if (m_context_materialized[index])
+      order.erase(std::find(order.begin(), order.end(), index));
+    else
+      materialize_context(index);
+    order.push_back(index);
+    ++active;
+  }
+  const auto limit = std::max(max_materialized_contexts, active);
+  if (order.size() > limit) {
+    const auto evicted = order.size() - limit;
+    for (auto i = size_t{ }; i < evicted; ++i)
+      release_context(order[i]);
+    order.erase(order.begin(), order.begin() +
+      static_cast<std::ptrdiff_t>(evicted));
+  }
+}
+
+void Stage::build_input_index(int context_index) {
+  const auto& inputs = m_contexts[context_index].inputs;
+  auto& index = m_input_indices[context_index];
+  const auto keyed = (m_match_engine != MatchEngine::interpreted);
+  for (auto j = 0; j < static_cast<int>(inputs.size()); ++j) {
+    if (const auto key = (keyed ? get_leading_key(inputs[j].input) : Key::none);
+        key != Key::none) {
+      // a logical key is bucketed by each of its keys
+      const auto& keys = m_logical_keys.keys(key);
+      if (keys.empty())
+        index.keyed.emplace_back(key, j);
+      for (auto physical : keys)
+        index.keyed.emplace_back(physical, j);
+    }
+    else {
+      index.generic.push_back(j);
+    }
+  }
+  // sort by key, keeping input order within a bucket
+  std::stable_sort(index.keyed.begin(), index.keyed.end(),
+    [](const auto& a, const auto& b) { return a.first < b.first; });
+}
+
+void Stage::build_input_triggers() {
+  m_input_triggers.resize(m_contexts.size());
+  for (auto i = size_t{ }; i < m_contexts.size(); ++i)
+    for (const auto& input : m_contexts[i].inputs)
+      m_input_triggers[i].push_back(get_input_trigger_event(input.input));
+}
+
+void Stage::build_input_signatures(int context_index) {
+  auto& signatures = m_input_signatures[context_index];
+  for (const auto& input : m_contexts[context_index].inputs)
+    signatures.push_back(get_input_signature(input.input, m_logical_keys));
+}
+
+void Stage::build_event_arena() {
+  // variants of the inputs with logical keys, by context and input
+  auto logical_variants = std::vector<std::vector<std::pair<int,
+    std::vector<std::pair<KeySequence, KeySequence>>>>>(m_contexts.size());
+  for (auto i = size_t{ }; i < m_contexts.size(); ++i) {
+    const auto& context = m_contexts[i];
+    for (auto j = 0; j < static_cast<int>(context.inputs.size()); ++j) {
+      const auto& input = context.inputs[j];
+      if (has_logical_key(input.input))
+        logical_variants[i].emplace_back(j, get_logical_variants(input.input,
+          (input.output_index >= 0 ? context.outputs[input.output_index] :
+            KeySequence()), m_logical_keys));
+    }
+  }
+
+  // reserve up front, so the ranges stay valid
+  auto size = size_t{ };
+  for (const auto& context : m_contexts) {
+    for (const auto& input : context.inputs)
+      size += input.input.size();
+    for (const auto& output : context.outputs)
+      size += output.size();
+    for (const auto& command : context.command_outputs)
+      size += command.output.size();
+  }
+  for (const auto& inputs : logical_variants)
+    for (const auto& [input_index, variants] : inputs)
+      for (const auto& [input, output] : variants)
+        size += input.size() + output.size();
+  size += m_forward_modifiers.size();
+  m_events.reserve(size);
+
+  const auto add_events = [&](const KeySequence& sequence) {
+    const auto offset = m_events.size();
+    m_events.insert(m_events.end(), sequence.begin(), sequence.end());
+    return ConstKeySequenceRange(m_events.data() + offset,
+      m_events.data() + m_events.size());
+  };
+
+  // equal outputs share their events, but not their ranges,
+  // which identify the mapping
+  auto output_ranges = std::unordered_multimap<uint64_t, ConstKeySequenceRange>();
+  const auto add_output_events = [&](const KeySequence& sequence) {
+    const auto hash = get_hash(sequence);
+    const auto [begin, end] = output_ranges.equal_range(hash);
+    for (auto it = begin; it != end; ++it)
+      if (std::equal(it->second.begin(), it->second.end(),
+            sequence.begin(), sequence.end()))
+        return it->second;
+    const auto range = add_events(sequence);
+    output_ranges.emplace(hash, range);
+    return range;
+  };
+
+  m_input_ranges.resize(m_contexts.size());
+  m_output_ranges.resize(m_contexts.size());
+  m_command_output_ranges.resize(m_contexts.size());
+  m_input_variants.resize(m_contexts.size());
+  m_input_variant_offsets.resize(m_contexts.size());
+  m_variant_output_ranges.resize(m_contexts.size());
+  for (auto i = size_t{ }; i < m_contexts.size(); ++i) {
+    // keep events of a context together
+    const auto& context = m_contexts[i];
+    for (const auto& input : context.inputs)
+      m_input_ranges[i].push_back(add_events(input.input));
+    for (const auto& output : context.outputs)
+      m_output_ranges[i].push_back(add_output_events(
+        resolve_logical_keys(output, m_logical_keys)));
+    for (const auto& command : context.command_outputs)
+      m_command_output_ranges[i].push_back(add_output_events(
+        resolve_logical_keys(command.output, m_logical_keys)));
+
+    if (logical_variants[i].empty())
+      continue;
+    auto& variants = m_input_variants[i];
+    auto& offsets = m_input_variant_offsets[i];
+    auto& variant_outputs = m_variant_output_ranges[i];
+    auto next = logical_variants[i].begin();
+    for (auto j = 0; j < static_cast<int>(context.inputs.size()); ++j) {
+      offsets.push_back(static_cast<uint32_t>(variants.size()));
+      if (next == logical_variants[i].end() || next->first != j)
+        continue;
+
+      const auto output_index = context.inputs[j].output_index;
+      const auto first_variant_output = variant_outputs.size();
+      for (const auto& [input, output] : next->second) {
+        // variants outputting the same keys share the output
+        const auto same_output = [&](const ConstKeySequenceRange& range) {
+          return std::equal(range.begin(), range.end(),
+            output.begin(), output.end());
+        };
+        auto variant_output = -1;
+        if (output_index >= 0 &&
+            !same_output(m_output_ranges[i][output_index])) {
+          const auto it = std::find_if(
+            variant_outputs.begin() +
+              static_cast<std::ptrdiff_t>(first_variant_output),
+            variant_outputs.end(), same_output);
+          variant_output = static_cast<int>(it - variant_outputs.begin());
+          if (it == variant_outputs.end())
+            variant_outputs.push_back(add_output_events(output));
+        }
+        variants.push_back({ add_events(input),
+          get_input_trigger_event(input), variant_output });
+      }
+      ++next;
+    }
+    offsets.push_back(static_cast<uint32_t>(variants.size()));
+  }
+  for (auto key : m_forward_modifiers)
+    m_forward_modifier_outputs.push_back(add_output_events(
+      KeySequence{ KeyEvent(key, KeyState::Down) }));
+  assert(m_events.size() <= size);
+}
+
+void Stage::build_output_ops() {
+  const auto get_op = [](const KeyEvent& event) {
+    if (event.key == Key::any)
+      return (event.state == KeyState::Not ?
+        OutputOp::release_all : OutputOp::output_any_matches);
+    switch (event.state) {
+      case KeyState::Down: return OutputOp::press;
+      case KeyState::Up: return OutputOp::release;
+      case KeyState::OutputOnRelease: return OutputOp::defer_on_release;
+      case KeyState::Not:
+        if (is_virtual_key(event.key))
+          return OutputOp::toggle_virtual;
+        if (is_action_key(event.key))
+          return OutputOp::none;
+        return OutputOp::ensure_released;
+      default:
+        return OutputOp::none;
+    }
+  };
+
+  m_output_ops.assign(m_events.size(), OutputOp::none);
+  const auto compile = [&](const ConstKeySequenceRange& range) {
+    const auto offset = static_cast<size_t>(range.begin() - m_events.data());
+    for (auto i = size_t{ }; i < range.size(); ++i)
+      m_output_ops[offset + i] = get_op(range[i]);
+  };
+  for (const auto& ranges : m_output_ranges)
+    std::for_each(ranges.begin(), ranges.end(), compile);
+  for (const auto& ranges : m_command_output_ranges)
+    std::for_each(ranges.begin(), ranges.end(), compile);
+  for (const auto& ranges : m_variant_output_ranges)
+    std::for_each(ranges.begin(), ranges.end(), compile);
+  std::for_each(m_forward_modifier_outputs.begin(),
+    m_forward_modifier_outputs.end(), compile);
+}
+
+void Stage::build_output_tables() {
+  m_input_outputs.resize(m_contexts.size());
+  m_command_output_tables.resize(m_contexts.size());
+  for (auto i = size_t{ }; i < m_contexts.size(); ++i) {
+    const auto& context = m_contexts[i];
+    for (const auto& input : context.inputs)
+      m_input_outputs[i].push_back(input.output_index >= 0 ?
+        &m_output_ranges[i][input.output_index] : nullptr);
+
+    // command output index -1 is at 0, -2 at 1...
+    auto& table = m_command_output_tables[i];
+    for (auto j = size_t{ }; j < context.command_outputs.size(); ++j) {
+      const auto index = context.command_outputs[j].index;
+      assert(index < 0);
+      const auto offset = static_cast<size_t>(-index - 1);
+      if (offset >= table.size())
+        table.resize(offset + 1);
+      table[offset] = &m_command_output_ranges[i][j];
+    }
+  }
+}
+
+void Stage::update_mapped_keys() {
+  m_mapped_keys.reset();
+  m_maps_any_key = false;
+  const auto add_keys = [&](const KeySequence& sequence) {
+    for (const auto& event : sequence) {
+      if (event.key == Key::any)
+        m_maps_any_key = true;
+      m_mapped_keys.set(event.key);
+      for (auto key : m_logical_keys.keys(event.key))
+        m_mapped_keys.set(key);
+    }
+  };
+  const auto add_context_keys = [&](const Context& context) {
+    for (const auto& input : context.inputs)
+      add_keys(input.input);
+    for (const auto& output : context.outputs)
+      add_keys(output);
+  };
+  // modifier filters can activate contexts at any time
+  for (const auto& context : m_contexts)
+    add_keys(context.modifier_filter);
+  for (auto index : m_active_client_contexts) {
+    add_context_keys(m_contexts[index]);
+    add_context_keys(m_contexts[fallthrough_context(index)]);
+  }
+}
+
+void Stage::build_modifier_filter_masks() {
+  for (const auto& context : m_contexts)
+    for (const auto& modifier : context.modifier_filter)
+      if (!contains(m_modifier_filter_keys, modifier.key))
+        m_modifier_filter_keys.push_back(modifier.key);
+
+  // fall back to matching filters
+  if (m_modifier_filter_keys.size() > 64) {
+    m_modifier_filter_keys.clear();
+    return;
+  }
+
+  for (const auto& context : m_contexts) {
+    auto& mask = m_modifier_filter_masks.emplace_back();
+    for (const auto& modifier : context.modifier_filter) {
+      const auto bit = uint64_t{ 1 } << std::distance(m_modifier_filter_keys.begin(),
+        std::find(m_modifier_filter_keys.begin(), m_modifier_filter_keys.end(), modifier.key));
+      (modifier.state == KeyState::Not ? mask.not_pressed : mask.pressed) |= bit;
+    }
+  }
+}
+
+void Stage::compile_inputs(int context_index) {
+  const auto& inputs = m_contexts[context_index].inputs;
+  auto& compiled = m_compiled_inputs[context_index];
+  if (m_match_engine != MatchEngine::compiled)
+    compiled.resize(inputs.size());
+  else
+    for (auto j = 0; j < static_cast<int>(inputs.size()); ++j)
+      // the variants of inputs with logical keys are interpreted
+      compiled.push_back(get_input_variants(context_index, j).empty() ?
+        CompiledKeySequence::compile(inputs[j].input) : std::nullopt);
+  m_match_cursors[context_index].resize(inputs.size());
+}
+
+auto Stage::get_input_variants(int context_index, int input_index) const
+    -> InputVariants {
+  const auto& offsets = m_input_variant_offsets[context_index];
+  if (offsets.empty())
+    return { nullptr, nullptr };
+  const auto variants = m_input_variants[context_index].data();
+  return { variants + offsets[input_index],
+           variants + offsets[input_index + 1] };
+}
+
+void Stage::update_match_cursors(ConstKeySequenceRange sequence) {
+  // cursors can be resumed when events were only appended
+  const auto& prev = m_match_cursor_sequence;
+  if (prev.size() > sequence.size() ||
+      !std::equal(prev.begin(), prev.end(), sequence.begin()))
+    ++m_match_cursor_generation;
+  m_match_cursor_sequence.assign(sequence.begin(), sequence.end());
+}
+
+CompiledKeySequence::Cursor* Stage::get_match_cursor(
+    int context_index, int input_index) {
+  auto& cursor = m_match_cursors[context_index][input_index];
+  if (cursor.generation != m_match_cursor_generation) {
+    static_cast<CompiledKeySequence::Cursor&>(cursor) = { };
+    cursor.generation = m_match_cursor_generation;
+  }
+  return &cursor;
+}
+
+void Stage::update_leading_keys(ConstKeySequenceRange sequence) {
+  // collect keys which can be matched by a leading Down
+  m_leading_keys.clear();
+  for (const auto& event : sequence) {
+    if (event.state == KeyState::Down ||
+        event.state == KeyState::DownMatched)
+      if (!contains(m_leading_keys, event.key))
+        m_leading_keys.push_back(event.key);
+    if (event.state != KeyState::DownMatched)
+      break;
+  }
+}
+
+const std::vector<int>& Stage::get_candidate_inputs(int context_index) {
+  if (m_reference_matching) {
+    m_candidate_inputs.resize(m_contexts[context_index].inputs.size());
+    std::iota(m_candidate_inputs.begin(), m_candidate_inputs.end(), 0);
+    return m_candidate_inputs;
+  }
+  const auto& index = m_input_indices[context_index];
+  m_candidate_inputs = index.generic;
+  if (index.keyed.empty())
+    return m_candidate_inputs;
+
+  for (auto key : m_leading_keys) {
+    const auto [begin, end] = std::equal_range(
+      index.keyed.begin(), index.keyed.end(), std::pair(key, 0),
+      [](const auto& a, const auto& b) { return a.first < b.first; });
+    for (auto it = begin; it != end; ++it)
+      m_candidate_inputs.push_back(it->second);
+  }
+
+  // restore order of inputs in context
+  std::sort(m_candidate_inputs.begin(), m_candidate_inputs.end());
+
+  // inputs with a logical leading key are in several buckets
+  if (!m_logical_keys.empty())
+    m_candidate_inputs.erase(std::unique(m_candidate_inputs.begin(),
+      m_candidate_inputs.end()), m_candidate_inputs.end());
+  return m_candidate_inputs;
 }
 
 bool Stage::is_clear() const {
-  return m_output_down.empty() &&
-         m_output_on_release.empty() &&
-         m_sequence.empty() &&
-         m_history.empty() &&
-         !m_sequence_might_match &&
-         !m_current_timeout;
+  return m_state.passed_keys.empty() &&
+         m_state.output_down.empty() &&
+         m_state.output_on_release.empty() &&
+         m_state.sequence.empty() &&
+         history().empty() &&
+         !m_state.sequence_might_match &&
+         !m_state.current_timeout;
 }
 
 std::vector<Key> Stage::get_output_keys_down() const {
   auto keys = std::vector<Key>{ };
-  for (const auto& output : m_output_down)
+  for (const auto& output : m_state.output_down)
     if (is_device_key(output.key))
       keys.push_back(output.key);
+  keys.insert(keys.end(), m_state.passed_keys.begin(), m_state.passed_keys.end());
+  if (m_state.early_output_key != Key::none)
+    keys.push_back(m_state.early_output_key);
+  return keys;
+}
+
+std::vector<Key> Stage::get_input_keys_down() const {
+  auto keys = std::vector<Key>{ };
+  for (auto code = 0u; code <= std::numeric_limits<uint16_t>::max(); ++code)
+    if (m_keys_down.test(static_cast<Key>(code)))
+      keys.push_back(static_cast<Key>(code));
   return keys;
 }
 
-void Stage::evaluate_device_filters(const std::vector<DeviceDesc>& device_descs) {
-  for (auto& context : m_contexts)
+std::vector<bool> Stage::match_device_filters(const DeviceDesc& device_desc) const {
+  auto results = std::vector<bool>(m_contexts.size());
+  for (auto i = size_t{ }; i < m_contexts.size(); ++i) {
+    const auto& context = m_contexts[i];
+    if (!has_device_filter(context))
+      continue;
+    const auto group = static_cast<size_t>(m_device_filter_groups[i]);
+    results[i] = (group != i ? results[group] :
+      context.device_filter.matches(device_desc.name, false) &&
+      context.device_id_filter.matches(device_desc.id, false));
+  }
+  return results;
+}
+
+bool Stage::evaluate_device_filters(const std::vector<DeviceDesc>& device_descs) {
+  m_state.key_repeat.reset();
+  m_active_contexts_modifiers.reset();
+
+  // only devices which were not seen before are evaluated
+  auto columns = std::vector<const std::vector<bool>*>();
+  if (m_has_device_filter)
+    for (const auto& device_desc : device_descs) {
+      auto key = device_desc.name;
+      key.push_back('\0');
+      key += device_desc.id;
+      auto it = m_device_filter_results.find(key);
+      if (it == m_device_filter_results.end())
+        it = m_device_filter_results.emplace(std::move(key),
+          match_device_filters(device_desc)).first;
+      columns.push_back(&it->second);
+    }
+
+  auto changed = false;
+  for (auto i = size_t{ }; i < m_contexts.size(); ++i) {
+    auto& context = m_contexts[i];
+    auto has_matching_device = true;
     if (has_device_filter(context)) {
-      context.matching_device_bits = { };
-      auto bit = decltype(context.matching_device_bits){ 1 };
-      for (const auto& device_desc : device_descs) {
-        if (context.device_filter.matches(device_desc.name, false) &&
-            context.device_id_filter.matches(device_desc.id, false))
-          context.matching_device_bits |= bit;
-        bit <<= 1;
+      has_matching_device = false;
+      context.matching_devices.resize(columns.size());
+      for (auto j = size_t{ }; j < columns.size(); ++j) {
+        const auto matches = (*columns[j])[i];
+        context.matching_devices[j] = matches;
+        has_matching_device |= matches;
       }
     }
     else {
-      context.matching_device_bits = all_device_bits;
+      context.matching_devices.clear();
     }
+    changed |= (has_matching_device != context.has_matching_device);
+    context.has_matching_device = has_matching_device;
+  }
+
+  if (m_has_device_filter)
+    update_device_active_contexts();
+  return changed;
 }
 
 bool Stage::device_matches_filter(const Context& context, int device_index) const {
-  if (device_index == any_device_index)
+  if (device_index == any_device_index || !has_device_filter(context))
     return true;
 
   // no-device only matches contexts with default device
   if (device_index == no_device_index)
-    return (context.matching_device_bits == all_device_bits);
+    return false;
+
+  return (device_index >= 0 &&
+          device_index < static_cast<int>(context.matching_devices.size()) &&
+          context.matching_devices[device_index]);
+}
+
+// so matching only iterates the contexts a device can match. Updated when
+// the active contexts or the devices changed
+void Stage::update_device_active_contexts() {
+  // other devices only match contexts without filter
+  auto device_count = size_t{ };
+  for (auto index : m_active_contexts)
+    device_count = std::max(device_count,
+      m_contexts[index].matching_devices.size());
+  if (m_device_active_contexts.size() != device_count + 1) {
+    m_device_active_contexts.resize(device_count + 1);
+    for (auto& contexts : m_device_active_contexts)
+      contexts.reserve(m_contexts.size());
+  }
+
+  for (auto i = size_t{ }; i <= device_count; ++i) {
+    const auto device_index = (i < device_count ?
+      static_cast<int>(i) : no_device_index);
+    auto& contexts = m_device_active_contexts[i];
+    contexts.clear();
+    for (auto index : m_active_contexts)
+      if (device_matches_filter(m_contexts[index], device_index))
+        contexts.push_back(index);
+  }
+}
 
-  return ((context.matching_device_bits >> device_index) & 1);
+const std::vector<int>& Stage::get_device_active_contexts(int device_index) const {
+  if (!m_has_device_filter || device_index == any_device_index ||
+      m_device_active_contexts.empty())
+    return m_active_contexts;
+  const auto device_count = m_device_active_contexts.size() - 1;
+  return m_device_active_contexts[device_index >= 0 &&
+    static_cast<size_t>(device_index) < device_count ?
+    static_cast<size_t>(device_index) : device_count];
 }
 
 KeySequence Stage::set_active_client_contexts(const std::vector<int> &indices) {
@@ -197,7 +1183,13 @@ KeySequence Stage::set_active_client_contexts(const std::vector<int> &indices) {
   for ([[maybe_unused]] auto i : indices)
     assert(i >= 0 && i < static_cast<int>(m_contexts.size()));
 
+  adopt_passed_keys();
+  m_state.key_repeat.reset();
+  m_active_contexts_modifiers.reset();
   m_active_client_contexts = indices;
+  if (m_contexts.size() > max_materialized_contexts)
+    materialize_active_contexts();
+  update_mapped_keys();
   update_active_contexts();
 
   // cancel output on release when the focus changed
@@ -207,9 +1199,19 @@ KeySequence Stage::set_active_client_contexts(const std::vector<int> &indices) {
   return std::move(m_output_buffer);
 }
 
+// a logical key is pressed when one of its keys is
+bool Stage::is_modifier_pressed(Key key) const {
+  if (find_key(m_state.sequence, key) != m_state.sequence.end())
+    return true;
+  for (auto physical : m_logical_keys.keys(key))
+    if (find_key(m_state.sequence, physical) != m_state.sequence.end())
+      return true;
+  return false;
+}
+
 bool Stage::match_context_modifier_filter(const KeySequence& modifiers) {
   for (const auto& modifier : modifiers) {
-    const auto pressed = (find_key(m_sequence, modifier.key) != m_sequence.end());
+    const auto pressed = is_modifier_pressed(modifier.key);
     const auto should_be_pressed = (modifier.state != KeyState::Not);
     if (pressed != should_be_pressed)
       return false;
@@ -217,20 +1219,52 @@ bool Stage::match_context_modifier_filter(const KeySequence& modifiers) {
   return true;
 }
 
+uint64_t Stage::get_modifier_filter_keys_pressed() const {
+  auto pressed = uint64_t{ };
+  for (auto i = size_t{ }; i < m_modifier_filter_keys.size(); ++i)
+    if (is_modifier_pressed(m_modifier_filter_keys[i]))
+      pressed |= uint64_t{ 1 } << i;
+  return pressed;
+}
+
 void Stage::update_active_contexts() {
+  const auto use_masks = !m_modifier_filter_masks.empty();
+  const auto modifiers = (use_masks ? get_modifier_filter_keys_pressed() : 0);
+  if (use_masks) {
+    // nothing changed since last update
+    if (m_active_contexts_modifiers == modifiers && !m_reference_matching)
+      return;
+    m_active_contexts_modifiers = modifiers;
+  }
+
   std::swap(m_prev_active_contexts, m_active_contexts);
+  for (auto index : m_prev_active_contexts)
+    m_context_active[index] = false;
 
   // evaluate modifier and device filter of contexts which were set active by client
   m_active_contexts.clear();
   for (auto index : m_active_client_contexts) {
     const auto& context = m_contexts[index];
-    if ((match_context_modifier_filter(context.modifier_filter) ^ context.invert_modifier_filter) &&
-        ((!context.device_filter && !context.device_id_filter) || context.matching_device_bits)) {
+    auto modifier_filter_matches = false;
+    if (use_masks) {
+      const auto& mask = m_modifier_filter_masks[index];
+      modifier_filter_matches = ((modifiers & mask.pressed) == mask.pressed &&
+                                 !(modifiers & mask.not_pressed));
+    }
+    else {
+      modifier_filter_matches = match_context_modifier_filter(context.modifier_filter);
+    }
+    if ((modifier_filter_matches ^ context.invert_modifier_filter) &&
+        (!has_device_filter(context) || context.has_matching_device)) {
       index = fallthrough_context(index);
-      if (m_active_contexts.empty() || m_active_contexts.back() != index)
+      if (m_active_contexts.empty() || m_active_contexts.back() != index) {
         m_active_contexts.push_back(index);
+        m_context_active[index] = true;
+      }
     }
   }
+  if (m_has_device_filter)
+    update_device_active_contexts();
 
   // compare current and previous active contexts indices
   // first toggle deactivated contexts' keys then activated
@@ -272,7 +1306,8 @@ void Stage::on_context_active_event(const KeyEvent& event, int context_index) {
     });
   if (it != inputs.end()) {
     if (event.state == KeyState::Down) {
-      if (auto output = find_output(context, it->output_index))
+      const auto input_index = static_cast<int>(std::distance(inputs.begin(), it));
+      if (auto output = find_output(context_index, input_index))
         apply_output(*output, event, context_index);
     }
     else {
@@ -284,26 +1319,26 @@ void Stage::on_context_active_event(const KeyEvent& event, int context_index) {
 
 void Stage::cancel_inactive_output_on_release() {
   // only cancel output which was triggered in now inactive context
-  m_output_on_release.erase(
-    std::remove_if(begin(m_output_on_release), end(m_output_on_release),
+  m_state.output_on_release.erase(
+    std::remove_if(begin(m_state.output_on_release), end(m_state.output_on_release),
       [&](const OutputOnRelease& output) {
-        return !is_context_active(output.context_index);
+        if (is_context_active(output.context_index))
+          return false;
+        m_output_on_release_triggers.reset(output.trigger);
+        return true;
       }),
-    end(m_output_on_release));
+    end(m_state.output_on_release));
+  for (const auto& output : m_state.output_on_release)
+    m_output_on_release_triggers.set(output.trigger);
 }
 
 int Stage::fallthrough_context(int context_index) const {
-  while (m_contexts[context_index].fallthrough)
-    ++context_index;
-  return context_index;
+  return m_fallthrough_contexts[context_index];
 }
 
 bool Stage::is_context_active(int context_index) const {
-  for (auto active_context_index : m_active_contexts)
-    if (active_context_index == context_index ||
-        fallthrough_context(active_context_index) == context_index)
-      return true;
-  return false;
+  // the active contexts are the fallthrough targets
+  return m_context_active[context_index];
 }
 
 void Stage::advance_exit_sequence(const KeyEvent& event) {
@@ -311,90 +1346,332 @@ void Stage::advance_exit_sequence(const KeyEvent& event) {
     return;
 
   if (event.state == KeyState::Down) {
-    const auto p = m_exit_sequence_position;
+    const auto p = m_state.exit_sequence_position;
     // ignore key repeat
     if (p > 0 && event.key == exit_sequence[p - 1])
       return;
     if (p < exit_sequence.size() && event.key == exit_sequence[p]) {
-      ++m_exit_sequence_position;
+      ++m_state.exit_sequence_position;
       return;
     }
   }
-  m_exit_sequence_position = 0;
+  m_state.exit_sequence_position = 0;
 }
 
 bool Stage::should_exit() const {
-  return (m_exit_sequence_position == exit_sequence.size());
+  return (m_state.exit_sequence_position == exit_sequence.size());
 }
 
 KeySequence Stage::update(const KeyEvent event, int device_index) {
-  advance_exit_sequence(event);
-  apply_input(event, device_index);
+  update_input(event, device_index);
   return std::move(m_output_buffer);
 }
 
+void Stage::update(const KeyEvent event, int device_index, KeySequence& output) {
+  update_input(event, device_index);
+  output.insert(output.end(), m_output_buffer.begin(), m_output_buffer.end());
+  m_output_buffer.clear();
+}
+
+void Stage::update(ConstKeySequenceRange events, int device_index,
+    KeySequence& output) {
+  // only an event, which is repeated by the next one, needs to be cached
+  const auto may_repeat = [&](size_t i) {
+    return (i + 1 == events.size() || events[i + 1] == events[i]);
+  };
+  for (auto i = size_t{ }; i < events.size(); ++i) {
+    if (uses_minimal_policy(events[i]))
+      update_input<MinimalPolicy>(events[i], device_index, may_repeat(i));
+    else
+      update_input<GeneralPolicy>(events[i], device_index, may_repeat(i));
+  }
+  output.insert(output.end(), m_output_buffer.begin(), m_output_buffer.end());
+  m_output_buffer.clear();
+}
+
+bool Stage::uses_minimal_policy(const KeyEvent& event) const {
+  // timeouts of other stages are also applied, they can release
+  // outputs and they become the trigger, which only the general policy handles
+  return (m_minimal_policy && !m_reference_matching &&
+    event.key != Key::timeout);
+}
+
+void Stage::update_input(const KeyEvent& event, int device_index) {
+  if (uses_minimal_policy(event))
+    update_input<MinimalPolicy>(event, device_index, true);
+  else
+    update_input<GeneralPolicy>(event, device_index, true);
+}
+
+template<typename Policy>
+void Stage::update_input(const KeyEvent& event, int device_index,
+    bool may_repeat) {
+  advance_exit_sequence(event);
+  if (replay_key_repeat(event, device_index))
+    return;
+
+  const auto cache_key_repeat = (may_repeat && can_cache_key_repeat(event));
+  if (cache_key_repeat) {
+    m_prev_sequence = m_state.sequence;
+    m_prev_output_down = m_state.output_down;
+    m_prev_history.assign(history().begin(), history().end());
+  }
+  const auto output_begin = m_output_buffer.size();
+  apply_input<Policy>(event, device_index);
+  if (m_state.early_output_key != Key::none)
+    finish_early_output(output_begin);
+
+  // when a key repeat did not change the state, following
+  // repeats can simply output the same again
+  if (cache_key_repeat &&
+      can_cache_key_repeat(event) &&
+      m_state.sequence == m_prev_sequence &&
+      m_state.output_down == m_prev_output_down &&
+      std::equal(m_prev_history.begin(), m_prev_history.end(),
+        history().begin(), history().end())) {
+    m_state.key_repeat = KeyRepeat{ event, device_index };
+    m_state.key_repeat_output.assign(
+      m_output_buffer.begin() + output_begin, m_output_buffer.end());
+  }
+}
+
+bool Stage::replay_key_repeat(const KeyEvent& event, int device_index) {
+  if (!m_state.key_repeat ||
+      m_state.key_repeat->event != event ||
+      m_state.key_repeat->device_index != device_index) {
+    m_state.key_repeat.reset();
+    return false;
+  }
+  m_output_buffer.insert(m_output_buffer.end(),
+    m_state.key_repeat_output.begin(), m_state.key_repeat_output.end());
+  return true;
+}
+
+bool Stage::can_cache_key_repeat(const KeyEvent& event) const {
+  // key is still down after its mapping matched
+  return (!m_reference_matching &&
+          event.state == KeyState::Down &&
+          event.key != Key::timeout &&
+          !is_virtual_key(event.key) &&
+          m_state.passed_keys.empty() &&
+          m_state.output_on_release.empty() &&
+          !m_state.sequence_might_match &&
+          !m_state.current_timeout &&
+          contains(m_state.sequence, KeyEvent(event.key, KeyState::DownMatched)));
+}
+
+bool Stage::is_holding_back() const {
+  // something the event would need to be ordered after
+  return (m_state.sequence_might_match ||
+          m_state.current_timeout ||
+          !m_state.output_on_release.empty() ||
+          has_non_optional(m_state.sequence) ||
+          std::any_of(begin(m_state.output_down), end(m_state.output_down),
+            [](const OutputDown& output) { return output.temporarily_released; }));
+}
+
+bool Stage::can_pass_through(const KeyEvent& event) const {
+  if (m_reference_matching ||
+      m_maps_any_key ||
+      m_has_no_might_match_mapping ||
+      !is_device_key(event.key) ||
+      m_mapped_keys.test(event.key))
+    return false;
+
+  if (event.state == KeyState::Down)
+    // key repeats and keys still output are updated
+    return (!m_keys_down.test(event.key) &&
+            !m_output_keys_down.test(event.key) &&
+            !is_holding_back());
+
+  return contains(m_state.passed_keys, event.key);
+}
+
+bool Stage::pass_through(const KeyEvent& event) {
+  if (!can_pass_through(event))
+    return false;
+
+  m_state.key_repeat.reset();
+  if (event.state == KeyState::Down) {
+    m_state.passed_keys.push_back(event.key);
+    m_keys_down.set(event.key);
+  }
+  else {
+    m_state.passed_keys.erase(
+      std::find(begin(m_state.passed_keys), end(m_state.passed_keys), event.key));
+    m_keys_down.reset(event.key);
+  }
+  advance_exit_sequence(event);
+  return true;
+}
+
+bool Stage::is_waiting_for_timeout() const {
+  // a timeout can also complete or flush a sequence of keys which are
+  // still hold, even when the stage does not map timeouts
+  return (m_state.current_timeout || !m_state.sequence.empty());
+}
+
+bool Stage::get_referenced_keys(KeyBitmap& keys) const {
+  if (m_has_no_might_match_mapping)
+    return false;
+  auto any_key = false;
+  const auto add_keys = [&](const KeySequence& sequence) {
+    for (const auto& event : sequence) {
+      if (event.key == Key::any)
+        any_key = true;
+      keys.set(event.key);
+      for (auto key : m_logical_keys.keys(event.key))
+        keys.set(key);
+    }
+  };
+  for (const auto& context : m_contexts) {
+    add_keys(context.modifier_filter);
+    for (const auto& input : context.inputs)
+      add_keys(input.input);
+    for (const auto& output : context.outputs)
+      add_keys(output);
+    for (const auto& output : context.command_outputs)
+      add_keys(output.output);
+  }
+  for (auto key : m_forward_modifiers)
+    keys.set(key);
+  return !any_key;
+}
+
+void Stage::adopt_passed_keys() {
+  // continue as if the passed keys' Downs were updated
+  for (auto key : m_state.passed_keys) {
+    m_state.sequence.push_back({ key, KeyState::DownMatched });
+    m_state.output_down.push_back({ key, key, false, false, false, -1 });
+    m_output_keys_down.set(key);
+    m_output_down_triggers.set(key);
+  }
+  m_state.passed_keys.clear();
+}
+
 void Stage::reuse_buffer(KeySequence&& buffer) {
   m_output_buffer = std::move(buffer);
   m_output_buffer.clear();
 }
 
 void Stage::validate_state(const std::function<bool(Key)>& is_down) {
-  m_sequence_might_match = false;
+  adopt_passed_keys();
+  m_state.key_repeat.reset();
+  m_state.sequence_might_match = false;
 
-  m_sequence.erase(
-    std::remove_if(begin(m_sequence), end(m_sequence),
+  m_state.sequence.erase(
+    std::remove_if(begin(m_state.sequence), end(m_state.sequence),
       [&](const KeyEvent& event) { 
         return is_device_key(event.key) && 
           !is_down(event.key); 
       }),
-    end(m_sequence));
+    end(m_state.sequence));
 
-  m_output_down.erase(
-    std::remove_if(begin(m_output_down), end(m_output_down),
+  for (auto code = 0u; code <= std::numeric_limits<uint16_t>::max(); ++code) {
+    const auto key = static_cast<Key>(code);
+    if (m_keys_down.test(key) && is_device_key(key) && !is_down(key))
+      m_keys_down.reset(key);
+  }
+
+  m_state.output_down.erase(
+    std::remove_if(begin(m_state.output_down), end(m_state.output_down),
       [&](const OutputDown& output) {
-        return is_device_key(output.key) &&
-          !is_down(get_trigger_key(output.trigger));
+        if (is_device_key(output.key) &&
+            !is_down(get_trigger_key(output.trigger))) {
+          m_output_keys_down.reset(output.key);
+          return true;
+        }
+        return false;
       }),
-    end(m_output_down));
+    end(m_state.output_down));
+
+  if (m_state.early_output_key != Key::none &&
+      !is_down(m_state.early_output_key))
+    m_state.early_output_key = Key::none;
 }
 
-const KeySequence* Stage::find_output(const Context& context, int output_index) const {
-  if (output_index >= 0) {
-    assert(output_index < static_cast<int>(context.outputs.size()));
-    return &context.outputs[output_index];
-  }
+const ConstKeySequenceRange* Stage::find_output(int context_index,
+    int input_index, const InputVariant* variant) const {
+  if (variant && variant->output_index >= 0)
+    return &m_variant_output_ranges[context_index][variant->output_index];
+  if (auto output = m_input_outputs[context_index][input_index])
+    return output;
 
   // search for last override of command output
+  const auto output_index = m_contexts[context_index].inputs[input_index].output_index;
+  const auto offset = static_cast<size_t>(-output_index - 1);
   for (auto i = static_cast<int>(m_active_contexts.size()) - 1; i >= 0; --i) {
-    // binary search for command outputs of context
-    const auto context_index = fallthrough_context(m_active_contexts[i]);
-    const auto& command_outputs = m_contexts[context_index].command_outputs;
-    const auto it = std::lower_bound(
-      command_outputs.rbegin(), command_outputs.rend(), output_index,
-      [](const CommandOutput& a, int index) { return a.index < index; });
-    if (it != command_outputs.rend() && it->index == output_index)
-      return &it->output;
+    const auto& table = m_command_output_tables[m_active_contexts[i]];
+    if (offset < table.size() && table[offset])
+      return table[offset];
   }
   return nullptr;
 }
 
+// a forwarded modifier matches like an input "+Key ~Key" before all others,
+// so a sequence starting with its Down and at most followed by its Up
+const ConstKeySequenceRange* Stage::match_forward_modifier(
+    ConstKeySequenceRange sequence) const {
+  auto it = sequence.begin();
+  while (it != sequence.end() && it->state == KeyState::DownMatched)
+    ++it;
+  if (it == sequence.end() || it->state != KeyState::Down ||
+      !m_forward_modifier_keys.test(it->key))
+    return nullptr;
+
+  const auto key = it->key;
+  auto released = false;
+  for (++it; it != sequence.end(); ++it) {
+    if (it->state == KeyState::DownMatched)
+      continue;
+    if (it->key != key || it->state != KeyState::Up || released)
+      return nullptr;
+    released = true;
+  }
+  const auto index = std::distance(m_forward_modifiers.begin(),
+    std::find(m_forward_modifiers.begin(), m_forward_modifiers.end(), key));
+  return &m_forward_modifier_outputs[static_cast<size_t>(index)];
+}
+
+template<typename Policy>
 auto Stage::match_input(bool first_iteration, 
     ConstKeySequenceRange sequence, int device_index, 
     bool is_key_up_event) -> MatchInputResult {
 
-  for (auto context_index : m_active_contexts) {
+  // forwarded modifiers are checked before the mappings
+  if (!m_forward_modifiers.empty())
+    if (const auto output = match_forward_modifier(sequence))
+      return { MatchResult::match, output,
+        KeyEvent((*output)[0].key, KeyState::Down), -1 };
+
+  update_leading_keys(sequence);
+
+  // only the whole sequence is matched incrementally
+  if (first_iteration)
+    update_match_cursors(sequence);
+
+  const auto sequence_signature = get_sequence_signature(sequence);
+
+  const auto& active_contexts = (Policy::device_filters ?
+    get_device_active_contexts(device_index) : m_active_contexts);
+  for (auto context_index : active_contexts) {
     const auto& context = m_contexts[context_index];
-    if (!device_matches_filter(context, device_index))
-      continue;
 
-    for (const auto& context_input : context.inputs) {
+    const auto& signatures = m_input_signatures[context_index];
+    for (auto input_index : get_candidate_inputs(context_index)) {
+      // skip inputs, which cannot unify all events of sequence
+      if ((sequence_signature & ~signatures[input_index]) &&
+          !m_reference_matching)
+        continue;
+
+      const auto& context_input = context.inputs[input_index];
       const auto& input = context_input.input;
-      const auto no_might_match_mapping = 
-        is_no_might_match_mapping(input);
+      const auto no_might_match_mapping = (Policy::no_might_match &&
+        is_no_might_match_mapping(input));
 
       // no-might-match mappings are matched with
       // history and only in first iteration
-      if (no_might_match_mapping && (!first_iteration || m_history.empty()))
+      if (no_might_match_mapping && (!first_iteration || history().empty()))
         continue;
 
       // no-might-match mappings are matched only
@@ -406,46 +1683,234 @@ auto Stage::match_input(bool first_iteration,
       const auto accept_might_match = 
         (first_iteration && !no_might_match_mapping);
 
-      auto input_timeout_event = KeyEvent{ };
-      const auto result = m_match(input,
-        (no_might_match_mapping ? m_history : sequence),
-        &m_any_key_matches, &input_timeout_event);
+      // an input with logical keys is matched as each of its variants
+      const auto variants = get_input_variants(context_index, input_index);
+      const auto variant_count = std::max(variants.size(), size_t{ 1 });
+      for (auto v = size_t{ }; v < variant_count; ++v) {
+        const auto variant = (variants.empty() ? nullptr : &variants[v]);
+        const auto& trigger = (variant ? variant->trigger :
+          m_input_triggers[context_index][input_index]);
+        auto input_timeout_event = KeyEvent{ };
+        const auto& compiled = m_compiled_inputs[context_index][input_index];
+        const auto& expression = (variant ? variant->input :
+          m_input_ranges[context_index][input_index]);
+        const auto profiling = !m_input_profiles.empty();
+        const auto start = (profiling ?
+          std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point{ });
+        const auto result = (no_might_match_mapping ?
+          m_match(expression, history(), &m_any_key_matches, &input_timeout_event) :
+          compiled && !m_reference_matching ?
+          m_match(*compiled, sequence, &m_any_key_matches, &input_timeout_event,
+            (first_iteration ? get_match_cursor(context_index, input_index) : nullptr)) :
+          m_match(expression, sequence, &m_any_key_matches, &input_timeout_event));
+
+        if (profiling) {
+          auto& profile = m_input_profiles[context_index][input_index];
+          ++profile.invocations;
+          if (result == MatchResult::might_match)
+            ++profile.might_matches;
+          else if (result == MatchResult::match)
+            ++profile.matches;
+          profile.nanoseconds += static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+              std::chrono::steady_clock::now() - start).count());
+        }
 
-      if (accept_might_match && result == MatchResult::might_match) {
-        
-        if (input_timeout_event.key == Key::timeout) {
-          // request client to inject timeout event
-          m_output_buffer.push_back(input_timeout_event);
-
-          // track timeout - use last key Down as trigger
-          if (auto trigger = find_last_down_event(sequence)) {
-            if (!m_current_timeout || 
-                *m_current_timeout != input_timeout_event ||
-                m_current_timeout->trigger != trigger->key) {
-              m_current_timeout = { input_timeout_event, trigger->key };
-            }
-            else if (is_key_up_event) {
-              // timeout did not change, undo adding to output buffer
-              m_output_buffer.pop_back();
+        if (accept_might_match && result == MatchResult::might_match) {
+
+          if (Policy::timeouts && input_timeout_event.key == Key::timeout) {
+            // request client to inject timeout event
+            m_output_buffer.push_back(input_timeout_event);
+
+            // track timeout - use last key Down as trigger
+            if (auto last_down = find_last_down_event(sequence)) {
+              if (!m_state.current_timeout ||
+                  *m_state.current_timeout != input_timeout_event ||
+                  m_state.current_timeout->trigger != last_down->key) {
+                m_state.current_timeout = { input_timeout_event, last_down->key };
+              }
+              else if (is_key_up_event) {
+                // timeout did not change, undo adding to output buffer
+                m_output_buffer.pop_back();
+              }
             }
           }
+          return { MatchResult::might_match, nullptr, trigger, context_index };
         }
-        return { MatchResult::might_match, nullptr, &input, context_index };
+
+        if (result == MatchResult::match)
+          if (auto output = find_output(context_index, input_index, variant))
+            return { MatchResult::match, output, trigger, context_index };
       }
+    }
+  }
+  return { MatchResult::no_match, nullptr, { }, 0 };
+}
 
-      if (result == MatchResult::match)
-        if (auto output = find_output(context, context_input.output_index))
-          return { MatchResult::match, output, &input, context_index };
+// when a might match failed, the longest start of the sequence is looked for,
+// which matches exactly. Each compiled input is matched with the growing
+// starts by resuming a cursor, so the candidates are evaluated in one pass.
+// The sequence is shortened to the start which matched
+template<typename Policy>
+auto Stage::match_sequence_start(ConstKeySequenceRange& sequence,
+    int device_index, bool is_key_up_event) -> MatchInputResult {
+
+  if (m_reference_matching) {
+    // evaluate each shorter start separately
+    while (sequence.size() > 1) {
+      sequence.pop_back();
+      if (!has_unmatched_down(sequence))
+        break;
+      const auto result = match_input<Policy>(false, sequence,
+        device_index, is_key_up_event);
+      if (std::get<MatchResult>(result) == MatchResult::match)
+        return result;
     }
+    return { MatchResult::no_match, nullptr, { }, 0 };
   }
-  return { MatchResult::no_match, nullptr, nullptr, 0 };
+
+  // only starts with a Down can match
+  const auto min_length = key_scan::find_state(sequence.begin(),
+    sequence.size(), key_scan::states(KeyState::Down)) + 1;
+  const auto max_length = sequence.size() - 1;
+  const auto start = [&](size_t length) {
+    return ConstKeySequenceRange(sequence.begin(), sequence.begin() + length);
+  };
+
+  // a longer start is preferred, on the same length the first input
+  auto best = MatchInputResult{ MatchResult::no_match, nullptr, { }, 0 };
+  auto best_length = min_length - 1;
+  auto best_expression = static_cast<const ConstKeySequenceRange*>(nullptr);
+  if (min_length > max_length)
+    return best;
+
+  // forwarded modifiers are checked before the mappings
+  if (!m_forward_modifiers.empty())
+    for (auto length = max_length; length >= min_length; --length)
+      if (const auto output = match_forward_modifier(start(length))) {
+        best = { MatchResult::match, output,
+          KeyEvent((*output)[0].key, KeyState::Down), -1 };
+        best_length = length;
+        break;
+      }
+
+  // the leading keys are the same for each start containing a Down
+  update_leading_keys(sequence);
+
+  const auto profiling = !m_input_profiles.empty();
+  auto input_timeout_event = KeyEvent{ };
+  const auto& active_contexts = (Policy::device_filters ?
+    get_device_active_contexts(device_index) : m_active_contexts);
+  for (auto context_index : active_contexts) {
+    const auto& context = m_contexts[context_index];
+
+    const auto& signatures = m_input_signatures[context_index];
+    for (auto input_index : get_candidate_inputs(context_index)) {
+      if (best_length == max_length)
+        break;
+
+      // no-might-match mappings are only matched with the whole sequence
+      const auto& input = context.inputs[input_index].input;
+      if (Policy::no_might_match && is_no_might_match_mapping(input))
+        continue;
+
+      // an input with logical keys is matched as each of its variants
+      const auto variants = get_input_variants(context_index, input_index);
+      const auto variant_count = std::max(variants.size(), size_t{ 1 });
+      for (auto v = size_t{ }; v < variant_count; ++v) {
+        if (best_length == max_length)
+          break;
+        const auto variant = (variants.empty() ? nullptr : &variants[v]);
+        const auto output = find_output(context_index, input_index, variant);
+        if (!output)
+          continue;
+
+        const auto begin = (profiling ?
+          std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point{ });
+        const auto& compiled = m_compiled_inputs[context_index][input_index];
+        const auto& expression = (variant ? variant->input :
+          m_input_ranges[context_index][input_index]);
+        auto matched_length = size_t{ };
+        auto invocations = uint64_t{ };
+        auto signature = uint64_t{ };
+        if (compiled) {
+          // each start resumes the match of the previous one
+          auto cursor = CompiledKeySequence::Cursor{ };
+          for (auto length = size_t{ 1 }; length <= max_length; ++length) {
+            // skip starts, which cannot unify all events
+            const auto& event = sequence[length - 1];
+            if (event.state != KeyState::DownMatched)
+              signature |= get_key_signature(event.key);
+            if (signature & ~signatures[input_index])
+              break;
+            if (length < min_length)
+              continue;
+
+            ++invocations;
+            if (m_match(*compiled, start(length), &m_any_key_matches,
+                  &input_timeout_event, &cursor) == MatchResult::match)
+              matched_length = length;
+            if (cursor.failed)
+              break;
+          }
+        }
+        else {
+          // interpreted from the longest start, which can unify all events
+          auto length = size_t{ };
+          for (; length < max_length; ++length) {
+            const auto& event = sequence[length];
+            if (event.state != KeyState::DownMatched)
+              signature |= get_key_signature(event.key);
+            if (signature & ~signatures[input_index])
+              break;
+          }
+          for (; length > best_length; --length) {
+            ++invocations;
+            if (m_match(expression, start(length), &m_any_key_matches,
+                  &input_timeout_event) == MatchResult::match) {
+              matched_length = length;
+              break;
+            }
+          }
+        }
+
+        if (profiling) {
+          auto& profile = m_input_profiles[context_index][input_index];
+          profile.invocations += invocations;
+          if (matched_length)
+            ++profile.matches;
+          profile.nanoseconds += static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+              std::chrono::steady_clock::now() - begin).count());
+        }
+
+        if (matched_length > best_length) {
+          best = { MatchResult::match, output, (variant ? variant->trigger :
+            m_input_triggers[context_index][input_index]), context_index };
+          best_length = matched_length;
+          best_expression = &expression;
+        }
+      }
+    }
+  }
+
+  if (std::get<MatchResult>(best) == MatchResult::match) {
+    sequence = start(best_length);
+
+    // restore the keys the input matched with Any, since the
+    // candidates evaluated after it overwrote them
+    if (best_expression)
+      m_match(*best_expression, sequence,
+        &m_any_key_matches, &input_timeout_event);
+  }
+  return best;
 }
 
 bool Stage::is_physically_pressed(Key key) const {
-  const auto it = rfind_key(m_sequence, key);
-  return (it != cend(m_sequence) && it->state != KeyState::Up);
+  return m_keys_down.test(key);
 }
 
+template<typename Policy>
 void Stage::apply_input(const KeyEvent event, int device_index) {
   assert(event.state == KeyState::Down ||
          event.state == KeyState::Up);
@@ -453,58 +1918,71 @@ void Stage::apply_input(const KeyEvent event, int device_index) {
          is_virtual_key(event.key) ||
          event.key == Key::timeout);
 
+  adopt_passed_keys();
+
+  if (event.key != Key::timeout) {
+    if (event.state == KeyState::Down)
+      m_keys_down.set(event.key);
+    else
+      m_keys_down.reset(event.key);
+  }
+
   // check if key triggers an output on release
   if (!continue_output_on_release(event))
     return;
 
   // suppress short timeout after not-timeout was exceeded
-  if (m_current_timeout && is_not_timeout(m_current_timeout->state)) {
+  if (Policy::timeouts && m_state.current_timeout &&
+      is_not_timeout(m_state.current_timeout->state)) {
     if (event.key == Key::timeout) {
-      if (m_current_timeout->value == event.value) {
-        m_current_timeout->not_exceeded = true;
+      if (m_state.current_timeout->value == event.value) {
+        m_state.current_timeout->not_exceeded = true;
       }
-      else if (m_current_timeout->not_exceeded) {
+      else if (m_state.current_timeout->not_exceeded) {
         return;
       }
     }
     else if (event.state == KeyState::Up &&
-             m_current_timeout->trigger == event.key) {
-      m_current_timeout->not_exceeded = false;
+             m_state.current_timeout->trigger == event.key) {
+      m_state.current_timeout->not_exceeded = false;
     }
   }
 
   if (event.state == KeyState::Down) {
     // merge key repeats
-    const auto it = rfind_key(m_sequence, event.key);
-    if (it != end(m_sequence) && it->state != KeyState::Up) {
+    const auto it = rfind_key(m_state.sequence, event.key);
+    if (it != end(m_state.sequence) && it->state != KeyState::Up) {
       // ignore key repeat while sequence might match
-      if (m_sequence_might_match)
+      if (m_state.sequence_might_match)
         return;
 
-      m_sequence.erase(it);
+      m_state.sequence.erase(it);
     }
   }
 
   // add to sequence
-  m_sequence.push_back(event);
+  m_state.sequence.push_back(event);
 
   // add to history
-  if (m_has_no_might_match_mapping && 
+  if (Policy::no_might_match &&
+      m_has_no_might_match_mapping &&
       !is_virtual_key(event.key) &&
       event.key != Key::timeout) {
-    const auto it = rfind_key(m_history, event.key);
+    const auto history = this->history();
+    const auto it = rfind_key(history, event.key);
     if (event.state == KeyState::Down) {
-      if (it == end(m_history) || it->state != KeyState::Down)
-        m_history.push_back(event);
+      if (it == end(history) || it->state != KeyState::Down)
+        m_state.history.push_back(event);
     }
     else {
-      if (it != end(m_history) && it->state == KeyState::Down)
-        m_history.push_back(event);
+      if (it != end(history) && it->state == KeyState::Down)
+        m_state.history.push_back(event);
     }
   }
 
   // update contexts with modifier filter
-  update_active_contexts();
+  if (Policy::modifier_filters)
+    update_active_contexts();
 
   if (event.state == KeyState::Up) {
     // release output when triggering input was released
@@ -512,22 +1990,22 @@ void Stage::apply_input(const KeyEvent event, int device_index) {
 
     // remove from sequence
     // except when it was already used for a might match
-    if (!m_sequence_might_match) {
-      const auto it = find_key(m_sequence, event.key);
-      assert(it != end(m_sequence));
+    if (!m_state.sequence_might_match) {
+      const auto it = find_key(m_state.sequence, event.key);
+      assert(it != end(m_state.sequence));
       if (it->state == KeyState::DownMatched)
-        m_sequence.erase(it);
+        m_state.sequence.erase(it);
     }
   }
 
-  for (auto& output : m_output_down)
+  for (auto& output : m_state.output_down)
     output.suppressed = false;
 
   const auto is_key_up_event = (event.state == KeyState::Up && event.key != Key::timeout);
-  while (has_non_optional(m_sequence)) {
+  while (has_non_optional(m_state.sequence)) {
     // find first mapping which matches or might match sequence
-    auto sequence = ConstKeySequenceRange(m_sequence);
-    auto [result, output, trigger, context_index] = match_input(
+    auto sequence = ConstKeySequenceRange(m_state.sequence);
+    auto [result, output, trigger, context_index] = match_input<Policy>(
       true, sequence, device_index, is_key_up_event);
 
     // virtual key events need to match directly or never
@@ -539,63 +2017,62 @@ void Stage::apply_input(const KeyEvent event, int device_index) {
 
     // hold back sequence when something might match
     if (result == MatchResult::might_match) {
-      m_sequence_might_match = true;
+      m_state.sequence_might_match = true;
+      ++m_state.might_match_count;
+      if (m_early_output && m_state.early_output_key == Key::none)
+        apply_early_output();
       break;
     }
 
     // when might match failed, look for exact match in sequence start
     auto matched_start_only = false;
     if (result == MatchResult::no_match &&
-        m_sequence_might_match) {
-
-      while (sequence.size() > 1) {
-        sequence.pop_back();
-        if (!has_unmatched_down(sequence))
-          break;
-
-        std::tie(result, output, trigger, context_index) = 
-          match_input(false, sequence, device_index, is_key_up_event);
-        if (result == MatchResult::match) {
-          matched_start_only = true;
-          break;
-        }
-      }
+        m_state.sequence_might_match) {
+      std::tie(result, output, trigger, context_index) =
+        match_sequence_start<Policy>(sequence, device_index, is_key_up_event);
+      matched_start_only = (result == MatchResult::match);
     }
 
     // when a timeout matched once, prevent following timeout
     // cancellation from matching another input
-    if (m_current_timeout && !is_not_timeout(m_current_timeout->state)) {
+    if (Policy::timeouts && m_state.current_timeout &&
+        !is_not_timeout(m_state.current_timeout->state)) {
       if (event.key == Key::timeout) {
         if (result == MatchResult::match) {
-          if (!m_current_timeout->matched_output) {
+          if (!m_state.current_timeout->matched_output) {
             if (!matched_start_only)
-              m_current_timeout->matched_output = output;
+              m_state.current_timeout->matched_output = output;
           }
-          else if (m_current_timeout->matched_output != output) {
+          else if (m_state.current_timeout->matched_output != output) {
             result = MatchResult::no_match;
           }
         }
       }
       else if (result == MatchResult::no_match) {
-        m_current_timeout->matched_output = nullptr;
+        m_state.current_timeout->matched_output = nullptr;
       }
     }
 
     // prevent match after not-timeout did not match once
-    if (m_current_timeout && is_not_timeout(m_current_timeout->state)) {
+    if (Policy::timeouts && m_state.current_timeout &&
+        is_not_timeout(m_state.current_timeout->state)) {
       if (result == MatchResult::no_match)
-        m_current_timeout->not_exceeded = true;
+        m_state.current_timeout->not_exceeded = true;
     }
 
     if (result == MatchResult::match) {
+      ++m_state.match_count;
+      TRACEPOINT(stage_matched, context_index, *event.key);
+
       // optimize trigger
-      if (get_trigger_key(trigger) == Key::any ||
-          event.key == Key::timeout)
+      if ((Policy::any_key && get_trigger_key(trigger) == Key::any) ||
+          (Policy::timeouts && event.key == Key::timeout))
         trigger = event;
 
       // for timeouts use last key press as trigger
-      if (get_trigger_key(trigger) == Key::timeout && m_current_timeout)
-        trigger = m_current_timeout->trigger;
+      if (Policy::timeouts && m_state.current_timeout &&
+          get_trigger_key(trigger) == Key::timeout)
+        trigger = m_state.current_timeout->trigger;
 
       // ensure that trigger is still down
       if (!is_physically_pressed(get_trigger_key(trigger))) {
@@ -603,8 +2080,8 @@ void Stage::apply_input(const KeyEvent event, int device_index) {
         // do not change trigger of hold back output
         // when trigger is also released (might need some more work)
         const auto keep_trivial_trigger = (output->size() == 1 && 
-            output->front() == get_trigger_event(trigger) &&
-            contains(m_sequence, KeyEvent(get_trigger_key(trigger), KeyState::Up)));
+            (*output)[0] == get_trigger_event(trigger) &&
+            contains(m_state.sequence, KeyEvent(get_trigger_key(trigger), KeyState::Up)));
 
         if (!keep_trivial_trigger)
           trigger = event;
@@ -622,125 +2099,218 @@ void Stage::apply_input(const KeyEvent event, int device_index) {
 
       // continue when only the start of the sequence matched
       if (!matched_start_only)
-        m_sequence_might_match = false;
+        m_state.sequence_might_match = false;
     }
     else {
       // when still no match was found, forward beginning of sequence
       forward_from_sequence();
 
-      if (m_sequence_might_match && !has_non_optional(m_sequence))
-        m_sequence_might_match = false;
+      if (m_state.sequence_might_match && !has_non_optional(m_state.sequence))
+        m_state.sequence_might_match = false;
     }
   }
 
   // update contexts with modifier filter
-  update_active_contexts();
+  if (Policy::modifier_filters)
+    update_active_contexts();
 
-  if (m_sequence.empty())
-    m_current_timeout.reset();
+  if (Policy::timeouts && m_state.sequence.empty())
+    m_state.current_timeout.reset();
 
   m_temporary_reapplied = false;
 
-  clean_up_history();
+  if (Policy::no_might_match)
+    clean_up_history();
+}
+
+void Stage::apply_early_output() {
+  // only the press of a single held back key is output early
+  if (m_state.sequence.size() != 1 ||
+      m_state.sequence.front().state != KeyState::Down)
+    return;
+  const auto key = m_state.sequence.front().key;
+  if (!is_device_key(key) ||
+      m_output_keys_down.test(key) ||
+      m_forward_modifier_keys.test(key))
+    return;
+
+  // each active context either does not map the key or outputs its press,
+  // like it is forwarded when nothing matches
+  const auto conflicts = [&](int context_index) {
+    const auto& keys = m_early_output_conflicts[context_index];
+    return (std::binary_search(keys.begin(), keys.end(), key) ||
+            std::binary_search(keys.begin(), keys.end(), Key::any));
+  };
+  if (std::any_of(m_active_client_contexts.begin(),
+        m_active_client_contexts.end(), conflicts) ||
+      std::any_of(m_active_contexts.begin(), m_active_contexts.end(),
+        conflicts))
+    return;
+
+  m_output_buffer.emplace_back(key, KeyState::Down);
+  m_state.early_output_key = key;
+}
+
+void Stage::finish_early_output(size_t output_begin) {
+  const auto key = m_state.early_output_key;
+  const auto& sequence = m_state.sequence;
+  if (m_state.sequence_might_match && !sequence.empty() &&
+      sequence.front().key == key &&
+      sequence.front().state == KeyState::Down)
+    return;
+
+  // the resolved output starts with the press, which was already output
+  m_state.early_output_key = Key::none;
+  const auto begin = m_output_buffer.begin() + output_begin;
+  const auto it = std::find_if(begin, m_output_buffer.end(),
+    [&](const KeyEvent& event) {
+      return (event.key == key && event.state == KeyState::Down);
+    });
+  if (it != m_output_buffer.end())
+    m_output_buffer.erase(it);
+  else
+    m_output_buffer.insert(begin, KeyEvent(key, KeyState::Up));
 }
 
 bool Stage::continue_output_on_release(const KeyEvent& event, int context_index) {
-  const auto it = std::find_if(begin(m_output_on_release), end(m_output_on_release),
+  if (!m_output_on_release_triggers.test(event.key))
+    return true;
+
+  const auto it = std::find_if(begin(m_state.output_on_release), end(m_state.output_on_release),
     [&](const OutputOnRelease& o) {
       return (o.trigger == event.key &&
               (o.trigger != Key::ContextActive || o.context_index == context_index));
     });
-  if (it != m_output_on_release.end()) {
+  if (it != m_state.output_on_release.end()) {
     // ignore key repeat
     if (event.state == KeyState::Down)
       return false;
 
     // trigger released - output rest of sequence
     apply_output(it->sequence, event, it->context_index);
-    m_output_on_release.erase(it);
+    m_state.output_on_release.erase(it);
+
+    if (std::none_of(begin(m_state.output_on_release), end(m_state.output_on_release),
+          [&](const OutputOnRelease& o) { return o.trigger == event.key; }))
+      m_output_on_release_triggers.reset(event.key);
   }
   return true;
 }
 
 void Stage::release_triggered(Key key, int context_index) {
-  // sort output to release to the right
-  const auto it = std::stable_partition(begin(m_output_down), end(m_output_down),
-    [&](const OutputDown& k) { 
-      if (get_trigger_key(k.trigger) == key) {
-        if (key == Key::ContextActive)
-          return (k.context_index != context_index);
-        return false;
-      }
+  if (m_output_down_triggers.test(key))
+    release_output_down(key, context_index);
+
+  // also reset current timeout
+  if (m_state.current_timeout && m_state.current_timeout->trigger == key)
+    m_state.current_timeout.reset();
+}
+
+void Stage::release_output_down(Key key, int context_index) {
+  // sort output to release to the right (stable, without allocating)
+  const auto released = [&](const OutputDown& k) { 
+    if (get_trigger_key(k.trigger) == key) {
+      if (key == Key::ContextActive)
+        return (k.context_index == context_index);
       return true;
-    });
+    }
+    return false;
+  };
+  m_release_buffer.clear();
+  std::copy_if(begin(m_state.output_down), end(m_state.output_down),
+    std::back_inserter(m_release_buffer), released);
+  const auto it = std::remove_if(begin(m_state.output_down), end(m_state.output_down), released);
+  std::copy(begin(m_release_buffer), end(m_release_buffer), it);
   std::for_each(
-    std::make_reverse_iterator(end(m_output_down)),
+    std::make_reverse_iterator(end(m_state.output_down)),
     std::make_reverse_iterator(it),
     [&](const OutputDown& k) {
       if (!k.temporarily_released)
         m_output_buffer.push_back({ k.key, KeyState::Up });
+      m_output_keys_down.reset(k.key);
     });
-  m_output_down.erase(it, end(m_output_down));
+  m_state.output_down.erase(it, end(m_state.output_down));
 
-  // also reset current timeout
-  if (m_current_timeout && m_current_timeout->trigger == key)
-    m_current_timeout.reset();
+  // ContextActive can still be the trigger in other contexts
+  if (key != Key::ContextActive)
+    m_output_down_triggers.reset(key);
 }
 
 void Stage::apply_output(ConstKeySequenceRange sequence,
     const Trigger& trigger, int context_index) {
-  for (auto it = begin(sequence); it != end(sequence); ++it) {
-    const auto& event = *it;
-    if (event.key == Key::any) {
-      if (event.state == KeyState::Not) {
-        // release all keys
-        for (const auto& output : m_output_down)
-          update_output({ output.key, KeyState::Not }, trigger, context_index);
-      }
-      else {
+  // outputs are ranges of the event arena, which has an op per event
+  const auto offset = static_cast<size_t>(sequence.begin() - m_events.data());
+  const auto ops = m_output_ops.data() + offset;
+  for (auto i = size_t{ }; i < sequence.size(); ++i) {
+    const auto& event = sequence[i];
+    switch (ops[i]) {
+      case OutputOp::press:
+        press_output(event, trigger, context_index);
+        break;
+
+      case OutputOp::release:
+        release_output(event, trigger);
+        break;
+
+      case OutputOp::ensure_released:
+        ensure_output_released(event.key);
+        break;
+
+      case OutputOp::toggle_virtual:
+        // !Virtual inserts a Virtual down to toggle when not already pressed
+        if (find_key(m_state.sequence, event.key) != m_state.sequence.end())
+          press_output({ event.key, KeyState::Down }, trigger, context_index);
+        break;
+
+      case OutputOp::release_all:
+        for (const auto& output : m_state.output_down)
+          if (!is_virtual_key(output.key) && !is_action_key(output.key))
+            ensure_output_released(output.key);
+        break;
+
+      case OutputOp::output_any_matches:
         // output keys matched by Any in input
         for (auto key : m_any_key_matches)
           update_output({ key, event.state }, trigger, context_index);
-      }
-    }
-    else if (event.state == KeyState::OutputOnRelease) {
-      // do not split output when input matched when trigger was released
-      const auto trigger_event = get_trigger_event(trigger);
-      if (trigger_event.state == KeyState::Down) {
-        // send rest of sequence when trigger is released
-        const auto rest = ConstKeySequenceRange(std::next(it), sequence.end());
-        m_output_on_release.push_back({ trigger_event.key, rest, context_index });
+        break;
+
+      case OutputOp::defer_on_release: {
+        // do not split output when input matched when trigger was released
+        const auto trigger_event = get_trigger_event(trigger);
+        if (trigger_event.state == KeyState::Down) {
+          // send rest of sequence when trigger is released
+          const auto rest = ConstKeySequenceRange(
+            sequence.begin() + i + 1, sequence.end());
+          m_state.output_on_release.push_back({ trigger_event.key, rest, context_index });
+          m_output_on_release_triggers.set(trigger_event.key);
+          return;
+        }
         break;
       }
-    }
-    else if (event.state == KeyState::Not && is_virtual_key(event.key)) {
-      // !Virtual inserts a Virtual down to toggle when not already pressed
-      if (find_key(m_sequence, event.key) != m_sequence.end())
-        update_output({ event.key, KeyState::Down }, trigger, context_index);
-    }
-    else{
-      update_output(event, trigger, context_index);
+
+      case OutputOp::none:
+        break;
     }
   }
 }
 
 void Stage::forward_from_sequence() {
   // TODO: this function likely needs a refactoring
-  for (auto it = begin(m_sequence); it != end(m_sequence); ++it) {
+  for (auto it = begin(m_state.sequence); it != end(m_state.sequence); ++it) {
     auto& event = *it;
     if (event.state == KeyState::Down || event.state == KeyState::DownMatched) {
-      const auto up = std::find(it, end(m_sequence),
+      const auto up = std::find(it, end(m_state.sequence),
         KeyEvent{ event.key, KeyState::Up });
-      if (up != end(m_sequence)) {
+      if (up != end(m_state.sequence)) {
         // erase Down when Up is following
         update_output(event, event.key);
-        m_sequence.erase(it);
+        m_state.sequence.erase(it);
         return;
       }
       else if (event.state == KeyState::Down) {
         // no Up yet, convert to DownMatched
         // suppress forwarding when a timeout already matched
-        if (!m_current_timeout || !m_current_timeout->matched_output)
+        if (!m_state.current_timeout || !m_state.current_timeout->matched_output)
           update_output(event, event.key);
         event.state = KeyState::DownMatched;
         return;
@@ -749,103 +2319,33 @@ void Stage::forward_from_sequence() {
     else if (event.state == KeyState::Up) {
       // remove remaining Up
       release_triggered(event.key);
-      m_sequence.erase(it);
+      m_state.sequence.erase(it);
       return;
     }
   }
 }
 
-void Stage::update_output(const KeyEvent& event, const Trigger& trigger, int context_index) {
-  const auto it = std::find_if(begin(m_output_down), end(m_output_down),
-    [&](const OutputDown& down_key) { return down_key.key == event.key; });
+auto Stage::find_output_down(Key key) -> std::vector<OutputDown>::iterator {
+  if (!m_output_keys_down.test(key))
+    return end(m_state.output_down);
+  return std::find_if(begin(m_state.output_down), end(m_state.output_down),
+    [&](const OutputDown& down_key) { return down_key.key == key; });
+}
 
+void Stage::update_output(const KeyEvent& event, const Trigger& trigger, int context_index) {
   switch (event.state) {
-    case KeyState::Up: {
-      if (it != end(m_output_down)) {
-        if (it->pressed_twice && is_virtual_key(event.key)) {
-          // allow to toggle virtual key which is still hold by ContextActive
-          it->pressed_twice = false;
-
-          m_output_buffer.push_back(event);
-        }
-        else if (it->pressed_twice && !it->suppressed) {
-          // try to remove current down
-          auto it2 = rfind_key(m_output_buffer, event.key);
-          if (it2 != m_output_buffer.end())
-            m_output_buffer.erase(it2);
-
-          it->pressed_twice = false;
-        }
-        else {
-          // only releasing trigger can permanently release
-          if (get_trigger_key(it->trigger) == get_trigger_key(trigger))
-            m_output_down.erase(it);
-          else
-            it->temporarily_released = true;
-
-          m_output_buffer.push_back(event);
-        }
-      }
+    case KeyState::Up:
+      release_output(event, trigger);
       break;
-    }
 
-    case KeyState::Not: {
-      // make sure it is released in output
-      if (it != end(m_output_down) && 
-          !is_virtual_key(event.key) &&
-          !is_action_key(event.key)) {
-        if (!it->temporarily_released) {
-          m_output_buffer.emplace_back(event.key, KeyState::Up);
-          it->temporarily_released = true;
-        }
-        it->suppressed = true;
-      }
+    case KeyState::Not:
+      if (!is_virtual_key(event.key) && !is_action_key(event.key))
+        ensure_output_released(event.key);
       break;
-    }
-
-    case KeyState::Down: {
-      // reapply temporarily released
-      for (auto& output : m_output_down)
-        if (output.temporarily_released && !output.suppressed) {
-          output.temporarily_released = false;
-          m_output_buffer.emplace_back(output.key, KeyState::Down);
-          m_temporary_reapplied = true;
 
-          if (output.key == event.key)
-            return;
-        }
-        else if (output.temporarily_released &&
-                 output.key == event.key) {
-          // when it is a common modifier and 
-          // was the last output, simply undo releasing
-          if (is_common_modifier(event.key) &&
-              !m_output_buffer.empty() && 
-              m_output_buffer.back() == KeyEvent(event.key, KeyState::Up)) {
-            m_output_buffer.pop_back();
-            output.temporarily_released = false;
-            return;
-          }
-        }
-
-      if (it == end(m_output_down)) {
-        if (event.key != Key::timeout)
-          m_output_down.push_back({ event.key, trigger, 
-            false, false, false, context_index });
-      }
-      else {
-        // already pressed before
-        it->temporarily_released = false;
-        it->pressed_twice = true;
-
-        // up/down when something was reapplied in the meantime
-        if (m_temporary_reapplied) {
-          m_output_buffer.emplace_back(event.key, KeyState::Up);
-          it->pressed_twice = false;
-        }
-      }
-      m_output_buffer.push_back(event);
+    case KeyState::Down:
+      press_output(event, trigger, context_index);
       break;
-    }
 
     case KeyState::DownMatched:
       // ignored
@@ -861,21 +2361,112 @@ void Stage::update_output(const KeyEvent& event, const Trigger& trigger, int con
   }
 }
 
+void Stage::release_output(const KeyEvent& event, const Trigger& trigger) {
+  const auto it = find_output_down(event.key);
+  if (it == end(m_state.output_down))
+    return;
+
+  if (it->pressed_twice && is_virtual_key(event.key)) {
+    // allow to toggle virtual key which is still hold by ContextActive
+    it->pressed_twice = false;
+
+    m_output_buffer.push_back(event);
+  }
+  else if (it->pressed_twice && !it->suppressed) {
+    // try to remove current down
+    auto it2 = rfind_key(m_output_buffer, event.key);
+    if (it2 != m_output_buffer.end())
+      m_output_buffer.erase(it2);
+
+    it->pressed_twice = false;
+  }
+  else {
+    // only releasing trigger can permanently release
+    if (get_trigger_key(it->trigger) == get_trigger_key(trigger)) {
+      m_output_keys_down.reset(it->key);
+      m_state.output_down.erase(it);
+    }
+    else
+      it->temporarily_released = true;
+
+    m_output_buffer.push_back(event);
+  }
+}
+
+void Stage::ensure_output_released(Key key) {
+  // make sure it is released in output
+  const auto it = find_output_down(key);
+  if (it != end(m_state.output_down)) {
+    if (!it->temporarily_released) {
+      m_output_buffer.emplace_back(key, KeyState::Up);
+      it->temporarily_released = true;
+    }
+    it->suppressed = true;
+  }
+}
+
+void Stage::press_output(const KeyEvent& event, const Trigger& trigger, int context_index) {
+  // reapply temporarily released
+  for (auto& output : m_state.output_down)
+    if (output.temporarily_released && !output.suppressed) {
+      output.temporarily_released = false;
+      m_output_buffer.emplace_back(output.key, KeyState::Down);
+      m_temporary_reapplied = true;
+
+      if (output.key == event.key)
+        return;
+    }
+    else if (output.temporarily_released &&
+             output.key == event.key) {
+      // when it is a common modifier and 
+      // was the last output, simply undo releasing
+      if (is_common_modifier(event.key) &&
+          !m_output_buffer.empty() && 
+          m_output_buffer.back() == KeyEvent(event.key, KeyState::Up)) {
+        m_output_buffer.pop_back();
+        output.temporarily_released = false;
+        return;
+      }
+    }
+
+  const auto it = find_output_down(event.key);
+  if (it == end(m_state.output_down)) {
+    if (event.key != Key::timeout) {
+      m_state.output_down.push_back({ event.key, trigger, 
+        false, false, false, context_index });
+      m_output_keys_down.set(event.key);
+      m_output_down_triggers.set(get_trigger_key(trigger));
+    }
+  }
+  else {
+    // already pressed before
+    it->temporarily_released = false;
+    it->pressed_twice = true;
+
+    // up/down when something was reapplied in the meantime
+    if (m_temporary_reapplied) {
+      m_output_buffer.emplace_back(event.key, KeyState::Up);
+      it->pressed_twice = false;
+    }
+  }
+  m_output_buffer.push_back(event);
+}
+
 void Stage::finish_sequence(ConstKeySequenceRange sequence) {
   // erase Down and DownMatchen when an Up follows, convert to DownMatched otherwise
-  assert(sequence.begin() == m_sequence.begin());
-  assert(sequence.size() <= m_sequence.size());
+  assert(sequence.begin() == m_state.sequence.begin());
+  assert(sequence.size() <= m_state.sequence.size());
   auto length = sequence.size();
   for (auto i = size_t{ }; i < length; ) {
-    const auto it = begin(m_sequence) + i;
+    const auto it = begin(m_state.sequence) + i;
     if (it->state == KeyState::Down || it->state == KeyState::DownMatched) {
-      if (!contains(it, end(m_sequence), KeyEvent{ it->key, KeyState::Up })) {
+      if (!contains(it, end(m_state.sequence), KeyEvent{ it->key, KeyState::Up })) {
         it->state = KeyState::DownMatched;
         ++i;
         continue;
       }
     }
-    m_sequence.erase(it);
+    m_state.sequence.erase(it);
     --length;
   }
 }
@@ -885,28 +2476,51 @@ void Stage::clean_up_history() {
   // prevent all no-might-match mappings from matching
   auto input_timeout_event = KeyEvent{ };
   auto any_key_matches = std::vector<Key>{ };
-  while (!m_history.empty()) {
-    const auto event = m_history.front();
+  while (!history().empty()) {
+    const auto event = history()[0];
     assert(event.state == KeyState::Down);
 
     // do not remove Down without Up
     const auto up_event = KeyEvent{ event.key, KeyState::Up, event.value };
-    if (!contains(m_history, up_event))
+    if (!contains(history(), up_event))
       return;
 
-    for (auto context_index : m_active_contexts)
-      for (const auto& context_input : m_contexts[context_index].inputs)
-        if (is_no_might_match_mapping(context_input.input)) {
+    for (auto context_index : m_active_contexts) {
+      const auto& inputs = m_contexts[context_index].inputs;
+      for (auto input_index = 0; input_index < static_cast<int>(inputs.size());
+           ++input_index) {
+        if (!is_no_might_match_mapping(inputs[input_index].input))
+          continue;
+
+        // each variant of an input with logical keys is checked
+        const auto variants = get_input_variants(context_index, input_index);
+        const auto variant_count = std::max(variants.size(), size_t{ 1 });
+        for (auto v = size_t{ }; v < variant_count; ++v) {
           // pass without NoMightMatch, so it does not skip events at the front
-          const auto& input = without_first(context_input.input);
-          if (m_match(input, m_history, &any_key_matches, 
+          const auto input = without_first(variants.empty() ?
+            m_input_ranges[context_index][input_index] : variants[v].input);
+          if (m_match(input, history(), &any_key_matches, 
                 &input_timeout_event) == MatchResult::might_match)
             return;
         }
+      }
+    }
 
-    m_history.erase(m_history.begin());
+    // removing from the front only advances the beginning
+    ++m_state.history_begin;
 
     // also remove Up
-    m_history.erase(std::find(m_history.begin(), m_history.end(), up_event));
+    m_state.history.erase(std::find(m_state.history.begin() + m_state.history_begin,
+      m_state.history.end(), up_event));
+
+    // drop removed events once they outnumber the remaining
+    if (m_state.history_begin * 2 >= m_state.history.size()) {
+      m_state.history.erase(m_state.history.begin(), m_state.history.begin() + m_state.history_begin);
+      m_state.history_begin = 0;
+    }
   }
 }
+
+ConstKeySequenceRange Stage::history() const {
+  return { m_state.history.begin() + m_state.history_begin, m_state.history.end() };
+}
@@ -1,18 +1,42 @@
 #pragma once
 
 #include "MatchKeySequence.h"
+#include "LogicalKeys.h"
+#include "KeyBitmap.h"
+#include "MemoryUsage.h"
 #include "common/DeviceDesc.h"
 #include "common/Filter.h"
+#include "common/InputProfile.h"
 #include <functional>
-#include <variant>
+#include <string_view>
+#include <unordered_map>
 
-using Trigger = std::variant<const KeySequence*, KeyEvent, Key>;
+// the event which triggered an output, precomputed for inputs
+struct Trigger {
+  Trigger() = default;
+  Trigger(const KeyEvent& event) : event(event) { }
+  Trigger(Key key) : event(key, KeyState::Down) { }
+  KeyEvent event;
+};
 
 class Stage {
 public:
   static const int no_device_index = -1;
   static const int any_device_index = -2;
-  static const uint64_t all_device_bits = ~uint64_t{ };
+  // in larger configurations, the matching structures of the least recently
+  // active contexts are released, until they become active again
+  static constexpr size_t max_materialized_contexts = 64;
+
+  // how the inputs of the active contexts are looked up and matched
+  enum class MatchEngine : uint8_t {
+    // each input is interpreted
+    interpreted,
+    // inputs are looked up by their leading key and interpreted
+    indexed,
+    // inputs are looked up by their leading key and matched by automatons,
+    // which resume where the previous match stopped
+    compiled,
+  };
 
   struct Input {
     KeySequence input;
@@ -25,6 +49,15 @@ public:
     int index{ };
   };
 
+  // maximum sizes of the configuration, the buffers are reserved for
+  struct Capacity {
+    size_t max_input_length;
+    size_t max_output_length;
+    // keys an output can hold down
+    size_t max_output_keys_down;
+    size_t max_context_inputs;
+  };
+
   struct Context {
     std::vector<Input> inputs;
     std::vector<KeySequence> outputs;
@@ -32,78 +65,273 @@ public:
     Filter device_filter;
     Filter device_id_filter;
     KeySequence modifier_filter;
-    uint64_t matching_device_bits = all_device_bits;
+    // evaluated for contexts with device filter, indexed by device
+    std::vector<bool> matching_devices;
+    bool has_matching_device{ };
     bool invert_modifier_filter{ };
     bool fallthrough{ };
   };
 
-  explicit Stage(std::vector<Context> contexts = { });
+  explicit Stage(std::vector<Context> contexts = { },
+    LogicalKeys logical_keys = { },
+    std::vector<Key> forward_modifiers = { });
 
   const std::vector<Context>& contexts() const { return m_contexts; }
+  const LogicalKeys& logical_keys() const { return m_logical_keys; }
+  const std::vector<Key>& forward_modifiers() const { return m_forward_modifiers; }
+  const Capacity& capacity() const { return m_capacity; }
+  // bytes reserved for the buffers used while matching
+  size_t buffer_footprint() const;
+  // regexes shared with other stages are only counted once
+  MemoryUsage memory_usage(std::vector<const void*>* counted_regexes = nullptr) const;
   const std::vector<int>& active_client_contexts() const { return m_active_client_contexts; }
   bool has_mouse_mappings() const { return m_has_mouse_mappings; }
   bool has_device_filters() const { return m_has_device_filter; }
+  // uses none of timeouts, Any, no-might-match mappings, device and
+  // modifier filters, so a reduced hot path is used
+  bool has_minimal_policy() const { return m_minimal_policy; }
+  // chosen from the size and the features of the configuration,
+  // unless it was overridden
+  MatchEngine match_engine() const { return m_match_engine; }
+  void set_match_engine(std::optional<MatchEngine> engine);
+  // number of times a mapping matched or might match, for statistics
+  uint64_t match_count() const { return m_state.match_count; }
+  uint64_t might_match_count() const { return m_state.might_match_count; }
+  // contexts whose matching structures are built
+  size_t materialized_context_count() const;
+  // counts and times each match of an input, which slows matching down
+  void set_profiling(bool enabled);
+  const InputProfiles& input_profiles() const { return m_input_profiles; }
+  // interprets every input of the active contexts on each event, without
+  // the index, signatures, compiled inputs or cached results. For checking
+  // that the optimized matching produces the same output.
+  void set_reference_matching(bool enabled);
+  // while a held back key might match, outputs its press immediately, when
+  // every mapping it can complete and forwarding it start with the press
+  void set_early_output(bool enabled);
 
   bool is_clear() const;
-  size_t history_size() const { return m_history.size(); }
-  const KeySequence& sequence() const { return m_sequence; }
+  size_t history_size() const { return history().size(); }
+  const KeySequence& sequence() const { return m_state.sequence; }
   std::vector<Key> get_output_keys_down() const;
-  void evaluate_device_filters(const std::vector<DeviceDesc>& device_descs);
+  std::vector<Key> get_input_keys_down() const;
+  // returns whether a context's has_matching_device changed
+  bool evaluate_device_filters(const std::vector<DeviceDesc>& device_descs);
   KeySequence set_active_client_contexts(const std::vector<int>& indices);
   KeySequence update(KeyEvent event, int device_index);
+  // appends the output to a caller-owned sequence
+  void update(KeyEvent event, int device_index, KeySequence& output);
+  // applies the events of one input frame, with the same output
+  // as updating each of them
+  void update(ConstKeySequenceRange events, int device_index,
+    KeySequence& output);
+  // forwards event of a key no active mapping refers to without matching,
+  // returns false when it needs to be updated
+  bool can_pass_through(const KeyEvent& event) const;
+  bool pass_through(const KeyEvent& event);
+  bool is_holding_back() const;
+  // whether a timeout event can match, cancel or flush something
+  bool is_waiting_for_timeout() const;
+  // adds the keys any context refers to,
+  // returns false when it might match any key
+  bool get_referenced_keys(KeyBitmap& keys) const;
   void reuse_buffer(KeySequence&& buffer);
   void validate_state(const std::function<bool(Key)>& is_down);
   bool should_exit() const;
 
 private:
-  using MatchInputResult = std::tuple<MatchResult, const KeySequence*, Trigger, int>;
+  using MatchInputResult = std::tuple<MatchResult, const ConstKeySequenceRange*, Trigger, int>;
+
+  // features the hot path is instantiated for
+  struct GeneralPolicy;
+  struct MinimalPolicy;
 
+  // inputs of a context bucketed by the key of their leading Down
+  struct InputIndex {
+    std::vector<std::pair<Key, int>> keyed;
+    // Any, timeout, no-might-match and other inputs
+    std::vector<int> generic;
+  };
+
+  // an input containing logical keys is matched like a mapping for each
+  // combination of their keys, which binds each logical key to one key
+  struct InputVariant {
+    ConstKeySequenceRange input;
+    Trigger trigger;
+    // in m_variant_output_ranges, -1 when the input's output is output
+    int output_index;
+  };
+  using InputVariants = Range<const InputVariant*>;
+
+  void reserve_buffers();
+  void build_fallthrough_contexts();
+  void build_device_filter_groups();
+  std::vector<bool> match_device_filters(const DeviceDesc& device_desc) const;
+  void materialize_context(int context_index);
+  void release_context(int context_index);
+  void materialize_active_contexts();
+  void build_input_index(int context_index);
+  void build_input_signatures(int context_index);
+  void build_input_triggers();
+  void build_event_arena();
+  void build_output_ops();
+  void build_output_tables();
+  void build_modifier_filter_masks();
+  void build_early_output_conflicts();
+  void update_mapped_keys();
+  void adopt_passed_keys();
+  void compile_inputs(int context_index);
+  InputVariants get_input_variants(int context_index, int input_index) const;
+  void update_match_cursors(ConstKeySequenceRange sequence);
+  CompiledKeySequence::Cursor* get_match_cursor(int context_index, int input_index);
+  void update_leading_keys(ConstKeySequenceRange sequence);
+  const std::vector<int>& get_candidate_inputs(int context_index);
   void advance_exit_sequence(const KeyEvent& event);
-  const KeySequence* find_output(const Context& context, int output_index) const;
+  const ConstKeySequenceRange* find_output(int context_index, int input_index,
+    const InputVariant* variant = nullptr) const;
+  const ConstKeySequenceRange* match_forward_modifier(
+    ConstKeySequenceRange sequence) const;
   bool device_matches_filter(const Context& context, int device_index) const;
+  void update_device_active_contexts();
+  const std::vector<int>& get_device_active_contexts(int device_index) const;
+  template<typename Policy>
   MatchInputResult match_input(bool first_iteration, 
     ConstKeySequenceRange sequence, int device_index, 
     bool is_key_up_event);
+  template<typename Policy>
+  MatchInputResult match_sequence_start(ConstKeySequenceRange& sequence,
+    int device_index, bool is_key_up_event);
   bool is_physically_pressed(Key key) const;
+  bool uses_minimal_policy(const KeyEvent& event) const;
+  void update_input(const KeyEvent& event, int device_index);
+  template<typename Policy>
+  void update_input(const KeyEvent& event, int device_index,
+    bool may_repeat);
+  bool replay_key_repeat(const KeyEvent& event, int device_index);
+  bool can_cache_key_repeat(const KeyEvent& event) const;
+  template<typename Policy>
   void apply_input(KeyEvent event, int device_index);
   void release_triggered(Key key, int context_index = -1);
+  void release_output_down(Key key, int context_index);
   void forward_from_sequence();
   void apply_output(ConstKeySequenceRange sequence,
     const Trigger& trigger, int context_index);
   void update_output(const KeyEvent& event, const Trigger& trigger, int context_index = -1);
+  void press_output(const KeyEvent& event, const Trigger& trigger, int context_index);
+  void release_output(const KeyEvent& event, const Trigger& trigger);
+  void ensure_output_released(Key key);
   void finish_sequence(ConstKeySequenceRange sequence);
+  bool is_modifier_pressed(Key key) const;
   bool match_context_modifier_filter(const KeySequence& modifiers);
+  uint64_t get_modifier_filter_keys_pressed() const;
   void update_active_contexts();
   bool continue_output_on_release(const KeyEvent& event, int context_index = -1);
   void cancel_inactive_output_on_release();
+  void apply_early_output();
+  void finish_early_output(size_t output_begin);
   int fallthrough_context(int context_index) const;
   bool is_context_active(int context_index) const;
   void on_context_active_event(const KeyEvent& event, int context_index);
   void clean_up_history();
+  ConstKeySequenceRange history() const;
 
   std::vector<Context> m_contexts;
+  LogicalKeys m_logical_keys;
+  // keys which are forwarded when pressed before any mapping is matched,
+  // with their output in the event arena
+  std::vector<Key> m_forward_modifiers;
+  KeyBitmap m_forward_modifier_keys;
+  std::vector<ConstKeySequenceRange> m_forward_modifier_outputs;
+  Capacity m_capacity{ };
+  std::vector<InputIndex> m_input_indices;
+  std::vector<std::vector<std::optional<CompiledKeySequence>>> m_compiled_inputs;
+  std::vector<std::vector<Trigger>> m_input_triggers;
+  // bit per key (modulo 64) of the events of each input
+  std::vector<std::vector<uint64_t>> m_input_signatures;
+  // events of all inputs and outputs, contiguous per context
+  std::vector<KeyEvent> m_events;
+  std::vector<std::vector<ConstKeySequenceRange>> m_input_ranges;
+  std::vector<std::vector<ConstKeySequenceRange>> m_output_ranges;
+  std::vector<std::vector<ConstKeySequenceRange>> m_command_output_ranges;
+  // variants of the inputs with logical keys, contiguous per input, and
+  // the offset of each input's first one, empty without logical keys
+  std::vector<std::vector<InputVariant>> m_input_variants;
+  std::vector<std::vector<uint32_t>> m_input_variant_offsets;
+  // direct outputs of variants, which output other keys than the input's
+  std::vector<std::vector<ConstKeySequenceRange>> m_variant_output_ranges;
+  // how apply_output applies each event of the outputs in m_events
+  enum class OutputOp : uint8_t {
+    none,
+    press,
+    release,
+    ensure_released,
+    toggle_virtual,
+    release_all,
+    output_any_matches,
+    defer_on_release,
+  };
+  std::vector<OutputOp> m_output_ops;
+  // direct output of each input, null for command outputs
+  std::vector<std::vector<const ConstKeySequenceRange*>> m_input_outputs;
+  // command outputs of each context, indexed by -output_index - 1
+  std::vector<std::vector<const ConstKeySequenceRange*>> m_command_output_tables;
+  // keys of all modifier filters, bit per key in masks of each context,
+  // empty when there are more than 64 keys
+  struct ModifierFilterMask {
+    uint64_t pressed;
+    uint64_t not_pressed;
+  };
+  std::vector<Key> m_modifier_filter_keys;
+  std::vector<ModifierFilterMask> m_modifier_filter_masks;
+  // keys whose mappings do not all output their press first, sorted
+  // for each context, Key::any when it does not hold for any key
+  std::vector<std::vector<Key>> m_early_output_conflicts;
+  bool m_early_output{ };
+  // modifier filter keys pressed when active contexts were updated
+  std::optional<uint64_t> m_active_contexts_modifiers;
+
+  // per input state of matching m_sequence, valid while it is only appended to
+  struct MatchCursor : CompiledKeySequence::Cursor {
+    uint32_t generation;
+  };
+  std::vector<std::vector<MatchCursor>> m_match_cursors;
+  // whether the input index, signatures, compiled inputs and cursors of a
+  // context are built, and the order they were last active in
+  std::vector<bool> m_context_materialized;
+  std::vector<int> m_materialized_contexts;
+  uint32_t m_match_cursor_generation{ };
+  KeySequence m_match_cursor_sequence;
   bool m_has_mouse_mappings{ };
   bool m_has_device_filter{ };
+  // first context with the same device filters, indexed by context
+  std::vector<int> m_device_filter_groups;
+  // filter results of each device descriptor seen, indexed by context
+  std::unordered_map<std::string, std::vector<bool>> m_device_filter_results;
   bool m_has_no_might_match_mapping{ };
+  bool m_minimal_policy{ };
+  MatchEngine m_default_match_engine{ };
+  MatchEngine m_match_engine{ };
+  // keys referred to by the active contexts or any modifier filter
+  KeyBitmap m_mapped_keys;
+  bool m_maps_any_key{ };
   std::vector<int> m_active_client_contexts;
+  // context which a fallthrough context's mappings are added to
+  std::vector<int> m_fallthrough_contexts;
   std::vector<int> m_active_contexts;
+  // the active contexts each device can match, indexed by device,
+  // followed by those of devices without matching filters
+  std::vector<std::vector<int>> m_device_active_contexts;
+  // whether a context is in m_active_contexts, indexed by context
+  std::vector<bool> m_context_active;
   std::vector<int> m_prev_active_contexts;
   MatchKeySequence m_match;
-  size_t m_exit_sequence_position{ };
-
-  // the input since the last match (or already matched but still hold)
-  KeySequence m_sequence;
-  bool m_sequence_might_match{ };
-
-  // the input which might still match a no-might-match mapping
-  KeySequence m_history;
+  bool m_reference_matching{ };
 
   struct OutputOnRelease {
     Key trigger;
     ConstKeySequenceRange sequence;
     int context_index;
   };
-  std::vector<OutputOnRelease> m_output_on_release;
 
   // the keys which were output and are still down
   struct OutputDown {
@@ -113,18 +341,78 @@ private:
     bool temporarily_released; // by KeyState::Not event
     bool pressed_twice;
     int context_index;
+
+    bool operator==(const OutputDown& b) const {
+      return (key == b.key && trigger.event == b.trigger.event &&
+        suppressed == b.suppressed && 
+        temporarily_released == b.temporarily_released &&
+        pressed_twice == b.pressed_twice &&
+        context_index == b.context_index);
+    }
   };
-  std::vector<OutputDown> m_output_down;
+  // finds an output key, checks m_output_keys_down first
+  std::vector<OutputDown>::iterator find_output_down(Key key);
 
   struct CurrentTimeout : KeyEvent {
     Key trigger;
-    const KeySequence* matched_output;
+    const ConstKeySequenceRange* matched_output;
     bool not_exceeded;
   };
-  std::optional<CurrentTimeout> m_current_timeout;
+
+  // output of last key repeat, which did not change the state
+  struct KeyRepeat {
+    KeyEvent event;
+    int device_index;
+  };
+
+  // the state updated on each event, apart from the configuration above,
+  // starting at a cache line and ordered by how often it is accessed
+  struct alignas(64) State {
+    // the input since the last match (or already matched but still hold)
+    KeySequence sequence;
+    // the keys which were output and are still down
+    std::vector<OutputDown> output_down;
+    std::optional<CurrentTimeout> current_timeout;
+    std::optional<KeyRepeat> key_repeat;
+    bool sequence_might_match{ };
+    // press output before the held back sequence was resolved
+    Key early_output_key{ };
+    uint64_t match_count{ };
+    uint64_t might_match_count{ };
+    size_t exit_sequence_position{ };
+    // keys passed through since the last update, not yet in sequence
+    std::vector<Key> passed_keys;
+    // the input which might still match a no-might-match mapping
+    // events before history_begin were already removed
+    KeySequence history;
+    size_t history_begin{ };
+    std::vector<OutputOnRelease> output_on_release;
+    KeySequence key_repeat_output;
+  };
+  // fails when the state outgrows its cache lines
+  static_assert(sizeof(State) <= 5 * 64);
+  State m_state;
+  // the input keys which are currently pressed
+  KeyBitmap m_keys_down;
+  KeyBitmap m_output_keys_down;
+  // contains at least the triggers in output_down
+  KeyBitmap m_output_down_triggers;
+  // the triggers in output_on_release
+  KeyBitmap m_output_on_release_triggers;
+  // empty while profiling is disabled
+  InputProfiles m_input_profiles;
 
   // temporary buffer
   KeySequence m_output_buffer;
   bool m_temporary_reapplied{ };
   std::vector<Key> m_any_key_matches;
+  std::vector<Key> m_leading_keys;
+  std::vector<int> m_candidate_inputs;
+  std::vector<OutputDown> m_release_buffer;
+  KeySequence m_prev_sequence;
+  std::vector<OutputDown> m_prev_output_down;
+  KeySequence m_prev_history;
 };
+
+const char* get_match_engine_name(Stage::MatchEngine engine);
+std::optional<Stage::MatchEngine> get_match_engine(std::string_view name);
@@ -0,0 +1,48 @@
+
+#include "Tracepoints.h"
+
+#if defined(ENABLE_TRACEPOINTS) && defined(_WIN32)
+
+# include <windows.h>
+# include <TraceLoggingProvider.h>
+
+// {5B0C3F4E-8A6D-4E2B-9C71-3D2A8F6E1B47}
+TRACELOGGING_DEFINE_PROVIDER(g_provider, "keymapper",
+  (0x5b0c3f4e, 0x8a6d, 0x4e2b, 0x9c, 0x71, 0x3d, 0x2a, 0x8f, 0x6e, 0x1b, 0x47));
+
+std::atomic<bool> g_tracepoints_enabled;
+
+namespace {
+  void NTAPI enable_callback(LPCGUID, ULONG control_code, UCHAR, ULONGLONG,
+      ULONGLONG, PEVENT_FILTER_DESCRIPTOR, PVOID) {
+    if (control_code == EVENT_CONTROL_CODE_ENABLE_PROVIDER)
+      g_tracepoints_enabled.store(true);
+    else if (control_code == EVENT_CONTROL_CODE_DISABLE_PROVIDER)
+      g_tracepoints_enabled.store(false);
+  }
+} // namespace
+
+void register_tracepoints() {
+  TraceLoggingRegisterEx(g_provider, &enable_callback, nullptr);
+}
+
+void unregister_tracepoints() {
+  g_tracepoints_enabled.store(false);
+  TraceLoggingUnregister(g_provider);
+}
+
+void write_tracepoint(const char* name, const int64_t* arguments, size_t count) {
+  TraceLoggingWrite(g_provider, "Tracepoint",
+    TraceLoggingString(name, "Name"),
+    TraceLoggingInt64Array(arguments, static_cast<UINT16>(count), "Arguments"));
+}
+
+#else // !ENABLE_TRACEPOINTS || !_WIN32
+
+void register_tracepoints() {
+}
+
+void unregister_tracepoints() {
+}
+
+#endif
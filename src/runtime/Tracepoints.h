@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Static tracepoints of the provider "keymapper", which cost next to nothing
+// while no tracer is attached. On Linux they are USDT probes, e.g.:
+//   bpftrace -e 'usdt:/usr/bin/keymapperd:keymapper:event_received
+//     { printf("key %x state %d\n", arg0, arg1); }'
+// On Windows they are "Tracepoint" events of the TraceLogging provider
+// "keymapper", with the name and arguments as fields.
+//
+//   event_received(key, state, value, device_index)
+//   stage_matched(context_index, key)
+//   timeout_scheduled(milliseconds)
+//   timeout_fired(milliseconds)
+//   output_flushed(event_count)
+//   configuration_swapped(configuration_hash)
+
+#if defined(ENABLE_TRACEPOINTS) && defined(__linux__)
+
+# include <sys/sdt.h>
+
+#define TRACEPOINT(name, ...) STAP_PROBEV(keymapper, name, __VA_ARGS__)
+
+#elif defined(ENABLE_TRACEPOINTS) && defined(_WIN32)
+
+# include <atomic>
+
+// set while a session enabled the provider
+extern std::atomic<bool> g_tracepoints_enabled;
+void write_tracepoint(const char* name, const int64_t* arguments, size_t count);
+
+template<typename... Args>
+void write_tracepoint(const char* name, Args... args) {
+  const int64_t arguments[] = { static_cast<int64_t>(args)... };
+  write_tracepoint(name, arguments, sizeof...(args));
+}
+
+#define TRACEPOINT(name, ...) \
+  do { \
+    if (g_tracepoints_enabled.load(std::memory_order_relaxed)) \
+      write_tracepoint(#name, __VA_ARGS__); \
+  } while (false)
+
+#else
+
+#define TRACEPOINT(name, ...) do { } while (false)
+
+#endif
+
+// the provider only needs to be registered on Windows
+void register_tracepoints();
+void unregister_tracepoints();
@@ -0,0 +1,48 @@
+
+#include "AllocationTracker.h"
+
+#if defined(ENABLE_ALLOCATION_TRACKING)
+# include <cstdlib>
+# include <new>
+
+namespace {
+  thread_local AllocationCount t_allocations;
+
+  void* allocate(size_t size) {
+    ++t_allocations.allocations;
+    t_allocations.bytes += size;
+    if (auto ptr = std::malloc(size ? size : 1))
+      return ptr;
+    throw std::bad_alloc();
+  }
+} // namespace
+
+AllocationCount get_thread_allocations() {
+  return t_allocations;
+}
+
+void* operator new(size_t size) {
+  return allocate(size);
+}
+
+void* operator new[](size_t size) {
+  return allocate(size);
+}
+
+void operator delete(void* ptr) noexcept {
+  std::free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+  std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+  std::free(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept {
+  std::free(ptr);
+}
+
+#endif // ENABLE_ALLOCATION_TRACKING
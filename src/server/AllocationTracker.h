@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+
+// When built with ENABLE_ALLOCATION_TRACKING, the global operator new is
+// replaced, to count the allocations and allocated bytes of each thread.
+// Otherwise nothing is counted.
+struct AllocationCount {
+  uint64_t allocations;
+  uint64_t bytes;
+};
+
+#if defined(ENABLE_ALLOCATION_TRACKING)
+AllocationCount get_thread_allocations();
+constexpr bool allocation_tracking_enabled = true;
+#else
+inline AllocationCount get_thread_allocations() { return { }; }
+constexpr bool allocation_tracking_enabled = false;
+#endif
+
+// the allocations of the calls of a function
+struct AllocationStatistics {
+  uint64_t calls;
+  uint64_t allocations;
+  uint64_t bytes;
+};
+
+// adds the allocations of the calling thread during its lifetime
+class ScopedAllocationCount {
+public:
+  explicit ScopedAllocationCount(AllocationStatistics& statistics)
+    : m_statistics(statistics), m_start(get_thread_allocations()) {
+  }
+  ScopedAllocationCount(const ScopedAllocationCount&) = delete;
+  ScopedAllocationCount& operator=(const ScopedAllocationCount&) = delete;
+
+  ~ScopedAllocationCount() {
+    const auto end = get_thread_allocations();
+    ++m_statistics.calls;
+    m_statistics.allocations += end.allocations - m_start.allocations;
+    m_statistics.bytes += end.bytes - m_start.bytes;
+  }
+
+private:
+  AllocationStatistics& m_statistics;
+  const AllocationCount m_start;
+};
@@ -1,14 +1,39 @@
 
 #include "ClientPort.h"
+#include "common/CompactSequence.h"
 #include "common/parse_regex.h"
+#include "common/output.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <fstream>
+#include <iterator>
+#include <thread>
+
+#if !defined(_WIN32)
+# include "common/unix/SealedMemory.h"
+#endif
 
 namespace {
+  // the stages of larger configurations are constructed on a few threads,
+  // so loading takes about as long as the largest stage
+  const auto max_build_threads = size_t{ 4 };
+  const auto min_parallel_build_inputs = size_t{ 256 };
+
+  size_t get_input_count(const std::vector<Stage::Context>& contexts) {
+    auto count = size_t{ };
+    for (const auto& context : contexts)
+      count += context.inputs.size();
+    return count;
+  }
+
   KeySequence read_key_sequence(Deserializer& d) {
+    static_assert(std::is_trivially_copyable_v<KeyEvent>);
     auto sequence = KeySequence();
-    auto size = d.read<uint32_t>();
-    for (auto i = 0u; i < size; ++i) {
-      auto& event = sequence.emplace_back();
-      d.read(&event);
+    const auto size = d.read<uint32_t>();
+    if (d.can_read(size * sizeof(KeyEvent))) {
+      sequence.resize(size);
+      d.read(sequence.data(), size * sizeof(KeyEvent));
     }
     return sequence;
   }
@@ -22,68 +47,65 @@ namespace {
     return filter;
   }
 
-  MultiStagePtr read_stages(Deserializer& d) {
-    auto stages = std::vector<StagePtr>();
-    auto contexts = std::vector<Stage::Context>();
-    const auto context_count = d.read<uint32_t>();
-    for (auto i = 0u; i < context_count; ++i) {
-      // begin stage
-      auto begin_stage = false;
-      d.read(&begin_stage);
-      if (begin_stage && !contexts.empty()) {
-        stages.emplace_back(std::make_unique<Stage>(std::move(contexts)));
-        contexts = { };
-      }
-
-      auto& context = contexts.emplace_back();
-
-      // inputs
-      auto count = d.read<uint32_t>();
-      context.inputs.resize(count);
-      for (auto& input : context.inputs) {
-        input.input = read_key_sequence(d);
-        input.output_index = d.read<int32_t>();
-      }
-
-      // outputs
-      count = d.read<uint32_t>();
-      context.outputs.resize(count);
-      for (auto& output : context.outputs) {
-        output = read_key_sequence(d);
-      }
-
-      // command outputs
-      count = d.read<uint32_t>();
-      context.command_outputs.resize(count);
-      for (auto& command : context.command_outputs) {
-        command.output = read_key_sequence(d);
-        command.index = d.read<int32_t>();
-      }
+  // sequences and strings are referred to by their index in the tables
+  template<typename T>
+  T read_ref(Deserializer& d, const std::vector<T>& table) {
+    const auto index = d.read_varint();
+    return (index < table.size() ? table[index] : T());
+  }
 
-      // device filter
-      context.device_filter = read_filter(d);
+  Filter read_filter_ref(Deserializer& d,
+      const std::vector<std::string>& strings, bool invert) {
+    auto filter = Filter{ };
+    filter.string = read_ref(d, strings);
+    filter.invert = invert;
+    if (is_regex(filter.string))
+      filter.regex = parse_regex(filter.string);
+    return filter;
+  }
 
-      // device-id filter
-      context.device_id_filter = read_filter(d);
+  void read_context(Deserializer& d, Stage::Context& context,
+      bool& begin_stage, const std::vector<KeySequence>& sequences,
+      const std::vector<std::string>& strings) {
+    // flags
+    const auto flags = d.read<uint8_t>();
+    begin_stage = (flags & 0x01);
 
-      // modifier filter
-      context.modifier_filter = read_key_sequence(d);
-      d.read(&context.invert_modifier_filter);
+    // inputs
+    auto count = d.read_varint();
+    context.inputs.resize(d.can_read(count) ? count : 0);
+    for (auto& input : context.inputs) {
+      input.input = read_ref(d, sequences);
+      input.output_index = d.read_signed_varint();
+    }
 
-      // fallthrough
-      d.read(&context.fallthrough);
+    // outputs
+    count = d.read_varint();
+    context.outputs.resize(d.can_read(count) ? count : 0);
+    for (auto& output : context.outputs) {
+      output = read_ref(d, sequences);
     }
 
-    if (!contexts.empty())
-      stages.emplace_back(std::make_unique<Stage>(std::move(contexts)));
+    // command outputs
+    count = d.read_varint();
+    context.command_outputs.resize(d.can_read(count) ? count : 0);
+    for (auto& command : context.command_outputs) {
+      command.output = read_ref(d, sequences);
+      command.index = d.read_signed_varint();
+    }
 
-    return std::make_unique<MultiStage>(std::move(stages));
+    // device filter, device-id filter and modifier filter
+    context.device_filter = read_filter_ref(d, strings, flags & 0x02);
+    context.device_id_filter = read_filter_ref(d, strings, flags & 0x04);
+    context.modifier_filter = read_ref(d, sequences);
+    context.invert_modifier_filter = (flags & 0x08);
+    context.fallthrough = (flags & 0x10);
   }
 
   std::vector<GrabDeviceFilter> read_grab_device_filters(Deserializer& d) {
     auto device_filters = std::vector<GrabDeviceFilter>();
-    const auto count = d.read<uint32_t>();
-    for (auto i = 0u; i < count; ++i) {
+    const auto count = d.read_varint();
+    for (auto i = 0u; i < count && d.can_read(1); ++i) {
       auto filter = read_filter(d);
       auto by_id = d.read<bool>();
       device_filters.push_back({ std::move(filter), by_id });
@@ -91,49 +113,514 @@ namespace {
     return device_filters;
   }
 
+  LogicalKeys read_logical_keys(Deserializer& d) {
+    auto definitions = std::vector<LogicalKeys::Definition>();
+    const auto count = d.read_varint();
+    for (auto i = 0u; i < count && d.can_read(3 * sizeof(Key)); ++i) {
+      auto& definition = definitions.emplace_back();
+      definition.logical = d.read<Key>();
+      definition.left = d.read<Key>();
+      definition.right = d.read<Key>();
+    }
+    return LogicalKeys(std::move(definitions));
+  }
+
+  std::vector<Key> read_forward_modifiers(Deserializer& d) {
+    auto keys = std::vector<Key>();
+    const auto count = d.read_varint();
+    for (auto i = 0u; i < count && d.can_read(sizeof(Key)); ++i)
+      keys.push_back(d.read<Key>());
+    return keys;
+  }
+
   std::vector<std::string> read_directives(Deserializer& d) {
     auto directives = std::vector<std::string>();
-    const auto count = d.read<uint32_t>();
-    for (auto i = 0u; i < count; ++i)
+    const auto count = d.read_varint();
+    for (auto i = 0u; i < count && d.can_read(1); ++i)
       directives.push_back(d.read_string());
     return directives;
   }
 
+  void write_filter(Serializer& s, const Filter& filter) {
+    s.write(filter.string);
+    s.write(filter.invert);
+  }
+
+  void write_grab_device_filters(Serializer& s,
+      const std::vector<GrabDeviceFilter>& device_filters) {
+    s.write_varint(static_cast<uint32_t>(device_filters.size()));
+    for (const auto& device_filter : device_filters) {
+      write_filter(s, device_filter);
+      s.write(device_filter.by_id);
+    }
+  }
+
+  void write_logical_keys(Serializer& s, const LogicalKeys& logical_keys) {
+    const auto& definitions = logical_keys.definitions();
+    s.write_varint(static_cast<uint32_t>(definitions.size()));
+    for (const auto& [logical, left, right] : definitions) {
+      s.write(logical);
+      s.write(left);
+      s.write(right);
+    }
+  }
+
+  void write_forward_modifiers(Serializer& s, const std::vector<Key>& keys) {
+    s.write_varint(static_cast<uint32_t>(keys.size()));
+    for (auto key : keys)
+      s.write(key);
+  }
+
+  void write_directives(Serializer& s,
+      const std::vector<std::string>& directives) {
+    s.write_varint(static_cast<uint32_t>(directives.size()));
+    for (const auto& directive : directives)
+      s.write(directive);
+  }
+
+  size_t get_hash(const char* data, size_t size) {
+    return std::hash<std::string_view>{ }(std::string_view(data, size));
+  }
+
   void read_active_contexts(Deserializer& d, std::vector<int>* indices) {
     indices->clear();
     const auto count = d.read<uint32_t>();
     for (auto i = 0u; i < count; ++i)
       indices->push_back(static_cast<int>(d.read<uint32_t>()));
   }
+
+  void read_index_deltas(Deserializer& d, std::vector<int>* indices) {
+    indices->clear();
+    const auto count = d.read_varint();
+    auto index = uint32_t{ };
+    for (auto i = 0u; i < count && d.can_read(1); ++i)
+      indices->push_back(static_cast<int>(index += d.read_varint()));
+  }
 } // namespace
 
-ClientPort::ClientPort() 
-  : m_host("keymapper") {
+ClientPort::ClientPort(std::string ipc_id) 
+  : m_host(std::move(ipc_id)) {
 }
 
 bool ClientPort::listen() {
   return m_host.listen();
 }
 
+bool ClientPort::adopt_listen_socket(Socket socket) {
+  return m_host.adopt(socket);
+}
+
 bool ClientPort::accept() {
+  m_context_data.clear();
+  m_context_offsets.clear();
+  m_configuration_hash = { };
+  m_cached_configurations.clear();
+  m_sequences.reset();
+  m_strings.reset();
+  m_configuration_chunks.clear();
+  m_active_contexts_pending = false;
+  m_pending_virtual_key_state.reset();
   m_connection = m_host.accept();
+#if !defined(_WIN32)
+  if (m_connection &&
+      !m_connection.accept_receive_ring(std::chrono::seconds(1)))
+    m_connection.disconnect();
+#endif
   return static_cast<bool>(m_connection);
 }
 
 void ClientPort::disconnect() {
   m_connection.disconnect();
+  m_context_data.clear();
+  m_context_offsets.clear();
+  m_configuration_hash = { };
+  m_cached_configurations.clear();
+  m_sequences.reset();
+  m_strings.reset();
+  m_configuration_chunks.clear();
+}
+
+std::unique_ptr<IClientPort> ClientPort::create_session() const {
+  return std::make_unique<ClientPort>();
+}
+
+void ClientPort::swap_session(IClientPort& other_port) {
+  // the host and the snapshot are shared by all sessions
+  auto& other = static_cast<ClientPort&>(other_port);
+  std::swap(m_connection, other.m_connection);
+  std::swap(m_active_context_indices, other.m_active_context_indices);
+  std::swap(m_context_switch_times, other.m_context_switch_times);
+  std::swap(m_active_contexts_pending, other.m_active_contexts_pending);
+  std::swap(m_pending_virtual_key_state, other.m_pending_virtual_key_state);
+  std::swap(m_context_data, other.m_context_data);
+  std::swap(m_context_offsets, other.m_context_offsets);
+  std::swap(m_grab_device_filters, other.m_grab_device_filters);
+  std::swap(m_logical_keys, other.m_logical_keys);
+  std::swap(m_forward_modifiers, other.m_forward_modifiers);
+  std::swap(m_directives, other.m_directives);
+  std::swap(m_configuration_hash, other.m_configuration_hash);
+  std::swap(m_cached_configurations, other.m_cached_configurations);
+  std::swap(m_sequences, other.m_sequences);
+  std::swap(m_strings, other.m_strings);
+  std::swap(m_configuration_chunks, other.m_configuration_chunks);
+}
+
+void ClientPort::restore_session(MessageHandler& handler) {
+  handler.on_grab_device_filters_message(m_grab_device_filters);
+  handler.on_directives_message(m_directives);
+}
+
+bool ClientPort::read_configuration(Deserializer& d,
+    MessageHandler& handler, bool update) {
+  const auto hash = static_cast<size_t>(d.read<uint64_t>());
+  if (hash != m_configuration_hash)
+    cache_configuration(hash);
+  m_configuration_hash = hash;
+  m_grab_device_filters = read_grab_device_filters(d);
+  m_logical_keys = read_logical_keys(d);
+  m_forward_modifiers = read_forward_modifiers(d);
+  if (!update) {
+    m_sequences.reset();
+    m_strings.reset();
+  }
+  read_tables(d);
+  handler.on_grab_device_filters_message(m_grab_device_filters);
+  const auto start = Clock::now();
+  auto contexts = std::vector<ReceivedContext>();
+  if (!read_contexts(d, update, contexts)) {
+    error("Updating configuration failed");
+    return false;
+  }
+  auto stage = build_stages(std::move(contexts), m_logical_keys,
+    m_forward_modifiers);
+  stage->set_configuration_hash(hash);
+  verbose("Building configuration took %d ms", static_cast<int>(
+    std::chrono::duration_cast<std::chrono::milliseconds>(
+      Clock::now() - start).count()));
+  handler.on_configuration_message(std::move(stage));
+  m_directives = read_directives(d);
+  handler.on_directives_message(m_directives);
+  return true;
+}
+
+bool ClientPort::read_activate_configuration(Deserializer& d,
+    MessageHandler& handler) {
+  const auto hash = static_cast<size_t>(d.read<uint64_t>());
+  auto& cached = m_cached_configurations;
+  const auto it = std::find_if(cached.begin(), cached.end(),
+    [&](const CachedConfiguration& c) { return c.hash == hash; });
+  if (it == cached.end()) {
+    error("Activating configuration failed");
+    return false;
+  }
+  auto configuration = std::move(*it);
+  cached.erase(it);
+  cache_configuration(hash);
+
+  verbose("Activating cached configuration");
+  m_configuration_hash = hash;
+  m_context_data = *configuration.context_data;
+  m_context_offsets = std::move(configuration.context_offsets);
+  m_grab_device_filters = std::move(configuration.grab_device_filters);
+  m_logical_keys = std::move(configuration.logical_keys);
+  m_forward_modifiers = std::move(configuration.forward_modifiers);
+  m_directives = std::move(configuration.directives);
+  handler.on_grab_device_filters_message(m_grab_device_filters);
+  handler.on_activate_configuration_message(hash,
+    [context_data = configuration.context_data, sequences = m_sequences,
+        strings = m_strings, logical_keys = m_logical_keys,
+        forward_modifiers = m_forward_modifiers, hash]() {
+      return build_stages(*context_data, *sequences, *strings,
+        logical_keys, forward_modifiers, hash);
+    });
+  handler.on_directives_message(m_directives);
+  return true;
+}
+
+bool ClientPort::read_configuration_chunk(Deserializer& d,
+    MessageHandler& handler) {
+  const auto last = d.read<bool>();
+  const auto size = d.read<uint32_t>();
+  if (!d.can_read(size)) {
+    m_configuration_chunks.clear();
+    return false;
+  }
+  auto& chunks = m_configuration_chunks;
+  chunks.insert(chunks.end(), d.data() + d.position(),
+    d.data() + d.position() + size);
+  d.seek(d.position() + size);
+  if (!last)
+    return false;
+
+  auto message = Deserializer(std::exchange(chunks, { }));
+  return read_configuration_message(message, handler);
+}
+
+bool ClientPort::read_configuration_memory(Deserializer& d,
+    MessageHandler& handler) {
+  const auto size = static_cast<size_t>(d.read<uint64_t>());
+#if !defined(_WIN32)
+  // the stages are built directly from the mapped memory
+  const auto fd = m_connection.receive_descriptor();
+  const auto memory = (fd >= 0 ? SealedMemory::map(fd, size) : SealedMemory());
+  if (!memory) {
+    error("Mapping configuration failed");
+    return false;
+  }
+  auto message = Deserializer(memory.data(), memory.size());
+  return read_configuration_message(message, handler);
+#else
+  static_cast<void>(size);
+  return false;
+#endif
 }
 
-const std::vector<int>& ClientPort::read_active_contexts(Deserializer& d) {
-  ::read_active_contexts(d, &m_active_context_indices);
+bool ClientPort::read_configuration_message(Deserializer& d,
+    MessageHandler& handler) {
+  const auto type = d.read<MessageType>();
+  if (type != MessageType::configuration &&
+      type != MessageType::configuration_update)
+    return false;
+  return read_configuration(d, handler,
+    type == MessageType::configuration_update);
+}
+
+// keeps the current configuration, when it is replaced by the one with hash.
+// The client does the same, so it knows which ones it can activate
+void ClientPort::cache_configuration(size_t hash) {
+  auto& cached = m_cached_configurations;
+  if (m_configuration_hash && !m_context_data.empty())
+    cached.push_back({ m_configuration_hash,
+      std::make_shared<const std::vector<char>>(m_context_data),
+      m_context_offsets, m_grab_device_filters, m_logical_keys,
+      m_forward_modifiers, m_directives });
+  cached.erase(std::remove_if(cached.begin(), cached.end(),
+    [&](const CachedConfiguration& c) { return c.hash == hash; }),
+    cached.end());
+  if (cached.size() > max_cached_configurations)
+    cached.erase(cached.begin());
+}
+
+// contexts are deserialized once, directly into the stage contexts.
+// only their serialized form is retained for subsequent updates
+bool ClientPort::read_contexts(Deserializer& d, bool update,
+    std::vector<ReceivedContext>& contexts) {
+  auto previous = Deserializer(std::exchange(m_context_data, { }));
+  const auto previous_offsets = std::exchange(m_context_offsets, { 0 });
+  const auto read = [&](Deserializer& source) {
+    const auto begin = source.position();
+    auto& received = contexts.emplace_back();
+    read_context(source, received.context, received.begin_stage,
+      *m_sequences, *m_strings);
+    m_context_data.insert(m_context_data.end(),
+      source.data() + begin, source.data() + source.position());
+    m_context_offsets.push_back(m_context_data.size());
+  };
+
+  const auto count = d.read_varint();
+  for (auto i = 0u; i < count && d.can_read(1); ++i) {
+    // index of unchanged context in previous configuration
+    if (update)
+      if (const auto index = d.read_signed_varint(); index >= 0) {
+        if (index + 1 >= static_cast<int32_t>(previous_offsets.size()))
+          return false;
+        previous.seek(previous_offsets[index]);
+        read(previous);
+        continue;
+      }
+    read(d);
+  }
+  return true;
+}
+
+MultiStagePtr ClientPort::build_stages(std::vector<ReceivedContext> received,
+    const LogicalKeys& logical_keys,
+    const std::vector<Key>& forward_modifiers) {
+  // split at the stage boundaries first
+  auto stage_contexts = std::vector<std::vector<Stage::Context>>();
+  for (auto& context : received) {
+    if (stage_contexts.empty() ||
+        (context.begin_stage && !stage_contexts.back().empty()))
+      stage_contexts.emplace_back();
+    stage_contexts.back().push_back(std::move(context.context));
+  }
+
+  auto stages = std::vector<StagePtr>(stage_contexts.size());
+  const auto build_stage = [&](size_t index) {
+    stages[index] = std::make_unique<Stage>(
+      std::move(stage_contexts[index]), logical_keys, forward_modifiers);
+  };
+
+  // the threads take the next stage, until all are built
+  auto inputs = size_t{ };
+  for (const auto& contexts : stage_contexts)
+    inputs += get_input_count(contexts);
+  const auto thread_count = (inputs < min_parallel_build_inputs ? size_t{ 1 } :
+    std::min({ stages.size(), max_build_threads,
+      std::max(size_t{ std::thread::hardware_concurrency() }, size_t{ 1 }) }));
+  auto next_index = std::atomic<size_t>{ };
+  const auto build_stages = [&]() {
+    for (auto index = next_index++; index < stages.size(); index = next_index++)
+      build_stage(index);
+  };
+  auto threads = std::vector<std::thread>();
+  for (auto i = size_t{ 1 }; i < thread_count; ++i)
+    threads.emplace_back(build_stages);
+  build_stages();
+  for (auto& thread : threads)
+    thread.join();
+
+  return std::make_unique<MultiStage>(std::move(stages));
+}
+
+MultiStagePtr ClientPort::build_stages(const std::vector<char>& context_data,
+    const std::vector<KeySequence>& sequences,
+    const std::vector<std::string>& strings,
+    const LogicalKeys& logical_keys,
+    const std::vector<Key>& forward_modifiers, size_t hash) {
+  auto d = Deserializer(context_data.data(), context_data.size());
+  auto contexts = std::vector<ReceivedContext>();
+  while (d.position() < context_data.size()) {
+    const auto position = d.position();
+    auto& received = contexts.emplace_back();
+    read_context(d, received.context, received.begin_stage,
+      sequences, strings);
+    if (d.position() == position)
+      break;
+  }
+  auto stage = build_stages(std::move(contexts), logical_keys,
+    forward_modifiers);
+  stage->set_configuration_hash(hash);
+  return stage;
+}
+
+// new sequences and strings are appended to the tables. A copy is made,
+// when a table is still referred to by a configuration, which can be built
+// again
+void ClientPort::read_tables(Deserializer& d) {
+  auto sequences = (m_sequences ? *m_sequences : std::vector<KeySequence>());
+  auto count = d.read_varint();
+  for (auto i = 0u; i < count && d.can_read(1); ++i)
+    sequences.push_back(read_compact_sequence(d));
+  m_sequences = std::make_shared<const std::vector<KeySequence>>(
+    std::move(sequences));
+
+  auto strings = (m_strings ? *m_strings : std::vector<std::string>());
+  count = d.read_varint();
+  for (auto i = 0u; i < count && d.can_read(sizeof(uint32_t)); ++i)
+    strings.push_back(d.read_string());
+  m_strings = std::make_shared<const std::vector<std::string>>(
+    std::move(strings));
+}
+
+void ClientPort::set_snapshot_filename(std::filesystem::path filename) {
+  m_snapshot_filename = std::move(filename);
+}
+
+// version hash, hash of body and configuration as received from client
+bool ClientPort::load_snapshot(MessageHandler& handler) {
+  auto is = std::ifstream(m_snapshot_filename, std::ios::binary);
+  if (m_snapshot_filename.empty() || !is.good())
+    return false;
+  auto data = std::vector<char>(std::istreambuf_iterator<char>(is), { });
+  auto header = std::array<uint64_t, 2>{ };
+  const auto header_size = sizeof(header);
+  if (data.size() < header_size)
+    return false;
+  std::memcpy(header.data(), data.data(), header_size);
+  const auto hash = get_hash(data.data() + header_size,
+    data.size() - header_size);
+  if (header[0] != get_version_hash() || header[1] != hash)
+    return false;
+
+  auto d = Deserializer(std::move(data));
+  d.read<decltype(header)>();
+  m_snapshot_hash = hash;
+  const auto succeeded = read_configuration(d, handler, false);
+  m_context_data.clear();
+  m_context_offsets.clear();
+  m_configuration_hash = { };
+  m_sequences.reset();
+  m_strings.reset();
+  return succeeded;
+}
+
+void ClientPort::save_snapshot() {
+  if (m_snapshot_filename.empty())
+    return;
+
+  auto s = Serializer();
+  s.write(static_cast<uint64_t>(get_version_hash()));
+  s.write(uint64_t{ });
+  const auto header_size = s.size();
+  s.write(static_cast<uint64_t>(m_configuration_hash));
+  write_grab_device_filters(s, m_grab_device_filters);
+  write_logical_keys(s, m_logical_keys);
+  write_forward_modifiers(s, m_forward_modifiers);
+  const auto sequences = (m_sequences ? m_sequences->size() : size_t{ });
+  s.write_varint(static_cast<uint32_t>(sequences));
+  for (auto i = size_t{ }; i < sequences; ++i)
+    write_compact_sequence(s, (*m_sequences)[i]);
+  const auto strings = (m_strings ? m_strings->size() : size_t{ });
+  s.write_varint(static_cast<uint32_t>(strings));
+  for (auto i = size_t{ }; i < strings; ++i)
+    s.write((*m_strings)[i]);
+  s.write_varint(static_cast<uint32_t>(m_context_offsets.size() - 1));
+  s.write(m_context_data.data(), m_context_data.size());
+  write_directives(s, m_directives);
+
+  // only write when configuration changed
+  const auto hash = get_hash(s.data() + header_size, s.size() - header_size);
+  if (hash == m_snapshot_hash)
+    return;
+  s.write_at(sizeof(uint64_t), static_cast<uint64_t>(hash));
+
+  // replace at once, so it is never read partially
+  auto error = std::error_code{ };
+  std::filesystem::create_directories(m_snapshot_filename.parent_path(), error);
+  auto temp_filename = m_snapshot_filename;
+  temp_filename += ".tmp";
+  auto os = std::ofstream(temp_filename, std::ios::binary);
+  if (!os.write(s.data(), static_cast<std::streamsize>(s.size())))
+    return verbose("Writing configuration snapshot failed");
+  os.close();
+  std::filesystem::rename(temp_filename, m_snapshot_filename, error);
+  if (error)
+    return verbose("Writing configuration snapshot failed");
+  m_snapshot_hash = hash;
+}
+
+const std::vector<int>& ClientPort::read_active_contexts(Deserializer& d,
+    bool delta) {
+  if (!delta) {
+    ::read_active_contexts(d, &m_active_context_indices);
+    return m_active_context_indices;
+  }
+  // remove, then merge in the added
+  auto& indices = m_context_indices_buffer;
+  read_index_deltas(d, &indices);
+  m_active_context_indices.erase(std::remove_if(
+    m_active_context_indices.begin(), m_active_context_indices.end(),
+    [&](int index) {
+      return std::binary_search(indices.begin(), indices.end(), index);
+    }), m_active_context_indices.end());
+  read_index_deltas(d, &indices);
+  const auto middle = m_active_context_indices.size();
+  m_active_context_indices.insert(m_active_context_indices.end(),
+    indices.begin(), indices.end());
+  std::inplace_merge(m_active_context_indices.begin(),
+    m_active_context_indices.begin() + static_cast<std::ptrdiff_t>(middle),
+    m_active_context_indices.end());
   return m_active_context_indices;
 }
 
-bool ClientPort::send_triggered_action(int action) {
+bool ClientPort::send_triggered_actions(const std::vector<int>& actions) {
   return m_connection.send_message(
     [&](Serializer& s) {
       s.write(MessageType::execute_action);
-      s.write(static_cast<uint32_t>(action));
+      s.write(static_cast<uint32_t>(actions.size()));
+      for (auto action : actions)
+        s.write(static_cast<uint32_t>(action));
     });
 }
 
@@ -146,6 +633,18 @@ bool ClientPort::send_virtual_key_state(Key key, KeyState state) {
     });
 }
 
+bool ClientPort::send_virtual_key_states(const std::vector<KeyEvent>& states) {
+  return m_connection.send_message(
+    [&](Serializer& s) {
+      s.write(MessageType::virtual_key_states);
+      s.write(static_cast<uint32_t>(states.size()));
+      for (const auto& event : states) {
+        s.write(event.key);
+        s.write(event.state);
+      }
+    });
+}
+
 bool ClientPort::send_next_key_info(Key key, const DeviceDesc& device_desc) {
   return m_connection.send_message(
     [&](Serializer& s) {
@@ -156,25 +655,134 @@ bool ClientPort::send_next_key_info(Key key, const DeviceDesc& device_desc) {
     });
 }
 
+size_t ClientPort::memory_usage() const {
+  const auto string_bytes = [](const std::vector<std::string>& strings) {
+    auto bytes = strings.capacity() * sizeof(std::string);
+    for (const auto& string : strings)
+      bytes += string.capacity();
+    return bytes;
+  };
+  auto bytes = m_connection.buffer_footprint() +
+    m_context_data.capacity() +
+    m_context_offsets.capacity() * sizeof(size_t) +
+    m_configuration_chunks.capacity() +
+    string_bytes(m_directives);
+  if (m_sequences) {
+    bytes += m_sequences->capacity() * sizeof(KeySequence);
+    for (const auto& sequence : *m_sequences)
+      if (sequence.capacity() > KeySequence::inline_capacity)
+        bytes += sequence.capacity() * sizeof(KeyEvent);
+  }
+  if (m_strings)
+    bytes += string_bytes(*m_strings);
+  for (const auto& cached : m_cached_configurations)
+    bytes += cached.context_data->capacity() +
+      cached.context_offsets.capacity() * sizeof(size_t) +
+      string_bytes(cached.directives);
+  return bytes;
+}
+
+bool ClientPort::send_statistics(const std::string& statistics) {
+  return m_connection.send_message(
+    [&](Serializer& s) {
+      s.write(MessageType::statistics);
+      s.write(statistics);
+    });
+}
+
+bool ClientPort::send_input_profiles(const InputProfiles& profiles) {
+  static_assert(std::is_trivially_copyable_v<InputProfile>);
+  return m_connection.send_message(
+    [&](Serializer& s) {
+      s.write(MessageType::input_profile);
+      s.write(static_cast<uint32_t>(profiles.size()));
+      for (const auto& context : profiles) {
+        s.write(static_cast<uint32_t>(context.size()));
+        s.write(context.data(), context.size() * sizeof(InputProfile));
+      }
+    });
+}
+
+void ClientPort::apply_pending_messages(MessageHandler& handler) {
+  if (std::exchange(m_active_contexts_pending, false))
+    handler.on_active_contexts_message(m_active_context_indices,
+      m_context_switch_times);
+
+  if (m_pending_virtual_key_state) {
+    const auto [key, state] = *m_pending_virtual_key_state;
+    m_pending_virtual_key_state.reset();
+    handler.on_set_virtual_key_state_message(key, state);
+  }
+}
+
 bool ClientPort::read_messages(MessageHandler& handler,
     std::optional<Duration> timeout) {
-  return m_connection.read_messages(timeout,
+  const auto result = m_connection.read_messages(timeout,
     [&](Deserializer& d) {
-      switch (d.read<MessageType>()) {
-        case MessageType::configuration: {
-          handler.on_grab_device_filters_message(read_grab_device_filters(d));        
-          handler.on_configuration_message(read_stages(d));
-          handler.on_directives_message(read_directives(d));
+      const auto type = d.read<MessageType>();
+
+      // consecutive messages, which supersede the previous, are only
+      // applied once per read. Other messages apply them before
+      if ((m_active_contexts_pending &&
+           type != MessageType::active_contexts &&
+           type != MessageType::active_contexts_delta) ||
+          (m_pending_virtual_key_state &&
+           type != MessageType::set_virtual_key_state))
+        apply_pending_messages(handler);
+
+      switch (type) {
+        case MessageType::configuration: 
+        case MessageType::configuration_update: {
+          const auto update = (type == MessageType::configuration_update);
+          // not reading the whole message fails
+          if (read_configuration(d, handler, update))
+            save_snapshot();
+          break;
+        }
+        case MessageType::activate_configuration: {
+          if (read_activate_configuration(d, handler))
+            save_snapshot();
+          break;
+        }
+        case MessageType::configuration_chunk: {
+          if (read_configuration_chunk(d, handler))
+            save_snapshot();
           break;
         }
-        case MessageType::active_contexts: {
-          handler.on_active_contexts_message(read_active_contexts(d));
+        case MessageType::configuration_memory: {
+          if (read_configuration_memory(d, handler))
+            save_snapshot();
+          break;
+        }
+        case MessageType::active_contexts:
+        case MessageType::active_contexts_delta: {
+          read_active_contexts(d,
+            type == MessageType::active_contexts_delta);
+          m_context_switch_times = d.read<ContextSwitchTimes>();
+          if (m_context_switch_times.sent)
+            m_context_switch_times.received = to_timestamp(Clock::now());
+          m_active_contexts_pending = true;
           break;
         }
         case MessageType::set_virtual_key_state: {
+          // only setting the same state again is superseded,
+          // a press and release would trigger mappings
           const auto key = d.read<Key>();
           const auto state = d.read<KeyState>();
-          handler.on_set_virtual_key_state_message(key, state);
+          const auto key_state = std::make_pair(key, state);
+          if (m_pending_virtual_key_state != key_state)
+            apply_pending_messages(handler);
+          if (state == KeyState::Not)
+            handler.on_set_virtual_key_state_message(key, state);
+          else
+            m_pending_virtual_key_state = key_state;
+          break;
+        }
+        case MessageType::set_virtual_key_states: {
+          auto keys = std::vector<Key>(d.read<uint32_t>());
+          for (auto& key : keys)
+            key = d.read<Key>();
+          handler.on_set_virtual_key_states_message(keys, d.read<KeyState>());
           break;
         }
         case MessageType::validate_state: {
@@ -193,7 +801,17 @@ bool ClientPort::read_messages(MessageHandler& handler,
           handler.on_inject_output_message(read_key_sequence(d));
           break;
         }
+        case MessageType::statistics: {
+          handler.on_request_statistics_message(d.read<bool>());
+          break;
+        }
+        case MessageType::input_profile: {
+          handler.on_request_input_profiles_message();
+          break;
+        }
         default: break;
       }
     });
+  apply_pending_messages(handler);
+  return result;
 }
@@ -4,6 +4,9 @@
 #include "common/MessageType.h"
 #include "common/Host.h"
 #include "common/DeviceDesc.h"
+#include "common/ContextSwitchTimes.h"
+#include <filesystem>
+#include <functional>
 #include <memory>
 
 class IClientPort {
@@ -12,12 +15,27 @@ public:
     virtual void on_configuration_message(MultiStagePtr stage) = 0;
     virtual void on_grab_device_filters_message(std::vector<GrabDeviceFilter> filters) = 0;
     virtual void on_directives_message(const std::vector<std::string>& directives) = 0;
-    virtual void on_active_contexts_message(const std::vector<int>& context_indices) = 0;
+    virtual void on_active_contexts_message(const std::vector<int>& context_indices,
+      const ContextSwitchTimes& times) = 0;
     virtual void on_set_virtual_key_state_message(Key key, KeyState state) = 0;
+    // sets several virtual keys, before the output is flushed once
+    virtual void on_set_virtual_key_states_message(
+        const std::vector<Key>& keys, KeyState state) {
+      for (auto key : keys)
+        on_set_virtual_key_state_message(key, state);
+    }
     virtual void on_validate_state_message() = 0;
     virtual void on_request_next_key_info_message() = 0;
     virtual void on_inject_input_message(const KeySequence& sequence) = 0;
     virtual void on_inject_output_message(const KeySequence& sequence) = 0;
+    virtual void on_request_statistics_message(bool recent_events) = 0;
+    virtual void on_request_input_profiles_message() = 0;
+    // activates a configuration received before. The stage is only built
+    // again, when the handler did not keep the replaced configuration
+    virtual void on_activate_configuration_message(size_t hash,
+        const std::function<MultiStagePtr()>& build_stage) {
+      on_configuration_message(build_stage());
+    }
   };
 
   virtual ~IClientPort() = default;
@@ -25,34 +43,132 @@ public:
   virtual Socket listen_socket() const = 0;
   virtual bool version_mismatch() const = 0;
   virtual bool listen() = 0;
+  // continues listening on the socket of another process
+  virtual bool adopt_listen_socket(Socket socket) { return false; }
   virtual bool accept() = 0;
   virtual void disconnect() = 0;
-  virtual bool send_triggered_action(int action) = 0;
+  // actions triggered by one flush are sent at once, in order
+  virtual bool send_triggered_actions(const std::vector<int>& actions) = 0;
   virtual bool send_virtual_key_state(Key key, KeyState state) = 0;
+  // states changed by one message are sent at once, in order
+  virtual bool send_virtual_key_states(const std::vector<KeyEvent>& states) {
+    for (const auto& event : states)
+      if (!send_virtual_key_state(event.key, event.state))
+        return false;
+    return true;
+  }
   virtual bool send_next_key_info(Key key, const DeviceDesc& device_desc) = 0;
+  virtual bool send_statistics(const std::string& statistics) = 0;
+  virtual bool send_input_profiles(const InputProfiles& profiles) = 0;
   virtual bool read_messages(MessageHandler& handler, 
     std::optional<Duration> timeout) = 0;
+  // the last received configuration is persisted,
+  // so it can be applied at startup before a client connects
+  virtual void set_snapshot_filename(std::filesystem::path filename) = 0;
+  virtual bool load_snapshot(MessageHandler& handler) = 0;
+  // a session is the connection of one client and its received state,
+  // so several clients can be connected, while one of them is active
+  virtual std::unique_ptr<IClientPort> create_session() const = 0;
+  virtual void swap_session(IClientPort& other) = 0;
+  // passes the grab device filters and directives of the session again
+  virtual void restore_session(MessageHandler& handler) = 0;
+  // bytes of the connection buffers and the received configurations
+  virtual size_t memory_usage() const { return 0; }
 };
 
 class ClientPort : public IClientPort {
 public:
-  ClientPort();
+  explicit ClientPort(std::string ipc_id = "keymapper");
   Socket socket() const override { return m_connection.socket(); }
   Socket listen_socket() const override { return m_host.listen_socket(); }
   bool version_mismatch() const override { return m_host.version_mismatch(); }
   bool listen() override;
+  bool adopt_listen_socket(Socket socket) override;
   bool accept() override;
   void disconnect() override;
-  bool send_triggered_action(int action) override;
+  bool send_triggered_actions(const std::vector<int>& actions) override;
   bool send_virtual_key_state(Key key, KeyState state) override;
+  bool send_virtual_key_states(const std::vector<KeyEvent>& states) override;
   bool send_next_key_info(Key key, const DeviceDesc& device_desc) override;
+  bool send_statistics(const std::string& statistics) override;
+  bool send_input_profiles(const InputProfiles& profiles) override;
   bool read_messages(MessageHandler& handler, 
     std::optional<Duration> timeout) override;
+  void set_snapshot_filename(std::filesystem::path filename) override;
+  bool load_snapshot(MessageHandler& handler) override;
+  std::unique_ptr<IClientPort> create_session() const override;
+  void swap_session(IClientPort& other) override;
+  void restore_session(MessageHandler& handler) override;
+  size_t memory_usage() const override;
+  // the configuration message, after its type was read
+  bool read_configuration(Deserializer& d, MessageHandler& handler,
+    bool update);
+  // the activate configuration message, after its type was read
+  bool read_activate_configuration(Deserializer& d, MessageHandler& handler);
+  // a configuration chunk message, after its type was read. The
+  // configuration is read when the last chunk arrived
+  bool read_configuration_chunk(Deserializer& d, MessageHandler& handler);
+  // the configuration in the shared memory passed along the message
+  bool read_configuration_memory(Deserializer& d, MessageHandler& handler);
+  // the active contexts message, after its type was read. A delta
+  // updates the indices of the previous message
+  const std::vector<int>& read_active_contexts(Deserializer& d, bool delta);
 
 private:
-  const std::vector<int>& read_active_contexts(Deserializer& d);
+  struct ReceivedContext {
+    Stage::Context context;
+    bool begin_stage;
+  };
+
+  bool read_contexts(Deserializer& d, bool update,
+    std::vector<ReceivedContext>& contexts);
+  static MultiStagePtr build_stages(std::vector<ReceivedContext> contexts,
+    const LogicalKeys& logical_keys,
+    const std::vector<Key>& forward_modifiers);
+  static MultiStagePtr build_stages(const std::vector<char>& context_data,
+    const std::vector<KeySequence>& sequences,
+    const std::vector<std::string>& strings,
+    const LogicalKeys& logical_keys,
+    const std::vector<Key>& forward_modifiers, size_t hash);
+  void read_tables(Deserializer& d);
+  bool read_configuration_message(Deserializer& d, MessageHandler& handler);
+  void cache_configuration(size_t hash);
+  void save_snapshot();
+  void apply_pending_messages(MessageHandler& handler);
 
   Host m_host;
   Connection m_connection;
   std::vector<int> m_active_context_indices;
+  std::vector<int> m_context_indices_buffer;
+  ContextSwitchTimes m_context_switch_times{ };
+  // superseded messages of one read are only applied once
+  bool m_active_contexts_pending{ };
+  std::optional<std::pair<Key, KeyState>> m_pending_virtual_key_state;
+  // serialized contexts of the last configuration, which can be referred
+  // to by update, with the offset of each context and the end
+  std::vector<char> m_context_data;
+  std::vector<size_t> m_context_offsets;
+  // the sequences the contexts refer to, the client only sends new ones
+  std::shared_ptr<const std::vector<KeySequence>> m_sequences;
+  std::shared_ptr<const std::vector<std::string>> m_strings;
+  std::vector<GrabDeviceFilter> m_grab_device_filters;
+  LogicalKeys m_logical_keys;
+  std::vector<Key> m_forward_modifiers;
+  std::vector<std::string> m_directives;
+  size_t m_configuration_hash{ };
+  // replaced configurations, which can be activated again, most recent last
+  struct CachedConfiguration {
+    size_t hash;
+    std::shared_ptr<const std::vector<char>> context_data;
+    std::vector<size_t> context_offsets;
+    std::vector<GrabDeviceFilter> grab_device_filters;
+    LogicalKeys logical_keys;
+    std::vector<Key> forward_modifiers;
+    std::vector<std::string> directives;
+  };
+  std::vector<CachedConfiguration> m_cached_configurations;
+  // the chunks of a configuration message received so far
+  std::vector<char> m_configuration_chunks;
+  std::filesystem::path m_snapshot_filename;
+  size_t m_snapshot_hash{ };
 };
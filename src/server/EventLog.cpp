@@ -0,0 +1,94 @@
+
+#include "EventLog.h"
+#include "runtime/Timeout.h"
+#include "common/output.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+#if !defined(NDEBUG)
+# include "config/get_key_name.h"
+#endif
+
+namespace {
+  // the entries are printed in batches
+  const auto print_interval = std::chrono::milliseconds(10);
+
+  std::string format_event(const KeyEvent& e) {
+    if (e.key == Key::timeout)
+      return (e.state == KeyState::Not ? "!" : "") +
+        std::to_string(timeout_to_milliseconds(e.value).count()) + "ms";
+
+    auto string = std::string(e.state == KeyState::Down ? "+" :
+      e.state == KeyState::Up ? "-" : "*");
+#if !defined(NDEBUG)
+    if (const auto name = get_key_name(e.key))
+      return string + name;
+#endif
+    char code[8];
+    std::snprintf(code, sizeof(code), "%X", static_cast<unsigned>(*e.key));
+    return string + code;
+  }
+} // namespace
+
+EventLog::~EventLog() {
+  stop();
+}
+
+void EventLog::log(const KeyEvent& input, const KeyEvent* output,
+    size_t output_count, bool translated, Clock::time_point time) {
+  if (!m_thread.joinable()) {
+    m_start_time = time.time_since_epoch().count();
+    m_thread = std::thread(&EventLog::thread_func, this);
+  }
+
+  auto entry = Entry{ };
+  entry.time = time.time_since_epoch().count();
+  entry.input = input;
+  entry.translated = translated;
+  entry.output_count = static_cast<uint8_t>(std::min(output_count, size_t{ 255 }));
+  std::copy_n(output, std::min(output_count, max_output_events),
+    entry.output.begin());
+  if (!m_entries.try_push(entry))
+    m_dropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+void EventLog::stop() {
+  if (!m_thread.joinable())
+    return;
+  m_stop.store(true);
+  m_thread.join();
+  m_stop.store(false);
+}
+
+void EventLog::thread_func() {
+  while (!m_stop.load()) {
+    print_entries();
+    std::this_thread::sleep_for(print_interval);
+  }
+  print_entries();
+}
+
+void EventLog::print_entries() {
+  auto entry = Entry{ };
+  while (m_entries.pop(entry)) {
+    const auto seconds = Duration(
+      Clock::duration(entry.time - m_start_time)).count();
+    const auto input = format_event(entry.input);
+    if (!entry.translated) {
+      verbose("%10.6f %s", seconds, input.c_str());
+      continue;
+    }
+    auto output = std::string();
+    const auto count = std::min(size_t{ entry.output_count }, max_output_events);
+    for (auto i = size_t{ }; i < count; ++i)
+      output += format_event(entry.output[i]) + " ";
+    if (entry.output_count > count)
+      output += "...";
+    verbose("%10.6f %s --> %s", seconds, input.c_str(), output.c_str());
+  }
+
+  if (const auto dropped = m_dropped.exchange(0))
+    verbose("%u events were not logged", static_cast<unsigned>(dropped));
+}
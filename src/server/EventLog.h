@@ -0,0 +1,46 @@
+#pragma once
+
+#include "LockFreeQueue.h"
+#include "runtime/KeyEvent.h"
+#include "common/Duration.h"
+#include <atomic>
+#include <thread>
+
+// Verbose output of the translated input. Logging only copies a
+// fixed-size entry into a queue, a background thread formats and prints
+// it later, so enabling it barely changes the timing of the input path.
+// Entries are logged by a single thread, they are dropped when the queue
+// is full.
+class EventLog {
+public:
+  EventLog() = default;
+  EventLog(const EventLog&) = delete;
+  EventLog& operator=(const EventLog&) = delete;
+  ~EventLog();
+
+  // starts the formatting thread on first call
+  void log(const KeyEvent& input, const KeyEvent* output,
+    size_t output_count, bool translated, Clock::time_point time);
+  // prints the remaining entries and stops the thread
+  void stop();
+
+private:
+  static constexpr size_t max_output_events = 12;
+
+  struct Entry {
+    Clock::rep time;
+    KeyEvent input;
+    bool translated;
+    uint8_t output_count;
+    std::array<KeyEvent, max_output_events> output;
+  };
+
+  void thread_func();
+  void print_entries();
+
+  LockFreeQueue<Entry, 1024> m_entries;
+  std::atomic<size_t> m_dropped{ };
+  std::atomic<bool> m_stop{ };
+  std::thread m_thread;
+  Clock::rep m_start_time{ };
+};
@@ -0,0 +1,152 @@
+
+#include "FlightRecorder.h"
+#include <chrono>
+#include <cstdio>
+
+namespace {
+  const char* get_type_name(FlightRecorder::Type type) {
+    switch (type) {
+      case FlightRecorder::Type::input: return "input";
+      case FlightRecorder::Type::forwarded: return "forwarded";
+      case FlightRecorder::Type::ignored_repeat: return "ignored repeat";
+      case FlightRecorder::Type::timeout_scheduled: return "timeout";
+      case FlightRecorder::Type::output: return "output";
+      case FlightRecorder::Type::state_invalid: return "state invalid";
+      case FlightRecorder::Type::read: return "read";
+      case FlightRecorder::Type::translate: return "translate";
+      case FlightRecorder::Type::stage: return "stage";
+      case FlightRecorder::Type::flush: return "flush";
+      case FlightRecorder::Type::write_output: return "write output";
+      case FlightRecorder::Type::client_messages: return "client messages";
+      case FlightRecorder::Type::deadlines: return "deadlines";
+      case FlightRecorder::Type::match_contexts: return "match contexts";
+      case FlightRecorder::Type::send_contexts: return "send contexts";
+      case FlightRecorder::Type::apply_contexts: return "apply contexts";
+    }
+    return "";
+  }
+
+  char get_state_char(KeyState state) {
+    switch (state) {
+      case KeyState::Up: return '-';
+      case KeyState::Down: return '+';
+      default: return '~';
+    }
+  }
+
+  bool is_span(FlightRecorder::Type type) {
+    return (type >= FlightRecorder::Type::read);
+  }
+
+  struct Track {
+    int pid;
+    int tid;
+  };
+
+  // the context spans were measured by keymapper
+  Track get_track(FlightRecorder::Type type) {
+    using Type = FlightRecorder::Type;
+    switch (type) {
+      case Type::input:
+      case Type::forwarded:
+      case Type::ignored_repeat:
+      case Type::read: return { 1, 1 };
+      case Type::translate:
+      case Type::stage: return { 1, 2 };
+      case Type::output:
+      case Type::flush:
+      case Type::write_output: return { 1, 3 };
+      case Type::client_messages:
+      case Type::apply_contexts:
+      case Type::state_invalid: return { 1, 4 };
+      case Type::timeout_scheduled:
+      case Type::deadlines: return { 1, 5 };
+      case Type::match_contexts:
+      case Type::send_contexts: return { 2, 1 };
+    }
+    return { };
+  }
+
+  double to_microseconds(Clock::rep ticks) {
+    return std::chrono::duration<double, std::micro>(
+      Clock::duration(ticks)).count();
+  }
+} // namespace
+
+std::string FlightRecorder::format(Clock::time_point now) const {
+  auto string = std::string();
+  const auto count = std::min(m_next, m_entries.size());
+  char line[96];
+  for (auto i = m_next - count; i < m_next; ++i) {
+    const auto& entry = m_entries[i % m_entries.size()];
+    const auto time = Clock::time_point(Clock::duration(entry.time));
+    const auto seconds = Duration(time - now).count();
+    if (is_span(entry.type))
+      std::snprintf(line, sizeof(line), "%12.6f %-15s %.3fms\n", seconds,
+        get_type_name(entry.type), to_microseconds(entry.duration) / 1000);
+    else if (entry.event.key == Key::timeout)
+      std::snprintf(line, sizeof(line), "%12.6f %-15s %ums\n", seconds,
+        get_type_name(entry.type), static_cast<unsigned>(entry.event.value));
+    else
+      std::snprintf(line, sizeof(line), "%12.6f %-15s %c0x%04X device %d\n",
+        seconds, get_type_name(entry.type), get_state_char(entry.event.state),
+        static_cast<unsigned>(*entry.event.key), entry.device_index);
+    string += line;
+  }
+  return string;
+}
+
+std::string FlightRecorder::format_chrome_trace() const {
+  auto string = std::string(
+    "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+    "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+      "\"args\":{\"name\":\"keymapperd\"}},\n"
+    "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":2,"
+      "\"args\":{\"name\":\"keymapper\"}}");
+  const Track tracks[] = { { 1, 1 }, { 1, 2 }, { 1, 3 }, { 1, 4 },
+    { 1, 5 }, { 2, 1 } };
+  const char* const track_names[] = { "devices", "translate", "output",
+    "client", "timers", "contexts" };
+  char line[256];
+  for (auto i = 0; i < 6; ++i) {
+    std::snprintf(line, sizeof(line),
+      ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+      "\"args\":{\"name\":\"%s\"}}",
+      tracks[i].pid, tracks[i].tid, track_names[i]);
+    string += line;
+  }
+
+  const auto count = std::min(m_next, m_entries.size());
+  for (auto i = m_next - count; i < m_next; ++i) {
+    const auto& entry = m_entries[i % m_entries.size()];
+    const auto track = get_track(entry.type);
+    auto length = std::snprintf(line, sizeof(line),
+      ",\n{\"name\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,",
+      get_type_name(entry.type), track.pid, track.tid,
+      to_microseconds(entry.time));
+    if (is_span(entry.type))
+      length += std::snprintf(line + length, sizeof(line) - length,
+        "\"ph\":\"X\",\"dur\":%.3f,", to_microseconds(entry.duration));
+    else
+      length += std::snprintf(line + length, sizeof(line) - length,
+        "\"ph\":\"i\",\"s\":\"t\",");
+
+    if (entry.type == Type::stage)
+      std::snprintf(line + length, sizeof(line) - length,
+        "\"args\":{\"stage\":%d}}", entry.device_index);
+    else if (entry.event.key == Key::timeout)
+      std::snprintf(line + length, sizeof(line) - length,
+        "\"args\":{\"timeout\":\"%ums\"}}",
+        static_cast<unsigned>(entry.event.value));
+    else if (entry.event.key != Key::none)
+      std::snprintf(line + length, sizeof(line) - length,
+        "\"args\":{\"key\":\"%c0x%04X\",\"device\":%d}}",
+        get_state_char(entry.event.state),
+        static_cast<unsigned>(*entry.event.key), entry.device_index);
+    else
+      std::snprintf(line + length, sizeof(line) - length, "\"args\":{}}");
+    string += line;
+  }
+  string += "\n]}\n";
+  return string;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "runtime/KeyEvent.h"
+#include "common/Duration.h"
+#include <array>
+#include <string>
+
+// Keeps the most recent input and output events in a fixed-size ring
+// buffer. Recording a record only copies it, it is formatted when the
+// buffer is dumped, so it can be kept enabled. While tracing, also the
+// spans of the pipeline stages are recorded, to export them as a timeline.
+class FlightRecorder {
+public:
+  enum class Type : uint8_t {
+    input,
+    forwarded,
+    ignored_repeat,
+    timeout_scheduled,
+    output,
+    state_invalid,
+    // spans, which are only recorded while tracing
+    read,
+    translate,
+    stage,
+    flush,
+    write_output,
+    client_messages,
+    deadlines,
+    match_contexts,
+    send_contexts,
+    apply_contexts,
+  };
+
+  void record(Type type, const KeyEvent& event, int device_index,
+    Clock::time_point time) {
+    auto& entry = m_entries[m_next++ % m_entries.size()];
+    entry.time = time.time_since_epoch().count();
+    entry.event = event;
+    entry.device_index = static_cast<int16_t>(device_index);
+    entry.duration = 0;
+    entry.type = type;
+  }
+
+  // the index is the stage index of stage spans
+  void record_span(Type type, const KeyEvent& event, int index,
+      Clock::time_point begin, Clock::time_point end) {
+    record(type, event, index, begin);
+    m_entries[(m_next - 1) % m_entries.size()].duration = (end - begin).count();
+  }
+
+  // oldest first, with the time relative to now
+  std::string format(Clock::time_point now) const;
+
+  // in the Chrome trace event format, which Perfetto can open
+  std::string format_chrome_trace() const;
+
+private:
+  struct Entry {
+    Clock::rep time;
+    Clock::rep duration;
+    KeyEvent event;
+    int16_t device_index;
+    Type type;
+  };
+
+  std::array<Entry, 1024> m_entries{ };
+  size_t m_next{ };
+};
@@ -0,0 +1,213 @@
+
+#include "InputTrace.h"
+#include "runtime/MultiStage.h"
+#include <chrono>
+#include <cstring>
+#include <type_traits>
+
+namespace {
+  const auto trace_magic = uint32_t{ 0x5254484b };
+  const auto trace_version = uint32_t{ 1 };
+  // written at once, so recording does not block on every event
+  const auto max_buffer_size = size_t{ 64 * 1024 };
+  const auto max_flush_interval = std::chrono::seconds(1);
+  const auto max_active_contexts = uint32_t{ 1 << 16 };
+
+  FILE* open_file(const std::filesystem::path& filename, bool write) {
+#if defined(_WIN32)
+    return ::_wfopen(filename.c_str(), write ? L"wb" : L"rb");
+#else
+    return std::fopen(filename.c_str(), write ? "wb" : "rb");
+#endif
+  }
+
+  // FNV-1a, which unlike std::hash is stable between builds
+  void add_hash(uint64_t& hash, const void* data, size_t size) {
+    const auto bytes = static_cast<const unsigned char*>(data);
+    for (auto i = size_t{ }; i < size; ++i)
+      hash = (hash ^ bytes[i]) * 1099511628211ull;
+  }
+
+  template<typename T>
+  void add_hash(uint64_t& hash, const T& value) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    add_hash(hash, &value, sizeof(T));
+  }
+
+  void add_hash(uint64_t& hash, const KeySequence& sequence) {
+    add_hash(hash, static_cast<uint32_t>(sequence.size()));
+    add_hash(hash, sequence.data(), sequence.size() * sizeof(KeyEvent));
+  }
+
+  void add_hash(uint64_t& hash, const std::string& string) {
+    add_hash(hash, static_cast<uint32_t>(string.size()));
+    add_hash(hash, string.data(), string.size());
+  }
+} // namespace
+
+InputTraceWriter::~InputTraceWriter() {
+  if (m_file) {
+    flush();
+    std::fclose(m_file);
+  }
+}
+
+bool InputTraceWriter::open(const std::filesystem::path& filename,
+    Clock::time_point start) {
+  m_file = open_file(filename, true);
+  if (!m_file)
+    return false;
+  m_start = start;
+  m_flushed_at = start;
+  write(trace_magic);
+  write(trace_version);
+  flush();
+  return true;
+}
+
+template<typename T>
+void InputTraceWriter::write(const T& value) {
+  static_assert(std::is_trivially_copyable_v<T>);
+  const auto offset = m_buffer.size();
+  m_buffer.resize(offset + sizeof(T));
+  std::memcpy(m_buffer.data() + offset, &value, sizeof(T));
+}
+
+void InputTraceWriter::write_header(InputTraceRecord::Type type,
+    Clock::time_point time) {
+  const auto elapsed = std::chrono::duration_cast<
+    std::chrono::microseconds>(std::max(time - m_start, Clock::duration::zero()));
+  write(type);
+  write(static_cast<uint64_t>(elapsed.count()));
+}
+
+void InputTraceWriter::write_input(const KeyEvent& event, int device_index,
+    Clock::time_point time) {
+  if (!m_file)
+    return;
+  static_assert(std::is_trivially_copyable_v<KeyEvent>);
+  write_header(InputTraceRecord::Type::input, time);
+  write(event);
+  write(static_cast<int32_t>(device_index));
+  if (m_buffer.size() >= max_buffer_size ||
+      time - m_flushed_at > max_flush_interval) {
+    flush();
+    m_flushed_at = time;
+  }
+}
+
+void InputTraceWriter::write_active_contexts(
+    const std::vector<int>& active_contexts, Clock::time_point time) {
+  if (!m_file)
+    return;
+  write_header(InputTraceRecord::Type::active_contexts, time);
+  write(static_cast<uint32_t>(active_contexts.size()));
+  for (auto index : active_contexts)
+    write(static_cast<int32_t>(index));
+  if (m_buffer.size() >= max_buffer_size)
+    flush();
+}
+
+void InputTraceWriter::write_configuration(const MultiStage& stage,
+    Clock::time_point time) {
+  if (!m_file)
+    return;
+  write_header(InputTraceRecord::Type::configuration, time);
+  write(get_configuration_hash(stage));
+  flush();
+}
+
+void InputTraceWriter::flush() {
+  if (!m_file || m_buffer.empty())
+    return;
+  std::fwrite(m_buffer.data(), 1, m_buffer.size(), m_file);
+  std::fflush(m_file);
+  m_buffer.clear();
+}
+
+InputTraceReader::~InputTraceReader() {
+  if (m_file)
+    std::fclose(m_file);
+}
+
+bool InputTraceReader::open(const std::filesystem::path& filename) {
+  m_file = open_file(filename, false);
+  auto magic = uint32_t{ };
+  auto version = uint32_t{ };
+  return (m_file && read(&magic) && read(&version) &&
+    magic == trace_magic && version == trace_version);
+}
+
+template<typename T>
+bool InputTraceReader::read(T* value) {
+  static_assert(std::is_trivially_copyable_v<T>);
+  return (std::fread(value, sizeof(T), 1, m_file) == 1);
+}
+
+bool InputTraceReader::read(InputTraceRecord& record) {
+  if (!m_file || !read(&record.type) || !read(&record.time))
+    return false;
+
+  switch (record.type) {
+    case InputTraceRecord::Type::input: {
+      auto device_index = int32_t{ };
+      if (!read(&record.event) || !read(&device_index))
+        return false;
+      record.device_index = device_index;
+      return true;
+    }
+
+    case InputTraceRecord::Type::active_contexts: {
+      auto count = uint32_t{ };
+      if (!read(&count) || count > max_active_contexts)
+        return false;
+      record.active_contexts.resize(count);
+      for (auto& index : record.active_contexts) {
+        auto value = int32_t{ };
+        if (!read(&value))
+          return false;
+        index = value;
+      }
+      return true;
+    }
+
+    case InputTraceRecord::Type::configuration:
+      return read(&record.configuration_hash);
+  }
+  return false;
+}
+
+uint64_t get_configuration_hash(const MultiStage& multi_stage) {
+  auto hash = uint64_t{ 14695981039346656037ull };
+  for (const auto& stage : multi_stage.stages()) {
+    add_hash(hash, static_cast<uint32_t>(stage->contexts().size()));
+    for (const auto& context : stage->contexts()) {
+      add_hash(hash, static_cast<uint32_t>(context.inputs.size()));
+      for (const auto& input : context.inputs) {
+        add_hash(hash, input.input);
+        add_hash(hash, static_cast<int32_t>(input.output_index));
+      }
+      add_hash(hash, static_cast<uint32_t>(context.outputs.size()));
+      for (const auto& output : context.outputs)
+        add_hash(hash, output);
+      add_hash(hash, static_cast<uint32_t>(context.command_outputs.size()));
+      for (const auto& command : context.command_outputs) {
+        add_hash(hash, command.output);
+        add_hash(hash, static_cast<int32_t>(command.index));
+      }
+      add_hash(hash, context.device_filter.string);
+      add_hash(hash, context.device_id_filter.string);
+      add_hash(hash, context.modifier_filter);
+      add_hash(hash, context.invert_modifier_filter);
+      add_hash(hash, context.fallthrough);
+    }
+    for (const auto& [logical, left, right] : stage->logical_keys().definitions()) {
+      add_hash(hash, logical);
+      add_hash(hash, left);
+      add_hash(hash, right);
+    }
+    for (auto key : stage->forward_modifiers())
+      add_hash(hash, key);
+  }
+  return hash;
+}
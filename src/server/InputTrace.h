@@ -0,0 +1,71 @@
+#pragma once
+
+#include "runtime/KeyEvent.h"
+#include "common/Duration.h"
+#include <cstdio>
+#include <filesystem>
+#include <optional>
+#include <vector>
+
+class MultiStage;
+
+// A compact binary recording of the input the stages received, which
+// can be replayed offline with keymapper-replay.
+struct InputTraceRecord {
+  enum class Type : uint8_t { input = 1, active_contexts, configuration };
+
+  Type type;
+  // microseconds since the recording started
+  uint64_t time;
+  KeyEvent event;
+  int device_index;
+  std::vector<int> active_contexts;
+  uint64_t configuration_hash;
+};
+
+class InputTraceWriter {
+public:
+  InputTraceWriter() = default;
+  InputTraceWriter(const InputTraceWriter&) = delete;
+  InputTraceWriter& operator=(const InputTraceWriter&) = delete;
+  ~InputTraceWriter();
+
+  bool open(const std::filesystem::path& filename, Clock::time_point start);
+  void write_input(const KeyEvent& event, int device_index,
+    Clock::time_point time);
+  void write_active_contexts(const std::vector<int>& active_contexts,
+    Clock::time_point time);
+  void write_configuration(const MultiStage& stage, Clock::time_point time);
+  void flush();
+
+private:
+  template<typename T>
+  void write(const T& value);
+  void write_header(InputTraceRecord::Type type, Clock::time_point time);
+
+  FILE* m_file{ };
+  Clock::time_point m_start;
+  Clock::time_point m_flushed_at;
+  std::vector<char> m_buffer;
+};
+
+class InputTraceReader {
+public:
+  InputTraceReader() = default;
+  InputTraceReader(const InputTraceReader&) = delete;
+  InputTraceReader& operator=(const InputTraceReader&) = delete;
+  ~InputTraceReader();
+
+  bool open(const std::filesystem::path& filename);
+  // returns false at the end of the trace
+  bool read(InputTraceRecord& record);
+
+private:
+  template<typename T>
+  bool read(T* value);
+
+  FILE* m_file{ };
+};
+
+// identifies a configuration by the mappings, stable between builds
+uint64_t get_configuration_hash(const MultiStage& stage);
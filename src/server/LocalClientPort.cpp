@@ -0,0 +1,222 @@
+
+#include "LocalClientPort.h"
+#include <cmath>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+namespace {
+  void create_pipe(std::array<int, 2>& fds) {
+    if (::pipe(fds.data()) != 0)
+      return;
+    for (auto fd : fds) {
+      ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+      ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+  }
+
+  void close_pipe(std::array<int, 2>& fds) {
+    for (auto fd : fds)
+      if (fd >= 0)
+        ::close(fd);
+  }
+
+  void write_pipe(const std::array<int, 2>& fds) {
+    // a full pipe is readable already
+    [[maybe_unused]] const auto result = ::write(fds[1], "", 1);
+  }
+} // namespace
+
+class LocalClientPort::Recorder : public MessageHandler {
+public:
+  Recorder(LocalClientPort& port, MessageHandler& handler)
+    : m_port(port), m_handler(handler) {
+  }
+
+private:
+  void on_configuration_message(MultiStagePtr stage) override {
+    m_handler.on_configuration_message(std::move(stage));
+  }
+  void on_grab_device_filters_message(
+      std::vector<GrabDeviceFilter> filters) override {
+    m_port.m_grab_device_filters = filters;
+    m_handler.on_grab_device_filters_message(std::move(filters));
+  }
+  void on_directives_message(
+      const std::vector<std::string>& directives) override {
+    m_port.m_directives = directives;
+    m_handler.on_directives_message(directives);
+  }
+  void on_active_contexts_message(const std::vector<int>& context_indices,
+      const ContextSwitchTimes& times) override {
+    m_handler.on_active_contexts_message(context_indices, times);
+  }
+  void on_set_virtual_key_state_message(Key key, KeyState state) override {
+    m_handler.on_set_virtual_key_state_message(key, state);
+  }
+  void on_set_virtual_key_states_message(const std::vector<Key>& keys,
+      KeyState state) override {
+    m_handler.on_set_virtual_key_states_message(keys, state);
+  }
+  void on_validate_state_message() override {
+    m_handler.on_validate_state_message();
+  }
+  void on_request_next_key_info_message() override {
+    m_handler.on_request_next_key_info_message();
+  }
+  void on_inject_input_message(const KeySequence& sequence) override {
+    m_handler.on_inject_input_message(sequence);
+  }
+  void on_inject_output_message(const KeySequence& sequence) override {
+    m_handler.on_inject_output_message(sequence);
+  }
+  void on_request_statistics_message(bool recent_events) override {
+    m_handler.on_request_statistics_message(recent_events);
+  }
+  void on_request_input_profiles_message() override {
+    m_handler.on_request_input_profiles_message();
+  }
+
+  LocalClientPort& m_port;
+  MessageHandler& m_handler;
+};
+
+LocalChannel::LocalChannel() {
+  create_pipe(m_connect_pipe);
+  create_pipe(m_server_pipe);
+  create_pipe(m_client_pipe);
+}
+
+LocalChannel::~LocalChannel() {
+  close_pipe(m_connect_pipe);
+  close_pipe(m_server_pipe);
+  close_pipe(m_client_pipe);
+}
+
+void LocalChannel::wake_connect() {
+  write_pipe(m_connect_pipe);
+}
+
+void LocalChannel::wake_server() {
+  write_pipe(m_server_pipe);
+}
+
+void LocalChannel::wake_client() {
+  write_pipe(m_client_pipe);
+}
+
+void wait_for_local_channel(int fd, std::optional<Duration> timeout) {
+  auto poll_fd = pollfd{ fd, POLLIN, 0 };
+  const auto milliseconds = (timeout ? static_cast<int>(std::ceil(
+    std::chrono::duration<double, std::milli>(*timeout).count())) : -1);
+  // interrupted by a signal, the caller checks the connection anyway
+  ::poll(&poll_fd, 1, milliseconds);
+}
+
+void drain_local_channel(int fd) {
+  auto buffer = std::array<char, 64>{ };
+  while (::read(fd, buffer.data(), buffer.size()) > 0) { }
+}
+
+LocalClientPort::LocalClientPort(LocalChannelPtr channel)
+  : m_channel(std::move(channel)) {
+}
+
+bool LocalClientPort::accept() {
+  if (!m_channel->connected.load(std::memory_order_acquire))
+    wait_for_local_channel(m_channel->connect_fd(), std::nullopt);
+  drain_local_channel(m_channel->connect_fd());
+  if (!m_channel->connected.load(std::memory_order_acquire))
+    return false;
+  m_channel->accepted.store(true, std::memory_order_release);
+  return true;
+}
+
+void LocalClientPort::disconnect() {
+  // also called by the signal handler, to interrupt waiting for messages
+  m_channel->connected.store(false, std::memory_order_release);
+  m_channel->accepted.store(false, std::memory_order_release);
+  m_channel->wake_server();
+  m_channel->wake_client();
+}
+
+bool LocalClientPort::send(LocalChannel::ClientMessage message) {
+  if (!m_channel->connected.load(std::memory_order_acquire))
+    return false;
+  m_channel->to_client.push(std::move(message));
+  m_channel->wake_client();
+  return true;
+}
+
+bool LocalClientPort::send_triggered_actions(const std::vector<int>& actions) {
+  return send([actions](ServerPort::MessageHandler& handler) {
+    for (auto action : actions)
+      handler.on_execute_action_message(action);
+  });
+}
+
+bool LocalClientPort::send_virtual_key_state(Key key, KeyState state) {
+  return send([key, state](ServerPort::MessageHandler& handler) {
+    handler.on_virtual_key_state_message(key, state);
+  });
+}
+
+bool LocalClientPort::send_virtual_key_states(
+    const std::vector<KeyEvent>& states) {
+  return send([states](ServerPort::MessageHandler& handler) {
+    for (const auto& event : states)
+      handler.on_virtual_key_state_message(event.key, event.state);
+  });
+}
+
+bool LocalClientPort::send_next_key_info(Key key,
+    const DeviceDesc& device_desc) {
+  return send([key, device_desc](ServerPort::MessageHandler& handler) {
+    handler.on_next_key_info_message(key, device_desc);
+  });
+}
+
+bool LocalClientPort::send_statistics(const std::string& statistics) {
+  return send([statistics](ServerPort::MessageHandler& handler) {
+    handler.on_statistics_message(statistics);
+  });
+}
+
+bool LocalClientPort::send_input_profiles(const InputProfiles& profiles) {
+  return send([profiles](ServerPort::MessageHandler& handler) {
+    handler.on_input_profiles_message(profiles);
+  });
+}
+
+bool LocalClientPort::read_messages(MessageHandler& handler,
+    std::optional<Duration> timeout) {
+  const auto connected = [&]() {
+    return m_channel->connected.load(std::memory_order_acquire);
+  };
+  if (m_channel->to_server.empty() && connected() &&
+      timeout != Duration::zero())
+    wait_for_local_channel(m_channel->server_fd(), timeout);
+  drain_local_channel(m_channel->server_fd());
+
+  auto recorder = Recorder(*this, handler);
+  while (m_channel->to_server.apply_next(recorder))
+    ;
+  return connected();
+}
+
+std::unique_ptr<IClientPort> LocalClientPort::create_session() const {
+  // only one client can connect, a parked session stays disconnected
+  return std::make_unique<LocalClientPort>(std::make_shared<LocalChannel>());
+}
+
+void LocalClientPort::swap_session(IClientPort& other_port) {
+  auto& other = static_cast<LocalClientPort&>(other_port);
+  std::swap(m_channel, other.m_channel);
+  std::swap(m_grab_device_filters, other.m_grab_device_filters);
+  std::swap(m_directives, other.m_directives);
+}
+
+void LocalClientPort::restore_session(MessageHandler& handler) {
+  handler.on_grab_device_filters_message(m_grab_device_filters);
+  handler.on_directives_message(m_directives);
+}
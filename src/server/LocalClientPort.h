@@ -0,0 +1,83 @@
+#pragma once
+
+#include "ClientPort.h"
+#include "MessageQueue.h"
+#include "client/ServerPort.h"
+#include <array>
+
+// Connects a client and a server, which run in one process, without
+// serializing the messages. The queues allow one thread on each side.
+// Each side waits on the read end of a pipe, which the other side writes
+// to, when it pushed a message or the connection changed.
+class LocalChannel {
+public:
+  using ClientMessage = std::function<void(ServerPort::MessageHandler&)>;
+
+  LocalChannel();
+  LocalChannel(const LocalChannel&) = delete;
+  LocalChannel& operator=(const LocalChannel&) = delete;
+  ~LocalChannel();
+
+  MessageQueue to_server;
+  LockFreeQueue<ClientMessage, 64> to_client;
+  std::atomic<bool> connected{ };
+  // the client can only connect again, once the server disconnected
+  std::atomic<bool> accepted{ };
+
+  // readable when the client connected
+  int connect_fd() const { return m_connect_pipe[0]; }
+  // readable when a message was pushed or the connection changed
+  int server_fd() const { return m_server_pipe[0]; }
+  int client_fd() const { return m_client_pipe[0]; }
+  // only async-signal-safe functions are called
+  void wake_connect();
+  void wake_server();
+  void wake_client();
+
+private:
+  std::array<int, 2> m_connect_pipe{ -1, -1 };
+  std::array<int, 2> m_server_pipe{ -1, -1 };
+  std::array<int, 2> m_client_pipe{ -1, -1 };
+};
+using LocalChannelPtr = std::shared_ptr<LocalChannel>;
+
+// returns when the pipe is readable or the timeout elapsed
+void wait_for_local_channel(int fd, std::optional<Duration> timeout);
+// reads everything written to the pipe
+void drain_local_channel(int fd);
+
+class LocalClientPort : public IClientPort {
+public:
+  explicit LocalClientPort(LocalChannelPtr channel);
+  Socket socket() const override { return m_channel->server_fd(); }
+  Socket listen_socket() const override { return m_channel->connect_fd(); }
+  bool version_mismatch() const override { return false; }
+  bool listen() override { return true; }
+  // waits until the client connected
+  bool accept() override;
+  void disconnect() override;
+  bool send_triggered_actions(const std::vector<int>& actions) override;
+  bool send_virtual_key_state(Key key, KeyState state) override;
+  bool send_virtual_key_states(const std::vector<KeyEvent>& states) override;
+  bool send_next_key_info(Key key, const DeviceDesc& device_desc) override;
+  bool send_statistics(const std::string& statistics) override;
+  bool send_input_profiles(const InputProfiles& profiles) override;
+  bool read_messages(MessageHandler& handler,
+    std::optional<Duration> timeout) override;
+  // the client sends its configuration on each connection
+  void set_snapshot_filename(std::filesystem::path filename) override { }
+  bool load_snapshot(MessageHandler& handler) override { return false; }
+  std::unique_ptr<IClientPort> create_session() const override;
+  void swap_session(IClientPort& other) override;
+  void restore_session(MessageHandler& handler) override;
+
+private:
+  bool send(LocalChannel::ClientMessage message);
+
+  // passes the received messages on and keeps what a session restores
+  class Recorder;
+
+  LocalChannelPtr m_channel;
+  std::vector<GrabDeviceFilter> m_grab_device_filters;
+  std::vector<std::string> m_directives;
+};
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <thread>
+#include <utility>
+
+// Queue of a fixed capacity for a single producer and a single consumer
+// thread. It is not blocking or locking, except when pushing to a full queue.
+template<typename T, size_t Size>
+class LockFreeQueue {
+public:
+  // producer thread
+  void push(T value) {
+    const auto write_index = m_write_index.load(std::memory_order_relaxed);
+
+    // wait until consumer made room
+    while (write_index - m_read_index.load(std::memory_order_acquire) >= Size)
+      std::this_thread::yield();
+
+    m_values[write_index % Size] = std::move(value);
+    m_write_index.store(write_index + 1, std::memory_order_release);
+  }
+
+  // producer thread, returns false instead of waiting when queue is full
+  bool try_push(T value) {
+    const auto write_index = m_write_index.load(std::memory_order_relaxed);
+    if (write_index - m_read_index.load(std::memory_order_acquire) >= Size)
+      return false;
+
+    m_values[write_index % Size] = std::move(value);
+    m_write_index.store(write_index + 1, std::memory_order_release);
+    return true;
+  }
+
+  // consumer thread, returns false when queue is empty
+  bool pop(T& value) {
+    const auto read_index = m_read_index.load(std::memory_order_relaxed);
+    if (read_index == m_write_index.load(std::memory_order_acquire))
+      return false;
+
+    value = std::exchange(m_values[read_index % Size], T{ });
+    m_read_index.store(read_index + 1, std::memory_order_release);
+    return true;
+  }
+
+  // consumer thread, returns nullptr when queue is empty
+  const T* front() const {
+    const auto read_index = m_read_index.load(std::memory_order_relaxed);
+    if (read_index == m_write_index.load(std::memory_order_acquire))
+      return nullptr;
+    return &m_values[read_index % Size];
+  }
+
+  bool empty() const {
+    return (m_read_index.load(std::memory_order_acquire) ==
+            m_write_index.load(std::memory_order_acquire));
+  }
+
+  // only while neither thread is accessing it
+  void clear() {
+    for (auto& value : m_values)
+      value = T{ };
+    m_read_index.store(0);
+    m_write_index.store(0);
+  }
+
+private:
+  std::array<T, Size> m_values{ };
+  std::atomic<size_t> m_read_index{ };
+  std::atomic<size_t> m_write_index{ };
+};
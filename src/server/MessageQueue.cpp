@@ -0,0 +1,116 @@
+
+#include "MessageQueue.h"
+#include <memory>
+#include <utility>
+
+void MessageQueue::push(Message message) {
+  m_messages.push(std::move(message));
+}
+
+void MessageQueue::close() {
+  m_closed.store(true, std::memory_order_release);
+}
+
+bool MessageQueue::apply_next(IClientPort::MessageHandler& handler) {
+  auto message = Message{ };
+  if (!m_messages.pop(message))
+    return false;
+  message(handler);
+  return true;
+}
+
+bool MessageQueue::empty() const {
+  return m_messages.empty();
+}
+
+void MessageQueue::clear() {
+  m_messages.clear();
+  m_closed.store(false);
+}
+
+void MessageQueue::on_configuration_message(MultiStagePtr stage) {
+  // std::function needs to be copyable
+  push([stage = std::make_shared<MultiStagePtr>(std::move(stage))](
+      IClientPort::MessageHandler& handler) {
+    handler.on_configuration_message(std::move(*stage));
+  });
+}
+
+void MessageQueue::on_grab_device_filters_message(
+    std::vector<GrabDeviceFilter> filters) {
+  push([filters = std::move(filters)](
+      IClientPort::MessageHandler& handler) mutable {
+    handler.on_grab_device_filters_message(std::move(filters));
+  });
+}
+
+void MessageQueue::on_directives_message(
+    const std::vector<std::string>& directives) {
+  push([directives](IClientPort::MessageHandler& handler) {
+    handler.on_directives_message(directives);
+  });
+}
+
+void MessageQueue::on_active_contexts_message(
+    const std::vector<int>& context_indices,
+    const ContextSwitchTimes& times) {
+  push([context_indices, times](IClientPort::MessageHandler& handler) {
+    handler.on_active_contexts_message(context_indices, times);
+  });
+}
+
+void MessageQueue::on_set_virtual_key_state_message(Key key, KeyState state) {
+  push([key, state](IClientPort::MessageHandler& handler) {
+    handler.on_set_virtual_key_state_message(key, state);
+  });
+}
+
+void MessageQueue::on_set_virtual_key_states_message(
+    const std::vector<Key>& keys, KeyState state) {
+  push([keys, state](IClientPort::MessageHandler& handler) {
+    handler.on_set_virtual_key_states_message(keys, state);
+  });
+}
+
+void MessageQueue::on_validate_state_message() {
+  push([](IClientPort::MessageHandler& handler) {
+    handler.on_validate_state_message();
+  });
+}
+
+void MessageQueue::on_request_next_key_info_message() {
+  push([](IClientPort::MessageHandler& handler) {
+    handler.on_request_next_key_info_message();
+  });
+}
+
+void MessageQueue::on_inject_input_message(const KeySequence& sequence) {
+  push([sequence](IClientPort::MessageHandler& handler) {
+    handler.on_inject_input_message(sequence);
+  });
+}
+
+void MessageQueue::on_inject_output_message(const KeySequence& sequence) {
+  push([sequence](IClientPort::MessageHandler& handler) {
+    handler.on_inject_output_message(sequence);
+  });
+}
+
+void MessageQueue::on_request_statistics_message(bool recent_events) {
+  push([recent_events](IClientPort::MessageHandler& handler) {
+    handler.on_request_statistics_message(recent_events);
+  });
+}
+
+void MessageQueue::on_request_input_profiles_message() {
+  push([](IClientPort::MessageHandler& handler) {
+    handler.on_request_input_profiles_message();
+  });
+}
+
+void MessageQueue::on_activate_configuration_message(size_t hash,
+    const std::function<MultiStagePtr()>& build_stage) {
+  push([hash, build_stage](IClientPort::MessageHandler& handler) {
+    handler.on_activate_configuration_message(hash, build_stage);
+  });
+}
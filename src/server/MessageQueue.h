@@ -0,0 +1,46 @@
+#pragma once
+
+#include "ClientPort.h"
+#include "LockFreeQueue.h"
+#include <atomic>
+#include <functional>
+
+// Forwards the client messages from the thread reading them to the
+// thread handling them. Pushing is only done by the reading thread,
+// applying only by the handling thread.
+class MessageQueue : public IClientPort::MessageHandler {
+public:
+  using Message = std::function<void(IClientPort::MessageHandler&)>;
+
+  // reading thread
+  void push(Message message);
+  void close();
+
+  // handling thread, returns false when queue is empty
+  bool apply_next(IClientPort::MessageHandler& handler);
+  bool empty() const;
+  bool closed() const { return m_closed.load(std::memory_order_acquire); }
+  // only while no thread is pushing
+  void clear();
+
+private:
+  void on_configuration_message(MultiStagePtr stage) override;
+  void on_grab_device_filters_message(std::vector<GrabDeviceFilter> filters) override;
+  void on_directives_message(const std::vector<std::string>& directives) override;
+  void on_active_contexts_message(const std::vector<int>& context_indices,
+    const ContextSwitchTimes& times) override;
+  void on_set_virtual_key_state_message(Key key, KeyState state) override;
+  void on_set_virtual_key_states_message(const std::vector<Key>& keys,
+    KeyState state) override;
+  void on_validate_state_message() override;
+  void on_request_next_key_info_message() override;
+  void on_inject_input_message(const KeySequence& sequence) override;
+  void on_inject_output_message(const KeySequence& sequence) override;
+  void on_request_statistics_message(bool recent_events) override;
+  void on_request_input_profiles_message() override;
+  void on_activate_configuration_message(size_t hash,
+    const std::function<MultiStagePtr()>& build_stage) override;
+
+  LockFreeQueue<Message, 64> m_messages;
+  std::atomic<bool> m_closed{ };
+};
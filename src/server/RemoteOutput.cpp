@@ -0,0 +1,153 @@
+
+#include "RemoteOutput.h"
+#include <algorithm>
+#include <cstring>
+
+namespace {
+  const auto magic = uint32_t{ 0x31524D4B }; // KMR1
+  const auto header_size = 3 * sizeof(uint32_t) + 2 * sizeof(uint16_t);
+  const auto event_size = 2 * sizeof(uint16_t);
+  const auto keepalive_repeats = 3;
+
+  template<typename T>
+  void write_value(std::vector<char>& buffer, T value) {
+    const auto offset = buffer.size();
+    buffer.resize(offset + sizeof(T));
+    std::memcpy(buffer.data() + offset, &value, sizeof(T));
+  }
+
+  template<typename T>
+  T read_value(const char*& data) {
+    auto value = T{ };
+    std::memcpy(&value, data, sizeof(T));
+    data += sizeof(T);
+    return value;
+  }
+
+  void update_keys_down(std::vector<Key>& keys_down, const KeyEvent& event) {
+    const auto it = std::find(keys_down.begin(), keys_down.end(), event.key);
+    if (event.state == KeyState::Down && it == keys_down.end())
+      keys_down.push_back(event.key);
+    else if (event.state == KeyState::Up && it != keys_down.end())
+      keys_down.erase(it);
+  }
+} // namespace
+
+RemoteOutputWriter::RemoteOutputWriter(uint32_t session)
+  : m_session(session) {
+}
+
+void RemoteOutputWriter::add(const KeyEvent& event) {
+  m_events.push_back(event);
+}
+
+bool RemoteOutputWriter::flush(const Send& send, Clock::time_point now) {
+  auto succeeded = true;
+  for (auto i = size_t{ }; i < m_events.size(); i += max_events)
+    succeeded &= send_datagram(send, m_events.data() + i,
+      std::min(max_events, m_events.size() - i), now);
+  if (!m_events.empty())
+    m_keepalives_pending = keepalive_repeats;
+  m_events.clear();
+  return succeeded;
+}
+
+std::optional<Clock::time_point> RemoteOutputWriter::keepalive_at() const {
+  if (m_keys_down.empty() && !m_keepalives_pending)
+    return { };
+  return m_sent_at + keepalive_interval;
+}
+
+bool RemoteOutputWriter::send_keepalive(const Send& send,
+    Clock::time_point now) {
+  if (m_keepalives_pending > 0)
+    --m_keepalives_pending;
+  return send_datagram(send, nullptr, 0, now);
+}
+
+bool RemoteOutputWriter::send_datagram(const Send& send,
+    const KeyEvent* events, size_t count, Clock::time_point now) {
+  for (auto i = size_t{ }; i < count; ++i)
+    update_keys_down(m_keys_down, events[i]);
+
+  m_buffer.clear();
+  write_value(m_buffer, magic);
+  write_value(m_buffer, m_session);
+  write_value(m_buffer, ++m_sequence);
+  write_value(m_buffer, static_cast<uint16_t>(count));
+  write_value(m_buffer, static_cast<uint16_t>(m_keys_down.size()));
+  for (auto i = size_t{ }; i < count; ++i) {
+    write_value(m_buffer, static_cast<uint16_t>(events[i].key));
+    write_value(m_buffer, static_cast<uint16_t>(
+      static_cast<uint16_t>(events[i].state) << KeyEvent::value_bits |
+      events[i].value));
+  }
+  for (auto key : m_keys_down)
+    write_value(m_buffer, static_cast<uint16_t>(key));
+  m_sent_at = now;
+  return send(m_buffer.data(), m_buffer.size());
+}
+
+//--------------------------------------------------------------------
+
+bool RemoteOutputReader::read(const char* data, size_t size,
+    KeySequence& output) {
+  if (size < header_size)
+    return false;
+  const auto end = data + size;
+  if (read_value<uint32_t>(data) != magic)
+    return false;
+  const auto session = read_value<uint32_t>(data);
+  const auto sequence = read_value<uint32_t>(data);
+  const auto event_count = read_value<uint16_t>(data);
+  const auto keys_down_count = read_value<uint16_t>(data);
+  if (header_size + event_count * event_size +
+      keys_down_count * sizeof(uint16_t) != size)
+    return false;
+
+  if (session != m_session) {
+    // sender restarted, it does not know the keys which are down
+    release_keys(output);
+    m_session = session;
+  }
+  else {
+    // ignore duplicated and reordered datagrams
+    const auto distance = static_cast<int32_t>(sequence - m_sequence);
+    if (distance <= 0)
+      return true;
+    m_lost_datagrams += static_cast<size_t>(distance - 1);
+  }
+  m_sequence = sequence;
+
+  for (auto i = 0; i < event_count; ++i) {
+    const auto key = static_cast<Key>(read_value<uint16_t>(data));
+    const auto bits = read_value<uint16_t>(data);
+    const auto event = KeyEvent(key,
+      static_cast<KeyState>(bits >> KeyEvent::value_bits),
+      static_cast<KeyEvent::value_t>(bits & ((1 << KeyEvent::value_bits) - 1)));
+    update_keys_down(m_keys_down, event);
+    output.push_back(event);
+  }
+
+  // recover the release of keys in lost datagrams
+  m_sender_keys_down.clear();
+  while (data < end)
+    m_sender_keys_down.push_back(
+      static_cast<Key>(read_value<uint16_t>(data)));
+  for (auto it = m_keys_down.begin(); it != m_keys_down.end(); )
+    if (std::find(m_sender_keys_down.begin(), m_sender_keys_down.end(),
+          *it) == m_sender_keys_down.end()) {
+      output.emplace_back(*it, KeyState::Up);
+      it = m_keys_down.erase(it);
+    }
+    else {
+      ++it;
+    }
+  return true;
+}
+
+void RemoteOutputReader::release_keys(KeySequence& output) {
+  for (auto key : m_keys_down)
+    output.emplace_back(key, KeyState::Up);
+  m_keys_down.clear();
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "runtime/KeyEvent.h"
+#include "common/Duration.h"
+#include <functional>
+#include <optional>
+#include <vector>
+
+// Streams the output to another machine, which injects it.
+// One datagram is sent per flush, it contains a sequence number, the
+// events and the keys which are down afterwards. The receiver releases
+// the keys whose release was lost. While keys are down, the keys down
+// are also sent periodically, so the receiver can tell when the sender
+// stopped.
+class RemoteOutputWriter {
+public:
+  using Send = std::function<bool(const char* data, size_t size)>;
+  static const size_t max_events = 256;
+  static constexpr auto keepalive_interval = std::chrono::milliseconds(100);
+
+  explicit RemoteOutputWriter(uint32_t session = 0);
+  void add(const KeyEvent& event);
+  // sends the added events, in several datagrams when there are many
+  bool flush(const Send& send, Clock::time_point now);
+  std::optional<Clock::time_point> keepalive_at() const;
+  bool send_keepalive(const Send& send, Clock::time_point now);
+
+private:
+  bool send_datagram(const Send& send, const KeyEvent* events,
+    size_t count, Clock::time_point now);
+
+  uint32_t m_session;
+  uint32_t m_sequence{ };
+  KeySequence m_events;
+  std::vector<Key> m_keys_down;
+  std::vector<char> m_buffer;
+  Clock::time_point m_sent_at;
+  // keys down are sent a few times after the last release
+  int m_keepalives_pending{ };
+};
+
+class RemoteOutputReader {
+public:
+  // after this the sender is considered stopped
+  static constexpr auto release_timeout = std::chrono::seconds(1);
+
+  // appends the events, followed by the release of the keys which are
+  // not down on the sender. returns false when the datagram is invalid
+  bool read(const char* data, size_t size, KeySequence& output);
+  // appends the release of all keys down
+  void release_keys(KeySequence& output);
+  bool has_keys_down() const { return !m_keys_down.empty(); }
+  size_t lost_datagrams() const { return m_lost_datagrams; }
+
+private:
+  std::optional<uint32_t> m_session;
+  uint32_t m_sequence{ };
+  std::vector<Key> m_keys_down;
+  size_t m_lost_datagrams{ };
+
+  // temporary buffer
+  std::vector<Key> m_sender_keys_down;
+};
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <vector>
+
+// Queue, which grows on demand and removes from the front in constant
+// time. The capacity is a power of two, so the indices can be masked.
+template<typename T>
+class RingBuffer {
+public:
+  bool empty() const { return (m_begin == m_end); }
+  size_t size() const { return m_end - m_begin; }
+  size_t capacity() const { return m_values.size(); }
+
+  const T& operator[](size_t index) const {
+    assert(index < size());
+    return m_values[(m_begin + index) & mask()];
+  }
+
+  T& operator[](size_t index) {
+    assert(index < size());
+    return m_values[(m_begin + index) & mask()];
+  }
+
+  const T& front() const { return (*this)[0]; }
+
+  void push_back(const T& value) {
+    if (size() == capacity())
+      grow(capacity() ? capacity() * 2 : 16);
+    m_values[m_end++ & mask()] = value;
+  }
+
+  void pop_front() {
+    assert(!empty());
+    ++m_begin;
+  }
+
+  void pop_front(size_t count) {
+    assert(count <= size());
+    m_begin += count;
+  }
+
+  void pop_back(size_t count) {
+    assert(count <= size());
+    m_end -= count;
+  }
+
+  void clear() {
+    m_begin = m_end = 0;
+  }
+
+  void reserve(size_t size) {
+    auto capacity = size_t{ 16 };
+    while (capacity < size)
+      capacity *= 2;
+    if (capacity > this->capacity())
+      grow(capacity);
+  }
+
+private:
+  size_t mask() const { return m_values.size() - 1; }
+
+  void grow(size_t capacity) {
+    auto values = std::vector<T>(capacity);
+    const auto size = this->size();
+    for (auto i = size_t{ }; i < size; ++i)
+      values[i] = (*this)[i];
+    m_values.swap(values);
+    m_begin = 0;
+    m_end = size;
+  }
+
+  std::vector<T> m_values;
+  // indices only grow, they are masked when accessing
+  size_t m_begin{ };
+  size_t m_end{ };
+};
@@ -1,36 +1,244 @@
 
 #include "ServerState.h"
-#include "server/verbose_debug_io.h"
 #include "runtime/Timeout.h"
+#include "runtime/Tracepoints.h"
 #include "common/output.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+
+namespace {
+  // a configuration is applied when no key is hold, but not later than
+  const auto max_pending_configuration_delay = std::chrono::seconds(1);
+
+  // injected output is sent in batches of about this many events per interval,
+  // so long texts are not dropped and input is still handled in between
+  const auto default_inject_rate = 10;
+  const auto inject_interval = std::chrono::milliseconds(1);
+
+  // unmapped wheel events are sent at most once per window, the following
+  // ones are combined, so high-resolution wheels do not flood the output
+  const auto default_wheel_aggregation = std::chrono::milliseconds(4);
+  const auto max_wheel_value = (1 << KeyEvent::value_bits) - 1;
+
+  // output with delays is played on one of these lanes, the vector is
+  // reserved up front, so lanes stay in place while one is played
+  const auto max_lanes = size_t{ 8 };
+
+  bool is_injected_key_down(const KeyEvent& event) {
+    return (event.state == KeyState::Down && event.key != Key::timeout &&
+      !is_action_key(event.key) && !is_virtual_key(event.key));
+  }
+
+  bool is_injected_key_up(const KeyEvent& event) {
+    return (event.state == KeyState::Up && event.key != Key::timeout &&
+      !is_action_key(event.key) && !is_virtual_key(event.key));
+  }
+
+  // longest input or output sequence of any stage
+  size_t get_max_sequence_length(const MultiStage& stage) {
+    auto length = size_t{ };
+    for (const auto& s : stage.stages())
+      length = std::max({ length, s->capacity().max_input_length,
+        s->capacity().max_output_length });
+    return length;
+  }
+
+  std::vector<std::string> get_match_engine_names(const MultiStage& stage) {
+    auto names = std::vector<std::string>();
+    for (auto engine : stage.match_engines())
+      names.emplace_back(get_match_engine_name(engine));
+    return names;
+  }
+
+  std::string join(const std::vector<std::string>& strings) {
+    auto string = std::string();
+    for (const auto& s : strings)
+      string += (string.empty() ? "" : ", ") + s;
+    return string;
+  }
+
+  void append_memory_usage(std::string& string, const char* name,
+      size_t bytes) {
+    char line[64];
+    std::snprintf(line, sizeof(line), "%-18s %10zu\n", name, bytes);
+    string += line;
+  }
+} // namespace
 
 ServerState::ServerState(std::unique_ptr<IClientPort> client)
   : m_client(std::move(client)),
-    m_stage(std::make_unique<MultiStage>()) {
+    m_stage(std::make_unique<MultiStage>()),
+    m_inject_rate(default_inject_rate),
+    m_wheel_aggregation(default_wheel_aggregation) {
 }
 
 void ServerState::on_configuration_message(std::unique_ptr<MultiStage> stage) {
   if (!stage)
     return error("Receiving configuration failed");
+  apply_stage_options(*stage);
+
+  // switch when stage is clear, to not release keys which are hold
+  if (!m_stage->is_clear()) {
+    verbose("Deferring configuration update");
+    m_pending_stage = std::move(stage);
+    m_pending_active_contexts.reset();
+    m_pending_stage_deadline = now() + max_pending_configuration_delay;
+    on_next_deadline_changed();
+    return;
+  }
   reset_configuration(std::move(stage));  
 }
 
+void ServerState::on_activate_configuration_message(size_t hash,
+    const std::function<MultiStagePtr()>& build_stage) {
+  auto& cached = m_cached_stages;
+  const auto it = std::find_if(cached.begin(), cached.end(),
+    [&](const auto& stage) { return stage->configuration_hash() == hash; });
+  if (it == cached.end())
+    return on_configuration_message(build_stage());
+
+  auto stage = std::move(*it);
+  cached.erase(it);
+  on_configuration_message(std::move(stage));
+}
+
+void ServerState::cache_stage(std::unique_ptr<MultiStage> stage) {
+  if (!stage || !stage->configuration_hash())
+    return;
+  // it starts clear when it is activated again
+  stage->validate_state([](Key) { return false; });
+  auto& cached = m_cached_stages;
+  cached.erase(std::remove_if(cached.begin(), cached.end(),
+    [&](const auto& other) {
+      return other->configuration_hash() == stage->configuration_hash();
+    }), cached.end());
+  cached.push_back(std::move(stage));
+  if (cached.size() > max_cached_configurations)
+    cached.erase(cached.begin());
+}
+
+void ServerState::apply_pending_configuration() {
+  auto stage = std::move(m_pending_stage);
+  auto active_contexts = std::exchange(m_pending_active_contexts, std::nullopt);
+  transfer_configuration(std::move(stage), active_contexts);
+  on_next_deadline_changed();
+}
+
+// presses the hold keys in the new configuration and only sends the
+// difference of the output keys down, instead of releasing all keys
+void ServerState::transfer_configuration(std::unique_ptr<MultiStage> stage,
+    const std::optional<std::vector<int>>& active_contexts) {
+  verbose("Transferring state to new configuration");
+  flush_send_buffer();
+  const auto output_keys_down = m_stage->get_output_keys_down();
+  const auto input_keys_down = m_stage->get_input_keys_down();
+  add_stage_statistics();
+  cache_stage(std::exchange(m_stage, std::move(stage)));
+  TRACEPOINT(configuration_swapped, m_stage->configuration_hash());
+  if (m_trace)
+    m_trace->write_configuration(*m_stage, now());
+  m_flush_scheduled_at.reset();
+  m_timeout_start_at.reset();
+  if (has_injected_output())
+    schedule_flush();
+  evaluate_device_filters();
+  preallocate_buffers();
+  if (g_verbose_output) {
+    verbose("Configuration memory usage:\n%s",
+      format_memory_usage().c_str());
+    verbose("Match engines: %s",
+      join(get_match_engine_names(*m_stage)).c_str());
+  }
+  if (active_contexts)
+    set_active_contexts(*active_contexts);
+
+  // other output like actions is not repeated
+  auto& output = m_output_buffer;
+  for (auto key : input_keys_down) {
+    output.clear();
+    if (m_timeout_start_at) {
+      const auto timeout = make_input_timeout_event(Duration::zero());
+      cancel_timeout();
+      if (m_trace)
+        m_trace->write_input(timeout, Stage::no_device_index, now());
+      m_stage->update(timeout, Stage::no_device_index, output);
+    }
+    if (m_trace)
+      m_trace->write_input({ key, KeyState::Down }, Stage::no_device_index,
+        now());
+    m_stage->update({ key, KeyState::Down }, Stage::no_device_index, output);
+    if (!output.empty() && output.back().key == Key::timeout)
+      schedule_timeout(timeout_to_milliseconds(output.back().value), 
+        cancel_timeout_on_up(output.back().state), now());
+  }
+
+  const auto keys_down = m_stage->get_output_keys_down();
+  for (auto key : output_keys_down)
+    if (std::find(keys_down.begin(), keys_down.end(), key) == keys_down.end())
+      m_send_buffer.push_back({ key, KeyState::Up });
+  for (auto key : keys_down)
+    if (std::find(output_keys_down.begin(), output_keys_down.end(), key) == 
+        output_keys_down.end())
+      m_send_buffer.push_back({ key, KeyState::Down });
+  flush_send_buffer();
+}
+
 void ServerState::on_directives_message(const std::vector<std::string>& directives) {
-  // no common server directives yet
+  m_inject_rate = default_inject_rate;
+  send_pending_wheel();
+  m_wheel_window_end = { };
+  m_wheel_aggregation = default_wheel_aggregation;
+  m_match_engine.reset();
+  for (const auto& directive : directives)
+    if (directive.rfind("inject-rate ", 0) == 0)
+      m_inject_rate = std::max(std::atoi(directive.c_str() + 12), 0);
+    else if (directive.rfind("wheel-aggregation ", 0) == 0)
+      m_wheel_aggregation = std::chrono::milliseconds(
+        std::max(std::atoi(directive.c_str() + 18), 0));
+    else if (directive.rfind("match-engine ", 0) == 0)
+      m_match_engine = get_match_engine(
+        std::string_view(directive).substr(13));
+
+  m_profiling = (std::count(directives.begin(), directives.end(),
+    "profile") > 0);
+  m_optimize_output = (std::count(directives.begin(), directives.end(),
+    "optimize-output") > 0);
+  m_concurrent_output = (std::count(directives.begin(), directives.end(),
+    "concurrent-output") > 0);
+  m_early_output = (std::count(directives.begin(), directives.end(),
+    "early-output") > 0);
+  apply_stage_options(*m_stage);
+  if (m_pending_stage)
+    apply_stage_options(*m_pending_stage);
+  if (g_verbose_output)
+    verbose("Match engines: %s",
+      join(get_match_engine_names(*m_stage)).c_str());
 }
 
 void ServerState::on_active_contexts_message(
-    const std::vector<int>& active_contexts) {
+    const std::vector<int>& active_contexts,
+    const ContextSwitchTimes& times) {
   verbose("Active contexts received (%u)", active_contexts.size());
+  m_context_switch_times = times;
+  // indices refer to pending configuration
+  if (m_pending_stage) {
+    m_pending_active_contexts = active_contexts;
+    return;
+  }
   set_active_contexts(active_contexts);
 }
 
 void ServerState::set_active_contexts(const std::vector<int>& active_contexts) {
+  if (m_trace)
+    m_trace->write_active_contexts(active_contexts, now());
   auto output = m_stage->set_active_client_contexts(active_contexts);
   send_key_sequence(output);
   m_stage->reuse_buffer(std::move(output));
   if (!m_flush_scheduled_at)
     flush_send_buffer();
+  record_context_switch();
 }
 
 void ServerState::on_set_virtual_key_state_message(Key key, KeyState state) {
@@ -39,10 +247,40 @@ void ServerState::on_set_virtual_key_state_message(Key key, KeyState state) {
     flush_send_buffer();
 }
 
+void ServerState::on_set_virtual_key_states_message(
+    const std::vector<Key>& keys, KeyState state) {
+  m_batch_virtual_key_states = true;
+  for (auto key : keys)
+    set_virtual_key_state(key, state);
+  if (!m_flush_scheduled_at)
+    flush_send_buffer();
+  m_batch_virtual_key_states = false;
+
+  if (!m_batched_virtual_key_states.empty()) {
+    m_client->send_virtual_key_states(m_batched_virtual_key_states);
+    m_batched_virtual_key_states.clear();
+  }
+}
+
 void ServerState::on_validate_state_message() {
   verbose("Validating state");
-  m_stage->validate_state(std::bind(&ServerState::on_validate_key_is_down, 
-    this, std::placeholders::_1));
+  const auto input_keys_down = m_stage->get_input_keys_down();
+  m_keys_down.reset();
+  if (on_get_keys_down(m_keys_down))
+    m_stage->validate_state(
+      [&](Key key) { return m_keys_down.test(key); });
+  else
+    m_stage->validate_state(std::bind(&ServerState::on_validate_key_is_down, 
+      this, std::placeholders::_1));
+
+  // keys were released without the stage noticing
+  if (m_stage->get_input_keys_down() != input_keys_down) {
+    ++m_statistics.state_corrections;
+    m_recorder.record(FlightRecorder::Type::state_invalid, { },
+      Stage::no_device_index, now());
+    message("Validating state found released keys, recent events:\n%s",
+      format_recent_events().c_str());
+  }
 }
 
 void ServerState::on_request_next_key_info_message() {
@@ -50,6 +288,15 @@ void ServerState::on_request_next_key_info_message() {
   m_next_key_info_requested = true;
 }
 
+void ServerState::on_request_statistics_message(bool recent_events) {
+  m_client->send_statistics(recent_events ? format_recent_events() :
+    format_statistics(statistics()) + format_memory_usage());
+}
+
+void ServerState::on_request_input_profiles_message() {
+  m_client->send_input_profiles(m_stage->input_profiles());
+}
+
 void ServerState::on_inject_input_message(const KeySequence& sequence) {
   for (const auto& event : sequence)
     if ((event.state == KeyState::Up || event.state == KeyState::Down) &&
@@ -60,11 +307,52 @@ void ServerState::on_inject_input_message(const KeySequence& sequence) {
 }
 
 void ServerState::on_inject_output_message(const KeySequence& sequence) {
-  send_key_sequence(sequence);
+  if (m_inject_rate <= 0) {
+    send_key_sequence(sequence);
+  }
+  else {
+    m_inject_buffer.insert(m_inject_buffer.end(), 
+      sequence.begin(), sequence.end());
+  }
   schedule_flush();
 }
 
+bool ServerState::has_injected_output() const {
+  return (m_inject_position < m_inject_buffer.size());
+}
+
+// moves the next batch of injected output to the send buffer,
+// but only once the previous one and all other output was sent
+void ServerState::release_injected_output() {
+  if (!has_injected_output() || !m_send_buffer.empty())
+    return;
+  const auto time = now();
+  if (time < m_next_inject_at)
+    return;
+
+  // do not split between the press and release of keys
+  auto keys_down = 0;
+  auto count = 0;
+  while (m_inject_position < m_inject_buffer.size()) {
+    const auto& event = m_inject_buffer[m_inject_position++];
+    m_send_buffer.push_back(event);
+    if (is_injected_key_down(event))
+      ++keys_down;
+    else if (is_injected_key_up(event) && keys_down > 0)
+      --keys_down;
+    if (++count >= m_inject_rate && keys_down == 0)
+      break;
+  }
+  if (m_inject_position == m_inject_buffer.size()) {
+    m_inject_buffer.clear();
+    m_inject_position = 0;
+  }
+  m_next_inject_at = time + inject_interval;
+}
+
 void ServerState::release_all_keys() {
+  send_pending_wheel();
+  release_lanes();
   const auto& keys_down = m_stage->get_output_keys_down();
   if (!keys_down.empty()) {
     verbose("Releasing all keys (%d)", keys_down.size());
@@ -73,11 +361,109 @@ void ServerState::release_all_keys() {
   }
 }
 
-void ServerState::send_key_sequence(const KeySequence& key_sequence) {
+// the first event of a window is sent at once, the following ones when
+// it closes, combined as long as the direction does not change
+void ServerState::aggregate_wheel(const KeyEvent& input,
+    Clock::time_point time) {
+  // the Down is sent with the Up
+  if (input.state != KeyState::Up)
+    return;
+  const auto value = (input.value ? input.value : 120);
+  if (m_pending_wheel && (m_pending_wheel->key != input.key ||
+        m_pending_wheel->value + value > max_wheel_value))
+    send_pending_wheel();
+
+  if (!m_pending_wheel && time >= m_wheel_window_end) {
+    send_wheel(KeyEvent(input.key, KeyState::Up,
+      static_cast<KeyEvent::value_t>(value)));
+    m_wheel_window_end = time +
+      std::chrono::duration_cast<Clock::duration>(m_wheel_aggregation);
+    return;
+  }
+  if (!m_pending_wheel) {
+    m_pending_wheel = KeyEvent(input.key, KeyState::Up, 0);
+    on_next_deadline_changed();
+  }
+  m_pending_wheel->value = static_cast<KeyEvent::value_t>(
+    m_pending_wheel->value + value);
+}
+
+void ServerState::send_wheel(const KeyEvent& event) {
+  const auto down = KeyEvent(event.key, KeyState::Down, event.value);
+  if (m_send_buffer.empty() &&
+      send_key(down) && send_key(event) && submit_output()) {
+    on_input_sent();
+  }
+  else {
+    m_send_buffer.push_back(down);
+    m_send_buffer.push_back(event);
+  }
+}
+
+void ServerState::send_pending_wheel() {
+  if (!m_pending_wheel)
+    return;
+  send_wheel(*std::exchange(m_pending_wheel, std::nullopt));
+  m_wheel_window_end = now() +
+    std::chrono::duration_cast<Clock::duration>(m_wheel_aggregation);
+}
+
+void ServerState::send_key_sequence(const KeySequence& key_sequence,
+    const KeyEvent& trigger) {
+  if (m_concurrent_output && !key_sequence.empty()) {
+    // output sharing keys with a lane is played after it
+    auto lane = find_lane(key_sequence.data(), key_sequence.size());
+    if (lane < 0 && std::any_of(key_sequence.begin(), key_sequence.end(),
+          [](const KeyEvent& event) { return event.key == Key::timeout; })) {
+      if (m_lanes.size() < max_lanes) {
+        m_lanes.reserve(max_lanes);
+        auto& added = m_lanes.emplace_back();
+        added.resume_at = now();
+        added.trigger = trigger;
+        on_next_deadline_changed();
+      }
+      lane = static_cast<int>(m_lanes.size()) - 1;
+    }
+    if (lane >= 0) {
+      for (const auto& event : key_sequence)
+        m_lanes[lane].events.push_back(event);
+      return;
+    }
+  }
   for (const auto& event : key_sequence)
     m_send_buffer.push_back(event);
 }
 
+// returns the lane, whose remaining output contains one of the keys
+int ServerState::find_lane(const KeyEvent* events, size_t count) const {
+  for (auto l = size_t{ }; l < m_lanes.size(); ++l) {
+    const auto& lane = m_lanes[l].events;
+    for (auto i = size_t{ }; i < lane.size(); ++i)
+      if (lane[i].key != Key::timeout)
+        for (auto j = size_t{ }; j < count; ++j)
+          if (events[j].key == lane[i].key)
+            return static_cast<int>(l);
+  }
+  return -1;
+}
+
+bool ServerState::is_playing(const KeyEvent& trigger) const {
+  return std::any_of(m_lanes.begin(), m_lanes.end(),
+    [&](const Lane& lane) { return lane.trigger == trigger; });
+}
+
+// stops the lanes, but releases the keys they would release
+void ServerState::release_lanes() {
+  for (const auto& lane : m_lanes)
+    for (auto i = size_t{ }; i < lane.events.size(); ++i) {
+      const auto& event = lane.events[i];
+      if (event.state == KeyState::Up && m_sent_keys_down.test(event.key) &&
+          !is_action_key(event.key) && !is_virtual_key(event.key))
+        m_send_buffer.push_back(KeyEvent(event.key, KeyState::Up));
+    }
+  m_lanes.clear();
+}
+
 std::optional<Socket> ServerState::listen_for_client_connections() {
   if (m_client->listen())
     return m_client->listen_socket();
@@ -85,34 +471,215 @@ std::optional<Socket> ServerState::listen_for_client_connections() {
   return { };
 }
 
+std::optional<Socket> ServerState::adopt_client_listen_socket(Socket socket) {
+  if (m_client->adopt_listen_socket(socket))
+    return m_client->listen_socket();
+  error("Adopting keymapper connection failed");
+  return { };
+}
+
 std::optional<Socket> ServerState::accept_client_connection() {
-  if (m_client->accept())
+  if (m_client->accept()) {
+    ++m_statistics.client_connections;
     return m_client->socket();
+  }
   error("Accepting keymapper connection failed");
   return { };  
 }
 
 void ServerState::disconnect() {
   m_client->disconnect();
+  if (m_trace)
+    m_trace->flush();
 }
 
 bool ServerState::read_client_messages(std::optional<Duration> timeout) {
-  return m_client->read_messages(*this, timeout);
+  if (!m_tracing)
+    return m_client->read_messages(*this, timeout);
+  const auto begin = now();
+  const auto result = m_client->read_messages(*this, timeout);
+  m_recorder.record_span(FlightRecorder::Type::client_messages, { }, 0,
+    begin, now());
+  return result;
+}
+
+// a parked session only keeps its configuration and contexts up to date,
+// focusing a window or validating the state activates it
+class ServerState::ClientSessionHandler : public MessageHandler {
+public:
+  explicit ClientSessionHandler(ClientSession& session)
+    : m_session(session) {
+  }
+
+private:
+  void on_configuration_message(MultiStagePtr stage) override {
+    if (stage)
+      m_session.stage = std::move(stage);
+  }
+  void on_grab_device_filters_message(std::vector<GrabDeviceFilter>) override { }
+  void on_directives_message(const std::vector<std::string>&) override { }
+  void on_active_contexts_message(const std::vector<int>& context_indices,
+      const ContextSwitchTimes& times) override {
+    m_session.stage->set_active_client_contexts(context_indices);
+    if (times.focus_changed)
+      m_session.activation_requested = true;
+  }
+  void on_set_virtual_key_state_message(Key, KeyState) override { }
+  void on_validate_state_message() override {
+    m_session.activation_requested = true;
+  }
+  // requests and injections of inactive sessions are not served
+  void on_request_next_key_info_message() override { }
+  void on_inject_input_message(const KeySequence&) override { }
+  void on_inject_output_message(const KeySequence&) override { }
+  void on_request_statistics_message(bool) override { }
+  void on_request_input_profiles_message() override { }
+
+  ClientSession& m_session;
+};
+
+void ServerState::park_client_session() {
+  verbose("Parking client session");
+  release_all_keys();
+  flush_send_buffer();
+  auto stage = std::exchange(m_stage, std::make_unique<MultiStage>());
+  if (m_pending_stage) {
+    stage = std::move(m_pending_stage);
+    if (m_pending_active_contexts)
+      stage->set_active_client_contexts(*m_pending_active_contexts);
+  }
+  // the keys were released, the session starts clear when it is resumed
+  stage->validate_state([](Key) { return false; });
+
+  auto& session = m_client_sessions.emplace_back();
+  session.client = m_client->create_session();
+  session.client->swap_session(*m_client);
+  session.stage = std::move(stage);
+  session.virtual_keys_down = m_virtual_keys_down;
+  reset_configuration();
+}
+
+bool ServerState::resume_client_session() {
+  if (m_client_sessions.empty())
+    return false;
+  auto it = std::find_if(m_client_sessions.begin(), m_client_sessions.end(),
+    [](const ClientSession& session) { return session.activation_requested; });
+  if (it == m_client_sessions.end())
+    it = std::prev(m_client_sessions.end());
+
+  verbose("Resuming client session");
+  auto session = std::move(*it);
+  m_client_sessions.erase(it);
+  apply_stage_options(*session.stage);
+  reset_configuration(std::move(session.stage));
+  m_virtual_keys_down = session.virtual_keys_down;
+  m_client->swap_session(*session.client);
+  m_client->restore_session(*this);
+  set_active_contexts(m_stage->active_client_contexts());
+  return true;
+}
+
+bool ServerState::read_client_sessions() {
+  auto activation_requested = false;
+  for (auto it = m_client_sessions.begin(); it != m_client_sessions.end(); ) {
+    auto handler = ClientSessionHandler(*it);
+    if (!it->client->read_messages(handler, Duration::zero())) {
+      verbose("Parked client session disconnected");
+      it = m_client_sessions.erase(it);
+      continue;
+    }
+    activation_requested |= it->activation_requested;
+    ++it;
+  }
+  return activation_requested;
+}
+
+std::vector<Socket> ServerState::client_session_sockets() const {
+  auto sockets = std::vector<Socket>();
+  for (const auto& session : m_client_sessions)
+    sockets.push_back(session.client->socket());
+  return sockets;
+}
+
+MultiStagePtr ServerState::clone_configuration() const {
+  return (m_pending_stage ? m_pending_stage : m_stage)->clone_configuration();
+}
+
+const std::vector<int>& ServerState::active_contexts() const {
+  if (m_pending_stage)
+    return (m_pending_active_contexts ? *m_pending_active_contexts :
+      m_pending_stage->active_client_contexts());
+  return m_stage->active_client_contexts();
+}
+
+bool ServerState::load_configuration_snapshot(std::filesystem::path filename) {
+  m_client->set_snapshot_filename(std::move(filename));
+  return m_client->load_snapshot(*this);
+}
+
+bool ServerState::record_input_trace(const std::filesystem::path& filename) {
+  auto trace = std::make_unique<InputTraceWriter>();
+  if (!trace->open(filename, now()))
+    return false;
+  m_trace = std::move(trace);
+  m_trace->write_configuration(*m_stage, now());
+  m_trace->write_active_contexts(m_stage->active_client_contexts(),
+    now());
+  return true;
+}
+
+bool ServerState::read_client_messages(MessageHandler& handler,
+    std::optional<Duration> timeout) {
+  return m_client->read_messages(handler, timeout);
 }
 
 void ServerState::reset_configuration(std::unique_ptr<MultiStage> stage) {
+  m_pending_stage.reset();
+  m_pending_active_contexts.reset();
   release_all_keys();
   flush_send_buffer();
   verbose("Resetting configuration");
-  m_stage = (stage ? std::move(stage) : std::make_unique<MultiStage>());
-  m_virtual_keys_down.clear();
+  add_stage_statistics();
+  cache_stage(std::exchange(m_stage,
+    (stage ? std::move(stage) : std::make_unique<MultiStage>())));
+  TRACEPOINT(configuration_swapped, m_stage->configuration_hash());
+  verbose("Configuration buffers reserve %zu bytes",
+    m_stage->buffer_footprint());
+  if (g_verbose_output)
+    verbose("Match engines: %s",
+      join(get_match_engine_names(*m_stage)).c_str());
+  if (m_trace)
+    m_trace->write_configuration(*m_stage, now());
+  m_virtual_keys_down.reset();
   m_flush_scheduled_at.reset();
   m_timeout_start_at.reset();
+  if (has_injected_output())
+    schedule_flush();
   evaluate_device_filters();
+  preallocate_buffers();
+}
+
+void ServerState::set_preallocate_buffers(bool enabled) {
+  m_preallocate_buffers = enabled;
+  preallocate_buffers();
+}
+
+void ServerState::preallocate_buffers() {
+  if (!m_preallocate_buffers)
+    return;
+  // each stage can output the longest sequence and release what it holds
+  const auto length = std::max(get_max_sequence_length(*m_stage), size_t{ 1 });
+  const auto events = 2 * length *
+    std::max(m_stage->stages().size(), size_t{ 1 });
+  m_send_buffer.reserve(events);
+  m_output_buffer.reserve(events);
+  m_triggered_actions.reserve(m_stage->context_count());
+  verbose("Reserved buffers for %zu events", events);
 }
 
 void ServerState::set_device_descs(std::vector<DeviceDesc> device_descs) {
   m_device_descs = std::move(device_descs);
+  m_statistics.devices = m_device_descs.size();
   evaluate_device_filters();
 }
 
@@ -121,7 +688,8 @@ void ServerState::evaluate_device_filters() {
       m_device_descs.empty())
     return;
   verbose("Evaluating device filters");
-  m_stage->evaluate_device_filters(m_device_descs);
+  if (!m_stage->evaluate_device_filters(m_device_descs))
+    return;
 
   // reevaluate active contexts
   set_active_contexts(m_stage->active_client_contexts());
@@ -147,21 +715,25 @@ bool ServerState::should_exit() const {
 }
 
 void ServerState::set_virtual_key_state(Key key, KeyState state) {
-  const auto it = std::find(m_virtual_keys_down.begin(), m_virtual_keys_down.end(), key);
-  if (it == m_virtual_keys_down.end() && state != KeyState::Up) {
+  const auto down = m_virtual_keys_down.test(key);
+  if (!down && state != KeyState::Up) {
     state = KeyState::Down;
-    m_virtual_keys_down.push_back(key);
+    m_virtual_keys_down.set(key);
     translate_input({ key, state }, Stage::any_device_index);
   }
-  else if (it != m_virtual_keys_down.end() && state != KeyState::Down) {
+  else if (down && state != KeyState::Down) {
     state = KeyState::Up;
-    m_virtual_keys_down.erase(it);
+    m_virtual_keys_down.reset(key);
     translate_input({ key, state }, Stage::any_device_index);
   }
   else {
     return;
   }
-  if (is_virtual_key(key))
+  if (!is_virtual_key(key))
+    return;
+  if (m_batch_virtual_key_states)
+    m_batched_virtual_key_states.emplace_back(key, state);
+  else
     m_client->send_virtual_key_state(key, state);
 }
 
@@ -175,11 +747,23 @@ const DeviceDesc* ServerState::get_device_desc(int device_index) const {
       &m_device_descs[device_index] : nullptr);
 }
 
-bool ServerState::translate_input(KeyEvent input, int device_index) {
+bool ServerState::translate_input(KeyEvent input, int device_index,
+    Clock::time_point time) {
+  const auto count_allocations =
+    ScopedAllocationCount(m_statistics.translate_allocations);
+  TRACEPOINT(event_received, *input.key, static_cast<int>(input.state),
+    static_cast<int>(input.value), device_index);
+
+  // keep the order of the combined wheel events and other input
+  if (m_pending_wheel && !is_mouse_wheel(input.key))
+    send_pending_wheel();
+
   // ignore key repeat while a flush or a timeout is pending
   if (input == m_last_key_event && 
-        (m_flush_scheduled_at || m_timeout_start_at)) {
-    verbose_debug_io(input, { }, true);
+        (m_flush_scheduled_at || m_timeout_start_at || is_playing(input))) {
+    m_recorder.record(FlightRecorder::Type::ignored_repeat, input,
+      device_index, time);
+    log_io(input, nullptr, 0, true);
     return true;
   }
 
@@ -202,9 +786,10 @@ bool ServerState::translate_input(KeyEvent input, int device_index) {
       (input.state == KeyState::Down || m_cancel_timeout_on_up)) {
     // cancel current time out, inject event with elapsed time
     const auto time_since_timeout_start = 
-      (Clock::now() - *m_timeout_start_at);
+      std::max(time - *m_timeout_start_at, Clock::duration::zero());
     cancel_timeout();
-    translate_input(make_input_timeout_event(time_since_timeout_start), device_index);
+    translate_input(make_input_timeout_event(time_since_timeout_start), 
+      device_index, time);
     cancelled_timeout = true;
   }
 
@@ -226,7 +811,70 @@ bool ServerState::translate_input(KeyEvent input, int device_index) {
   if (input.key != Key::timeout)
     m_last_key_event = input;
 
-  auto output = m_stage->update(input, device_index);
+  if (m_trace)
+    m_trace->write_input(input, device_index, time);
+
+  if (input.key == Key::timeout) {
+    ++m_statistics.timeouts;
+  }
+  else {
+    const auto translate_time = now();
+    ++m_statistics.events;
+    m_statistics.read_to_translate.record(translate_time - time);
+    if (m_tracing)
+      m_recorder.record_span(FlightRecorder::Type::read, input,
+        device_index, time, translate_time);
+    if (!m_unsent_input_time) {
+      m_unsent_input_time = time;
+      m_unsent_translate_time = translate_time;
+    }
+  }
+
+  // forward keys directly, which no stage maps
+  if (!m_flush_scheduled_at &&
+      !m_timeout_start_at &&
+      m_send_buffer.empty() &&
+      find_lane(&input, 1) < 0 &&
+      m_stage->pass_through(input)) {
+#if defined(_WIN32)
+    const auto intercept_and_send =
+        cancelled_timeout ||
+        translated_numlock_to_pause ||
+        input.key == Key::AltRight;
+#else
+    const auto intercept_and_send = true;
+#endif
+    m_recorder.record(FlightRecorder::Type::forwarded, input,
+      device_index, time);
+    log_io(input, &input, 1, intercept_and_send);
+
+    if (intercept_and_send && is_mouse_wheel(input.key)) {
+      aggregate_wheel(input, time);
+    }
+    else if (intercept_and_send) {
+      if (send_key(input) && submit_output())
+        on_input_sent();
+      else
+        m_send_buffer.push_back(input);
+    }
+    return intercept_and_send;
+  }
+
+  send_pending_wheel();
+  m_recorder.record(FlightRecorder::Type::input, input, device_index, time);
+  auto& output = m_output_buffer;
+  output.clear();
+  if (m_tracing) {
+    const auto begin = now();
+    m_stage_nanoseconds.clear();
+    for (const auto& profile : m_stage->stage_profiles())
+      m_stage_nanoseconds.push_back(profile.update_nanoseconds);
+    m_stage->update(input, device_index, output);
+    record_stage_spans(input, device_index, begin);
+  }
+  else {
+    m_stage->update(input, device_index, output);
+  }
 
   if (m_stage->should_exit()) {
     verbose("Read exit sequence");
@@ -240,7 +888,7 @@ bool ServerState::translate_input(KeyEvent input, int device_index) {
     const auto& request = output.back();
     schedule_timeout(
       timeout_to_milliseconds(request.value), 
-      cancel_timeout_on_up(request.state));
+      cancel_timeout_on_up(request.state), time);
     output.pop_back();
   }
 
@@ -261,43 +909,200 @@ bool ServerState::translate_input(KeyEvent input, int device_index) {
   const auto intercept_and_send = true;
 #endif
 
-  verbose_debug_io(input, output, intercept_and_send);
+  log_io(input, output.data(), output.size(), intercept_and_send);
 
   if (intercept_and_send)
-    send_key_sequence(output);
+    send_key_sequence(output, input);
 
-  m_stage->reuse_buffer(std::move(output));
   return intercept_and_send;
 }
 
+bool ServerState::get_referenced_keys(KeyBitmap& keys) const {
+  return (m_stage->get_referenced_keys(keys) &&
+    (!m_pending_stage || m_pending_stage->get_referenced_keys(keys)));
+}
+
+bool ServerState::can_forward_unreferenced() const {
+  return (!m_flush_scheduled_at &&
+          !m_timeout_start_at &&
+          !m_next_key_info_requested &&
+          !m_pending_stage &&
+          !m_pending_wheel &&
+          m_send_buffer.empty() &&
+          m_lanes.empty() &&
+          !m_stage->is_holding_back());
+}
+
+void ServerState::update_forwarded_input(const KeyEvent& input, int device_index) {
+  m_last_key_event = input;
+  if (m_trace)
+    m_trace->write_input(input, device_index, now());
+  if (!can_forward_unreferenced() || !m_stage->pass_through(input)) {
+    // state changed since it was forwarded, send output except the input
+    auto& output = m_output_buffer;
+    output.clear();
+    m_stage->update(input, device_index, output);
+    if (!output.empty() && output.back().key == Key::timeout) {
+      const auto& request = output.back();
+      schedule_timeout(
+        timeout_to_milliseconds(request.value),
+        cancel_timeout_on_up(request.state), now());
+      output.pop_back();
+    }
+    const auto it = std::find(output.begin(), output.end(), input);
+    if (it != output.end())
+      output.erase(it);
+    log_io(input, output.data(), output.size(), true);
+    send_key_sequence(output);
+  }
+
+  if (m_stage->should_exit()) {
+    verbose("Read exit sequence");
+    reset_configuration();
+    on_exit_requested();
+  }
+}
+
 bool is_control_up(const KeyEvent& event) {
   return (event.state == KeyState::Up &&
         (event.key == Key::ControlLeft ||
           event.key == Key::ControlRight));
 }
 
+bool ServerState::send_key(const KeyEvent& event) {
+  if (event.state == KeyState::Down)
+    m_sent_keys_down.set(event.key);
+  else if (event.state == KeyState::Up)
+    m_sent_keys_down.reset(event.key);
+  return on_send_key(event);
+}
+
+void ServerState::optimize_send_buffer() {
+  // only the events up to the first one, which is not simply sent
+  const auto size = m_send_buffer.size();
+  auto end = size_t{ };
+  for (; end < size; ++end) {
+    const auto key = m_send_buffer[end].key;
+    if (is_action_key(key) || is_virtual_key(key) || key == Key::timeout)
+      break;
+  }
+
+  // compact in place, the kept events are before index kept
+  auto kept = size_t{ };
+  const auto find_last = [&](Key key, size_t index) -> const KeyEvent* {
+    for (auto i = index; i-- > 0; )
+      if (m_send_buffer[i].key == key)
+        return &m_send_buffer[i];
+    return nullptr;
+  };
+  for (auto i = size_t{ }; i < end; ++i) {
+    const auto event = m_send_buffer[i];
+    if (!is_mouse_wheel(event.key)) {
+      // releasing a key which was already released
+      if (event.state == KeyState::Up) {
+        const auto last = find_last(event.key, kept);
+        if (last && last->state == KeyState::Up)
+          continue;
+      }
+
+      // releasing a modifier which is down and immediately pressing it
+      // again, for other keys it would be a second keystroke
+      if (event.state == KeyState::Down && kept > 0 &&
+          is_common_modifier(event.key) &&
+          m_send_buffer[kept - 1].key == event.key &&
+          m_send_buffer[kept - 1].state == KeyState::Up) {
+        const auto last = find_last(event.key, kept - 1);
+        if (last ? last->state == KeyState::Down :
+                   m_sent_keys_down.test(event.key)) {
+          --kept;
+          continue;
+        }
+      }
+    }
+    m_send_buffer[kept++] = event;
+  }
+  if (kept == end)
+    return;
+  for (auto i = end; i < size; ++i)
+    m_send_buffer[kept++] = m_send_buffer[i];
+  m_statistics.optimized_events += size - kept;
+  m_send_buffer.pop_back(size - kept);
+}
+
 bool ServerState::flush_send_buffer() {
   if (m_sending_key)
     return true;
+  const auto count_allocations =
+    ScopedAllocationCount(m_statistics.flush_allocations);
+  const auto begin = (m_tracing ? now() : Clock::time_point{ });
   m_sending_key = true;
   m_flush_scheduled_at.reset();
+  release_injected_output();
+  if (m_optimize_output)
+    optimize_send_buffer();
 
   auto succeeded = true;
-  auto i = size_t{ };
   auto toggled_virtual_keys = 0;
-  for (; i < m_send_buffer.size(); ++i) {
-    const auto& event = m_send_buffer[i];
+  auto delay = std::optional<Duration>();
+  auto sent = send_events(m_send_buffer, delay, succeeded,
+    toggled_virtual_keys);
+  if (delay)
+    schedule_flush(*delay);
+  sent += play_lanes(succeeded, toggled_virtual_keys);
+  if (!submit_output())
+    succeeded = false;
+  TRACEPOINT(output_flushed, sent);
+  if (succeeded && sent > 0)
+    on_input_sent();
+  else if (m_send_buffer.empty() && m_lanes.empty() && !m_timeout_start_at &&
+      !m_stage->is_holding_back())
+    m_unsent_input_time.reset();
+  if (!m_triggered_actions.empty()) {
+    m_client->send_triggered_actions(m_triggered_actions);
+    m_triggered_actions.clear();
+  }
+  m_sending_key = false;
+  if (m_tracing)
+    m_recorder.record_span(FlightRecorder::Type::flush, { }, 0, begin, now());
+
+  if (has_injected_output())
+    schedule_flush(std::max(m_next_inject_at - now(),
+      Clock::duration::zero()));
+
+  if (m_pending_stage && m_send_buffer.empty() && m_lanes.empty() &&
+      !m_flush_scheduled_at && m_stage->is_clear())
+    apply_pending_configuration();
+  return succeeded;
+}
+
+// sends the events up to the first delay, which is returned,
+// returns the count of handled events
+size_t ServerState::send_events(RingBuffer<KeyEvent>& events,
+    std::optional<Duration>& delay, bool& succeeded,
+    int& toggled_virtual_keys) {
+  auto i = size_t{ };
+  const auto send_time = now();
+  for (; i < events.size(); ++i) {
+    // a copy, toggling a virtual key can append to the buffer
+    const auto event = events[i];
+
+    // actions and virtual keys end a batch of sent keys
+    if (is_action_key(event.key) || is_virtual_key(event.key)) {
+      if (event.state == KeyState::Down && !submit_output())
+        succeeded = false;
+    }
 
     if (is_action_key(event.key)) {
       if (event.state == KeyState::Down)
-        m_client->send_triggered_action(
+        m_triggered_actions.push_back(
           static_cast<int>(*event.key - *Key::first_action));
       continue;
     }
 
     if (is_virtual_key(event.key)) {
       if (event.state == KeyState::Down) {
-        // prevent infinite loop (when two ContextActive toggle each other)
+        // cycles of ContextActive toggles are rejected by ParseConfig,
+        // this only guards against configurations sent by other clients
         if (++toggled_virtual_keys < 10)
           toggle_virtual_key(event.key);
       }
@@ -305,7 +1110,7 @@ bool ServerState::flush_send_buffer() {
     }
 
     if (event.key == Key::timeout) {
-      schedule_flush(timeout_to_milliseconds(event.value));
+      delay = timeout_to_milliseconds(event.value);
       ++i;
       break;
     }
@@ -315,17 +1120,67 @@ bool ServerState::flush_send_buffer() {
     // otherwise copy/paste does not work in some input fields
     const auto is_first = (i == 0);
     if (!is_first && is_control_up(event)) {
-      schedule_flush(std::chrono::milliseconds(10));
+      delay = std::chrono::milliseconds(10);
       break;
     }
 #endif
 
-    if (!on_send_key(event)) {
+    m_recorder.record(FlightRecorder::Type::output, event,
+      Stage::no_device_index, send_time);
+    if (!send_key(event)) {
       succeeded = false;
       break;
     }
   }
-  m_send_buffer.erase(m_send_buffer.begin(), m_send_buffer.begin() + i);
+  // the next flush resumes after the delay
+  events.pop_front(i);
+  return i;
+}
+
+// plays the lanes, whose delay elapsed, returns the count of handled events
+size_t ServerState::play_lanes(bool& succeeded, int& toggled_virtual_keys) {
+  auto handled = size_t{ };
+  const auto time = now();
+  // playing can add lanes, which are played by the next flush
+  const auto count = m_lanes.size();
+  for (auto l = size_t{ }; l < count; ++l) {
+    auto& lane = m_lanes[l];
+    if (lane.resume_at > time)
+      continue;
+    auto delay = std::optional<Duration>();
+    handled += send_events(lane.events, delay, succeeded,
+      toggled_virtual_keys);
+    if (delay)
+      lane.resume_at = time +
+        std::chrono::duration_cast<Clock::duration>(*delay);
+  }
+  // a lane is kept until its last delay elapsed
+  const auto size = m_lanes.size();
+  m_lanes.erase(std::remove_if(m_lanes.begin(), m_lanes.end(),
+    [&](const Lane& lane) {
+      return (lane.events.empty() && lane.resume_at <= time);
+    }), m_lanes.end());
+  if (count || m_lanes.size() != size)
+    on_next_deadline_changed();
+  return handled;
+}
+
+// plays the lanes, while the other output is delayed
+bool ServerState::flush_lanes() {
+  if (m_sending_key)
+    return true;
+  m_sending_key = true;
+  auto succeeded = true;
+  auto toggled_virtual_keys = 0;
+  const auto handled = play_lanes(succeeded, toggled_virtual_keys);
+  if (!submit_output())
+    succeeded = false;
+  if (succeeded && handled > 0)
+    on_input_sent();
+  if (!m_triggered_actions.empty()) {
+    m_client->send_triggered_actions(m_triggered_actions);
+    m_triggered_actions.clear();
+  }
   m_sending_key = false;
   return succeeded;
 }
@@ -333,20 +1188,25 @@ bool ServerState::flush_send_buffer() {
 void ServerState::schedule_flush(Duration delay) {
   if (m_flush_scheduled_at)
     return;
-  m_flush_scheduled_at = Clock::now() + 
+  m_flush_scheduled_at = now() + 
     std::chrono::duration_cast<Clock::duration>(delay);
-  on_flush_scheduled(delay);
+  on_next_deadline_changed();
 }
 
 std::optional<Clock::time_point> ServerState::flush_scheduled_at() const {
   return m_flush_scheduled_at;
 }
 
-void ServerState::schedule_timeout(Duration timeout, bool cancel_on_up) {
+void ServerState::schedule_timeout(Duration timeout, bool cancel_on_up,
+    Clock::time_point start) {
+  m_recorder.record(FlightRecorder::Type::timeout_scheduled,
+    make_input_timeout_event(timeout), Stage::no_device_index, start);
+  TRACEPOINT(timeout_scheduled,
+    std::chrono::duration_cast<std::chrono::milliseconds>(timeout).count());
   m_timeout = timeout;
-  m_timeout_start_at = Clock::now();
+  m_timeout_start_at = start;
   m_cancel_timeout_on_up = cancel_on_up;
-  on_timeout_scheduled(timeout);
+  on_next_deadline_changed();
 }
 
 std::optional<Clock::time_point> ServerState::timeout_start_at() const {
@@ -360,5 +1220,227 @@ Duration ServerState::timeout() const {
 void ServerState::cancel_timeout() {
   m_timeout_start_at.reset();
   m_timeout = { };
-  on_timeout_cancelled();
+  on_next_deadline_changed();
+}
+
+std::optional<Clock::time_point> ServerState::next_deadline() const {
+  auto deadline = m_flush_scheduled_at;
+  if (m_timeout_start_at) {
+    const auto timeout_at = *m_timeout_start_at + 
+      std::chrono::duration_cast<Clock::duration>(m_timeout);
+    if (!deadline || timeout_at < *deadline)
+      deadline = timeout_at;
+  }
+  if (m_pending_stage && 
+      (!deadline || m_pending_stage_deadline < *deadline))
+    deadline = m_pending_stage_deadline;
+  if (m_pending_wheel &&
+      (!deadline || m_wheel_window_end < *deadline))
+    deadline = m_wheel_window_end;
+  for (const auto& lane : m_lanes)
+    if (!deadline || lane.resume_at < *deadline)
+      deadline = lane.resume_at;
+  return deadline;
+}
+
+void ServerState::log_io(const KeyEvent& input, const KeyEvent* output,
+    size_t output_count, bool translated) {
+  if (!g_verbose_output)
+    return;
+  if (!m_event_log)
+    m_event_log = std::make_unique<EventLog>();
+  m_event_log->log(input, output, output_count, translated, now());
+}
+
+void ServerState::apply_stage_options(MultiStage& stage) const {
+  stage.set_profiling(profiling());
+  stage.set_early_output(m_early_output);
+  stage.set_match_engine(m_match_engine);
+}
+
+void ServerState::add_stage_statistics() {
+  m_statistics.matches += m_stage->match_count();
+  m_statistics.might_matches += m_stage->might_match_count();
+}
+
+void ServerState::on_input_sent() {
+  ++m_statistics.flushes;
+  if (m_unsent_input_time) {
+    const auto sent_time = now();
+    m_statistics.translate_to_send.record(sent_time - m_unsent_translate_time);
+    m_statistics.event_to_send.record(sent_time - *m_unsent_input_time);
+    m_unsent_input_time.reset();
+  }
+}
+
+bool ServerState::submit_output() {
+  if (!m_tracing)
+    return on_keys_sent();
+  const auto begin = now();
+  const auto result = on_keys_sent();
+  m_recorder.record_span(FlightRecorder::Type::write_output, { }, 0,
+    begin, now());
+  return result;
+}
+
+void ServerState::record_stage_spans(const KeyEvent& input,
+    int device_index, Clock::time_point begin) {
+  const auto end = now();
+  m_recorder.record_span(FlightRecorder::Type::translate, input,
+    device_index, begin, end);
+
+  // only the time spent in each stage is known, they are laid out in order
+  const auto& profiles = m_stage->stage_profiles();
+  auto stage_begin = begin;
+  for (auto i = size_t{ }; i < profiles.size() &&
+       i < m_stage_nanoseconds.size(); ++i) {
+    const auto nanoseconds = profiles[i].update_nanoseconds -
+      m_stage_nanoseconds[i];
+    if (!nanoseconds)
+      continue;
+    const auto stage_end = std::min(stage_begin +
+      std::chrono::duration_cast<Clock::duration>(
+        std::chrono::nanoseconds(nanoseconds)), end);
+    m_recorder.record_span(FlightRecorder::Type::stage, input,
+      static_cast<int>(i), stage_begin, stage_end);
+    stage_begin = stage_end;
+  }
+}
+
+void ServerState::record_context_switch() {
+  const auto times = std::exchange(m_context_switch_times, { });
+  if (!times.focus_changed || !times.received)
+    return;
+  const auto applied_time = now();
+  if (m_tracing) {
+    // the first two spans were measured by the client
+    m_recorder.record_span(FlightRecorder::Type::match_contexts, { }, 0,
+      from_timestamp(times.focus_changed),
+      from_timestamp(times.contexts_matched));
+    m_recorder.record_span(FlightRecorder::Type::send_contexts, { }, 0,
+      from_timestamp(times.contexts_matched), from_timestamp(times.received));
+    m_recorder.record_span(FlightRecorder::Type::apply_contexts, { }, 0,
+      from_timestamp(times.received), applied_time);
+  }
+  const auto elapsed = [](uint64_t from, uint64_t to) {
+    return from_timestamp(to) - from_timestamp(from);
+  };
+  m_statistics.focus_to_match.record(
+    elapsed(times.focus_changed, times.contexts_matched));
+  m_statistics.match_to_send.record(
+    elapsed(times.contexts_matched, times.sent));
+  m_statistics.send_to_receive.record(elapsed(times.sent, times.received));
+  m_statistics.receive_to_apply.record(
+    applied_time - from_timestamp(times.received));
+  m_statistics.focus_to_apply.record(
+    applied_time - from_timestamp(times.focus_changed));
+}
+
+std::string ServerState::format_recent_events() const {
+  return m_recorder.format(now());
+}
+
+void ServerState::set_tracing(bool enabled) {
+  m_tracing = enabled;
+  m_stage->set_profiling(profiling());
+  if (m_pending_stage)
+    m_pending_stage->set_profiling(profiling());
+}
+
+bool ServerState::write_event_trace(const std::filesystem::path& filename) const {
+  auto file = std::ofstream(filename, std::ios::binary);
+  file << m_recorder.format_chrome_trace();
+  return file.good();
+}
+
+std::string ServerState::format_memory_usage() const {
+  const auto stage = m_stage->memory_usage();
+  // replaced, pending and parked configurations
+  auto other_stages = size_t{ };
+  for (const auto& cached : m_cached_stages)
+    other_stages += cached->memory_usage().total();
+  if (m_pending_stage)
+    other_stages += m_pending_stage->memory_usage().total();
+  auto client = m_client->memory_usage();
+  for (const auto& session : m_client_sessions) {
+    client += session.client->memory_usage();
+    if (session.stage)
+      other_stages += session.stage->memory_usage().total();
+  }
+  const auto send_buffers =
+    m_send_buffer.capacity() * sizeof(KeyEvent) +
+    (m_output_buffer.capacity() + m_inject_buffer.capacity()) *
+      sizeof(KeyEvent) +
+    m_triggered_actions.capacity() * sizeof(int);
+  const auto recorder = sizeof(FlightRecorder) +
+    (m_event_log ? sizeof(EventLog) : 0);
+
+  auto string = std::string();
+  char line[64];
+  std::snprintf(line, sizeof(line), "%-18s %10s\n", "memory", "bytes");
+  string += line;
+  append_memory_usage(string, "contexts", stage.contexts);
+  append_memory_usage(string, "matching", stage.matching);
+  append_memory_usage(string, "arena", stage.arena);
+  append_memory_usage(string, "regexes", stage.regexes);
+  append_memory_usage(string, "stage buffers", stage.buffers);
+  append_memory_usage(string, "other stages", other_stages);
+  append_memory_usage(string, "connection", client);
+  append_memory_usage(string, "send buffers", send_buffers);
+  append_memory_usage(string, "recorder", recorder);
+  append_memory_usage(string, "total", stage.total() + other_stages +
+    client + send_buffers + recorder);
+  return string;
+}
+
+Statistics ServerState::statistics() const {
+  auto statistics = m_statistics;
+  statistics.matches += m_stage->match_count();
+  statistics.might_matches += m_stage->might_match_count();
+  statistics.stages = m_stage->stage_profiles();
+  statistics.match_engines = get_match_engine_names(*m_stage);
+  return statistics;
+}
+
+bool ServerState::process_deadlines(Clock::time_point now) {
+  if (!m_tracing)
+    return update_deadlines(now);
+  const auto result = update_deadlines(now);
+  m_recorder.record_span(FlightRecorder::Type::deadlines, { }, 0,
+    now, this->now());
+  return result;
+}
+
+bool ServerState::update_deadlines(Clock::time_point now) {
+  if (m_timeout_start_at &&
+      now >= *m_timeout_start_at + 
+        std::chrono::duration_cast<Clock::duration>(m_timeout)) {
+    const auto timeout = make_input_timeout_event(m_timeout);
+    m_statistics.timeout_lateness.record(now - (*m_timeout_start_at +
+      std::chrono::duration_cast<Clock::duration>(m_timeout)));
+    TRACEPOINT(timeout_fired,
+      std::chrono::duration_cast<std::chrono::milliseconds>(m_timeout).count());
+    cancel_timeout();
+    translate_input(timeout, Stage::any_device_index);
+  }
+
+  if (m_pending_stage && now >= m_pending_stage_deadline) {
+    verbose("Applying deferred configuration");
+    apply_pending_configuration();
+  }
+
+  if (m_pending_wheel && now >= m_wheel_window_end)
+    send_pending_wheel();
+
+  if (!m_flush_scheduled_at)
+    return flush_send_buffer();
+  if (now >= *m_flush_scheduled_at) {
+    m_statistics.flush_lateness.record(now - *m_flush_scheduled_at);
+    return flush_send_buffer();
+  }
+
+  if (std::any_of(m_lanes.begin(), m_lanes.end(),
+        [&](const Lane& lane) { return (now >= lane.resume_at); }))
+    return flush_lanes();
+  return true;
 }
@@ -1,6 +1,11 @@
 #pragma once
 
 #include "ClientPort.h"
+#include "EventLog.h"
+#include "FlightRecorder.h"
+#include "InputTrace.h"
+#include "RingBuffer.h"
+#include "Statistics.h"
 #include "runtime/Stage.h"
 
 class ServerState : public ClientPort::MessageHandler {
@@ -8,65 +13,220 @@ public:
   explicit ServerState(std::unique_ptr<IClientPort> client =
     std::make_unique<ClientPort>());
   std::optional<Socket> listen_for_client_connections();
+  // continues with the listening socket of another process
+  std::optional<Socket> adopt_client_listen_socket(Socket socket);
   std::optional<Socket> accept_client_connection();
   bool version_mismatch() const { return m_client->version_mismatch(); }
+  Socket client_socket() const { return m_client->socket(); }
   void disconnect();
   bool read_client_messages(std::optional<Duration> timeout = { });
+  // keeps the active session, so another client can connect
+  void park_client_session();
+  // activates the parked session, which requested it, or the last one
+  bool resume_client_session();
+  // reads the parked sessions, returns true when one requested activation
+  bool read_client_sessions();
+  std::vector<Socket> client_session_sockets() const;
+  size_t client_session_count() const { return m_client_sessions.size(); }
+  // of the pending or current configuration
+  MultiStagePtr clone_configuration() const;
+  const std::vector<int>& active_contexts() const;
+  // persists received configurations, applies the last one when available
+  bool load_configuration_snapshot(std::filesystem::path filename);
+  // records the input, active contexts and configurations for replaying
+  bool record_input_trace(const std::filesystem::path& filename);
+  // lets another handler receive the messages, e.g. to forward them
+  bool read_client_messages(MessageHandler& handler,
+    std::optional<Duration> timeout);
   void reset_configuration(std::unique_ptr<MultiStage> stage = { });
   bool has_configuration() const;
   bool has_mouse_mappings() const;
   bool has_device_filters() const;
   void set_device_descs(std::vector<DeviceDesc> device_descs);
+  // reserves the buffers for the longest output of each configuration,
+  // so translating input does not allocate
+  void set_preallocate_buffers(bool enabled);
   bool should_exit() const;
-  bool translate_input(KeyEvent input, int device_index);
+  // time is used for measuring elapsed timeouts
+  bool translate_input(KeyEvent input, int device_index,
+    Clock::time_point time);
+  bool translate_input(KeyEvent input, int device_index) {
+    return translate_input(input, device_index, now());
+  }
   bool flush_send_buffer();
+  // for deciding in another thread whether input can be forwarded unchanged,
+  // adds the keys of the current and pending configuration
+  bool get_referenced_keys(KeyBitmap& keys) const;
+  // whether input of unreferenced keys can currently be forwarded
+  bool can_forward_unreferenced() const;
+  // updates the state with an input, which was already forwarded
+  void update_forwarded_input(const KeyEvent& input, int device_index);
   bool sending_key() const { return m_sending_key; }
   bool stage_is_clear() const { return m_stage->is_clear(); }
+  bool has_pending_configuration() const { return static_cast<bool>(m_pending_stage); }
   void schedule_flush(Duration delay = { });
   std::optional<Clock::time_point> flush_scheduled_at() const;
   std::optional<Clock::time_point> timeout_start_at() const;
   Duration timeout() const;
   void cancel_timeout();
+  // earliest time at which process_deadlines needs to be called
+  std::optional<Clock::time_point> next_deadline() const;
+  bool process_deadlines(Clock::time_point now);
+  Statistics statistics() const;
+  // the last input and output events, for diagnosing problems
+  std::string format_recent_events() const;
+  // also records the spans of the pipeline along with the recent events
+  void set_tracing(bool enabled);
+  // writes the recent events as a timeline for a trace viewer
+  bool write_event_trace(const std::filesystem::path& filename) const;
+  // bytes held by the configurations, the connection and the buffers
+  std::string format_memory_usage() const;
 
 protected:
   void on_configuration_message(std::unique_ptr<MultiStage> stage) override;
+  void on_activate_configuration_message(size_t hash,
+    const std::function<MultiStagePtr()>& build_stage) override;
   void on_directives_message(const std::vector<std::string>& directives) override;
   void on_active_contexts_message(
-      const std::vector<int>& active_contexts) override;
+      const std::vector<int>& active_contexts,
+      const ContextSwitchTimes& times) override;
   void on_set_virtual_key_state_message(Key key, KeyState state) override;
+  void on_set_virtual_key_states_message(const std::vector<Key>& keys,
+    KeyState state) override;
   void on_validate_state_message() override;
   void on_request_next_key_info_message() override;
   void on_inject_input_message(const KeySequence& sequence) override;
   void on_inject_output_message(const KeySequence& sequence) override;
+  void on_request_statistics_message(bool recent_events) override;
+  void on_request_input_profiles_message() override;
 
   virtual bool on_send_key(const KeyEvent& event) = 0;
-  virtual void on_flush_scheduled(Duration timeout) { }
-  virtual void on_timeout_scheduled(Duration timeout) { }
-  virtual void on_timeout_cancelled() { }
+  // called after keys were sent, so they can be submitted at once
+  virtual bool on_keys_sent() { return true; }
+  virtual void on_next_deadline_changed() { }
   virtual void on_exit_requested() = 0;
   virtual bool on_validate_key_is_down(Key key) { return true; }
+  // sets the keys which are down at once, returns false when not supported
+  virtual bool on_get_keys_down(KeyBitmap& keys_down) { return false; }
   virtual std::string get_devices_error_message() { return { }; }
+  // all scheduling is based on this time, so it can be simulated
+  virtual Clock::time_point now() const { return Clock::now(); }
 
   void release_all_keys();
+  bool send_key(const KeyEvent& event);
+  void optimize_send_buffer();
+  void aggregate_wheel(const KeyEvent& input, Clock::time_point time);
+  void send_wheel(const KeyEvent& event);
+  void send_pending_wheel();
+  void apply_stage_options(MultiStage& stage) const;
+  void add_stage_statistics();
+  void log_io(const KeyEvent& input, const KeyEvent* output,
+    size_t output_count, bool translated);
+  void on_input_sent();
+  bool submit_output();
+  bool update_deadlines(Clock::time_point now);
+  bool profiling() const { return m_profiling || m_tracing; }
+  void record_stage_spans(const KeyEvent& input, int device_index,
+    Clock::time_point begin);
+  void record_context_switch();
+  void apply_pending_configuration();
+  void cache_stage(std::unique_ptr<MultiStage> stage);
+  void transfer_configuration(std::unique_ptr<MultiStage> stage,
+    const std::optional<std::vector<int>>& active_contexts);
   void set_active_contexts(const std::vector<int>& active_contexts);
-  void send_key_sequence(const KeySequence& key_sequence);
-  void schedule_timeout(Duration timeout, bool cancel_on_up);
+  void send_key_sequence(const KeySequence& key_sequence,
+    const KeyEvent& trigger = { });
+  size_t send_events(RingBuffer<KeyEvent>& events,
+    std::optional<Duration>& delay, bool& succeeded, int& toggled_virtual_keys);
+  int find_lane(const KeyEvent* events, size_t count) const;
+  bool is_playing(const KeyEvent& trigger) const;
+  size_t play_lanes(bool& succeeded, int& toggled_virtual_keys);
+  bool flush_lanes();
+  void release_lanes();
+  bool has_injected_output() const;
+  void release_injected_output();
+  void schedule_timeout(Duration timeout, bool cancel_on_up,
+    Clock::time_point start);
   void set_virtual_key_state(Key key, KeyState state);
   void toggle_virtual_key(Key key);
   void evaluate_device_filters();
+  void preallocate_buffers();
   const DeviceDesc* get_device_desc(int device_index) const;
 
 private:
+  // delayed output, which is played independently of other output
+  struct Lane {
+    RingBuffer<KeyEvent> events;
+    Clock::time_point resume_at;
+    // input, whose repeat is ignored while the lane is playing
+    KeyEvent trigger;
+  };
+
+  struct ClientSession {
+    std::unique_ptr<IClientPort> client;
+    std::unique_ptr<MultiStage> stage;
+    KeyBitmap virtual_keys_down;
+    bool activation_requested{ };
+  };
+  class ClientSessionHandler;
+
   std::unique_ptr<IClientPort> m_client;
+  // parked sessions of other clients, the most recent last
+  std::vector<ClientSession> m_client_sessions;
   std::unique_ptr<MultiStage> m_stage;
-  std::vector<KeyEvent> m_send_buffer;
-  std::vector<Key> m_virtual_keys_down;
+  // configuration received while stage was not clear
+  std::unique_ptr<MultiStage> m_pending_stage;
+  std::optional<std::vector<int>> m_pending_active_contexts;
+  // replaced configurations, which can be activated again, most recent last
+  std::vector<std::unique_ptr<MultiStage>> m_cached_stages;
+  // of the last received active contexts, until they are applied
+  ContextSwitchTimes m_context_switch_times{ };
+  Clock::time_point m_pending_stage_deadline;
+  // output not sent yet, a flush is cut short by delays
+  RingBuffer<KeyEvent> m_send_buffer;
+  std::vector<int> m_triggered_actions;
+  KeySequence m_output_buffer;
+  KeyBitmap m_virtual_keys_down;
+  // keys whose last sent event was a Down
+  KeyBitmap m_sent_keys_down;
+  bool m_optimize_output{ };
+  bool m_concurrent_output{ };
+  bool m_early_output{ };
+  // overrides the match engine each stage chose
+  std::optional<Stage::MatchEngine> m_match_engine;
+  std::vector<Lane> m_lanes;
   KeyEvent m_last_key_event;
   bool m_sending_key{ };
   std::optional<Clock::time_point> m_flush_scheduled_at;
+  // collected while a batch of virtual keys is set
+  std::vector<KeyEvent> m_batched_virtual_key_states;
+  bool m_batch_virtual_key_states{ };
   std::optional<Clock::time_point> m_timeout_start_at;
   Duration m_timeout{ };
   bool m_cancel_timeout_on_up{ };
   std::vector<DeviceDesc> m_device_descs;
   bool m_next_key_info_requested{ };
+  // injected output, which is sent paced
+  KeySequence m_inject_buffer;
+  size_t m_inject_position{ };
+  int m_inject_rate;
+  bool m_profiling{ };
+  bool m_tracing{ };
+  bool m_preallocate_buffers{ };
+  Clock::time_point m_next_inject_at;
+  // unmapped wheel events are combined while the window is open
+  Duration m_wheel_aggregation;
+  std::optional<KeyEvent> m_pending_wheel;
+  Clock::time_point m_wheel_window_end;
+  std::unique_ptr<InputTraceWriter> m_trace;
+  Statistics m_statistics;
+  FlightRecorder m_recorder;
+  std::unique_ptr<EventLog> m_event_log;
+  // of the first input, whose output was not sent yet
+  std::optional<Clock::time_point> m_unsent_input_time;
+  Clock::time_point m_unsent_translate_time;
+
+  // temporary buffers
+  KeyBitmap m_keys_down;
+  std::vector<uint64_t> m_stage_nanoseconds;
 };
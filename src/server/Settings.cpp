@@ -1,6 +1,7 @@
 
 #include "Settings.h"
 #include "common/output.h"
+#include <cstdlib>
 
 #if defined(_WIN32)
 bool interpret_commandline(Settings& settings, int argc, wchar_t* argv[]) {
@@ -21,12 +22,94 @@ bool interpret_commandline(Settings& settings, int argc, char* argv[]) {
     else if (argument == T("-g")) {
       settings.grab_and_exit = true;
     }
+#endif
+    else if (argument == T("--realtime")) {
+      settings.realtime = true;
+    }
+#if !defined(_WIN32)
+    else if (argument == T("--realtime-policy")) {
+      if (++i >= argc)
+        return false;
+      const auto policy = std::string_view(argv[i]);
+      if (policy != "fifo" && policy != "rr")
+        return false;
+      settings.realtime_round_robin = (policy == "rr");
+    }
+#endif
+#if defined(__linux__)
+    else if (argument == T("--realtime-cpu")) {
+      if (++i >= argc)
+        return false;
+      const auto cpu = std::atoi(argv[i]);
+      if (cpu < 0 || (cpu == 0 && std::string_view(argv[i]) != "0"))
+        return false;
+      settings.realtime_cpu = cpu;
+    }
+#endif
+    else if (argument == T("--record")) {
+      if (++i >= argc)
+        return false;
+      settings.record_filename = argv[i];
+    }
+    else if (argument == T("--trace")) {
+      if (++i >= argc)
+        return false;
+      settings.trace_filename = argv[i];
+    }
+#if defined(__linux__)
+    else if (argument == T("--no-event-time")) {
+      settings.no_event_time = true;
+    }
+    else if (argument == T("--pointer-thread")) {
+      settings.pointer_thread = true;
+    }
+    else if (argument == T("--reader-threads")) {
+      settings.reader_threads = true;
+    }
+#if defined(ENABLE_IO_URING)
+    else if (argument == T("--io-uring")) {
+      settings.io_uring = true;
+    }
+#endif
+    else if (argument == T("--takeover")) {
+      settings.takeover = true;
+    }
+    else if (argument == T("--seat")) {
+      if (++i >= argc)
+        return false;
+      settings.seats.push_back(argv[i]);
+    }
+#endif
+#if !defined(_WIN32)
+    else if (argument == T("--forward")) {
+      if (++i >= argc)
+        return false;
+      settings.forward_address = argv[i];
+    }
+    else if (argument == T("--receive")) {
+      if (++i >= argc)
+        return false;
+      settings.receive_port = argv[i];
+    }
+    else if (argument == T("--metrics")) {
+      if (++i >= argc)
+        return false;
+      settings.metrics_port = argv[i];
+    }
+#endif
+#if defined(ENABLE_EMBEDDED)
+    else if (argument == T("-c") || argument == T("--config")) {
+      if (++i >= argc)
+        return false;
+      settings.config_file_path = argv[i];
+    }
 #endif
     else {
       return false;
     }
   }
-  return true;
+  // a machine either forwards or receives the output
+  return (settings.forward_address.empty() || settings.receive_port.empty());
 }
 
 void print_help_message() {
@@ -35,6 +118,33 @@ void print_help_message() {
     "\n"
     "Usage: keymapperd [-options]\n"
     "  -v, --verbose        enable verbose output.\n"
+    "  --realtime           handle input in a high priority thread.\n"
+#if !defined(_WIN32)
+    "  --realtime-policy <fifo|rr> scheduling policy in realtime mode.\n"
+#endif
+#if defined(__linux__)
+    "  --realtime-cpu <index> run the input thread on this CPU.\n"
+#endif
+    "  --record <file>      record the input for keymapper-replay.\n"
+    "  --trace <file>       write a timeline of the recent events on exit.\n"
+#if defined(__linux__)
+    "  --no-event-time      measure timeouts when events are read.\n"
+    "  --seat <device>      handle the matching devices separately.\n"
+    "  --pointer-thread     forward mouse motion in separate threads.\n"
+    "  --reader-threads     read each device in a separate thread.\n"
+#if defined(ENABLE_IO_URING)
+    "  --io-uring           read and write the devices using io_uring.\n"
+#endif
+    "  --takeover           continue with the devices of the running instance.\n"
+#endif
+#if !defined(_WIN32)
+    "  --forward <host:port> send the output to another machine.\n"
+    "  --receive <port>     output what another machine forwards.\n"
+    "  --metrics <port>     serve statistics in OpenMetrics format.\n"
+#endif
+#if defined(ENABLE_EMBEDDED)
+    "  -c, --config <path>  configuration file, /etc/keymapper.conf by default.\n"
+#endif
     "  -h, --help           print this help.\n"
     "\n"
     "%s\n"
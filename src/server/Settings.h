@@ -1,10 +1,38 @@
 #pragma once
 
+#include <filesystem>
+#include <optional>
 #include <string>
+#include <vector>
 
 struct Settings {
   bool verbose;
   bool grab_and_exit;
+  bool no_event_time;
+  // pointer motion of grabbed mice is forwarded by separate threads
+  bool pointer_thread;
+  // each grabbed device is read by a separate thread
+  bool reader_threads;
+  // devices are read and written by an io_uring
+  bool io_uring;
+  // devices are taken over from the running instance
+  bool takeover;
+  bool realtime;
+  // scheduling of the input thread in realtime mode
+  bool realtime_round_robin;
+  std::optional<int> realtime_cpu;
+  std::filesystem::path record_filename;
+  // the timeline of the recent events is written to this file
+  std::filesystem::path trace_filename;
+  // device filters of the additional seats
+  std::vector<std::string> seats;
+  // output is sent to the host:port, or received on the port
+  std::string forward_address;
+  std::string receive_port;
+  // statistics are served on this localhost port
+  std::string metrics_port;
+  // the configuration of the client running in the process
+  std::filesystem::path config_file_path;
 };
 
 #if defined(_WIN32)
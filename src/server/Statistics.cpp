@@ -0,0 +1,303 @@
+
+#include "Statistics.h"
+#include <chrono>
+#include <cstdio>
+#include <string_view>
+
+namespace {
+  using Nanoseconds = std::chrono::nanoseconds;
+  using Microseconds = std::chrono::duration<double, std::micro>;
+  using Seconds = std::chrono::duration<double>;
+
+  // upper bounds of the exported histogram buckets
+  const Clock::duration metrics_buckets[] = {
+    std::chrono::microseconds(10), std::chrono::microseconds(50),
+    std::chrono::microseconds(100), std::chrono::microseconds(250),
+    std::chrono::microseconds(500), std::chrono::milliseconds(1),
+    std::chrono::milliseconds(5), std::chrono::milliseconds(10),
+    std::chrono::milliseconds(50), std::chrono::milliseconds(100),
+  };
+
+  void append_histogram(std::string& string, const char* name,
+      const LatencyHistogram& histogram) {
+    const auto us = [](Clock::duration duration) {
+      return Microseconds(duration).count();
+    };
+    char line[128];
+    std::snprintf(line, sizeof(line),
+      "%-18s %10llu %9.1f %9.1f %9.1f %9.1f %9.1f\n", name,
+      static_cast<unsigned long long>(histogram.count()),
+      us(histogram.percentile(0.5)), us(histogram.percentile(0.9)),
+      us(histogram.percentile(0.99)), us(histogram.percentile(0.999)),
+      us(histogram.max()));
+    string += line;
+  }
+
+  void append_allocations(std::string& string, const char* name,
+      const AllocationStatistics& statistics) {
+    const auto per_call = [&](uint64_t value) {
+      return (statistics.calls ? static_cast<double>(value) /
+        static_cast<double>(statistics.calls) : 0.0);
+    };
+    char line[128];
+    std::snprintf(line, sizeof(line),
+      "%-18s %10llu %9.2f %9.1f\n", name,
+      static_cast<unsigned long long>(statistics.calls),
+      per_call(statistics.allocations), per_call(statistics.bytes));
+    string += line;
+  }
+
+  void append_metric(std::string& string, const char* name,
+      const char* type, const char* help, uint64_t value) {
+    char line[256];
+    std::snprintf(line, sizeof(line),
+      "# TYPE keymapper_%s %s\n# HELP keymapper_%s %s\n"
+      "keymapper_%s%s %llu\n", name, type, name, help, name,
+      (std::string_view(type) == "counter" ? "_total" : ""),
+      static_cast<unsigned long long>(value));
+    string += line;
+  }
+
+  // one sample per stage, labeled with its index
+  void append_stage_metric(std::string& string, const char* name,
+      const char* type, const char* help, const StageProfiles& stages,
+      uint64_t StageProfile::*value) {
+    char line[256];
+    std::snprintf(line, sizeof(line),
+      "# TYPE keymapper_stage_%s %s\n# HELP keymapper_stage_%s %s\n",
+      name, type, name, help);
+    string += line;
+    for (auto i = size_t{ }; i < stages.size(); ++i) {
+      std::snprintf(line, sizeof(line), "keymapper_stage_%s%s{stage=\"%zu\"} %llu\n",
+        name, (std::string_view(type) == "counter" ? "_total" : ""), i,
+        static_cast<unsigned long long>(stages[i].*value));
+      string += line;
+    }
+  }
+
+  void append_metric_histogram(std::string& string, const char* name,
+      const char* help, const LatencyHistogram& histogram) {
+    char line[160];
+    std::snprintf(line, sizeof(line),
+      "# TYPE keymapper_%s_seconds histogram\n"
+      "# UNIT keymapper_%s_seconds seconds\n"
+      "# HELP keymapper_%s_seconds %s\n", name, name, name, help);
+    string += line;
+    for (auto bound : metrics_buckets) {
+      std::snprintf(line, sizeof(line),
+        "keymapper_%s_seconds_bucket{le=\"%g\"} %llu\n", name,
+        Seconds(bound).count(), static_cast<unsigned long long>(
+          histogram.count_at_most(bound)));
+      string += line;
+    }
+    std::snprintf(line, sizeof(line),
+      "keymapper_%s_seconds_bucket{le=\"+Inf\"} %llu\n"
+      "keymapper_%s_seconds_count %llu\n"
+      "keymapper_%s_seconds_sum %.9f\n", name,
+      static_cast<unsigned long long>(histogram.count()), name,
+      static_cast<unsigned long long>(histogram.count()), name,
+      Seconds(histogram.sum()).count());
+    string += line;
+  }
+} // namespace
+
+void LatencyHistogram::record(Clock::duration duration) {
+  const auto value = static_cast<uint64_t>(std::max(
+    std::chrono::duration_cast<Nanoseconds>(duration).count(),
+    Nanoseconds::rep{ }));
+
+  // the magnitude is the number of bits exceeding the sub bucket bits
+  auto magnitude = 0;
+  while ((value >> magnitude) >= (uint64_t{ 2 } << sub_bucket_bits) &&
+         magnitude < magnitudes)
+    ++magnitude;
+  const auto index = (static_cast<uint64_t>(magnitude) << sub_bucket_bits) +
+    (value >> magnitude);
+  ++m_buckets[std::min(static_cast<size_t>(index), m_buckets.size() - 1)];
+  ++m_count;
+  m_max = std::max(m_max, duration);
+  m_sum += duration;
+}
+
+uint64_t LatencyHistogram::count_at_most(Clock::duration bound) const {
+  const auto value = static_cast<uint64_t>(std::max(
+    std::chrono::duration_cast<Nanoseconds>(bound).count(),
+    Nanoseconds::rep{ }));
+  auto count = uint64_t{ };
+  const auto sub_buckets = (size_t{ 1 } << sub_bucket_bits);
+  for (auto index = size_t{ }; index < m_buckets.size(); ++index) {
+    const auto magnitude = (index < 2 * sub_buckets ? 0 :
+      static_cast<int>(index / sub_buckets) - 1);
+    const auto sub_bucket = index - static_cast<size_t>(magnitude) * sub_buckets;
+    const auto upper = ((static_cast<uint64_t>(sub_bucket) + 1) << magnitude) - 1;
+    if (upper > value)
+      break;
+    count += m_buckets[index];
+  }
+  return count;
+}
+
+Clock::duration LatencyHistogram::percentile(double p) const {
+  if (!m_count)
+    return { };
+  const auto rank = std::max(uint64_t{ 1 },
+    static_cast<uint64_t>(p * static_cast<double>(m_count) + 0.5));
+  auto total = uint64_t{ };
+  for (auto index = size_t{ }; index < m_buckets.size(); ++index) {
+    total += m_buckets[index];
+    if (total < rank)
+      continue;
+
+    // magnitude 0 holds the values below twice the sub bucket count
+    const auto sub_buckets = (size_t{ 1 } << sub_bucket_bits);
+    const auto magnitude = (index < 2 * sub_buckets ? 0 :
+      static_cast<int>(index / sub_buckets) - 1);
+    const auto sub_bucket = index - static_cast<size_t>(magnitude) * sub_buckets;
+    const auto upper = ((static_cast<uint64_t>(sub_bucket) + 1) << magnitude) - 1;
+    return std::min(std::chrono::duration_cast<Clock::duration>(
+      Nanoseconds(upper)), m_max);
+  }
+  return m_max;
+}
+
+std::string format_statistics(const Statistics& statistics) {
+  auto string = std::string();
+  char line[160];
+  std::snprintf(line, sizeof(line),
+    "events %llu, matches %llu, might matches %llu, "
+    "timeouts %llu, flushes %llu, optimized %llu\n",
+    static_cast<unsigned long long>(statistics.events),
+    static_cast<unsigned long long>(statistics.matches),
+    static_cast<unsigned long long>(statistics.might_matches),
+    static_cast<unsigned long long>(statistics.timeouts),
+    static_cast<unsigned long long>(statistics.flushes),
+    static_cast<unsigned long long>(statistics.optimized_events));
+  string += line;
+  std::snprintf(line, sizeof(line), "%-18s %10s %9s %9s %9s %9s %9s\n",
+    "latency", "count", "p50 us", "p90 us", "p99 us", "p99.9 us", "max us");
+  string += line;
+  append_histogram(string, "read-translate", statistics.read_to_translate);
+  append_histogram(string, "translate-send", statistics.translate_to_send);
+  append_histogram(string, "event-send", statistics.event_to_send);
+  append_histogram(string, "focus-match", statistics.focus_to_match);
+  append_histogram(string, "match-send", statistics.match_to_send);
+  append_histogram(string, "send-receive", statistics.send_to_receive);
+  append_histogram(string, "receive-apply", statistics.receive_to_apply);
+  append_histogram(string, "focus-apply", statistics.focus_to_apply);
+  append_histogram(string, "timeout-late", statistics.timeout_lateness);
+  append_histogram(string, "flush-late", statistics.flush_lateness);
+
+  if (!statistics.match_engines.empty()) {
+    string += "match engines     ";
+    for (const auto& engine : statistics.match_engines)
+      string += " " + engine;
+    string += "\n";
+  }
+
+  if (allocation_tracking_enabled) {
+    std::snprintf(line, sizeof(line), "%-18s %10s %9s %9s\n",
+      "allocations", "calls", "per call", "bytes");
+    string += line;
+    append_allocations(string, "translate", statistics.translate_allocations);
+    append_allocations(string, "flush", statistics.flush_allocations);
+  }
+
+  if (!statistics.stages.empty()) {
+    std::snprintf(line, sizeof(line), "%-18s %10s %10s %10s %10s %9s %9s\n",
+      "stages", "events in", "out", "might match", "forwarded",
+      "update us", "context us");
+    string += line;
+    for (auto i = size_t{ }; i < statistics.stages.size(); ++i) {
+      const auto& stage = statistics.stages[i];
+      char name[32];
+      std::snprintf(name, sizeof(name), "stage %zu", i);
+      std::snprintf(line, sizeof(line),
+        "%-18s %10llu %10llu %10llu %10llu %9.1f %9.1f\n", name,
+        static_cast<unsigned long long>(stage.events_in),
+        static_cast<unsigned long long>(stage.events_out),
+        static_cast<unsigned long long>(stage.might_match_holds),
+        static_cast<unsigned long long>(stage.forwarded_server_events),
+        static_cast<double>(stage.update_nanoseconds) / 1000,
+        static_cast<double>(stage.context_nanoseconds) / 1000);
+      string += line;
+    }
+  }
+  return string;
+}
+
+std::string format_open_metrics(const Statistics& statistics) {
+  auto string = std::string();
+  append_metric(string, "events", "counter",
+    "Translated input events.", statistics.events);
+  append_metric(string, "matches", "counter",
+    "Mappings which matched.", statistics.matches);
+  append_metric(string, "might_matches", "counter",
+    "Mappings which might match.", statistics.might_matches);
+  append_metric(string, "timeouts", "counter",
+    "Elapsed timeouts.", statistics.timeouts);
+  append_metric(string, "flushes", "counter",
+    "Flushes of the output.", statistics.flushes);
+  append_metric(string, "optimized_events", "counter",
+    "No-op transitions removed from the output.", statistics.optimized_events);
+  append_metric(string, "client_connections", "counter",
+    "Connections of keymapper clients.", statistics.client_connections);
+  append_metric(string, "state_corrections", "counter",
+    "Validations which found keys released.", statistics.state_corrections);
+  append_metric(string, "devices", "gauge",
+    "Grabbed input devices.", statistics.devices);
+  append_metric_histogram(string, "read_to_translate",
+    "From the device event until it was translated.",
+    statistics.read_to_translate);
+  append_metric_histogram(string, "translate_to_send",
+    "From the translation until the output was flushed.",
+    statistics.translate_to_send);
+  append_metric_histogram(string, "event_to_send",
+    "From the device event until the output was flushed.",
+    statistics.event_to_send);
+  append_metric_histogram(string, "focus_to_apply",
+    "From the focus change until the contexts were applied.",
+    statistics.focus_to_apply);
+  append_metric_histogram(string, "timeout_lateness",
+    "From the deadline of a timeout until it was injected.",
+    statistics.timeout_lateness);
+  append_metric_histogram(string, "flush_lateness",
+    "From the deadline of a delayed flush until it was processed.",
+    statistics.flush_lateness);
+
+  if (!statistics.match_engines.empty()) {
+    string += "# TYPE keymapper_stage_match_engine info\n"
+      "# HELP keymapper_stage_match_engine How the stage matches its inputs.\n";
+    for (auto i = size_t{ }; i < statistics.match_engines.size(); ++i) {
+      char line[128];
+      std::snprintf(line, sizeof(line),
+        "keymapper_stage_match_engine_info{stage=\"%zu\",engine=\"%s\"} 1\n",
+        i, statistics.match_engines[i].c_str());
+      string += line;
+    }
+  }
+
+  if (!statistics.stages.empty()) {
+    const auto& stages = statistics.stages;
+    append_stage_metric(string, "events_in", "counter",
+      "Events the stage updated.", stages, &StageProfile::events_in);
+    append_stage_metric(string, "events_out", "counter",
+      "Events the stage output.", stages, &StageProfile::events_out);
+    append_stage_metric(string, "might_match_holds", "counter",
+      "Mappings which might match, so the stage held back its input.",
+      stages, &StageProfile::might_match_holds);
+    append_stage_metric(string, "forwarded_server_events", "counter",
+      "Server events of previous stages passed on.", stages,
+      &StageProfile::forwarded_server_events);
+    append_stage_metric(string, "update_nanoseconds", "counter",
+      "Time spent updating the stage.", stages,
+      &StageProfile::update_nanoseconds);
+    append_stage_metric(string, "context_updates", "counter",
+      "Updates of the stage's active contexts.", stages,
+      &StageProfile::context_updates);
+    append_stage_metric(string, "context_nanoseconds", "counter",
+      "Time spent updating the stage's active contexts.", stages,
+      &StageProfile::context_nanoseconds);
+  }
+  string += "# EOF\n";
+  return string;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "AllocationTracker.h"
+#include "common/Duration.h"
+#include "common/StageProfile.h"
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Counts durations in buckets of exponentially growing size, which are
+// divided linearly, like an HDR histogram. So recording takes constant
+// time and memory, and percentiles are precise to about 6%.
+class LatencyHistogram {
+public:
+  void record(Clock::duration duration);
+  uint64_t count() const { return m_count; }
+  Clock::duration max() const { return m_max; }
+  Clock::duration sum() const { return m_sum; }
+  // number of durations in the buckets up to the bound
+  uint64_t count_at_most(Clock::duration bound) const;
+  // upper bound of the bucket the percentile lies in
+  Clock::duration percentile(double p) const;
+
+private:
+  static constexpr auto sub_bucket_bits = 4;
+  static constexpr auto magnitudes = 48;
+
+  std::array<uint64_t, (magnitudes + 2) << sub_bucket_bits> m_buckets{ };
+  uint64_t m_count{ };
+  Clock::duration m_max{ };
+  Clock::duration m_sum{ };
+};
+
+struct Statistics {
+  // from the time of the device event until it is translated
+  LatencyHistogram read_to_translate;
+  // from the translation until the output was written
+  LatencyHistogram translate_to_send;
+  // from the time of the device event until the output was written
+  LatencyHistogram event_to_send;
+  // from querying the focused window until the client matched the contexts,
+  // sent them, the server received and applied them
+  LatencyHistogram focus_to_match;
+  LatencyHistogram match_to_send;
+  LatencyHistogram send_to_receive;
+  LatencyHistogram receive_to_apply;
+  LatencyHistogram focus_to_apply;
+  // from the deadline of a timeout or a delayed flush until it was
+  // processed, the injected timeout event still contains the deadline
+  LatencyHistogram timeout_lateness;
+  LatencyHistogram flush_lateness;
+  uint64_t events{ };
+  uint64_t matches{ };
+  uint64_t might_matches{ };
+  uint64_t timeouts{ };
+  uint64_t flushes{ };
+  // no-op transitions removed from the output by @optimize-output
+  uint64_t optimized_events{ };
+  uint64_t client_connections{ };
+  // validate_state found keys released, which the stage considered down
+  uint64_t state_corrections{ };
+  uint64_t devices{ };
+  // only counted when built with ENABLE_ALLOCATION_TRACKING,
+  // translating includes the flushes it triggers
+  AllocationStatistics translate_allocations{ };
+  AllocationStatistics flush_allocations{ };
+  // of the current configuration, only while profiling is enabled
+  StageProfiles stages;
+  // how each stage of the current configuration matches its inputs
+  std::vector<std::string> match_engines;
+};
+
+std::string format_statistics(const Statistics& statistics);
+// in the OpenMetrics text format, for scraping by Prometheus
+std::string format_open_metrics(const Statistics& statistics);
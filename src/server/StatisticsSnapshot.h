@@ -0,0 +1,47 @@
+#pragma once
+
+#include "Statistics.h"
+#include <array>
+#include <atomic>
+
+// Passes copies of the statistics from the input thread to a single
+// reading thread. The reading thread requests a snapshot, which the input
+// thread publishes at its next safe point. Neither thread waits for the
+// other, the input thread only writes the buffer which is not published,
+// and only once per request.
+class StatisticsSnapshot {
+public:
+  // reading thread
+  void request() {
+    m_requested.store(true, std::memory_order_release);
+  }
+
+  // reading thread, increases with each published snapshot
+  uint64_t version() const {
+    return m_version.load(std::memory_order_acquire);
+  }
+
+  // reading thread, the latest published snapshot
+  const Statistics& statistics() const {
+    return m_buffers[m_version.load(std::memory_order_acquire) % 2];
+  }
+
+  // input thread
+  bool requested() const {
+    return m_requested.load(std::memory_order_relaxed);
+  }
+
+  // input thread
+  void publish(const Statistics& statistics) {
+    if (!m_requested.exchange(false, std::memory_order_acq_rel))
+      return;
+    const auto version = m_version.load(std::memory_order_relaxed) + 1;
+    m_buffers[version % 2] = statistics;
+    m_version.store(version, std::memory_order_release);
+  }
+
+private:
+  std::array<Statistics, 2> m_buffers{ };
+  std::atomic<uint64_t> m_version{ };
+  std::atomic<bool> m_requested{ };
+};
@@ -1,8 +1,11 @@
 #pragma once
 
 #include "runtime/KeyEvent.h"
+#include "runtime/KeyBitmap.h"
 #include "common/DeviceDesc.h"
 #include "common/Filter.h"
+#include "common/Duration.h"
+#include <functional>
 #include <memory>
 #include <optional>
 #include <utility>
@@ -18,7 +21,12 @@ public:
     int type;
     int code;
     int value;
+    Clock::time_point time;
   };
+  // event id and file descriptor of a grabbed device
+  using HandoffDevice = std::pair<int, int>;
+  // called from another thread, returns false when frame was not sent
+  using ForwardFrame = std::function<bool(const Event* events, size_t count)>;
 
   GrabbedDevices();
   GrabbedDevices(GrabbedDevices&&) noexcept;
@@ -27,10 +35,39 @@ public:
 
   bool grab(const char* virtual_device_name, bool grab_mice,
     std::vector<GrabDeviceFilter> grab_filters);
+  // only grabs/ungrabs the devices whose filter result changed,
+  // returns whether grabbed devices changed
+  bool set_grab_filters(bool grab_mice, 
+    std::vector<GrabDeviceFilter> grab_filters);
   bool update_devices();
+  // continues with the devices another process grabbed
+  bool adopt(const char* virtual_device_name, bool grab_mice,
+    const std::vector<HandoffDevice>& devices);
+  // releases the devices without ungrabbing them, so they can be passed
+  // to another process, the caller closes the file descriptors
+  std::vector<HandoffDevice> hand_off();
+  // returns without event when deadline is reached
+  // or one of the interrupt fds is readable, which sets interrupted
   std::pair<bool, std::optional<Event>> read_input_event(
-    std::optional<Duration> timeout, int interrupt_fd);
+    std::optional<Clock::time_point> deadline,
+    const std::vector<int>& interrupt_fds, bool* interrupted = nullptr);
+  // more events of the current frame were already read
+  bool reading_frame() const;
   const std::vector<DeviceDesc>& grabbed_device_descs() const;
+  // sets the keys which are down on any grabbed device,
+  // returns false when not supported
+  bool get_keys_down(KeyBitmap& keys_down) const;
+  // grabbed mice are read by separate threads, which forward the frames
+  // only containing pointer motion directly, unless other events of the
+  // device are still queued. Returns false when not supported.
+  bool set_pointer_forwarding(ForwardFrame forward_frame);
+  // all grabbed devices are read by separate threads, the frames are
+  // returned in the order of their kernel timestamps.
+  // Returns false when not supported.
+  bool set_reader_threads(bool enabled);
+  // the devices, which are not read by separate threads, are read by
+  // multishot reads of an io_uring. Returns false when not supported.
+  bool set_io_uring(bool enabled);
 
 private:
   std::unique_ptr<class GrabbedDevicesImpl> m_impl;
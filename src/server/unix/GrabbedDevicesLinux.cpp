@@ -1,18 +1,32 @@
 
 #include "GrabbedDevices.h"
+#include "server/LockFreeQueue.h"
 #include "common/output.h"
 #include "common/Duration.h"
 #include <cstdio>
 #include <cerrno>
+#include <cstring>
 #include <array>
 #include <algorithm>
+#include <atomic>
 #include <bitset>
 #include <iterator>
 #include <filesystem>
+#include <map>
+#include <thread>
+#include <tuple>
 #include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
 #include <linux/input.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/inotify.h>
+#include <sys/timerfd.h>
+
+#if defined(ENABLE_IO_URING)
+# include "IoUring.h"
+#endif
 
 namespace {
   struct IntRange {
@@ -22,6 +36,13 @@ namespace {
 
   const auto default_abs_range = IntRange{ 0, 1023 };
 
+  // wait for burst of hotplug events to end before updating
+  const auto update_devices_delay = std::chrono::milliseconds(100);
+
+  // devices with keys hold are grabbed once they are released
+  const auto retry_grab_delay = std::chrono::milliseconds(20);
+  const auto max_grab_delay = std::chrono::seconds(5);
+
   template<uint64_t Value> uint64_t bit = (1ull << Value);
 
   int map_to_range(int value, const IntRange& from, const IntRange& to) {
@@ -97,7 +118,9 @@ namespace {
     return "";
   }
 
-  std::string get_device_id(int event_id) {
+  // device ids by event id
+  std::map<int, std::string> get_device_ids() {
+    auto device_ids = std::map<int, std::string>();
     auto ec = std::error_code{ };
     for (auto const& entry : std::filesystem::directory_iterator("/dev/input/by-id", ec)) {
       auto target_event_id = 0;
@@ -108,10 +131,9 @@ namespace {
       if (::sscanf(target_path.c_str(), "../event%d", &target_event_id) != 1)
         continue;
 
-      if (target_event_id == event_id)
-        return entry.path().filename();
+      device_ids.emplace(target_event_id, entry.path().filename());
     }
-    return { };
+    return device_ids;
   }
 
   IntRange get_device_abs_range(int fd, int abs_event) {
@@ -121,23 +143,49 @@ namespace {
     return default_abs_range;
   }
 
-  bool wait_until_keys_released(int fd) {
-    const auto retries = 1000;
-    const auto sleep_ms = 5;
-    for (auto i = 0; i < retries; ++i) {
-      auto bits = std::array<char, (KEY_MAX + 7) / 8>();
-      if (::ioctl(fd, EVIOCGKEY(bits.size()), bits.data()) == -1)
-        return false;
+  using KeyBits = std::array<uint8_t, (KEY_MAX + 7) / 8>;
 
-      const auto all_keys_released =
-        std::none_of(std::cbegin(bits), std::cend(bits),
-          [](char bits) { return (bits != 0); });
-      if (all_keys_released)
-        return true;
+  bool get_key_bits(int fd, KeyBits& bits) {
+    return (::ioctl(fd, EVIOCGKEY(bits.size()), bits.data()) >= 0);
+  }
+
+  bool keys_released(int fd) {
+    auto bits = KeyBits{ };
+    if (!get_key_bits(fd, bits))
+      return true;
+
+    return std::none_of(std::cbegin(bits), std::cend(bits),
+      [](uint8_t bits) { return (bits != 0); });
+  }
 
-      ::usleep(sleep_ms * 1000);
+  // blocks until the device reports an event, which released the last key
+  bool wait_until_keys_released(int fd, Clock::time_point give_up_at) {
+    auto events = std::array<input_event, 64>{ };
+    while (!keys_released(fd)) {
+      const auto timeout = std::chrono::duration_cast<std::chrono::milliseconds>(
+        give_up_at - Clock::now()).count();
+      if (timeout <= 0)
+        return false;
+      auto pfd = pollfd{ fd, POLLIN, 0 };
+      const auto result = ::poll(&pfd, 1, static_cast<int>(timeout));
+      if (result < 0 && errno != EINTR)
+        return false;
+      if (result > 0 && ::read(fd, events.data(), sizeof(events)) <= 0)
+        return true;
     }
-    return false;
+    return true;
+  }
+
+  bool set_monotonic_clock(int fd) {
+    auto clock_id = int{ CLOCK_MONOTONIC };
+    return (::ioctl(fd, EVIOCSCLOCKID, &clock_id) == 0);
+  }
+
+  Clock::time_point get_event_time(const input_event& event) {
+    // steady_clock is CLOCK_MONOTONIC
+    return Clock::time_point(std::chrono::duration_cast<Clock::duration>(
+      std::chrono::seconds(event.input_event_sec) +
+      std::chrono::microseconds(event.input_event_usec)));
   }
 
   bool grab_event_device(int fd, bool grab) {
@@ -155,7 +203,7 @@ namespace {
   }
 
   int create_event_device_monitor() {
-    auto fd = ::inotify_init();
+    auto fd = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
     if (fd >= 0) {
       auto ret = ::inotify_add_watch(fd, "/dev/input", IN_CREATE | IN_DELETE);
       if (ret == -1) {
@@ -166,18 +214,200 @@ namespace {
     return fd;
   }
 
-  bool read_all(int fd, char* buffer, size_t length) {
-    while (length != 0) {
-      auto ret = ::read(fd, buffer, length);
+  // steady_clock is CLOCK_MONOTONIC
+  bool set_timer(int fd, std::optional<Clock::time_point> time) {
+    auto spec = itimerspec{ };
+    if (time) {
+      const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        time->time_since_epoch()).count();
+      // zero would disarm timer
+      spec.it_value.tv_sec = static_cast<time_t>(ns / 1'000'000'000);
+      spec.it_value.tv_nsec = std::max(static_cast<long>(ns % 1'000'000'000), 1l);
+    }
+    return (::timerfd_settime(fd, TFD_TIMER_ABSTIME, &spec, nullptr) == 0);
+  }
+
+  // reads as many events as available and fit, returns their count
+  int read_events(int fd, input_event* events, size_t count) {
+    for (;;) {
+      const auto ret = ::read(fd, events, count * sizeof(input_event));
       if (ret == -1 && errno == EINTR)
         continue;
       if (ret <= 0)
+        return 0;
+      return static_cast<int>(static_cast<size_t>(ret) / sizeof(input_event));
+    }
+  }
+
+  void signal_event_fd(int fd) {
+    const auto value = uint64_t{ 1 };
+    while (::write(fd, &value, sizeof(value)) < 0 && errno == EINTR) { }
+  }
+
+  bool is_wheel_code(int code) {
+    return (code == REL_WHEEL || code == REL_HWHEEL ||
+            code == REL_WHEEL_HI_RES || code == REL_HWHEEL_HI_RES);
+  }
+
+  // frames which neither contain keys nor wheel events are not translated
+  bool is_pointer_motion(const std::vector<input_event>& frame) {
+    auto motion = false;
+    for (const auto& event : frame) {
+      if (event.type == EV_REL && !is_wheel_code(event.code))
+        motion = true;
+      else if (event.type != EV_SYN && event.type != EV_MSC)
         return false;
-      length -= static_cast<size_t>(ret);
-      buffer += ret;
     }
-    return true;
+    return motion;
   }
+
+  // Reads a device in a separate thread. The frames are queued until the
+  // main thread handled them. When a forward function is passed, pointer
+  // motion is forwarded directly, while no frames are pending.
+  class DeviceReader {
+  public:
+    using Event = GrabbedDevices::Event;
+
+    DeviceReader(int fd, bool monotonic_clock, int notify_fd,
+        const GrabbedDevices::ForwardFrame* forward_frame)
+      : m_fd(fd),
+        m_monotonic_clock(monotonic_clock),
+        m_notify_fd(notify_fd),
+        m_forward_frame(forward_frame),
+        m_stop_fd(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+      m_frame.reserve(64);
+      m_forward_events.reserve(64);
+      m_thread = std::thread(&DeviceReader::run, this);
+    }
+
+    DeviceReader(const DeviceReader&) = delete;
+    DeviceReader& operator=(const DeviceReader&) = delete;
+
+    ~DeviceReader() {
+      signal_event_fd(m_stop_fd);
+      m_thread.join();
+      ::close(m_stop_fd);
+    }
+
+    // only used for the forwarded events
+    void set_device_index(int index) {
+      m_device_index.store(index, std::memory_order_relaxed);
+    }
+
+    bool has_frame() const {
+      return (m_popped_frames <
+        m_pushed_frames.load(std::memory_order_acquire));
+    }
+
+    // microseconds of first queued event, only valid when has_frame
+    uint64_t frame_time() const {
+      const auto& event = *m_queue.front();
+      return static_cast<uint64_t>(event.input_event_sec) * 1'000'000 +
+        static_cast<uint64_t>(event.input_event_usec);
+    }
+
+    bool disappeared() const {
+      return (m_disappeared.load(std::memory_order_acquire) && !has_frame());
+    }
+
+    // returns the count of events, the frame is complete when
+    // the last one is a SYN event
+    int pop_frame(input_event* events, size_t count) {
+      auto read = size_t{ };
+      while (read < count && m_queue.pop(events[read]))
+        if (events[read++].type == EV_SYN) {
+          ++m_popped_frames;
+          break;
+        }
+      return static_cast<int>(read);
+    }
+
+    // the popped frame was handled, so motion can be forwarded again
+    void frame_done() {
+      m_done_frames.fetch_add(1, std::memory_order_release);
+    }
+
+  private:
+    void run() {
+      auto fds = std::array<pollfd, 2>{ {
+        { m_fd, POLLIN, 0 },
+        { m_stop_fd, POLLIN, 0 },
+      } };
+      auto events = std::array<input_event, 64>{ };
+      for (;;) {
+        if (::poll(fds.data(), fds.size(), -1) < 0) {
+          if (errno == EINTR)
+            continue;
+          break;
+        }
+        if (fds[1].revents)
+          return;
+
+        const auto count = read_events(m_fd, events.data(), events.size());
+        if (!count)
+          break;
+        for (auto i = 0; i < count; ++i) {
+          m_frame.push_back(events[i]);
+          if (events[i].type == EV_SYN && !handle_frame())
+            return;
+        }
+      }
+      m_disappeared.store(true, std::memory_order_release);
+      signal_event_fd(m_notify_fd);
+    }
+
+    bool handle_frame() {
+      const auto pushed = m_pushed_frames.load(std::memory_order_relaxed);
+      if (m_forward_frame &&
+          pushed == m_done_frames.load(std::memory_order_acquire) &&
+          is_pointer_motion(m_frame) && forward_frame()) {
+        m_frame.clear();
+        return true;
+      }
+
+      for (const auto& event : m_frame)
+        while (!m_queue.try_push(event)) {
+          if (is_stopping())
+            return false;
+          std::this_thread::yield();
+        }
+      m_frame.clear();
+      m_pushed_frames.store(pushed + 1, std::memory_order_release);
+      signal_event_fd(m_notify_fd);
+      return true;
+    }
+
+    bool forward_frame() {
+      const auto device_index = m_device_index.load(std::memory_order_relaxed);
+      m_forward_events.clear();
+      for (const auto& ev : m_frame)
+        m_forward_events.push_back({ device_index, ev.type, ev.code, ev.value,
+          (m_monotonic_clock ? get_event_time(ev) : Clock::now()) });
+      return (*m_forward_frame)(m_forward_events.data(),
+        m_forward_events.size());
+    }
+
+    bool is_stopping() const {
+      auto fd = pollfd{ m_stop_fd, POLLIN, 0 };
+      return (::poll(&fd, 1, 0) > 0);
+    }
+
+    const int m_fd;
+    const bool m_monotonic_clock;
+    const int m_notify_fd;
+    const GrabbedDevices::ForwardFrame* m_forward_frame;
+    const int m_stop_fd;
+    std::atomic<int> m_device_index{ };
+    std::vector<input_event> m_frame;
+    std::vector<Event> m_forward_events;
+    LockFreeQueue<input_event, 1024> m_queue;
+    std::atomic<uint64_t> m_pushed_frames{ };
+    std::atomic<uint64_t> m_done_frames{ };
+    std::atomic<bool> m_disappeared{ };
+    // only accessed by the main thread
+    uint64_t m_popped_frames{ };
+    std::thread m_thread;
+  };
 } // namespace
 
 //-------------------------------------------------------------------------
@@ -189,7 +419,17 @@ private:
     int fd;
     IntRange abs_range_volume;
     IntRange abs_range_misc;
+    bool monotonic_clock;
+    DeviceDesc desc;
     bool disappeared;
+    bool mouse;
+    // only when pointer motion is forwarded
+    std::unique_ptr<DeviceReader> reader;
+    bool reader_disappeared;
+#if defined(ENABLE_IO_URING)
+    // id of the multishot read posted to the ring, zero when not posted
+    uint64_t ring_read_id;
+#endif
   };
 
   std::string_view m_ignore_device_name;
@@ -198,7 +438,61 @@ private:
   int m_device_monitor_fd{ -1 };
   std::vector<Device> m_grabbed_devices;
   std::vector<DeviceDesc> m_grabbed_device_descs;
-  bool m_devices_changed{ };
+  // event nodes created/deleted since last update
+  std::vector<int> m_added_event_ids;
+  std::vector<int> m_removed_event_ids;
+  bool m_rescan_devices{ };
+  std::optional<Clock::time_point> m_update_devices_at;
+  // event ids of devices not yet grabbed, since keys were hold
+  std::map<int, Clock::time_point> m_deferred_grabs;
+  // devices not yet ungrabbed, since keys were hold
+  struct ReleasingDevice {
+    int event_id;
+    int fd;
+    Clock::time_point give_up_at;
+  };
+  std::vector<ReleasingDevice> m_releasing_devices;
+  bool m_grabbed_devices_changed{ };
+
+  // epoll data is device index or tag of device monitor/interrupt
+  static constexpr uint64_t monitor_tag = ~uint64_t{ };
+  static constexpr uint64_t interrupt_tag = ~uint64_t{ } - 1;
+  static constexpr uint64_t timer_tag = ~uint64_t{ } - 2;
+  static constexpr uint64_t reader_tag = ~uint64_t{ } - 3;
+  static constexpr uint64_t releasing_tag = ~uint64_t{ } - 4;
+  int m_epoll_fd{ -1 };
+  std::vector<int> m_interrupt_fds;
+  // wakes up at deadline
+  int m_timer_fd{ -1 };
+  std::optional<Clock::time_point> m_timer_deadline;
+  // ready events not yet handled
+  std::array<epoll_event, 16> m_ready_events{ };
+  int m_ready_count{ };
+  int m_ready_index{ };
+  // events read from device, which were not returned yet
+  std::array<input_event, 64> m_read_events{ };
+  int m_read_count{ };
+  int m_read_index{ };
+  int m_read_device_index{ };
+  // mice or all devices are read by separate threads,
+  // which signal queued frames
+  GrabbedDevices::ForwardFrame m_forward_frame;
+  bool m_read_all_devices{ };
+  int m_reader_notify_fd{ -1 };
+  DeviceReader* m_frame_reader{ };
+  bool m_frame_complete{ };
+#if defined(ENABLE_IO_URING)
+  // the devices are read by multishot reads, the epoll fd is polled
+  // by the ring too, so only the other fds are waited on with epoll
+  static constexpr unsigned int ring_entries = 64;
+  static constexpr uint16_t ring_buffer_group = 0;
+  static constexpr uint16_t ring_buffer_count = 64;
+  static constexpr uint64_t ring_cancel_id = 0;
+  std::unique_ptr<IoUring> m_ring;
+  uint64_t m_next_ring_id{ 1 };
+  uint64_t m_ring_poll_id{ };
+  bool m_ring_epoll_ready{ };
+#endif
 
 public:
   using Event = GrabbedDevices::Event;
@@ -207,10 +501,14 @@ public:
   ~GrabbedDevicesImpl() {
     if (!m_grabbed_devices.empty()) {
       verbose("Ungrabbing all devices");
-      for (const auto& device : m_grabbed_devices)
+      for (auto& device : m_grabbed_devices)
         ungrab_device(device);
     }
+    finish_releasing_devices();
     release_device_monitor();
+    release_epoll();
+    if (m_reader_notify_fd >= 0)
+      ::close(m_reader_notify_fd);
   }
 
   bool initialize(const char* ignore_device_name, bool grab_mice,
@@ -219,121 +517,690 @@ public:
     m_grab_mice = grab_mice;
     m_grab_filters = std::move(grab_filters);
     update();
+    m_grabbed_devices_changed = false;
     return true;
   }
 
-  bool update_devices() {
-    if (!m_devices_changed)
-      return false;
+  // the filters are updated once a client connects
+  bool adopt(const char* ignore_device_name, bool grab_mice,
+      const std::vector<GrabbedDevices::HandoffDevice>& devices) {
+    m_ignore_device_name = ignore_device_name;
+    m_grab_mice = grab_mice;
+    verbose("Adopting grabbed devices");
+    initialize_device_monitor();
+    const auto device_ids = get_device_ids();
+    for (const auto& [event_id, fd] : devices) {
+      const auto device_name = get_device_name(fd);
+      const auto id = device_ids.find(event_id);
+      auto& device = m_grabbed_devices.emplace_back(Device{
+        event_id,
+        fd,
+        get_device_abs_range(fd, ABS_VOLUME),
+        get_device_abs_range(fd, ABS_MISC),
+        set_monotonic_clock(fd),
+        { device_name, (id != device_ids.end() ? id->second : "") },
+        false,
+        has_mouse_axes(fd),
+      });
+      start_reader(device);
+      verbose("  /dev/input/event%d adopted (%s)", event_id,
+        device_name.c_str());
+    }
+    update_grabbed_device_descs();
+    m_grabbed_devices_changed = false;
+    return true;
+  }
+
+  std::vector<GrabbedDevices::HandoffDevice> hand_off() {
+    stop_readers();
+    finish_releasing_devices();
+    auto devices = std::vector<GrabbedDevices::HandoffDevice>();
+    for (const auto& device : m_grabbed_devices)
+      devices.emplace_back(device.event_id, device.fd);
+    m_grabbed_devices.clear();
+    m_grabbed_device_descs.clear();
+    release_epoll();
+#if defined(ENABLE_IO_URING)
+    // the other process reads the devices
+    m_ring.reset();
+#endif
+    return devices;
+  }
 
+  bool set_grab_filters(bool grab_mice,
+      std::vector<GrabDeviceFilter> grab_filters) {
+    m_grab_mice = grab_mice;
+    m_grab_filters = std::move(grab_filters);
+    // devices which do no longer match are ungrabbed as disappeared
+    m_grabbed_devices_changed = false;
     update();
-    m_devices_changed = false;
-    return true;
+    return std::exchange(m_grabbed_devices_changed, false);
+  }
+
+  bool update_devices() {
+    if (!m_update_devices_at || Clock::now() < *m_update_devices_at)
+      return false;
+    m_update_devices_at.reset();
+
+    if (std::exchange(m_rescan_devices, false))
+      update();
+    else
+      update_changed();
+    m_added_event_ids.clear();
+    m_removed_event_ids.clear();
+    return std::exchange(m_grabbed_devices_changed, false);
   }
 
   const std::vector<DeviceDesc>& grabbed_device_descs() const {
     return m_grabbed_device_descs;
   }
 
+  bool get_keys_down(KeyBitmap& keys_down) const {
+    auto bits = KeyBits{ };
+    for (const auto& device : m_grabbed_devices) {
+      auto device_bits = KeyBits{ };
+      if (!get_key_bits(device.fd, device_bits))
+        return false;
+      for (auto i = 0u; i < bits.size(); ++i)
+        bits[i] |= device_bits[i];
+    }
+
+    for (auto i = 0u; i < bits.size(); ++i)
+      for (auto b = 0u; bits[i] >> b; ++b)
+        if (bits[i] & (1u << b))
+          keys_down.set(static_cast<Key>(i * 8 + b));
+    return true;
+  }
+
+  bool set_pointer_forwarding(GrabbedDevices::ForwardFrame forward_frame) {
+    stop_readers();
+    m_forward_frame = std::move(forward_frame);
+    if (m_forward_frame && !create_reader_notify_fd())
+      m_forward_frame = { };
+    start_readers();
+    return static_cast<bool>(m_forward_frame);
+  }
+
+  bool set_reader_threads(bool enabled) {
+    stop_readers();
+    m_read_all_devices = (enabled && create_reader_notify_fd());
+    start_readers();
+    return (m_read_all_devices == enabled);
+  }
+
+  bool set_io_uring(bool enabled) {
+#if defined(ENABLE_IO_URING)
+    release_ring();
+    if (enabled) {
+      auto ring = std::make_unique<IoUring>();
+      if (ring->create(ring_entries) &&
+          ring->supports(IoUring::op_read_multishot) &&
+          ring->create_buffer_ring(ring_buffer_group,
+            sizeof(m_read_events), ring_buffer_count))
+        m_ring = std::move(ring);
+    }
+    initialize_epoll();
+    return (static_cast<bool>(m_ring) == enabled);
+#else
+    return !enabled;
+#endif
+  }
+
+  bool reading_frame() const {
+    if (m_read_index >= m_read_count)
+      return (m_frame_reader && !m_frame_complete);
+    return (m_read_events[m_read_index - 1].type != EV_SYN);
+  }
+
   std::pair<bool, std::optional<Event>> read_input_event(
-        std::optional<Duration> timeout, int interrupt_fd) {
-    for (;;) {
-      auto read_set = fd_set{ };
-      FD_ZERO(&read_set);
-      auto max_fd = 0;
-      for (const auto& device : m_grabbed_devices) {
-        max_fd = std::max(max_fd, device.fd);
-        FD_SET(device.fd, &read_set);
-      }
+        std::optional<Clock::time_point> deadline,
+        const std::vector<int>& interrupt_fds, bool* interrupted) {
+    if (m_read_index < m_read_count)
+      return { true, get_read_event() };
+
+    if (m_frame_reader) {
+      // continue frame, which did not fit in buffer
+      if (!m_frame_complete && pop_reader_frame(m_frame_reader))
+        return { true, get_read_event() };
+      m_frame_reader->frame_done();
+      m_frame_reader = nullptr;
+    }
 
-      if (m_device_monitor_fd >= 0) {
-        max_fd = std::max(max_fd, m_device_monitor_fd);
-        FD_SET(m_device_monitor_fd, &read_set);
-      }
+    if (m_update_devices_at && (!deadline || *m_update_devices_at < *deadline))
+      deadline = m_update_devices_at;
+    for (const auto& device : m_releasing_devices)
+      if (!deadline || device.give_up_at < *deadline)
+        deadline = device.give_up_at;
 
-      if (interrupt_fd >= 0) {
-        max_fd = std::max(max_fd, interrupt_fd);
-        FD_SET(interrupt_fd, &read_set);
-      }
+    if (deadline != m_timer_deadline) {
+      if (!set_timer(m_timer_fd, deadline))
+        return { false, std::nullopt };
+      m_timer_deadline = deadline;
+    }
+
+    if (interrupt_fds != m_interrupt_fds) {
+      for (auto fd : m_interrupt_fds)
+        ::epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+      m_interrupt_fds.clear();
+      for (auto fd : interrupt_fds)
+        if (fd >= 0 && add_to_epoll(fd, interrupt_tag))
+          m_interrupt_fds.push_back(fd);
+    }
 
-      auto timeoutval = (timeout ? to_timeval(timeout.value()) : timeval{ });
-      const auto result = ::select(max_fd + 1, &read_set,
-        nullptr, nullptr, (timeout ? &timeoutval : nullptr));
+    if (m_ready_index >= m_ready_count) {
+      m_ready_index = 0;
+      m_ready_count = 0;
+      // only poll the other fds while frames are queued
+      const auto timeout = (has_reader_frame() ? 0 : -1);
+#if defined(ENABLE_IO_URING)
+      const auto waited = (m_ring ? wait_ring(timeout) : wait_epoll(timeout));
+#else
+      const auto waited = wait_epoll(timeout);
+#endif
+      if (!waited)
+        return { false, std::nullopt };
+      // the ring read the events of a device
+      if (m_read_index < m_read_count)
+        return { true, get_read_event() };
+      if (!m_ready_count)
+        return read_reader_frame();
+
+      // handle device monitor and interrupt first
+      std::partition(m_ready_events.begin(), 
+        m_ready_events.begin() + m_ready_count,
+        [](const epoll_event& event) { return event.data.u64 >= timer_tag; });
+    }
+
+    const auto tag = m_ready_events[m_ready_index++].data.u64;
+    if (tag == monitor_tag) {
+      read_device_monitor();
+      m_update_devices_at = Clock::now() + update_devices_delay;
+      return { true, std::nullopt };
+    }
+
+    if (tag == interrupt_tag) {
+      if (interrupted)
+        *interrupted = true;
+      return { true, std::nullopt };
+    }
+
+    if (tag == timer_tag) {
+      // deadline reached, timer is disarmed
+      auto expirations = uint64_t{ };
+      if (::read(m_timer_fd, &expirations, sizeof(expirations)) < 0 &&
+          errno != EAGAIN)
+        return { false, std::nullopt };
+      m_timer_deadline.reset();
+      update_releasing_devices(false);
+      return { true, std::nullopt };
+    }
+
+    if (tag == releasing_tag) {
+      update_releasing_devices(true);
+      return { true, std::nullopt };
+    }
+
+    if (tag == reader_tag) {
+      auto value = uint64_t{ };
+      if (::read(m_reader_notify_fd, &value, sizeof(value)) < 0 &&
+          errno != EAGAIN)
+        return { false, std::nullopt };
+      return read_reader_frame();
+    }
+
+    // read all available events at once
+    m_read_device_index = static_cast<int>(tag);
+    m_read_index = 0;
+    const auto& device = m_grabbed_devices[m_read_device_index];
+    m_read_count = read_events(device.fd,
+      m_read_events.data(), m_read_events.size());
+    if (!m_read_count) {
+      // device disappeared, stop reading until devices are updated
+      ::epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, device.fd, nullptr);
+      m_removed_event_ids.push_back(device.event_id);
+      if (!m_update_devices_at)
+        m_update_devices_at = Clock::now() + update_devices_delay;
+      return { true, std::nullopt };
+    }
+
+    return { true, get_read_event() };
+  }
+
+private:
+  bool wait_epoll(int timeout) {
+    for (;;) {
+      const auto result = ::epoll_wait(m_epoll_fd, m_ready_events.data(),
+        static_cast<int>(m_ready_events.size()), timeout);
       if (result == -1 && errno == EINTR)
         continue;
 
       if (result < 0)
-        return { false, std::nullopt };
+        return false;
 
-      if (m_device_monitor_fd >= 0 &&
-          FD_ISSET(m_device_monitor_fd, &read_set)) {
-        m_devices_changed = true;
-        return { true, std::nullopt };
+      m_ready_count = result;
+      return true;
+    }
+  }
+
+#if defined(ENABLE_IO_URING)
+  // returns with the events of a device read or the ready events of epoll,
+  // or without any, when a device disappeared or timeout is zero
+  bool wait_ring(int timeout) {
+    for (;;) {
+      if (m_ring_epoll_ready) {
+        if (!wait_epoll(0))
+          return false;
+        // level triggered fds can stay ready without another wakeup
+        m_ring_epoll_ready = (m_ready_count > 0);
+        if (m_ready_count)
+          return true;
       }
 
-      if (interrupt_fd >= 0 &&
-          FD_ISSET(interrupt_fd, &read_set))
-        return { true, std::nullopt };
-
-      auto device_index = 0;
-      for (const auto& device : m_grabbed_devices) {
-        if (FD_ISSET(device.fd, &read_set)) {
-          auto ev = input_event{ };
-          if (!read_all(device.fd,
-                reinterpret_cast<char*>(&ev), sizeof(input_event)))
-            return { false, std::nullopt };
-
-          // map from device range to default range
-          if (ev.type == EV_ABS) {
-            if (ev.code == ABS_VOLUME) {
-              ev.value = map_to_range(ev.value, device.abs_range_volume, default_abs_range);
-            }
-            else if (ev.code == ABS_MISC) {
-              ev.value = map_to_range(ev.value, device.abs_range_misc, default_abs_range);
-            }
-          }
+      while (const auto cqe = m_ring->peek_cqe()) {
+        const auto [user_data, result, flags] =
+          std::tuple(cqe->user_data, cqe->res, cqe->flags);
+        m_ring->pop_cqe();
+        if (handle_ring_completion(user_data, result, flags))
+          return true;
+      }
+      if (m_ring_epoll_ready)
+        continue;
 
-          return { true, Event{ device_index, ev.type, ev.code, ev.value } };
-        }
-        ++device_index;
+      if (!m_ring->submit(timeout ? 1 : 0))
+        return false;
+      if (!timeout && !m_ring->peek_cqe())
+        return true;
+    }
+  }
+
+  // returns true when the device events were read or it disappeared
+  bool handle_ring_completion(uint64_t user_data, int result,
+      uint32_t flags) {
+    if (user_data == ring_cancel_id)
+      return false;
+
+    if (user_data == m_ring_poll_id) {
+      if (!(flags & IORING_CQE_F_MORE))
+        post_ring_poll();
+      m_ring_epoll_ready = true;
+      return false;
+    }
+
+    const auto has_buffer = ((flags & IORING_CQE_F_BUFFER) != 0);
+    const auto buffer_id =
+      static_cast<uint16_t>(flags >> IORING_CQE_BUFFER_SHIFT);
+    const auto it = std::find_if(m_grabbed_devices.begin(),
+      m_grabbed_devices.end(), [&](const Device& device) {
+        return (device.ring_read_id == user_data);
+      });
+    if (it == m_grabbed_devices.end()) {
+      // read of a device which is no longer read
+      if (has_buffer)
+        m_ring->recycle_buffer(buffer_id);
+      return false;
+    }
+
+    auto& device = *it;
+    if (has_buffer) {
+      // the buffers have the size of the read events
+      const auto size = static_cast<size_t>(std::max(result, 0));
+      std::memcpy(m_read_events.data(), m_ring->get_buffer(buffer_id), size);
+      m_ring->recycle_buffer(buffer_id);
+      m_read_device_index = static_cast<int>(
+        std::distance(m_grabbed_devices.begin(), it));
+      m_read_index = 0;
+      m_read_count = static_cast<int>(size / sizeof(input_event));
+    }
+
+    if (!(flags & IORING_CQE_F_MORE)) {
+      if (result > 0 || result == -ENOBUFS) {
+        // the read terminates, when the buffers were used up
+        device.ring_read_id = 0;
+        post_ring_read(device);
+        m_ring->submit();
+      }
+      else if (result != -ECANCELED) {
+        // device disappeared, stop reading until devices are updated
+        m_removed_event_ids.push_back(device.event_id);
+        if (!m_update_devices_at)
+          m_update_devices_at = Clock::now() + update_devices_delay;
+        return true;
+      }
+    }
+    return (m_read_count > 0);
+  }
+
+  void post_ring_poll() {
+    if (const auto sqe = m_ring->get_sqe()) {
+      m_ring_poll_id = m_next_ring_id++;
+      prepare_poll_multishot(*sqe, m_epoll_fd, m_ring_poll_id);
+    }
+  }
+
+  void post_ring_read(Device& device) {
+    if (const auto sqe = m_ring->get_sqe()) {
+      device.ring_read_id = m_next_ring_id++;
+      prepare_read_multishot(*sqe, device.fd, ring_buffer_group,
+        device.ring_read_id);
+    }
+  }
+
+  void cancel_ring_read(Device& device) {
+    if (!m_ring || !device.ring_read_id)
+      return;
+    if (const auto sqe = m_ring->get_sqe())
+      prepare_cancel(*sqe, std::exchange(device.ring_read_id, 0),
+        ring_cancel_id);
+    m_ring->submit();
+  }
+
+  void update_ring() {
+    if (!m_ring)
+      return;
+    // the epoll fd was created again
+    if (m_ring_poll_id) {
+      if (const auto sqe = m_ring->get_sqe())
+        prepare_cancel(*sqe, m_ring_poll_id, ring_cancel_id);
+      m_ring_poll_id = 0;
+    }
+    m_ring_epoll_ready = false;
+    post_ring_poll();
+
+    for (auto& device : m_grabbed_devices)
+      if (device.reader)
+        cancel_ring_read(device);
+      else if (!device.ring_read_id)
+        post_ring_read(device);
+    m_ring->submit();
+  }
+
+  void release_ring() {
+    m_ring.reset();
+    m_ring_poll_id = 0;
+    m_ring_epoll_ready = false;
+    for (auto& device : m_grabbed_devices)
+      device.ring_read_id = 0;
+  }
+#endif
+
+  bool has_reader_frame() const {
+    return std::any_of(m_grabbed_devices.begin(), m_grabbed_devices.end(),
+      [](const Device& device) {
+        return (device.reader && device.reader->has_frame());
+      });
+  }
+
+  bool pop_reader_frame(DeviceReader* reader) {
+    m_read_index = 0;
+    m_read_count = reader->pop_frame(m_read_events.data(),
+      m_read_events.size());
+    m_frame_complete = (m_read_count > 0 &&
+      m_read_events[m_read_count - 1].type == EV_SYN);
+    return (m_read_count > 0);
+  }
+
+  // returns the queued frame, which was read first by the kernel.
+  // Frames, which are not yet queued by a busy reader, are not awaited
+  std::pair<bool, std::optional<Event>> read_reader_frame() {
+    for (auto& device : m_grabbed_devices)
+      if (device.reader && device.reader->disappeared() &&
+          !std::exchange(device.reader_disappeared, true)) {
+        // device disappeared, update devices soon
+        m_removed_event_ids.push_back(device.event_id);
+        if (!m_update_devices_at)
+          m_update_devices_at = Clock::now() + update_devices_delay;
       }
-      
-      // timeout
+
+    auto first = -1;
+    auto first_time = uint64_t{ };
+    for (auto i = size_t{ }; i < m_grabbed_devices.size(); ++i) {
+      const auto& reader = m_grabbed_devices[i].reader;
+      if (!reader || !reader->has_frame())
+        continue;
+      const auto time = reader->frame_time();
+      if (first < 0 || time < first_time) {
+        first = static_cast<int>(i);
+        first_time = time;
+      }
+    }
+    if (first < 0)
       return { true, std::nullopt };
+
+    m_frame_reader = m_grabbed_devices[first].reader.get();
+    m_read_device_index = first;
+    pop_reader_frame(m_frame_reader);
+    return { true, get_read_event() };
+  }
+
+  bool create_reader_notify_fd() {
+    if (m_reader_notify_fd < 0)
+      m_reader_notify_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return (m_reader_notify_fd >= 0);
+  }
+
+  void start_reader(Device& device) {
+    const auto forward = (m_forward_frame && device.mouse);
+    if (!device.reader && (forward || m_read_all_devices))
+      device.reader = std::make_unique<DeviceReader>(device.fd,
+        device.monotonic_clock, m_reader_notify_fd,
+        (forward ? &m_forward_frame : nullptr));
+  }
+
+  void start_readers() {
+    for (auto& device : m_grabbed_devices)
+      start_reader(device);
+    initialize_epoll();
+  }
+
+  void stop_readers() {
+    for (auto& device : m_grabbed_devices)
+      stop_reader(device);
+  }
+
+  void stop_reader(Device& device) {
+    if (!device.reader)
+      return;
+    if (m_frame_reader == device.reader.get()) {
+      m_frame_reader = nullptr;
+      m_read_count = 0;
+      m_read_index = 0;
     }
+    device.reader.reset();
+  }
+
+  Event get_read_event() {
+    const auto& device = m_grabbed_devices[m_read_device_index];
+    auto ev = m_read_events[m_read_index++];
+
+    // map from device range to default range
+    if (ev.type == EV_ABS) {
+      if (ev.code == ABS_VOLUME) {
+        ev.value = map_to_range(ev.value, device.abs_range_volume, default_abs_range);
+      }
+      else if (ev.code == ABS_MISC) {
+        ev.value = map_to_range(ev.value, device.abs_range_misc, default_abs_range);
+      }
+    }
+    return Event{ m_read_device_index, ev.type, ev.code, ev.value,
+      (device.monotonic_clock ? get_event_time(ev) : Clock::now()) };
   }
 
-private:
   void initialize_device_monitor() {
     release_device_monitor();
     m_device_monitor_fd = create_event_device_monitor();
   }
 
+  void read_device_monitor() {
+    alignas(inotify_event) auto buffer = std::array<char, 4096>{ };
+    for (;;) {
+      const auto size = ::read(m_device_monitor_fd, buffer.data(), buffer.size());
+      if (size == -1 && errno == EINTR)
+        continue;
+      if (size <= 0)
+        break;
+
+      for (auto it = buffer.data(); it < buffer.data() + size; ) {
+        const auto& event = *reinterpret_cast<const inotify_event*>(it);
+        it += sizeof(inotify_event) + event.len;
+
+        auto event_id = 0;
+        if (event.mask & IN_Q_OVERFLOW) {
+          m_rescan_devices = true;
+        }
+        else if (event.len &&
+            ::sscanf(event.name, "event%d", &event_id) == 1) {
+          if (event.mask & IN_CREATE) {
+            m_added_event_ids.push_back(event_id);
+          }
+          else if (event.mask & IN_DELETE) {
+            m_added_event_ids.erase(std::remove(m_added_event_ids.begin(),
+              m_added_event_ids.end(), event_id), m_added_event_ids.end());
+            m_removed_event_ids.push_back(event_id);
+          }
+        }
+      }
+    }
+  }
+
   void release_device_monitor() {
     if (m_device_monitor_fd >= 0) {
       ::close(m_device_monitor_fd);
       m_device_monitor_fd = -1;
     }
   }
+
+  bool add_to_epoll(int fd, uint64_t tag) {
+    auto event = epoll_event{ };
+    event.events = EPOLLIN;
+    event.data.u64 = tag;
+    return (::epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &event) == 0);
+  }
+
+  void release_epoll() {
+    if (m_epoll_fd >= 0) {
+      ::close(m_epoll_fd);
+      m_epoll_fd = -1;
+    }
+    if (m_timer_fd >= 0) {
+      ::close(m_timer_fd);
+      m_timer_fd = -1;
+    }
+    m_timer_deadline.reset();
+    m_interrupt_fds.clear();
+    m_ready_count = 0;
+    m_ready_index = 0;
+    m_read_count = 0;
+    m_read_index = 0;
+    if (m_frame_reader) {
+      m_frame_reader->frame_done();
+      m_frame_reader = nullptr;
+    }
+  }
+
+  void initialize_epoll() {
+    // device indices changed, register all again
+    release_epoll();
+    m_epoll_fd = ::epoll_create1(EPOLL_CLOEXEC);
+    if (m_epoll_fd < 0)
+      return;
+    m_timer_fd = ::timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (m_timer_fd >= 0)
+      add_to_epoll(m_timer_fd, timer_tag);
+    if (m_device_monitor_fd >= 0)
+      add_to_epoll(m_device_monitor_fd, monitor_tag);
+    if (m_reader_notify_fd >= 0)
+      add_to_epoll(m_reader_notify_fd, reader_tag);
+    for (auto i = size_t{ }; i < m_grabbed_devices.size(); ++i) {
+      auto& device = m_grabbed_devices[i];
+      if (device.reader)
+        device.reader->set_device_index(static_cast<int>(i));
+#if defined(ENABLE_IO_URING)
+      else if (m_ring)
+        continue;
+#endif
+      else
+        add_to_epoll(device.fd, i);
+    }
+    for (const auto& device : m_releasing_devices)
+      add_to_epoll(device.fd, releasing_tag);
+#if defined(ENABLE_IO_URING)
+    update_ring();
+#endif
+  }
   
-  bool grab_device(int event_id, int fd) {
-    wait_until_keys_released(fd);
+  bool grab_device(int event_id, int fd, DeviceDesc desc) {
     if (!grab_event_device(fd, true))
       return false;
 
-    m_grabbed_devices.push_back({
+    auto& device = m_grabbed_devices.emplace_back(Device{
       event_id,
       ::dup(fd),
       get_device_abs_range(fd, ABS_VOLUME),
       get_device_abs_range(fd, ABS_MISC),
+      set_monotonic_clock(fd),
+      std::move(desc),
+      false,
+      has_mouse_axes(fd),
     });
+    start_reader(device);
+    m_grabbed_devices_changed = true;
     return true;
   }
 
-  void ungrab_device(const Device& device) {
-    wait_until_keys_released(device.fd);
-    grab_event_device(device.fd, false);
-    ::close(device.fd);
+  // keeps device grabbed until its keys are released, so the
+  // application does not receive the releases without the presses
+  void ungrab_device(Device& device) {
+    stop_reader(device);
+#if defined(ENABLE_IO_URING)
+    cancel_ring_read(device);
+#endif
+    m_grabbed_devices_changed = true;
+    if (keys_released(device.fd))
+      return release_device(device.fd);
+
+    verbose("  /dev/input/event%d ungrab deferred until keys are released",
+      device.event_id);
+    m_releasing_devices.push_back({ device.event_id, device.fd,
+      Clock::now() + max_grab_delay });
+    if (m_epoll_fd >= 0)
+      add_to_epoll(device.fd, releasing_tag);
+  }
+
+  void release_device(int fd) {
+    grab_event_device(fd, false);
+    ::close(fd);
+  }
+
+  // discards the events of the releasing devices and ungrabs the
+  // ones whose keys were released
+  void update_releasing_devices(bool read_events) {
+    const auto now = Clock::now();
+    auto events = std::array<input_event, 64>{ };
+    for (auto it = m_releasing_devices.begin(); it != m_releasing_devices.end(); ) {
+      auto pfd = pollfd{ it->fd, POLLIN, 0 };
+      const auto disappeared = (read_events && ::poll(&pfd, 1, 0) > 0 &&
+        ::read(it->fd, events.data(), sizeof(events)) <= 0);
+      if (disappeared || now >= it->give_up_at || keys_released(it->fd)) {
+        if (m_epoll_fd >= 0)
+          ::epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, it->fd, nullptr);
+        release_device(it->fd);
+        verbose("  /dev/input/event%d released", it->event_id);
+        it = m_releasing_devices.erase(it);
+      }
+      else {
+        ++it;
+      }
+    }
+  }
+
+  void finish_releasing_devices() {
+    for (const auto& device : m_releasing_devices) {
+      wait_until_keys_released(device.fd, device.give_up_at);
+      if (m_epoll_fd >= 0)
+        ::epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, device.fd, nullptr);
+      release_device(device.fd);
+    }
+    m_releasing_devices.clear();
   }
 
   void update() {
@@ -347,6 +1214,8 @@ private:
       device.disappeared = true;
 
     // grab new devices
+    const auto device_ids = get_device_ids();
+    const auto deferred_grabs = std::exchange(m_deferred_grabs, { });
     auto ec = std::error_code{ };
     for (auto const& entry : std::filesystem::directory_iterator("/dev/input", ec)) {
       const auto& path = entry.path();
@@ -355,34 +1224,7 @@ private:
           ::sscanf(path.c_str(), "/dev/input/event%d", &event_id) != 1)
         continue;
 
-      if (const auto fd = open_event_device(path.c_str()); fd >= 0) {
-        const auto device_name = get_device_name(fd);
-        const auto device_id = get_device_id(event_id);
-        auto status = "ignored";
-        if (is_supported_device(fd) &&
-            device_name != m_ignore_device_name) {
-          status = "skipped";
-          if (evaluate_grab_filters(m_grab_filters, device_name, device_id,
-                is_grabbed_by_default(fd, m_grab_mice))) {
-            const auto it = std::find_if(m_grabbed_devices.begin(), m_grabbed_devices.end(),
-              [&](const Device& device) { return device.event_id == event_id; });
-            if (it == m_grabbed_devices.end()) {
-              status = "grabbing failed";
-              if (grab_device(event_id, fd))
-                status = "grabbed";
-            }
-            else {
-              status = "already grabbed";
-              it->disappeared = false;
-            }
-          }
-        }
-        ::close(fd);
-        verbose("  %s %s (%s)", path.c_str(), status, device_name.c_str());
-      }
-      else {
-        verbose("  %s opening failed", path.c_str());
-      }
+      probe_device(event_id, device_ids, deferred_grabs);
     }
 
     // ungrab disappeared devices
@@ -397,13 +1239,102 @@ private:
       }
     }
     
+    update_grabbed_device_descs();
+    schedule_deferred_grabs();
+  }
+
+  // only probes the event nodes which were created or deleted
+  // and the devices which are still waiting to be grabbed
+  void update_changed() {
+    if (!m_added_event_ids.empty() || !m_removed_event_ids.empty())
+      verbose("Updating changed devices");
+
+    for (auto event_id : m_removed_event_ids) {
+      const auto it = std::find_if(m_grabbed_devices.begin(), m_grabbed_devices.end(),
+        [&](const Device& device) { return device.event_id == event_id; });
+      if (it != m_grabbed_devices.end()) {
+        ungrab_device(*it);
+        verbose("  /dev/input/event%d ungrabbed", it->event_id);
+        m_grabbed_devices.erase(it);
+      }
+    }
+
+    const auto deferred_grabs = std::exchange(m_deferred_grabs, { });
+    for (const auto& [event_id, give_up_at] : deferred_grabs)
+      if (std::count(m_added_event_ids.begin(), m_added_event_ids.end(), event_id) == 0 &&
+          std::count(m_removed_event_ids.begin(), m_removed_event_ids.end(), event_id) == 0)
+        m_added_event_ids.push_back(event_id);
+
+    if (!m_added_event_ids.empty()) {
+      const auto device_ids = get_device_ids();
+      for (auto event_id : m_added_event_ids)
+        probe_device(event_id, device_ids, deferred_grabs);
+    }
+
+    if (m_grabbed_devices_changed)
+      update_grabbed_device_descs();
+    schedule_deferred_grabs();
+  }
+
+  void schedule_deferred_grabs() {
+    if (!m_deferred_grabs.empty() && !m_update_devices_at)
+      m_update_devices_at = Clock::now() + retry_grab_delay;
+  }
+
+  void probe_device(int event_id, const std::map<int, std::string>& device_ids,
+      const std::map<int, Clock::time_point>& deferred_grabs) {
+    const auto path = "/dev/input/event" + std::to_string(event_id);
+    const auto fd = open_event_device(path.c_str());
+    if (fd < 0) {
+      verbose("  %s opening failed", path.c_str());
+      return;
+    }
+
+    const auto device_name = get_device_name(fd);
+    const auto id = device_ids.find(event_id);
+    const auto device_id = (id != device_ids.end() ? id->second : std::string());
+    auto status = "ignored";
+    if (is_supported_device(fd) &&
+        device_name != m_ignore_device_name) {
+      status = "skipped";
+      if (evaluate_grab_filters(m_grab_filters, device_name, device_id,
+            is_grabbed_by_default(fd, m_grab_mice))) {
+        const auto it = std::find_if(m_grabbed_devices.begin(), m_grabbed_devices.end(),
+          [&](const Device& device) { return device.event_id == event_id; });
+        const auto deferred = deferred_grabs.find(event_id);
+        const auto now = Clock::now();
+        const auto give_up_at = (deferred != deferred_grabs.end() ?
+          deferred->second : now + max_grab_delay);
+        if (it != m_grabbed_devices.end()) {
+          status = "already grabbed";
+          it->disappeared = false;
+        }
+        else if (!keys_released(fd) && now < give_up_at) {
+          m_deferred_grabs.emplace(event_id, give_up_at);
+          ::close(fd);
+          if (deferred == deferred_grabs.end())
+            verbose("  %s deferred until keys are released (%s)",
+              path.c_str(), device_name.c_str());
+          return;
+        }
+        else {
+          status = "grabbing failed";
+          if (grab_device(event_id, fd, { device_name, device_id }))
+            status = "grabbed";
+        }
+      }
+    }
+    ::close(fd);
+    verbose("  %s %s (%s)", path.c_str(), status, device_name.c_str());
+  }
+
+  void update_grabbed_device_descs() {
+    initialize_epoll();
+
     // collect grabbed device descs
     m_grabbed_device_descs.clear();
     for (const auto& device : m_grabbed_devices)
-      m_grabbed_device_descs.push_back({
-        get_device_name(device.fd),
-        get_device_id(device.event_id)
-      });
+      m_grabbed_device_descs.push_back(device.desc);
   }
 };
 
@@ -422,19 +1353,54 @@ bool GrabbedDevices::grab(const char* ignore_device_name, bool grab_mice,
   return m_impl->initialize(ignore_device_name, grab_mice, std::move(grab_filters));
 }
   
+bool GrabbedDevices::set_grab_filters(bool grab_mice,
+    std::vector<GrabDeviceFilter> grab_filters) {
+  return m_impl->set_grab_filters(grab_mice, std::move(grab_filters));
+}
+
 bool GrabbedDevices::update_devices() {
   return m_impl->update_devices();
 }
 
-auto GrabbedDevices::read_input_event(std::optional<Duration> timeout, int interrupt_fd)
+bool GrabbedDevices::adopt(const char* ignore_device_name, bool grab_mice,
+    const std::vector<HandoffDevice>& devices) {
+  return m_impl->adopt(ignore_device_name, grab_mice, devices);
+}
+
+auto GrabbedDevices::hand_off() -> std::vector<HandoffDevice> {
+  return m_impl->hand_off();
+}
+
+auto GrabbedDevices::read_input_event(std::optional<Clock::time_point> deadline, 
+    const std::vector<int>& interrupt_fds, bool* interrupted)
     -> std::pair<bool, std::optional<Event>> {
-  return m_impl->read_input_event(timeout, interrupt_fd);
+  return m_impl->read_input_event(deadline, interrupt_fds, interrupted);
+}
+
+bool GrabbedDevices::reading_frame() const {
+  return m_impl->reading_frame();
 }
 
 const std::vector<DeviceDesc>& GrabbedDevices::grabbed_device_descs() const {
   return m_impl->grabbed_device_descs();
 }
 
+bool GrabbedDevices::get_keys_down(KeyBitmap& keys_down) const {
+  return m_impl->get_keys_down(keys_down);
+}
+
+bool GrabbedDevices::set_pointer_forwarding(ForwardFrame forward_frame) {
+  return m_impl->set_pointer_forwarding(std::move(forward_frame));
+}
+
+bool GrabbedDevices::set_reader_threads(bool enabled) {
+  return m_impl->set_reader_threads(enabled);
+}
+
+bool GrabbedDevices::set_io_uring(bool enabled) {
+  return m_impl->set_io_uring(enabled);
+}
+
 std::optional<KeyEvent> to_key_event(const GrabbedDevices::Event& event) {
   if (event.type == EV_KEY)
     return KeyEvent{
@@ -1,13 +1,24 @@
 
 #include "GrabbedDevices.h"
+#include "server/LockFreeQueue.h"
 #include "common/output.h"
 #include <cstdio>
 #include <cerrno>
 #include <array>
 #include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <future>
 #include <iterator>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/select.h>
 #include <IOKit/IOKitLib.h>
 #include <IOKit/hid/IOHIDValue.h>
+#include <IOKit/hid/IOHIDQueue.h>
 #include <IOKit/hid/IOHIDManager.h>
 
 bool macos_iso_keyboard = false;
@@ -75,17 +86,25 @@ namespace {
       (grab_mice && is_mouse(device)));
   }
 
-  bool can_read_from_file(int fd) {
-    auto read_set = fd_set{ };
-    FD_ZERO(&read_set);
-    FD_SET(fd, &read_set);
-    auto timeout = timeval{ };
-    return (select(fd + 1, &read_set, nullptr, nullptr, &timeout) > 0);
+  bool is_input_element(IOHIDElementRef element) {
+    switch (IOHIDElementGetType(element)) {
+      case kIOHIDElementTypeInput_Misc:
+      case kIOHIDElementTypeInput_Button:
+      case kIOHIDElementTypeInput_Axis:
+      case kIOHIDElementTypeInput_ScanCodes:
+        return true;
+      default:
+        return false;
+    }
   }
 } // namespace
 
 //-------------------------------------------------------------------------
 
+// HID input is handled by a separate thread running a CFRunLoop, the values
+// are read from a queue per device and forwarded to the reading thread
+// through a lock-free queue. All other access to the HID manager and
+// devices is also performed on the HID thread.
 class GrabbedDevicesImpl {
 private:
   using Event = GrabbedDevices::Event;
@@ -95,21 +114,40 @@ private:
   const char* m_virtual_device_name{ };
   bool m_grab_mice{ };
   std::vector<GrabDeviceFilter> m_grab_filters;
-  bool m_devices_changed{ };
+  std::atomic<bool> m_devices_changed{ };
+  // grabbing existing virtual device (Karabiner Elements)
+  bool m_grab_virtual_device{ };
   std::vector<IOHIDDeviceRef> m_grabbed_devices;
   std::vector<DeviceDesc> m_grabbed_device_descs;
-  std::vector<Event> m_event_queue;
-  size_t m_event_queue_pos{ };
+  std::map<IOHIDDeviceRef, IOHIDQueueRef> m_device_queues;
+
+  std::thread m_hid_thread;
+  CFRunLoopRef m_run_loop{ };
+  CFRunLoopSourceRef m_perform_source{ };
+  std::mutex m_perform_mutex;
+  std::condition_variable m_performed;
+  std::function<void()> m_perform;
+  LockFreeQueue<Event, 1024> m_event_queue;
+  std::array<int, 2> m_wakeup_pipe{ -1, -1 };
 
 public:
   ~GrabbedDevicesImpl() {
-    if (!m_grabbed_devices.empty()) {
-      verbose("Ungrabbing all devices");
-      for (const auto& device : m_grabbed_devices)
-        ungrab_device(device);
+    if (m_hid_thread.joinable()) {
+      run_on_hid_thread([&]() {
+        if (!m_grabbed_devices.empty()) {
+          verbose("Ungrabbing all devices");
+          for (const auto& device : m_grabbed_devices)
+            ungrab_device(device);
+        }
+        if (m_hid_manager)
+          IOHIDManagerClose(m_hid_manager, kIOHIDOptionsTypeNone);
+      });
+      CFRunLoopStop(m_run_loop);
+      m_hid_thread.join();
     }
-    if (m_hid_manager)
-      IOHIDManagerClose(m_hid_manager, kIOHIDOptionsTypeNone);
+    for (auto fd : m_wakeup_pipe)
+      if (fd >= 0)
+        ::close(fd);
   }
 
   bool initialize(const char* virtual_device_name, bool grab_mice,
@@ -119,62 +157,100 @@ public:
     m_grab_filters = std::move(grab_filters);
     m_virtual_device_name = virtual_device_name;
 
-    m_hid_manager = IOHIDManagerCreate(kCFAllocatorDefault, kIOHIDOptionsTypeNone);
-    if (!m_hid_manager)
+    if (!create_wakeup_pipe() || !start_hid_thread())
       return false;
-    IOHIDManagerSetDeviceMatching(m_hid_manager, nullptr);
-    IOHIDManagerScheduleWithRunLoop(m_hid_manager, CFRunLoopGetCurrent(), kCFRunLoopDefaultMode);
-
-    // try to grab existing virtual device (Karabiner Elements)
-    // before the own virtual device was created
-    update(true);
-    if (!m_grabbed_devices.empty())
-      return true;
-
-    IOHIDManagerRegisterDeviceMatchingCallback(m_hid_manager, &devices_changed_callback, this);
-    IOHIDManagerRegisterDeviceRemovalCallback(m_hid_manager, &devices_changed_callback, this);
-    m_devices_changed = true;
-    return true;
+
+    auto succeeded = false;
+    run_on_hid_thread([&]() {
+      m_hid_manager = IOHIDManagerCreate(kCFAllocatorDefault, kIOHIDOptionsTypeNone);
+      if (!m_hid_manager)
+        return;
+      IOHIDManagerSetDeviceMatching(m_hid_manager, nullptr);
+      IOHIDManagerScheduleWithRunLoop(m_hid_manager, m_run_loop, kCFRunLoopDefaultMode);
+      succeeded = true;
+
+      // try to grab existing virtual device (Karabiner Elements)
+      // before the own virtual device was created
+      update(true);
+      if (!m_grabbed_devices.empty()) {
+        m_grab_virtual_device = true;
+        return;
+      }
+
+      IOHIDManagerRegisterDeviceMatchingCallback(m_hid_manager, &devices_changed_callback, this);
+      IOHIDManagerRegisterDeviceRemovalCallback(m_hid_manager, &devices_changed_callback, this);
+      m_devices_changed.store(true);
+    });
+    return succeeded;
   }
 
   std::pair<bool, std::optional<Event>> read_input_event(
-      std::optional<Duration> timeout, int interrupt_fd) {      
-        
-    const auto timeout_at = (timeout ? 
-        std::chrono::steady_clock::now() + *timeout : 
-        std::chrono::steady_clock::time_point::max());
+      std::optional<Clock::time_point> deadline,
+      const std::vector<int>& interrupt_fds, bool* interrupted) {
 
     for (;;) {
-      if (m_event_queue_pos < m_event_queue.size())
-        return { true, m_event_queue[m_event_queue_pos++] };
-
-      m_event_queue.clear();
-      m_event_queue_pos = 0;
+      auto event = Event{ };
+      if (m_event_queue.pop(event))
+        return { true, event };
 
-      if (m_devices_changed)
+      if (m_devices_changed.load())
         return { true, std::nullopt };
 
-      // TODO: do not poll. see https://stackoverflow.com/questions/48434976/cfsocket-data-callbacks
-      auto poll_timeout = (timeout.has_value() ? timeout.value() : Duration::max());
-      if (interrupt_fd >=0) {
-        if (can_read_from_file(interrupt_fd))
-          return { true, std::nullopt };
-        poll_timeout = std::min(poll_timeout, Duration(std::chrono::milliseconds(100)));
-      }
+      // wait until HID thread pushed events, interrupt or deadline
+      auto read_set = fd_set{ };
+      FD_ZERO(&read_set);
+      FD_SET(m_wakeup_pipe[0], &read_set);
+      auto max_fd = m_wakeup_pipe[0];
+      for (auto fd : interrupt_fds)
+        if (fd >= 0) {
+          FD_SET(fd, &read_set);
+          max_fd = std::max(max_fd, fd);
+        }
 
-      CFRunLoopRunInMode(kCFRunLoopDefaultMode, poll_timeout.count(), true);
+      auto timeout = timeval{ };
+      if (deadline)
+        timeout = to_timeval(std::max(Duration(*deadline - Clock::now()), 
+          Duration::zero()));
+      const auto result = ::select(max_fd + 1, &read_set, nullptr, nullptr,
+        deadline ? &timeout : nullptr);
+      if (result < 0)
+        return { errno == EINTR, std::nullopt };
 
-      if (std::chrono::steady_clock::now() >= timeout_at)  
+      if (result == 0)
         return { true, std::nullopt };
+      if (std::any_of(interrupt_fds.begin(), interrupt_fds.end(),
+            [&](int fd) { return (fd >= 0 && FD_ISSET(fd, &read_set)); })) {
+        if (interrupted)
+          *interrupted = true;
+        return { true, std::nullopt };
+      }
+
+      auto buffer = std::array<char, 64>();
+      while (::read(m_wakeup_pipe[0], buffer.data(), buffer.size()) > 0) { }
     }
   }
 
+  bool reading_frame() const {
+    return !m_event_queue.empty();
+  }
+
+  bool set_grab_filters(bool grab_mice,
+      std::vector<GrabDeviceFilter> grab_filters) {
+    auto changed = false;
+    run_on_hid_thread([&]() {
+      m_grab_filters = std::move(grab_filters);
+      const auto grabbed_devices = m_grabbed_devices;
+      update(m_grab_virtual_device);
+      changed = (grabbed_devices != m_grabbed_devices);
+    });
+    return changed;
+  }
+
   bool update_devices() {
-    if (!m_devices_changed)
+    if (!m_devices_changed.exchange(false))
       return false;
 
-    update(false);
-    m_devices_changed = false;
+    run_on_hid_thread([&]() { update(false); });
     return true;
   }
 
@@ -183,19 +259,98 @@ public:
   }
 
 private:
+  bool create_wakeup_pipe() {
+    if (::pipe(m_wakeup_pipe.data()) != 0)
+      return false;
+    for (auto fd : m_wakeup_pipe)
+      ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return true;
+  }
+
+  void wake_up() {
+    ::write(m_wakeup_pipe[1], "", 1);
+  }
+
+  bool start_hid_thread() {
+    auto ready = std::promise<void>();
+    auto started = ready.get_future();
+    m_hid_thread = std::thread([&]() {
+      m_run_loop = CFRunLoopGetCurrent();
+      auto context = CFRunLoopSourceContext{ };
+      context.info = this;
+      context.perform = &perform_callback;
+      m_perform_source = CFRunLoopSourceCreate(kCFAllocatorDefault, 0, &context);
+      CFRunLoopAddSource(m_run_loop, m_perform_source, kCFRunLoopDefaultMode);
+      ready.set_value();
+
+      CFRunLoopRun();
+
+      CFRunLoopRemoveSource(m_run_loop, m_perform_source, kCFRunLoopDefaultMode);
+      CFRelease(m_perform_source);
+    });
+    started.wait();
+    return (m_perform_source != nullptr);
+  }
+
+  // blocks until function was called by HID thread
+  void run_on_hid_thread(std::function<void()> function) {
+    auto lock = std::unique_lock(m_perform_mutex);
+    m_perform = std::move(function);
+    CFRunLoopSourceSignal(m_perform_source);
+    CFRunLoopWakeUp(m_run_loop);
+    m_performed.wait(lock, [&]() { return !m_perform; });
+  }
+
+  static void perform_callback(void* context) {
+    auto& impl = *static_cast<GrabbedDevicesImpl*>(context);
+    auto lock = std::lock_guard(impl.m_perform_mutex);
+    if (impl.m_perform) {
+      impl.m_perform();
+      impl.m_perform = nullptr;
+    }
+    impl.m_performed.notify_all();
+  }
+
   static void devices_changed_callback(void *context, IOReturn result,
       void *sender, IOHIDDeviceRef device) {
     static_cast<GrabbedDevicesImpl*>(context)->handle_devices_changed();
   }
 
-  static void input_value_callback(void* context, IOReturn result,
-      void* sender, IOHIDValueRef value) {
-    const auto element = IOHIDValueGetElement(value);
-    const auto page = IOHIDElementGetUsagePage(element);
-    const auto device = IOHIDElementGetDevice(element);
-    const auto usage = IOHIDElementGetUsage(element);
-    const auto val = IOHIDValueGetIntegerValue(value);
-    static_cast<GrabbedDevicesImpl*>(context)->handle_input(device, page, usage, val);
+  static void values_available_callback(void* context, IOReturn result,
+      void* sender) {
+    static_cast<GrabbedDevicesImpl*>(context)->handle_input(
+      static_cast<IOHIDQueueRef>(sender));
+  }
+
+  IOHIDQueueRef create_input_queue(IOHIDDeviceRef device) {
+    const auto elements = IOHIDDeviceCopyMatchingElements(device, 
+      nullptr, kIOHIDOptionsTypeNone);
+    if (!elements)
+      return nullptr;
+
+    const auto max_depth = 64;
+    const auto queue = IOHIDQueueCreate(kCFAllocatorDefault, 
+      device, max_depth, kIOHIDOptionsTypeNone);
+    if (queue) {
+      for (auto i = CFIndex{ }; i < CFArrayGetCount(elements); ++i) {
+        const auto element = static_cast<IOHIDElementRef>(
+          const_cast<void*>(CFArrayGetValueAtIndex(elements, i)));
+        if (is_input_element(element))
+          IOHIDQueueAddElement(queue, element);
+      }
+      IOHIDQueueRegisterValueAvailableCallback(queue, 
+        &values_available_callback, this);
+      IOHIDQueueScheduleWithRunLoop(queue, m_run_loop, kCFRunLoopDefaultMode);
+      IOHIDQueueStart(queue);
+    }
+    CFRelease(elements);
+    return queue;
+  }
+
+  void destroy_input_queue(IOHIDQueueRef queue) {
+    IOHIDQueueStop(queue);
+    IOHIDQueueUnscheduleFromRunLoop(queue, m_run_loop, kCFRunLoopDefaultMode);
+    CFRelease(queue);
   }
 
   bool grab_device(IOHIDDeviceRef device) {
@@ -203,22 +358,50 @@ private:
     if (result != kIOReturnSuccess)
       return false;
 
-    IOHIDDeviceRegisterInputValueCallback(device, &input_value_callback, this);
+    const auto queue = create_input_queue(device);
+    if (!queue) {
+      IOHIDDeviceClose(device, kIOHIDOptionsTypeNone);
+      return false;
+    }
+    m_device_queues[device] = queue;
     return true;
   }
 
   void ungrab_device(IOHIDDeviceRef device) {
+    if (auto it = m_device_queues.find(device); it != m_device_queues.end()) {
+      destroy_input_queue(it->second);
+      m_device_queues.erase(it);
+    }
     IOHIDDeviceClose(device, kIOHIDOptionsTypeNone);
   }
 
   void handle_devices_changed() {
-    m_devices_changed = true;
+    m_devices_changed.store(true);
+    wake_up();
   }
 
-  void handle_input(IOHIDDeviceRef device, int page, int code, int value) {
+  void handle_input(IOHIDQueueRef queue) {
+    const auto device = IOHIDQueueGetDevice(queue);
     const auto device_index = std::distance(m_grabbed_devices.begin(), 
       std::find(m_grabbed_devices.begin(), m_grabbed_devices.end(), device));
-    m_event_queue.push_back({ static_cast<int>(device_index), page, code, value });
+    const auto time = Clock::now();
+
+    // take all values available at once
+    auto pushed = false;
+    while (auto value = IOHIDQueueCopyNextValueWithTimeout(queue, 0)) {
+      const auto element = IOHIDValueGetElement(value);
+      m_event_queue.push({ 
+        static_cast<int>(device_index), 
+        static_cast<int>(IOHIDElementGetUsagePage(element)),
+        static_cast<int>(IOHIDElementGetUsage(element)),
+        static_cast<int>(IOHIDValueGetIntegerValue(value)),
+        time 
+      });
+      CFRelease(value);
+      pushed = true;
+    }
+    if (pushed)
+      wake_up();
   }
 
   void update(bool grab_virtual_device) {
@@ -244,9 +427,9 @@ private:
       auto status = "ignored";
       const auto it = std::find(previously_grabbed.begin(), 
         previously_grabbed.end(), device);
+      const auto is_virtual_device =
+        (device_name.find(m_virtual_device_name) != std::string::npos);
       if (it == previously_grabbed.end()) {
-        const auto is_virtual_device =
-          (device_name.find(m_virtual_device_name) != std::string::npos);
         if (is_virtual_device == grab_virtual_device) {
           status = "skipped";
           if (is_virtual_device ||
@@ -260,10 +443,16 @@ private:
           }
         }
       }
-      else {
+      else if (is_virtual_device ||
+          evaluate_grab_filters(m_grab_filters, device_name, device_id,
+            is_grabbed_by_default(device, m_grab_mice))) {
         m_grabbed_devices.push_back(std::exchange(*it, nullptr));
         status = "already grabbed";
       }
+      else {
+        // no longer matches filters, ungrabbed below
+        status = "skipped";
+      }
       verbose("  '%s' %s (%s)", device_name.c_str(), status, device_id.c_str());
     }
 
@@ -298,19 +487,61 @@ bool GrabbedDevices::grab(const char* virtual_device_name, bool grab_mice,
   return m_impl->initialize(virtual_device_name, grab_mice, std::move(grab_filters));
 }
 
+bool GrabbedDevices::set_grab_filters(bool grab_mice,
+    std::vector<GrabDeviceFilter> grab_filters) {
+  return m_impl->set_grab_filters(grab_mice, std::move(grab_filters));
+}
+
 bool GrabbedDevices::update_devices() {
   return m_impl->update_devices();
 }
 
-auto GrabbedDevices::read_input_event(std::optional<Duration> timeout, int interrupt_fd)
+bool GrabbedDevices::adopt(const char* virtual_device_name, bool grab_mice,
+    const std::vector<HandoffDevice>& devices) {
+  // not supported
+  return false;
+}
+
+auto GrabbedDevices::hand_off() -> std::vector<HandoffDevice> {
+  // not supported
+  return { };
+}
+
+auto GrabbedDevices::read_input_event(std::optional<Clock::time_point> deadline, 
+    const std::vector<int>& interrupt_fds, bool* interrupted)
     -> std::pair<bool, std::optional<Event>> {
-  return m_impl->read_input_event(timeout, interrupt_fd);
+  return m_impl->read_input_event(deadline, interrupt_fds, interrupted);
+}
+
+bool GrabbedDevices::reading_frame() const {
+  // more events were already taken from the device queues
+  return m_impl->reading_frame();
 }
 
 const std::vector<DeviceDesc>& GrabbedDevices::grabbed_device_descs() const {
   return m_impl->grabbed_device_descs();
 }
 
+bool GrabbedDevices::get_keys_down(KeyBitmap& keys_down) const {
+  // not supported
+  return false;
+}
+
+bool GrabbedDevices::set_pointer_forwarding(ForwardFrame forward_frame) {
+  // not supported
+  return false;
+}
+
+bool GrabbedDevices::set_reader_threads(bool enabled) {
+  // not supported
+  return !enabled;
+}
+
+bool GrabbedDevices::set_io_uring(bool enabled) {
+  // not supported
+  return !enabled;
+}
+
 std::optional<KeyEvent> to_key_event(const GrabbedDevices::Event& event) {
   const auto page = event.type;
   const auto usage = event.code;
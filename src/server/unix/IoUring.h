@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <linux/io_uring.h>
+
+// A minimal io_uring, which is set up with the system calls, so
+// liburing is not required. It is not thread safe.
+class IoUring {
+public:
+  // not declared by the headers before Linux 6.7
+  static constexpr uint8_t op_read_multishot = 49;
+
+  IoUring() = default;
+  IoUring(const IoUring&) = delete;
+  IoUring& operator=(const IoUring&) = delete;
+  ~IoUring();
+
+  bool create(unsigned int entries);
+  bool supports(uint8_t opcode) const;
+  // returns nullptr when the submission queue is full
+  io_uring_sqe* get_sqe();
+  // submits the queued entries and waits until wait_count completions
+  // are available, returns false on error but not when interrupted
+  bool submit(unsigned int wait_count = 0);
+  // the completion is consumed by pop_cqe
+  const io_uring_cqe* peek_cqe() const;
+  void pop_cqe();
+
+  // provides the buffers of reads with IOSQE_BUFFER_SELECT,
+  // buffer_count has to be a power of two
+  bool create_buffer_ring(uint16_t group, size_t buffer_size,
+    uint16_t buffer_count);
+  const char* get_buffer(uint16_t buffer_id) const;
+  // returns the buffer, once its content was handled
+  void recycle_buffer(uint16_t buffer_id);
+
+private:
+  void release();
+
+  int m_ring_fd{ -1 };
+  void* m_sq_ring{ };
+  size_t m_sq_ring_size{ };
+  void* m_cq_ring{ };
+  size_t m_cq_ring_size{ };
+  io_uring_sqe* m_sqes{ };
+  size_t m_sqes_size{ };
+  unsigned int* m_sq_head{ };
+  unsigned int* m_sq_tail{ };
+  unsigned int* m_sq_array{ };
+  unsigned int m_sq_mask{ };
+  unsigned int m_sq_entries{ };
+  unsigned int m_sqe_tail{ };
+  unsigned int* m_cq_head{ };
+  unsigned int* m_cq_tail{ };
+  unsigned int m_cq_mask{ };
+  io_uring_cqe* m_cqes{ };
+
+  // not accessed as io_uring_buf_ring, whose flexible array member
+  // has an offset in C++. The tail is the resv field of the first buffer
+  io_uring_buf* m_buffer_ring{ };
+  size_t m_buffer_ring_size{ };
+  uint16_t m_buffer_tail{ };
+  uint16_t m_buffer_mask{ };
+  size_t m_buffer_size{ };
+  std::vector<char> m_buffers;
+};
+
+void prepare_read_multishot(io_uring_sqe& sqe, int fd,
+  uint16_t buffer_group, uint64_t user_data);
+void prepare_poll_multishot(io_uring_sqe& sqe, int fd, uint64_t user_data);
+void prepare_write(io_uring_sqe& sqe, int fd, const void* data,
+  size_t size, uint64_t user_data);
+void prepare_cancel(io_uring_sqe& sqe, uint64_t cancel_user_data,
+  uint64_t user_data);
@@ -0,0 +1,234 @@
+
+#include "IoUring.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+  int io_uring_setup(unsigned int entries, io_uring_params* params) {
+    return static_cast<int>(::syscall(__NR_io_uring_setup, entries, params));
+  }
+
+  int io_uring_enter(int fd, unsigned int to_submit,
+      unsigned int min_complete, unsigned int flags) {
+    return static_cast<int>(::syscall(__NR_io_uring_enter, fd, to_submit,
+      min_complete, flags, nullptr, size_t{ }));
+  }
+
+  int io_uring_register(int fd, unsigned int opcode, void* arg,
+      unsigned int count) {
+    return static_cast<int>(::syscall(__NR_io_uring_register, fd, opcode,
+      arg, count));
+  }
+
+  void* map_ring(int fd, size_t size, off_t offset) {
+    const auto memory = ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, fd, offset);
+    return (memory != MAP_FAILED ? memory : nullptr);
+  }
+
+  void unmap_ring(void* memory, size_t size) {
+    if (memory)
+      ::munmap(memory, size);
+  }
+
+  template<typename T>
+  T* offset_pointer(void* base, uint32_t offset) {
+    return reinterpret_cast<T*>(static_cast<char*>(base) + offset);
+  }
+
+  // the kernel reads and writes the heads and tails concurrently
+  unsigned int load_acquire(const unsigned int* value) {
+    return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+  }
+
+  template<typename T>
+  void store_release(T* value, T new_value) {
+    __atomic_store_n(value, new_value, __ATOMIC_RELEASE);
+  }
+} // namespace
+
+IoUring::~IoUring() {
+  release();
+}
+
+void IoUring::release() {
+  // cancels the pending requests
+  if (m_ring_fd >= 0)
+    ::close(m_ring_fd);
+  m_ring_fd = -1;
+  if (m_buffer_ring)
+    ::munmap(m_buffer_ring, m_buffer_ring_size);
+  m_buffer_ring = nullptr;
+  m_buffers.clear();
+  unmap_ring(m_sqes, m_sqes_size);
+  if (m_cq_ring != m_sq_ring)
+    unmap_ring(m_cq_ring, m_cq_ring_size);
+  unmap_ring(m_sq_ring, m_sq_ring_size);
+  m_sqes = nullptr;
+  m_cq_ring = nullptr;
+  m_sq_ring = nullptr;
+}
+
+bool IoUring::create(unsigned int entries) {
+  release();
+  auto params = io_uring_params{ };
+  m_ring_fd = io_uring_setup(entries, &params);
+  if (m_ring_fd < 0)
+    return false;
+
+  m_sq_ring_size = params.sq_off.array +
+    params.sq_entries * sizeof(unsigned int);
+  m_cq_ring_size = params.cq_off.cqes +
+    params.cq_entries * sizeof(io_uring_cqe);
+  const auto single_mmap = ((params.features & IORING_FEAT_SINGLE_MMAP) != 0);
+  if (single_mmap)
+    m_sq_ring_size = m_cq_ring_size = std::max(m_sq_ring_size, m_cq_ring_size);
+  m_sq_ring = map_ring(m_ring_fd, m_sq_ring_size, IORING_OFF_SQ_RING);
+  m_cq_ring = (single_mmap ? m_sq_ring :
+    map_ring(m_ring_fd, m_cq_ring_size, IORING_OFF_CQ_RING));
+  m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+  m_sqes = static_cast<io_uring_sqe*>(
+    map_ring(m_ring_fd, m_sqes_size, IORING_OFF_SQES));
+  if (!m_sq_ring || !m_cq_ring || !m_sqes) {
+    release();
+    return false;
+  }
+
+  m_sq_head = offset_pointer<unsigned int>(m_sq_ring, params.sq_off.head);
+  m_sq_tail = offset_pointer<unsigned int>(m_sq_ring, params.sq_off.tail);
+  m_sq_array = offset_pointer<unsigned int>(m_sq_ring, params.sq_off.array);
+  m_sq_mask = *offset_pointer<unsigned int>(m_sq_ring, params.sq_off.ring_mask);
+  m_sq_entries = params.sq_entries;
+  m_sqe_tail = *m_sq_tail;
+  m_cq_head = offset_pointer<unsigned int>(m_cq_ring, params.cq_off.head);
+  m_cq_tail = offset_pointer<unsigned int>(m_cq_ring, params.cq_off.tail);
+  m_cq_mask = *offset_pointer<unsigned int>(m_cq_ring, params.cq_off.ring_mask);
+  m_cqes = offset_pointer<io_uring_cqe>(m_cq_ring, params.cq_off.cqes);
+  return true;
+}
+
+bool IoUring::supports(uint8_t opcode) const {
+  const auto max_ops = size_t{ 256 };
+  const auto size = sizeof(io_uring_probe) + max_ops * sizeof(io_uring_probe_op);
+  auto buffer = std::make_unique<uint64_t[]>(size / sizeof(uint64_t));
+  const auto probe = reinterpret_cast<io_uring_probe*>(buffer.get());
+  std::memset(probe, 0, size);
+  if (io_uring_register(m_ring_fd, IORING_REGISTER_PROBE, probe, max_ops) < 0 ||
+      opcode > probe->last_op || opcode >= probe->ops_len)
+    return false;
+  return ((probe->ops[opcode].flags & IO_URING_OP_SUPPORTED) != 0);
+}
+
+io_uring_sqe* IoUring::get_sqe() {
+  if (m_sqe_tail - load_acquire(m_sq_head) >= m_sq_entries)
+    return nullptr;
+  const auto index = m_sqe_tail++ & m_sq_mask;
+  m_sq_array[index] = index;
+  auto& sqe = m_sqes[index];
+  std::memset(&sqe, 0, sizeof(sqe));
+  return &sqe;
+}
+
+bool IoUring::submit(unsigned int wait_count) {
+  store_release(m_sq_tail, m_sqe_tail);
+  const auto to_submit = m_sqe_tail - load_acquire(m_sq_head);
+  if (!to_submit && !wait_count)
+    return true;
+  const auto flags = (wait_count ? IORING_ENTER_GETEVENTS : 0u);
+  if (io_uring_enter(m_ring_fd, to_submit, wait_count, flags) < 0)
+    return (errno == EINTR);
+  return true;
+}
+
+const io_uring_cqe* IoUring::peek_cqe() const {
+  const auto head = *m_cq_head;
+  if (head == load_acquire(m_cq_tail))
+    return nullptr;
+  return &m_cqes[head & m_cq_mask];
+}
+
+void IoUring::pop_cqe() {
+  store_release(m_cq_head, *m_cq_head + 1);
+}
+
+bool IoUring::create_buffer_ring(uint16_t group, size_t buffer_size,
+    uint16_t buffer_count) {
+  m_buffer_ring_size = buffer_count * sizeof(io_uring_buf);
+  const auto memory = ::mmap(nullptr, m_buffer_ring_size,
+    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED)
+    return false;
+  m_buffer_ring = static_cast<io_uring_buf*>(memory);
+
+  auto reg = io_uring_buf_reg{ };
+  reg.ring_addr = reinterpret_cast<uint64_t>(m_buffer_ring);
+  reg.ring_entries = buffer_count;
+  reg.bgid = group;
+  if (io_uring_register(m_ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    ::munmap(m_buffer_ring, m_buffer_ring_size);
+    m_buffer_ring = nullptr;
+    return false;
+  }
+  m_buffer_size = buffer_size;
+  m_buffer_mask = static_cast<uint16_t>(buffer_count - 1);
+  m_buffer_tail = 0;
+  m_buffers.resize(buffer_size * buffer_count);
+  for (auto i = uint16_t{ }; i < buffer_count; ++i)
+    recycle_buffer(i);
+  return true;
+}
+
+const char* IoUring::get_buffer(uint16_t buffer_id) const {
+  return &m_buffers[buffer_id * m_buffer_size];
+}
+
+void IoUring::recycle_buffer(uint16_t buffer_id) {
+  auto& buffer = m_buffer_ring[m_buffer_tail & m_buffer_mask];
+  buffer.addr = reinterpret_cast<uint64_t>(get_buffer(buffer_id));
+  buffer.len = static_cast<uint32_t>(m_buffer_size);
+  buffer.bid = buffer_id;
+  ++m_buffer_tail;
+  store_release(&m_buffer_ring[0].resv, m_buffer_tail);
+}
+
+void prepare_read_multishot(io_uring_sqe& sqe, int fd,
+    uint16_t buffer_group, uint64_t user_data) {
+  sqe.opcode = IoUring::op_read_multishot;
+  sqe.fd = fd;
+  sqe.flags = IOSQE_BUFFER_SELECT;
+  sqe.buf_group = buffer_group;
+  sqe.user_data = user_data;
+}
+
+void prepare_poll_multishot(io_uring_sqe& sqe, int fd, uint64_t user_data) {
+  sqe.opcode = IORING_OP_POLL_ADD;
+  sqe.fd = fd;
+  sqe.poll32_events = POLLIN;
+  sqe.len = IORING_POLL_ADD_MULTI;
+  sqe.user_data = user_data;
+}
+
+void prepare_write(io_uring_sqe& sqe, int fd, const void* data,
+    size_t size, uint64_t user_data) {
+  sqe.opcode = IORING_OP_WRITE;
+  sqe.fd = fd;
+  sqe.addr = reinterpret_cast<uint64_t>(data);
+  sqe.len = static_cast<uint32_t>(size);
+  // current file position, which uinput ignores
+  sqe.off = ~uint64_t{ };
+  sqe.user_data = user_data;
+}
+
+void prepare_cancel(io_uring_sqe& sqe, uint64_t cancel_user_data,
+    uint64_t user_data) {
+  sqe.opcode = IORING_OP_ASYNC_CANCEL;
+  sqe.fd = -1;
+  sqe.addr = cancel_user_data;
+  sqe.user_data = user_data;
+}
@@ -0,0 +1,146 @@
+
+#include "MetricsExporter.h"
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <utility>
+
+namespace {
+  // how long a scrape waits for the input thread, before the
+  // previous snapshot is served
+  const auto snapshot_timeout = std::chrono::milliseconds(100);
+  const auto request_timeout_ms = 1000;
+
+  int open_listen_socket(const char* port) {
+    auto hints = addrinfo{ };
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    auto result = static_cast<addrinfo*>(nullptr);
+    // only reachable from this machine
+    if (::getaddrinfo("localhost", port, &hints, &result) != 0)
+      return -1;
+    auto fd = -1;
+    for (auto info = result; info; info = info->ai_next) {
+      fd = ::socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+      if (fd < 0)
+        continue;
+      const auto reuse = int{ 1 };
+      ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+      if (::bind(fd, info->ai_addr, info->ai_addrlen) == 0 &&
+          ::listen(fd, 4) == 0)
+        break;
+      ::close(fd);
+      fd = -1;
+    }
+    ::freeaddrinfo(result);
+    if (fd >= 0)
+      ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+  }
+
+  bool send_all(int socket, const std::string& data) {
+    for (auto sent = size_t{ }; sent < data.size(); ) {
+      const auto result = ::send(socket, data.data() + sent,
+        data.size() - sent, MSG_NOSIGNAL);
+      if (result <= 0)
+        return false;
+      sent += static_cast<size_t>(result);
+    }
+    return true;
+  }
+
+  // reads until the end of the request header
+  std::string read_request(int socket) {
+    auto request = std::string();
+    auto buffer = std::array<char, 1024>();
+    while (request.find("\r\n\r\n") == std::string::npos &&
+           request.size() < 8 * buffer.size()) {
+      auto pfd = pollfd{ socket, POLLIN, 0 };
+      if (::poll(&pfd, 1, request_timeout_ms) <= 0)
+        break;
+      const auto result = ::recv(socket, buffer.data(), buffer.size(), 0);
+      if (result <= 0)
+        break;
+      request.append(buffer.data(), static_cast<size_t>(result));
+    }
+    return request;
+  }
+} // namespace
+
+MetricsExporter::~MetricsExporter() {
+  stop();
+}
+
+bool MetricsExporter::start(const std::string& port) {
+  if (::pipe(m_wakeup_pipe.data()) != 0)
+    return false;
+  for (auto fd : m_wakeup_pipe)
+    ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+  m_listen_socket = open_listen_socket(port.c_str());
+  if (m_listen_socket < 0)
+    return false;
+  m_stop.store(false);
+  m_thread = std::thread(&MetricsExporter::run, this);
+  return true;
+}
+
+void MetricsExporter::stop() {
+  if (m_thread.joinable()) {
+    m_stop.store(true);
+    m_thread.join();
+  }
+  for (auto* fd : { &m_listen_socket, &m_wakeup_pipe[0], &m_wakeup_pipe[1] })
+    if (*fd >= 0)
+      ::close(std::exchange(*fd, -1));
+}
+
+void MetricsExporter::drain_wakeup_pipe() {
+  auto buffer = std::array<char, 64>{ };
+  while (::read(m_wakeup_pipe[0], buffer.data(), buffer.size()) > 0) { }
+}
+
+void MetricsExporter::run() {
+  while (!m_stop.load()) {
+    // wake up regularly to check for stop
+    auto pfd = pollfd{ m_listen_socket, POLLIN, 0 };
+    if (::poll(&pfd, 1, 100) <= 0)
+      continue;
+    const auto socket = ::accept(m_listen_socket, nullptr, nullptr);
+    if (socket < 0)
+      continue;
+    serve(socket);
+    ::close(socket);
+  }
+}
+
+void MetricsExporter::serve(int socket) {
+  const auto request = read_request(socket);
+  if (request.rfind("GET /metrics ", 0) != 0 &&
+      request.rfind("GET / ", 0) != 0) {
+    send_all(socket, "HTTP/1.0 404 Not Found\r\n"
+      "Content-Length: 0\r\nConnection: close\r\n\r\n");
+    return;
+  }
+  const auto body = format_open_metrics(request_snapshot());
+  send_all(socket, "HTTP/1.0 200 OK\r\n"
+    "Content-Type: application/openmetrics-text; version=1.0.0; "
+    "charset=utf-8\r\n"
+    "Content-Length: " + std::to_string(body.size()) + "\r\n"
+    "Connection: close\r\n\r\n" + body);
+}
+
+const Statistics& MetricsExporter::request_snapshot() {
+  const auto version = m_snapshot.version();
+  m_snapshot.request();
+  ::write(m_wakeup_pipe[1], "", 1);
+
+  const auto deadline = Clock::now() + snapshot_timeout;
+  while (m_snapshot.version() == version && Clock::now() < deadline)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  return m_snapshot.statistics();
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "server/StatisticsSnapshot.h"
+#include <array>
+#include <atomic>
+#include <string>
+#include <thread>
+
+// Serves the statistics in the OpenMetrics text format on a localhost
+// port, from a thread of its own. On each scrape a snapshot is requested
+// from the input thread, which is woken up through a pipe and publishes
+// it without waiting.
+class MetricsExporter {
+public:
+  MetricsExporter() = default;
+  MetricsExporter(const MetricsExporter&) = delete;
+  MetricsExporter& operator=(const MetricsExporter&) = delete;
+  ~MetricsExporter();
+
+  bool start(const std::string& port);
+  void stop();
+
+  // input thread, readable when a snapshot was requested
+  int wakeup_fd() const { return m_wakeup_pipe[0]; }
+
+  // input thread, woken is set when waiting was interrupted
+  template<typename F> // Statistics()
+  void publish_snapshot(bool woken, F&& get_statistics) {
+    if (woken)
+      drain_wakeup_pipe();
+    if (m_snapshot.requested())
+      m_snapshot.publish(get_statistics());
+  }
+
+private:
+  void drain_wakeup_pipe();
+  void run();
+  void serve(int socket);
+  const Statistics& request_snapshot();
+
+  int m_listen_socket{ -1 };
+  std::array<int, 2> m_wakeup_pipe{ -1, -1 };
+  std::atomic<bool> m_stop{ };
+  std::thread m_thread;
+  StatisticsSnapshot m_snapshot;
+};
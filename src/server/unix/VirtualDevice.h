@@ -1,20 +1,39 @@
 #pragma once
 
+#include <cstddef>
 #include <memory>
 
 struct KeyEvent;
 
 class VirtualDevice {
 public:
+  struct Event {
+    int type;
+    int code;
+    int value;
+  };
+
   VirtualDevice();
   VirtualDevice(VirtualDevice&&) noexcept;
   VirtualDevice& operator=(VirtualDevice&&) noexcept;
   ~VirtualDevice();
 
   bool create(const char* name);
+  // continues with the device another process created
+  bool adopt(int fd);
+  // releases the device without destroying it, so it can be passed
+  // to another process, the caller closes the file descriptor
+  int hand_off();
+  // events can be buffered until flush
   bool send_key_event(const KeyEvent& event);
   bool send_event(int type, int code, int value);
   bool flush();
+  // writes the events at once, bypassing the buffer,
+  // so it can be called from another thread
+  bool write_events(const Event* events, size_t count);
+  // the frames are written on flush by linked requests of an io_uring.
+  // Returns false when not supported.
+  bool set_io_uring(bool enabled);
 
 private:
   std::unique_ptr<class VirtualDeviceImpl> m_impl;
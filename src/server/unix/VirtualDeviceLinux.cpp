@@ -1,14 +1,22 @@
 
 #include "VirtualDevice.h"
 #include "runtime/KeyEvent.h"
+#include "runtime/KeyBitmap.h"
 #include "common/output.h"
 #include <algorithm>
+#include <array>
 #include <cstring>
 #include <cerrno>
 #include <fcntl.h>
 #include <unistd.h>
 #include <linux/uinput.h>
 #include <chrono>
+#include <utility>
+#include <vector>
+
+#if defined(ENABLE_IO_URING)
+# include "IoUring.h"
+#endif
 
 namespace {
   int open_uinput_device() {
@@ -89,26 +97,28 @@ namespace {
 class VirtualDeviceImpl {
 private:
   int m_uinput_fd{ -1 };
-  std::vector<Key> m_down_keys;
+  KeyBitmap m_down_keys;
+  // events written at once on flush
+  std::vector<input_event> m_write_buffer;
+#if defined(ENABLE_IO_URING)
+  static constexpr unsigned int ring_entries = 64;
+  std::unique_ptr<IoUring> m_ring;
+#endif
 
   int get_key_event_value(const KeyEvent& event) {
     const auto release = 0;
     const auto press = 1;
     const auto autorepeat = 2;
 
-    const auto it = std::find(begin(m_down_keys), end(m_down_keys), event.key);
     if (event.state == KeyState::Up) {
-      if (it != m_down_keys.end())
-        m_down_keys.erase(
-          std::remove(begin(m_down_keys), end(m_down_keys), event.key),
-          end(m_down_keys));
+      m_down_keys.reset(event.key);
       return release;
     }
 
-    if (it != m_down_keys.end())
+    if (m_down_keys.test(event.key))
       return autorepeat;
 
-    m_down_keys.push_back(event.key);
+    m_down_keys.set(event.key);
     return press;
   }
 
@@ -124,19 +134,141 @@ public:
     return (m_uinput_fd >= 0);
   }
 
-  bool send_event(int type, int code, int value) {
-    auto event = input_event{ };
-    ::gettimeofday(&event.time, nullptr);
+  bool adopt(int fd) {
+    if (m_uinput_fd >= 0 || fd < 0)
+      return false;
+    m_uinput_fd = fd;
+    return true;
+  }
+
+  int hand_off() {
+    return std::exchange(m_uinput_fd, -1);
+  }
+
+  void buffer_event(int type, int code, int value) {
+    auto& event = m_write_buffer.emplace_back();
     event.type = static_cast<unsigned short>(type);
     event.code = static_cast<unsigned short>(code);
     event.value = value;
-    do {
-      const auto result = ::write(m_uinput_fd, &event, sizeof(event));
-      if (result >= 0)
-        return (result == sizeof(event));
-    } while (errno == EINTR);
+  }
 
-    return false;
+  bool send_event(int type, int code, int value) {
+    // coalesce consecutive mouse movement
+    if (type == EV_REL && (code == REL_X || code == REL_Y) &&
+        !m_write_buffer.empty() &&
+        m_write_buffer.back().type == type &&
+        m_write_buffer.back().code == code) {
+      m_write_buffer.back().value += value;
+      return true;
+    }
+    buffer_event(type, code, value);
+    return true;
+  }
+
+  bool flush() {
+    if (m_write_buffer.empty())
+      return true;
+
+#if defined(ENABLE_IO_URING)
+    if (m_ring)
+      return flush_ring();
+#endif
+
+    // time is not set, uinput stamps the events when they are injected
+    const auto data = reinterpret_cast<const char*>(m_write_buffer.data());
+    const auto size = m_write_buffer.size() * sizeof(input_event);
+    auto written = size_t{ };
+    while (written < size) {
+      const auto result = ::write(m_uinput_fd, data + written, size - written);
+      if (result < 0 && errno == EINTR)
+        continue;
+      if (result <= 0)
+        break;
+      written += static_cast<size_t>(result);
+    }
+    m_write_buffer.clear();
+    return (written == size);
+  }
+
+  bool set_io_uring(bool enabled) {
+#if defined(ENABLE_IO_URING)
+    m_ring.reset();
+    if (enabled) {
+      auto ring = std::make_unique<IoUring>();
+      if (ring->create(ring_entries))
+        m_ring = std::move(ring);
+    }
+    return (static_cast<bool>(m_ring) == enabled);
+#else
+    return !enabled;
+#endif
+  }
+
+#if defined(ENABLE_IO_URING)
+  // each frame is written by a request, which is linked to the next one,
+  // so they are written in order and the ones after a failed one are
+  // canceled. They are submitted and awaited by a single system call
+  bool flush_ring() {
+    const auto events = m_write_buffer.data();
+    const auto count = m_write_buffer.size();
+    auto succeeded = true;
+    for (auto begin = size_t{ }; begin < count; ) {
+      auto pending = 0u;
+      auto previous = static_cast<io_uring_sqe*>(nullptr);
+      while (begin < count) {
+        const auto sqe = m_ring->get_sqe();
+        if (!sqe)
+          break;
+        auto end = begin;
+        while (end < count && events[end++].type != EV_SYN) { }
+        // the user data is the size, which should be written
+        const auto size = (end - begin) * sizeof(input_event);
+        prepare_write(*sqe, m_uinput_fd, &events[begin], size, size);
+        if (previous)
+          previous->flags |= IOSQE_IO_LINK;
+        previous = sqe;
+        ++pending;
+        begin = end;
+      }
+
+      while (pending) {
+        if (!m_ring->submit(pending)) {
+          // continue without ring, nothing was submitted
+          m_ring.reset();
+          m_write_buffer.clear();
+          return false;
+        }
+        while (const auto cqe = m_ring->peek_cqe()) {
+          if (cqe->res < 0 ||
+              static_cast<uint64_t>(cqe->res) != cqe->user_data)
+            succeeded = false;
+          m_ring->pop_cqe();
+          --pending;
+        }
+      }
+    }
+    m_write_buffer.clear();
+    return succeeded;
+  }
+#endif
+
+  bool write_events(const VirtualDevice::Event* events, size_t count) {
+    auto buffer = std::array<input_event, 64>{ };
+    if (count > buffer.size())
+      return false;
+    for (auto i = size_t{ }; i < count; ++i) {
+      buffer[i].type = static_cast<unsigned short>(events[i].type);
+      buffer[i].code = static_cast<unsigned short>(events[i].code);
+      buffer[i].value = events[i].value;
+    }
+    // a single write is not interleaved with the ones of flush
+    const auto size = count * sizeof(input_event);
+    for (;;) {
+      const auto result = ::write(m_uinput_fd, buffer.data(), size);
+      if (result < 0 && errno == EINTR)
+        continue;
+      return (result == static_cast<ssize_t>(size));
+    }
   }
 
   bool send_key_event(const KeyEvent& event) {
@@ -147,14 +279,14 @@ public:
       const auto vertical = (event.key == Key::WheelUp || event.key == Key::WheelDown);
       const auto negative = (event.key == Key::WheelDown || event.key == Key::WheelLeft);
       const auto value = (event.value ? event.value : 120) * (negative ? -1 : 1);
-      send_event(EV_REL, (vertical ? REL_WHEEL : REL_HWHEEL), value / 120);
-      send_event(EV_REL, (vertical ? REL_WHEEL_HI_RES : REL_HWHEEL_HI_RES), value);
+      buffer_event(EV_REL, (vertical ? REL_WHEEL : REL_HWHEEL), value / 120);
+      buffer_event(EV_REL, (vertical ? REL_WHEEL_HI_RES : REL_HWHEEL_HI_RES), value);
     }
     else {
-      if (!send_event(EV_KEY, *event.key, get_key_event_value(event)))
-        return false;
+      buffer_event(EV_KEY, *event.key, get_key_event_value(event));
     }
-    return send_event(EV_SYN, SYN_REPORT, 0);
+    buffer_event(EV_SYN, SYN_REPORT, 0);
+    return true;
   }
 };
 
@@ -174,6 +306,21 @@ bool VirtualDevice::create(const char* name) {
   return true;
 }
 
+bool VirtualDevice::adopt(int fd) {
+  m_impl.reset();
+  auto impl = std::make_unique<VirtualDeviceImpl>();
+  if (!impl->adopt(fd))
+    return false;
+  m_impl = std::move(impl);
+  return true;
+}
+
+int VirtualDevice::hand_off() {
+  const auto fd = (m_impl ? m_impl->hand_off() : -1);
+  m_impl.reset();
+  return fd;
+}
+
 bool VirtualDevice::send_key_event(const KeyEvent& event) {
   return (m_impl && m_impl->send_key_event(event));
 }
@@ -183,5 +330,13 @@ bool VirtualDevice::send_event(int type, int code, int value) {
 }
 
 bool VirtualDevice::flush() {
-  return true;
+  return (m_impl && m_impl->flush());
+}
+
+bool VirtualDevice::write_events(const Event* events, size_t count) {
+  return (m_impl && m_impl->write_events(events, count));
+}
+
+bool VirtualDevice::set_io_uring(bool enabled) {
+  return (m_impl && m_impl->set_io_uring(enabled));
 }
@@ -4,6 +4,7 @@
 #include "common/output.h"
 #include <atomic>
 #include <optional>
+#include <utility>
 #include <pqrs/karabiner/driverkit/virtual_hid_device_driver.hpp>
 #include <pqrs/karabiner/driverkit/virtual_hid_device_service.hpp>
 #include <IOKit/hid/IOHIDManager.h>
@@ -19,6 +20,10 @@ private:
   virtual_hid_device_driver::hid_report::consumer_input m_consumer;
   virtual_hid_device_driver::hid_report::generic_desktop_input m_desktop;
   bool m_fn_key_hold{ };
+  // report with changes not yet posted
+  enum class Report { none, keyboard, consumer, desktop };
+  Report m_pending_report{ };
+  bool m_pending_down{ };
 
 public:
   VirtualDeviceImpl() {
@@ -87,12 +92,11 @@ public:
     // TODO: FN keys are currently hardcoded for my device, find out how to map correctly
     if (!m_fn_key_hold && event.key == Key::F6) {
       const auto key = kHIDUsage_GD_DoNotDisturb;
+      prepare_report(Report::desktop, event.state);
       if (event.state == KeyState::Down)
         m_desktop.keys.insert(key);
       else
         m_desktop.keys.erase(key);
-
-      m_client->async_post_report(m_desktop);
     }
     else if (!m_fn_key_hold && event.key >= Key::F1 && event.key <= Key::F12) {
       const auto key = [&]() {
@@ -111,26 +115,27 @@ public:
           case Key::F12: return kHIDUsage_Csmr_VolumeIncrement;
         }
       }();
+      prepare_report(Report::consumer, event.state);
       if (event.state == KeyState::Down)
         m_consumer.keys.insert(key);
       else
         m_consumer.keys.erase(key);
-
-      m_client->async_post_report(m_consumer);
     }
     else {
       const auto key = static_cast<uint16_t>(event.key);
+      prepare_report(Report::keyboard, event.state);
       if (event.state == KeyState::Down)
         m_keyboard.keys.insert(key);
       else
         m_keyboard.keys.erase(key);
-
-      m_client->async_post_report(m_keyboard);
     }
     return true;
   }
 
   bool flush() {
+    if (m_state.load() != State::connected)
+      return false;
+    post_pending_report();
     return true;
   }
 
@@ -149,6 +154,28 @@ public:
     }
     return true;
   }
+
+private:
+  void prepare_report(Report report, KeyState state) {
+    // successive releases are posted at once, but each press
+    // in a separate report, so the OS observes their order
+    if (m_pending_report != Report::none &&
+        (m_pending_report != report || m_pending_down ||
+         state == KeyState::Down))
+      post_pending_report();
+    m_pending_report = report;
+    m_pending_down = (state == KeyState::Down);
+  }
+
+  void post_pending_report() {
+    switch (std::exchange(m_pending_report, Report::none)) {
+      case Report::none: break;
+      case Report::keyboard: m_client->async_post_report(m_keyboard); break;
+      case Report::consumer: m_client->async_post_report(m_consumer); break;
+      case Report::desktop: m_client->async_post_report(m_desktop); break;
+    }
+    m_pending_down = false;
+  }
 };
 
 //-------------------------------------------------------------------------
@@ -167,6 +194,16 @@ bool VirtualDevice::create(const char* name) {
   return true;
 }
 
+bool VirtualDevice::adopt(int fd) {
+  // not supported
+  return false;
+}
+
+int VirtualDevice::hand_off() {
+  // not supported
+  return -1;
+}
+
 bool VirtualDevice::send_key_event(const KeyEvent& event) {
   return (m_impl && m_impl->send_key_event(event));
 }
@@ -178,3 +215,13 @@ bool VirtualDevice::send_event(int type, int code, int value) {
 bool VirtualDevice::flush() {
   return (m_impl && m_impl->flush());
 }
+
+bool VirtualDevice::write_events(const Event* events, size_t count) {
+  // not supported
+  return false;
+}
+
+bool VirtualDevice::set_io_uring(bool enabled) {
+  // not supported
+  return !enabled;
+}
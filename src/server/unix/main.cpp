@@ -1,41 +1,250 @@
 
 #include "GrabbedDevices.h"
 #include "VirtualDevice.h"
+#include "MetricsExporter.h"
 #include "server/Settings.h"
 #include "server/ServerState.h"
-#include "runtime/Timeout.h"
+#include "server/MessageQueue.h"
+#include "server/RemoteOutput.h"
 #include "common/output.h"
+#include "common/parse_regex.h"
+#if defined(ENABLE_EMBEDDED)
+# include "client/unix/EmbeddedClient.h"
+#endif
 #include <csignal>
 #include <atomic>
+#include <array>
+#include <random>
+#include <thread>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#if defined(__GLIBC__)
+#  include <malloc.h>
+#endif
 
 namespace {
   class ServerStateImpl final : public ServerState {
+  public:
+    using ServerState::ServerState;
+
   private:
     bool on_send_key(const KeyEvent& event) override;
+    bool on_keys_sent() override;
+    bool on_get_keys_down(KeyBitmap& keys_down) override;
     void on_exit_requested() override;
     void on_configuration_message(MultiStagePtr stage) override;
     void on_grab_device_filters_message(
       std::vector<GrabDeviceFilter> filters) override;
     void on_directives_message(
       const std::vector<std::string>& directives) override;
+    void on_active_contexts_message(const std::vector<int>& context_indices,
+      const ContextSwitchTimes& times) override;
+    void on_set_virtual_key_state_message(Key key, KeyState state) override;
+    void on_set_virtual_key_states_message(const std::vector<Key>& keys,
+      KeyState state) override;
+    void on_validate_state_message() override;
+  };
+
+  // the devices of a seat are translated by their own stages
+  // and output through their own virtual device
+  class SeatState final : public ServerState {
+  public:
+    SeatState(std::unique_ptr<IClientPort> client, Filter filter);
+    bool matches(const DeviceDesc& device_desc) const;
+    VirtualDevice& device() { return m_device; }
+
+  private:
+    bool on_send_key(const KeyEvent& event) override;
+    bool on_keys_sent() override;
+    bool on_get_keys_down(KeyBitmap& keys_down) override;
+    void on_exit_requested() override;
+    // devices are grabbed by the filters of the default seat
+    void on_grab_device_filters_message(std::vector<GrabDeviceFilter>) override { }
+
+    Filter m_filter;
+    VirtualDevice m_device;
+  };
+
+  // seats have no connection, their actions are sent to the client
+  class SeatClientPort final : public IClientPort {
+  public:
+    Socket socket() const override { return invalid_socket; }
+    Socket listen_socket() const override { return invalid_socket; }
+    bool version_mismatch() const override { return false; }
+    bool listen() override { return false; }
+    bool accept() override { return false; }
+    void disconnect() override { }
+    bool send_triggered_actions(const std::vector<int>& actions) override;
+    bool send_virtual_key_state(Key key, KeyState state) override;
+    bool send_virtual_key_states(const std::vector<KeyEvent>& states) override;
+    bool send_next_key_info(Key, const DeviceDesc&) override { return true; }
+    bool send_statistics(const std::string&) override { return true; }
+    bool send_input_profiles(const InputProfiles&) override { return true; }
+    bool read_messages(MessageHandler&, std::optional<Duration>) override {
+      return true;
+    }
+    void set_snapshot_filename(std::filesystem::path) override { }
+    bool load_snapshot(MessageHandler&) override { return false; }
+    std::unique_ptr<IClientPort> create_session() const override {
+      return std::make_unique<SeatClientPort>();
+    }
+    void swap_session(IClientPort&) override { }
+    void restore_session(MessageHandler&) override { }
   };
   
 #if !defined(__APPLE__)
   const auto virtual_device_name = "Keymapper";
+  const auto snapshot_filename = "/var/lib/keymapper/configuration";
 #else
   const auto virtual_device_name = "Karabiner";
+  const auto snapshot_filename = "/var/db/keymapper/configuration";
 #endif
 
   VirtualDevice g_virtual_device;
   GrabbedDevices g_grabbed_devices;
-  int g_interrupt_fd;
+  // waiting is interrupted by the clients and when another one connects
+  std::vector<int> g_interrupt_fds;
   std::atomic<bool> g_shutdown;
+  std::atomic<bool> g_dump_requested;
+  std::filesystem::path g_trace_filename;
+  bool g_use_event_time;
+  bool g_pointer_thread;
+  bool g_reader_threads;
+  bool g_io_uring;
+  bool g_realtime;
+  int g_realtime_policy{ SCHED_FIFO };
+  std::optional<int> g_realtime_cpu;
+  int g_client_socket{ -1 };
+  int g_listen_socket;
+  // devices are kept across client connections
+  bool g_devices_grabbed;
+  bool g_virtual_device_created;
+  bool g_devices_failed;
+  bool g_grab_mice;
+  bool g_configuration_received;
+  // the default seat is translated by the state, which owns the client port
+  IClientPort* g_client_port;
+  std::vector<std::unique_ptr<SeatState>> g_seats;
+  // index of the seat of each grabbed device, -1 for the default seat
+  std::vector<int> g_device_seats;
+  // realtime mode: client messages are read by another thread
+  MessageQueue g_message_queue;
+  std::array<int, 2> g_wakeup_pipe{ -1, -1 };
+  std::atomic<bool> g_stop_reading;
+  std::thread g_reading_thread;
   std::vector<GrabDeviceFilter> m_grab_device_filters;
   bool g_grab_device_filters_changed;
-  ServerStateImpl g_state;
+  // another client connected or a parked session requested activation
+  enum class SessionSwitch { none, accept, activate };
+  SessionSwitch g_session_switch;
+  // the output of the default seat is forwarded to another machine
+  int g_remote_socket{ -1 };
+  RemoteOutputWriter g_remote_output;
+  // serves the statistics to a monitoring system
+  MetricsExporter g_metrics_exporter;
+  bool g_export_metrics;
+  // a restarted keymapperd takes over the grabbed devices, the virtual
+  // device and the listening socket, so they do not disappear
+  const auto handoff_socket_name = "keymapperd-handoff";
+  const auto handoff_version = uint32_t{ 1 };
+  const auto max_handoff_devices = size_t{ 64 };
+  int g_handoff_socket{ -1 };
+  int g_handoff_connection{ -1 };
+  int g_adopted_listen_socket{ -1 };
+
+  struct HandoffHeader {
+    uint32_t version;
+    uint32_t device_count;
+    uint32_t grab_mice;
+  };
+#if defined(ENABLE_EMBEDDED)
+  // the client runs in a thread of the process, instead of connecting
+  const auto g_local_channel = std::make_shared<LocalChannel>();
+  const auto default_config_file_path = "/etc/keymapper.conf";
+#endif
+
+  std::unique_ptr<IClientPort> create_client_port() {
+#if defined(ENABLE_EMBEDDED)
+    auto client_port = std::make_unique<LocalClientPort>(g_local_channel);
+#else
+    auto client_port = std::make_unique<ClientPort>();
+#endif
+    g_client_port = client_port.get();
+    return client_port;
+  }
+  ServerStateImpl g_state{ create_client_port() };
+
+  IClientPort::MessageHandler& handler(SeatState& seat) {
+    return seat;
+  }
   
+  bool send_remote_output(const char* data, size_t size) {
+    // not fatal, the receiver recovers the keys released in lost datagrams
+    if (::send(g_remote_socket, data, size, MSG_DONTWAIT) < 0)
+      verbose("Forwarding output failed");
+    return true;
+  }
+
+  bool send_key_event(const KeyEvent& event) {
+    if (g_remote_socket < 0)
+      return g_virtual_device.send_key_event(event);
+    g_remote_output.add(event);
+    return true;
+  }
+
+  bool flush_output() {
+    if (g_remote_socket >= 0)
+      g_remote_output.flush(send_remote_output, Clock::now());
+    return g_virtual_device.flush();
+  }
+
+  // called by the threads reading the grabbed mice
+  bool forward_pointer_frame(const GrabbedDevices::Event* events, size_t count) {
+    auto frame = std::array<VirtualDevice::Event, 64>{ };
+    if (count > frame.size())
+      return false;
+    for (auto i = size_t{ }; i < count; ++i)
+      frame[i] = { events[i].type, events[i].code, events[i].value };
+    return g_virtual_device.write_events(frame.data(), count);
+  }
+
+  void start_device_threads() {
+    // can only write once the virtual device exists
+    if (g_pointer_thread &&
+        !g_grabbed_devices.set_pointer_forwarding(forward_pointer_frame))
+      error("Forwarding pointer motion in separate threads failed");
+    if (g_reader_threads && !g_grabbed_devices.set_reader_threads(true))
+      error("Reading devices in separate threads failed");
+    if (g_io_uring) {
+      auto succeeded = g_grabbed_devices.set_io_uring(true) &&
+        g_virtual_device.set_io_uring(true);
+      for (auto& seat : g_seats)
+        succeeded = seat->device().set_io_uring(true) && succeeded;
+      if (!succeeded)
+        error("Using io_uring failed");
+    }
+  }
+
   bool ServerStateImpl::on_send_key(const KeyEvent& event) {
-    return g_virtual_device.send_key_event(event);
+    return send_key_event(event);
+  }
+
+  bool ServerStateImpl::on_keys_sent() {
+    return flush_output();
+  }
+
+  bool ServerStateImpl::on_get_keys_down(KeyBitmap& keys_down) {
+    return g_grabbed_devices.get_keys_down(keys_down);
   }
 
   void ServerStateImpl::on_exit_requested() {
@@ -43,9 +252,18 @@ namespace {
   }
 
   void ServerStateImpl::on_configuration_message(MultiStagePtr stage) {
-    if (has_configuration() &&
-        has_mouse_mappings() != stage->has_mouse_mappings()) {
-      verbose("Mouse usage in configuration changed");
+    if (stage) {
+      g_configuration_received = true;
+      // seats keep the configurations they replaced too
+      for (auto& seat : g_seats)
+        handler(*seat).on_activate_configuration_message(
+          stage->configuration_hash(),
+          [&]() { return stage->clone_configuration(); });
+    }
+    if (stage && g_grab_mice != stage->has_mouse_mappings()) {
+      if (has_configuration())
+        verbose("Mouse usage in configuration changed");
+      g_grab_mice = stage->has_mouse_mappings();
       g_grab_device_filters_changed = true;
     }
     ServerState::on_configuration_message(std::move(stage));
@@ -61,8 +279,9 @@ namespace {
                   std::tie(b.string, b.invert, b.by_id));
         });
 
-    if (has_configuration() && filters_changed) {
-      verbose("Grab device filters changed");
+    if (filters_changed) {
+      if (has_configuration())
+        verbose("Grab device filters changed");
       g_grab_device_filters_changed = true;
     }
     m_grab_device_filters = std::move(filters);
@@ -76,11 +295,156 @@ namespace {
       end(directives), "macos-iso-keyboard") > 0);
 #endif
 
+    for (auto& seat : g_seats)
+      handler(*seat).on_directives_message(directives);
     ServerState::on_directives_message(directives);
   }
 
+  void ServerStateImpl::on_active_contexts_message(
+      const std::vector<int>& context_indices,
+      const ContextSwitchTimes& times) {
+    for (auto& seat : g_seats)
+      handler(*seat).on_active_contexts_message(context_indices, { });
+    ServerState::on_active_contexts_message(context_indices, times);
+  }
+
+  void ServerStateImpl::on_set_virtual_key_state_message(Key key,
+      KeyState state) {
+    for (auto& seat : g_seats)
+      handler(*seat).on_set_virtual_key_state_message(key, state);
+    ServerState::on_set_virtual_key_state_message(key, state);
+  }
+
+  void ServerStateImpl::on_set_virtual_key_states_message(
+      const std::vector<Key>& keys, KeyState state) {
+    for (auto& seat : g_seats)
+      handler(*seat).on_set_virtual_key_states_message(keys, state);
+    ServerState::on_set_virtual_key_states_message(keys, state);
+  }
+
+  void ServerStateImpl::on_validate_state_message() {
+    for (auto& seat : g_seats)
+      handler(*seat).on_validate_state_message();
+    ServerState::on_validate_state_message();
+  }
+
+  SeatState::SeatState(std::unique_ptr<IClientPort> client, Filter filter)
+    : ServerState(std::move(client)),
+      m_filter(std::move(filter)) {
+  }
+
+  bool SeatState::matches(const DeviceDesc& device_desc) const {
+    return (m_filter.matches(device_desc.name, false) ||
+            m_filter.matches(device_desc.id, false));
+  }
+
+  bool SeatState::on_send_key(const KeyEvent& event) {
+    return m_device.send_key_event(event);
+  }
+
+  bool SeatState::on_keys_sent() {
+    return m_device.flush();
+  }
+
+  bool SeatState::on_get_keys_down(KeyBitmap& keys_down) {
+    return g_grabbed_devices.get_keys_down(keys_down);
+  }
+
+  void SeatState::on_exit_requested() {
+    g_shutdown.store(true);
+  }
+
+  bool SeatClientPort::send_triggered_actions(const std::vector<int>& actions) {
+    return g_client_port->send_triggered_actions(actions);
+  }
+
+  bool SeatClientPort::send_virtual_key_state(Key key, KeyState state) {
+    return g_client_port->send_virtual_key_state(key, state);
+  }
+
+  bool SeatClientPort::send_virtual_key_states(
+      const std::vector<KeyEvent>& states) {
+    return g_client_port->send_virtual_key_states(states);
+  }
+
+  void create_seats(const std::vector<std::string>& filters) {
+    for (const auto& string : filters) {
+      auto filter = Filter{ string };
+      if (is_regex(string))
+        filter.regex = parse_regex(string);
+      g_seats.push_back(std::make_unique<SeatState>(
+        std::make_unique<SeatClientPort>(), std::move(filter)));
+    }
+  }
+
+  // the seat, whose devices the input was read from
+  SeatState* get_seat(int device_index) {
+    if (device_index < 0 ||
+        static_cast<size_t>(device_index) >= g_device_seats.size() ||
+        g_device_seats[device_index] < 0)
+      return nullptr;
+    return g_seats[g_device_seats[device_index]].get();
+  }
+
+  void set_device_descs() {
+    const auto& device_descs = g_grabbed_devices.grabbed_device_descs();
+    g_state.set_device_descs(device_descs);
+    g_device_seats.clear();
+    for (const auto& device_desc : device_descs) {
+      const auto it = std::find_if(g_seats.begin(), g_seats.end(),
+        [&](const auto& seat) { return seat->matches(device_desc); });
+      g_device_seats.push_back(it == g_seats.end() ? -1 :
+        static_cast<int>(std::distance(g_seats.begin(), it)));
+    }
+    for (auto& seat : g_seats)
+      seat->set_device_descs(device_descs);
+  }
+
+  void reset_configuration() {
+    g_state.reset_configuration();
+    for (auto& seat : g_seats)
+      seat->reset_configuration();
+  }
+
+  // applies the configuration of a resumed session to the seats
+  void update_seats() {
+    for (auto& seat : g_seats) {
+      seat->reset_configuration(g_state.clone_configuration());
+      handler(*seat).on_active_contexts_message(g_state.active_contexts(), { });
+    }
+  }
+
+  std::optional<Clock::time_point> next_deadline() {
+    auto deadline = g_state.next_deadline();
+    if (g_remote_socket >= 0)
+      if (const auto keepalive_at = g_remote_output.keepalive_at())
+        if (!deadline || *keepalive_at < *deadline)
+          deadline = keepalive_at;
+    for (auto& seat : g_seats)
+      if (const auto seat_deadline = seat->next_deadline())
+        if (!deadline || *seat_deadline < *deadline)
+          deadline = seat_deadline;
+    return deadline;
+  }
+
+  bool process_deadlines() {
+    const auto now = Clock::now();
+    if (!g_state.process_deadlines(now) || !flush_output())
+      return false;
+    if (g_remote_socket >= 0)
+      if (const auto keepalive_at = g_remote_output.keepalive_at())
+        if (*keepalive_at <= now)
+          g_remote_output.send_keepalive(send_remote_output, now);
+    for (auto& seat : g_seats)
+      if (!seat->process_deadlines(now) || !seat->device().flush())
+        return false;
+    return true;
+  }
+
   bool read_initial_config() {
-    while (!g_state.has_configuration()) {
+    // configuration snapshot is kept until client sends its configuration
+    g_configuration_received = false;
+    while (!g_configuration_received || !g_state.has_configuration()) {
       if (!g_state.read_client_messages()) {
         error("Receiving configuration failed");
         return false;
@@ -89,75 +453,479 @@ namespace {
     return true;
   }
 
+  void read_client_messages_thread() {
+    // let main thread handle the signals
+    auto signals = sigset_t{ };
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGUSR1);
+    ::pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    while (!g_stop_reading.load()) {
+      if (!g_state.read_client_messages(g_message_queue,
+            std::chrono::milliseconds(100)))
+        break;
+      if (!g_message_queue.empty())
+        ::write(g_wakeup_pipe[1], "", 1);
+    }
+    g_message_queue.close();
+    ::write(g_wakeup_pipe[1], "", 1);
+  }
+
+  bool create_wakeup_pipe() {
+    if (::pipe(g_wakeup_pipe.data()) != 0)
+      return false;
+    for (auto fd : g_wakeup_pipe)
+      ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return true;
+  }
+
+  void update_interrupt_fds() {
+    g_interrupt_fds.clear();
+    g_interrupt_fds.push_back(g_listen_socket);
+    if (g_handoff_socket >= 0)
+      g_interrupt_fds.push_back(g_handoff_socket);
+    if (g_export_metrics)
+      g_interrupt_fds.push_back(g_metrics_exporter.wakeup_fd());
+    if (g_client_socket < 0)
+      return;
+    g_interrupt_fds.push_back(g_reading_thread.joinable() ?
+      g_wakeup_pipe[0] : g_client_socket);
+    for (auto socket : g_state.client_session_sockets())
+      g_interrupt_fds.push_back(socket);
+  }
+
+  void start_reading_thread() {
+    g_stop_reading.store(false);
+    g_reading_thread = std::thread(read_client_messages_thread);
+    update_interrupt_fds();
+  }
+
+  void stop_reading_thread() {
+    g_stop_reading.store(true);
+    g_reading_thread.join();
+    g_message_queue.clear();
+    update_interrupt_fds();
+  }
+
+  bool set_realtime_priority(bool enable) {
+    auto param = sched_param{ };
+    param.sched_priority =
+      (enable ? sched_get_priority_min(g_realtime_policy) : 0);
+    const auto result = ::pthread_setschedparam(::pthread_self(),
+      (enable ? g_realtime_policy : SCHED_OTHER), &param);
+    if (enable && result == EPERM)
+      error("Setting realtime priority failed, CAP_SYS_NICE or "
+            "RLIMIT_RTPRIO is missing");
+    else if (enable && result != 0)
+      error("Setting realtime priority failed");
+    return (result == 0);
+  }
+
+  // pins the calling thread to the CPU, the reading thread is not pinned
+  bool set_realtime_affinity(bool enable) {
+#if defined(__linux__)
+    static auto s_default_cpus = std::optional<cpu_set_t>();
+    if (!g_realtime_cpu)
+      return true;
+    if (!s_default_cpus) {
+      s_default_cpus.emplace();
+      if (::sched_getaffinity(0, sizeof(cpu_set_t), &*s_default_cpus) != 0)
+        return false;
+    }
+    auto cpus = *s_default_cpus;
+    if (enable) {
+      CPU_ZERO(&cpus);
+      CPU_SET(*g_realtime_cpu, &cpus);
+    }
+    if (::pthread_setaffinity_np(::pthread_self(),
+          sizeof(cpu_set_t), &cpus) != 0) {
+      if (enable)
+        error("Setting CPU affinity to CPU %d failed", *g_realtime_cpu);
+      return false;
+    }
+#endif
+    return true;
+  }
+
+  // so the input thread is not delayed by page faults
+  void lock_memory() {
+#if defined(__GLIBC__)
+    // keep the freed memory instead of returning it to the system
+    ::mallopt(M_TRIM_THRESHOLD, -1);
+    ::mallopt(M_MMAP_MAX, 0);
+#endif
+    if (::mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+      if (errno == EPERM || errno == ENOMEM)
+        error("Locking memory failed, CAP_IPC_LOCK is missing or "
+              "RLIMIT_MEMLOCK is too low");
+      else
+        error("Locking memory failed");
+      return;
+    }
+    verbose("Locked memory");
+  }
+
+  // touches the stack the input thread may use, so it is mapped
+  void prefault_stack() {
+    const auto size = 256 * 1024;
+    char stack[size];
+    const auto pages = static_cast<volatile char*>(stack);
+    for (auto i = 0; i < size; i += 4096)
+      pages[i] = 0;
+  }
+
+  bool split_address(const std::string& address,
+      std::string& host, std::string& port) {
+    const auto colon = address.rfind(':');
+    if (colon == std::string::npos)
+      return false;
+    host = address.substr(0, colon);
+    port = address.substr(colon + 1);
+    // [IPv6]:port
+    if (host.size() >= 2 && host.front() == '[' && host.back() == ']')
+      host = host.substr(1, host.size() - 2);
+    return !port.empty();
+  }
+
+  // connects to the host or binds to the port, when host is null
+  int open_udp_socket(const char* host, const char* port) {
+    auto hints = addrinfo{ };
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = (host ? 0 : AI_PASSIVE);
+    auto result = static_cast<addrinfo*>(nullptr);
+    if (::getaddrinfo(host, port, &hints, &result) != 0)
+      return -1;
+    auto fd = -1;
+    for (auto info = result; info; info = info->ai_next) {
+      fd = ::socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+      if (fd < 0)
+        continue;
+      if ((host ? ::connect(fd, info->ai_addr, info->ai_addrlen) :
+                  ::bind(fd, info->ai_addr, info->ai_addrlen)) == 0)
+        break;
+      ::close(fd);
+      fd = -1;
+    }
+    ::freeaddrinfo(result);
+    if (fd >= 0) {
+      ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+      const auto tos = int{ IPTOS_LOWDELAY };
+      ::setsockopt(fd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
+    }
+    return fd;
+  }
+
+  bool open_remote_output(const std::string& address) {
+    auto host = std::string();
+    auto port = std::string();
+    if (!split_address(address, host, port))
+      return false;
+    g_remote_socket = open_udp_socket(host.c_str(), port.c_str());
+    if (g_remote_socket < 0)
+      return false;
+    // lets the receiver tell when keymapperd restarted
+    g_remote_output = RemoteOutputWriter(std::random_device()());
+    return true;
+  }
+
+  bool is_readable(int fd) {
+    auto pfd = pollfd{ fd, POLLIN, 0 };
+    return (::poll(&pfd, 1, 0) > 0);
+  }
+
+  sockaddr_un get_handoff_address() {
+    // abstract socket address
+    auto addr = sockaddr_un{ };
+    addr.sun_family = AF_UNIX;
+    std::strncpy(&addr.sun_path[1], handoff_socket_name,
+      sizeof(addr.sun_path) - 2);
+    return addr;
+  }
+
+  bool open_handoff_socket() {
+    const auto fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+      return false;
+    const auto addr = get_handoff_address();
+    if (::bind(fd, reinterpret_cast<const sockaddr*>(&addr),
+          sizeof(addr)) != 0 ||
+        ::listen(fd, 1) != 0) {
+      ::close(fd);
+      return false;
+    }
+    ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+    g_handoff_socket = fd;
+    return true;
+  }
+
+  bool is_same_user(int socket) {
+#if defined(__linux__)
+    auto credentials = ucred{ };
+    auto length = socklen_t{ sizeof(credentials) };
+    return (::getsockopt(socket, SOL_SOCKET, SO_PEERCRED,
+        &credentials, &length) == 0 && credentials.uid == ::geteuid());
+#else
+    return false;
+#endif
+  }
+
+  // accepts another keymapperd, which wants to take over
+  bool handoff_requested() {
+    if (g_handoff_socket < 0 || !is_readable(g_handoff_socket))
+      return false;
+    const auto connection = ::accept(g_handoff_socket, nullptr, nullptr);
+    if (connection < 0)
+      return false;
+    if (!is_same_user(connection) || !g_seats.empty() ||
+        !g_devices_grabbed || !g_virtual_device_created) {
+      verbose("Refused to hand off devices");
+      ::close(connection);
+      return false;
+    }
+    verbose("Handing off devices to another keymapperd");
+    // the successor listens, once it took over
+    ::close(std::exchange(g_handoff_socket, -1));
+    g_handoff_connection = connection;
+    return true;
+  }
+
+  // passes the devices and the listening socket in a single message,
+  // the own descriptors are closed without ungrabbing or destroying
+  void hand_off_devices() {
+    const auto connection = std::exchange(g_handoff_connection, -1);
+    reset_configuration();
+    flush_output();
+    const auto devices = g_grabbed_devices.hand_off();
+    const auto uinput_fd = g_virtual_device.hand_off();
+
+    const auto count = std::min(devices.size(), max_handoff_devices);
+    auto header = HandoffHeader{ handoff_version,
+      static_cast<uint32_t>(count), (g_grab_mice ? 1u : 0u) };
+    auto event_ids = std::vector<int32_t>();
+    auto fds = std::vector<int>{ g_listen_socket, uinput_fd };
+    for (auto i = size_t{ }; i < count; ++i) {
+      event_ids.push_back(devices[i].first);
+      fds.push_back(devices[i].second);
+    }
+    auto iov = std::array<iovec, 2>{ {
+      { &header, sizeof(header) },
+      { event_ids.data(), event_ids.size() * sizeof(int32_t) },
+    } };
+    auto control = std::vector<char>(CMSG_SPACE(fds.size() * sizeof(int)));
+    auto message = msghdr{ };
+    message.msg_iov = iov.data();
+    message.msg_iovlen = iov.size();
+    message.msg_control = control.data();
+    message.msg_controllen = control.size();
+    const auto cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(fds.size() * sizeof(int));
+    std::memcpy(CMSG_DATA(cmsg), fds.data(), fds.size() * sizeof(int));
+    if (uinput_fd < 0 || ::sendmsg(connection, &message, 0) < 0)
+      error("Handing off devices failed");
+
+    for (const auto& [event_id, fd] : devices)
+      ::close(fd);
+    if (uinput_fd >= 0)
+      ::close(uinput_fd);
+    ::close(connection);
+  }
+
+#if defined(__linux__)
+  // receives the devices and the listening socket of the running keymapperd
+  bool take_over() {
+    const auto connection = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connection < 0)
+      return false;
+    // the running keymapperd hands off once it woke up
+    auto timeout = timeval{ 5, 0 };
+    ::setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO,
+      &timeout, sizeof(timeout));
+    const auto addr = get_handoff_address();
+    if (::connect(connection, reinterpret_cast<const sockaddr*>(&addr),
+          sizeof(addr)) != 0) {
+      ::close(connection);
+      return false;
+    }
+
+    auto header = HandoffHeader{ };
+    auto event_ids = std::array<int32_t, max_handoff_devices>{ };
+    auto iov = std::array<iovec, 2>{ {
+      { &header, sizeof(header) },
+      { event_ids.data(), event_ids.size() * sizeof(int32_t) },
+    } };
+    auto control = std::vector<char>(
+      CMSG_SPACE((max_handoff_devices + 2) * sizeof(int)));
+    auto message = msghdr{ };
+    message.msg_iov = iov.data();
+    message.msg_iovlen = iov.size();
+    message.msg_control = control.data();
+    message.msg_controllen = control.size();
+    const auto size = ::recvmsg(connection, &message, MSG_CMSG_CLOEXEC);
+    ::close(connection);
+
+    auto fds = std::vector<int>();
+    for (auto cmsg = CMSG_FIRSTHDR(&message); cmsg;
+        cmsg = CMSG_NXTHDR(&message, cmsg))
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        const auto count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        fds.resize(fds.size() + count);
+        std::memcpy(fds.data() + fds.size() - count, CMSG_DATA(cmsg),
+          count * sizeof(int));
+      }
+
+    if (size < static_cast<ssize_t>(sizeof(header)) ||
+        header.version != handoff_version ||
+        header.device_count > max_handoff_devices ||
+        static_cast<size_t>(size) != sizeof(header) +
+          header.device_count * sizeof(int32_t) ||
+        fds.size() != header.device_count + 2) {
+      for (auto fd : fds)
+        ::close(fd);
+      return false;
+    }
+
+    auto devices = std::vector<GrabbedDevices::HandoffDevice>();
+    for (auto i = size_t{ }; i < header.device_count; ++i)
+      devices.emplace_back(event_ids[i], fds[i + 2]);
+    g_adopted_listen_socket = fds[0];
+    g_grab_mice = (header.grab_mice != 0);
+    if (!g_virtual_device.adopt(fds[1]) ||
+        !g_grabbed_devices.adopt(virtual_device_name, g_grab_mice, devices))
+      return false;
+    g_devices_grabbed = true;
+    g_virtual_device_created = true;
+    start_device_threads();
+    return true;
+  }
+#endif // __linux__
+
+  // applies the messages at a safe point between the input frames
+  bool apply_client_messages() {
+    if (!g_realtime)
+      return g_state.read_client_messages(Duration::zero());
+
+    const auto closed = g_message_queue.closed();
+    auto buffer = std::array<char, 64>{ };
+    while (::read(g_wakeup_pipe[0], buffer.data(), buffer.size()) > 0) { }
+    while (g_message_queue.apply_next(g_state)) { }
+    return !closed;
+  }
+
+  void write_event_trace() {
+    if (!g_trace_filename.empty() &&
+        !g_state.write_event_trace(g_trace_filename))
+      error("Writing event trace failed");
+  }
+
   bool main_loop() {
     auto& s = g_state;
+    auto translated_input = false;
     for (;;) {
-      // wait for next input event
-      auto now = Clock::now();
-      auto timeout = std::optional<Duration>();
-      const auto set_timeout = [&](const Duration& duration) {
-        if (!timeout || duration < timeout)
-          timeout = duration;
-      };
-      
-      if (s.flush_scheduled_at())
-        set_timeout(s.flush_scheduled_at().value() - now);
-      if (s.timeout_start_at())
-        set_timeout(s.timeout_start_at().value() + s.timeout() - now);
-
       if (g_shutdown.load()) {
         verbose("Received shutdown signal");
         return false;
       }
+      if (g_dump_requested.exchange(false)) {
+        message("Recent events:\n%s", s.format_recent_events().c_str());
+        write_event_trace();
+      }
 
+      // wait for next input event or deadline,
       // interrupt waiting when client sends an update
-      const auto [succeeded, input] =
-        g_grabbed_devices.read_input_event(timeout, g_interrupt_fd);
+      auto interrupted = false;
+      const auto [succeeded, input] = g_grabbed_devices.read_input_event(
+        next_deadline(), g_interrupt_fds, &interrupted);
       if (!succeeded) {
         error("Reading input event failed");
+        g_devices_failed = true;
         return true;
       }
 
-      now = Clock::now();
-
       if (input) {
+        auto seat = get_seat(input->device_index);
+        auto& state = (seat ? static_cast<ServerState&>(*seat) : s);
+        auto& device = (seat ? seat->device() : g_virtual_device);
         if (auto event = to_key_event(input.value())) {
-          if (event->key != Key::none)
-            s.translate_input(event.value(), input->device_index);
+          if (event->key != Key::none) {
+            state.translate_input(event.value(), input->device_index,
+              g_use_event_time ? input->time : Clock::now());
+            translated_input = true;
+          }
         }
         else {
           // forward other events
-          g_virtual_device.send_event(input->type, input->code, input->value);
-          continue;
+          device.send_event(input->type, input->code, input->value);
         }
-      }
 
-      if (s.timeout_start_at() &&
-          now >= s.timeout_start_at().value() + s.timeout()) {
-        const auto timeout = make_input_timeout_event(s.timeout());
-        s.cancel_timeout();
-        s.translate_input(timeout, Stage::any_device_index);
-      }
+        // handle whole frame before flushing once
+        if (g_grabbed_devices.reading_frame())
+          continue;
 
-      if (!s.flush_scheduled_at() || now > s.flush_scheduled_at()) {
-        if (!s.flush_send_buffer()) {
-          error("Sending input failed");
-          return true;
+        // forward frame without translated keys directly
+        if (!std::exchange(translated_input, false)) {
+          if (!device.flush()) {
+            error("Sending input failed");
+            g_devices_failed = true;
+            return true;
+          }
+          continue;
         }
       }
 
+      if (!process_deadlines()) {
+        error("Sending input failed");
+        g_devices_failed = true;
+        return true;
+      }
+
       if (g_grabbed_devices.update_devices())
-        s.set_device_descs(g_grabbed_devices.grabbed_device_descs());
+        set_device_descs();
+
+      if (g_export_metrics)
+        g_metrics_exporter.publish_snapshot(!input,
+          [&]() { return s.statistics(); });
+
+      if (!input && handoff_requested())
+        return false;
 
       // let client update configuration and context
-      if (g_interrupt_fd >= 0)
-        if (!s.read_client_messages(Duration::zero()) ||
-            std::exchange(g_grab_device_filters_changed, false) ||
+      if (g_client_socket < 0) {
+        if (interrupted && is_readable(g_listen_socket))
+          return true;
+      }
+      else {
+        // messages are only read when they interrupted waiting
+        if ((interrupted && !apply_client_messages()) ||
             !s.has_configuration()) {
           verbose("Connection to keymapper reset");
           return true;
         }
 
+        // other clients can only interrupt waiting
+        if (interrupted) {
+          if (is_readable(g_listen_socket)) {
+            g_session_switch = SessionSwitch::accept;
+            return true;
+          }
+          const auto session_count = s.client_session_count();
+          if (s.read_client_sessions()) {
+            g_session_switch = SessionSwitch::activate;
+            return true;
+          }
+          if (s.client_session_count() != session_count)
+            update_interrupt_fds();
+        }
+      }
+
+      if (std::exchange(g_grab_device_filters_changed, false) &&
+          g_grabbed_devices.set_grab_filters(g_grab_mice, m_grab_device_filters))
+        set_device_descs();
+
       if (s.should_exit())
         return false;
     }
@@ -165,54 +933,321 @@ namespace {
 
   void handle_shutdown_signal(int) {
     g_shutdown.store(true);
-    g_state.disconnect();
+    if (g_realtime)
+      ::write(g_wakeup_pipe[1], "", 1);
+    else
+      g_state.disconnect();
   }
- 
-  int connection_loop() {
-    while (!g_shutdown.load()) {
-      verbose("Waiting for keymapper to connect");
-      const auto client_socket = g_state.accept_client_connection();
 
-      if (g_state.version_mismatch()) {
-        error("Client version mismatch detected");
-        return 1;
-      }
-      if (!client_socket)
+  // the recent events are output by the main loop, once it wakes up
+  void handle_dump_signal(int) {
+    g_dump_requested.store(true);
+    if (g_realtime)
+      ::write(g_wakeup_pipe[1], "", 1);
+  }
+
+  // forward input unmodified until a client connects
+  bool forward_input_until_connection() {
+    auto interrupt_fds = std::vector<int>{ g_listen_socket };
+    if (g_handoff_socket >= 0)
+      interrupt_fds.push_back(g_handoff_socket);
+    for (;;) {
+      const auto [succeeded, input] =
+        g_grabbed_devices.read_input_event(std::nullopt, interrupt_fds);
+      if (!succeeded)
+        return false;
+
+      if (input) {
+        const auto seat = get_seat(input->device_index);
+        auto& device = (seat ? seat->device() : g_virtual_device);
+        const auto event = to_key_event(input.value());
+        if (event && event->key != Key::none && !is_mouse_wheel(event->key)) {
+          if (seat)
+            device.send_key_event(event.value());
+          else
+            send_key_event(event.value());
+        }
+        else {
+          device.send_event(input->type, input->code, input->value);
+        }
+
+        if (!g_grabbed_devices.reading_frame() &&
+            !(seat ? device.flush() : flush_output()))
+          return false;
         continue;
+      }
+
+      if (g_grabbed_devices.update_devices())
+        set_device_descs();
+
+      if (handoff_requested()) {
+        g_shutdown.store(true);
+        return true;
+      }
+
+      if (is_readable(g_listen_socket))
+        return true;
+    }
+  }
+
+  bool grab_devices() {
+    if (!g_devices_grabbed) {
+      if (!g_grabbed_devices.grab(virtual_device_name, g_grab_mice,
+            m_grab_device_filters))
+        return false;
+      g_devices_grabbed = true;
+      g_grab_device_filters_changed = false;
+    }
+    else if (std::exchange(g_grab_device_filters_changed, false)) {
+      g_grabbed_devices.set_grab_filters(g_grab_mice, m_grab_device_filters);
+    }
+    return true;
+  }
+
+  bool create_devices() {
+    if (!grab_devices()) {
+      error("Initializing input device grabbing failed");
+      return false;
+    }
+    set_device_descs();
+
+    if (!g_virtual_device_created) {
+      verbose("Creating virtual device '%s'", virtual_device_name);
+      if (!g_virtual_device.create(virtual_device_name)) {
+        error("Creating virtual device failed");
+        return false;
+      }
+      // the seat devices have the same name, so they are not grabbed
+      for (auto& seat : g_seats)
+        if (!seat->device().create(virtual_device_name)) {
+          error("Creating virtual device of seat failed");
+          return false;
+        }
+      g_virtual_device_created = true;
+      start_device_threads();
+    }
+    return true;
+  }
 
-      g_interrupt_fd = *client_socket;
+  void release_devices() {
+    if (g_handoff_connection >= 0)
+      hand_off_devices();
+    g_grabbed_devices = { };
+    g_virtual_device = { };
+    for (auto& seat : g_seats)
+      seat->device() = { };
+    g_device_seats.clear();
+    g_devices_grabbed = false;
+    g_virtual_device_created = false;
+    g_devices_failed = false;
+  }
+
+  // apply configuration snapshot until a client connects
+  bool translate_input_until_connection() {
+    verbose("Applying configuration snapshot");
+    if (!create_devices())
+      return false;
+    g_client_socket = -1;
+    update_interrupt_fds();
+    if (!main_loop())
+      g_shutdown.store(true);
+    return !g_devices_failed;
+  }
+
+  // accepts the next client, returns false when no session can be updated
+  bool accept_client(bool& version_mismatch) {
+    // snapshot is only kept until a client sent its configuration
+    if (g_state.has_configuration()) {
+      if (!translate_input_until_connection()) {
+        reset_configuration();
+        release_devices();
+      }
+      if (g_shutdown.load())
+        return false;
+    }
+
+    verbose("Waiting for keymapper to connect");
+    if (g_devices_grabbed && !g_state.has_configuration() &&
+        !forward_input_until_connection()) {
+      error("Forwarding input failed");
+      release_devices();
+    }
+    if (g_shutdown.load())
+      return false;
+    const auto client_socket = g_state.accept_client_connection();
+
+    if (g_state.version_mismatch()) {
+      error("Client version mismatch detected");
+      version_mismatch = true;
+      return false;
+    }
+    if (!client_socket || !read_initial_config()) {
+      g_state.disconnect();
+      return false;
+    }
+    return true;
+  }
+
+  void handle_receive_signal(int) {
+    g_shutdown.store(true);
+  }
+
+  // outputs what another keymapperd forwards, until a signal is received
+  int receive_output(const std::string& port) {
+    const auto socket = open_udp_socket(nullptr, port.c_str());
+    if (socket < 0) {
+      error("Opening port %s failed", port.c_str());
+      return 1;
+    }
+    verbose("Creating virtual device '%s'", virtual_device_name);
+    if (!g_virtual_device.create(virtual_device_name)) {
+      error("Creating virtual device failed");
+      ::close(socket);
+      return 1;
+    }
+    ::signal(SIGINT, handle_receive_signal);
+    ::signal(SIGTERM, handle_receive_signal);
+    if (g_realtime) {
+      set_realtime_priority(true);
+      set_realtime_affinity(true);
+      prefault_stack();
+    }
+
+    verbose("Receiving output on port %s", port.c_str());
+    auto reader = RemoteOutputReader();
+    auto buffer = std::vector<char>(65536);
+    auto output = KeySequence();
+    auto received_at = Clock::now();
+    auto result = 0;
+    while (!g_shutdown.load()) {
+      auto timeout = -1;
+      if (reader.has_keys_down())
+        timeout = static_cast<int>(std::max(std::chrono::milliseconds(),
+          std::chrono::ceil<std::chrono::milliseconds>(received_at +
+            RemoteOutputReader::release_timeout - Clock::now())).count());
+      auto pfd = pollfd{ socket, POLLIN, 0 };
+      const auto ready = ::poll(&pfd, 1, timeout);
+      if (ready < 0 && errno != EINTR) {
+        error("Receiving output failed");
+        result = 1;
+        break;
+      }
 
-      if (read_initial_config()) {
-        if (!g_grabbed_devices.grab(virtual_device_name,
-              g_state.has_mouse_mappings(),
-              m_grab_device_filters)) {
-          error("Initializing input device grabbing failed");
-          return 1;
+      // apply all pending datagrams before flushing once
+      output.clear();
+      if (ready > 0) {
+        for (;;) {
+          const auto size = ::recv(socket, buffer.data(), buffer.size(),
+            MSG_DONTWAIT);
+          if (size < 0)
+            break;
+          if (reader.read(buffer.data(), static_cast<size_t>(size), output))
+            received_at = Clock::now();
+          else
+            verbose("Received invalid datagram");
         }
-        g_state.set_device_descs(g_grabbed_devices.grabbed_device_descs());
+      }
+      else if (reader.has_keys_down() &&
+               Clock::now() >= received_at + RemoteOutputReader::release_timeout) {
+        verbose("Sender stopped, releasing keys");
+        reader.release_keys(output);
+      }
 
-        verbose("Creating virtual device '%s'", virtual_device_name);
-        if (!g_virtual_device.create(virtual_device_name)) {
-          error("Creating virtual device failed");
-          return 1;
+      for (const auto& event : output)
+        g_virtual_device.send_key_event(event);
+      if (!output.empty() && !g_virtual_device.flush()) {
+        error("Sending input failed");
+        result = 1;
+        break;
+      }
+    }
+
+    output.clear();
+    reader.release_keys(output);
+    for (const auto& event : output)
+      g_virtual_device.send_key_event(event);
+    g_virtual_device.flush();
+    verbose("%zu datagrams were lost", reader.lost_datagrams());
+    ::close(socket);
+    g_virtual_device = { };
+    return result;
+  }
+
+  int connection_loop() {
+    auto resumed = false;
+    while (!g_shutdown.load()) {
+      if (!std::exchange(resumed, false)) {
+        auto version_mismatch = false;
+        if (!accept_client(version_mismatch)) {
+          if (version_mismatch)
+            return 1;
+          // continue with a parked session, when the new client failed
+          resumed = (!g_shutdown.load() && g_state.resume_client_session());
+          if (resumed)
+            update_seats();
+          continue;
         }
+      }
+      g_client_socket = g_state.client_socket();
+      if (std::exchange(g_grab_mice, g_state.has_mouse_mappings()) !=
+          g_grab_mice)
+        g_grab_device_filters_changed = true;
 
-        const auto prev_sigint_handler = ::signal(SIGINT, handle_shutdown_signal);
-        const auto prev_sigterm_handler = ::signal(SIGTERM, handle_shutdown_signal);
+      if (!create_devices())
+        return 1;
 
-        verbose("Entering update loop");
-        if (!main_loop())
-          g_shutdown.store(true);
-        g_state.reset_configuration();
+      const auto prev_sigint_handler = ::signal(SIGINT, handle_shutdown_signal);
+      const auto prev_sigterm_handler = ::signal(SIGTERM, handle_shutdown_signal);
+      const auto prev_sigusr1_handler = ::signal(SIGUSR1, handle_dump_signal);
 
-        ::signal(SIGINT, prev_sigint_handler);
-        ::signal(SIGTERM, prev_sigterm_handler);
+      update_interrupt_fds();
+      if (g_realtime) {
+        start_reading_thread();
+        set_realtime_priority(true);
+        set_realtime_affinity(true);
+        prefault_stack();
       }
-      g_grabbed_devices = { };
-      g_virtual_device = { };
+
+      verbose("Entering update loop");
+      g_session_switch = SessionSwitch::none;
+      if (!main_loop())
+        g_shutdown.store(true);
+
+      if (g_realtime) {
+        set_realtime_priority(false);
+        set_realtime_affinity(false);
+        stop_reading_thread();
+      }
+
+      ::signal(SIGINT, prev_sigint_handler);
+      ::signal(SIGTERM, prev_sigterm_handler);
+      ::signal(SIGUSR1, prev_sigusr1_handler);
+
+      // devices stay grabbed, while the sessions are switched
+      if (!g_devices_failed && !g_shutdown.load()) {
+        if (g_session_switch == SessionSwitch::accept) {
+          g_state.park_client_session();
+          reset_configuration();
+          continue;
+        }
+        if (g_session_switch == SessionSwitch::activate) {
+          g_state.park_client_session();
+          resumed = g_state.resume_client_session();
+          update_seats();
+          continue;
+        }
+      }
+
+      reset_configuration();
+      if (g_devices_failed || g_shutdown.load())
+        release_devices();
       g_state.disconnect();
       verbose("---------------");
+      resumed = (!g_shutdown.load() && g_state.resume_client_session());
+      if (resumed)
+        update_seats();
     }
+    release_devices();
     return 0;
   }
 } // namespace
@@ -225,6 +1260,51 @@ int main(int argc, char* argv[]) {
     return 1;
   }
   g_verbose_output = settings.verbose;
+  g_use_event_time = !settings.no_event_time;
+  g_pointer_thread = settings.pointer_thread;
+  g_reader_threads = settings.reader_threads;
+  g_io_uring = settings.io_uring;
+  if (g_pointer_thread && !settings.seats.empty()) {
+    verbose("Pointer thread is not supported with seats");
+    g_pointer_thread = false;
+  }
+  g_realtime = settings.realtime;
+  if (settings.realtime_round_robin)
+    g_realtime_policy = SCHED_RR;
+  g_realtime_cpu = settings.realtime_cpu;
+  create_seats(settings.seats);
+  if (g_realtime) {
+    lock_memory();
+    g_state.set_preallocate_buffers(true);
+    for (auto& seat : g_seats)
+      seat->set_preallocate_buffers(true);
+  }
+
+  if (!settings.receive_port.empty())
+    return receive_output(settings.receive_port);
+
+  if (!settings.forward_address.empty()) {
+    if (!open_remote_output(settings.forward_address)) {
+      error("Connecting to '%s' failed", settings.forward_address.c_str());
+      return 1;
+    }
+    verbose("Forwarding output to '%s'", settings.forward_address.c_str());
+  }
+
+  if (!settings.metrics_port.empty()) {
+    if (!g_metrics_exporter.start(settings.metrics_port)) {
+      error("Exporting metrics on port '%s' failed",
+        settings.metrics_port.c_str());
+      return 1;
+    }
+    g_export_metrics = true;
+    verbose("Exporting metrics on port '%s'", settings.metrics_port.c_str());
+  }
+
+  if (g_realtime && !create_wakeup_pipe()) {
+    error("Creating pipe failed");
+    return 1;
+  }
 
 #if defined(__APPLE__)
   // when running as user in the graphical environment try to grab input device and exit.
@@ -233,8 +1313,53 @@ int main(int argc, char* argv[]) {
     return g_grabbed_devices.grab(virtual_device_name, false, { }) ? 0 : 1;
 #endif
 
-  if (!g_state.listen_for_client_connections())
+#if defined(__linux__)
+  if (settings.takeover) {
+    if (!g_seats.empty()) {
+      error("Taking over is not supported with seats");
+      return 1;
+    }
+    if (!take_over()) {
+      error("Taking over from running keymapperd failed");
+      return 1;
+    }
+    verbose("Took over devices from running keymapperd");
+  }
+#endif
+
+  const auto listen_socket = (g_adopted_listen_socket >= 0 ?
+    g_state.adopt_client_listen_socket(g_adopted_listen_socket) :
+    g_state.listen_for_client_connections());
+  if (!listen_socket)
+    return 1;
+  g_listen_socket = *listen_socket;
+
+#if defined(__linux__)
+  if (!open_handoff_socket())
+    verbose("Opening handoff socket failed");
+#endif
+
+  if (g_state.load_configuration_snapshot(snapshot_filename))
+    verbose("Loaded configuration snapshot");
+
+  if (!settings.record_filename.empty() &&
+      !g_state.record_input_trace(settings.record_filename)) {
+    error("Opening input trace file failed");
     return 1;
+  }
+
+  g_trace_filename = settings.trace_filename;
+  g_state.set_tracing(!g_trace_filename.empty());
+
+#if defined(ENABLE_EMBEDDED)
+  auto client = EmbeddedClient(g_local_channel);
+  if (!client.load_config(settings.config_file_path.empty() ?
+        default_config_file_path : settings.config_file_path))
+    return 1;
+  client.start();
+#endif
 
-  return connection_loop();
+  const auto result = connection_loop();
+  write_event_trace();
+  return result;
 }
@@ -6,8 +6,10 @@
 #include <initguid.h>
 #include <Devpkey.h>
 #include <Cfgmgr32.h>
+#include <algorithm>
 #include <thread>
 #include <atomic>
+#include <iterator>
 #include <map>
 #include <optional>
 
@@ -23,6 +25,17 @@ namespace {
     return KeyEvent{ key, state };
   }
 
+  Key get_key(const RAWKEYBOARD& keyboard) {
+    if (!keyboard.MakeCode || keyboard.MakeCode > 0xFF)
+      return Key::none;
+    const auto key_code = keyboard.MakeCode |
+      (keyboard.Flags & RI_KEY_E0 ? 0xE000u : 0u);
+    // like the hook does
+    if (key_code == 0xE036)
+      return Key::ShiftRight;
+    return static_cast<Key>(key_code);
+  }
+
   InterceptionKeyStroke get_interception_stroke(const KeyEvent& event) {
     auto scan_code = static_cast<unsigned short>(*event.key);
     auto state = static_cast<unsigned short>(event.state == KeyState::Up ?
@@ -83,6 +96,10 @@ private:
   std::map<HANDLE, InterceptionDevice> m_device_by_handle;
   std::map<InterceptionDevice, HANDLE> m_handle_by_device;
   InterceptionDevice m_last_device{ };
+  // sent at once, while input message of a batch is handled
+  std::vector<KeyEvent> m_input_batch;
+  std::vector<InterceptionStroke> m_send_buffer;
+  std::atomic<bool> m_buffer_sends{ };
 
 public:
   Interception()
@@ -129,7 +146,10 @@ public:
     InterceptionStroke stroke;
     auto* keystroke = reinterpret_cast<InterceptionKeyStroke*>(&stroke);
     *keystroke = get_interception_stroke(event);
-    interception_send(m_context, m_last_device, &stroke, 1);
+    if (m_buffer_sends.load())
+      m_send_buffer.push_back(stroke);
+    else
+      interception_send(m_context, m_last_device, &stroke, 1);
   }
 
 private:
@@ -160,21 +180,40 @@ private:
   }
 
   void thread_func(HWND window, UINT input_message) {
-    InterceptionStroke stroke;
+    // read all strokes available at once
+    InterceptionStroke strokes[32];
     while (!m_shutdown.load()) {
       const auto timeout_ms = 100;
       const auto device = interception_wait_with_timeout(m_context, timeout_ms);
-      if (interception_receive(m_context, device, &stroke, 1) > 0) {
-        const auto* keystroke = reinterpret_cast<InterceptionKeyStroke*>(&stroke);
-        const auto event = get_key_event(*keystroke);
-        if (auto device_handle = get_device_handle(device)) {
-          m_last_device = device;
-
-          if (::SendMessageA(window, input_message, MAKEWPARAM(event.key, event.state), 
-              reinterpret_cast<LPARAM>(device_handle)) == 1)
-            continue;
-        }
-        interception_send(m_context, device, &stroke, 1);
+      const auto count = interception_receive(m_context, device, 
+        strokes, static_cast<unsigned int>(std::size(strokes)));
+      if (count <= 0)
+        continue;
+
+      const auto device_handle = get_device_handle(device);
+      if (!device_handle) {
+        interception_send(m_context, device, 
+          strokes, static_cast<unsigned int>(count));
+        continue;
+      }
+
+      m_input_batch.clear();
+      for (auto i = 0; i < count; ++i)
+        m_input_batch.push_back(get_key_event(
+          *reinterpret_cast<const InterceptionKeyStroke*>(&strokes[i])));
+
+      // translated and forwarded strokes are sent at once
+      m_last_device = device;
+      m_buffer_sends.store(true);
+      ::SendMessageA(window, input_message, 
+        reinterpret_cast<WPARAM>(&m_input_batch), 
+        reinterpret_cast<LPARAM>(device_handle));
+      m_buffer_sends.store(false);
+
+      if (!m_send_buffer.empty()) {
+        interception_send(m_context, device, m_send_buffer.data(),
+          static_cast<unsigned int>(m_send_buffer.size()));
+        m_send_buffer.clear();
       }
     }
   }
@@ -194,11 +233,14 @@ bool Devices::initialize(HWND window, UINT input_message) {
   auto interception = std::make_unique<Interception>();
   if (!interception->initialize(window, input_message, &m_error_message)) {
     verbose("%s", m_error_message.c_str());
-    return false;
+    interception.reset();
   }
 
+  // without Interception also the raw input is requested,
+  // to attribute the events of the hooks to the devices
   verbose("Requesting device messages");
-  const auto flags = DWORD{ RIDEV_DEVNOTIFY };
+  const auto flags = DWORD{ RIDEV_DEVNOTIFY | 
+    (interception ? 0u : static_cast<DWORD>(RIDEV_INPUTSINK)) };
   auto devices = std::vector<RAWINPUTDEVICE>{ };
   for (auto usage : { HID_USAGE_GENERIC_KEYBOARD })
     devices.push_back({ HID_USAGE_PAGE_GENERIC, usage, flags, window });
@@ -206,8 +248,9 @@ bool Devices::initialize(HWND window, UINT input_message) {
       static_cast<UINT>(devices.size()), sizeof(RAWINPUTDEVICE)) == FALSE)
     return false;
 
+  m_raw_input = !interception;
   m_interception = std::move(interception);
-  return true;
+  return initialized();
 }
 
 bool Devices::initialized() {
@@ -216,6 +259,8 @@ bool Devices::initialized() {
 
 void Devices::shutdown() {
   m_interception.reset();
+  m_raw_input = false;
+  m_recent_raw_inputs_end = 0;
   m_window = nullptr;
 }
 
@@ -272,36 +317,116 @@ void Devices::on_device_attached(HANDLE device) {
     ::CloseHandle(file);
   }
 
-  reset_device_filters();
-  m_device_handles.push_back(device);
-  m_device_descs.push_back({ 
+  auto desc = DeviceDesc{ 
     wide_to_utf8(device_name), 
     wide_to_utf8(instance_id)
-  });
-  verbose("Device '%s' attached", m_device_descs.back().name.c_str());
-  apply_device_filters();
+  };
+  verbose("Device '%s' attached", desc.name.c_str());
+
+  // only evaluate filters for the attached device
+  if (evaluate_grab_filters(m_grab_filters, desc.name, desc.id, true)) {
+    m_device_index_by_handle[device] = static_cast<int>(m_device_handles.size());
+    m_device_handles.push_back(device);
+    m_device_descs.push_back(std::move(desc));
+  }
+  else {
+    m_ignored_device_handles.push_back(device);
+    m_ignored_device_descs.push_back(std::move(desc));
+  }
 
   if (m_interception)
     m_interception->set_device_hardware_ids(device, std::move(hardware_ids));
 }
 
 void Devices::on_device_removed(HANDLE device) {
-  reset_device_filters();
   if (auto index = get_device_index(device); index >= 0) {
     verbose("Device '%s' detached", m_device_descs[index].name.c_str());
     m_device_handles.erase(m_device_handles.begin() + index);
     m_device_descs.erase(m_device_descs.begin() + index);
+    update_device_indices();
+  }
+  else if (auto it = std::find(m_ignored_device_handles.begin(),
+      m_ignored_device_handles.end(), device); 
+      it != m_ignored_device_handles.end()) {
+    const auto ignored = std::distance(m_ignored_device_handles.begin(), it);
+    m_ignored_device_handles.erase(it);
+    m_ignored_device_descs.erase(m_ignored_device_descs.begin() + ignored);
   }
-  apply_device_filters();
 }
 
 int Devices::get_device_index(HANDLE device) const {
-  if (!device)
+  const auto it = m_device_index_by_handle.find(device);
+  return (it != m_device_index_by_handle.end() ? it->second : -1);
+}
+
+void Devices::on_raw_input(HRAWINPUT handle) {
+  if (!m_raw_input)
+    return;
+  auto input = RAWINPUT{ };
+  auto size = UINT{ sizeof(input) };
+  if (::GetRawInputData(handle, RID_INPUT, &input, &size,
+        sizeof(RAWINPUTHEADER)) != static_cast<UINT>(-1))
+    add_raw_input(input);
+
+  // the input which arrived meanwhile is read at once
+  read_raw_input();
+}
+
+void Devices::read_raw_input() {
+  if (!m_raw_input)
+    return;
+  for (;;) {
+    auto size = UINT{ };
+    if (::GetRawInputBuffer(nullptr, &size, sizeof(RAWINPUTHEADER)) != 0 || !size)
+      return;
+    // the size is the one of a single input, room is made for a batch
+    size *= 16;
+    if (m_raw_input_buffer.size() < size)
+      m_raw_input_buffer.resize(size);
+    size = static_cast<UINT>(m_raw_input_buffer.size());
+    auto input = reinterpret_cast<RAWINPUT*>(m_raw_input_buffer.data());
+    auto count = ::GetRawInputBuffer(input, &size, sizeof(RAWINPUTHEADER));
+    if (count == 0 || count == static_cast<UINT>(-1))
+      return;
+    for (; count; --count) {
+      add_raw_input(*input);
+      input = NEXTRAWINPUTBLOCK(input);
+    }
+  }
+}
+
+void Devices::add_raw_input(const RAWINPUT& input) {
+  if (input.header.dwType != RIM_TYPEKEYBOARD)
+    return;
+  const auto key = get_key(input.data.keyboard);
+  if (key == Key::none)
+    return;
+  m_recent_raw_inputs[m_recent_raw_inputs_end++ % 
+    m_recent_raw_inputs.size()] = { input.header.hDevice, key };
+}
+
+int Devices::get_recent_device_index(Key key) const {
+  // prefer the device which recently sent the key, 
+  // otherwise the one which sent the last key
+  if (!is_keyboard_key(key))
     return -1;
-  const auto begin = m_device_handles.begin();
-  const auto end = m_device_handles.end();
-  const auto it = std::find(begin, end, device);
-  return (it != end ? static_cast<int>(std::distance(begin, it)) : -1);
+  const auto count = std::min(m_recent_raw_inputs_end, m_recent_raw_inputs.size());
+  for (auto i = size_t{ }; i < count; ++i) {
+    const auto& event = m_recent_raw_inputs[
+      (m_recent_raw_inputs_end - 1 - i) % m_recent_raw_inputs.size()];
+    if (event.key == key)
+      return get_device_index(event.device);
+  }
+  if (!count)
+    return -1;
+  return get_device_index(m_recent_raw_inputs[
+    (m_recent_raw_inputs_end - 1) % m_recent_raw_inputs.size()].device);
+}
+
+void Devices::update_device_indices() {
+  m_device_index_by_handle.clear();
+  for (auto i = 0u; i < m_device_handles.size(); ++i)
+    m_device_index_by_handle[m_device_handles[i]] = static_cast<int>(i);
 }
 
 void Devices::send_input(const KeyEvent& event) {
@@ -342,4 +467,5 @@ void Devices::apply_device_filters() {
       ++i;
     }
   }
+  update_device_indices();
 }
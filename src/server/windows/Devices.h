@@ -4,8 +4,10 @@
 #include "common/windows/win.h"
 #include "common/DeviceDesc.h"
 #include "common/Filter.h"
+#include <array>
 #include <vector>
 #include <memory>
+#include <unordered_map>
 
 class Devices {
 public:
@@ -14,12 +16,20 @@ public:
   Devices& operator=(const Devices&) = delete;
   ~Devices();
 
+  // input message is sent with a pointer to the events read at once
+  // from a device (const std::vector<KeyEvent>*) and the device handle,
+  // send_input should be called for each event which was not translated
   bool initialize(HWND window, UINT input_message);
   bool initialized();
   void shutdown();
   void on_device_attached(HANDLE device);
   void on_device_removed(HANDLE device);
   int get_device_index(HANDLE device) const;
+  // without Interception, events of the hooks are attributed to the
+  // device which recently sent raw input of the key
+  void on_raw_input(HRAWINPUT input);
+  void read_raw_input();
+  int get_recent_device_index(Key key) const;
   void set_grab_filters(std::vector<GrabDeviceFilter> filters);
   const std::string& error_message() const { return m_error_message; }
   const std::vector<DeviceDesc>& device_descs() const { return m_device_descs; }
@@ -28,13 +38,25 @@ public:
 private:
   void reset_device_filters();
   void apply_device_filters();
+  void update_device_indices();
+  void add_raw_input(const RAWINPUT& input);
+
+  struct RawKeyEvent {
+    HANDLE device;
+    Key key;
+  };
 
   HWND m_window{ };
   std::vector<GrabDeviceFilter> m_grab_filters;
   std::vector<HANDLE> m_device_handles;
   std::vector<DeviceDesc> m_device_descs;
+  std::unordered_map<HANDLE, int> m_device_index_by_handle;
   std::vector<HANDLE> m_ignored_device_handles;
   std::vector<DeviceDesc> m_ignored_device_descs;
   std::unique_ptr<class Interception> m_interception;
+  bool m_raw_input{ };
+  std::vector<BYTE> m_raw_input_buffer;
+  std::array<RawKeyEvent, 16> m_recent_raw_inputs{ };
+  size_t m_recent_raw_inputs_end{ };
   std::string m_error_message;
 };
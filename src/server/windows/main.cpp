@@ -1,18 +1,26 @@
 
 #include "server/Settings.h"
 #include "server/ServerState.h"
-#include "runtime/Timeout.h"
+#include "server/LockFreeQueue.h"
 #include "common/windows/LimitSingleInstance.h"
 #include "common/output.h"
+#include "runtime/Tracepoints.h"
 #include "Devices.h"
 #include <WinSock2.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <optional>
+
+#if !defined(CREATE_WAITABLE_TIMER_HIGH_RESOLUTION)
+#  define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
 
 namespace {
   class ServerStateImpl final : public ServerState {
     bool on_send_key(const KeyEvent& event) override;
-    void on_flush_scheduled(Duration delay) override;
-    void on_timeout_scheduled(Duration timeout) override;
-    void on_timeout_cancelled() override;
+    bool on_keys_sent() override;
+    void on_next_deadline_changed() override;
     void on_exit_requested() override;
     void on_grab_device_filters_message(
         std::vector<GrabDeviceFilter> filters) override;
@@ -23,19 +31,47 @@ namespace {
   // Calling SendInput directly from mouse hook proc seems to trigger a
   // timeout, therefore it is called after returning from the hook proc. 
   // But for keyboard input it is still more reliable to call it directly!
-  const auto TIMER_FLUSH_SEND_BUFFER = 1;
-  const auto TIMER_TIMEOUT = 2;
-  const auto WM_APP_CLIENT_MESSAGE = WM_APP + 0;
   const auto WM_APP_DEVICE_INPUT = WM_APP + 1;
+  const auto WM_APP_HOOK_INPUT = WM_APP + 2;
+  const auto WM_APP_HOOK_DEVICES = WM_APP + 3;
+  const auto WM_APP_UNHOOK_DEVICES = WM_APP + 4;
   const auto injected_ident = ULONG_PTR(0xADDED);
+  const auto ControlRightPrecedingAltGr = DWORD{ 0x21D };
+
+  // in realtime mode the hooks are run by a separate thread, which only
+  // decides whether input can be forwarded. Otherwise it is intercepted
+  // and translated by the main thread, which sends it when unchanged.
+  struct HookInput {
+    KeyEvent event;
+    bool forwarded;
+  };
 
   HINSTANCE g_instance;
   HWND g_window;
+  HANDLE g_deadline_timer;
+  // signaled by the sockets of the client connection, so its messages are
+  // not queued behind window messages
+  WSAEVENT g_client_event;
+  std::optional<Socket> g_listen_socket;
+  std::optional<Socket> g_client_socket;
   HHOOK g_keyboard_hook;
   HHOOK g_mouse_hook;
   std::vector<Key> g_buttons_down;
+  // input sent at once by on_keys_sent
+  std::vector<INPUT> g_send_inputs;
   Devices g_devices;
   ServerStateImpl g_state;
+  bool g_realtime;
+  HANDLE g_hook_thread;
+  DWORD g_hook_thread_id;
+  LockFreeQueue<HookInput, 256> g_hook_inputs;
+  // inputs pushed by hook thread, which were not completely handled yet
+  std::atomic<int> g_hook_inputs_pending;
+  // published by main thread
+  std::atomic<bool> g_hook_can_forward;
+  std::shared_ptr<const KeyBitmap> g_hook_referenced_keys;
+  // only accessed by hook thread
+  KeyBitmap g_hook_forwarded_keys;
 
   KeyEvent get_key_event(WPARAM wparam, const KBDLLHOOKSTRUCT& kbd) {
     // ignore unknown events
@@ -141,9 +177,28 @@ namespace {
     return button;
   }
 
-  UINT to_milliseconds(Duration duration) {
-    return static_cast<UINT>(std::chrono::duration_cast<
-          std::chrono::milliseconds>(duration).count());
+  HANDLE create_deadline_timer() {
+    // USER timers have a resolution of 10-16ms
+    if (auto timer = CreateWaitableTimerExW(nullptr, nullptr,
+          CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS))
+      return timer;
+    // not supported before Windows 10 1803
+    return CreateWaitableTimerW(nullptr, FALSE, nullptr);
+  }
+
+  void set_deadline_timer() {
+    if (const auto deadline = g_state.next_deadline()) {
+      const auto delay = std::max(Duration(*deadline - Clock::now()), Duration::zero());
+      // negative for relative time in 100ns intervals
+      auto due_time = LARGE_INTEGER{ };
+      due_time.QuadPart = -std::max(std::chrono::duration_cast<
+        std::chrono::duration<LONGLONG, std::ratio<1, 10'000'000>>>(delay).count(),
+        LONGLONG{ 1 });
+      ::SetWaitableTimer(g_deadline_timer, &due_time, 0, nullptr, nullptr, FALSE);
+    }
+    else {
+      ::CancelWaitableTimer(g_deadline_timer);
+    }
   }
 
   bool ServerStateImpl::on_send_key(const KeyEvent& event) {
@@ -157,23 +212,22 @@ namespace {
       auto input = make_button_input(event);
       if (!input.has_value())
         input = make_key_input(event);
-      ::SendInput(1, &input.value(), sizeof(INPUT));
+      g_send_inputs.push_back(input.value());
     }
     return true;
   }
 
-  void ServerStateImpl::on_flush_scheduled(Duration delay) {
-    ::SetTimer(g_window, TIMER_FLUSH_SEND_BUFFER,
-      to_milliseconds(delay), nullptr);
-  }
-
-  void ServerStateImpl::on_timeout_scheduled(Duration timeout) {
-    ::SetTimer(g_window, TIMER_TIMEOUT, 
-      to_milliseconds(timeout),  nullptr);
+  bool ServerStateImpl::on_keys_sent() {
+    if (!g_send_inputs.empty()) {
+      ::SendInput(static_cast<UINT>(g_send_inputs.size()), 
+        g_send_inputs.data(), sizeof(INPUT));
+      g_send_inputs.clear();
+    }
+    return true;
   }
 
-  void ServerStateImpl::on_timeout_cancelled() {
-    ::KillTimer(g_window, TIMER_TIMEOUT);
+  void ServerStateImpl::on_next_deadline_changed() {
+    set_deadline_timer();
   }
 
   void ServerStateImpl::on_exit_requested() {
@@ -204,14 +258,16 @@ namespace {
       verbose("sc: 0x%X, vk: 0x%X", kbd.scanCode, kbd.vkCode);
 
       // ControlRight preceding AltGr, intercept when it was not sent
-      const auto ControlRightPrecedingAltGr = 0x21D;
       if (kbd.scanCode == ControlRightPrecedingAltGr)
         return !g_state.sending_key();
 
       return false;
     }
 
-    return g_state.translate_input(input, Stage::no_device_index);
+    // raw input, which arrived meanwhile, is read at once
+    g_devices.read_raw_input();
+    return g_state.translate_input(input, 
+      g_devices.get_recent_device_index(input.key));
   }
 
   LRESULT CALLBACK keyboard_hook_proc(int code, WPARAM wparam, LPARAM lparam) {
@@ -281,6 +337,71 @@ namespace {
     return CallNextHookEx(g_mouse_hook, code, wparam, lparam);
   }
 
+  bool can_forward_from_hook(const KeyEvent& event) {
+    // keep order of pending input, some keys are always translated
+    if (g_hook_inputs_pending.load(std::memory_order_acquire) ||
+        !g_hook_can_forward.load(std::memory_order_acquire) ||
+        event.key == Key::AltRight ||
+        event.key == Key::NumLock ||
+        event.key == Key::Pause)
+      return false;
+    const auto keys = std::atomic_load(&g_hook_referenced_keys);
+    return (keys && !keys->test(event.key));
+  }
+
+  // returns true when input can be forwarded by the hook
+  bool push_hook_input(const KeyEvent& event) {
+    auto forwarded = false;
+    if (event.state == KeyState::Down) {
+      // key repeat is translated
+      forwarded = (!g_hook_forwarded_keys.test(event.key) &&
+        can_forward_from_hook(event));
+      if (forwarded)
+        g_hook_forwarded_keys.set(event.key);
+    }
+    else {
+      forwarded = (g_hook_forwarded_keys.test(event.key) &&
+        can_forward_from_hook(event));
+      g_hook_forwarded_keys.reset(event.key);
+    }
+
+    g_hook_inputs.push({ event, forwarded });
+    if (g_hook_inputs_pending.fetch_add(1, std::memory_order_acq_rel) == 0)
+      ::PostMessageW(g_window, WM_APP_HOOK_INPUT, 0, 0);
+    return forwarded;
+  }
+
+  LRESULT CALLBACK realtime_keyboard_hook_proc(int code, WPARAM wparam, LPARAM lparam) {
+    if (code == HC_ACTION) {
+      const auto& kbd = *reinterpret_cast<const KBDLLHOOKSTRUCT*>(lparam);
+      // ignore injected and remote desktop input
+      if (kbd.dwExtraInfo != injected_ident && kbd.dwExtraInfo != 0x4321DCBA) {
+        const auto input = get_key_event(wparam, kbd);
+        if (input.key == Key::none) {
+          // the one preceding sent AltGr is flagged as injected
+          if (kbd.scanCode == ControlRightPrecedingAltGr &&
+              !(kbd.flags & LLKHF_INJECTED))
+            return -1;
+        }
+        else if (!push_hook_input(input)) {
+          return -1;
+        }
+      }
+    }
+    return CallNextHookEx(g_keyboard_hook, code, wparam, lparam);
+  }
+
+  LRESULT CALLBACK realtime_mouse_hook_proc(int code, WPARAM wparam, LPARAM lparam) {
+    if (code == HC_ACTION) {
+      const auto& ms = *reinterpret_cast<const MSLLHOOKSTRUCT*>(lparam);
+      if (ms.dwExtraInfo != injected_ident)
+        if (const auto input = get_button_event(wparam, ms))
+          if (!push_hook_input(*input))
+            return -1;
+    }
+    return CallNextHookEx(g_mouse_hook, code, wparam, lparam);
+  }
+
   void unhook_devices() {
     if (auto hook = std::exchange(g_keyboard_hook, nullptr))
       UnhookWindowsHookEx(hook);
@@ -292,8 +413,9 @@ namespace {
     unhook_devices();
     
     if (!g_devices.initialized()) {
-      g_keyboard_hook = SetWindowsHookExW(
-        WH_KEYBOARD_LL, &keyboard_hook_proc, g_instance, 0);
+      g_keyboard_hook = SetWindowsHookExW(WH_KEYBOARD_LL,
+        (g_realtime ? &realtime_keyboard_hook_proc : &keyboard_hook_proc),
+        g_instance, 0);
       if (!g_keyboard_hook)
         error("Hooking keyboard failed");
     }
@@ -303,8 +425,9 @@ namespace {
     if (!IsDebuggerPresent())
 #endif
     {
-      g_mouse_hook = SetWindowsHookExW(
-        WH_MOUSE_LL, &mouse_hook_proc, g_instance, 0);
+      g_mouse_hook = SetWindowsHookExW(WH_MOUSE_LL,
+        (g_realtime ? &realtime_mouse_hook_proc : &mouse_hook_proc),
+        g_instance, 0);
       if (!g_mouse_hook)
         error("Hooking mouse failed");
     }
@@ -329,52 +452,157 @@ namespace {
   }
 
   bool listen_for_client() {
-    auto socket = g_state.listen_for_client_connections();
-    return (socket && 
-      WSAAsyncSelect(*socket, g_window,
-        WM_APP_CLIENT_MESSAGE, FD_ACCEPT) == 0);
+    g_listen_socket = g_state.listen_for_client_connections();
+    return (g_listen_socket &&
+      WSAEventSelect(*g_listen_socket, g_client_event, FD_ACCEPT) == 0);
   }
 
   bool accept_client() {
-    auto socket = g_state.accept_client_connection();
-    return (socket && 
-      WSAAsyncSelect(*socket, g_window,
-        WM_APP_CLIENT_MESSAGE, (FD_READ | FD_CLOSE)) == 0);
+    g_client_socket = g_state.accept_client_connection();
+    return (g_client_socket &&
+      WSAEventSelect(*g_client_socket, g_client_event,
+        (FD_READ | FD_CLOSE)) == 0);
+  }
+
+  DWORD WINAPI hook_thread_proc(LPVOID ready_event) {
+    // create message queue before signaling that thread is ready
+    auto message = MSG{ };
+    PeekMessageW(&message, nullptr, WM_USER, WM_USER, PM_NOREMOVE);
+    SetEvent(static_cast<HANDLE>(ready_event));
+
+    while (GetMessageW(&message, nullptr, 0, 0) > 0) {
+      if (message.message == WM_APP_HOOK_DEVICES)
+        hook_devices();
+      else if (message.message == WM_APP_UNHOOK_DEVICES)
+        unhook_devices();
+    }
+    unhook_devices();
+    return 0;
+  }
+
+  bool start_hook_thread() {
+    const auto ready_event = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    g_hook_thread = CreateThread(nullptr, 0, 
+      &hook_thread_proc, ready_event, 0, &g_hook_thread_id);
+    if (g_hook_thread) {
+      SetThreadPriority(g_hook_thread, THREAD_PRIORITY_TIME_CRITICAL);
+      WaitForSingleObject(ready_event, INFINITE);
+    }
+    CloseHandle(ready_event);
+    return (g_hook_thread != nullptr);
+  }
+
+  void stop_hook_thread() {
+    if (!g_hook_thread)
+      return;
+    PostThreadMessageW(g_hook_thread_id, WM_QUIT, 0, 0);
+    WaitForSingleObject(g_hook_thread, INFINITE);
+    CloseHandle(std::exchange(g_hook_thread, nullptr));
+  }
+
+  void publish_hook_state() {
+    g_hook_can_forward.store(g_state.can_forward_unreferenced(),
+      std::memory_order_release);
+  }
+
+  void publish_referenced_keys() {
+    auto keys = std::make_shared<KeyBitmap>();
+    if (!g_state.get_referenced_keys(*keys))
+      keys.reset();
+    std::atomic_store(&g_hook_referenced_keys,
+      std::shared_ptr<const KeyBitmap>(std::move(keys)));
+  }
+
+  void send_unchanged_input(KeyEvent event) {
+    // mouse wheel is sent on Down
+    if (is_mouse_wheel(event.key))
+      event.state = KeyState::Down;
+    auto input = make_button_input(event);
+    if (!input.has_value())
+      input = make_key_input(event);
+    ::SendInput(1, &input.value(), sizeof(INPUT));
+  }
+
+  void handle_hook_inputs() {
+    g_devices.read_raw_input();
+    auto input = HookInput{ };
+    while (g_hook_inputs.pop(input)) {
+      const auto device_index = g_devices.get_recent_device_index(input.event.key);
+      if (input.forwarded) {
+        g_state.update_forwarded_input(input.event, device_index);
+      }
+      else if (!g_state.translate_input(input.event, device_index)) {
+        // it was intercepted by the hook
+        send_unchanged_input(input.event);
+      }
+      if (!g_state.flush_scheduled_at())
+        g_state.flush_send_buffer();
+
+      publish_hook_state();
+      g_hook_inputs_pending.fetch_sub(1, std::memory_order_acq_rel);
+    }
   }
 
   void apply_updates() {
     // reinsert hook in front of callchain
-    hook_devices();
+    if (g_realtime) {
+      publish_referenced_keys();
+      PostThreadMessageW(g_hook_thread_id, WM_APP_HOOK_DEVICES, 0, 0);
+    }
+    else {
+      hook_devices();
+    }
+  }
+
+  void release_hooks() {
+    if (g_realtime) {
+      publish_referenced_keys();
+      PostThreadMessageW(g_hook_thread_id, WM_APP_UNHOOK_DEVICES, 0, 0);
+    }
+    else {
+      unhook_devices();
+    }
+  }
+
+  void handle_client_events() {
+    auto events = WSANETWORKEVENTS{ };
+    if (g_listen_socket &&
+        WSAEnumNetworkEvents(*g_listen_socket, g_client_event, &events) == 0 &&
+        (events.lNetworkEvents & FD_ACCEPT))
+      accept_client();
+
+    if (!g_client_socket ||
+        WSAEnumNetworkEvents(*g_client_socket, g_client_event, &events) != 0)
+      return;
+
+    if (events.lNetworkEvents & FD_READ) {
+      if (g_state.read_client_messages(Duration::zero())) {
+        apply_updates();
+      }
+      else {
+        g_state.disconnect();
+        g_client_socket.reset();
+        return;
+      }
+    }
+    if (events.lNetworkEvents & FD_CLOSE) {
+      verbose("Connection to keymapper lost");
+      verbose("---------------");
+      g_state.reset_configuration();
+      release_hooks();
+      g_client_socket.reset();
+    }
   }
 
   LRESULT CALLBACK window_proc(HWND window, UINT message,
       WPARAM wparam, LPARAM lparam) {
     switch(message) {
       case WM_DESTROY:
+        stop_hook_thread();
         g_devices.shutdown();
         ::PostQuitMessage(0);
         return 0;
 
-      case WM_APP_CLIENT_MESSAGE:
-        if (lparam == FD_ACCEPT) {
-          accept_client();
-        }
-        else if (lparam == FD_READ) {
-          if (g_state.read_client_messages(Duration::zero())) {
-            apply_updates();
-          }
-          else {
-            g_state.disconnect();
-          }
-        }
-        else {
-          verbose("Connection to keymapper lost");
-          verbose("---------------");
-          g_state.reset_configuration();
-          unhook_devices();
-        }
-        return 0;
-
       case WM_INPUT_DEVICE_CHANGE: {
         const auto device = reinterpret_cast<HANDLE>(lparam);
         if (wparam == GIDC_ARRIVAL)
@@ -385,36 +613,31 @@ namespace {
         break;
       }
 
+      case WM_INPUT:
+        g_devices.on_raw_input(reinterpret_cast<HRAWINPUT>(lparam));
+        break;
+
       case WM_APP_DEVICE_INPUT: {
-        const auto event = KeyEvent{ 
-          static_cast<Key>(LOWORD(wparam)), 
-          static_cast<KeyState>(HIWORD(wparam)) 
-        };
+        const auto& events = *reinterpret_cast<const std::vector<KeyEvent>*>(wparam);
         const auto device = reinterpret_cast<HANDLE>(lparam);
         const auto device_index = g_devices.get_device_index(device);
-        if (device_index >= 0 &&
-            g_state.translate_input(event, device_index)) {
-          if (!g_state.flush_scheduled_at())
-            g_state.flush_send_buffer();
-          return 1;
+        for (const auto& event : events) {
+          if (device_index >= 0 &&
+              g_state.translate_input(event, device_index)) {
+            if (!g_state.flush_scheduled_at())
+              g_state.flush_send_buffer();
+          }
+          else {
+            g_devices.send_input(event);
+          }
         }
         return 0;
       }
 
-      case WM_TIMER: {
-        if (wparam == TIMER_FLUSH_SEND_BUFFER) {
-          KillTimer(g_window, TIMER_FLUSH_SEND_BUFFER);
-          g_state.flush_send_buffer();
-        }
-        else if (wparam == TIMER_TIMEOUT) {
-          const auto timeout = make_input_timeout_event(g_state.timeout());
-          g_state.cancel_timeout();
-          g_state.translate_input(timeout, Stage::any_device_index);
-          if (!g_state.flush_scheduled_at())
-            g_state.flush_send_buffer();
-        }
-        break;
-      }
+      case WM_APP_HOOK_INPUT:
+        handle_hook_inputs();
+        return 0;
+
     }
     return DefWindowProcW(window, message, wparam, lparam);
   }
@@ -440,11 +663,19 @@ int WINAPI wWinMain(HINSTANCE instance, HINSTANCE, LPWSTR, int) {
     return 1;
   }
 
+  register_tracepoints();
   g_state.reset_configuration();
+  if (!settings.record_filename.empty() &&
+      !g_state.record_input_trace(settings.record_filename)) {
+    error("Opening input trace file failed");
+    return 1;
+  }
+  g_state.set_tracing(!settings.trace_filename.empty());
 
   SetPriorityClass(GetCurrentProcess(), HIGH_PRIORITY_CLASS);
   g_instance = instance;
   g_verbose_output = settings.verbose;
+  g_realtime = settings.realtime;
 
   const auto window_class_name = L"keymapperd";
   auto window_class = WNDCLASSEXW{ };
@@ -465,14 +696,58 @@ int WINAPI wWinMain(HINSTANCE instance, HINSTANCE, LPWSTR, int) {
   SetUserObjectInformationA(GetCurrentProcess(),
     UOI_TIMERPROC_EXCEPTION_SUPPRESSION, &disable, sizeof(disable));
 
-  if (!listen_for_client())
+  g_deadline_timer = create_deadline_timer();
+  g_client_event = WSACreateEvent();
+  if (!g_deadline_timer || g_client_event == WSA_INVALID_EVENT ||
+      !listen_for_client())
     return 1;
 
+  if (g_realtime) {
+    publish_referenced_keys();
+    if (!start_hook_thread())
+      return 1;
+  }
+
+  // wait for messages, deadline timer and client connection at once
+  const HANDLE handles[] = { g_deadline_timer, g_client_event };
   auto message = MSG{ };
-  while (GetMessageW(&message, nullptr, 0, 0) > 0) {
-    TranslateMessage(&message);
-    DispatchMessageW(&message);
+  for (auto quit = false; !quit; ) {
+    const auto result = MsgWaitForMultipleObjectsEx(2, handles,
+      INFINITE, QS_ALLINPUT, MWMO_INPUTAVAILABLE);
+    if (result == WAIT_OBJECT_0) {
+      g_state.process_deadlines(Clock::now());
+      set_deadline_timer();
+    }
+    else if (result == WAIT_OBJECT_0 + 1) {
+      handle_client_events();
+    }
+    else if (result == WAIT_FAILED) {
+      break;
+    }
+
+    while (PeekMessageW(&message, nullptr, 0, 0, PM_REMOVE)) {
+      if (message.message == WM_QUIT) {
+        quit = true;
+        break;
+      }
+      TranslateMessage(&message);
+      DispatchMessageW(&message);
+
+      // client messages do not wait until all input was handled
+      if (WaitForSingleObject(g_client_event, 0) == WAIT_OBJECT_0)
+        handle_client_events();
+    }
+
+    // state might have changed by client messages or deadlines
+    if (g_realtime)
+      publish_hook_state();
   }
+  CloseHandle(g_deadline_timer);
+  WSACloseEvent(g_client_event);
+  if (!settings.trace_filename.empty() &&
+      !g_state.write_event_trace(settings.trace_filename))
+    error("Writing event trace failed");
+  unregister_tracepoints();
   verbose("Exiting");
   return 0;
 }
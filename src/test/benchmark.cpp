@@ -0,0 +1,690 @@
+
+// Measures the throughput and latency of the runtime engine and of
+// matching the contexts, when the focused window changes.
+// Usage: keymapper_bench [scenario-filter] [--events <count>]
+//          [--focus-log <file> --config <file>]
+//          [--budget <file>] [--report <file>]
+// A focus log can be recorded with keymapper --record-focus <file>.
+// With a budget file (src/test/benchmark_budget.txt) the run fails, when a
+// measurement exceeds its maximum. The report is written as JSON.
+
+#include "client/FocusLog.h"
+#include "config/ContextMatcher.h"
+#include "config/ParseConfig.h"
+#include "config/ParseKeySequence.h"
+#include "runtime/MatchKeySequence.h"
+#include "runtime/MultiStage.h"
+#include "runtime/Timeout.h"
+#include "server/AllocationTracker.h"
+#include "common/Duration.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#if !defined(_WIN32)
+# include <sys/resource.h>
+#endif
+
+void message(const char* format, ...) { }
+void error(const char* format, ...) { }
+void verbose(const char* format, ...) { }
+
+namespace {
+  using Nanoseconds = std::chrono::duration<double, std::nano>;
+
+  // keeps the matching from being optimized away
+  volatile int g_matches;
+
+  const char* const keys[] = {
+    "A", "B", "C", "D", "E", "F", "G", "H", "I", "J", "K", "L", "M",
+    "N", "O", "P", "Q", "R", "S", "T", "U", "V", "W", "X", "Y", "Z",
+    "0", "1", "2", "3", "4", "5", "6", "7", "8", "9",
+  };
+  const auto key_count = sizeof(keys) / sizeof(keys[0]);
+
+  const char* const modifiers[] = {
+    "ShiftLeft", "ControlLeft", "AltLeft", "MetaLeft",
+  };
+  const auto modifier_count = sizeof(modifiers) / sizeof(modifiers[0]);
+
+  struct Scenario {
+    const char* name;
+    std::string config;
+  };
+
+  // the maximum of a metric, process wide ones have the scenario "*"
+  struct Budget {
+    std::string metric;
+    std::string scenario;
+    double maximum;
+  };
+
+  struct Measurement {
+    std::string metric;
+    std::string scenario;
+    double value;
+  };
+
+  struct UpdateResult {
+    double ns_per_event;
+    double allocations_per_event;
+  };
+
+  std::string generate_mappings(int count) {
+    auto string = std::string();
+    for (auto i = 0; i < count; ++i) {
+      const auto n = static_cast<size_t>(i);
+      string += std::string(modifiers[n % modifier_count]) + "{" +
+        keys[(n / modifier_count) % key_count] + "} " +
+        keys[(n / modifier_count / key_count) % key_count];
+      if (n >= modifier_count * key_count * key_count)
+        string += std::string(" ") +
+          keys[(n / modifier_count / key_count / key_count) % key_count];
+      string += " >> " + std::string(keys[n % key_count]) + "\n";
+    }
+    return string;
+  }
+
+  std::vector<Scenario> get_scenarios() {
+    auto scenarios = std::vector<Scenario>();
+    scenarios.push_back({ "small", R"(
+      CapsLock >> Backspace
+      ShiftLeft{A} >> B
+      ControlLeft{C} >> ControlLeft{Insert}
+      AltLeft{J} >> ArrowLeft
+      AltLeft{L} >> ArrowRight
+      Q W >> Escape
+    )" });
+
+    scenarios.push_back({ "1k mappings", generate_mappings(1000) });
+    scenarios.push_back({ "10k mappings", generate_mappings(10000) });
+
+    auto stages = std::string();
+    for (auto i = 0u; i < 16; ++i) {
+      stages += "[stage]\n";
+      stages += std::string(keys[i]) + " >> " + keys[i + 1] + "\n";
+      stages += std::string(modifiers[i % modifier_count]) + "{" +
+        keys[i + 10] + "} >> " + keys[i + 2] + "\n";
+    }
+    scenarios.push_back({ "many stages", stages });
+
+    scenarios.push_back({ "any and timeouts", R"(
+      A{!200ms} >> X
+      A{200ms} >> Y
+      S !250ms D >> Z
+      ShiftLeft{Any} >> ShiftLeft{Any}
+      ? F Any >> G
+      E{Any} >> Any
+      ControlLeft{200ms} >> Escape
+      Any >> Any
+    )" });
+    return scenarios;
+  }
+
+  Config parse_config(const std::string& string) {
+    static auto parse = ParseConfig();
+    auto stream = std::stringstream(string);
+    return parse(stream);
+  }
+
+  std::vector<Stage::Context> get_contexts(Config& config,
+      std::vector<std::vector<Stage::Context>>* stages) {
+    auto contexts = std::vector<Stage::Context>();
+    auto stage_contexts = std::vector<Stage::Context>();
+    for (auto& config_context : config.contexts) {
+      if (!stage_contexts.empty() && config_context.begin_stage)
+        stages->push_back(std::exchange(stage_contexts, { }));
+
+      auto& context = stage_contexts.emplace_back();
+      for (auto& input : config_context.inputs)
+        context.inputs.push_back({ input.input, input.output_index });
+      context.outputs = config_context.outputs;
+      for (auto& output : config_context.command_outputs)
+        context.command_outputs.push_back({ output.output, output.index });
+      context.modifier_filter = config_context.modifier_filter;
+      context.fallthrough = config_context.fallthrough;
+      contexts.push_back(context);
+    }
+    if (!stage_contexts.empty())
+      stages->push_back(std::move(stage_contexts));
+    return contexts;
+  }
+
+  std::vector<int> all_contexts(size_t count) {
+    auto indices = std::vector<int>();
+    for (auto i = 0; i < static_cast<int>(count); ++i)
+      indices.push_back(i);
+    return indices;
+  }
+
+  // typing with occasionally held modifiers
+  KeySequence generate_input(size_t count) {
+    auto random = std::mt19937(1);
+    auto sequence = KeySequence();
+    auto modifier_down = std::optional<Key>();
+    while (sequence.size() < count) {
+      if (random() % 8 == 0) {
+        const auto modifier = get_key_by_name(
+          modifiers[random() % modifier_count]);
+        if (modifier_down)
+          sequence.emplace_back(*modifier_down, KeyState::Up);
+        modifier_down = (modifier_down == modifier ?
+          std::nullopt : std::make_optional(modifier));
+        if (modifier_down)
+          sequence.emplace_back(*modifier_down, KeyState::Down);
+      }
+      const auto key = get_key_by_name(keys[random() % key_count]);
+      sequence.emplace_back(key, KeyState::Down);
+      sequence.emplace_back(key, KeyState::Up);
+    }
+    if (modifier_down)
+      sequence.emplace_back(*modifier_down, KeyState::Up);
+    return sequence;
+  }
+
+  void print_header() {
+    std::printf("%-18s %-18s %12s %8s %8s %8s %8s %10s\n",
+      "scenario", "benchmark", "events/s", "p50 ns", "p90 ns",
+      "p99 ns", "p99.9 ns", "max ns");
+  }
+
+  void print_result(const char* scenario, const char* benchmark,
+      size_t count, std::vector<double>& latencies, Nanoseconds total) {
+    if (latencies.empty())
+      return;
+    std::sort(latencies.begin(), latencies.end());
+    const auto percentile = [&](double p) {
+      const auto index = static_cast<size_t>(p * (latencies.size() - 1));
+      return latencies[index];
+    };
+    std::printf("%-18s %-18s %12.0f %8.0f %8.0f %8.0f %8.0f %10.0f\n",
+      scenario, benchmark,
+      static_cast<double>(count) /
+        std::chrono::duration<double>(total).count(),
+      percentile(0.5), percentile(0.9), percentile(0.99),
+      percentile(0.999), latencies.back());
+  }
+
+  // calls update for each event and replies requested input timeouts
+  template<typename F> // void(KeyEvent, KeySequence&)
+  UpdateResult measure(const char* scenario, const char* benchmark,
+      const KeySequence& input, F&& update) {
+    auto latencies = std::vector<double>();
+    latencies.reserve(input.size() * 2);
+    auto output = KeySequence();
+    auto allocations = uint64_t{ };
+    const auto begin = Clock::now();
+    for (const auto& event : input) {
+      auto next = event;
+      for (;;) {
+        output.clear();
+        const auto allocations_before = get_thread_allocations().allocations;
+        const auto start = Clock::now();
+        update(next, output);
+        latencies.push_back(Nanoseconds(Clock::now() - start).count());
+        allocations += get_thread_allocations().allocations - allocations_before;
+
+        if (output.empty() || output.back().key != Key::timeout)
+          break;
+        next = make_input_timeout_event(
+          timeout_to_milliseconds(output.back().value));
+      }
+    }
+    const auto total = Nanoseconds(Clock::now() - begin);
+    const auto count = static_cast<double>(std::max(latencies.size(), size_t{ 1 }));
+    print_result(scenario, benchmark, latencies.size(), latencies, total);
+    return { total.count() / count, static_cast<double>(allocations) / count };
+  }
+
+  // peak resident memory in KiB, 0 when unknown
+  double get_peak_resident_memory() {
+#if !defined(_WIN32)
+    auto usage = rusage{ };
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+      return static_cast<double>(usage.ru_maxrss);
+#endif
+    return 0;
+  }
+
+  // each line is "<metric> <scenario> <maximum>", the scenario can
+  // contain spaces, empty lines and lines starting with # are skipped
+  bool read_budgets(const std::string& filename, std::vector<Budget>& budgets) {
+    auto file = std::ifstream(filename);
+    if (!file.good())
+      return false;
+    auto line = std::string();
+    while (std::getline(file, line)) {
+      const auto begin = line.find_first_not_of(" \t");
+      if (begin == std::string::npos || line[begin] == '#')
+        continue;
+      const auto end = line.find_last_not_of(" \t\r") + 1;
+      const auto metric_end = line.find_first_of(" \t", begin);
+      const auto maximum_begin = line.find_last_of(" \t", end - 1);
+      if (metric_end == std::string::npos || maximum_begin <= metric_end)
+        return false;
+      const auto scenario_begin = line.find_first_not_of(" \t", metric_end);
+      const auto scenario_end = line.find_last_not_of(" \t", maximum_begin) + 1;
+      try {
+        budgets.push_back({ line.substr(begin, metric_end - begin),
+          line.substr(scenario_begin, scenario_end - scenario_begin),
+          std::stod(line.substr(maximum_begin + 1, end - maximum_begin - 1)) });
+      }
+      catch (const std::exception&) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  const Budget* find_budget(const std::vector<Budget>& budgets,
+      const Measurement& measurement) {
+    for (const auto& budget : budgets)
+      if (budget.metric == measurement.metric &&
+          budget.scenario == measurement.scenario)
+        return &budget;
+    return nullptr;
+  }
+
+  // budgets of scenarios which were not run are not checked,
+  // returns false when a measurement exceeds its budget
+  bool check_budgets(const std::vector<Budget>& budgets,
+      const std::vector<Measurement>& measurements, const std::string& filename) {
+    auto report = std::string("{\n  \"results\": [");
+    auto passed = true;
+    auto separator = "\n";
+    char buffer[512];
+    for (const auto& measurement : measurements) {
+      const auto budget = find_budget(budgets, measurement);
+      const auto exceeded = (budget && measurement.value > budget->maximum);
+      if (exceeded) {
+        passed = false;
+        std::printf("budget exceeded: %s %s %.2f > %.2f\n",
+          measurement.metric.c_str(), measurement.scenario.c_str(),
+          measurement.value, budget->maximum);
+      }
+      char maximum[32] = "null";
+      if (budget)
+        std::snprintf(maximum, sizeof(maximum), "%.2f", budget->maximum);
+      std::snprintf(buffer, sizeof(buffer),
+        "%s    { \"metric\": \"%s\", \"scenario\": \"%s\", "
+        "\"value\": %.2f, \"maximum\": %s, \"passed\": %s }",
+        separator, measurement.metric.c_str(), measurement.scenario.c_str(),
+        measurement.value, maximum, (exceeded ? "false" : "true"));
+      report += buffer;
+      separator = ",\n";
+    }
+    report += std::string("\n  ],\n  \"passed\": ") +
+      (passed ? "true" : "false") + "\n}\n";
+
+    if (!filename.empty()) {
+      auto file = std::ofstream(filename);
+      file << report;
+      if (!file.good()) {
+        std::fprintf(stderr, "writing report failed\n");
+        return false;
+      }
+    }
+    if (!budgets.empty())
+      std::printf("budgets %s\n", (passed ? "passed" : "exceeded"));
+    return passed;
+  }
+
+  // a session switching between a browser, an editor and a terminal,
+  // whose titles change while loading pages, editing and running commands
+  std::vector<FocusLogRecord> generate_focus_log(size_t count) {
+    struct Window {
+      const char* window_class;
+      const char* window_path;
+      const char* const* titles;
+      size_t title_count;
+    };
+    const char* const browser_titles[] = {
+      "Inbox (%d) - user@example.com - Mail - Mozilla Firefox",
+      "How to configure keymapper - YouTube - Mozilla Firefox",
+      "Ticket-%d: Fix the build - Tracker - Mozilla Firefox",
+      "Loading... (%d%%) - Mozilla Firefox",
+    };
+    const char* const editor_titles[] = {
+      "Stage%d.cpp - keymapper - Visual Studio Code",
+      "* ParseConfig.h - keymapper - Visual Studio Code",
+      "README.md - project%d - Visual Studio Code",
+    };
+    const char* const terminal_titles[] = {
+      "user@host: ~/projects/keymapper",
+      "vim ClientState.cpp [%d/12]",
+      "make -j%d",
+      "htop",
+    };
+    const Window windows[] = {
+      { "firefox", "/usr/lib/firefox/firefox", browser_titles, 4 },
+      { "Code", "/usr/share/code/code", editor_titles, 3 },
+      { "Alacritty", "/usr/bin/alacritty", terminal_titles, 4 },
+    };
+
+    auto random = std::mt19937(1);
+    auto log = std::vector<FocusLogRecord>();
+    auto time = uint64_t{ };
+    auto window = &windows[0];
+    char title[128];
+    while (log.size() < count) {
+      // mostly title changes, in bursts while something is loading
+      if (random() % 4 == 0)
+        window = &windows[random() % 3];
+      time += (random() % 3 == 0 ? 10 : 100 + random() % 5000);
+      std::snprintf(title, sizeof(title),
+        window->titles[random() % window->title_count],
+        static_cast<int>(random() % 20));
+      log.push_back({ time, window->window_class, title,
+        window->window_path });
+    }
+    return log;
+  }
+
+  // contexts with class, title and path filters, mixing exact strings,
+  // substrings and regular expressions
+  std::string generate_context_config(int count) {
+    auto string = std::string(R"(
+      [class = "firefox", title = /YouTube/i]
+      A >> B
+      [class = "Code", title = ".cpp"]
+      A >> B
+      [title = /^user@host: ~\/projects/]
+      A >> B
+      [path = "/usr/bin/alacritty"]
+      A >> B
+      [class = /^(Slack|discord)$/]
+      A >> B
+      [title = /vim|emacs|nano/i]
+      A >> B
+    )");
+    for (auto i = 0; i < count; ++i) {
+      const auto n = std::to_string(i);
+      string += (i % 3 == 0 ? "[title = \"project" + n + "\"]\n" :
+                 i % 3 == 1 ? "[title = /Ticket-" + n + ":/]\n" :
+                 "[class = \"app" + n + "\"]\n");
+      string += "A >> B\n";
+    }
+    return string;
+  }
+
+  // replays the focus changes like ClientState::update_active_contexts,
+  // title changes are skipped when no title filter's result changes and
+  // are rate limited otherwise
+  template<typename M, typename D> // void(const FocusLogRecord&, std::vector<int>&)
+                                   // bool(const std::string&, const std::string&)
+  void measure_contexts(const char* scenario, const char* benchmark,
+      const std::vector<FocusLogRecord>& log, int title_update_interval_ms,
+      M&& match, D&& title_filters_differ) {
+    const auto rounds = std::max(size_t{ 1 }, size_t{ 100000 } / log.size());
+    auto latencies = std::vector<double>();
+    latencies.reserve(rounds * log.size());
+    auto active_contexts = std::vector<int>();
+    auto new_active_contexts = std::vector<int>();
+    auto matched = std::optional<FocusLogRecord>();
+    auto pending = std::optional<FocusLogRecord>();
+    auto title_update_time = uint64_t{ };
+    auto updates = size_t{ };
+    auto messages = size_t{ };
+
+    const auto apply = [&](const FocusLogRecord& record, bool rate_limit) {
+      if (matched && record.window_class == matched->window_class &&
+          record.window_path == matched->window_path) {
+        if (!title_filters_differ(matched->window_title,
+              record.window_title)) {
+          matched->window_title = record.window_title;
+          pending.reset();
+          return;
+        }
+        if (rate_limit &&
+            record.time < title_update_time + title_update_interval_ms) {
+          pending = record;
+          return;
+        }
+        title_update_time = record.time;
+      }
+      pending.reset();
+      matched = record;
+      ++updates;
+      match(record, new_active_contexts);
+      if (new_active_contexts != active_contexts) {
+        active_contexts.swap(new_active_contexts);
+        ++messages;
+      }
+    };
+
+    const auto begin = Clock::now();
+    for (auto round = size_t{ }; round < rounds; ++round)
+      for (const auto& record : log) {
+        const auto start = Clock::now();
+        // a rate limited title change is applied after the interval
+        if (pending && record.time >= title_update_time +
+              static_cast<uint64_t>(title_update_interval_ms)) {
+          title_update_time += title_update_interval_ms;
+          apply(*pending, false);
+        }
+        apply(record, true);
+        latencies.push_back(Nanoseconds(Clock::now() - start).count());
+      }
+    const auto total = Nanoseconds(Clock::now() - begin);
+
+    std::sort(latencies.begin(), latencies.end());
+    const auto percentile = [&](double p) {
+      return latencies[static_cast<size_t>(p * (latencies.size() - 1))];
+    };
+    std::printf("%-18s %-22s %12.0f %8zu %8zu %8.0f %8.0f %8.0f %10.0f\n",
+      scenario, benchmark,
+      static_cast<double>(latencies.size()) /
+        std::chrono::duration<double>(total).count(),
+      updates / rounds, messages / rounds, percentile(0.5),
+      percentile(0.9), percentile(0.99), latencies.back());
+  }
+
+  void run_context_benchmark(const char* scenario, const Config& config,
+      const std::vector<FocusLogRecord>& log) {
+    if (log.empty())
+      return;
+    std::printf("%-18s %-22s %12s %8s %8s %8s %8s %8s %10s\n",
+      "focus log", "benchmark", "changes/s", "matched", "messages",
+      "p50 ns", "p90 ns", "p99 ns", "max ns");
+    const auto& contexts = config.contexts;
+    const auto interval = config.title_update_interval_ms;
+
+    // each filter of each context, regular expressions included
+    measure_contexts(scenario, "Context::matches", log, interval,
+      [&](const FocusLogRecord& record, std::vector<int>& indices) {
+        indices.clear();
+        for (auto i = 0; i < static_cast<int>(contexts.size()); ++i)
+          if (contexts[i].matches(record.window_class,
+                record.window_title, record.window_path))
+            indices.push_back(i);
+      },
+      [&](const std::string& title_a, const std::string& title_b) {
+        for (const auto& context : contexts)
+          if (context.window_title_filter.matches(title_a, true) !=
+              context.window_title_filter.matches(title_b, true))
+            return true;
+        return false;
+      });
+
+    for (auto caching : { false, true }) {
+      auto matcher = ContextMatcher(contexts);
+      matcher.set_caching(caching);
+      measure_contexts(scenario, (caching ?
+          "ContextMatcher cached" : "ContextMatcher"), log, interval,
+        [&](const FocusLogRecord& record, std::vector<int>& indices) {
+          matcher.match(record.window_class, record.window_title,
+            record.window_path, &indices);
+        },
+        [&](const std::string& title_a, const std::string& title_b) {
+          return matcher.title_filters_differ(title_a, title_b);
+        });
+    }
+  }
+
+  bool read_focus_log(const std::string& filename,
+      std::vector<FocusLogRecord>& log) {
+    auto reader = FocusLogReader();
+    if (!reader.open(filename))
+      return false;
+    auto record = FocusLogRecord{ };
+    while (reader.read(record))
+      log.push_back(record);
+    return true;
+  }
+
+  void run_match_benchmark(const char* scenario, const Config& config) {
+    auto expressions = std::vector<KeySequence>();
+    for (const auto& context : config.contexts)
+      for (const auto& input : context.inputs)
+        expressions.push_back(input.input);
+    if (expressions.empty())
+      return;
+
+    const auto sequences = std::vector<KeySequence>{
+      { { Key::A, KeyState::Down } },
+      { { Key::ShiftLeft, KeyState::Down }, { Key::A, KeyState::Down } },
+      { { Key::ControlLeft, KeyState::Down }, { Key::C, KeyState::Down },
+        { Key::C, KeyState::Up }, { Key::D, KeyState::Down } },
+    };
+    auto match = MatchKeySequence();
+    auto any_key_matches = std::vector<Key>();
+    auto timeout_event = KeyEvent{ };
+    auto latencies = std::vector<double>();
+    const auto rounds = std::max(size_t{ 1 }, 100000 / expressions.size());
+    latencies.reserve(rounds * sequences.size());
+    const auto begin = Clock::now();
+    for (auto i = size_t{ }; i < rounds; ++i)
+      for (const auto& sequence : sequences) {
+        // a sample is the average of matching all expressions
+        const auto start = Clock::now();
+        for (const auto& expression : expressions)
+          if (match(expression, sequence, &any_key_matches,
+              &timeout_event) != MatchResult::no_match)
+            ++g_matches;
+        latencies.push_back(Nanoseconds(Clock::now() - start).count() /
+          static_cast<double>(expressions.size()));
+      }
+    print_result(scenario, "MatchKeySequence", 
+      latencies.size() * expressions.size(), latencies, Clock::now() - begin);
+  }
+} // namespace
+
+int main(int argc, char* argv[]) {
+  auto filter = std::string();
+  auto event_count = size_t{ 200000 };
+  auto focus_log_filename = std::string();
+  auto config_filename = std::string();
+  auto budget_filename = std::string();
+  auto report_filename = std::string();
+  for (auto i = 1; i < argc; ++i) {
+    if (!std::strcmp(argv[i], "--events") && i + 1 < argc)
+      event_count = static_cast<size_t>(std::max(std::atoi(argv[++i]), 1));
+    else if (!std::strcmp(argv[i], "--focus-log") && i + 1 < argc)
+      focus_log_filename = argv[++i];
+    else if (!std::strcmp(argv[i], "--config") && i + 1 < argc)
+      config_filename = argv[++i];
+    else if (!std::strcmp(argv[i], "--budget") && i + 1 < argc)
+      budget_filename = argv[++i];
+    else if (!std::strcmp(argv[i], "--report") && i + 1 < argc)
+      report_filename = argv[++i];
+    else
+      filter = argv[i];
+  }
+
+  // replay a recorded focus log against the contexts of a configuration
+  if (!focus_log_filename.empty()) {
+    auto log = std::vector<FocusLogRecord>();
+    if (!read_focus_log(focus_log_filename, log)) {
+      std::fprintf(stderr, "reading focus log failed\n");
+      return 1;
+    }
+    auto config = Config();
+    try {
+      auto file = std::ifstream(config_filename);
+      if (!file.good()) {
+        std::fprintf(stderr, "reading configuration failed\n");
+        return 1;
+      }
+      config = ParseConfig()(file,
+        std::filesystem::path(config_filename).parent_path());
+    }
+    catch (const std::exception& ex) {
+      std::fprintf(stderr, "%s\n", ex.what());
+      return 1;
+    }
+    run_context_benchmark("recorded", config, log);
+    return 0;
+  }
+
+  auto budgets = std::vector<Budget>();
+  if (!budget_filename.empty() && !read_budgets(budget_filename, budgets)) {
+    std::fprintf(stderr, "reading budget failed\n");
+    return 1;
+  }
+  auto measurements = std::vector<Measurement>();
+
+  const auto input = generate_input(event_count);
+  print_header();
+  for (const auto& scenario : get_scenarios()) {
+    if (!filter.empty() &&
+        std::string(scenario.name).find(filter) == std::string::npos)
+      continue;
+
+    // loading is parsing and building the stages
+    const auto load_begin = Clock::now();
+    auto config = parse_config(scenario.config);
+    auto stage_contexts = std::vector<std::vector<Stage::Context>>();
+    auto contexts = get_contexts(config, &stage_contexts);
+    auto stages = std::vector<StagePtr>();
+    for (auto& contexts : stage_contexts)
+      stages.push_back(std::make_unique<Stage>(std::move(contexts),
+        config.logical_keys, config.forward_modifiers));
+    auto multi_stage = MultiStage(std::move(stages));
+    measurements.push_back({ "config_load_ms", scenario.name,
+      std::chrono::duration<double, std::milli>(
+        Clock::now() - load_begin).count() });
+
+    run_match_benchmark(scenario.name, config);
+
+    auto stage = Stage(std::move(contexts), config.logical_keys,
+      config.forward_modifiers);
+    stage.set_active_client_contexts(all_contexts(stage.contexts().size()));
+    measure(scenario.name, "Stage::update", input,
+      [&](KeyEvent event, KeySequence& output) {
+        stage.update(event, 0, output);
+      });
+
+    multi_stage.set_active_client_contexts(
+      all_contexts(multi_stage.context_count()));
+    const auto result = measure(scenario.name, "MultiStage::update", input,
+      [&](KeyEvent event, KeySequence& output) {
+        multi_stage.update(event, 0, output);
+      });
+    measurements.push_back({ "update_ns_per_event", scenario.name,
+      result.ns_per_event });
+    if (allocation_tracking_enabled)
+      measurements.push_back({ "allocations_per_event", scenario.name,
+        result.allocations_per_event });
+  }
+
+  const auto context_scenario = "100 contexts";
+  if (filter.empty() ||
+      std::string(context_scenario).find(filter) != std::string::npos) {
+    std::printf("\n");
+    run_context_benchmark(context_scenario,
+      parse_config(generate_context_config(100)), generate_focus_log(1000));
+  }
+
+  if (const auto resident = get_peak_resident_memory(); resident > 0)
+    measurements.push_back({ "peak_resident_kb", "*", resident });
+  if (budgets.empty() && report_filename.empty())
+    return 0;
+  return (check_budgets(budgets, measurements, report_filename) ? 0 : 1);
+}
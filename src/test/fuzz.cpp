@@ -0,0 +1,557 @@
+// Differential fuzzer, which compares the stages with the runtime of the
+// first release (see src/test/reference), which serves as oracle.
+// Usage: keymapper-fuzz [--threads <count>] [--seconds <count>]
+//   [--iterations <count>] [--seed <n>]
+// Each iteration generates a random configuration and event stream, which
+// are applied to both, once for each match engine. The events also repeat
+// held keys, switch the active contexts and offer keys for passing them
+// through. After each event the output and is_clear() have to be equal.
+// A divergence is minimized and printed together with its seed,
+// which reproduces it with --seed <n> --iterations 1. Runs until stopped,
+// when neither --seconds nor --iterations is passed.
+
+#include "common/Duration.h"
+#include "config/ParseConfig.h"
+#include "config/get_key_name.h"
+#include "runtime/MultiStage.h"
+#include "runtime/Timeout.h"
+#include "test/reference/create_multi_stage.h"
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+void message(const char* format, ...) { }
+void error(const char* format, ...) { }
+void verbose(const char* format, ...) { }
+
+namespace {
+  const auto events_per_iteration = 200;
+  const auto max_printed_divergences = 5;
+
+  const char* const keys[] = {
+    "A", "B", "C", "D", "E", "ShiftLeft", "ShiftRight", "ControlLeft"
+  };
+  // mappings also contain logical keys
+  const char* const mapped_keys[] = {
+    "A", "B", "C", "D", "E", "ShiftLeft", "ShiftRight", "ControlLeft", "Shift"
+  };
+  const char* const virtual_keys[] = { "Virtual1", "Virtual2" };
+  const char* const modifier_keys[] = {
+    "ShiftLeft", "ShiftRight", "ControlLeft", "Shift"
+  };
+  const Stage::MatchEngine match_engines[] = {
+    Stage::MatchEngine::interpreted,
+    Stage::MatchEngine::indexed,
+    Stage::MatchEngine::compiled,
+  };
+
+  struct Event {
+    enum class Type { input, forward, contexts };
+    Type type;
+    KeyEvent event;
+    // the active contexts, after a context switch
+    std::vector<int> contexts;
+  };
+  using Events = std::vector<Event>;
+
+  using Random = std::mt19937_64;
+
+  template<typename T, size_t N>
+  const T& pick(Random& rand, const T(&values)[N]) {
+    return values[std::uniform_int_distribution<size_t>(0, N - 1)(rand)];
+  }
+
+  bool chance(Random& rand, double probability) {
+    return std::uniform_real_distribution<double>()(rand) < probability;
+  }
+
+  std::string generate_input(Random& rand) {
+    const auto a = std::string(pick(rand, mapped_keys));
+    const auto b = std::string(pick(rand, mapped_keys));
+    const auto c = std::string(pick(rand, mapped_keys));
+    switch (std::uniform_int_distribution<int>(0, 15)(rand)) {
+      default:
+      case 0: return a;
+      case 1: return a + " " + b;
+      case 2: return a + "{" + b + "}";
+      case 3: return "(" + a + " " + b + ")";
+      case 4: return "!" + a + " " + b;
+      case 5: return a + "{" + b + " " + c + "}";
+      case 6: return "(" + a + " " + b + "){" + c + "}";
+      case 7: return a + " 200ms";
+      case 8: return a + " !200ms";
+      case 9: return a + "{300ms}";
+      case 10: return "? " + a + " " + b;
+      case 11: return a + "{Any}";
+      case 12: return std::string(pick(rand, virtual_keys)) + "{" + a + "}";
+      case 13: return a + " !" + a + " " + b;
+      case 14: return "Any";
+      case 15: return a + "{" + b + " Any}";
+    }
+  }
+
+  std::string generate_output(Random& rand) {
+    const auto a = std::string(pick(rand, mapped_keys));
+    const auto b = std::string(pick(rand, mapped_keys));
+    switch (std::uniform_int_distribution<int>(0, 9)(rand)) {
+      default:
+      case 0: return a;
+      case 1: return a + " " + b;
+      case 2: return "(" + a + " " + b + ")";
+      case 3: return "!" + a + " " + b;
+      case 4: return "";
+      case 5: return a + " ^ " + b;
+      case 6: return std::string(pick(rand, virtual_keys));
+      case 7: return a + "{" + b + "}";
+      case 8: return "$(command)";
+      case 9: return "Any";
+    }
+  }
+
+  // a stage which only permutes single keys is fused with its neighbours
+  std::string generate_permutation_stage(Random& rand) {
+    auto permuted = std::vector<std::string>();
+    const auto count = std::uniform_int_distribution<int>(2, 3)(rand);
+    while (static_cast<int>(permuted.size()) < count) {
+      const auto key = std::string(pick(rand, keys));
+      if (std::find(permuted.begin(), permuted.end(), key) == permuted.end())
+        permuted.push_back(key);
+    }
+    auto stage = std::string("[stage]\n");
+    for (auto i = size_t{ }; i < permuted.size(); ++i)
+      stage += permuted[i] + " >> " +
+        permuted[(i + 1) % permuted.size()] + "\n";
+    return stage;
+  }
+
+  std::string generate_config(Random& rand) {
+    auto config = std::string();
+    if (chance(rand, 0.2)) {
+      config += "@forward-modifiers";
+      const auto count = std::uniform_int_distribution<int>(1, 2)(rand);
+      for (auto i = 0; i < count; ++i)
+        config += std::string(" ") + pick(rand, modifier_keys);
+      config += "\n";
+    }
+    const auto contexts = std::uniform_int_distribution<int>(1, 4)(rand);
+    for (auto c = 0; c < contexts; ++c) {
+      if (c > 0 && chance(rand, 0.2))
+        config += "[stage]\n";
+      if (chance(rand, 0.3))
+        config += std::string("[modifier=\"") + (chance(rand, 0.5) ? "!" : "") +
+          pick(rand, mapped_keys) + "\"]\n";
+      else if (chance(rand, 0.3))
+        config += "[title=\"Window" + std::to_string(c) + "\"]\n";
+      else if (c > 0)
+        config += "[default]\n";
+      const auto mappings = std::uniform_int_distribution<int>(1, 6)(rand);
+      for (auto m = 0; m < mappings; ++m)
+        config += generate_input(rand) + " >> " + generate_output(rand) + "\n";
+    }
+    if (chance(rand, 0.2))
+      config += generate_permutation_stage(rand);
+    return config;
+  }
+
+  std::optional<Config> parse_config(const std::string& string) try {
+    auto stream = std::istringstream(string);
+    return ParseConfig()(stream);
+  }
+  catch (const std::exception&) {
+    return { };
+  }
+
+  std::vector<int> all_contexts(size_t count) {
+    auto indices = std::vector<int>();
+    for (auto i = 0; i < static_cast<int>(count); ++i)
+      indices.push_back(i);
+    return indices;
+  }
+
+  bool has_filter(const Config::Context& context) {
+    return (context.window_class_filter || context.window_title_filter ||
+      context.window_path_filter || context.device_filter ||
+      context.device_id_filter || !context.modifier_filter.empty());
+  }
+
+  // the first release inserted a context for each logical key in a
+  // modifier filter, and began each stage with an unfiltered context
+  // for the forwarded modifiers, so the indices of its contexts are shifted
+  std::vector<int> get_reference_contexts(const Config& config,
+      const std::vector<int>& contexts) {
+    auto indices = std::vector<int>();
+    auto offsets = std::vector<int>{ 0 };
+    for (const auto& context : config.contexts) {
+      if ((context.begin_stage || &context == &config.contexts.front()) &&
+          has_filter(context) &&
+          !config.forward_modifiers.empty()) {
+        indices.push_back(offsets.back());
+        ++offsets.back();
+      }
+      auto logical_keys = std::vector<Key>();
+      for (const auto& event : context.modifier_filter)
+        if (is_logical_key(event.key) &&
+            std::find(logical_keys.begin(), logical_keys.end(),
+              event.key) == logical_keys.end())
+          logical_keys.push_back(event.key);
+      offsets.push_back(offsets.back() + (1 << logical_keys.size()));
+    }
+    for (auto index : contexts)
+      if (index < static_cast<int>(config.contexts.size()))
+        for (auto i = offsets[index]; i < offsets[index + 1]; ++i)
+          indices.push_back(i);
+    std::sort(indices.begin(), indices.end());
+    return indices;
+  }
+
+  // contexts with a window filter are switched by the client,
+  // the others are always active
+  std::vector<int> generate_contexts(Random& rand, const Config& config) {
+    auto contexts = std::vector<int>();
+    for (auto i = 0; i < static_cast<int>(config.contexts.size()); ++i)
+      if (!config.contexts[i].window_title_filter || chance(rand, 0.5))
+        contexts.push_back(i);
+    return contexts;
+  }
+
+  reference::MultiStagePtr create_reference_stage(const Config& config) {
+    auto stage = reference::create_multi_stage(config);
+    stage->set_active_client_contexts(all_contexts(stage->context_count()));
+    return stage;
+  }
+
+  MultiStagePtr create_stage(const Config& config, Stage::MatchEngine engine) {
+    auto stages = std::vector<StagePtr>();
+    auto contexts = std::vector<Stage::Context>();
+    for (const auto& config_context : config.contexts) {
+      if (!contexts.empty() && config_context.begin_stage)
+        stages.push_back(std::make_unique<Stage>(
+          std::exchange(contexts, { }), config.logical_keys,
+          config.forward_modifiers));
+
+      auto& context = contexts.emplace_back();
+      for (const auto& input : config_context.inputs)
+        context.inputs.push_back({ input.input, input.output_index });
+      context.outputs = config_context.outputs;
+      for (const auto& output : config_context.command_outputs)
+        context.command_outputs.push_back({ output.output, output.index });
+      context.modifier_filter = config_context.modifier_filter;
+      context.invert_modifier_filter = config_context.invert_modifier_filter;
+      context.fallthrough = config_context.fallthrough;
+    }
+    if (!contexts.empty())
+      stages.push_back(std::make_unique<Stage>(std::move(contexts),
+        config.logical_keys, config.forward_modifiers));
+    auto stage = std::make_unique<MultiStage>(std::move(stages));
+    stage->set_match_engine(engine);
+    stage->set_active_client_contexts(all_contexts(stage->context_count()));
+    return stage;
+  }
+
+  std::string format_sequence(const KeySequence& sequence) {
+    auto string = std::string();
+    for (const auto& event : sequence) {
+      if (!string.empty())
+        string.push_back(' ');
+      if (event.key == Key::timeout) {
+        string += std::to_string(timeout_to_milliseconds(
+          event.value).count()) + "ms";
+        continue;
+      }
+      string.push_back(event.state == KeyState::Down ? '+' :
+        event.state == KeyState::Up ? '-' : '~');
+      if (auto name = get_key_name(event.key))
+        string += name;
+      else
+        string += std::to_string(static_cast<int>(event.key));
+    }
+    return string;
+  }
+
+  std::string format_events(const Events& events) {
+    auto string = std::string();
+    for (const auto& event : events) {
+      if (!string.empty())
+        string.push_back(' ');
+      if (event.type == Event::Type::contexts) {
+        string += "[";
+        for (auto index : event.contexts)
+          string += (string.back() == '[' ? "" : ",") + std::to_string(index);
+        string += "]";
+        continue;
+      }
+      // keys offered for passing them through are marked
+      if (event.type == Event::Type::forward)
+        string += "=";
+      string += format_sequence({ event.event });
+    }
+    return string;
+  }
+
+  struct Divergence {
+    Stage::MatchEngine engine;
+    size_t event_index;
+    KeySequence reference_output;
+    KeySequence output;
+    bool reference_clear;
+    bool clear;
+  };
+
+  // applies the events to both, returns the first divergence
+  std::optional<Divergence> compare(const Config& config,
+      const Events& events, Stage::MatchEngine engine) {
+    auto reference = create_reference_stage(config);
+    auto optimized = create_stage(config, engine);
+    auto reference_output = KeySequence();
+    auto output = KeySequence();
+    for (auto i = size_t{ }; i < events.size(); ++i) {
+      const auto& event = events[i];
+      // like the server, only reply to requested timeouts
+      const auto timeout_requested = (!reference_output.empty() &&
+        reference_output.back().key == Key::timeout);
+      if (event.type != Event::Type::contexts &&
+          event.event.key == Key::timeout && !timeout_requested)
+        continue;
+      output.clear();
+      if (event.type == Event::Type::contexts) {
+        // minimizing the configuration can remove contexts
+        auto contexts = event.contexts;
+        contexts.erase(std::remove_if(contexts.begin(), contexts.end(),
+          [&](int index) {
+            return index >= static_cast<int>(config.contexts.size());
+          }), contexts.end());
+        reference_output = reference->set_active_client_contexts(
+          get_reference_contexts(config, contexts));
+        output = optimized->set_active_client_contexts(contexts);
+      }
+      else {
+        reference_output = reference->update(event.event, 0);
+        // like the server, keys are only passed through without timeout
+        if (event.type == Event::Type::forward && !timeout_requested &&
+            optimized->pass_through(event.event))
+          output.push_back(event.event);
+        else
+          optimized->update(event.event, 0, output);
+      }
+      if (reference_output != output ||
+          reference->is_clear() != optimized->is_clear())
+        return Divergence{ engine, i, reference_output, output,
+          reference->is_clear(), optimized->is_clear() };
+    }
+    return { };
+  }
+
+  std::optional<Divergence> compare(const Config& config,
+      const Events& events) {
+    for (auto engine : match_engines)
+      if (auto divergence = compare(config, events, engine))
+        return divergence;
+    return { };
+  }
+
+  // presses, repeats and releases random keys, switches the active
+  // contexts and replies to requested timeouts
+  Events generate_events(Random& rand, const Config& config) {
+    auto stage = create_reference_stage(config);
+    auto events = Events();
+    auto pressed = std::vector<Key>();
+    const auto apply = [&](const KeyEvent& event) {
+      // some keys are offered for passing them through
+      events.push_back({ (chance(rand, 0.2) ? Event::Type::forward :
+        Event::Type::input), event, { } });
+      const auto output = stage->update(event, 0);
+      return (!output.empty() && output.back().key == Key::timeout ?
+        std::optional(output.back()) : std::nullopt);
+    };
+
+    auto timeout = std::optional<KeyEvent>();
+    for (auto i = 0; i < events_per_iteration; ++i) {
+      if (timeout) {
+        // replied immediately, halfway or when reached
+        const auto requested = timeout_to_milliseconds(timeout->value);
+        const auto elapsed = std::uniform_int_distribution<int>(0, 2)(rand) *
+          requested / 2;
+        timeout = apply(make_input_timeout_event(std::min(elapsed, requested)));
+        if (timeout)
+          continue;
+      }
+      // release all keys regularly
+      if (chance(rand, 0.05)) {
+        for (auto key : pressed)
+          timeout = apply({ key, KeyState::Up });
+        pressed.clear();
+        continue;
+      }
+      // switch the active contexts, also while keys are held
+      if (chance(rand, 0.05)) {
+        auto contexts = generate_contexts(rand, config);
+        stage->set_active_client_contexts(
+          get_reference_contexts(config, contexts));
+        events.push_back({ Event::Type::contexts, { }, std::move(contexts) });
+        continue;
+      }
+      const auto key = get_key_by_name(pick(rand, keys));
+      const auto it = std::find(pressed.begin(), pressed.end(), key);
+      if (it != pressed.end() && chance(rand, 0.3)) {
+        // repeat a held key
+        timeout = apply({ key, KeyState::Down });
+      }
+      else if (it != pressed.end()) {
+        pressed.erase(it);
+        timeout = apply({ key, KeyState::Up });
+      }
+      else {
+        pressed.push_back(key);
+        timeout = apply({ key, KeyState::Down });
+      }
+    }
+    for (auto key : pressed)
+      apply({ key, KeyState::Up });
+    return events;
+  }
+
+  // removes events and mappings as long as the divergence remains
+  void minimize(std::string& config_string, Events& events) {
+    const auto diverges = [](const std::string& string,
+        const Events& events) {
+      const auto config = parse_config(string);
+      return (config && compare(*config, events).has_value());
+    };
+
+    // events after the divergence are not needed
+    events.resize(compare(*parse_config(config_string), events)->event_index + 1);
+    for (auto i = events.size(); i-- > 0; ) {
+      auto reduced = events;
+      reduced.erase(reduced.begin() + static_cast<std::ptrdiff_t>(i));
+      if (diverges(config_string, reduced))
+        events = std::move(reduced);
+    }
+
+    auto lines = std::vector<std::string>();
+    auto stream = std::istringstream(config_string);
+    for (auto line = std::string(); std::getline(stream, line); )
+      lines.push_back(line);
+    const auto join = [](const std::vector<std::string>& lines) {
+      auto string = std::string();
+      for (const auto& line : lines)
+        string += line + "\n";
+      return string;
+    };
+    for (auto i = lines.size(); i-- > 0; ) {
+      auto reduced = lines;
+      reduced.erase(reduced.begin() + static_cast<std::ptrdiff_t>(i));
+      if (diverges(join(reduced), events))
+        lines = std::move(reduced);
+    }
+    config_string = join(lines);
+  }
+
+  // returns whether both matched alike
+  bool run_iteration(uint64_t seed, std::mutex& print_mutex) {
+    auto rand = Random(seed);
+    auto config_string = generate_config(rand);
+    const auto config = parse_config(config_string);
+    if (!config)
+      return true;
+    auto events = generate_events(rand, *config);
+    if (!compare(*config, events))
+      return true;
+
+    minimize(config_string, events);
+    const auto divergence = compare(*parse_config(config_string), events);
+    auto lock = std::lock_guard<std::mutex>(print_mutex);
+    std::printf("divergence with seed %llu (%s):\n%s"
+      "input:     %s\nreference: %s (%s)\noptimized: %s (%s)\n\n",
+      static_cast<unsigned long long>(seed),
+      get_match_engine_name(divergence->engine), config_string.c_str(),
+      format_events(events).c_str(),
+      format_sequence(divergence->reference_output).c_str(),
+      divergence->reference_clear ? "clear" : "not clear",
+      format_sequence(divergence->output).c_str(),
+      divergence->clear ? "clear" : "not clear");
+    std::fflush(stdout);
+    return false;
+  }
+} // namespace
+
+int main(int argc, char* argv[]) {
+  auto threads = std::max(std::thread::hardware_concurrency(), 1u);
+  auto seconds = std::optional<double>();
+  auto iterations = std::optional<uint64_t>();
+  auto seed = uint64_t{ 1 };
+  for (auto i = 1; i < argc; ++i) {
+    if (!std::strcmp(argv[i], "--threads") && i + 1 < argc)
+      threads = static_cast<unsigned>(std::max(std::atoi(argv[++i]), 1));
+    else if (!std::strcmp(argv[i], "--seconds") && i + 1 < argc)
+      seconds = std::atof(argv[++i]);
+    else if (!std::strcmp(argv[i], "--iterations") && i + 1 < argc)
+      iterations = std::strtoull(argv[++i], nullptr, 10);
+    else if (!std::strcmp(argv[i], "--seed") && i + 1 < argc)
+      seed = std::strtoull(argv[++i], nullptr, 10);
+    else {
+      std::fprintf(stderr, "Usage: keymapper-fuzz [--threads <count>] "
+        "[--seconds <count>] [--iterations <count>] [--seed <n>]\n");
+      return 1;
+    }
+  }
+
+  // each iteration's seed follows from its index
+  auto next_iteration = std::atomic<uint64_t>{ };
+  auto completed = std::atomic<uint64_t>{ };
+  auto divergences = std::atomic<uint64_t>{ };
+  auto print_mutex = std::mutex();
+  const auto end = (seconds ? std::optional(Clock::now() +
+    std::chrono::duration_cast<Clock::duration>(
+      std::chrono::duration<double>(*seconds))) : std::nullopt);
+
+  const auto run = [&]() {
+    for (;;) {
+      if (end && Clock::now() >= *end)
+        return;
+      const auto index = next_iteration.fetch_add(1);
+      if (iterations && index >= *iterations)
+        return;
+      if (divergences.load() >= max_printed_divergences)
+        return;
+      if (!run_iteration(seed + index, print_mutex))
+        ++divergences;
+      ++completed;
+    }
+  };
+  auto workers = std::vector<std::thread>();
+  for (auto i = 0u; i < threads; ++i)
+    workers.emplace_back(run);
+
+  // report the progress every minute
+  auto last_report = Clock::now();
+  for (;;) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    const auto done = (iterations && completed.load() >= *iterations) ||
+      (end && Clock::now() >= *end) ||
+      divergences.load() >= max_printed_divergences;
+    if (done || Clock::now() - last_report >= std::chrono::minutes(1)) {
+      last_report = Clock::now();
+      auto lock = std::lock_guard<std::mutex>(print_mutex);
+      std::printf("%llu iterations, %llu divergences\n",
+        static_cast<unsigned long long>(completed.load()),
+        static_cast<unsigned long long>(divergences.load()));
+      std::fflush(stdout);
+    }
+    if (done)
+      break;
+  }
+  for (auto& worker : workers)
+    worker.join();
+  return (divergences.load() ? 1 : 0);
+}
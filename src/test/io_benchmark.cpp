@@ -0,0 +1,317 @@
+
+// Compares the ways keymapperd can wait for, read and write the device
+// events. Pipes take the place of the grabbed devices and the virtual
+// device. The main thread writes each frame to one of the devices and
+// waits until the translated frames arrive, while another thread reads
+// the devices and writes a press and a release frame for each.
+// Usage: keymapper_io_bench [--frames <count>] [--devices <count>]
+
+#include "server/unix/IoUring.h"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/input.h>
+#include <sys/epoll.h>
+#include <sys/select.h>
+
+namespace {
+  using Clock = std::chrono::steady_clock;
+  using Nanoseconds = std::chrono::duration<double, std::nano>;
+
+  // the size of the read buffer of keymapperd
+  using ReadBuffer = std::array<input_event, 64>;
+
+  struct Pipes {
+    std::vector<int> device_read_fds;
+    std::vector<int> device_write_fds;
+    int output_read_fd;
+    int output_write_fd;
+  };
+
+  bool create_pipe(int& read_fd, int& write_fd) {
+    auto fds = std::array<int, 2>{ };
+    if (::pipe2(fds.data(), O_CLOEXEC) != 0)
+      return false;
+    read_fd = fds[0];
+    write_fd = fds[1];
+    return true;
+  }
+
+  bool create_pipes(Pipes& pipes, int devices) {
+    pipes.device_read_fds.resize(devices, -1);
+    pipes.device_write_fds.resize(devices, -1);
+    for (auto i = 0; i < devices; ++i)
+      if (!create_pipe(pipes.device_read_fds[i], pipes.device_write_fds[i]))
+        return false;
+    return create_pipe(pipes.output_read_fd, pipes.output_write_fd);
+  }
+
+  void close_pipes(Pipes& pipes) {
+    for (auto fd : pipes.device_read_fds)
+      ::close(fd);
+    for (auto fd : pipes.device_write_fds)
+      ::close(fd);
+    ::close(pipes.output_read_fd);
+    ::close(pipes.output_write_fd);
+  }
+
+  input_event make_event(int type, int code, int value) {
+    auto event = input_event{ };
+    event.type = static_cast<unsigned short>(type);
+    event.code = static_cast<unsigned short>(code);
+    event.value = value;
+    return event;
+  }
+
+  // a press of the key and a release frame
+  using OutputFrames = std::array<input_event, 4>;
+
+  // translates the complete frames, returns their count
+  int translate(const input_event* events, int count,
+      std::vector<OutputFrames>& output) {
+    auto frames = 0;
+    for (auto i = 0; i < count; ++i)
+      if (events[i].type == EV_KEY) {
+        output.push_back({
+          make_event(EV_KEY, events[i].code, 1),
+          make_event(EV_SYN, SYN_REPORT, 0),
+          make_event(EV_KEY, events[i].code, 0),
+          make_event(EV_SYN, SYN_REPORT, 0),
+        });
+        ++frames;
+      }
+    return frames;
+  }
+
+  bool write_output(int fd, std::vector<OutputFrames>& output) {
+    const auto size = output.size() * sizeof(OutputFrames);
+    const auto result = ::write(fd, output.data(), size);
+    output.clear();
+    return (result == static_cast<ssize_t>(size));
+  }
+
+  void read_select(const Pipes& pipes, int frames) {
+    auto events = ReadBuffer{ };
+    auto output = std::vector<OutputFrames>();
+    const auto max_fd = *std::max_element(pipes.device_read_fds.begin(),
+      pipes.device_read_fds.end());
+    for (auto handled = 0; handled < frames; ) {
+      auto read_set = fd_set{ };
+      FD_ZERO(&read_set);
+      for (auto fd : pipes.device_read_fds)
+        FD_SET(fd, &read_set);
+      if (::select(max_fd + 1, &read_set, nullptr, nullptr, nullptr) < 0)
+        return;
+      for (auto fd : pipes.device_read_fds)
+        if (FD_ISSET(fd, &read_set)) {
+          const auto size = ::read(fd, events.data(), sizeof(events));
+          if (size <= 0)
+            return;
+          handled += translate(events.data(),
+            static_cast<int>(size / sizeof(input_event)), output);
+          if (!write_output(pipes.output_write_fd, output))
+            return;
+        }
+    }
+  }
+
+  void read_epoll(const Pipes& pipes, int frames) {
+    const auto epoll_fd = ::epoll_create1(EPOLL_CLOEXEC);
+    for (auto i = size_t{ }; i < pipes.device_read_fds.size(); ++i) {
+      auto event = epoll_event{ };
+      event.events = EPOLLIN;
+      event.data.u64 = i;
+      ::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pipes.device_read_fds[i], &event);
+    }
+    auto ready_events = std::array<epoll_event, 16>{ };
+    auto events = ReadBuffer{ };
+    auto output = std::vector<OutputFrames>();
+    for (auto handled = 0; handled < frames; ) {
+      const auto count = ::epoll_wait(epoll_fd, ready_events.data(),
+        static_cast<int>(ready_events.size()), -1);
+      if (count < 0)
+        break;
+      for (auto i = 0; i < count; ++i) {
+        const auto fd = pipes.device_read_fds[ready_events[i].data.u64];
+        const auto size = ::read(fd, events.data(), sizeof(events));
+        if (size <= 0)
+          break;
+        handled += translate(events.data(),
+          static_cast<int>(size / sizeof(input_event)), output);
+        if (!write_output(pipes.output_write_fd, output))
+          break;
+      }
+    }
+    ::close(epoll_fd);
+  }
+
+  // the output frames are written by linked requests, like VirtualDevice
+  bool write_output_ring(IoUring& ring, int fd,
+      std::vector<OutputFrames>& output) {
+    auto pending = 0u;
+    auto previous = static_cast<io_uring_sqe*>(nullptr);
+    for (const auto& frames : output)
+      for (auto i = 0; i < 2; ++i) {
+        const auto sqe = ring.get_sqe();
+        if (!sqe)
+          return false;
+        const auto size = 2 * sizeof(input_event);
+        prepare_write(*sqe, fd, &frames[i * 2], size, size);
+        if (previous)
+          previous->flags |= IOSQE_IO_LINK;
+        previous = sqe;
+        ++pending;
+      }
+    output.clear();
+
+    auto succeeded = true;
+    while (pending) {
+      if (!ring.submit(pending))
+        return false;
+      while (const auto cqe = ring.peek_cqe()) {
+        if (cqe->res < 0 || static_cast<uint64_t>(cqe->res) != cqe->user_data)
+          succeeded = false;
+        ring.pop_cqe();
+        --pending;
+      }
+    }
+    return succeeded;
+  }
+
+  void read_io_uring(IoUring& read_ring, IoUring& write_ring,
+      const Pipes& pipes, int frames) {
+    // the user data of the reads is the device index
+    for (auto i = size_t{ }; i < pipes.device_read_fds.size(); ++i)
+      if (const auto sqe = read_ring.get_sqe())
+        prepare_read_multishot(*sqe, pipes.device_read_fds[i], 0, i);
+
+    auto events = ReadBuffer{ };
+    auto output = std::vector<OutputFrames>();
+    for (auto handled = 0; handled < frames; ) {
+      if (!read_ring.submit(1))
+        return;
+      while (const auto cqe = read_ring.peek_cqe()) {
+        const auto result = cqe->res;
+        const auto flags = cqe->flags;
+        read_ring.pop_cqe();
+        if (result <= 0 || !(flags & IORING_CQE_F_BUFFER) ||
+            !(flags & IORING_CQE_F_MORE))
+          return;
+        const auto buffer_id =
+          static_cast<uint16_t>(flags >> IORING_CQE_BUFFER_SHIFT);
+        std::memcpy(events.data(), read_ring.get_buffer(buffer_id),
+          static_cast<size_t>(result));
+        read_ring.recycle_buffer(buffer_id);
+        handled += translate(events.data(),
+          static_cast<int>(static_cast<size_t>(result) / sizeof(input_event)),
+          output);
+        if (!write_output_ring(write_ring, pipes.output_write_fd, output))
+          return;
+      }
+    }
+  }
+
+  void print_header() {
+    std::printf("%-10s %8s %10s %8s %8s %8s %10s %10s\n",
+      "backend", "devices", "frames/s", "p50 us", "p90 us", "p99 us",
+      "max us", "cpu us");
+  }
+
+  // writes each frame to a device and waits for the translated frames
+  template<typename F> // void(const Pipes&, int frames)
+  void measure(const char* backend, int devices, int frames, F&& read) {
+    auto pipes = Pipes{ };
+    if (!create_pipes(pipes, devices)) {
+      std::fprintf(stderr, "creating pipes failed\n");
+      return;
+    }
+    auto thread = std::thread([&]() { read(pipes, frames); });
+
+    auto latencies = std::vector<double>();
+    latencies.reserve(static_cast<size_t>(frames));
+    auto output = OutputFrames{ };
+    const auto cpu_begin = std::clock();
+    const auto begin = Clock::now();
+    for (auto i = 0; i < frames; ++i) {
+      const auto frame = std::array<input_event, 2>{
+        make_event(EV_KEY, KEY_A + i % 26, 1),
+        make_event(EV_SYN, SYN_REPORT, 0),
+      };
+      const auto start = Clock::now();
+      if (::write(pipes.device_write_fds[i % devices], frame.data(),
+            sizeof(frame)) != static_cast<ssize_t>(sizeof(frame)))
+        break;
+      auto received = size_t{ };
+      while (received < sizeof(output)) {
+        const auto size = ::read(pipes.output_read_fd,
+          reinterpret_cast<char*>(output.data()) + received,
+          sizeof(output) - received);
+        if (size <= 0)
+          break;
+        received += static_cast<size_t>(size);
+      }
+      if (received < sizeof(output))
+        break;
+      latencies.push_back(Nanoseconds(Clock::now() - start).count() / 1000);
+    }
+    const auto seconds = std::chrono::duration<double>(
+      Clock::now() - begin).count();
+    // of both threads
+    const auto cpu_seconds = static_cast<double>(std::clock() - cpu_begin) /
+      CLOCKS_PER_SEC;
+
+    // unblocks the reading thread, when it failed
+    close_pipes(pipes);
+    thread.join();
+
+    if (latencies.size() != static_cast<size_t>(frames)) {
+      std::fprintf(stderr, "%s failed\n", backend);
+      return;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    const auto percentile = [&](double p) {
+      return latencies[static_cast<size_t>(p * (latencies.size() - 1))];
+    };
+    std::printf("%-10s %8d %10.0f %8.1f %8.1f %8.1f %10.1f %10.2f\n",
+      backend, devices, frames / seconds, percentile(0.5), percentile(0.9),
+      percentile(0.99), latencies.back(), cpu_seconds * 1000000 / frames);
+  }
+} // namespace
+
+int main(int argc, char* argv[]) {
+  auto frames = 20000;
+  auto device_counts = std::vector<int>{ 1, 4, 16 };
+  for (auto i = 1; i < argc; ++i) {
+    if (!std::strcmp(argv[i], "--frames") && i + 1 < argc)
+      frames = std::max(std::atoi(argv[++i]), 1);
+    else if (!std::strcmp(argv[i], "--devices") && i + 1 < argc)
+      device_counts = { std::clamp(std::atoi(argv[++i]), 1, 64) };
+  }
+
+  print_header();
+  for (auto devices : device_counts) {
+    measure("select", devices, frames, read_select);
+    measure("epoll", devices, frames, read_epoll);
+
+    auto read_ring = IoUring();
+    auto write_ring = IoUring();
+    if (!read_ring.create(64) || !write_ring.create(64) ||
+        !read_ring.supports(IoUring::op_read_multishot) ||
+        !read_ring.create_buffer_ring(0, sizeof(ReadBuffer), 64)) {
+      std::fprintf(stderr, "io_uring multishot reads are not supported\n");
+      continue;
+    }
+    measure("io_uring", devices, frames, [&](const Pipes& pipes, int count) {
+      read_io_uring(read_ring, write_ring, pipes, count);
+    });
+  }
+  return 0;
+}
@@ -0,0 +1,241 @@
+
+// Measures the cost of the IPC between keymapper and keymapperd, by
+// running a ServerPort and a ClientPort on two threads of one process.
+// Usage: keymapper_ipc_bench [--messages <count>]
+
+#include "client/ServerPort.h"
+#include "server/ClientPort.h"
+#include "config/ParseConfig.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+  using Nanoseconds = std::chrono::duration<double, std::nano>;
+
+  const auto ipc_id = std::string("keymapper_ipc_bench");
+
+  // acknowledges every received message with a virtual key state
+  class Server : public IClientPort::MessageHandler {
+  public:
+    bool listen() { return m_port.listen(); }
+
+    void run() {
+      if (!m_port.accept())
+        return;
+      while (m_port.read_messages(*this, std::nullopt))
+        ;
+      m_port.disconnect();
+    }
+
+  private:
+    void acknowledge() {
+      m_port.send_virtual_key_state(Key::first_virtual, KeyState::Down);
+    }
+
+    // keeps the stages like keymapperd, so they can be activated again
+    void on_configuration_message(MultiStagePtr stage) override {
+      if (m_stages.size() > max_cached_configurations)
+        m_stages.erase(m_stages.begin());
+      m_stages.push_back(std::move(stage));
+      acknowledge();
+    }
+    void on_activate_configuration_message(size_t hash,
+        const std::function<MultiStagePtr()>& build_stage) override {
+      const auto it = std::find_if(m_stages.begin(), m_stages.end(),
+        [&](const auto& stage) { return stage->configuration_hash() == hash; });
+      if (it == m_stages.end())
+        return on_configuration_message(build_stage());
+      std::rotate(it, std::next(it), m_stages.end());
+      acknowledge();
+    }
+    void on_grab_device_filters_message(std::vector<GrabDeviceFilter>) override { }
+    void on_directives_message(const std::vector<std::string>&) override { }
+    void on_active_contexts_message(const std::vector<int>&,
+        const ContextSwitchTimes&) override { acknowledge(); }
+    void on_set_virtual_key_state_message(Key, KeyState) override { acknowledge(); }
+    void on_validate_state_message() override { }
+    void on_request_next_key_info_message() override { }
+    void on_inject_input_message(const KeySequence&) override { acknowledge(); }
+    void on_inject_output_message(const KeySequence&) override { }
+    void on_request_statistics_message(bool) override { }
+    void on_request_input_profiles_message() override { }
+
+    ClientPort m_port{ ipc_id };
+    std::vector<MultiStagePtr> m_stages;
+  };
+
+  class Client : public ServerPort::MessageHandler {
+  public:
+    bool connect() { return m_port.connect(); }
+    void disconnect() { m_port.disconnect(); }
+    ServerPort& port() { return m_port; }
+
+    // blocks until the server acknowledged a message
+    bool wait_for_acknowledge() {
+      while (!std::exchange(m_acknowledged, false))
+        if (!m_port.read_messages(*this, std::nullopt))
+          return false;
+      return true;
+    }
+
+  private:
+    void on_execute_action_message(int) override { }
+    void on_virtual_key_state_message(Key, KeyState) override {
+      m_acknowledged = true;
+    }
+    void on_next_key_info_message(Key, DeviceDesc) override { }
+    void on_statistics_message(const std::string&) override { }
+    void on_input_profiles_message(const InputProfiles&) override { }
+
+    ServerPort m_port{ ipc_id };
+    bool m_acknowledged{ };
+  };
+
+  Config parse_config(const std::string& string) {
+    static auto parse = ParseConfig();
+    auto stream = std::stringstream(string);
+    return parse(stream);
+  }
+
+  // the contexts of two configurations differ, so switching between them
+  // sends all contexts
+  std::string generate_config(int contexts, int mappings, int variant) {
+    const char* const keys[] = { "A", "B", "C", "D", "E", "F", "G", "H" };
+    auto string = std::string();
+    for (auto c = 0; c < contexts; ++c) {
+      string += "[title=\"Window" + std::to_string(c) + "\"]\n";
+      for (auto m = 0; m < mappings; ++m)
+        string += std::string("ShiftLeft{") + keys[m % 8] + "} " +
+          keys[(m / 8) % 8] + " >> " + keys[(m + variant) % 8] +
+          " " + keys[(c + variant) % 8] + "\n";
+    }
+    return string;
+  }
+
+  void print_header() {
+    std::printf("%-14s %-22s %10s %10s %8s %8s %8s %10s %10s\n",
+      "transport", "message", "msgs/s", "MB/s", "p50 us", "p90 us",
+      "p99 us", "max us", "cpu us");
+  }
+
+  // sends the messages and waits for each acknowledge
+  template<typename F> // bool(ServerPort&, size_t index)
+  void measure(Client& client, const char* transport, const char* name,
+      size_t count, size_t message_size, F&& send) {
+    auto latencies = std::vector<double>();
+    latencies.reserve(count);
+    const auto cpu_begin = std::clock();
+    const auto begin = Clock::now();
+    for (auto i = size_t{ }; i < count; ++i) {
+      const auto start = Clock::now();
+      if (!send(client.port(), i) || !client.wait_for_acknowledge()) {
+        std::fprintf(stderr, "%s failed\n", name);
+        return;
+      }
+      latencies.push_back(Nanoseconds(Clock::now() - start).count() / 1000);
+    }
+    const auto seconds = std::chrono::duration<double>(
+      Clock::now() - begin).count();
+    // of both threads
+    const auto cpu_seconds = static_cast<double>(std::clock() - cpu_begin) /
+      CLOCKS_PER_SEC;
+
+    std::sort(latencies.begin(), latencies.end());
+    const auto percentile = [&](double p) {
+      return latencies[static_cast<size_t>(p * (latencies.size() - 1))];
+    };
+    std::printf("%-14s %-22s %10.0f %10.2f %8.1f %8.1f %8.1f %10.1f %10.2f\n",
+      transport, name, static_cast<double>(count) / seconds,
+      static_cast<double>(count * message_size) / seconds / (1024 * 1024),
+      percentile(0.5), percentile(0.9), percentile(0.99), latencies.back(),
+      cpu_seconds * 1000000 / static_cast<double>(count));
+  }
+} // namespace
+
+int main(int argc, char* argv[]) {
+  auto message_count = size_t{ 20000 };
+  for (auto i = 1; i < argc; ++i)
+    if (!std::strcmp(argv[i], "--messages") && i + 1 < argc)
+      message_count = static_cast<size_t>(std::max(std::atoi(argv[++i]), 1));
+
+  auto server = Server();
+  if (!server.listen()) {
+    std::fprintf(stderr, "listening failed\n");
+    return 1;
+  }
+  auto server_thread = std::thread(&Server::run, &server);
+
+  auto client = Client();
+  if (!client.connect()) {
+    std::fprintf(stderr, "connecting failed\n");
+    server_thread.join();
+    return 1;
+  }
+#if !defined(_WIN32)
+  const auto transport = "shared ring";
+#else
+  const auto transport = "socket";
+#endif
+
+  print_header();
+
+  const auto indices = std::vector<int>{ 0, 2, 5 };
+  measure(client, transport, "active_contexts", message_count,
+    sizeof(MessageType) + sizeof(uint32_t) * (1 + indices.size()) +
+      sizeof(ContextSwitchTimes),
+    [&](ServerPort& port, size_t) {
+      return port.send_active_contexts(indices, { });
+    });
+
+  measure(client, transport, "set_virtual_key_state", message_count,
+    sizeof(MessageType) + sizeof(Key) + sizeof(KeyState),
+    [&](ServerPort& port, size_t i) {
+      return port.send_set_virtual_key_state(Key::first_virtual,
+        (i % 2 ? KeyState::Up : KeyState::Down));
+    });
+
+  const auto sequence = KeySequence{
+    { Key::ShiftLeft, KeyState::Down }, { Key::A, KeyState::Down },
+    { Key::A, KeyState::Up }, { Key::ShiftLeft, KeyState::Up },
+  };
+  measure(client, transport, "inject_input", message_count,
+    sizeof(MessageType) + sizeof(uint32_t) + sequence.size() * sizeof(KeyEvent),
+    [&](ServerPort& port, size_t) {
+      return port.send_inject_input(sequence);
+    });
+
+  for (auto [contexts, mappings] : { std::pair(10, 100), std::pair(100, 100),
+      std::pair(1000, 100) }) {
+    // more than the server caches, so each one is sent
+    auto configs = std::vector<Config>();
+    for (auto i = 0u; i < max_cached_configurations + 2; ++i)
+      configs.push_back(parse_config(generate_config(contexts, mappings,
+        static_cast<int>(i))));
+    auto serializer = Serializer();
+    ServerPort(ipc_id).write_config(serializer, configs[0]);
+    const auto size = std::to_string(contexts * mappings);
+    const auto count = std::max(message_count / (contexts * mappings),
+      size_t{ 10 });
+    measure(client, transport, ("configuration " + size).c_str(), count,
+      serializer.size(), [&](ServerPort& port, size_t i) {
+        return port.send_config(configs[i % configs.size()]);
+      });
+
+    // switching between two, which the server keeps
+    measure(client, transport, ("activate_config " + size).c_str(), count,
+      sizeof(MessageType) + sizeof(uint64_t), [&](ServerPort& port, size_t i) {
+        return port.send_config(configs[i % 2]);
+      });
+  }
+
+  client.disconnect();
+  server_thread.join();
+  return 0;
+}
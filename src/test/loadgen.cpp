@@ -0,0 +1,475 @@
+// Drives keymapperd with synthetic input through a uinput keyboard, which
+// it grabs like any other, and reads its output from the virtual device.
+// Usage: keymapper-loadgen [--rate <events/s>] [--duration <s>]
+//   [--keys <A,B,...>] [--script <file>] [--seed <n>] [--interval <s>]
+//   [--timeout <ms>]
+// Random key streams or the sequences of a script are sent at the rate,
+// the output rate, latency and the inputs without output (drops) are
+// reported each interval, together with the resident memory of keymapperd,
+// so it can run for hours as soak test. At the end the keys still down in
+// the output are reported as stuck. Latency is measured from sending an
+// input until the next output event, it is meaningful for configurations
+// which output at most one event per input, like plain remappings.
+// Needs the permissions to create uinput devices and read input devices.
+
+#include "config/ParseKeySequence.h"
+#include "config/get_key_name.h"
+#include "server/Statistics.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <linux/uinput.h>
+
+void message(const char* format, ...) { }
+void error(const char* format, ...) { }
+void verbose(const char* format, ...) { }
+
+namespace {
+  using Seconds = std::chrono::duration<double>;
+  using Microseconds = std::chrono::duration<double, std::micro>;
+
+  const auto source_device_name = "keymapper-loadgen";
+  const auto output_device_name = "Keymapper";
+  const auto grab_timeout = std::chrono::seconds(5);
+  // held at most at once by the random stream
+  const auto max_keys_down = size_t{ 3 };
+
+  struct Options {
+    double rate{ 1000 };
+    double duration{ 10 };
+    double interval{ 1 };
+    int timeout_ms{ 100 };
+    unsigned int seed{ std::random_device()() };
+    std::vector<Key> keys;
+    std::string script_filename;
+  };
+
+  struct Counters {
+    uint64_t sent;
+    uint64_t received;
+    uint64_t drops;
+    // output without pending input, e.g. of sequences or timeouts
+    uint64_t extra;
+    LatencyHistogram latency;
+  };
+
+  bool interpret_commandline(Options& options, int argc, char* argv[]) {
+    for (auto i = 1; i < argc; ++i) {
+      const auto argument = std::string_view(argv[i]);
+      if (i + 1 >= argc)
+        return false;
+      const auto value = argv[++i];
+      if (argument == "--rate")
+        options.rate = std::atof(value);
+      else if (argument == "--duration")
+        options.duration = std::atof(value);
+      else if (argument == "--interval")
+        options.interval = std::atof(value);
+      else if (argument == "--timeout")
+        options.timeout_ms = std::atoi(value);
+      else if (argument == "--seed")
+        options.seed = static_cast<unsigned int>(std::atoll(value));
+      else if (argument == "--script")
+        options.script_filename = value;
+      else if (argument == "--keys") {
+        auto names = std::string_view(value);
+        while (!names.empty()) {
+          const auto comma = std::min(names.find(','), names.size());
+          const auto key = get_key_by_name(names.substr(0, comma));
+          if (key == Key::none)
+            return false;
+          options.keys.push_back(key);
+          names.remove_prefix(std::min(comma + 1, names.size()));
+        }
+      }
+      else
+        return false;
+    }
+    return (options.rate > 0 && options.duration > 0 &&
+      options.interval > 0 && options.timeout_ms > 0);
+  }
+
+  // each line is a sequence in the notation of the configuration
+  bool read_script(const std::string& filename, KeySequence& script) try {
+    auto file = std::ifstream(filename);
+    if (!file.good())
+      return false;
+    auto parse = ParseKeySequence();
+    auto line = std::string();
+    while (std::getline(file, line))
+      if (!line.empty() && line.front() != '#')
+        for (const auto& event : parse(line, false))
+          if (event.state == KeyState::Down || event.state == KeyState::Up)
+            script.push_back(event);
+    return !script.empty();
+  }
+  catch (const std::exception& ex) {
+    std::fprintf(stderr, "%s: %s\n", filename.c_str(), ex.what());
+    return false;
+  }
+
+  int create_source_device() {
+    const auto fd = ::open("/dev/uinput", O_WRONLY | O_NONBLOCK);
+    if (fd < 0)
+      return -1;
+    auto uinput = uinput_setup{ };
+    std::strncpy(uinput.name, source_device_name, UINPUT_MAX_NAME_SIZE - 1);
+    uinput.id.bustype = BUS_VIRTUAL;
+    uinput.id.vendor = 0xD1CE;
+    uinput.id.product = 2;
+    ::ioctl(fd, UI_SET_EVBIT, EV_SYN);
+    ::ioctl(fd, UI_SET_EVBIT, EV_KEY);
+    for (auto i = KEY_ESC; i < KEY_NUMERIC_0; ++i)
+      ::ioctl(fd, UI_SET_KEYBIT, i);
+    if (::ioctl(fd, UI_DEV_SETUP, &uinput) < 0 ||
+        ::ioctl(fd, UI_DEV_CREATE) < 0) {
+      ::close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  // the event device with the name
+  int open_event_device(const char* name) {
+    auto ec = std::error_code{ };
+    for (const auto& entry :
+        std::filesystem::directory_iterator("/dev/input", ec)) {
+      if (entry.path().filename().string().rfind("event", 0) != 0)
+        continue;
+      const auto fd = ::open(entry.path().c_str(), O_RDONLY | O_NONBLOCK);
+      if (fd < 0)
+        continue;
+      auto device_name = std::array<char, 256>();
+      if (::ioctl(fd, EVIOCGNAME(device_name.size()), device_name.data()) >= 0 &&
+          std::strcmp(device_name.data(), name) == 0)
+        return fd;
+      ::close(fd);
+    }
+    return -1;
+  }
+
+  // keymapperd grabbed the device, when it can not be grabbed
+  bool wait_until_grabbed(const char* name) {
+    const auto deadline = Clock::now() + grab_timeout;
+    while (Clock::now() < deadline) {
+      const auto fd = open_event_device(name);
+      if (fd >= 0) {
+        const auto grabbed = (::ioctl(fd, EVIOCGRAB, 1) < 0 && errno == EBUSY);
+        if (!grabbed)
+          ::ioctl(fd, EVIOCGRAB, 0);
+        ::close(fd);
+        if (grabbed)
+          return true;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    return false;
+  }
+
+  bool write_key_event(int fd, const KeyEvent& event) {
+    input_event events[2] = { };
+    events[0].type = EV_KEY;
+    events[0].code = static_cast<unsigned short>(*event.key);
+    events[0].value = (event.state == KeyState::Down ? 1 : 0);
+    events[1].type = EV_SYN;
+    events[1].code = SYN_REPORT;
+    return (::write(fd, events, sizeof(events)) == sizeof(events));
+  }
+
+  std::vector<Key> get_keys_down(int fd) {
+    auto bits = std::array<uint8_t, (KEY_MAX + 7) / 8>();
+    auto keys = std::vector<Key>();
+    if (::ioctl(fd, EVIOCGKEY(bits.size()), bits.data()) < 0)
+      return keys;
+    for (auto code = 0; code < KEY_MAX; ++code)
+      if (bits[static_cast<size_t>(code / 8)] & (1 << (code % 8)))
+        keys.push_back(static_cast<Key>(code));
+    return keys;
+  }
+
+  // resident memory of keymapperd in KiB, 0 when it was not found
+  long get_server_resident_memory() {
+    auto ec = std::error_code{ };
+    for (const auto& entry : std::filesystem::directory_iterator("/proc", ec)) {
+      auto comm = std::ifstream(entry.path() / "comm");
+      auto name = std::string();
+      if (!std::getline(comm, name) || name != "keymapperd")
+        continue;
+      auto status = std::ifstream(entry.path() / "status");
+      auto line = std::string();
+      while (std::getline(status, line))
+        if (line.rfind("VmRSS:", 0) == 0)
+          return std::atol(line.c_str() + 6);
+    }
+    return 0;
+  }
+
+  // generates random presses and releases, without holding too many keys
+  class RandomStream {
+  public:
+    RandomStream(std::vector<Key> keys, unsigned int seed)
+      : m_keys(std::move(keys)), m_random(seed) {
+    }
+
+    KeyEvent next() {
+      const auto release = !m_down.empty() &&
+        (m_down.size() >= max_keys_down || m_random() % 2);
+      if (release) {
+        const auto index = m_random() % m_down.size();
+        const auto key = m_down[index];
+        m_down.erase(m_down.begin() + static_cast<std::ptrdiff_t>(index));
+        return { key, KeyState::Up };
+      }
+      auto key = m_keys[m_random() % m_keys.size()];
+      while (std::count(m_down.begin(), m_down.end(), key))
+        key = m_keys[m_random() % m_keys.size()];
+      m_down.push_back(key);
+      return { key, KeyState::Down };
+    }
+
+    const std::vector<Key>& keys_down() const { return m_down; }
+
+  private:
+    std::vector<Key> m_keys;
+    std::mt19937 m_random;
+    std::vector<Key> m_down;
+  };
+
+  // matches the output events with the inputs sent before
+  class OutputReader {
+  public:
+    OutputReader(int fd, Clock::duration timeout)
+      : m_fd(fd), m_timeout(timeout) {
+      auto clock_id = int{ CLOCK_MONOTONIC };
+      ::ioctl(m_fd, EVIOCSCLOCKID, &clock_id);
+    }
+
+    void start() { m_thread = std::thread(&OutputReader::run, this); }
+
+    void stop() {
+      m_stop.store(true);
+      m_thread.join();
+    }
+
+    void add_input(Clock::time_point time) {
+      auto lock = std::lock_guard(m_mutex);
+      m_pending.push_back(time);
+      ++m_counters.sent;
+    }
+
+    // the counters since the last call
+    Counters take_counters() {
+      auto lock = std::lock_guard(m_mutex);
+      expire_pending(Clock::now());
+      return std::exchange(m_counters, Counters{ });
+    }
+
+  private:
+    void run() {
+      auto events = std::array<input_event, 64>();
+      while (!m_stop.load()) {
+        auto pfd = pollfd{ m_fd, POLLIN, 0 };
+        if (::poll(&pfd, 1, 50) <= 0)
+          continue;
+        const auto result = ::read(m_fd, events.data(),
+          events.size() * sizeof(input_event));
+        if (result <= 0)
+          continue;
+        auto lock = std::lock_guard(m_mutex);
+        const auto count = static_cast<size_t>(result) / sizeof(input_event);
+        for (auto i = size_t{ }; i < count; ++i)
+          if (events[i].type == EV_KEY && events[i].value != 2)
+            add_output(get_event_time(events[i]));
+      }
+    }
+
+    static Clock::time_point get_event_time(const input_event& event) {
+      return Clock::time_point(std::chrono::duration_cast<Clock::duration>(
+        std::chrono::seconds(event.input_event_sec) +
+        std::chrono::microseconds(event.input_event_usec)));
+    }
+
+    void expire_pending(Clock::time_point now) {
+      while (!m_pending.empty() && now - m_pending.front() > m_timeout) {
+        m_pending.pop_front();
+        ++m_counters.drops;
+      }
+    }
+
+    void add_output(Clock::time_point time) {
+      ++m_counters.received;
+      expire_pending(time);
+      if (m_pending.empty() || m_pending.front() > time) {
+        ++m_counters.extra;
+        return;
+      }
+      m_counters.latency.record(time - m_pending.front());
+      m_pending.pop_front();
+    }
+
+    const int m_fd;
+    const Clock::duration m_timeout;
+    std::thread m_thread;
+    std::atomic<bool> m_stop{ };
+    std::mutex m_mutex;
+    std::deque<Clock::time_point> m_pending;
+    Counters m_counters{ };
+  };
+
+  void print_header() {
+    std::printf("%10s %10s %10s %8s %8s %9s %9s %9s %10s\n",
+      "elapsed s", "sent/s", "output/s", "drops", "extra",
+      "p50 us", "p99 us", "max us", "rss KiB");
+  }
+
+  void print_counters(double elapsed, double interval, const Counters& c) {
+    const auto us = [](Clock::duration duration) {
+      return Microseconds(duration).count();
+    };
+    std::printf("%10.1f %10.0f %10.0f %8llu %8llu %9.1f %9.1f %9.1f %10ld\n",
+      elapsed, static_cast<double>(c.sent) / interval,
+      static_cast<double>(c.received) / interval,
+      static_cast<unsigned long long>(c.drops),
+      static_cast<unsigned long long>(c.extra),
+      us(c.latency.percentile(0.5)), us(c.latency.percentile(0.99)),
+      us(c.latency.max()), get_server_resident_memory());
+    std::fflush(stdout);
+  }
+} // namespace
+
+int main(int argc, char* argv[]) {
+  auto options = Options();
+  if (!interpret_commandline(options, argc, argv)) {
+    std::fprintf(stderr, "Usage: keymapper-loadgen [--rate <events/s>] "
+      "[--duration <s>] [--keys <A,B,...>] [--script <file>] [--seed <n>] "
+      "[--interval <s>] [--timeout <ms>]\n");
+    return 1;
+  }
+  if (options.keys.empty())
+    for (auto name = 'A'; name <= 'Z'; ++name)
+      options.keys.push_back(get_key_by_name(std::string(1, name)));
+
+  auto script = KeySequence();
+  if (!options.script_filename.empty() &&
+      !read_script(options.script_filename, script)) {
+    std::fprintf(stderr, "Reading script '%s' failed\n",
+      options.script_filename.c_str());
+    return 1;
+  }
+
+  const auto output_fd = open_event_device(output_device_name);
+  if (output_fd < 0) {
+    std::fprintf(stderr, "Opening the output device of keymapperd failed\n");
+    return 1;
+  }
+  const auto source_fd = create_source_device();
+  if (source_fd < 0) {
+    std::fprintf(stderr, "Creating uinput device failed\n");
+    return 1;
+  }
+  if (!wait_until_grabbed(source_device_name)) {
+    std::fprintf(stderr, "keymapperd did not grab the device\n");
+    ::ioctl(source_fd, UI_DEV_DESTROY);
+    return 1;
+  }
+
+  auto reader = OutputReader(output_fd, std::chrono::milliseconds(
+    options.timeout_ms));
+  reader.start();
+  auto stream = RandomStream(options.keys, options.seed);
+  auto script_position = size_t{ };
+  auto script_keys_down = std::vector<Key>();
+  const auto next_event = [&]() {
+    if (script.empty())
+      return stream.next();
+    const auto event = script[script_position];
+    script_position = (script_position + 1) % script.size();
+    if (event.state == KeyState::Down)
+      script_keys_down.push_back(event.key);
+    else
+      script_keys_down.erase(std::remove(script_keys_down.begin(),
+        script_keys_down.end(), event.key), script_keys_down.end());
+    return event;
+  };
+
+  print_header();
+  const auto period = std::chrono::duration_cast<Clock::duration>(
+    Seconds(1.0 / options.rate));
+  const auto interval = std::chrono::duration_cast<Clock::duration>(
+    Seconds(options.interval));
+  const auto start = Clock::now();
+  const auto end = start + std::chrono::duration_cast<Clock::duration>(
+    Seconds(options.duration));
+  auto next_send = start;
+  auto next_report = start + interval;
+  auto total = Counters{ };
+  const auto report = [&](Clock::time_point now) {
+    const auto counters = reader.take_counters();
+    total.sent += counters.sent;
+    total.received += counters.received;
+    total.drops += counters.drops;
+    total.extra += counters.extra;
+    print_counters(Seconds(now - start).count(), options.interval, counters);
+  };
+
+  auto write_failures = uint64_t{ };
+  while (next_send < end) {
+    // catch up, when sleeping overshot
+    const auto now = Clock::now();
+    while (next_send <= now && next_send < end) {
+      if (write_key_event(source_fd, next_event()))
+        reader.add_input(Clock::now());
+      else
+        ++write_failures;
+      next_send += period;
+    }
+    if (now >= next_report) {
+      report(now);
+      next_report += interval;
+    }
+    std::this_thread::sleep_until(std::min(next_send, next_report));
+  }
+
+  // release what is still held and let the output settle
+  const auto& keys_down = (script.empty() ? stream.keys_down() :
+    script_keys_down);
+  for (auto key : std::vector<Key>(keys_down))
+    if (write_key_event(source_fd, { key, KeyState::Up }))
+      reader.add_input(Clock::now());
+  std::this_thread::sleep_for(std::chrono::milliseconds(
+    std::max(options.timeout_ms, 200)));
+  report(Clock::now());
+  reader.stop();
+
+  const auto stuck_keys = get_keys_down(output_fd);
+  std::printf("sent %llu, output %llu, drops %llu, extra %llu, "
+    "write failures %llu, stuck keys %zu",
+    static_cast<unsigned long long>(total.sent),
+    static_cast<unsigned long long>(total.received),
+    static_cast<unsigned long long>(total.drops),
+    static_cast<unsigned long long>(total.extra),
+    static_cast<unsigned long long>(write_failures), stuck_keys.size());
+  for (auto key : stuck_keys)
+    std::printf(" %s", get_key_name(key));
+  std::printf("\n");
+
+  ::ioctl(source_fd, UI_DEV_DESTROY);
+  ::close(source_fd);
+  ::close(output_fd);
+  return (stuck_keys.empty() ? 0 : 2);
+}
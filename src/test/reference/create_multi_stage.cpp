@@ -0,0 +1,143 @@
+
+#include "create_multi_stage.h"
+#include <algorithm>
+
+namespace reference {
+
+namespace {
+  bool contains(const KeySequence& sequence, Key key) {
+    return std::find_if(cbegin(sequence), cend(sequence),
+      [&](const KeyEvent& event) {
+        return event.key == key;
+      }) != cend(sequence);
+  }
+
+  void replace_key(KeySequence& sequence, Key both, Key key) {
+    std::for_each(begin(sequence), end(sequence),
+      [&](KeyEvent& event) {
+        if (event.key == both)
+          event.key = key;
+      });
+  }
+
+  bool has_filter(const Config::Context& context) {
+    return (context.window_class_filter || context.window_title_filter ||
+      context.window_path_filter || context.device_filter ||
+      context.device_id_filter || !context.modifier_filter.empty());
+  }
+
+  void prepend_forward_modifier_mappings(Config& config) {
+    if (config.forward_modifiers.empty())
+      return;
+    auto& contexts = config.contexts;
+    for (auto it = contexts.begin(); it != contexts.end(); ++it)
+      if (it->begin_stage || it == contexts.begin()) {
+        // in the first release a stage began with an unfiltered context
+        if (has_filter(*it)) {
+          it->begin_stage = false;
+          it = contexts.insert(it, Config::Context{ });
+          it->begin_stage = true;
+          it->system_filter_matched = true;
+        }
+        auto& context = *it;
+        for (auto key = config.forward_modifiers.rbegin(); 
+             key != config.forward_modifiers.rend(); ++key) {
+          context.inputs.insert(context.inputs.begin(), {
+            KeySequence{ 
+              KeyEvent(*key, KeyState::Down),
+              KeyEvent(*key, KeyState::UpAsync)
+            },
+            static_cast<int>(context.outputs.size())
+          });
+          context.outputs.push_back({
+            KeyEvent(*key, KeyState::Down)
+          });
+        }
+      }
+  }
+
+  // the Not keys were already replaced by the parser
+  void replace_logical_key(Config& config, Key both, Key left, Key right) {
+    auto& contexts = config.contexts;
+    for (auto& context : contexts) {
+      // duplicate command and replace the logical with a physical key
+      for (auto it = begin(context.inputs); it != end(context.inputs); ++it)
+        if (contains(it->input, both)) {
+          // duplicate and replace with <left> and <right>
+          it = context.inputs.insert(it, *it);
+          replace_key(it->input, both, left);
+          ++it;
+          replace_key(it->input, both, right);
+
+          // when directly mapped output also contains logical key,
+          // then duplicate output and replace with <right>
+          if (it->output_index >= 0) {
+            auto& output = context.outputs[it->output_index];
+            if (contains(output, both)) {
+              it->output_index = static_cast<int>(context.outputs.size());
+              context.outputs.push_back(output);
+              replace_key(context.outputs.back(), both, right);
+            }
+          }
+        }
+
+      // replace logical key with <left>
+      for (auto& output : context.outputs)
+        replace_key(output, both, left);
+      for (auto& command : context.command_outputs)
+        replace_key(command.output, both, left);
+    }
+
+    // insert fallthrough context and replace the logical with a physical key
+    for (auto it = begin(contexts); it != end(contexts); ++it) {
+      if (contains(it->modifier_filter, both)) {
+        // duplicate and replace with <left> and <right>
+        it = contexts.insert(it, *it);
+        it->inputs.clear();
+        it->outputs.clear();
+        it->command_outputs.clear();
+        it->fallthrough = true;
+        replace_key(it->modifier_filter, both, left);
+        ++it;
+        replace_key(it->modifier_filter, both, right);
+        // unlike the first release, the stage begins with the inserted context
+        it->begin_stage = false;
+      }
+    }
+  }
+} // namespace
+
+MultiStagePtr create_multi_stage(Config config) {
+  prepend_forward_modifier_mappings(config);
+
+  // replace logical keys (in reverse order of registration)
+  const auto& definitions = config.logical_keys.definitions();
+  for (auto it = definitions.rbegin(); it != definitions.rend(); ++it)
+    replace_logical_key(config, it->logical, it->left, it->right);
+
+  auto stages = std::vector<StagePtr>();
+  auto contexts = std::vector<Stage::Context>();
+  for (auto& config_context : config.contexts) {
+    if (config_context.begin_stage && !contexts.empty())
+      stages.push_back(std::make_unique<Stage>(std::exchange(contexts, { })));
+
+    auto& context = contexts.emplace_back();
+    for (auto& input : config_context.inputs)
+      context.inputs.push_back({ std::move(input.input), input.output_index });
+    context.outputs = std::move(config_context.outputs);
+    for (auto& command : config_context.command_outputs)
+      context.command_outputs.push_back({ std::move(command.output),
+        command.index });
+    context.device_filter = std::move(config_context.device_filter);
+    context.device_id_filter = std::move(config_context.device_id_filter);
+    context.modifier_filter = std::move(config_context.modifier_filter);
+    context.invert_modifier_filter = config_context.invert_modifier_filter;
+    context.fallthrough = config_context.fallthrough;
+  }
+  if (!contexts.empty())
+    stages.push_back(std::make_unique<Stage>(std::move(contexts)));
+
+  return std::make_unique<MultiStage>(std::move(stages));
+}
+
+} // namespace reference
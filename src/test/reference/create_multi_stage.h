@@ -0,0 +1,12 @@
+#pragma once
+
+#include "MultiStage.h"
+#include "config/Config.h"
+
+namespace reference {
+
+// converts the configuration to the form the first release's parser
+// produced, with duplicated mappings for logical keys
+MultiStagePtr create_multi_stage(Config config);
+
+} // namespace reference
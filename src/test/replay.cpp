@@ -0,0 +1,315 @@
+
+// Replays an input trace recorded with keymapperd --record.
+// Usage: keymapper-replay <trace> <config> [<other-config>] [--output <file>]
+//                         [--parallel]
+// Reports the throughput and latency, and the events for which the output
+// of two configurations differs. Writing the output of two builds to files
+// allows to compare them. Device filters are not evaluated, since the trace
+// contains no device descriptions. With --parallel the configurations are
+// replayed on separate threads, which only share the trace.
+
+#include "config/ParseConfig.h"
+#include "config/get_key_name.h"
+#include "runtime/MultiStage.h"
+#include "runtime/Timeout.h"
+#include "server/InputTrace.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+void message(const char* format, ...) { }
+void error(const char* format, ...) { }
+void verbose(const char* format, ...) { }
+
+namespace {
+  using Nanoseconds = std::chrono::duration<double, std::nano>;
+  using Microseconds = std::chrono::duration<double, std::micro>;
+
+  const auto max_printed_divergences = 10;
+
+  struct Replay {
+    // output of each input event, including injected timeouts
+    std::vector<KeySequence> outputs;
+    std::vector<double> latencies;
+    Nanoseconds total{ };
+    size_t injected_timeouts{ };
+    size_t configurations{ };
+    size_t hash_mismatches{ };
+  };
+
+  std::optional<Config> read_config(const char* filename) try {
+    auto stream = std::ifstream(filename);
+    if (!stream.good()) {
+      std::fprintf(stderr, "Opening configuration '%s' failed\n", filename);
+      return { };
+    }
+    return ParseConfig()(stream);
+  }
+  catch (const std::exception& ex) {
+    std::fprintf(stderr, "%s: %s\n", filename, ex.what());
+    return { };
+  }
+
+  MultiStagePtr create_stage(const Config& config) {
+    auto stages = std::vector<StagePtr>();
+    auto contexts = std::vector<Stage::Context>();
+    for (const auto& config_context : config.contexts) {
+      if (!contexts.empty() && config_context.begin_stage)
+        stages.push_back(std::make_unique<Stage>(
+          std::exchange(contexts, { }), config.logical_keys,
+          config.forward_modifiers));
+
+      auto& context = contexts.emplace_back();
+      for (const auto& input : config_context.inputs)
+        context.inputs.push_back({ input.input, input.output_index });
+      context.outputs = config_context.outputs;
+      for (const auto& output : config_context.command_outputs)
+        context.command_outputs.push_back({ output.output, output.index });
+      context.device_filter = config_context.device_filter;
+      context.device_id_filter = config_context.device_id_filter;
+      context.modifier_filter = config_context.modifier_filter;
+      context.invert_modifier_filter = config_context.invert_modifier_filter;
+      context.fallthrough = config_context.fallthrough;
+    }
+    if (!contexts.empty())
+      stages.push_back(std::make_unique<Stage>(std::move(contexts),
+        config.logical_keys, config.forward_modifiers));
+    return std::make_unique<MultiStage>(std::move(stages));
+  }
+
+  std::optional<std::vector<InputTraceRecord>> read_trace(const char* filename) {
+    auto reader = InputTraceReader();
+    if (!reader.open(filename)) {
+      std::fprintf(stderr, "Opening trace '%s' failed\n", filename);
+      return { };
+    }
+    auto records = std::vector<InputTraceRecord>();
+    auto record = InputTraceRecord{ };
+    while (reader.read(record))
+      records.push_back(record);
+    return records;
+  }
+
+  // the stages receive the input with the elapsed time of the recording,
+  // timeouts are replied like the server does, but without waiting
+  Replay replay(const std::vector<InputTraceRecord>& records,
+      const Config& config) {
+    auto result = Replay{ };
+    auto stage = create_stage(config);
+    const auto hash = get_configuration_hash(*stage);
+    auto output = KeySequence();
+    auto timeout_pending = false;
+    auto timeout_start = uint64_t{ };
+    auto timeout = uint64_t{ };
+    auto cancel_on_up = false;
+
+    const auto update = [&](KeyEvent event, int device_index) {
+      const auto start = Clock::now();
+      stage->update(event, device_index, output);
+      const auto elapsed = Nanoseconds(Clock::now() - start);
+      result.latencies.push_back(elapsed.count());
+      result.total += elapsed;
+
+      if (!output.empty() && output.back().key == Key::timeout) {
+        timeout = static_cast<uint64_t>(Microseconds(
+          timeout_to_milliseconds(output.back().value)).count());
+        cancel_on_up = cancel_timeout_on_up(output.back().state);
+        output.pop_back();
+        timeout_pending = true;
+        return true;
+      }
+      return false;
+    };
+
+    const auto inject_timeout = [&](uint64_t elapsed) {
+      timeout_pending = false;
+      ++result.injected_timeouts;
+      return update(make_input_timeout_event(
+        Microseconds(static_cast<double>(elapsed))), Stage::any_device_index);
+    };
+
+    for (const auto& record : records) {
+      switch (record.type) {
+        case InputTraceRecord::Type::configuration:
+          ++result.configurations;
+          if (record.configuration_hash != hash)
+            ++result.hash_mismatches;
+          stage = create_stage(config);
+          timeout_pending = false;
+          break;
+
+        case InputTraceRecord::Type::active_contexts: {
+          auto indices = std::vector<int>();
+          for (auto index : record.active_contexts)
+            if (index >= 0 &&
+                static_cast<size_t>(index) < stage->context_count())
+              indices.push_back(index);
+          stage->set_active_client_contexts(indices);
+          break;
+        }
+
+        case InputTraceRecord::Type::input: {
+          // timeouts of the recording are replaced by the replayed ones
+          if (record.event.key == Key::timeout)
+            break;
+
+          output.clear();
+          if (timeout_pending) {
+            const auto elapsed = record.time -
+              std::min(timeout_start, record.time);
+            if (elapsed >= timeout ||
+                record.event.state == KeyState::Down || cancel_on_up)
+              if (inject_timeout(std::min(elapsed, timeout)))
+                timeout_start = record.time;
+          }
+          if (update(record.event, record.device_index))
+            timeout_start = record.time;
+          result.outputs.push_back(output);
+          break;
+        }
+      }
+    }
+    return result;
+  }
+
+  std::string format_sequence(const KeySequence& sequence) {
+    auto string = std::string();
+    for (const auto& event : sequence) {
+      if (!string.empty())
+        string.push_back(' ');
+      string.push_back(event.state == KeyState::Down ? '+' :
+        event.state == KeyState::Up ? '-' : '~');
+      if (auto name = get_key_name(event.key))
+        string += name;
+      else
+        string += std::to_string(static_cast<int>(event.key));
+    }
+    return string;
+  }
+
+  void print_result(const char* name, Replay& result) {
+    auto& latencies = result.latencies;
+    if (latencies.empty())
+      return;
+    std::sort(latencies.begin(), latencies.end());
+    const auto percentile = [&](double p) {
+      return latencies[static_cast<size_t>(p * (latencies.size() - 1))];
+    };
+    std::printf("%-24s %12.0f %8.0f %8.0f %8.0f %8.0f %10.0f\n",
+      name, static_cast<double>(latencies.size()) /
+        std::chrono::duration<double>(result.total).count(),
+      percentile(0.5), percentile(0.9), percentile(0.99),
+      percentile(0.999), latencies.back());
+    if (result.hash_mismatches)
+      std::printf("  %zu of %zu recorded configurations differ from '%s'\n",
+        result.hash_mismatches, result.configurations, name);
+  }
+
+  bool write_output(const char* filename,
+      const std::vector<InputTraceRecord>& records, const Replay& result) {
+    auto file = std::ofstream(filename);
+    auto index = size_t{ };
+    for (const auto& record : records)
+      if (record.type == InputTraceRecord::Type::input &&
+          record.event.key != Key::timeout)
+        file << record.time << " " << format_sequence({ record.event }) <<
+          " >> " << format_sequence(result.outputs[index++]) << "\n";
+    return file.good();
+  }
+
+  void print_divergence(const std::vector<InputTraceRecord>& records,
+      const char* name_a, const Replay& a,
+      const char* name_b, const Replay& b) {
+    auto index = size_t{ };
+    auto divergences = size_t{ };
+    for (const auto& record : records) {
+      if (record.type != InputTraceRecord::Type::input ||
+          record.event.key == Key::timeout)
+        continue;
+      const auto& output_a = a.outputs[index];
+      const auto& output_b = b.outputs[index];
+      ++index;
+      if (output_a == output_b)
+        continue;
+      if (++divergences <= max_printed_divergences)
+        std::printf("event %zu at %.3fs %s:\n  %s >> %s\n  %s >> %s\n",
+          index - 1, static_cast<double>(record.time) / 1000000.0,
+          format_sequence({ record.event }).c_str(),
+          name_a, format_sequence(output_a).c_str(),
+          name_b, format_sequence(output_b).c_str());
+    }
+    std::printf("%zu of %zu events produced different output\n",
+      divergences, index);
+  }
+} // namespace
+
+int main(int argc, char* argv[]) {
+  auto filenames = std::vector<const char*>();
+  auto output_filename = static_cast<const char*>(nullptr);
+  auto parallel = false;
+  for (auto i = 1; i < argc; ++i) {
+    if (!std::strcmp(argv[i], "--output") && i + 1 < argc)
+      output_filename = argv[++i];
+    else if (!std::strcmp(argv[i], "--parallel"))
+      parallel = true;
+    else
+      filenames.push_back(argv[i]);
+  }
+  if (filenames.size() < 2 || filenames.size() > 3) {
+    std::fprintf(stderr, "Usage: keymapper-replay <trace> <config> "
+      "[<other-config>] [--output <file>] [--parallel]\n");
+    return 1;
+  }
+
+  const auto records = read_trace(filenames[0]);
+  if (!records)
+    return 1;
+
+  auto configs = std::vector<Config>();
+  for (auto i = size_t{ 1 }; i < filenames.size(); ++i) {
+    auto config = read_config(filenames[i]);
+    if (!config)
+      return 1;
+    configs.push_back(std::move(*config));
+  }
+
+  // each replay has its own stages
+  auto results = std::vector<Replay>(configs.size());
+  auto threads = std::vector<std::thread>();
+  for (auto i = size_t{ }; i < configs.size(); ++i) {
+    const auto run = [&, i]() { results[i] = replay(*records, configs[i]); };
+    if (parallel)
+      threads.emplace_back(run);
+    else
+      run();
+  }
+  for (auto& thread : threads)
+    thread.join();
+
+  const auto& first = results.front();
+  std::printf("%zu events, %zu injected timeouts, %.3fs recorded\n",
+    first.outputs.size(), first.injected_timeouts,
+    records->empty() ? 0.0 :
+      static_cast<double>(records->back().time) / 1000000.0);
+  std::printf("%-24s %12s %8s %8s %8s %8s %10s\n",
+    "configuration", "events/s", "p50 ns", "p90 ns",
+    "p99 ns", "p99.9 ns", "max ns");
+  for (auto i = size_t{ }; i < results.size(); ++i)
+    print_result(filenames[i + 1], results[i]);
+
+  if (results.size() == 2)
+    print_divergence(*records, filenames[1], results[0],
+      filenames[2], results[1]);
+
+  if (output_filename && !write_output(output_filename, *records, first)) {
+    std::fprintf(stderr, "Writing output '%s' failed\n", output_filename);
+    return 1;
+  }
+  return 0;
+}
@@ -7,6 +7,7 @@
 #include "config/ParseConfig.h"
 #include "runtime/Key.h"
 #include "runtime/Timeout.h"
+#include "test/reference/create_multi_stage.h"
 
 namespace {
   struct Stream : std::stringstream {
@@ -22,6 +23,8 @@ namespace {
   };
 } // namespace
 
+bool g_verbose_output = false;
+
 void message(const char* format, ...) { }
 void error(const char* format, ...) { }
 void verbose(const char* format, ...) {
@@ -60,6 +63,9 @@ std::ostream& operator<<(std::ostream& os, const KeyEvent& event) {
   else if (auto name = get_key_name(event.key)) {
     os << name;
   }
+  else if (is_logical_key(event.key)) {
+    os << "Logical" << (*event.key - *Key::first_logical);
+  }
   else if (event.key != Key::none) {
     os << "???";
   }
@@ -134,7 +140,8 @@ Stage create_stage(const char* string, bool activate_all_contexts) {
     context.modifier_filter = std::move(config_context.modifier_filter);
     context.fallthrough = config_context.fallthrough;
   }
-  auto stage = Stage(std::move(contexts));
+  auto stage = Stage(std::move(contexts), config.logical_keys,
+    config.forward_modifiers);
 
   if (activate_all_contexts) {
     auto active_contexts = std::vector<int>();
@@ -154,7 +161,8 @@ MultiStagePtr create_multi_stage(const char* string) {
   auto contexts = std::vector<Stage::Context>();
   for (auto& config_context : config.contexts) {
     if (!contexts.empty() && config_context.begin_stage) {
-      stages.push_back(std::make_unique<Stage>(std::move(contexts)));
+      stages.push_back(std::make_unique<Stage>(std::move(contexts),
+        config.logical_keys, config.forward_modifiers));
       contexts.clear();
     }
   
@@ -170,11 +178,18 @@ MultiStagePtr create_multi_stage(const char* string) {
     context.fallthrough = config_context.fallthrough;
   }
   if (!contexts.empty())
-    stages.push_back(std::make_unique<Stage>(std::move(contexts)));
+    stages.push_back(std::make_unique<Stage>(std::move(contexts),
+      config.logical_keys, config.forward_modifiers));
 
   return std::make_unique<MultiStage>(std::move(stages));
 }
 
+reference::MultiStagePtr create_reference_multi_stage(const char* string) {
+  static auto parse_config = ParseConfig();
+  auto stream = std::stringstream(string);
+  return reference::create_multi_stage(parse_config(stream));
+}
+
 KeyEvent reply_timeout_ms(int timeout_ms) {
   return KeyEvent(Key::timeout, KeyState::Up,
     duration_to_timeout(std::chrono::milliseconds(timeout_ms)));
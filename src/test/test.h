@@ -5,6 +5,7 @@
 #include "catch.hpp"
 #include "runtime/Key.h"
 #include "runtime/MultiStage.h"
+#include "test/reference/MultiStage.h"
 
 KeySequence parse_input(const char* input);
 KeySequence parse_output(const char* output);
@@ -21,6 +22,7 @@ std::string format_list(const std::vector<Key>& keys);
 
 Stage create_stage(const char* config, bool activate_all_contexts = true);
 MultiStagePtr create_multi_stage(const char* config);
+reference::MultiStagePtr create_reference_multi_stage(const char* config);
 
 KeyEvent reply_timeout_ms(int timeout_ms);
 KeyEvent make_timeout_ms(int timeout_ms, bool cancel_on_up);
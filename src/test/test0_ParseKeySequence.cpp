@@ -829,6 +829,11 @@ TEST_CASE("Output string", "[ParseKeySequence]") {
   CHECK_THROWS(parse_output("'B'{A}"));
   CHECK_THROWS(parse_output("('B' A)"));
   CHECK_THROWS(parse_output("!'B'"));
+
+  // characters which can not be typed are skipped
+  CHECK(parse_output("'a\xC3\xA4\xE2\x82\xAC" "b'") == parse_output("'ab'"));
+  CHECK_THROWS(parse_output("'a\xFF" "b'"));
+  CHECK_THROWS(parse_output("'a\xC3'"));
 }
 
 //--------------------------------------------------------------------
@@ -1,6 +1,11 @@
 
 #include "test.h"
+#include "client/FocusLog.h"
 #include "config/ParseConfig.h"
+#include "config/ContextMatcher.h"
+#include "config/OptimizeConfig.h"
+#include <filesystem>
+#include <fstream>
 
 namespace {
   Config parse_config(const char* config) {
@@ -326,6 +331,93 @@ TEST_CASE("Config directives", "[ParseConfig]") {
 
 //--------------------------------------------------------------------
 
+TEST_CASE("Inject rate directive", "[ParseConfig]") {
+  auto config = parse_config(R"(
+    @inject-rate 20
+    A >> B
+  )");
+  CHECK(config.server_directives == std::vector<std::string>{ "inject-rate 20" });
+  CHECK_NOTHROW(parse_config(R"(@inject-rate 0)"));
+  CHECK_THROWS(parse_config(R"(@inject-rate)"));
+  CHECK_THROWS(parse_config(R"(@inject-rate fast)"));
+  CHECK(parse_config(R"(@wheel-aggregation 10)").server_directives ==
+    std::vector<std::string>{ "wheel-aggregation 10" });
+  CHECK_THROWS(parse_config(R"(@wheel-aggregation)"));
+  CHECK(parse_config(R"(@optimize-output)").server_directives ==
+    std::vector<std::string>{ "optimize-output" });
+  CHECK(parse_config(R"(@optimize-output false)").server_directives.empty());
+  CHECK(parse_config(R"(@concurrent-output)").server_directives ==
+    std::vector<std::string>{ "concurrent-output" });
+  CHECK(parse_config(R"(@early-output)").server_directives ==
+    std::vector<std::string>{ "early-output" });
+  CHECK(parse_config(R"(@match-engine indexed)").server_directives ==
+    std::vector<std::string>{ "match-engine indexed" });
+  CHECK_THROWS(parse_config(R"(@match-engine)"));
+  CHECK_THROWS(parse_config(R"(@match-engine fast)"));
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("ContextActive toggle cycles", "[ParseConfig]") {
+  CHECK_NOTHROW(parse_config(R"(
+    [title="Firefox"]
+    ContextActive >> Virtual1 ^ Virtual1
+
+    [modifier="Virtual1"]
+    ContextActive >> Virtual2
+  )"));
+
+  CHECK_THROWS_WITH(parse_config(R"(
+    [modifier="!Virtual1"]
+    ContextActive >> Virtual1 ^ Virtual1
+  )"), "ContextActive toggles Virtual1 in a cycle in line 3");
+
+  CHECK_THROWS_WITH(parse_config(R"(
+    [modifier="Virtual1"]
+    ContextActive >> Virtual2
+
+    [modifier="!Virtual2"]
+    ContextActive >> toggle
+
+    [default]
+    toggle >> Virtual1
+  )"), "ContextActive toggles Virtual1 in a cycle in line 6");
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Profile directive and line numbers", "[ParseConfig]") {
+  auto config = parse_config(R"(
+    @profile
+    A >> B
+
+    C >> command
+    [title="Test"]
+    D >> E
+    command >> F
+  )");
+  CHECK(config.server_directives == std::vector<std::string>{ "profile" });
+  REQUIRE(config.contexts.size() == 2);
+  REQUIRE(config.contexts[0].inputs.size() == 2);
+  CHECK(config.contexts[0].inputs[0].line_no == 3);
+  CHECK(config.contexts[0].inputs[1].line_no == 5);
+  REQUIRE(config.contexts[1].inputs.size() == 1);
+  CHECK(config.contexts[1].inputs[0].line_no == 7);
+  CHECK(parse_config("@profile false").server_directives.empty());
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Title update interval directive", "[ParseConfig]") {
+  CHECK(parse_config("A >> B").title_update_interval_ms == 100);
+  CHECK(parse_config("@title-update-interval 250").title_update_interval_ms == 250);
+  CHECK(parse_config("@title-update-interval 0").title_update_interval_ms == 0);
+  CHECK_THROWS(parse_config("@title-update-interval"));
+  CHECK_THROWS(parse_config("@title-update-interval fast"));
+}
+
+//--------------------------------------------------------------------
+
 TEST_CASE("Forward modifiers directive", "[ParseConfig]") {
   CHECK_NOTHROW(parse_config(R"(
     @forward-modifiers
@@ -356,32 +448,21 @@ TEST_CASE("Forward modifiers directive", "[ParseConfig]") {
   const auto& c0 = config.contexts[0];
   const auto& c1 = config.contexts[1];
   const auto& c2 = config.contexts[2];
-  REQUIRE(c0.inputs.size() == 11);
-  REQUIRE(c0.outputs.size() == 6);
+  // forwarded by the stage, no mappings are inserted
+  CHECK(config.forward_modifiers == std::vector<Key>{ Key::ShiftLeft,
+    Key::ShiftRight, Key::ControlLeft, Key::ControlRight, Key::AltLeft });
+  REQUIRE(c0.inputs.size() == 4);
+  REQUIRE(c0.outputs.size() == 1);
   REQUIRE(c0.command_outputs.size() == 1);
-  // inputs are inserted at the front
-  CHECK(format_sequence(c0.inputs[0].input) == "+ShiftLeft ~ShiftLeft");
-  CHECK(format_sequence(c0.inputs[1].input) == "+ShiftRight ~ShiftRight");
-  CHECK(format_sequence(c0.inputs[2].input) == "+ControlLeft ~ControlLeft");
-  CHECK(format_sequence(c0.inputs[3].input) == "+ControlRight ~ControlRight");
-  CHECK(format_sequence(c0.inputs[4].input) == "+AltLeft ~AltLeft");
-  CHECK(format_sequence(c0.inputs[5].input) == "+ControlLeft +A ~A ~ControlLeft");
-  CHECK(format_sequence(c0.inputs[6].input) == "+ControlRight +A ~A ~ControlRight");
-  CHECK(format_sequence(c0.inputs[7].input) == "+ControlLeft +B ~B ~ControlLeft");
-  CHECK(format_sequence(c0.inputs[8].input) == "+ControlRight +B ~B ~ControlRight");
-  CHECK(format_sequence(c0.inputs[9].input) == "+ControlLeft +C ~C ~ControlLeft");
-  CHECK(format_sequence(c0.inputs[10].input) == "+AltLeft +D ~D ~AltLeft");
+  CHECK(format_sequence(c0.inputs[0].input) == "+Control +A ~A ~Control");
+  CHECK(format_sequence(c0.inputs[1].input) == "+Control +B ~B ~Control");
+  CHECK(format_sequence(c0.inputs[2].input) == "+ControlLeft +C ~C ~ControlLeft");
+  CHECK(format_sequence(c0.inputs[3].input) == "+AltLeft +D ~D ~AltLeft");
   // forwarded modifiers in input are suppressed in output
   CHECK(format_sequence(c0.command_outputs[0].output) == 
     "!AltLeft !ControlRight !ControlLeft +ShiftLeft +Y -Y -ShiftLeft");
   CHECK(format_sequence(c0.outputs[0]) == 
     "!ControlRight !ControlLeft +ShiftLeft +X -X -ShiftLeft");
-  // outputs are prepended (in reverse order)
-  CHECK(format_sequence(c0.outputs[1]) == "+AltLeft");
-  CHECK(format_sequence(c0.outputs[2]) == "+ControlRight");
-  CHECK(format_sequence(c0.outputs[3]) == "+ControlLeft");
-  CHECK(format_sequence(c0.outputs[4]) == "+ShiftRight");
-  CHECK(format_sequence(c0.outputs[5]) == "+ShiftLeft");
 
   REQUIRE(c1.inputs.size() == 0);
   REQUIRE(c1.outputs.size() == 0);
@@ -389,16 +470,10 @@ TEST_CASE("Forward modifiers directive", "[ParseConfig]") {
   CHECK(format_sequence(c1.command_outputs[0].output) == 
     "!AltLeft !ControlRight +ControlLeft +Z -Z -ControlLeft");
 
-  // modifiers are forwarded in each stage
-  REQUIRE(c2.inputs.size() == 6);
-  REQUIRE(c2.outputs.size() == 6);
+  REQUIRE(c2.inputs.size() == 1);
+  REQUIRE(c2.outputs.size() == 1);
   REQUIRE(c2.command_outputs.empty());
-  CHECK(format_sequence(c2.inputs[0].input) == "+ShiftLeft ~ShiftLeft");
-  CHECK(format_sequence(c2.inputs[1].input) == "+ShiftRight ~ShiftRight");
-  CHECK(format_sequence(c2.inputs[2].input) == "+ControlLeft ~ControlLeft");
-  CHECK(format_sequence(c2.inputs[3].input) == "+ControlRight ~ControlRight");
-  CHECK(format_sequence(c2.inputs[4].input) == "+AltLeft ~AltLeft");
-  CHECK(format_sequence(c2.inputs[5].input) == "+ShiftRight +X ~X ~ShiftRight");
+  CHECK(format_sequence(c2.inputs[0].input) == "+ShiftRight +X ~X ~ShiftRight");
   CHECK(format_sequence(c2.outputs[0]) == "!ShiftRight +Z");
 }
 
@@ -752,12 +827,11 @@ TEST_CASE("Macros", "[ParseConfig]") {
     Alt{B} >> Y
   )";
   REQUIRE_NOTHROW(config = parse_config(string));
-  REQUIRE(config.contexts[0].inputs.size() == 3);
+  REQUIRE(config.contexts[0].inputs.size() == 2);
   REQUIRE(config.contexts[0].outputs.size() == 2);
   REQUIRE(config.contexts[0].command_outputs.size() == 0);
-  CHECK(format_sequence(config.contexts[0].inputs[0].input) == "+AltLeft +A ~A ~AltLeft");
-  CHECK(format_sequence(config.contexts[0].inputs[1].input) == "+AltRight +A ~A ~AltRight");
-  CHECK(format_sequence(config.contexts[0].inputs[2].input) == "+AltRight +B ~B ~AltRight");
+  CHECK(format_sequence(config.contexts[0].inputs[0].input) == "+Alt +A ~A ~Alt");
+  CHECK(format_sequence(config.contexts[0].inputs[1].input) == "+AltRight +B ~B ~AltRight");
   CHECK(format_sequence(config.contexts[0].outputs[0]) == "+X");
   CHECK(format_sequence(config.contexts[0].outputs[1]) == "+Y");
 }
@@ -967,6 +1041,32 @@ TEST_CASE("Macros with Terminal Commands", "[ParseConfig]") {
 
 //--------------------------------------------------------------------
 
+TEST_CASE("Repeated expressions", "[ParseConfig]") {
+  auto string = R"(
+    Ext = IntlBackslash | AltRight
+    F1 >> $(echo)
+    F2 >> $(echo)
+    F3 >> "ab"
+    F4 >> "ab"
+    [title="app"]
+    Ext{A} >> B
+    Ext{A} >> C
+  )";
+  auto config = parse_config(string);
+  REQUIRE(config.contexts.size() == 2);
+  // each terminal command is a separate action
+  REQUIRE(config.actions.size() == 2);
+  const auto& outputs = config.contexts[0].outputs;
+  REQUIRE(outputs.size() == 4);
+  CHECK(outputs[0] != outputs[1]);
+  CHECK(outputs[2] == outputs[3]);
+  const auto& inputs = config.contexts[1].inputs;
+  REQUIRE(inputs.size() == 2);
+  CHECK(format_sequence(inputs[0].input) == format_sequence(inputs[1].input));
+}
+
+//--------------------------------------------------------------------
+
 TEST_CASE("Macro result substituted again", "[ParseConfig]") {
   auto string = R"(
     x0 = 
@@ -1229,12 +1329,15 @@ TEST_CASE("Logical keys", "[ParseConfig]") {
   )";
   auto config = parse_config(string);
   REQUIRE(config.contexts.size() == 1);
-  REQUIRE(config.contexts[0].inputs.size() == 2);
+  REQUIRE(config.contexts[0].inputs.size() == 1);
   REQUIRE(config.contexts[0].outputs.size() == 1);
-  CHECK(format_sequence(config.contexts[0].inputs[0].input) == "+IntlBackslash +A ~A ~IntlBackslash");
+  // logical keys are not expanded, but matched with either key
+  CHECK(format_sequence(config.contexts[0].inputs[0].input) == "+Logical4 +A ~A ~Logical4");
   CHECK(config.contexts[0].inputs[0].output_index == 0);
-  CHECK(format_sequence(config.contexts[0].inputs[1].input) == "+AltRight +A ~A ~AltRight");
-  CHECK(config.contexts[0].inputs[1].output_index == 0);
+  CHECK(config.logical_keys.keys(static_cast<Key>(*Key::first_logical + 4)) ==
+    std::vector<Key>{ Key::IntlBackslash, Key::AltRight });
+  CHECK(config.logical_keys.keys(Key::Shift) ==
+    std::vector<Key>{ Key::ShiftLeft, Key::ShiftRight });
 
   string = R"(
     Ext = IntlBackslash | AltRight
@@ -1244,11 +1347,11 @@ TEST_CASE("Logical keys", "[ParseConfig]") {
   )";
   config = parse_config(string);
   REQUIRE(config.contexts.size() == 1);
-  REQUIRE(config.contexts[0].inputs.size() == 3);
+  REQUIRE(config.contexts[0].inputs.size() == 1);
   REQUIRE(config.contexts[0].outputs.size() == 1);
-  CHECK(format_sequence(config.contexts[0].inputs[0].input) == "+IntlBackslash +A ~A ~IntlBackslash");
-  CHECK(format_sequence(config.contexts[0].inputs[1].input) == "+AltRight +A ~A ~AltRight");
-  CHECK(format_sequence(config.contexts[0].inputs[2].input) == "+AltLeft +A ~A ~AltLeft");
+  CHECK(format_sequence(config.contexts[0].inputs[0].input) == "+Logical5 +A ~A ~Logical5");
+  CHECK(config.logical_keys.keys(static_cast<Key>(*Key::first_logical + 5)) ==
+    std::vector<Key>{ Key::IntlBackslash, Key::AltRight, Key::AltLeft });
 
   string = R"(
     Ext = IntlBackslash | AltRight | AltLeft | AltRight  # duplicates are not removed (not ideal)
@@ -1258,13 +1361,10 @@ TEST_CASE("Logical keys", "[ParseConfig]") {
   )";
   config = parse_config(string);
   REQUIRE(config.contexts.size() == 1);
-  REQUIRE(config.contexts[0].inputs.size() == 5);
+  REQUIRE(config.contexts[0].inputs.size() == 2);
   REQUIRE(config.contexts[0].outputs.size() == 2);
-  CHECK(format_sequence(config.contexts[0].inputs[0].input) == "+IntlBackslash +A ~A ~IntlBackslash");
-  CHECK(format_sequence(config.contexts[0].inputs[1].input) == "+AltRight +A ~A ~AltRight");
-  CHECK(format_sequence(config.contexts[0].inputs[2].input) == "+AltLeft +A ~A ~AltLeft");
-  CHECK(format_sequence(config.contexts[0].inputs[3].input) == "+AltRight +A ~A ~AltRight");
-  CHECK(format_sequence(config.contexts[0].inputs[4].input) == "+X ~X");
+  CHECK(format_sequence(config.contexts[0].inputs[0].input) == "+Logical6 +A ~A ~Logical6");
+  CHECK(format_sequence(config.contexts[0].inputs[1].input) == "+X ~X");
   CHECK(format_sequence(config.contexts[0].outputs[0]) == "+A -A +Action0 +B -B");
   CHECK(format_sequence(config.contexts[0].outputs[1]) == "!IntlBackslash !AltRight !AltLeft !AltRight +Y");
   REQUIRE(config.actions.size() == 1);
@@ -1286,12 +1386,22 @@ TEST_CASE("Logical keys 2", "[ParseConfig]") {
 
   auto config = parse_config(string);
   REQUIRE(config.contexts.size() == 1);
-  REQUIRE(config.contexts[0].inputs.size() == 2);
-  REQUIRE(config.contexts[0].outputs.size() == 2);
-  REQUIRE(format_sequence(config.contexts[0].inputs[0].input) == "+ShiftLeft +A ~A ~ShiftLeft");
-  REQUIRE(format_sequence(config.contexts[0].inputs[1].input) == "+ShiftRight +A ~A ~ShiftRight");
-  REQUIRE(format_sequence(config.contexts[0].outputs[0]) == "+ShiftLeft +B -B -ShiftLeft");
-  REQUIRE(format_sequence(config.contexts[0].outputs[1]) == "+ShiftRight +B -B -ShiftRight");
+  REQUIRE(config.contexts[0].inputs.size() == 1);
+  REQUIRE(config.contexts[0].outputs.size() == 1);
+  // the output is resolved to the key which was matched
+  REQUIRE(format_sequence(config.contexts[0].inputs[0].input) == "+Shift +A ~A ~Shift");
+  REQUIRE(format_sequence(config.contexts[0].outputs[0]) == "+Shift +B -B -Shift");
+
+  // other outputs are replaced with the first key
+  config = parse_config(R"(
+    A >> Shift{B}
+    Shift{C} >> command
+    command >> Shift{D}
+  )");
+  REQUIRE(config.contexts[0].outputs.size() == 1);
+  REQUIRE(config.contexts[0].command_outputs.size() == 1);
+  CHECK(format_sequence(config.contexts[0].outputs[0]) == "+ShiftLeft +B -B -ShiftLeft");
+  CHECK(format_sequence(config.contexts[0].command_outputs[0].output) == "+ShiftLeft +D -D -ShiftLeft");
 }
 
 //--------------------------------------------------------------------
@@ -1300,7 +1410,7 @@ TEST_CASE("Logical keys in context filter", "[ParseConfig]") {
   auto string = R"(
     Mod = A | B | C
     
-    [modifier = "Mod"] # 2 fallthrough contexts
+    [modifier = "Mod"]
     R >> X
     
     [modifier = "!Mod !Mod Mod"]  # duplicates are removed
@@ -1311,22 +1421,17 @@ TEST_CASE("Logical keys in context filter", "[ParseConfig]") {
   )";
 
   auto config = parse_config(string);
-  REQUIRE(config.contexts.size() == 5);
-  REQUIRE(config.contexts[0].fallthrough);
-  REQUIRE(config.contexts[0].inputs.empty());
-  REQUIRE(config.contexts[1].fallthrough);
-  REQUIRE(config.contexts[1].inputs.empty());
+  // no fallthrough contexts are inserted
+  REQUIRE(config.contexts.size() == 3);
+  REQUIRE(!config.contexts[0].fallthrough);
+  REQUIRE(config.contexts[0].inputs.size() == 1);
+  REQUIRE(!config.contexts[1].fallthrough);
+  REQUIRE(config.contexts[1].inputs.size() == 1);
   REQUIRE(!config.contexts[2].fallthrough);
   REQUIRE(config.contexts[2].inputs.size() == 1);
-  REQUIRE(!config.contexts[3].fallthrough);
-  REQUIRE(config.contexts[3].inputs.size() == 1);
-  REQUIRE(!config.contexts[4].fallthrough);
-  REQUIRE(config.contexts[4].inputs.size() == 1);
-  REQUIRE(format_sequence(config.contexts[0].modifier_filter) == "+A");
-  REQUIRE(format_sequence(config.contexts[1].modifier_filter) == "+B");
-  REQUIRE(format_sequence(config.contexts[2].modifier_filter) == "+C");
-  REQUIRE(format_sequence(config.contexts[3].modifier_filter) == "!A !B !C");
-  REQUIRE(format_sequence(config.contexts[4].modifier_filter) == "");
+  REQUIRE(format_sequence(config.contexts[0].modifier_filter) == "+Logical5");
+  REQUIRE(format_sequence(config.contexts[1].modifier_filter) == "!A !B !C");
+  REQUIRE(format_sequence(config.contexts[2].modifier_filter) == "");
 }
 
 //--------------------------------------------------------------------
@@ -1409,6 +1514,30 @@ TEST_CASE("Line break", "[ParseConfig]") {
 
 //--------------------------------------------------------------------
 
+TEST_CASE("Lines without macros", "[ParseConfig]") {
+  // lines are only preprocessed when macros or comments are found
+  auto string = "Macro = C\n"
+    "A >> B \"Macro\" $(echo $Macro $HOME)\n"
+    "B >> Macro # comment\n"
+    "C >> \"$Macro\" ; comment\n"
+    "D >> length[\"ab\"]";
+  auto config = ParseConfig()(std::string_view(string));
+  REQUIRE(config.contexts.size() == 1);
+  REQUIRE(config.contexts[0].outputs.size() == 4);
+  CHECK(format_sequence(config.contexts[0].outputs[0]) ==
+    "+B -B !Any +ShiftLeft +M -M -ShiftLeft +A -A +C -C +R -R +O -O +Action0");
+  CHECK(config.actions[0].terminal_command == "echo C $HOME");
+  CHECK(format_sequence(config.contexts[0].outputs[1]) == "+C");
+  CHECK(format_sequence(config.contexts[0].outputs[2]) == "!Any +ShiftLeft +C -C -ShiftLeft");
+  CHECK(format_sequence(config.contexts[0].outputs[3]) == "+2");
+
+  // a final newline is followed by an empty line
+  auto stream = std::stringstream(std::string(string) + "\n");
+  CHECK(ParseConfig()(stream).contexts[0].outputs.size() == 4);
+}
+
+//--------------------------------------------------------------------
+
 TEST_CASE("String interpolation", "[ParseConfig]") {
   auto string = R"(
     TEST = "bc"
@@ -1427,3 +1556,432 @@ TEST_CASE("String interpolation", "[ParseConfig]") {
   CHECK(config.actions[0].terminal_command == R"(bcTESTbc)");
   CHECK(config.actions[1].terminal_command == R"(${TEST1 TEST$TEST1)");
 }
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Context matcher", "[ParseConfig]") {
+  auto string = R"(
+    [class = "Term"]
+    A >> B
+    [class = "Term" title = "vim"]
+    A >> C
+    [class != "Term" title = "vim"]
+    A >> D
+    [title = "im"]
+    A >> E
+    [title = /^Vim/i]
+    A >> F
+    [title != "vim" path = "bin/"]
+    A >> G
+    [class = /erm$/ path = "/usr/bin/term"]
+    A >> H
+    [title = "sh" path = "/usr"]
+    A >> I
+  )";
+  auto config = parse_config(string);
+  auto matcher = ContextMatcher(config.contexts);
+
+  const auto windows = {
+    std::array<const char*, 3>{ "Term", "vim main.cpp", "/usr/bin/term" },
+    std::array<const char*, 3>{ "Term", "bash", "/usr/bin/term" },
+    std::array<const char*, 3>{ "Terminal", "Vim", "/opt/term" },
+    std::array<const char*, 3>{ "Editor", "nvim", "/usr/bin/nvim" },
+    std::array<const char*, 3>{ "Xterm", "fish shell", "/usr/local/bin/x" },
+    std::array<const char*, 3>{ "", "", "" },
+  };
+  auto indices = std::vector<int>();
+  for (const auto& [window_class, window_title, window_path] : windows) {
+    auto expected = std::vector<int>();
+    for (auto i = 0; i < static_cast<int>(config.contexts.size()); ++i)
+      if (config.contexts[i].matches(window_class, window_title, window_path))
+        expected.push_back(i);
+
+    matcher.match(window_class, window_title, window_path, &indices);
+    CHECK(indices == expected);
+  }
+
+  matcher.match("Term", "vim", "/usr/bin/term", &indices);
+  CHECK(indices == std::vector<int>{ 0, 1, 3, 4, 6 });
+
+  // results are cached, also when more windows were matched than fit
+  for (auto i = 0; i < 100; ++i)
+    matcher.match("Term", std::to_string(i), "", &indices);
+  matcher.match("Term", "vim", "/usr/bin/term", &indices);
+  CHECK(indices == std::vector<int>{ 0, 1, 3, 4, 6 });
+  matcher.match("Term", "vim", "/usr/bin/term", &indices);
+  CHECK(indices == std::vector<int>{ 0, 1, 3, 4, 6 });
+  matcher.match("Editor", "nvim", "", &indices);
+  CHECK(indices == std::vector<int>{ 2, 3 });
+
+  // changes between titles are only relevant when a title filter flips
+  CHECK(!matcher.title_filters_differ("bash", "fish"));
+  CHECK(!matcher.title_filters_differ("make 10%", "make 20%"));
+  CHECK(!matcher.title_filters_differ("vim a.cpp", "vim b.cpp"));
+  CHECK(matcher.title_filters_differ("vim a.cpp", "bash"));
+  CHECK(matcher.title_filters_differ("bash", "top"));
+
+  // the filters are evaluated again without caching
+  matcher.set_caching(false);
+  matcher.match("Term", "vim", "/usr/bin/term", &indices);
+  CHECK(indices == std::vector<int>{ 0, 1, 3, 4, 6 });
+  matcher.match("Editor", "nvim", "", &indices);
+  CHECK(indices == std::vector<int>{ 2, 3 });
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Record focus log", "[ParseConfig]") {
+  const auto filename = std::filesystem::temp_directory_path() /
+    "keymapper-test.focus";
+  const auto start = Clock::time_point{ } + std::chrono::hours(1);
+  {
+    auto writer = FocusLogWriter();
+    REQUIRE(writer.open(filename, start));
+    writer.write("Term", "vim main.cpp", "/usr/bin/term", start);
+    // separators are replaced
+    writer.write("Editor", "a\tb\nc", "", start + std::chrono::seconds(2));
+    writer.write("", "", "", start + std::chrono::milliseconds(2500));
+  }
+
+  auto reader = FocusLogReader();
+  REQUIRE(reader.open(filename));
+  auto record = FocusLogRecord{ };
+  REQUIRE(reader.read(record));
+  CHECK(record.time == 0);
+  CHECK(record.window_class == "Term");
+  CHECK(record.window_title == "vim main.cpp");
+  CHECK(record.window_path == "/usr/bin/term");
+  REQUIRE(reader.read(record));
+  CHECK(record.time == 2000);
+  CHECK(record.window_class == "Editor");
+  CHECK(record.window_title == "a b c");
+  CHECK(record.window_path == "");
+  REQUIRE(reader.read(record));
+  CHECK(record.time == 2500);
+  CHECK(record.window_class == "");
+  CHECK(record.window_title == "");
+  CHECK(!reader.read(record));
+  std::filesystem::remove(filename);
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Reparse changed include files", "[ParseConfig]") {
+  const auto directory = std::filesystem::temp_directory_path() /
+    "keymapper-test-include";
+  std::filesystem::create_directories(directory);
+  const auto write_file = [&](const char* filename, const char* contents) {
+    std::ofstream(directory / filename) << contents;
+  };
+  write_file("macros.conf", "Macro = C\n@include \"nested.conf\"\n");
+  write_file("nested.conf", "Nested = D\n");
+  write_file("mappings.conf", "[title = 'vim']\nA >> B\n");
+
+  const auto config_string = R"(
+    @include "macros.conf"
+    X >> Macro
+    @include "mappings.conf"
+    Y >> Nested
+  )";
+  const auto parse_config = [&](ParseConfig& parse) {
+    auto stream = std::stringstream(config_string);
+    return parse(stream, directory);
+  };
+  const auto format_config = [](const Config& config) {
+    auto string = std::string();
+    for (const auto& context : config.contexts) {
+      string += context.window_title_filter.string + "\n";
+      for (const auto& input : context.inputs)
+        string += format_sequence(input.input) + " >> " +
+          std::to_string(input.output_index) + "\n";
+      for (const auto& output : context.outputs)
+        string += format_sequence(output) + "\n";
+    }
+    return string;
+  };
+  const auto parse_fresh = [&]() {
+    auto parse = ParseConfig();
+    return format_config(parse_config(parse));
+  };
+
+  auto parse = ParseConfig();
+  const auto first = format_config(parse_config(parse));
+  CHECK(format_config(parse_config(parse)) == first);
+  CHECK(parse.included_files().size() == 3);
+
+  // changes of a nested include file are detected
+  write_file("nested.conf", "Nested = E\n");
+  const auto second = format_config(parse_config(parse));
+  CHECK(second != first);
+  CHECK(second == parse_fresh());
+
+  write_file("mappings.conf", "[title = 'emacs']\nA >> B\nB >> A\n");
+  const auto third = format_config(parse_config(parse));
+  CHECK(third != second);
+  CHECK(third == parse_fresh());
+  CHECK(parse.included_files().size() == 3);
+
+  std::filesystem::remove(directory / "mappings.conf");
+  CHECK_THROWS(parse_config(parse));
+  write_file("mappings.conf", "[title = 'emacs']\nA >> B\nB >> A\n");
+  CHECK(format_config(parse_config(parse)) == third);
+
+  std::filesystem::remove_all(directory);
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Parse include files concurrently", "[ParseConfig]") {
+  const auto directory = std::filesystem::temp_directory_path() /
+    "keymapper-test-parallel-include";
+  std::filesystem::create_directories(directory);
+  const auto files = std::vector<std::pair<const char*, const char*>>{
+    { "macros.conf", "Macro = C\n" },
+    { "commands.conf", "[default]\nControlLeft{K} >> open\nShift{L} >> close\n" },
+    { "app1.conf", "[title='a']\nA >> Macro\nB >> $(ls)\nopen >> X\n" },
+    { "app2.conf", "[title='b']\n[title='c']\nclose >> Y\nC >> $(pwd)\n"
+                   "D >> run\nLater = Y\n[default]\nrun >> Z\n" },
+    { "app3.conf", "[stage]\nE >> Later\n[title='d']\nopen >> $(echo)\n" },
+    { "app4.conf", "[title='e']\nF >> $(true)\nrun >> $(false)\n\n" },
+    { "app5.conf", "[title='f']\n[title='g']\nG >> H\n" },
+  };
+  auto includes = std::string();
+  auto inlined = std::string();
+  for (const auto& [filename, contents] : files) {
+    std::ofstream(directory / filename) << contents;
+    includes += std::string("@include \"") + filename + "\"\n# comment\n";
+    inlined += contents;
+  }
+
+  const auto format_config = [](const Config& config) {
+    auto string = std::string();
+    for (const auto& context : config.contexts) {
+      string += context.window_title_filter.string +
+        (context.begin_stage ? " stage" : "") +
+        (context.fallthrough ? " fallthrough" : "") + "\n";
+      for (const auto& input : context.inputs)
+        string += format_sequence(input.input) + " >> " +
+          std::to_string(input.output_index) + "\n";
+      for (const auto& output : context.outputs)
+        string += format_sequence(output) + "\n";
+      for (const auto& output : context.command_outputs)
+        string += std::to_string(output.index) + " >> " +
+          format_sequence(output.output) + "\n";
+    }
+    for (const auto& action : config.actions)
+      string += action.terminal_command + "\n";
+    return string;
+  };
+  const auto parse_config = [&](const std::string& string) {
+    auto stream = std::stringstream(string);
+    return format_config(ParseConfig()(stream, directory));
+  };
+
+  // numbering is the same as when the files are parsed in order
+  const auto expected = parse_config(inlined);
+  CHECK(parse_config(includes) == expected);
+  CHECK(parse_config(includes) == expected);
+
+  // errors are reported in the file
+  std::ofstream(directory / "app4.conf") << "[title='e']\nF >> ContextActive\n";
+  auto stream = std::stringstream(includes);
+  CHECK_THROWS_WITH(ParseConfig()(stream, directory),
+    Catch::Contains("app4.conf' in line 2"));
+
+  std::filesystem::remove_all(directory);
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Optimize config", "[ParseConfig]") {
+  auto string = R"(
+    A >> B
+    B >> command
+    A >> C
+    B >> command
+
+    [system="Linux"]
+    command >> D
+    C >> E
+
+    [system="Windows"]
+    command >> D
+    C >> E
+
+    [title="app"]
+    C >> F
+    [title="app"]
+    C >> G
+    D >> H
+
+    [title="app"]
+    ContextActive >> X
+    [title="app"]
+    ContextActive >> Y
+
+    [stage]
+    A >> I
+  )";
+  auto config = parse_config(string);
+  REQUIRE(config.contexts.size() == 7);
+  const auto [merged_contexts, removed_mappings] = optimize_config(config);
+  CHECK(merged_contexts == 3);
+  CHECK(removed_mappings == 3);
+  REQUIRE(config.contexts.size() == 4);
+
+  // system context was merged and shadowed mappings removed
+  const auto& context0 = config.contexts[0];
+  REQUIRE(context0.inputs.size() == 3);
+  REQUIRE(context0.outputs.size() == 2);
+  CHECK(format_sequence(context0.inputs[0].input) == "+A ~A");
+  CHECK(format_sequence(context0.outputs[context0.inputs[0].output_index]) == "+B");
+  CHECK(context0.inputs[1].output_index < 0);
+  CHECK(format_sequence(context0.outputs[context0.inputs[2].output_index]) == "+E");
+  CHECK(context0.command_outputs.size() == 1);
+
+  // contexts with ContextActive inputs are not merged
+  const auto& context1 = config.contexts[1];
+  REQUIRE(context1.inputs.size() == 3);
+  CHECK(format_sequence(context1.outputs[context1.inputs[1].output_index]) == "+H");
+  CHECK(format_sequence(context1.outputs[context1.inputs[2].output_index]) == "+X");
+  CHECK(config.contexts[2].inputs.size() == 1);
+  CHECK(config.contexts[3].begin_stage);
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Match window title filters", "[.][benchmark]") {
+  auto string = R"(
+    [title = /^Mozilla Firefox$/]
+    A >> B
+    [title = /.* - Visual Studio Code$/]
+    A >> B
+    [title = /vim|emacs|nano/i]
+    A >> B
+    [title = /\[\d+\/\d+\]/]
+    A >> B
+    [title = /^(bash|zsh|fish)( |$)/]
+    A >> B
+    [title = /Inbox \(\d+\)/i]
+    A >> B
+    [title = /youtube/i]
+    A >> B
+    [title = /.*\.(cpp|h|hpp) .*/]
+    A >> B
+  )";
+  auto config = parse_config(string);
+  const auto titles = std::vector<std::string>{
+    "main.cpp - keymapper - Visual Studio Code",
+    "Inbox (42) - user@example.com - Mail",
+    "How to configure keymapper - YouTube - Mozilla Firefox",
+    "user@host: ~/projects/keymapper/src/config",
+    "vim ParseConfig.cpp [3/12]",
+    "zsh",
+    "Untitled - Notepad",
+    "Mozilla Firefox",
+  };
+
+  BENCHMARK("Filter") {
+    auto matches = 0;
+    for (const auto& title : titles)
+      for (const auto& context : config.contexts)
+        matches += context.window_title_filter.matches(title, true);
+    return matches;
+  };
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Parse macro-heavy config", "[.][benchmark]") {
+  auto string = std::string(R"(
+    twice = $0 $0
+    add_all = add[add[$0, $1], add[$2, $3]]
+    key_or_default = default[$0, A]
+  )");
+  for (auto i = 0; i < 200; ++i) {
+    const auto n = std::to_string(i % 20);
+    string += 
+      "F" + std::to_string(i % 12 + 1) + " >> repeat[twice[repeat[A B, "
+        "add_all[1, " + n + ", 2, 3]]], 10] "
+      "repeat[key_or_default[], mod[add_all[" + n + ", 3, 4, 5], 7]]\n";
+  }
+
+  BENCHMARK("Parse") {
+    auto parse = ParseConfig();
+    auto stream = std::stringstream(string);
+    return parse(stream).contexts.size();
+  };
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Parse generated config", "[.][benchmark]") {
+  const auto key = [](int i) {
+    return std::string(1, static_cast<char>('A' + i % 26));
+  };
+  auto string = std::string("Ctrl = Control\n");
+  for (auto c = 0; c < 200; ++c) {
+    string += "[title='Window" + std::to_string(c) + "']\n";
+    for (auto m = 0; m < 100; ++m)
+      string += "Shift{" + key(m) + "} " + key(m / 26 + c) + " >> " +
+        key(m + c) + " " + key(c) + "\n";
+  }
+
+  BENCHMARK("Parse") {
+    auto parse = ParseConfig();
+    return parse(string).contexts.size();
+  };
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Parse config with many commands", "[.][benchmark]") {
+  auto string = std::string();
+  for (auto i = 0; i < 2000; ++i)
+    string += "Virtual" + std::to_string(i % 200) + " Shift{A} ControlLeft B" + 
+      " >> command" + std::to_string(i) + "\n";
+  string += "[title='test']\n";
+  for (auto i = 0; i < 2000; ++i)
+    string += "command" + std::to_string(i) + " >> Meta{C} Alt{D}\n";
+
+  BENCHMARK("Parse") {
+    auto parse = ParseConfig();
+    auto stream = std::stringstream(string);
+    return parse(stream).contexts.size();
+  };
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Parse config with forwarded modifiers", "[.][benchmark]") {
+  auto string = std::string("@forward-modifiers Shift Control Alt\n");
+  for (auto i = 0; i < 500; ++i)
+    string += "Shift{Virtual" + std::to_string(i % 200) + "} >> command" +
+      std::to_string(i) + "\n";
+  for (auto c = 0; c < 10; ++c) {
+    string += "[title='" + std::to_string(c) + "']\n";
+    for (auto i = 0; i < 500; ++i)
+      string += "command" + std::to_string(i) + " >> Control{C}\n";
+  }
+
+  BENCHMARK("Parse") {
+    auto parse = ParseConfig();
+    auto stream = std::stringstream(string);
+    return parse(stream).contexts.size();
+  };
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Parse config with typed strings", "[.][benchmark]") {
+  auto string = std::string();
+  for (auto i = 0; i < 500; ++i)
+    string += "Virtual" + std::to_string(i % 200) + " Shift{A} >> \"Lorem ipsum dolor " + std::to_string(i) + 
+      " sit amet, consectetur adipiscing elit\\n\"\n";
+
+  BENCHMARK("Parse") {
+    auto parse = ParseConfig();
+    auto stream = std::stringstream(string);
+    return parse(stream).contexts.size();
+  };
+}
@@ -1,6 +1,10 @@
 
 #include "test.h"
 #include "runtime/MatchKeySequence.h"
+#include "runtime/KeySequenceScan.h"
+#include <cstring>
+#include <random>
+#include <thread>
 
 namespace  {
   MatchResult match(const KeySequence& expression,
@@ -307,3 +311,282 @@ TEST_CASE("Match Not Timeout", "[MatchKeySequence]") {
   CHECK(input_timeout_event == KeyEvent{ });
 }
 //--------------------------------------------------------------------
+
+TEST_CASE("Compiled expressions match like interpreted", "[MatchKeySequence]") {
+  const auto expressions = {
+    "A", "A B", "A{B}", "A{B{C}}", "A{B C}", "A !A", "A !B C", "!A B",
+    "A{B !B C}", "A 100ms", "A !100ms", "A{100ms}", "A{!100ms} B",
+    "A B 200ms C", "A{B} !A", "A A", "A{A}", "A{B A}",
+    "A{B} C{D}", "!A !B C", "A{B} 100ms", "A !A B !B",
+  };
+  const auto keys = { Key::A, Key::B, Key::C, Key::D };
+  const auto states = { KeyState::Down, KeyState::Up, KeyState::DownMatched };
+
+  auto all_events = std::vector<KeyEvent>();
+  for (auto key : keys)
+    for (auto state : states)
+      all_events.emplace_back(key, state);
+  for (auto timeout : { 50, 100, 200 })
+    all_events.push_back(reply_timeout_ms(timeout));
+
+  auto rand = std::mt19937(0);
+  auto dist = std::uniform_int_distribution<size_t>(0, all_events.size() - 1);
+  auto length = std::uniform_int_distribution<size_t>(1, 6);
+  auto interpret = MatchKeySequence();
+  auto run = MatchKeySequence();
+  for (auto string : expressions) {
+    const auto expression = parse_input(string);
+    const auto compiled = CompiledKeySequence::compile(expression);
+    REQUIRE(compiled.has_value());
+
+    for (auto i = 0; i < 2000; ++i) {
+      auto sequence = KeySequence();
+      for (auto j = length(rand); j > 0; --j)
+        sequence.push_back(all_events[dist(rand)]);
+
+      auto any_key_matches_a = std::vector<Key>();
+      auto any_key_matches_b = std::vector<Key>();
+      auto timeout_event_a = KeyEvent{ };
+      auto timeout_event_b = KeyEvent{ };
+      const auto a = interpret(expression, sequence,
+        &any_key_matches_a, &timeout_event_a);
+      const auto b = run(*compiled, sequence,
+        &any_key_matches_b, &timeout_event_b);
+      INFO(string << ": " << format_sequence(sequence));
+      REQUIRE(a == b);
+      REQUIRE(timeout_event_a == timeout_event_b);
+      REQUIRE(any_key_matches_a == any_key_matches_b);
+
+      // resume matching while appending events
+      auto cursor = CompiledKeySequence::Cursor{ };
+      auto prefix = KeySequence();
+      for (const auto& event : sequence) {
+        prefix.push_back(event);
+        timeout_event_a = timeout_event_b = KeyEvent{ };
+        const auto a = run(*compiled, prefix,
+          &any_key_matches_a, &timeout_event_a);
+        const auto b = run(*compiled, prefix,
+          &any_key_matches_b, &timeout_event_b, &cursor);
+        REQUIRE(a == b);
+        REQUIRE(timeout_event_a == timeout_event_b);
+      }
+    }
+  }
+
+  // not supported
+  CHECK(!CompiledKeySequence::compile(parse_input("(A B)")));
+  CHECK(!CompiledKeySequence::compile(parse_input("Any")));
+  CHECK(!CompiledKeySequence::compile(parse_input("? A B")));
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Match from several threads", "[MatchKeySequence]") {
+  const auto expressions = std::vector<KeySequence>{
+    parse_input("(A B) C"), parse_input("Any !A B"), parse_input("? A B"),
+    parse_input("A{B} C"), parse_input("(A B){C}"), parse_input("A !B 100ms"),
+  };
+  const auto all_events = std::vector<KeyEvent>{
+    { Key::A, KeyState::Down }, { Key::A, KeyState::Up },
+    { Key::B, KeyState::Down }, { Key::B, KeyState::Up },
+    { Key::C, KeyState::Down }, { Key::C, KeyState::Up },
+    { Key::B, KeyState::DownMatched }, reply_timeout_ms(200),
+  };
+  auto rand = std::mt19937(0);
+  auto dist = std::uniform_int_distribution<size_t>(0, all_events.size() - 1);
+  auto length = std::uniform_int_distribution<size_t>(1, 6);
+  auto sequences = std::vector<KeySequence>(500);
+  for (auto& sequence : sequences)
+    for (auto j = length(rand); j > 0; --j)
+      sequence.push_back(all_events[dist(rand)]);
+
+  // each thread has its own scratch, the expressions are shared
+  const auto match_all = [&](std::vector<MatchResult>& results) {
+    auto scratch = MatchKeySequence::Scratch();
+    auto any_key_matches = std::vector<Key>();
+    for (const auto& expression : expressions)
+      for (const auto& sequence : sequences) {
+        auto input_timeout_event = KeyEvent{ };
+        results.push_back(MatchKeySequence::match(expression, sequence,
+          &any_key_matches, &input_timeout_event, scratch));
+      }
+  };
+  auto expected = std::vector<MatchResult>();
+  match_all(expected);
+
+  auto results = std::vector<std::vector<MatchResult>>(4);
+  auto threads = std::vector<std::thread>();
+  for (auto& result : results)
+    threads.emplace_back(match_all, std::ref(result));
+  for (auto& thread : threads)
+    thread.join();
+  for (const auto& result : results)
+    CHECK(result == expected);
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("KeySequence inline storage", "[MatchKeySequence]") {
+  auto sequence = parse_sequence("+A +B -A -B");
+  CHECK(sequence.capacity() == KeySequence::inline_capacity);
+
+  // spill to heap
+  auto copy = sequence;
+  copy.insert(copy.end(), sequence.begin(), sequence.end());
+  copy.insert(copy.begin(), sequence.begin(), sequence.end());
+  CHECK(copy.size() == 12);
+  CHECK(copy.capacity() > KeySequence::inline_capacity);
+  CHECK(format_sequence(copy) == "+A +B -A -B +A +B -A -B +A +B -A -B");
+
+  // insert part of itself
+  sequence.insert(sequence.begin() + 1, sequence.begin() + 2, sequence.end());
+  CHECK(format_sequence(sequence) == "+A -A -B +B -A -B");
+  sequence.erase(sequence.begin(), sequence.begin() + 3);
+  CHECK(format_sequence(sequence) == "+B -A -B");
+
+  // move inline and heap storage
+  auto moved = std::move(sequence);
+  CHECK(sequence.empty());
+  CHECK(format_sequence(moved) == "+B -A -B");
+  moved = std::move(copy);
+  CHECK(copy.empty());
+  CHECK(moved.size() == 12);
+  std::swap(moved, sequence);
+  CHECK(moved.empty());
+  CHECK(sequence.size() == 12);
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Vectorized KeySequence scans", "[MatchKeySequence]") {
+  // layout assumed by the vectorized paths
+  const auto event = KeyEvent(Key::A, KeyState::DownMatched, 0xABC);
+  auto word = uint32_t{ };
+  std::memcpy(&word, &event, sizeof(word));
+  CHECK(word == key_scan::detail::to_word(event));
+
+  const auto keys = { Key::A, Key::B, Key::C, Key::D };
+  const auto states = { KeyState::Up, KeyState::Down,
+    KeyState::DownMatched, KeyState::Not };
+  auto rand = std::mt19937(1);
+  auto pick = std::uniform_int_distribution<size_t>(0, 3);
+  auto length = std::uniform_int_distribution<size_t>(0, 21);
+  for (auto i = 0; i < 2000; ++i) {
+    auto sequence = KeySequence();
+    auto key_list = std::vector<Key>();
+    for (auto j = length(rand); j > 0; --j) {
+      sequence.emplace_back(*(keys.begin() + pick(rand)),
+        *(states.begin() + pick(rand)), static_cast<KeyEvent::value_t>(j));
+      key_list.push_back(sequence.back().key);
+    }
+    const auto data = sequence.data();
+    const auto size = sequence.size();
+    const auto index = [&](auto it) {
+      return static_cast<size_t>(std::distance(sequence.begin(), it));
+    };
+    const auto rindex = [&](auto it) {
+      return (it == sequence.rend() ? size :
+        static_cast<size_t>(std::distance(it, sequence.rend())) - 1);
+    };
+    const auto key = *(keys.begin() + pick(rand));
+    const auto has_key = [&](const KeyEvent& e) { return e.key == key; };
+    const auto is_down = [](const KeyEvent& e) {
+      return (e.state == KeyState::Down || e.state == KeyState::DownMatched);
+    };
+    INFO(format_sequence(sequence));
+    REQUIRE(key_scan::find_key(data, size, key) ==
+      index(std::find_if(sequence.begin(), sequence.end(), has_key)));
+    REQUIRE(key_scan::rfind_key(data, size, key) ==
+      rindex(std::find_if(sequence.rbegin(), sequence.rend(), has_key)));
+    REQUIRE(key_scan::find_key(key_list.data(), key_list.size(), key) ==
+      static_cast<size_t>(std::distance(key_list.begin(),
+        std::find(key_list.begin(), key_list.end(), key))));
+    const auto states_down = key_scan::states(
+      KeyState::Down, KeyState::DownMatched);
+    REQUIRE(key_scan::find_state(data, size, states_down) ==
+      index(std::find_if(sequence.begin(), sequence.end(), is_down)));
+    REQUIRE(key_scan::rfind_state(data, size, states_down) ==
+      rindex(std::find_if(sequence.rbegin(), sequence.rend(), is_down)));
+    if (size) {
+      const auto& last = sequence.back();
+      REQUIRE(key_scan::find_event(data, size, last) ==
+        index(std::find(sequence.begin(), sequence.end(), last)));
+    }
+  }
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Sequence events need to be unified with input", "[MatchKeySequence]") {
+  // Stage skips inputs, which do not contain the key of each event
+  // of the sequence, which is not DownMatched
+  const auto expressions = {
+    "A", "A B", "A{B}", "A !A", "A !B C", "!A B", "A{B !B C}", 
+    "A 100ms", "A !100ms", "A{100ms}", "(A B)", "(A B) C", "A{B C}",
+  };
+  const auto keys = { Key::A, Key::B, Key::C, Key::D };
+  const auto states = { KeyState::Down, KeyState::Up, KeyState::DownMatched };
+
+  auto all_events = std::vector<KeyEvent>();
+  for (auto key : keys)
+    for (auto state : states)
+      all_events.emplace_back(key, state);
+  all_events.push_back(reply_timeout_ms(100));
+
+  auto rand = std::mt19937(1);
+  auto dist = std::uniform_int_distribution<size_t>(0, all_events.size() - 1);
+  auto length = std::uniform_int_distribution<size_t>(1, 6);
+  auto match = MatchKeySequence();
+  for (auto string : expressions) {
+    const auto expression = parse_input(string);
+    auto rejected = 0;
+    for (auto i = 0; i < 2000; ++i) {
+      auto sequence = KeySequence();
+      for (auto j = length(rand); j > 0; --j)
+        sequence.push_back(all_events[dist(rand)]);
+
+      const auto unified = std::all_of(sequence.begin(), sequence.end(),
+        [&](const KeyEvent& event) {
+          return (event.state == KeyState::DownMatched ||
+            std::any_of(expression.begin(), expression.end(),
+              [&](const KeyEvent& e) { return e.key == event.key; }));
+        });
+      if (unified)
+        continue;
+
+      auto any_key_matches = std::vector<Key>();
+      auto timeout_event = KeyEvent{ };
+      INFO(string << ": " << format_sequence(sequence));
+      REQUIRE(match(expression, sequence,
+        &any_key_matches, &timeout_event) == MatchResult::no_match);
+      ++rejected;
+    }
+    CHECK(rejected > 0);
+  }
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Match long expressions", "[.][benchmark]") {
+  // "block every other modifier" mapping
+  const auto not_keys = parse_input(
+    "!ShiftLeft !ShiftRight !ControlLeft !ControlRight !AltLeft !AltRight "
+    "!MetaLeft !MetaRight !CapsLock !NumLock !ScrollLock !Fn "
+    "!F13 !F14 !F15 !F16 !F17 !F18 !F19 !F20 !F21 !F22 !F23 !F24 A");
+  const auto async_keys = parse_input(
+    "(ShiftLeft ShiftRight ControlLeft ControlRight AltLeft AltRight "
+    "MetaLeft MetaRight F13 F14 F15 F16 F17 F18 F19 F20) A");
+  const auto sequence = parse_sequence("+A -A");
+  const auto async_sequence = parse_sequence(
+    "+F20 +F19 +F18 +F17 +F16 +F15 +F14 +F13 +MetaRight +MetaLeft");
+  auto any_key_matches = std::vector<Key>();
+  auto timeout_event = KeyEvent{ };
+  auto match = MatchKeySequence();
+
+  BENCHMARK("Not keys") {
+    return match(not_keys, sequence, &any_key_matches, &timeout_event);
+  };
+  BENCHMARK("Async keys") {
+    return match(async_keys, async_sequence, &any_key_matches, &timeout_event);
+  };
+}
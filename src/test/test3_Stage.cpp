@@ -1,5 +1,7 @@
 
 #include "test.h"
+#include "library/keymapper.h"
+#include <random>
 
 namespace {
   std::string apply_input(Stage& stage, const KeySequence& input, 
@@ -53,6 +55,122 @@ TEST_CASE("Simple", "[Stage]") {
 
 //--------------------------------------------------------------------
 
+TEST_CASE("Minimal policy", "[Stage]") {
+  auto config = R"(
+    A >> B
+    ShiftLeft{C} >> D
+    B C >> E
+    D >> ShiftLeft{A} !ShiftLeft B
+  )";
+  // an unreachable timeout mapping selects the general policy
+  auto general_config = std::string(config) + "F24 250ms >> X\n";
+  auto minimal = create_stage(config);
+  auto general = create_stage(general_config.c_str());
+  CHECK(minimal.has_minimal_policy());
+  CHECK(!general.has_minimal_policy());
+  CHECK(!create_stage("Any >> A").has_minimal_policy());
+  CHECK(!create_stage("? A B >> C").has_minimal_policy());
+  CHECK(!create_stage("[modifier=ShiftLeft]\nA >> B").has_minimal_policy());
+  CHECK(!create_stage("[device=Mouse]\nA >> B").has_minimal_policy());
+
+  const auto keys = { Key::A, Key::B, Key::C, Key::D, Key::ShiftLeft };
+  auto rand = std::mt19937(3);
+  auto pick = std::uniform_int_distribution<size_t>(0, keys.size() - 1);
+  auto pressed = std::vector<Key>();
+  for (auto i = 0; i < 5000; ++i) {
+    const auto key = *(keys.begin() + pick(rand));
+    const auto it = std::find(pressed.begin(), pressed.end(), key);
+    const auto event = KeyEvent(key,
+      it == pressed.end() ? KeyState::Down : KeyState::Up);
+    if (it == pressed.end())
+      pressed.push_back(key);
+    else
+      pressed.erase(it);
+    INFO(i);
+    REQUIRE(format_sequence(minimal.update(event, 0)) ==
+            format_sequence(general.update(event, 0)));
+  }
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Device filters on hotplug", "[Stage]") {
+  auto config = R"(
+    [device="Keyboard"]
+    A >> X
+
+    [device="Keyboard"]
+    B >> Y
+
+    [device-id=/usb/]
+    C >> Z
+  )";
+  auto stage = create_stage(config);
+  auto devices = std::vector<DeviceDesc>{ { "Keyboard", "" } };
+  CHECK(stage.evaluate_device_filters(devices));
+  CHECK(apply_input(stage, "+A -A", 0) == "+X -X");
+
+  // adding a device, which matches no new context, changes nothing
+  devices.insert(devices.begin(), { "Mouse", "" });
+  CHECK(!stage.evaluate_device_filters(devices));
+  CHECK(apply_input(stage, "+A -A", 0) == "+A -A");
+  CHECK(apply_input(stage, "+B -B", 1) == "+Y -Y");
+
+  devices.push_back({ "Stick", "usb-1" });
+  CHECK(stage.evaluate_device_filters(devices));
+  CHECK(apply_input(stage, "+C -C", 2) == "+Z -Z");
+  CHECK(!stage.evaluate_device_filters(devices));
+
+  devices.erase(devices.begin() + 1);
+  CHECK(stage.evaluate_device_filters(devices));
+  CHECK(apply_input(stage, "+A -A", 0) == "+A -A");
+  CHECK(apply_input(stage, "+C -C", 1) == "+Z -Z");
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Contexts of each device", "[Stage]") {
+  auto config = R"(
+    [device="Keyboard"]
+    A >> X
+
+    [default]
+    A >> Y
+    B >> Y
+
+    [device="Mouse"]
+    B >> Z
+    C >> Z
+  )";
+  auto stage = create_stage(config);
+  auto devices = std::vector<DeviceDesc>{ { "Keyboard", "" }, { "Mouse", "" } };
+  CHECK(stage.evaluate_device_filters(devices));
+
+  // the order of the contexts is kept
+  CHECK(apply_input(stage, "+A -A", 0) == "+X -X");
+  CHECK(apply_input(stage, "+A -A", 1) == "+Y -Y");
+  CHECK(apply_input(stage, "+B -B", 1) == "+Y -Y");
+  CHECK(apply_input(stage, "+C -C", 1) == "+Z -Z");
+  CHECK(apply_input(stage, "+C -C", 0) == "+C -C");
+
+  // unknown devices only match contexts without filter
+  CHECK(apply_input(stage, "+A -A", 2) == "+Y -Y");
+  CHECK(apply_input(stage, "+C -C", 2) == "+C -C");
+  CHECK(apply_input(stage, "+A -A", Stage::no_device_index) == "+Y -Y");
+  CHECK(apply_input(stage, "+C -C", Stage::any_device_index) == "+Z -Z");
+
+  // lists are updated when the active contexts change
+  stage.set_active_client_contexts({ 1, 2 });
+  CHECK(apply_input(stage, "+A -A", 0) == "+Y -Y");
+  CHECK(apply_input(stage, "+C -C", 1) == "+Z -Z");
+  stage.set_active_client_contexts({ 0 });
+  CHECK(apply_input(stage, "+A -A", 0) == "+X -X");
+  CHECK(apply_input(stage, "+B -B", 0) == "+B -B");
+  REQUIRE(stage.is_clear());
+}
+
+//--------------------------------------------------------------------
+
 TEST_CASE("Layout", "[Stage]") {
   auto config = R"(
     S >> R
@@ -424,6 +542,141 @@ TEST_CASE("Not in input", "[Stage]") {
 
 //--------------------------------------------------------------------
 
+TEST_CASE("Logical key output", "[Stage]") {
+  auto config = R"(
+    Shift{A} >> Shift{B}
+    Ext = IntlBackslash | AltRight
+    Ext{C} >> D
+    E >> Shift{F}
+  )";
+  Stage stage = create_stage(config);
+  // not expanded
+  REQUIRE(stage.contexts()[0].inputs.size() == 3);
+
+  // output the key which was matched
+  CHECK(apply_input(stage, "+ShiftRight") == "");
+  CHECK(apply_input(stage, "+A") == "+ShiftRight +B -B -ShiftRight");
+  CHECK(apply_input(stage, "-A") == "");
+  CHECK(apply_input(stage, "-ShiftRight") == "");
+  REQUIRE(stage.is_clear());
+
+  CHECK(apply_input(stage, "+ShiftLeft") == "");
+  CHECK(apply_input(stage, "+A") == "+ShiftLeft +B -B -ShiftLeft");
+  CHECK(apply_input(stage, "-A") == "");
+  CHECK(apply_input(stage, "-ShiftLeft") == "");
+  REQUIRE(stage.is_clear());
+
+  CHECK(apply_input(stage, "+AltRight") == "");
+  CHECK(apply_input(stage, "+C") == "+D");
+  CHECK(apply_input(stage, "-C") == "-D");
+  CHECK(apply_input(stage, "-AltRight") == "");
+  CHECK(apply_input(stage, "+IntlBackslash") == "");
+  CHECK(apply_input(stage, "+C") == "+D");
+  CHECK(apply_input(stage, "-C") == "-D");
+  CHECK(apply_input(stage, "-IntlBackslash") == "");
+  REQUIRE(stage.is_clear());
+
+  // other outputs use the first key
+  CHECK(apply_input(stage, "+E") == "+ShiftLeft +F -F -ShiftLeft");
+  CHECK(apply_input(stage, "-E") == "");
+  REQUIRE(stage.is_clear());
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Logical key bound to one key", "[Stage]") {
+  auto config = R"(
+    Shift >> ControlLeft
+  )";
+  Stage stage = create_stage(config);
+
+  // the second key starts its own match
+  CHECK(apply_input(stage, "+ShiftLeft") == "+ControlLeft");
+  CHECK(apply_input(stage, "+ShiftRight") == "+ControlLeft");
+  CHECK(apply_input(stage, "-ShiftRight") == "");
+  CHECK(apply_input(stage, "-ShiftLeft") == "-ControlLeft");
+  REQUIRE(stage.is_clear());
+
+  config = R"(
+    Shift{A} >> B
+  )";
+  stage = create_stage(config);
+
+  // the first key is flushed, the second key matches with A
+  CHECK(apply_input(stage, "+ShiftLeft") == "");
+  CHECK(apply_input(stage, "+ShiftRight") == "+ShiftLeft");
+  CHECK(apply_input(stage, "+A") == "+B");
+  CHECK(apply_input(stage, "-A") == "-B");
+  CHECK(apply_input(stage, "-ShiftRight") == "");
+  CHECK(apply_input(stage, "-ShiftLeft") == "-ShiftLeft");
+  REQUIRE(stage.is_clear());
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Repeated logical key", "[Stage]") {
+  auto config = R"(
+    Shift{Shift} >> E
+    (Shift Shift) >> F
+    A >> B
+  )";
+  Stage stage = create_stage(config);
+
+  // both keys do not match, each is bound to the same key twice
+  CHECK(apply_input(stage, "+ShiftLeft") == "");
+  CHECK(apply_input(stage, "+ShiftRight") == "+ShiftLeft");
+  CHECK(apply_input(stage, "-ShiftRight") == "+ShiftRight -ShiftRight");
+  CHECK(apply_input(stage, "-ShiftLeft") == "-ShiftLeft");
+  REQUIRE(stage.is_clear());
+
+  CHECK(apply_input(stage, "+ShiftRight") == "");
+  CHECK(apply_input(stage, "+ShiftLeft") == "+ShiftRight");
+  CHECK(apply_input(stage, "-ShiftLeft") == "+ShiftLeft -ShiftLeft");
+  CHECK(apply_input(stage, "-ShiftRight") == "-ShiftRight");
+  REQUIRE(stage.is_clear());
+
+  CHECK(apply_input(stage, "+A") == "+B");
+  CHECK(apply_input(stage, "-A") == "-B");
+  REQUIRE(stage.is_clear());
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Forward modifiers", "[Stage]") {
+  auto config = R"(
+    @forward-modifiers Shift
+    Shift{A} >> X
+    B >> Y
+  )";
+  Stage stage = create_stage(config);
+  // forwarded by the stage, not by mappings
+  REQUIRE(stage.contexts()[0].inputs.size() == 2);
+  CHECK(stage.forward_modifiers().size() == 2);
+
+  CHECK(apply_input(stage, "+ShiftLeft") == "+ShiftLeft");
+  CHECK(apply_input(stage, "+ShiftLeft") == "+ShiftLeft");
+  CHECK(apply_input(stage, "-ShiftLeft") == "-ShiftLeft");
+  REQUIRE(stage.is_clear());
+
+  // mapped with forwarded modifier
+  CHECK(apply_input(stage, "+ShiftRight") == "+ShiftRight");
+  CHECK(apply_input(stage, "+A") == "-ShiftRight +X");
+  CHECK(apply_input(stage, "-A") == "-X");
+  CHECK(apply_input(stage, "-ShiftRight") == "");
+  REQUIRE(stage.is_clear());
+
+  // other mappings are applied while modifier is held
+  CHECK(apply_input(stage, "+ShiftLeft") == "+ShiftLeft");
+  CHECK(apply_input(stage, "+B") == "+Y");
+  CHECK(apply_input(stage, "-B") == "-Y");
+  CHECK(apply_input(stage, "+C") == "+C");
+  CHECK(apply_input(stage, "-C") == "-C");
+  CHECK(apply_input(stage, "-ShiftLeft") == "-ShiftLeft");
+  REQUIRE(stage.is_clear());
+}
+
+//--------------------------------------------------------------------
+
 TEST_CASE("Not in input undone", "[Stage]") {
   auto config = R"(
     Shift >> Shift
@@ -875,6 +1128,45 @@ TEST_CASE("Might match, then no match or match", "[Stage]") {
 
 //--------------------------------------------------------------------
 
+TEST_CASE("Might match, then longest start matches", "[Stage]") {
+  auto config = R"(
+    A B C D >> 1
+    B       >> 2
+    A B     >> 3
+    A       >> 4
+    E B C   >> 5
+    E B     >> 6
+    E       >> 7
+  )";
+  Stage stage = create_stage(config);
+
+  CHECK(apply_input(stage, "+A") == "");
+  CHECK(apply_input(stage, "-A") == "");
+  CHECK(apply_input(stage, "+B") == "");
+  CHECK(apply_input(stage, "-B") == "");
+  CHECK(apply_input(stage, "+C") == "");
+  CHECK(apply_input(stage, "-C") == "");
+  CHECK(apply_input(stage, "+X") == "+3 +C -C +X");
+  CHECK(apply_input(stage, "-X") == "-X -3");
+  REQUIRE(stage.is_clear());
+
+  CHECK(apply_input(stage, "+E") == "");
+  CHECK(apply_input(stage, "-E") == "");
+  CHECK(apply_input(stage, "+B") == "");
+  CHECK(apply_input(stage, "-B") == "");
+  CHECK(apply_input(stage, "+X") == "+6 +X");
+  CHECK(apply_input(stage, "-X") == "-X -6");
+  REQUIRE(stage.is_clear());
+
+  CHECK(apply_input(stage, "+E") == "");
+  CHECK(apply_input(stage, "-E") == "");
+  CHECK(apply_input(stage, "+X") == "+7 +X");
+  CHECK(apply_input(stage, "-X") == "-X -7");
+  REQUIRE(stage.is_clear());
+}
+
+//--------------------------------------------------------------------
+
 TEST_CASE("Keyrepeat might match", "[Stage]") {
   auto config = R"(
     Space{C} >> Control{C}
@@ -1388,7 +1680,7 @@ TEST_CASE("Context with modifier filter", "[Stage]") {
     [modifier="!Virtual1"]
     command >> Z
     
-    [modifier="Virtual1 Shift"] # adds one implicit fallthrough context
+    [modifier="Virtual1 Shift"]
     command >> W
   
     [title="Firefox"]
@@ -1399,8 +1691,8 @@ TEST_CASE("Context with modifier filter", "[Stage]") {
   )";
   
   Stage stage = create_stage(config);
-  REQUIRE(stage.contexts().size() == 6);
-  stage.set_active_client_contexts({ 0, 1, 2, 3 }); // No program
+  REQUIRE(stage.contexts().size() == 5);
+  stage.set_active_client_contexts({ 0, 1, 2 }); // No program
   
   REQUIRE(apply_input(stage, "+A -A") == "+Z -Z");
   REQUIRE(stage.is_clear());
@@ -1410,7 +1702,7 @@ TEST_CASE("Context with modifier filter", "[Stage]") {
   REQUIRE(apply_input(stage, "+Virtual1") == "");
   REQUIRE(apply_input(stage, "+A -A") == "+A -A");
   
-  // fallthrough contexts are added for logical keys
+  // logical keys in modifier filters match either key
   REQUIRE(apply_input(stage, "+ShiftLeft") == "+ShiftLeft");
   REQUIRE(apply_input(stage, "+A -A") == "+W -W");
   REQUIRE(apply_input(stage, "-ShiftLeft") == "-ShiftLeft");
@@ -1422,7 +1714,7 @@ TEST_CASE("Context with modifier filter", "[Stage]") {
   REQUIRE(apply_input(stage, "-Virtual1") == "");
   REQUIRE(stage.is_clear());
 
-  stage.set_active_client_contexts({ 0, 1, 2, 3, 4, 5 }); // Firefox
+  stage.set_active_client_contexts({ 0, 1, 2, 3, 4 }); // Firefox
 
   REQUIRE(apply_input(stage, "+A -A") == "+X -X");
   REQUIRE(stage.is_clear());
@@ -2635,6 +2927,27 @@ TEST_CASE("Output Timeout", "[Stage]") {
 
 //--------------------------------------------------------------------
 
+TEST_CASE("Timeout of another stage", "[Stage]") {
+  auto config = R"(
+    B D >> X
+    C >> A
+  )";
+  Stage stage = create_stage(config);
+
+  // timeouts are also applied in stages without timeout mappings
+  CHECK(apply_input(stage, "+B") == "");
+  CHECK(apply_input(stage, reply_timeout_ms(300)) == "+B");
+  CHECK(apply_input(stage, "-B") == "-B");
+  REQUIRE(stage.is_clear());
+
+  CHECK(apply_input(stage, "+C") == "+A");
+  CHECK(apply_input(stage, reply_timeout_ms(300)) == "");
+  CHECK(apply_input(stage, "-C") == "-A");
+  REQUIRE(stage.is_clear());
+}
+
+//--------------------------------------------------------------------
+
 TEST_CASE("Explicit modifier", "[Stage]") {
   auto config = R"(
     Shift >> Shift
@@ -2920,6 +3233,27 @@ TEST_CASE("NoMightMatch Sequence", "[Stage]") {
 
 //--------------------------------------------------------------------
 
+TEST_CASE("NoMightMatch history stays short", "[Stage]") {
+  auto config = R"(
+    ? A B C >> Y
+  )";
+  Stage stage = create_stage(config);
+
+  for (auto i = 0; i < 1000; ++i) {
+    CHECK(apply_input(stage, i % 3 ? "+A -A" : "+C -C") != "");
+    REQUIRE(stage.history_size() <= 6);
+  }
+  CHECK(apply_input(stage, "+A") == "+A");
+  CHECK(apply_input(stage, "-A") == "-A");
+  CHECK(apply_input(stage, "+B") == "+B");
+  CHECK(apply_input(stage, "-B") == "-B");
+  CHECK(apply_input(stage, "+C") == "+Y");
+  CHECK(apply_input(stage, "-C") == "-Y");
+  REQUIRE(stage.is_clear());
+}
+
+//--------------------------------------------------------------------
+
 TEST_CASE("NoMightMatch Sequence with initial Not", "[Stage]") {
   auto config = R"(
     ? !A B >> X
@@ -3220,3 +3554,528 @@ TEST_CASE("String typing input #5", "[Stage]") {
 }
 
 //--------------------------------------------------------------------
+
+TEST_CASE("Input order with leading key index", "[Stage]") {
+  auto config = R"(
+    A{B} >> X
+    Any{B} >> Y
+    A >> Z
+    C >> W
+  )";
+  Stage stage = create_stage(config);
+
+  CHECK(apply_input(stage, "+A") == "");
+  CHECK(apply_input(stage, "+B") == "+X");
+  CHECK(apply_input(stage, "-B") == "-X");
+  CHECK(apply_input(stage, "-A") == "");
+  REQUIRE(stage.is_clear());
+
+  CHECK(apply_input(stage, "+C") == "");
+  CHECK(apply_input(stage, "+B") == "+Y");
+  CHECK(apply_input(stage, "-B") == "-Y");
+  CHECK(apply_input(stage, "-C") == "");
+  REQUIRE(stage.is_clear());
+
+  CHECK(apply_input(stage, "+A") == "");
+  CHECK(apply_input(stage, "-A") == "+Z -Z");
+  CHECK(apply_input(stage, "+C") == "");
+  CHECK(apply_input(stage, "-C") == "+W -W");
+  REQUIRE(stage.is_clear());
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Release triggers while other keys are held", "[Stage]") {
+  auto config = R"(
+    A >> X ^ Y
+    B >> Z
+    C >> W ^ V
+  )";
+  Stage stage = create_stage(config);
+
+  CHECK(apply_input(stage, "+A") == "+X -X");
+  CHECK(apply_input(stage, "+B") == "+Z");
+  CHECK(apply_input(stage, "+C") == "+W -W");
+  CHECK(apply_input(stage, "+D") == "+D");
+  CHECK(apply_input(stage, "+A") == "");
+  CHECK(apply_input(stage, "-A") == "+Y -Y");
+  CHECK(apply_input(stage, "-D") == "-D");
+  CHECK(apply_input(stage, "+A") == "+X -X");
+  CHECK(apply_input(stage, "-B") == "-Z");
+  CHECK(apply_input(stage, "-C") == "+V -V");
+  CHECK(apply_input(stage, "-A") == "+Y -Y");
+  REQUIRE(stage.is_clear());
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Pass through unmapped keys", "[Stage]") {
+  const auto configs = {
+    "A >> B",
+    "A B >> C",
+    "A !A B >> C",
+    "A{B} >> C",
+    "ShiftLeft{A} >> B",
+    "ShiftLeft{A} >> ShiftLeft{C}",
+    "A >> B ^ C",
+    "A >> !ShiftLeft C",
+    "[modifier='ShiftLeft']\n A >> B",
+  };
+  const auto keys = { Key::A, Key::B, Key::C, Key::ShiftLeft, Key::X, Key::Y };
+
+  auto rand = std::mt19937(0);
+  auto dist = std::uniform_int_distribution<size_t>(0, keys.size() - 1);
+  for (auto config : configs) {
+    // reference is always updated
+    auto reference = create_stage(config);
+    auto stage = create_stage(config);
+    auto passed = 0;
+    auto down = std::vector<Key>();
+    for (auto i = 0; i < 2000; ++i) {
+      const auto key = *(keys.begin() + dist(rand));
+      const auto it = std::find(down.begin(), down.end(), key);
+      // also repeat a key now and then
+      const auto state = (it == down.end() || i % 7 == 0 ? 
+        KeyState::Down : KeyState::Up);
+      if (it == down.end())
+        down.push_back(key);
+      else if (state == KeyState::Up)
+        down.erase(it);
+      const auto event = KeyEvent(key, state);
+
+      const auto expected = format_sequence(reference.update(event, 0));
+      auto output = KeySequence();
+      if (stage.pass_through(event)) {
+        output.push_back(event);
+        ++passed;
+      }
+      else {
+        stage.update(event, 0, output);
+      }
+      INFO(config << ": " << i);
+      REQUIRE(format_sequence(output) == expected);
+      REQUIRE(stage.is_clear() == reference.is_clear());
+    }
+    CHECK(passed > 0);
+  }
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Many modifier filter keys", "[Stage]") {
+  // more than 64 keys fall back to matching filters
+  for (auto filters : { 3, 66 }) {
+    auto config = std::string();
+    for (auto i = 0; i < filters; ++i) {
+      const auto key = (i < 24 ? "F" + std::to_string(i + 1) :
+        i < 34 ? "Numpad" + std::to_string(i - 24) :
+        i < 58 ? std::string(1, static_cast<char>('C' + i - 34)) :
+        std::to_string(i - 58));
+      config += "[modifier=\"" + key + "\"]\n B >> Z\n";
+    }
+    config += R"(
+      [modifier="ShiftLeft !ControlLeft"]
+      A >> X
+
+      [modifier="!ShiftLeft"]
+      A >> Y
+    )";
+    Stage stage = create_stage(config.c_str());
+
+    INFO(filters);
+    CHECK(apply_input(stage, "+A -A") == "+Y -Y");
+    CHECK(apply_input(stage, "+ShiftLeft") == "+ShiftLeft");
+    CHECK(apply_input(stage, "+A -A") == "+X -X");
+    CHECK(apply_input(stage, "+ControlLeft") == "+ControlLeft");
+    CHECK(apply_input(stage, "+A -A") == "+A -A");
+    CHECK(apply_input(stage, "-ShiftLeft") == "-ShiftLeft");
+    CHECK(apply_input(stage, "+A -A") == "+Y -Y");
+    CHECK(apply_input(stage, "-ControlLeft") == "-ControlLeft");
+    CHECK(apply_input(stage, "+F2") == "+F2");
+    CHECK(apply_input(stage, "+B -B") == "+Z -Z");
+    CHECK(apply_input(stage, "-F2") == "-F2");
+    CHECK(apply_input(stage, "+B -B") == "+B -B");
+    REQUIRE(stage.is_clear());
+  }
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Replay output of key repeats", "[Stage]") {
+  const auto configs = {
+    "A >> B",
+    "A >> B C",
+    "A >> !ShiftLeft B",
+    "A{B} >> C",
+    "ShiftLeft{A} >> X",
+    "A >> ShiftLeft{X}",
+    "X >> ShiftLeft",
+    "A B >> X",
+    "A >> X ^ Y",
+    "[modifier=ShiftLeft] \n A >> X",
+  };
+  const auto keys = { Key::A, Key::B, Key::ShiftLeft, Key::X };
+
+  auto rand = std::mt19937(0);
+  auto dist = std::uniform_int_distribution<size_t>(0, keys.size() - 1);
+  for (auto config : configs) {
+    // reference never replays, since setting contexts resets it
+    auto reference = create_stage(config);
+    auto stage = create_stage(config);
+    auto down = std::vector<Key>();
+    for (auto i = 0; i < 2000; ++i) {
+      auto key = *(keys.begin() + dist(rand));
+      // mostly repeat last key pressed
+      if (!down.empty() && i % 4 != 0)
+        key = down.back();
+      const auto it = std::find(down.begin(), down.end(), key);
+      const auto state = (it == down.end() || i % 4 != 0 ? 
+        KeyState::Down : KeyState::Up);
+      if (it == down.end())
+        down.push_back(key);
+      else if (state == KeyState::Up)
+        down.erase(it);
+      const auto event = KeyEvent(key, state);
+
+      CHECK(reference.set_active_client_contexts(
+        reference.active_client_contexts()).empty());
+      const auto expected = format_sequence(reference.update(event, 0));
+      INFO(config << ": " << i);
+      REQUIRE(format_sequence(stage.update(event, 0)) == expected);
+      REQUIRE(stage.is_clear() == reference.is_clear());
+    }
+  }
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Update batches of events", "[Stage]") {
+  const auto configs = {
+    "A >> B",
+    "A >> B C",
+    "A{B} >> C",
+    "ShiftLeft{A} >> X",
+    "A B >> X",
+    "A !A B >> X",
+    "A >> X ^ Y",
+    "[modifier=ShiftLeft] \n A >> X",
+  };
+  const auto keys = { Key::A, Key::B, Key::ShiftLeft, Key::X };
+
+  auto rand = std::mt19937(0);
+  auto dist = std::uniform_int_distribution<size_t>(0, keys.size() - 1);
+  for (auto config : configs) {
+    auto reference = create_stage(config);
+    auto stage = create_stage(config);
+    auto down = std::vector<Key>();
+    auto batch = KeySequence();
+    for (auto i = 0; i < 2000; ++i) {
+      auto key = *(keys.begin() + dist(rand));
+      // also repeat keys within a batch
+      if (!down.empty() && i % 3 != 0)
+        key = down.back();
+      const auto it = std::find(down.begin(), down.end(), key);
+      const auto state = (it == down.end() || i % 3 != 0 ?
+        KeyState::Down : KeyState::Up);
+      if (it == down.end())
+        down.push_back(key);
+      else if (state == KeyState::Up)
+        down.erase(it);
+      batch.emplace_back(key, state);
+      if (dist(rand) != 0)
+        continue;
+
+      auto expected = KeySequence();
+      for (const auto& event : batch)
+        reference.update(event, 0, expected);
+      auto output = KeySequence();
+      stage.update(batch, 0, output);
+      INFO(config << ": " << i);
+      REQUIRE(format_sequence(output) == format_sequence(expected));
+      REQUIRE(stage.is_clear() == reference.is_clear());
+      batch.clear();
+    }
+  }
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Profile matching of inputs", "[Stage]") {
+  auto config = R"(
+    A >> X
+    B >> Y
+    C D >> Z
+  )";
+  auto stage = create_stage(config);
+  CHECK(stage.input_profiles().empty());
+  CHECK(format_sequence(stage.update(KeyEvent(Key::A, KeyState::Down), 0)) == "+X");
+  CHECK(stage.input_profiles().empty());
+
+  stage.set_profiling(true);
+  REQUIRE(stage.input_profiles().size() == 1);
+  REQUIRE(stage.input_profiles()[0].size() == 3);
+  CHECK(format_sequence(stage.update(KeyEvent(Key::A, KeyState::Up), 0)) == "-X");
+  CHECK(format_sequence(stage.update(KeyEvent(Key::A, KeyState::Down), 0)) == "+X");
+  CHECK(format_sequence(stage.update(KeyEvent(Key::A, KeyState::Up), 0)) == "-X");
+  CHECK(format_sequence(stage.update(KeyEvent(Key::C, KeyState::Down), 0)) == "");
+  CHECK(format_sequence(stage.update(KeyEvent(Key::D, KeyState::Down), 0)) == "+Z");
+
+  const auto& profiles = stage.input_profiles()[0];
+  CHECK(profiles[0].invocations == 1);
+  CHECK(profiles[0].matches == 1);
+  CHECK(profiles[0].might_matches == 0);
+  CHECK(profiles[1].invocations == 0);
+  CHECK(profiles[2].invocations == 2);
+  CHECK(profiles[2].might_matches == 1);
+  CHECK(profiles[2].matches == 1);
+
+  // enabling again keeps the counters
+  stage.set_profiling(true);
+  CHECK(stage.input_profiles()[0][2].invocations == 2);
+  stage.set_profiling(false);
+  CHECK(stage.input_profiles().empty());
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Output shared press early", "[Stage]") {
+  auto config = R"(
+    ShiftLeft{A} >> ShiftLeft{B}
+    ShiftLeft{C} >> ShiftLeft{D}
+    E{F} >> X
+  )";
+  auto stage = create_stage(config);
+  stage.set_early_output(true);
+  CHECK(apply_input(stage, "+ShiftLeft") == "+ShiftLeft");
+  CHECK(format_list(stage.get_output_keys_down()) == "ShiftLeft");
+  CHECK(apply_input(stage, "+A") == "+B -B -ShiftLeft");
+  CHECK(apply_input(stage, "-A -ShiftLeft") == "");
+  CHECK(stage.is_clear());
+
+  // forwarded when nothing matches
+  CHECK(apply_input(stage, "+ShiftLeft") == "+ShiftLeft");
+  CHECK(apply_input(stage, "+X") == "+X");
+  CHECK(apply_input(stage, "-X -ShiftLeft") == "-X -ShiftLeft");
+  CHECK(stage.is_clear());
+
+  // not when a mapping outputs something else first
+  CHECK(apply_input(stage, "+E") == "");
+  CHECK(apply_input(stage, "-E") == "+E -E");
+
+  // the same output as when disabled
+  const auto keys = { Key::ShiftLeft, Key::A, Key::C, Key::E, Key::F };
+  auto reference = create_stage(config);
+  auto rand = std::mt19937(0);
+  auto dist = std::uniform_int_distribution<size_t>(0, keys.size() - 1);
+  auto down = std::vector<Key>();
+  auto expected = KeySequence();
+  auto output = KeySequence();
+  for (auto i = 0; i < 2000; ++i) {
+    const auto key = *(keys.begin() + dist(rand));
+    const auto it = std::find(down.begin(), down.end(), key);
+    const auto state = (it == down.end() ? KeyState::Down : KeyState::Up);
+    if (it == down.end())
+      down.push_back(key);
+    else
+      down.erase(it);
+    reference.update(KeyEvent(key, state), 0, expected);
+    stage.update(KeyEvent(key, state), 0, output);
+    INFO(i);
+    if (!reference.is_holding_back())
+      REQUIRE(format_sequence(output) == format_sequence(expected));
+  }
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Choose match engine", "[Stage]") {
+  using MatchEngine = Stage::MatchEngine;
+  CHECK(create_stage("A >> B").match_engine() == MatchEngine::interpreted);
+  CHECK(create_stage("A !B >> C").match_engine() == MatchEngine::compiled);
+  CHECK(create_stage(R"(
+    A >> B
+    B >> C
+    C >> D
+    D >> E
+    E >> F
+  )").match_engine() == MatchEngine::compiled);
+  CHECK(create_stage(R"(
+    A Any >> B
+    B Any >> C
+    C >> D
+  )").match_engine() == MatchEngine::indexed);
+  CHECK(create_stage(R"(
+    Any A >> B
+    Any B >> C
+    C >> D
+  )").match_engine() == MatchEngine::interpreted);
+
+  CHECK(get_match_engine("indexed") == MatchEngine::indexed);
+  CHECK(!get_match_engine("fast"));
+  CHECK(get_match_engine_name(MatchEngine::compiled) == std::string("compiled"));
+
+  // each engine produces the same output
+  const auto configs = {
+    "A >> B",
+    "A{B} >> C",
+    "ShiftLeft{A} >> X",
+    "A B >> X",
+    "A !A B >> X",
+    "A Any >> X",
+    "[modifier=ShiftLeft] \n A >> X",
+  };
+  const auto keys = { Key::A, Key::B, Key::ShiftLeft, Key::X };
+  for (auto config : configs) {
+    auto reference = create_stage(config);
+    auto stages = std::vector<Stage>();
+    stages.reserve(3);
+    for (auto engine : { MatchEngine::interpreted, MatchEngine::indexed,
+        MatchEngine::compiled }) {
+      stages.push_back(create_stage(config));
+      stages.back().set_match_engine(engine);
+      CHECK(stages.back().match_engine() == engine);
+    }
+    auto rand = std::mt19937(0);
+    auto dist = std::uniform_int_distribution<size_t>(0, keys.size() - 1);
+    auto down = std::vector<Key>();
+    for (auto i = 0; i < 1000; ++i) {
+      const auto key = *(keys.begin() + dist(rand));
+      const auto it = std::find(down.begin(), down.end(), key);
+      const auto state = (it == down.end() ? KeyState::Down : KeyState::Up);
+      if (it == down.end())
+        down.push_back(key);
+      else
+        down.erase(it);
+      const auto expected = format_sequence(
+        reference.update(KeyEvent(key, state), 0));
+      INFO(config << ": " << i);
+      for (auto& stage : stages)
+        REQUIRE(format_sequence(stage.update(KeyEvent(key, state), 0)) == expected);
+    }
+  }
+
+  // the override can be reset
+  auto stage = create_stage("A >> B");
+  stage.set_match_engine(MatchEngine::compiled);
+  CHECK(apply_input(stage, "+A -A") == "+B -B");
+  stage.set_match_engine(std::nullopt);
+  CHECK(stage.match_engine() == MatchEngine::interpreted);
+  CHECK(apply_input(stage, "+A -A") == "+B -B");
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Restore Any matches of best sequence start", "[Stage]") {
+  using MatchEngine = Stage::MatchEngine;
+  for (auto engine : { MatchEngine::interpreted, MatchEngine::indexed,
+      MatchEngine::compiled }) {
+    INFO(get_match_engine_name(engine));
+
+    // the candidates evaluated after the best overwrote its Any matches
+    auto stage = create_stage(R"(
+      D{Shift ShiftRight} >> Any
+      D >> Any
+      Any >> Any
+    )");
+    stage.set_match_engine(engine);
+    CHECK(apply_input(stage, "+D") == "");
+    CHECK(apply_input(stage, "+ShiftRight") == "");
+    CHECK(apply_input(stage, "+B") == "+ShiftRight +B");
+
+    // a context switch in the middle of a sequence
+    stage = create_stage(R"(
+      [title=x]
+      E >> F
+
+      [title=y]
+      C D >> Any
+      C{Any} >> !C A
+    )", false);
+    stage.set_match_engine(engine);
+    CHECK(format_sequence(stage.set_active_client_contexts({ 0 })) == "");
+    CHECK(apply_input(stage, "+C") == "+C");
+    CHECK(format_sequence(stage.set_active_client_contexts({ 1 })) == "");
+    CHECK(apply_input(stage, "+D") == "");
+    CHECK(apply_input(stage, "+A") == "-C +A");
+    CHECK(apply_input(stage, "+ShiftLeft") == "+A");
+  }
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Materialize active contexts", "[Stage]") {
+  const char* const keys[] = { "B", "C", "D", "E", "F", "G", "H" };
+  auto config = std::string();
+  for (auto i = 0; i < 100; ++i)
+    config += "[title=\"Window" + std::to_string(i) + "\"]\n"
+      "A >> " + keys[i % 7] + "\n";
+  auto stage = create_stage(config.c_str(), false);
+  CHECK(stage.materialized_context_count() == 0);
+
+  // only the least recently active contexts are released
+  for (auto i = 0; i < 100; ++i) {
+    stage.set_active_client_contexts({ i });
+    CHECK(apply_input(stage, "+A -A") ==
+      std::string("+") + keys[i % 7] + " -" + keys[i % 7]);
+  }
+  CHECK(stage.materialized_context_count() == Stage::max_materialized_contexts);
+
+  // released ones are built again
+  stage.set_active_client_contexts({ 0, 99 });
+  CHECK(apply_input(stage, "+A -A") == "+B -B");
+  CHECK(stage.materialized_context_count() == Stage::max_materialized_contexts);
+
+  // active ones are not released
+  auto all = std::vector<int>();
+  for (auto i = 0; i < 100; ++i)
+    all.push_back(i);
+  stage.set_active_client_contexts(all);
+  CHECK(stage.materialized_context_count() == 100);
+  CHECK(apply_input(stage, "+A -A") == "+B -B");
+
+  // small configurations are built at once
+  CHECK(create_stage("A >> B", false).materialized_context_count() == 1);
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Embedded runtime library", "[Stage]") {
+  const auto program = keymapper::Program::parse(R"(
+    A >> B
+    C >> $(ls)
+
+    [title="Editor"]
+    F >> D
+
+    [stage]
+    B >> E
+  )");
+  CHECK(program->context_count() == 3);
+  CHECK_THROWS(keymapper::Program::parse("A >> UnknownKey"));
+
+  // instances of a program do not share state
+  auto instance = keymapper::Instance(program);
+  auto other = keymapper::Instance(program);
+  const auto format = [](ConstKeySequenceRange range) {
+    return format_sequence(KeySequence(range.begin(), range.end()));
+  };
+
+  CHECK(format(instance.set_active_contexts({ 0, 2 })) == "");
+  CHECK(format(instance.update(KeyEvent(Key::A, KeyState::Down))) == "+E");
+  CHECK(!instance.is_clear());
+  CHECK(other.is_clear());
+  CHECK(format(instance.update(KeyEvent(Key::A, KeyState::Up))) == "-E");
+
+  const auto events = KeySequence{
+    KeyEvent(Key::F, KeyState::Down), KeyEvent(Key::F, KeyState::Up) };
+  CHECK(format(instance.update(events)) == "+F -F");
+  CHECK(format(instance.set_active_contexts("", "Editor")) == "");
+  CHECK(format(instance.update(events)) == "+D -D");
+
+  const auto action = instance.update(KeyEvent(Key::C, KeyState::Down));
+  REQUIRE(action.size() == 1);
+  CHECK(program->action_command(action.begin()->key) == "ls");
+  CHECK(program->action_command(Key::A).empty());
+  instance.update(KeyEvent(Key::C, KeyState::Up));
+  CHECK(instance.is_clear());
+}
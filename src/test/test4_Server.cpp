@@ -2,13 +2,33 @@
 #include "test.h"
 #include "runtime/Timeout.h"
 #include "server/ServerState.h"
+#include "server/MessageQueue.h"
+#include "server/EventLog.h"
+#include "server/RemoteOutput.h"
+#include "server/StatisticsSnapshot.h"
+#include "client/ServerPort.h"
+#include "config/ParseConfig.h"
+#if !defined(_WIN32)
+# include "server/LocalClientPort.h"
+# include "client/LocalServerPort.h"
+# include <poll.h>
+#endif
+#include <fstream>
+#include <random>
 #include <utility>
+#include <thread>
 
 namespace {
   class ClientPortImpl : public IClientPort {
   private:
     std::vector<std::function<void(MessageHandler&)>> m_client_messages;
     std::vector<int> m_triggered_actions;
+    int m_triggered_action_messages{ };
+    KeySequence m_virtual_key_states;
+    int m_virtual_key_state_messages{ };
+    bool m_connected{ true };
+    // the sessions, which were created and are owned by the state
+    std::vector<ClientPortImpl*> m_sessions;
 
   public:
     Socket socket() const override { return 0; }
@@ -16,46 +36,126 @@ namespace {
     bool version_mismatch() const override { return false; }
     bool listen() override { return false; }
     bool accept() override { return false; }
-    void disconnect() override { }
-    bool send_triggered_action(int action) override { m_triggered_actions.push_back(action); return true; }
-    bool send_virtual_key_state(Key key, KeyState state) override { return true; }
+    void disconnect() override { m_connected = false; }
+    bool send_triggered_actions(const std::vector<int>& actions) override {
+      m_triggered_actions.insert(m_triggered_actions.end(), actions.begin(), actions.end());
+      ++m_triggered_action_messages;
+      return true;
+    }
+    bool send_virtual_key_state(Key key, KeyState state) override {
+      m_virtual_key_states.emplace_back(key, state);
+      ++m_virtual_key_state_messages;
+      return true;
+    }
+    bool send_virtual_key_states(const std::vector<KeyEvent>& states) override {
+      m_virtual_key_states.insert(m_virtual_key_states.end(), states.begin(), states.end());
+      ++m_virtual_key_state_messages;
+      return true;
+    }
     bool send_next_key_info(Key key, const DeviceDesc& device_desc) override { return true; }
+    bool send_statistics(const std::string& statistics) override { return true; }
+    bool send_input_profiles(const InputProfiles& profiles) override { return true; }
 
     bool read_messages(MessageHandler& handler, 
         std::optional<Duration> timeout) override {
       for (auto i = 0u; i < m_client_messages.size(); ++i) 
         m_client_messages[i](handler);
       m_client_messages.clear();
-      return true; 
+      return m_connected; 
     }
 
+    void set_snapshot_filename(std::filesystem::path filename) override { }
+    bool load_snapshot(MessageHandler& handler) override { return false; }
+
+    std::unique_ptr<IClientPort> create_session() const override {
+      auto session = std::make_unique<ClientPortImpl>();
+      const_cast<ClientPortImpl*>(this)->m_sessions.push_back(session.get());
+      return session;
+    }
+
+    void swap_session(IClientPort& other_port) override {
+      auto& other = static_cast<ClientPortImpl&>(other_port);
+      std::swap(m_client_messages, other.m_client_messages);
+      std::swap(m_connected, other.m_connected);
+    }
+
+    void restore_session(MessageHandler& handler) override { }
+
+    ClientPortImpl& session(size_t index) { return *m_sessions.at(index); }
+
     void inject_client_message(std::function<void(MessageHandler&)> send) {
       m_client_messages.push_back(send);
     }
 
     std::vector<int> reset_triggered_actions() { return std::exchange(m_triggered_actions, std::vector<int>()); }
+    int reset_triggered_action_messages() { return std::exchange(m_triggered_action_messages, 0); }
+    std::string reset_virtual_key_states() { return format_sequence(std::exchange(m_virtual_key_states, { })); }
+    int reset_virtual_key_state_messages() { return std::exchange(m_virtual_key_state_messages, 0); }
   };
 
   class State : public ServerState {
   private:
     ClientPortImpl& m_client;
     KeySequence m_output;
+    std::vector<Key> m_keys_down;
+    std::vector<size_t> m_batch_sizes;
+    size_t m_batch_size{ };
+    std::optional<Clock::time_point> m_time;
+    KeyEvent m_last_output;
 
   public:
     State(std::unique_ptr<IClientPort> client, ClientPortImpl* client_ptr) 
       : ServerState(std::move(client)),
         m_client(*client_ptr) {
+      // recording the batches should not allocate while sending
+      m_batch_sizes.reserve(1024);
     }
 
     ClientPortImpl& client() { return m_client; }
+    const KeyEvent& last_output() const { return m_last_output; }
 
     bool on_send_key(const KeyEvent& event) override {
       m_output.push_back(event);
+      m_last_output = event;
+      ++m_batch_size;
       return true;
     }
 
     void on_exit_requested() override {
     }
+
+    Clock::time_point now() const override {
+      return m_time.value_or(Clock::now());
+    }
+
+    // simulates the time, so deadlines can be processed without waiting
+    void set_time(Clock::time_point time) {
+      m_time = time;
+    }
+
+    bool on_keys_sent() override {
+      if (m_batch_size)
+        m_batch_sizes.push_back(std::exchange(m_batch_size, 0));
+      return true;
+    }
+
+    std::vector<size_t> reset_batch_sizes() {
+      return std::exchange(m_batch_sizes, { });
+    }
+
+    bool on_get_keys_down(KeyBitmap& keys_down) override {
+      for (auto key : m_keys_down)
+        keys_down.set(key);
+      return true;
+    }
+
+    void validate_state(std::vector<Key> keys_down) {
+      m_keys_down = std::move(keys_down);
+      m_client.inject_client_message([](ClientPort::MessageHandler& handler) {
+        handler.on_validate_state_message();
+      });
+      read_client_messages();
+    }
     
     void on_grab_device_filters_message(
         std::vector<GrabDeviceFilter> filters) override {
@@ -69,10 +169,11 @@ namespace {
       read_client_messages();
     }
 
-    std::string set_active_contexts(std::vector<int> indices) {
-      m_client.inject_client_message([indices = std::move(indices)](
+    std::string set_active_contexts(std::vector<int> indices,
+        ContextSwitchTimes times = { }) {
+      m_client.inject_client_message([indices = std::move(indices), times](
           ClientPort::MessageHandler& handler) mutable {
-        handler.on_active_contexts_message(std::move(indices));
+        handler.on_active_contexts_message(std::move(indices), times);
       });
       read_client_messages();
 
@@ -81,6 +182,37 @@ namespace {
       return result;
     }
 
+    void set_directives(std::vector<std::string> directives) {
+      m_client.inject_client_message([directives = std::move(directives)](
+          ClientPort::MessageHandler& handler) {
+        handler.on_directives_message(directives);
+      });
+      read_client_messages();
+    }
+
+    std::string set_virtual_key_states(std::vector<Key> keys, KeyState state) {
+      m_client.inject_client_message([keys = std::move(keys), state](
+          ClientPort::MessageHandler& handler) {
+        if (keys.size() == 1)
+          handler.on_set_virtual_key_state_message(keys.front(), state);
+        else
+          handler.on_set_virtual_key_states_message(keys, state);
+      });
+      read_client_messages();
+
+      auto result = format_sequence(m_output);
+      m_output.clear();
+      return result;
+    }
+
+    void inject_output(const KeySequence& sequence) {
+      m_client.inject_client_message([sequence](
+          ClientPort::MessageHandler& handler) {
+        handler.on_inject_output_message(sequence);
+      });
+      read_client_messages();
+    }
+
     std::string apply_input(const KeySequence& sequence, int device_index = 0) {
       for (auto event : sequence)
         if (!translate_input(event, device_index))
@@ -94,6 +226,21 @@ namespace {
       return result;
     }
 
+    template<size_t N>
+    std::string apply_input_at(const char(&input)[N], Clock::time_point time) {
+      for (auto event : parse_sequence(input))
+        if (!translate_input(event, 0, time))
+          m_output.push_back(event);
+      return flush();
+    }
+
+    template<size_t N>
+    std::string apply_forwarded_input(const char(&input)[N]) {
+      for (auto event : parse_sequence(input))
+        update_forwarded_input(event, 0);
+      return flush();
+    }
+
     std::string flush() {
       flush_send_buffer();
 
@@ -189,7 +336,8 @@ TEST_CASE("Modifier filter toggled in ContextActive", "[Server]") {
 //--------------------------------------------------------------------
 
 TEST_CASE("Modifier filter toggled in two ContextActive (prevent infinite loop)", "[Server]") {
-  auto state = create_state(R"(
+  // cycles are rejected by ParseConfig
+  CHECK_THROWS(create_state(R"(
     C >> Virtual1
 
     [modifier = Virtual1]
@@ -197,13 +345,7 @@ TEST_CASE("Modifier filter toggled in two ContextActive (prevent infinite loop)"
 
     [modifier = "!Virtual1"]
     ContextActive >> B Virtual1
-  )", false);
-  CHECK(state.set_active_contexts({ 0, 1, 2 }) == "+B -B +A -A +B -B +A -A +B -B +A -A +B -B +A -A +B -B +A -A");
-  CHECK(state.apply_input("+A -A") == "+A -A");
-  CHECK(state.apply_input("+B -B") == "+B -B");
-  CHECK(state.apply_input("+C") == "+B -B +A -A +B -B +A -A +B -B +A -A +B -B +A -A +B -B");
-  CHECK(state.apply_input("+A -A") == "+A -A");
-  CHECK(state.apply_input("+B -B") == "+B -B");
+  )", false));
 }
 
 //--------------------------------------------------------------------
@@ -260,6 +402,904 @@ TEST_CASE("Trigger Not Timeout", "[Server]") {
 
 //--------------------------------------------------------------------
 
+TEST_CASE("Process deadlines", "[Server]") {
+  auto state = create_state(R"(
+    A{!200ms} >> X
+    A{200ms} >> Y
+  )");
+  CHECK(!state.next_deadline());
+  CHECK(state.apply_input("+A") == "");
+  REQUIRE(state.next_deadline());
+  const auto deadline = *state.next_deadline();
+  CHECK(deadline == *state.timeout_start_at() + 
+    std::chrono::duration_cast<Clock::duration>(state.timeout()));
+
+  // nothing to do before deadline
+  CHECK(state.process_deadlines(deadline - std::chrono::milliseconds(1)));
+  CHECK(state.next_deadline() == deadline);
+  CHECK(state.flush() == "");
+
+  CHECK(state.process_deadlines(deadline));
+  CHECK(!state.next_deadline());
+  CHECK(state.flush() == "+Y");
+  CHECK(state.apply_input("-A") == "-Y");
+  REQUIRE(state.stage_is_clear());
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Measure timeout lateness", "[Server]") {
+  auto state = create_state(R"(
+    A{200ms} >> Y
+    B >> X 100ms Z
+  )");
+  const auto start = Clock::time_point{ } + std::chrono::hours(1);
+  const auto ms = [&](int ms) { return start + std::chrono::milliseconds(ms); };
+  state.set_time(start);
+
+  // timeout fires 3ms late, the injected event contains the timeout
+  CHECK(state.apply_input("+A") == "");
+  state.set_time(ms(203));
+  CHECK(state.process_deadlines(ms(203)));
+  CHECK(state.flush() == "+Y");
+  CHECK(state.apply_input("-A") == "-Y");
+
+  // delayed flush is processed 5ms late
+  state.set_time(ms(300));
+  CHECK(state.apply_input("+B -B") == "+X -X");
+  state.set_time(ms(405));
+  CHECK(state.process_deadlines(ms(405)));
+  CHECK(state.flush() == "+Z -Z");
+
+  const auto statistics = state.statistics();
+  CHECK(statistics.timeout_lateness.count() == 1);
+  CHECK(statistics.timeout_lateness.max() == std::chrono::milliseconds(3));
+  CHECK(statistics.flush_lateness.count() == 1);
+  CHECK(statistics.flush_lateness.max() == std::chrono::milliseconds(5));
+  CHECK(format_statistics(statistics).find("timeout-late") != std::string::npos);
+  CHECK(format_open_metrics(statistics).find("flush_lateness") != std::string::npos);
+  CHECK(state.format_recent_events().find(
+    "   -0.202000 input           200ms\n") != std::string::npos);
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Timeouts measured with event time", "[Server]") {
+  auto state = create_state(R"(
+    A{!200ms} >> X
+    A{200ms} >> Y
+  )");
+  const auto time = Clock::now() + std::chrono::seconds(10);
+  CHECK(state.apply_input_at("+A", time) == "");
+  REQUIRE(state.timeout_start_at() == time);
+  CHECK(state.apply_input_at("-A", time + std::chrono::milliseconds(100)) == "+X -X");
+  REQUIRE(state.stage_is_clear());
+
+  // released after timeout according to event time
+  CHECK(state.apply_input_at("+A", time) == "");
+  CHECK(state.apply_input_at("-A", time + std::chrono::milliseconds(300)) == "+Y -Y");
+  REQUIRE(state.stage_is_clear());
+
+  // event time before timeout start
+  CHECK(state.apply_input_at("+A", time) == "");
+  CHECK(state.apply_input_at("-A", time - std::chrono::milliseconds(300)) == "+X -X");
+  REQUIRE(state.stage_is_clear());
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Timeouts with simulated time", "[Server]") {
+  auto state = create_state(R"(
+    A{!200ms} >> X
+    A{200ms} >> Y
+  )");
+  const auto time = Clock::time_point{ } + std::chrono::hours(1);
+  state.set_time(time);
+  CHECK(state.apply_input("+A") == "");
+  REQUIRE(state.timeout_start_at() == time);
+  REQUIRE(state.next_deadline() == time + std::chrono::milliseconds(200));
+
+  // deadline is reached without waiting
+  state.set_time(*state.next_deadline());
+  CHECK(state.process_deadlines(*state.next_deadline()));
+  CHECK(state.flush() == "+Y");
+  CHECK(!state.next_deadline());
+  CHECK(state.apply_input("-A") == "-Y");
+  REQUIRE(state.stage_is_clear());
+
+  state.set_time(time + std::chrono::seconds(1));
+  CHECK(state.apply_input("+A") == "");
+  state.set_time(time + std::chrono::milliseconds(1100));
+  CHECK(state.apply_input("-A") == "+X -X");
+  REQUIRE(state.stage_is_clear());
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Forward client messages through queue", "[Server]") {
+  auto state = create_state(R"(
+    A >> B
+  )");
+  auto queue = MessageQueue();
+  auto reader = std::thread([&]() {
+    auto& handler = static_cast<IClientPort::MessageHandler&>(queue);
+    handler.on_configuration_message(create_multi_stage("A >> C"));
+    handler.on_active_contexts_message({ 0 }, { });
+    for (auto i = 0; i < 100; ++i)
+      handler.on_inject_input_message(parse_sequence("+A -A"));
+    queue.close();
+  });
+
+  auto output = std::string();
+  for (;;) {
+    const auto closed = queue.closed();
+    while (queue.apply_next(state))
+      output += state.flush();
+    if (closed)
+      break;
+    std::this_thread::yield();
+  }
+  reader.join();
+  CHECK(queue.empty());
+
+  auto expected = std::string();
+  for (auto i = 0; i < 100; ++i)
+    expected += "+C -C";
+  CHECK(output == expected);
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Log events without waiting", "[Server]") {
+  auto queue = LockFreeQueue<int, 4>();
+  for (auto i = 0; i < 4; ++i)
+    CHECK(queue.try_push(i));
+  CHECK(!queue.try_push(4));
+  auto value = 0;
+  CHECK(queue.pop(value));
+  CHECK(value == 0);
+  CHECK(queue.try_push(4));
+
+  // entries exceeding the queue are dropped, logging never blocks
+  auto log = EventLog();
+  const auto output = parse_sequence("+B -B +C -C");
+  const auto start = Clock::now();
+  for (auto i = 0; i < 10000; ++i)
+    log.log(KeyEvent(Key::A, KeyState::Down), output.data(), output.size(),
+      true, start + std::chrono::microseconds(i));
+  log.stop();
+  log.log(KeyEvent(Key::A, KeyState::Up), nullptr, 0, false, Clock::now());
+  log.stop();
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Combine unmapped wheel events", "[Server]") {
+  auto state = create_state(R"(
+    WheelLeft >> A
+  )");
+  const auto start = Clock::now();
+  const auto ms = [&](int ms) { return start + std::chrono::milliseconds(ms); };
+  state.set_time(start);
+
+  // first event is sent at once
+  CHECK(state.apply_input_at("-WheelUp", ms(0)) == "+WheelUp -WheelUp");
+  CHECK(state.last_output().value == 120);
+
+  // following events are combined until the window closes
+  CHECK(state.apply_input_at("-WheelUp", ms(1)) == "");
+  CHECK(state.apply_input_at("-WheelUp", ms(2)) == "");
+  REQUIRE(state.next_deadline());
+  CHECK(*state.next_deadline() == ms(4));
+  state.set_time(ms(4));
+  CHECK(state.process_deadlines(ms(4)));
+  CHECK(state.flush() == "+WheelUp -WheelUp");
+  CHECK(state.last_output().value == 240);
+  CHECK(!state.next_deadline());
+
+  // other input and a change of the direction send them in order
+  CHECK(state.apply_input_at("-WheelUp", ms(5)) == "");
+  CHECK(state.apply_input_at("-WheelDown", ms(6)) == "+WheelUp -WheelUp");
+  CHECK(state.apply_input_at("+X", ms(7)) == "+WheelDown -WheelDown +X");
+  CHECK(state.apply_input_at("-X", ms(7)) == "-X");
+
+  // mapped wheel events are not combined
+  state.set_time(ms(20));
+  CHECK(state.apply_input_at("-WheelUp", ms(20)) == "+WheelUp -WheelUp");
+  CHECK(state.apply_input_at("-WheelLeft", ms(21)) == "+A -A");
+  CHECK(state.apply_input_at("-WheelLeft", ms(22)) == "+A -A");
+
+  // can be disabled
+  state.set_directives({ "wheel-aggregation 0" });
+  CHECK(state.apply_input_at("-WheelUp", ms(23)) == "+WheelUp -WheelUp");
+  CHECK(state.apply_input_at("-WheelUp", ms(23)) == "+WheelUp -WheelUp");
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Override match engine", "[Server]") {
+  auto state = create_state(R"(
+    A >> B
+  )");
+  CHECK(state.statistics().match_engines ==
+    std::vector<std::string>{ "interpreted" });
+  state.set_directives({ "match-engine compiled" });
+  CHECK(state.statistics().match_engines ==
+    std::vector<std::string>{ "compiled" });
+  CHECK(state.apply_input("+A -A") == "+B -B");
+
+  const auto statistics = state.statistics();
+  CHECK(format_statistics(statistics).find(
+    "match engines      compiled\n") != std::string::npos);
+  CHECK(format_open_metrics(statistics).find(
+    "keymapper_stage_match_engine_info{stage=\"0\",engine=\"compiled\"} 1")
+    != std::string::npos);
+
+  state.set_directives({ });
+  CHECK(state.statistics().match_engines ==
+    std::vector<std::string>{ "interpreted" });
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Optimize output", "[Server]") {
+  auto state = create_state(R"(
+    A >> B !B B
+  )");
+  CHECK(state.apply_input("+A") == "+B -B +B");
+  CHECK(state.apply_input("-A") == "-B");
+  CHECK(state.statistics().optimized_events == 0);
+
+  state.set_directives({ "optimize-output", "inject-rate 0" });
+  CHECK(state.apply_input("+A") == "+B -B +B");
+  CHECK(state.apply_input("-A") == "-B");
+
+  // uses the state of keys sent by previous flushes
+  state.inject_output(parse_sequence("+ShiftLeft"));
+  CHECK(state.flush() == "+ShiftLeft");
+  state.inject_output(parse_sequence("-ShiftLeft +ShiftLeft +C -C -C"));
+  CHECK(state.flush() == "+C -C");
+  state.inject_output(parse_sequence("-ShiftLeft -ShiftLeft +ShiftLeft"));
+  CHECK(state.flush() == "");
+  state.inject_output(parse_sequence("-ShiftLeft"));
+  CHECK(state.flush() == "-ShiftLeft");
+  CHECK(state.statistics().optimized_events == 6);
+
+  // key repeats are kept
+  CHECK(state.apply_input("+X +X -X") == "+X +X -X");
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Concurrent output", "[Server]") {
+  auto state = create_state(R"(
+    A >> X 100ms Y
+    B >> Z
+    C >> Y
+  )");
+  const auto start = Clock::time_point{ } + std::chrono::hours(1);
+  const auto ms = [&](int ms) { return start + std::chrono::milliseconds(ms); };
+  state.set_time(start);
+
+  // output waits for delayed output
+  CHECK(state.apply_input("+A -A") == "+X -X");
+  CHECK(state.apply_input("+B -B") == "");
+  state.set_time(ms(100));
+  CHECK(state.process_deadlines(ms(100)));
+  CHECK(state.flush() == "+Y -Y +Z -Z");
+
+  state.set_directives({ "concurrent-output" });
+  CHECK(state.apply_input("+A") == "+X -X");
+  REQUIRE(state.next_deadline() == ms(200));
+
+  // key repeat of the input is ignored while it is played
+  CHECK(state.apply_input("+A") == "");
+  CHECK(state.apply_input("+B -B") == "+Z -Z");
+  CHECK(state.apply_input("-A") == "");
+
+  // output sharing keys is sent after it
+  CHECK(state.apply_input("+C -C") == "");
+  state.set_time(ms(200));
+  CHECK(state.process_deadlines(ms(200)));
+  CHECK(state.flush() == "+Y -Y +Y -Y");
+  CHECK(!state.next_deadline());
+  CHECK(state.apply_input("+B -B") == "+Z -Z");
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Send buffer wraps around", "[Server]") {
+  auto buffer = RingBuffer<int>();
+  CHECK(buffer.empty());
+  for (auto i = 0; i < 10; ++i)
+    buffer.push_back(i);
+  buffer.pop_front(8);
+  CHECK(buffer.front() == 8);
+
+  // wraps around without growing
+  const auto capacity = buffer.capacity();
+  for (auto i = 10; i < 20; ++i)
+    buffer.push_back(i);
+  CHECK(buffer.capacity() == capacity);
+  CHECK(buffer.size() == 12);
+  for (auto i = size_t{ }; i < buffer.size(); ++i)
+    CHECK(buffer[i] == static_cast<int>(i) + 8);
+
+  // grows keeping the order
+  for (auto i = 20; i < 40; ++i)
+    buffer.push_back(i);
+  CHECK(buffer.capacity() > capacity);
+  for (auto i = 8; i < 40; ++i) {
+    CHECK(buffer.front() == i);
+    buffer.pop_front();
+  }
+  CHECK(buffer.empty());
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Defer configuration until stage is clear", "[Server]") {
+  auto state = create_state(R"(
+    A >> B
+  )");
+  CHECK(state.apply_input("+A") == "+B");
+  state.set_configuration(create_multi_stage("A >> C"));
+  CHECK(state.has_pending_configuration());
+  CHECK(state.set_active_contexts({ 0 }) == "");
+  CHECK(state.apply_input("+A") == "+B");
+  CHECK(state.apply_input("-A") == "-B");
+  CHECK(!state.has_pending_configuration());
+  CHECK(state.apply_input("+A -A") == "+C -C");
+
+  // applied after a while, even when key is still hold
+  CHECK(state.apply_input("+A") == "+C");
+  state.set_configuration(create_multi_stage("A >> B"));
+  CHECK(state.set_active_contexts({ 0 }) == "");
+  REQUIRE(state.next_deadline());
+  const auto deadline = *state.next_deadline();
+  CHECK(state.process_deadlines(deadline - std::chrono::milliseconds(1)));
+  CHECK(state.has_pending_configuration());
+  CHECK(state.process_deadlines(deadline));
+  CHECK(!state.has_pending_configuration());
+  CHECK(state.flush() == "-C +B");
+  CHECK(state.apply_input("-A") == "-B");
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Transfer state to deferred configuration", "[Server]") {
+  auto state = create_state(R"(
+    A >> B
+    ShiftLeft >> ShiftLeft
+  )");
+  const auto apply_configuration = [&](const char* config) {
+    state.set_configuration(create_multi_stage(config));
+    REQUIRE(state.has_pending_configuration());
+    state.set_active_contexts({ 0 });
+    REQUIRE(state.next_deadline());
+    CHECK(state.process_deadlines(*state.next_deadline()));
+    REQUIRE(!state.has_pending_configuration());
+    return state.flush();
+  };
+
+  // equivalent mapping
+  CHECK(state.apply_input("+ShiftLeft +A") == "+ShiftLeft +B");
+  CHECK(apply_configuration("A >> B") == "");
+  CHECK(state.apply_input("-A") == "-B");
+  CHECK(state.apply_input("-ShiftLeft") == "-ShiftLeft");
+  REQUIRE(state.stage_is_clear());
+
+  // other mapping
+  CHECK(state.apply_input("+ShiftLeft +A") == "+ShiftLeft +B");
+  CHECK(apply_configuration("A >> C") == "-B +C");
+  CHECK(state.apply_input("-A") == "-C");
+  CHECK(state.apply_input("-ShiftLeft") == "-ShiftLeft");
+  REQUIRE(state.stage_is_clear());
+
+  // no mapping
+  CHECK(state.apply_input("+ShiftLeft +A") == "+ShiftLeft +C");
+  CHECK(apply_configuration("X >> Y") == "-C +A");
+  CHECK(state.apply_input("-A") == "-A");
+  CHECK(state.apply_input("-ShiftLeft") == "-ShiftLeft");
+  REQUIRE(state.stage_is_clear());
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Send keys in batches", "[Server]") {
+  auto state = create_state(R"(
+    A >> B C D
+    E >> B $(action) C D
+    F >> $(action1) B $(action2) C
+  )");
+  CHECK(state.apply_input("+A") == "+B -B +C -C +D -D");
+  CHECK(state.reset_batch_sizes() == std::vector<size_t>{ 6 });
+  CHECK(state.apply_input("-A") == "");
+
+  // action ends batch
+  CHECK(state.apply_input("+E") == "+B -B +C -C +D -D");
+  CHECK(state.reset_batch_sizes() == std::vector<size_t>{ 2, 4 });
+  CHECK(state.apply_input("-E") == "");
+  CHECK(state.client().reset_triggered_actions() == std::vector<int>{ 0 });
+  state.client().reset_triggered_action_messages();
+
+  // actions are sent at once, in order
+  CHECK(state.apply_input("+F") == "+B -B +C -C");
+  CHECK(state.client().reset_triggered_actions() == std::vector<int>{ 1, 2 });
+  CHECK(state.client().reset_triggered_action_messages() == 1);
+  CHECK(state.apply_input("-F") == "");
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Set several virtual keys at once", "[Server]") {
+  auto state = create_state(R"(
+    Virtual1 >> A
+    Virtual2 >> B
+    Virtual3 >> C
+  )");
+  const auto virtual_key = [](int index) {
+    return static_cast<Key>(static_cast<int>(Key::first_virtual) + index);
+  };
+  const auto keys = std::vector<Key>{
+    virtual_key(1), virtual_key(2), virtual_key(3) };
+
+  // output is flushed and the new states are sent once
+  CHECK(state.set_virtual_key_states(keys, KeyState::Down) == "+A +B +C");
+  CHECK(state.reset_batch_sizes() == std::vector<size_t>{ 3 });
+  CHECK(state.client().reset_virtual_key_states() ==
+    "+Virtual1 +Virtual2 +Virtual3");
+  CHECK(state.client().reset_virtual_key_state_messages() == 1);
+
+  // only changed states are sent
+  CHECK(state.set_virtual_key_states({ virtual_key(1) }, KeyState::Up) == "-A");
+  CHECK(state.client().reset_virtual_key_states() == "-Virtual1");
+  CHECK(state.set_virtual_key_states(keys, KeyState::Up) == "-B -C");
+  CHECK(state.client().reset_virtual_key_states() == "-Virtual2 -Virtual3");
+  CHECK(state.client().reset_virtual_key_state_messages() == 2);
+  CHECK(state.reset_batch_sizes() == std::vector<size_t>{ 1, 2 });
+
+  // toggling is the same as one after the other
+  CHECK(state.set_virtual_key_states({ virtual_key(2) }, KeyState::Down) == "+B");
+  CHECK(state.set_virtual_key_states(keys, KeyState::Not) == "+A -B +C");
+  CHECK(state.client().reset_virtual_key_states() ==
+    "+Virtual2 +Virtual1 -Virtual2 +Virtual3");
+  CHECK(state.reset_batch_sizes() == std::vector<size_t>{ 1, 3 });
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Pace injected output", "[Server]") {
+  auto state = create_state(R"(
+    A >> B
+  )");
+  auto injected = std::string();
+  for (auto i = 0; i < 20; ++i)
+    injected += "+ShiftLeft +X -X -ShiftLeft ";
+  const auto sequence = parse_sequence(injected.data(),
+    injected.data() + injected.size());
+  state.set_time(Clock::time_point{ });
+  state.inject_output(sequence);
+
+  // first batch is sent at once, without splitting the Shift{X}
+  const auto batch = "+ShiftLeft +X -X -ShiftLeft "
+    "+ShiftLeft +X -X -ShiftLeft +ShiftLeft +X -X -ShiftLeft";
+  CHECK(state.flush() == batch);
+  REQUIRE(state.flush_scheduled_at());
+
+  // input is still handled in between
+  CHECK(state.apply_input("+A") == "");
+  CHECK(state.flush() == "+B");
+  CHECK(state.apply_input("-A") == "");
+  CHECK(state.flush() == "-B");
+
+  auto output = std::string(batch);
+  while (auto deadline = state.next_deadline()) {
+    state.set_time(*deadline);
+    CHECK(state.process_deadlines(*deadline));
+    if (auto next = state.flush(); !next.empty())
+      output += " " + next;
+  }
+  CHECK(output == format_sequence(sequence));
+
+  // a rate of 0 sends all at once
+  state.set_directives({ "inject-rate 0" });
+  state.inject_output(sequence);
+  CHECK(state.flush() == format_sequence(sequence));
+  CHECK(!state.next_deadline());
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Collect statistics", "[Server]") {
+  auto state = create_state(R"(
+    A >> B
+    C D >> E
+  )");
+  const auto time = Clock::time_point{ } + std::chrono::hours(1);
+  state.set_time(time);
+  CHECK(state.apply_input_at("+A", time - std::chrono::milliseconds(2)) == "+B");
+  CHECK(state.apply_input("-A") == "-B");
+  CHECK(state.apply_input("+C") == "");
+  CHECK(state.apply_input("-C") == "");
+  state.set_time(time + std::chrono::milliseconds(5));
+  CHECK(state.apply_input("+D") == "+E");
+  CHECK(state.apply_input("-D") == "-E");
+
+  const auto statistics = state.statistics();
+  CHECK(statistics.events == 6);
+  CHECK(statistics.matches == 2);
+  CHECK(statistics.might_matches == 2);
+  CHECK(statistics.timeouts == 0);
+  CHECK(statistics.flushes == 4);
+  CHECK(statistics.read_to_translate.count() == 6);
+  CHECK(statistics.read_to_translate.max() == std::chrono::milliseconds(2));
+  // the output of C D was sent once D was pressed
+  CHECK(statistics.event_to_send.count() == 4);
+  CHECK(statistics.event_to_send.max() == std::chrono::milliseconds(5));
+  CHECK(statistics.translate_to_send.max() == std::chrono::milliseconds(5));
+
+  // counters are kept when the configuration is updated
+  state.set_configuration(create_multi_stage("A >> C"));
+  state.set_active_contexts({ 0 });
+  CHECK(state.apply_input("+A") == "+C");
+  CHECK(state.statistics().matches == 3);
+
+  auto histogram = LatencyHistogram();
+  for (auto i = 1; i <= 1000; ++i)
+    histogram.record(std::chrono::microseconds(i));
+  CHECK(histogram.count() == 1000);
+  CHECK(histogram.max() == std::chrono::microseconds(1000));
+  const auto p50 = histogram.percentile(0.5);
+  CHECK(p50 >= std::chrono::microseconds(500));
+  CHECK(p50 <= std::chrono::microseconds(532));
+  CHECK(histogram.percentile(1.0) == std::chrono::microseconds(1000));
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Export statistics in OpenMetrics format", "[Server]") {
+  auto state = create_state(R"(
+    A >> B
+  )");
+  CHECK(state.apply_input("+A") == "+B");
+  CHECK(state.apply_input("-A") == "-B");
+  CHECK(state.apply_input("+C") == "+C");
+
+  auto statistics = state.statistics();
+  statistics.event_to_send = LatencyHistogram();
+  statistics.event_to_send.record(std::chrono::microseconds(20));
+  statistics.event_to_send.record(std::chrono::microseconds(200));
+  statistics.event_to_send.record(std::chrono::milliseconds(200));
+  CHECK(statistics.event_to_send.count_at_most(
+    std::chrono::microseconds(100)) == 1);
+  CHECK(statistics.event_to_send.count_at_most(
+    std::chrono::milliseconds(1)) == 2);
+  statistics.stages = { StageProfile{ 5, 7 } };
+
+  const auto text = format_open_metrics(statistics);
+  CHECK(text.find("keymapper_events_total 3\n") != std::string::npos);
+  CHECK(text.find("keymapper_matches_total 1\n") != std::string::npos);
+  CHECK(text.find("# TYPE keymapper_devices gauge\n") != std::string::npos);
+  CHECK(text.find("keymapper_stage_events_out_total{stage=\"0\"} 7\n") !=
+    std::string::npos);
+  CHECK(text.find("keymapper_event_to_send_seconds_bucket{le=\"0.0001\"} 1\n") !=
+    std::string::npos);
+  CHECK(text.find("keymapper_event_to_send_seconds_bucket{le=\"+Inf\"} 3\n") !=
+    std::string::npos);
+  CHECK(text.find("keymapper_event_to_send_seconds_count 3\n") !=
+    std::string::npos);
+  CHECK(text.substr(text.size() - 6) == "# EOF\n");
+
+  // snapshots are only published when requested
+  auto snapshot = StatisticsSnapshot();
+  snapshot.publish(statistics);
+  CHECK(snapshot.version() == 0);
+  CHECK(snapshot.statistics().events == 0);
+  snapshot.request();
+  CHECK(snapshot.requested());
+  snapshot.publish(statistics);
+  CHECK(!snapshot.requested());
+  CHECK(snapshot.version() == 1);
+  CHECK(snapshot.statistics().events == 3);
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Account memory usage", "[Server]") {
+  auto state = create_state(R"(
+    A >> B
+    [stage]
+    B >> E F G H I J K L M N O
+  )");
+  CHECK(state.apply_input("+A") ==
+    "+E -E +F -F +G -G +H -H +I -I +J -J +K -K +L -L +M -M +N -N +O -O");
+
+  const auto stage = create_multi_stage(R"(
+    [device = /Keyboard.*/]
+    A >> B
+    [device = /Keyboard.*/]
+    C >> D
+  )");
+  const auto usage = stage->memory_usage();
+  CHECK(usage.contexts > 0);
+  CHECK(usage.arena > 0);
+  CHECK(usage.buffers >= stage->buffer_footprint());
+  // both filters share one compiled regex
+  CHECK(usage.regexes == Regex("Keyboard.*", false).memory_usage());
+  CHECK(usage.total() == usage.contexts + usage.matching + usage.arena +
+    usage.regexes + usage.buffers);
+
+  const auto report = state.format_memory_usage();
+  CHECK(report.find("regexes") != std::string::npos);
+  CHECK(report.find("send buffers") != std::string::npos);
+  CHECK(report.find("total") != std::string::npos);
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Count allocations of the input path", "[Server]") {
+  auto state = create_state(R"(
+    A >> B
+    C D >> E
+    ShiftLeft{F} >> G
+  )");
+  const auto input = parse_sequence(
+    "+A -A +C -C +D -D +ShiftLeft +F -F -ShiftLeft +X -X");
+
+  // warm up buffers
+  for (auto i = 0; i < 3; ++i)
+    state.apply_input(input);
+  REQUIRE(state.stage_is_clear());
+
+  const auto before = state.statistics();
+  for (auto i = 0; i < 10; ++i)
+    state.apply_input(input);
+  const auto after = state.statistics();
+
+  // the translation of the input and the sending do not allocate
+  CHECK(after.translate_allocations.calls -
+    before.translate_allocations.calls == 10 * input.size());
+  CHECK(after.translate_allocations.allocations ==
+    before.translate_allocations.allocations);
+  CHECK(after.flush_allocations.calls > before.flush_allocations.calls);
+  CHECK(after.flush_allocations.allocations ==
+    before.flush_allocations.allocations);
+  CHECK(format_statistics(after).find("allocations") != std::string::npos);
+
+  // the allocations of a scope are counted
+  auto statistics = AllocationStatistics{ };
+  {
+    const auto count_allocations = ScopedAllocationCount(statistics);
+    auto vector = std::vector<char>(100);
+    CHECK(vector.size() == 100);
+  }
+  CHECK(statistics.calls == 1);
+  CHECK(statistics.allocations == 1);
+  CHECK(statistics.bytes == 100);
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Measure context switch latency", "[Server]") {
+  auto state = create_state(R"(
+    [title="A"]
+    A >> B
+    [title="C"]
+    A >> C
+  )");
+  const auto time = Clock::time_point{ } + std::chrono::hours(1);
+  const auto ms = [&](int milliseconds) {
+    return to_timestamp(time + std::chrono::milliseconds(milliseconds));
+  };
+  state.set_time(time + std::chrono::milliseconds(10));
+  CHECK(state.set_active_contexts({ 1 }, { ms(0), ms(2), ms(3), ms(7) }) == "");
+  CHECK(state.apply_input("+A") == "+C");
+  CHECK(state.apply_input("-A") == "-C");
+
+  // contexts which were not sent because of a focus change are not measured
+  CHECK(state.set_active_contexts({ 0 }) == "");
+  CHECK(state.apply_input("+A") == "+B");
+
+  const auto statistics = state.statistics();
+  CHECK(statistics.focus_to_apply.count() == 1);
+  CHECK(statistics.focus_to_apply.max() == std::chrono::milliseconds(10));
+  CHECK(statistics.focus_to_match.max() == std::chrono::milliseconds(2));
+  CHECK(statistics.match_to_send.max() == std::chrono::milliseconds(1));
+  CHECK(statistics.send_to_receive.max() == std::chrono::milliseconds(4));
+  CHECK(statistics.receive_to_apply.max() == std::chrono::milliseconds(3));
+  CHECK(format_statistics(statistics).find("focus-apply") != std::string::npos);
+
+  const auto timestamp = ms(123);
+  CHECK(to_timestamp(from_timestamp(timestamp)) == timestamp);
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Switch between client sessions", "[Server]") {
+  auto state = create_state(R"(
+    A >> X
+  )");
+  CHECK(state.apply_input("+A") == "+X");
+
+  // keys are released, when another client connects
+  state.park_client_session();
+  CHECK(state.flush() == "-X");
+  CHECK(!state.has_configuration());
+  CHECK(state.client_session_count() == 1);
+  CHECK(state.apply_input("-A") == "-A");
+
+  state.set_configuration(create_multi_stage(R"(
+    A >> Y
+    B >> Z
+  )"));
+  CHECK(state.set_active_contexts({ 0, 1 }) == "");
+  CHECK(state.apply_input("+A -A") == "+Y -Y");
+
+  // parked session stays inactive until a window is focused
+  auto& parked = state.client().session(0);
+  parked.inject_client_message([](ClientPort::MessageHandler& handler) {
+    handler.on_active_contexts_message({ 0 }, { });
+  });
+  CHECK(!state.read_client_sessions());
+  CHECK(state.apply_input("+B -B") == "+Z -Z");
+
+  parked.inject_client_message([](ClientPort::MessageHandler& handler) {
+    handler.on_active_contexts_message({ 0 }, { 1, 2, 3, 4 });
+  });
+  CHECK(state.read_client_sessions());
+  state.park_client_session();
+  CHECK(state.resume_client_session());
+  CHECK(state.client_session_count() == 1);
+  CHECK(state.apply_input("+A -A") == "+X -X");
+  CHECK(state.apply_input("+B -B") == "+B -B");
+
+  // the other session is resumed, when the active client disconnects
+  state.disconnect();
+  state.reset_configuration();
+  CHECK(state.resume_client_session());
+  CHECK(state.client_session_count() == 0);
+  CHECK(state.apply_input("+B -B") == "+Z -Z");
+  CHECK(!state.resume_client_session());
+
+  // disconnected parked sessions are removed
+  state.park_client_session();
+  CHECK(state.client_session_count() == 1);
+  state.client().session(2).disconnect();
+  CHECK(!state.read_client_sessions());
+  CHECK(state.client_session_count() == 0);
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Keep recent events", "[Server]") {
+  auto state = create_state(R"(
+    A >> B
+    C{200ms} >> D
+  )");
+  const auto time = Clock::time_point{ } + std::chrono::hours(1);
+  state.set_time(time);
+  CHECK(state.apply_input(parse_sequence("+A"), 1) == "+B");
+  CHECK(state.apply_input(parse_sequence("+E")) == "+E");
+  CHECK(state.apply_input(parse_sequence("+C")) == "");
+
+  state.set_time(time + std::chrono::milliseconds(500));
+  CHECK(state.format_recent_events() ==
+    "   -0.500000 input           +0x001E device 1\n"
+    "   -0.500000 output          +0x0030 device -1\n"
+    "   -0.500000 forwarded       +0x0012 device 0\n"
+    "   -0.500000 input           +0x002E device 0\n"
+    "   -0.500000 timeout         200ms\n");
+
+  // only the most recent events are kept
+  for (auto i = 0; i < 1000; ++i)
+    state.apply_input(parse_sequence("+E -E"));
+  const auto events = state.format_recent_events();
+  CHECK(std::count(events.begin(), events.end(), '\n') == 1024);
+  CHECK(events.find("+0x001E") == std::string::npos);
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Export event trace", "[Server]") {
+  auto state = create_state(R"(
+    A >> B
+  )");
+  const auto time = Clock::time_point{ } + std::chrono::hours(1);
+  state.set_time(time);
+  CHECK(state.apply_input(parse_sequence("+A"), 1) == "+B");
+  // spans are only recorded while tracing
+  CHECK(state.format_recent_events().find("translate") == std::string::npos);
+
+  state.set_tracing(true);
+  state.set_time(time + std::chrono::milliseconds(1));
+  CHECK(state.apply_input(parse_sequence("-A"), 1) == "-B");
+  const auto events = state.format_recent_events();
+  CHECK(events.find("translate") != std::string::npos);
+  CHECK(events.find("flush") != std::string::npos);
+  CHECK(events.find("write output") != std::string::npos);
+
+  const auto filename = std::filesystem::temp_directory_path() /
+    "keymapper-test.json";
+  REQUIRE(state.write_event_trace(filename));
+  auto file = std::ifstream(filename);
+  const auto trace = std::string(std::istreambuf_iterator<char>(file), { });
+  file.close();
+  std::filesystem::remove(filename);
+  CHECK(trace.rfind("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", 0) == 0);
+  CHECK(trace.find("\"name\":\"keymapperd\"") != std::string::npos);
+  CHECK(trace.find("{\"name\":\"translate\",\"pid\":1,\"tid\":2,"
+    "\"ts\":3600001000.000,\"ph\":\"X\",\"dur\":0.000,"
+    "\"args\":{\"key\":\"-0x001E\",\"device\":1}}") != std::string::npos);
+  CHECK(trace.find("{\"name\":\"input\",\"pid\":1,\"tid\":1,"
+    "\"ts\":3600000000.000,\"ph\":\"i\",\"s\":\"t\","
+    "\"args\":{\"key\":\"+0x001E\",\"device\":1}}") != std::string::npos);
+  CHECK(trace.substr(trace.size() - 4) == "\n]}\n");
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Record input trace", "[Server]") {
+  const auto filename = std::filesystem::temp_directory_path() /
+    "keymapper-test.trace";
+  {
+    auto state = create_state(R"(
+      A >> B
+    )");
+    REQUIRE(state.record_input_trace(filename));
+    CHECK(state.apply_input(parse_sequence("+A"), 1) == "+B");
+    CHECK(state.apply_input(parse_sequence("-A"), 1) == "-B");
+    state.set_active_contexts({ });
+  }
+
+  auto reader = InputTraceReader();
+  REQUIRE(reader.open(filename));
+  auto record = InputTraceRecord{ };
+  REQUIRE(reader.read(record));
+  CHECK(record.type == InputTraceRecord::Type::configuration);
+  CHECK(record.configuration_hash ==
+    get_configuration_hash(*create_multi_stage("A >> B")));
+  REQUIRE(reader.read(record));
+  CHECK(record.type == InputTraceRecord::Type::active_contexts);
+  CHECK(record.active_contexts == std::vector<int>{ 0 });
+
+  auto time = uint64_t{ };
+  for (auto expected : parse_sequence("+A -A")) {
+    REQUIRE(reader.read(record));
+    CHECK(record.type == InputTraceRecord::Type::input);
+    CHECK(record.event == expected);
+    CHECK(record.device_index == 1);
+    CHECK(record.time >= time);
+    time = record.time;
+  }
+  REQUIRE(reader.read(record));
+  CHECK(record.type == InputTraceRecord::Type::active_contexts);
+  CHECK(record.active_contexts.empty());
+  CHECK(!reader.read(record));
+  std::filesystem::remove(filename);
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Validate state with keys down", "[Server]") {
+  auto state = create_state(R"(
+    A >> B
+    C >> D
+  )");
+  CHECK(state.apply_input("+A +C") == "+B +D");
+
+  state.validate_state({ Key::A, Key::C });
+  CHECK(!state.stage_is_clear());
+
+  // release of C was missed
+  state.validate_state({ Key::A });
+  CHECK(!state.stage_is_clear());
+  CHECK(state.apply_input("-A") == "-B");
+  CHECK(state.stage_is_clear());
+}
+
+//--------------------------------------------------------------------
+
 TEST_CASE("ContextActive with fallthrough contexts", "[Server]") {
   auto state = create_state(R"(
     [modifier = B]
@@ -348,6 +1388,36 @@ TEST_CASE("Device context filter", "[Server]") {
 
 //--------------------------------------------------------------------
 
+TEST_CASE("Device context filter with many devices", "[Server]") {
+  auto state = create_state(R"(
+    [device = "Device99"]
+    A >> X
+
+    [device = /Device[0-9]*0$/]
+    A >> Y
+  )");
+
+  auto device_descs = std::vector<DeviceDesc>();
+  for (auto i = 0; i < 100; ++i)
+    device_descs.push_back({ "Device" + std::to_string(i) });
+  state.set_device_descs(std::move(device_descs));
+
+  CHECK(state.apply_input("+A", 99) == "+X");
+  CHECK(state.apply_input("-A", 99) == "-X");
+  CHECK(state.apply_input("+A", 90) == "+Y");
+  CHECK(state.apply_input("-A", 90) == "-Y");
+  CHECK(state.apply_input("+A", 0) == "+Y");
+  CHECK(state.apply_input("-A", 0) == "-Y");
+  CHECK(state.apply_input("+A", 35) == "+A");
+  CHECK(state.apply_input("-A", 35) == "-A");
+  CHECK(state.apply_input("+A", 64) == "+A");
+  CHECK(state.apply_input("-A", 64) == "-A");
+  CHECK(state.apply_input("+A", 100) == "+A");
+  CHECK(state.apply_input("-A", 100) == "-A");
+}
+
+//--------------------------------------------------------------------
+
 TEST_CASE("Multi staging", "[Server]") {
   auto state = create_state(R"(
     # colemak layout
@@ -488,6 +1558,146 @@ TEST_CASE("Multi staging - virtual key", "[Server]") {
 
 //--------------------------------------------------------------------
 
+TEST_CASE("Multi staging - route timeouts and virtual keys", "[Server]") {
+  auto stage = create_multi_stage(R"(
+    X >> Virtual1
+
+    [stage]
+    Virtual1{A} >> R
+
+    [stage]
+    B{500ms} >> S
+
+    [stage]
+    Any >> Any
+  )");
+  stage->set_active_client_contexts({ 0, 1, 2, 3 });
+  const auto& stages = stage->stages();
+  const auto has_key_down = [&](size_t index, Key key) {
+    const auto keys = stages[index]->get_input_keys_down();
+    return (std::find(keys.begin(), keys.end(), key) != keys.end());
+  };
+  const auto virtual1 = static_cast<Key>(*Key::first_virtual + 1);
+
+  // virtual key is only toggled in the stages referring to it
+  CHECK(format_sequence(stage->update(
+    KeyEvent(virtual1, KeyState::Down), 0)) == "");
+  CHECK(has_key_down(1, virtual1));
+  CHECK(!has_key_down(2, virtual1));
+  CHECK(has_key_down(3, virtual1));
+
+  // timeout is only applied in stages waiting for it
+  CHECK(!stages[2]->is_waiting_for_timeout());
+  CHECK(format_sequence(stage->update(
+    KeyEvent(Key::B, KeyState::Down), 0)) == "-500ms");
+  CHECK(stages[2]->is_waiting_for_timeout());
+  CHECK(format_sequence(stage->update(reply_timeout_ms(500), 0)) == "+S");
+  CHECK(format_sequence(stage->update(
+    KeyEvent(Key::B, KeyState::Up), 0)) == "-S");
+  CHECK(!stages[2]->is_waiting_for_timeout());
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Multi staging - timeout flushes other stage", "[Server]") {
+  auto state = create_state(R"(
+    ShiftRight{300ms} >>
+
+    [stage]
+    B D >> $(command)
+  )");
+
+  // the second stage does not map timeouts, but still holds back B
+  CHECK(state.apply_input("+B") == "");
+  CHECK(state.apply_input("+ShiftRight") == "");
+  CHECK(state.apply_timeout_reached() == "+B");
+  CHECK(state.apply_input("-ShiftRight") == "");
+  CHECK(state.apply_input("-B") == "-B");
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Multi staging - update batches", "[Server]") {
+  const auto config = R"(
+    X >> Virtual1
+    C >> $(action0)
+
+    [stage]
+    Virtual1{A} >> R
+    A B >> S
+
+    [stage]
+    S >> T
+
+    [stage]
+    T >> U
+    B{500ms} >> V
+  )";
+  auto reference = create_multi_stage(config);
+  auto stage = create_multi_stage(config);
+  reference->set_active_client_contexts({ 0, 1, 2, 3, 4 });
+  stage->set_active_client_contexts({ 0, 1, 2, 3, 4 });
+
+  const auto virtual1 = static_cast<Key>(*Key::first_virtual + 1);
+  const auto check_batch = [&](const KeySequence& batch) {
+    auto expected = KeySequence();
+    for (const auto& event : batch)
+      reference->update(event, 0, expected);
+    auto output = KeySequence();
+    stage->update(batch, 0, output);
+    INFO(format_sequence(batch));
+    CHECK(format_sequence(output) == format_sequence(expected));
+  };
+  check_batch(parse_sequence("+A +B -B -A +S -S +T -T"));
+  check_batch(parse_sequence("+X -X +A -A +A -A +C -C"));
+  check_batch({ KeyEvent(virtual1, KeyState::Down), KeyEvent(Key::A, KeyState::Down),
+    KeyEvent(Key::A, KeyState::Up) });
+  check_batch(parse_sequence("+B"));
+  check_batch({ reply_timeout_ms(500), KeyEvent(Key::B, KeyState::Up) });
+  CHECK(stage->is_clear() == reference->is_clear());
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Multi staging - stage profiles", "[Server]") {
+  auto stage = create_multi_stage(R"(
+    A >> B C
+    X >> $(action0)
+
+    [stage]
+    B C >> D
+  )");
+  CHECK(stage->stage_profiles().empty());
+  stage->set_profiling(true);
+  REQUIRE(stage->stage_profiles().size() == 2);
+  CHECK(format_sequence(stage->set_active_client_contexts({ 0, 1 })) == "");
+
+  CHECK(format_sequence(stage->update(KeyEvent(Key::A, KeyState::Down), 0)) == "+D -D");
+  CHECK(format_sequence(stage->update(KeyEvent(Key::A, KeyState::Up), 0)) == "");
+  CHECK(format_sequence(stage->update(KeyEvent(Key::X, KeyState::Down), 0)) == "+Action0");
+  CHECK(format_sequence(stage->update(KeyEvent(Key::X, KeyState::Up), 0)) == "-Action0");
+
+  const auto& first = stage->stage_profiles()[0];
+  CHECK(first.events_in == 4);
+  CHECK(first.events_out == 6);
+  CHECK(first.forwarded_server_events == 0);
+  CHECK(first.context_updates == 1);
+  const auto& second = stage->stage_profiles()[1];
+  CHECK(second.events_in == 4);
+  CHECK(second.events_out == 2);
+  CHECK(second.might_match_holds == 2);
+  CHECK(second.forwarded_server_events == 2);
+  CHECK(second.context_updates == 1);
+
+  // enabling again keeps the counters
+  stage->set_profiling(true);
+  CHECK(stage->stage_profiles()[0].events_in == 4);
+  stage->set_profiling(false);
+  CHECK(stage->stage_profiles().empty());
+}
+
+//--------------------------------------------------------------------
+
 TEST_CASE("Multi staging - actions", "[Server]") {
   auto state = create_state(R"(
     F1 >> $(action0)
@@ -557,3 +1767,754 @@ TEST_CASE("Multi staging - ContextActive", "[Server]") {
   CHECK(state.set_active_contexts({ 0, 1 }) == "+A -A +D -D");
   CHECK(state.set_active_contexts({ 1 }) == "+B -B");
 }
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Clone configuration for another seat", "[Server]") {
+  auto state = create_state(R"(
+    [title="A"]
+    A >> X
+
+    [title="B"]
+    A >> Y
+
+    [stage]
+    Y >> Z
+  )", false);
+  CHECK(state.set_active_contexts({ 1, 2 }) == "");
+  CHECK(state.apply_input("+A") == "+Z");
+
+  // the clone has the same contexts, but none of the state
+  auto clone = state.clone_configuration();
+  CHECK(clone->context_count() == 3);
+  CHECK(clone->is_clear());
+  CHECK(clone->active_client_contexts().empty());
+  CHECK(state.active_contexts() == std::vector<int>{ 1, 2 });
+  clone->set_active_client_contexts(state.active_contexts());
+  CHECK(format_sequence(clone->update({ Key::A, KeyState::Down },
+    0)) == "+Z");
+  CHECK(state.apply_input("-A") == "-Z");
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Activate cached configuration", "[Server]") {
+  // counts the stages, which are built again on activation
+  struct Handler : IClientPort::MessageHandler {
+    MessageHandler& state;
+    int builds{ };
+
+    explicit Handler(MessageHandler& state) : state(state) { }
+    void on_configuration_message(MultiStagePtr stage) override { state.on_configuration_message(std::move(stage)); }
+    void on_grab_device_filters_message(std::vector<GrabDeviceFilter> filters) override { state.on_grab_device_filters_message(std::move(filters)); }
+    void on_directives_message(const std::vector<std::string>& directives) override { state.on_directives_message(directives); }
+    void on_active_contexts_message(const std::vector<int>& indices, const ContextSwitchTimes& times) override { state.on_active_contexts_message(indices, times); }
+    void on_set_virtual_key_state_message(Key key, KeyState state_) override { state.on_set_virtual_key_state_message(key, state_); }
+    void on_validate_state_message() override { state.on_validate_state_message(); }
+    void on_request_next_key_info_message() override { }
+    void on_inject_input_message(const KeySequence&) override { }
+    void on_inject_output_message(const KeySequence&) override { }
+    void on_request_statistics_message(bool) override { }
+    void on_request_input_profiles_message() override { }
+    void on_activate_configuration_message(size_t hash,
+        const std::function<MultiStagePtr()>& build_stage) override {
+      state.on_activate_configuration_message(hash, [&]() {
+        ++builds;
+        return build_stage();
+      });
+    }
+  };
+
+  auto state = create_state("");
+  auto handler = Handler(state);
+  auto client = ServerPort();
+  auto server = ClientPort();
+  auto parse = ParseConfig();
+
+  // returns the type of the message sent
+  const auto send_config = [&](const char* string) {
+    auto stream = std::stringstream(string);
+    auto s = Serializer();
+    client.write_config(s, parse(stream));
+    auto d = Deserializer(std::vector<char>(s.data(), s.data() + s.size()));
+    const auto type = d.read<MessageType>();
+    if (type == MessageType::activate_configuration)
+      CHECK(server.read_activate_configuration(d, handler));
+    else
+      CHECK(server.read_configuration(d, handler,
+        type == MessageType::configuration_update));
+    state.set_active_contexts({ 0, 1 });
+    return type;
+  };
+  const auto config_a = "A >> B";
+  const auto config_b = "A >> C";
+
+  CHECK(send_config(config_a) == MessageType::configuration);
+  CHECK(state.apply_input("+A -A") == "+B -B");
+  CHECK(send_config(config_b) == MessageType::configuration_update);
+  CHECK(state.apply_input("+A -A") == "+C -C");
+  CHECK(send_config(config_a) == MessageType::activate_configuration);
+  CHECK(state.apply_input("+A -A") == "+B -B");
+  CHECK(send_config(config_b) == MessageType::activate_configuration);
+  CHECK(state.apply_input("+A -A") == "+C -C");
+  CHECK(handler.builds == 0);
+
+  // sending the current configuration again updates it
+  CHECK(send_config(config_b) == MessageType::configuration_update);
+
+  // updates refer to the contexts of the activated configuration
+  CHECK(send_config(config_a) == MessageType::activate_configuration);
+  CHECK(send_config("A >> B\n[title=X]\nA >> D") ==
+    MessageType::configuration_update);
+  CHECK(state.apply_input("+A -A") == "+B -B");
+
+  // the least recently used are evicted
+  for (auto key : { "E", "F", "G", "H" })
+    CHECK(send_config((std::string("A >> ") + key).c_str()) ==
+      MessageType::configuration_update);
+  CHECK(state.apply_input("+A -A") == "+H -H");
+  CHECK(send_config(config_a) == MessageType::configuration_update);
+  CHECK(send_config(config_b) == MessageType::configuration_update);
+  CHECK(send_config("A >> G") == MessageType::activate_configuration);
+  CHECK(state.apply_input("+A -A") == "+G -G");
+  CHECK(send_config("A >> E") == MessageType::configuration_update);
+  CHECK(handler.builds == 0);
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Build stages in parallel", "[Server]") {
+  // large enough to be built on several threads
+  const char* const keys[] = { "E", "F", "G", "H", "I", "J", "K", "L" };
+  auto config = std::string();
+  for (auto [input, output] : { std::pair("A", "B"), std::pair("B", "C"),
+      std::pair("C", "D") }) {
+    if (!config.empty())
+      config += "[stage]\n";
+    config += std::string(input) + " >> " + output + "\n";
+    for (auto m = 0; m < 200; ++m)
+      config += std::string("ShiftLeft{") + keys[m % 8] + "} " +
+        keys[(m / 8) % 8] + " >> " + keys[(m / 64) % 8] + "\n";
+  }
+
+  auto state = create_state("");
+  auto client = ServerPort();
+  auto server = ClientPort();
+  auto stream = std::stringstream(config);
+  auto s = Serializer();
+  client.write_config(s, ParseConfig()(stream));
+  auto d = Deserializer(std::vector<char>(s.data(), s.data() + s.size()));
+  CHECK(d.read<MessageType>() == MessageType::configuration);
+  CHECK(server.read_configuration(d, state, false));
+  state.set_active_contexts({ 0, 1, 2 });
+  CHECK(state.statistics().match_engines.size() == 3);
+  CHECK(state.apply_input("+A -A") == "+D -D");
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Active contexts delta", "[Server]") {
+  auto client = ServerPort();
+  auto server = ClientPort();
+
+  // returns the type of the message sent
+  const auto send = [&](const std::vector<int>& indices) {
+    auto s = Serializer();
+    client.write_active_contexts(s, indices);
+    auto d = Deserializer(std::vector<char>(s.data(), s.data() + s.size()));
+    const auto type = d.read<MessageType>();
+    CHECK(server.read_active_contexts(d,
+      type == MessageType::active_contexts_delta) == indices);
+    return type;
+  };
+
+  CHECK(send({ 0, 3, 5, 7 }) == MessageType::active_contexts);
+  CHECK(send({ 0, 3, 5, 7 }) == MessageType::active_contexts_delta);
+  CHECK(send({ 0, 3, 6, 7, 1000 }) == MessageType::active_contexts_delta);
+  CHECK(send({ 1, 2, 3 }) == MessageType::active_contexts);
+  CHECK(send({ 1, 2, 3, 4 }) == MessageType::active_contexts_delta);
+  CHECK(send({ }) == MessageType::active_contexts);
+  CHECK(send({ 2 }) == MessageType::active_contexts);
+  CHECK(send({ 5, 2 }) == MessageType::active_contexts);
+  CHECK(send({ 2, 5 }) == MessageType::active_contexts);
+  CHECK(send({ 2, 5 }) == MessageType::active_contexts_delta);
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Multi staging - update only changed stages", "[Server]") {
+  auto state = create_state(R"(
+    [title="App1"]    # 0
+    ContextActive >> A ^ B
+
+    [stage]           # 1
+    A >> X
+
+    [title="App2"]    # 2
+    ContextActive >> C ^ D
+  )", false);
+
+  CHECK(state.set_active_contexts({ 1, 2 }) == "+C -C");
+  CHECK(state.set_active_contexts({ 0, 1, 2 }) == "+X -X");
+  CHECK(state.set_active_contexts({ 1, 2 }) == "+B -B");
+  CHECK(state.set_active_contexts({ 1, 2 }) == "");
+  CHECK(state.set_active_contexts({ 0, 1 }) == "+X -X +D -D");
+  CHECK(state.set_active_contexts({ 0 }) == "");
+  CHECK(state.set_active_contexts({ 1 }) == "+B -B");
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Multi staging - update unchanged stages holding output", "[Server]") {
+  auto state = create_state(R"(
+    [modifier="ShiftLeft"]
+    A >> B ^ C
+  )", false);
+
+  CHECK(state.set_active_contexts({ 0 }) == "");
+  CHECK(state.apply_input("+ShiftLeft") == "+ShiftLeft");
+  CHECK(state.apply_input("+A") == "+B -B");
+  CHECK(state.apply_input("-ShiftLeft") == "-ShiftLeft");
+
+  // output on release of the deactivated context is cancelled
+  CHECK(state.set_active_contexts({ 0 }) == "");
+  CHECK(state.apply_input("-A") == "");
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Multi staging - fuse remapping stages", "[Server]") {
+  const auto config = std::string(R"(
+    ShiftLeft{A} >> B
+    X >> Virtual1
+    Virtual1{C} >> D
+
+    [stage]
+    A >> S
+    S >> A
+    ButtonLeft >> ButtonRight
+    ButtonRight >> ButtonLeft
+    $(fusable)
+
+    [stage]
+    S >> T
+    T >> S
+    B >> ShiftLeft
+    ShiftLeft >> B
+    $(fusable)
+  )");
+  const auto create = [&](const char* replacement) {
+    auto string = config;
+    for (auto pos = string.find("$(fusable)"); pos != std::string::npos;
+         pos = string.find("$(fusable)"))
+      string.replace(pos, 10, replacement);
+    auto stage = create_multi_stage(string.c_str());
+    stage->set_active_client_contexts({ 0, 1, 2 });
+    return stage;
+  };
+  // the sequence prevents fusing the stages, but does not match
+  auto fused = create("");
+  auto updated = create("F23 F24 >> F22");
+
+  const auto apply = [](MultiStage& stage, KeyEvent event) {
+    return format_sequence(stage.update(event, 0));
+  };
+  CHECK(apply(*fused, { Key::A, KeyState::Down }) == "+T");
+  CHECK(apply(*fused, { Key::A, KeyState::Up }) == "-T");
+  CHECK(apply(*fused, { Key::S, KeyState::Down }) == "+A");
+  CHECK(!fused->is_clear());
+  CHECK(format_list(fused->get_output_keys_down()) == "A");
+  CHECK(apply(*fused, { Key::S, KeyState::Up }) == "-A");
+  CHECK(fused->is_clear());
+
+  // compare with updating each stage
+  const Key keys[] = { Key::A, Key::S, Key::T, Key::B, Key::C, Key::D,
+    Key::X, Key::ShiftLeft, Key::ButtonLeft, Key::ButtonRight };
+  auto random = std::mt19937(7);
+  auto down = std::vector<Key>();
+  for (auto i = 0; i < 2000; ++i) {
+    const auto key = keys[random() % std::size(keys)];
+    const auto it = std::find(down.begin(), down.end(), key);
+    const auto event = KeyEvent(key, (it == down.end() || random() % 4 == 0 ?
+      KeyState::Down : KeyState::Up));
+    if (event.state == KeyState::Up)
+      down.erase(it);
+    else if (it == down.end())
+      down.push_back(key);
+    REQUIRE(apply(*fused, event) == apply(*updated, event));
+    REQUIRE(format_list(fused->get_output_keys_down()) ==
+      format_list(updated->get_output_keys_down()));
+  }
+
+  // remaps are only applied while their stage is active
+  fused = create("");
+  fused->set_active_client_contexts({ 0, 2 });
+  CHECK(apply(*fused, { Key::A, KeyState::Down }) == "+A");
+  fused->set_active_client_contexts({ 0, 1, 2 });
+  CHECK(apply(*fused, { Key::A, KeyState::Up }) == "-A");
+  CHECK(apply(*fused, { Key::A, KeyState::Down }) == "+T");
+  CHECK(apply(*fused, { Key::A, KeyState::Up }) == "-T");
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Multi staging - fused stage after server events", "[Server]") {
+  const auto config = std::string(R"(
+    ControlLeft{300ms} >> A 50ms E
+    X >> Virtual1 $(ls)
+    Virtual1{C} >> D
+
+    [stage]
+    A >> B
+    B >> A
+    C >> C
+    $(fusable)
+  )");
+  const auto create = [&](const char* replacement) {
+    auto string = config;
+    string.replace(string.find("$(fusable)"), 10, replacement);
+    auto stage = create_multi_stage(string.c_str());
+    stage->set_active_client_contexts({ 0, 1 });
+    return stage;
+  };
+  auto fused = create("");
+  auto updated = create("F23 F24 >> F22");
+
+  const auto apply = [](MultiStage& stage, KeyEvent event) {
+    return format_sequence(stage.update(event, 0));
+  };
+  const auto events = {
+    KeyEvent(Key::ControlLeft, KeyState::Down),
+    reply_timeout_ms(300),
+    KeyEvent(Key::ControlLeft, KeyState::Up),
+    KeyEvent(Key::X, KeyState::Down),
+    KeyEvent(Key::X, KeyState::Up),
+    KeyEvent(Key::first_virtual, KeyState::Down),
+    KeyEvent(Key::C, KeyState::Down),
+    KeyEvent(Key::C, KeyState::Up),
+    KeyEvent(Key::first_virtual, KeyState::Up),
+  };
+  // timeouts, output delays, virtual keys and actions are not held
+  for (const auto& event : events) {
+    CHECK(apply(*fused, event) == apply(*updated, event));
+    CHECK(fused->is_clear() == updated->is_clear());
+  }
+  CHECK(fused->is_clear());
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Multi staging - pass keys through fused stage", "[Server]") {
+  const auto config = std::string(R"(
+    X >> Y
+
+    [stage]
+    A >> B
+    B >> A
+    $(fusable)
+  )");
+  const auto create = [&](const char* replacement) {
+    auto string = config;
+    string.replace(string.find("$(fusable)"), 10, replacement);
+    auto stage = create_multi_stage(string.c_str());
+    stage->set_active_client_contexts({ 0, 1 });
+    return stage;
+  };
+  auto fused = create("");
+  auto updated = create("F23 F24 >> F22");
+
+  // like the server, keys are updated when they cannot pass through
+  const auto apply = [](MultiStage& stage, KeyEvent event) {
+    if (stage.pass_through(event))
+      return "=" + format_sequence({ event });
+    return format_sequence(stage.update(event, 0));
+  };
+  const auto events = {
+    KeyEvent(Key::E, KeyState::Down),
+    KeyEvent(Key::A, KeyState::Down),
+    KeyEvent(Key::E, KeyState::Down),
+    KeyEvent(Key::E, KeyState::Up),
+    KeyEvent(Key::A, KeyState::Up),
+    KeyEvent(Key::E, KeyState::Up),
+    KeyEvent(Key::B, KeyState::Up),
+    KeyEvent(Key::X, KeyState::Down),
+    KeyEvent(Key::X, KeyState::Up),
+  };
+  // keys passed through are held and released like updated keys
+  for (const auto& event : events) {
+    CHECK(apply(*fused, event) == apply(*updated, event));
+    CHECK(fused->is_clear() == updated->is_clear());
+  }
+  CHECK(fused->is_clear());
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Forward unmapped keys directly", "[Server]") {
+  auto state = create_state(R"(
+    A B >> C
+    [title="App1"]   # 1
+    X >> Y
+    [stage]          # 2
+    C >> D
+  )", false);
+
+  CHECK(state.set_active_contexts({ 0, 2 }) == "");
+  CHECK(state.apply_input("+X") == "+X");
+  CHECK(state.apply_input("-X") == "-X");
+
+  // releasing passed key while sequence might match
+  CHECK(state.apply_input("+X") == "+X");
+  CHECK(state.apply_input("+A") == "");
+  CHECK(state.apply_input("-X") == "-X +A");
+  CHECK(state.apply_input("-A") == "-A");
+
+  CHECK(state.apply_input("+X") == "+X");
+  CHECK(state.apply_input("+A") == "");
+  CHECK(state.apply_input("+B") == "+D");
+  CHECK(state.apply_input("-X") == "-X");
+  CHECK(state.apply_input("-B") == "-D");
+  CHECK(state.apply_input("-A") == "");
+
+  // mapped in active context
+  CHECK(state.set_active_contexts({ 0, 1, 2 }) == "");
+  CHECK(state.apply_input("+X") == "+Y");
+  CHECK(state.apply_input("-X") == "-Y");
+
+  // context changed while key is hold
+  CHECK(state.apply_input("+X") == "+Y");
+  CHECK(state.set_active_contexts({ 0, 2 }) == "");
+  CHECK(state.apply_input("+X") == "+X");
+  CHECK(state.apply_input("-X") == "-X -Y");
+  CHECK(state.apply_input("+X") == "+X");
+  CHECK(state.apply_input("-X") == "-X");
+  CHECK(state.stage_is_clear());
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Update state with forwarded keys", "[Server]") {
+  auto state = create_state(R"(
+    A B >> C
+    X >> $(action)
+    [stage]
+    C >> D
+  )");
+
+  auto keys = KeyBitmap();
+  CHECK(state.get_referenced_keys(keys));
+  CHECK(keys.test(Key::A));
+  CHECK(keys.test(Key::B));
+  CHECK(keys.test(Key::C));
+  CHECK(keys.test(Key::D));
+  CHECK(keys.test(Key::X));
+  CHECK(!keys.test(Key::E));
+
+  CHECK(state.can_forward_unreferenced());
+  CHECK(state.apply_forwarded_input("+E") == "");
+  CHECK(state.apply_input("+A") == "");
+  CHECK(!state.can_forward_unreferenced());
+  CHECK(state.apply_input("+B") == "+D");
+  CHECK(state.apply_forwarded_input("-E") == "");
+  CHECK(state.apply_input("-B -A") == "-D");
+  CHECK(state.stage_is_clear());
+  CHECK(state.can_forward_unreferenced());
+
+  // state changed before forwarded input was applied
+  CHECK(state.apply_input("+A") == "");
+  CHECK(state.apply_forwarded_input("+E") == "+A");
+  CHECK(state.apply_forwarded_input("-E") == "");
+  CHECK(state.apply_input("-A") == "-A");
+  CHECK(state.stage_is_clear());
+
+  auto any_state = create_state("Any >> B");
+  CHECK(!any_state.get_referenced_keys(keys));
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Multi stage update does not allocate", "[Server]") {
+  auto multi_stage = create_multi_stage(R"(
+    S >> R
+    D >> S
+    F >> T
+    Shift{A} >> B
+
+    [stage]
+    BS = Backspace
+
+    [default]
+    ? R A T >> BS BS "cat"
+    B >> C
+  )");
+  auto indices = std::vector<int>();
+  for (auto i = 0u; i < multi_stage->context_count(); ++i)
+    indices.push_back(i);
+  multi_stage->set_active_client_contexts(indices);
+
+  const auto input = parse_sequence(
+    "+S +A +F -F -A -S +ShiftLeft +A -A -ShiftLeft +D -D +X -X");
+  auto output = KeySequence();
+  const auto apply_input = [&]() {
+    for (const auto& event : input) {
+      output.clear();
+      multi_stage->update(event, 0, output);
+    }
+  };
+
+  // warm up buffers
+  for (auto i = 0; i < 3; ++i)
+    apply_input();
+  REQUIRE(multi_stage->is_clear());
+
+  const auto allocations = get_thread_allocations().allocations;
+  for (auto i = 0; i < 10; ++i)
+    apply_input();
+  CHECK(get_thread_allocations().allocations == allocations);
+  CHECK(multi_stage->is_clear());
+}
+
+TEST_CASE("First chord after configuration update does not allocate", "[Server]") {
+  auto multi_stage = create_multi_stage(R"(
+    ShiftLeft{A B C} >> X Y Z "typed text"
+    A B C D E F >> Control{Z}
+    Any >> Any
+  )");
+  const auto& capacity = multi_stage->stages().front()->capacity();
+  CHECK(capacity.max_input_length == 12);
+  CHECK(capacity.max_output_length >= 13);
+  CHECK(multi_stage->buffer_footprint() > 0);
+
+  auto indices = std::vector<int>();
+  for (auto i = 0u; i < multi_stage->context_count(); ++i)
+    indices.push_back(i);
+  multi_stage->set_active_client_contexts(indices);
+
+  const auto input = parse_sequence(
+    "+ShiftLeft +A +B +C -C -B -A -ShiftLeft +A -A +B -B +C -C");
+  auto output = KeySequence();
+  output.reserve(256);
+  const auto allocations = get_thread_allocations().allocations;
+  for (const auto& event : input)
+    multi_stage->update(event, 0, output);
+  CHECK(get_thread_allocations().allocations == allocations);
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Forward output to remote machine", "[Server]") {
+  auto datagrams = std::vector<std::vector<char>>();
+  const auto send = [&](const char* data, size_t size) {
+    datagrams.emplace_back(data, data + size);
+    return true;
+  };
+  auto now = Clock::now();
+  auto writer = RemoteOutputWriter(1);
+  auto reader = RemoteOutputReader();
+  auto output = KeySequence();
+  const auto receive = [&](const std::vector<char>& datagram) {
+    output.clear();
+    return reader.read(datagram.data(), datagram.size(), output);
+  };
+
+  // events are batched
+  CHECK(!writer.keepalive_at());
+  for (const auto& event : parse_sequence("+ShiftLeft +A"))
+    writer.add(event);
+  CHECK(writer.flush(send, now));
+  REQUIRE(datagrams.size() == 1);
+  CHECK(receive(datagrams[0]));
+  CHECK(format_sequence(output) == "+ShiftLeft +A");
+  CHECK(reader.has_keys_down());
+
+  // duplicates are ignored
+  CHECK(receive(datagrams[0]));
+  CHECK(format_sequence(output) == "");
+
+  // keys down are sent periodically
+  REQUIRE(writer.keepalive_at());
+  CHECK(*writer.keepalive_at() == now + RemoteOutputWriter::keepalive_interval);
+
+  // release of lost datagram is recovered
+  writer.add(KeyEvent(Key::A, KeyState::Up));
+  CHECK(writer.flush(send, now));
+  writer.add(KeyEvent(Key::B, KeyState::Down));
+  CHECK(writer.flush(send, now));
+  REQUIRE(datagrams.size() == 3);
+  CHECK(receive(datagrams[2]));
+  CHECK(format_sequence(output) == "+B -A");
+  CHECK(reader.lost_datagrams() == 1);
+
+  // reordered datagrams are ignored
+  CHECK(receive(datagrams[1]));
+  CHECK(format_sequence(output) == "");
+
+  writer.add(KeyEvent(Key::B, KeyState::Up));
+  writer.add(KeyEvent(Key::ShiftLeft, KeyState::Up));
+  CHECK(writer.flush(send, now));
+  CHECK(receive(datagrams.back()));
+  CHECK(format_sequence(output) == "-B -ShiftLeft");
+  CHECK(!reader.has_keys_down());
+
+  // keepalives are sent a few times after the last release
+  auto keepalives = 0;
+  while (auto keepalive_at = writer.keepalive_at()) {
+    now = *keepalive_at;
+    CHECK(writer.send_keepalive(send, now));
+    ++keepalives;
+  }
+  CHECK(keepalives == 3);
+
+  // invalid datagrams are rejected
+  output.clear();
+  CHECK(!reader.read("KMR1", 4, output));
+  auto invalid = datagrams.back();
+  invalid.push_back(0);
+  CHECK(!receive(invalid));
+}
+
+TEST_CASE("Release remote keys when sender restarts", "[Server]") {
+  auto datagrams = std::vector<std::vector<char>>();
+  const auto send = [&](const char* data, size_t size) {
+    datagrams.emplace_back(data, data + size);
+    return true;
+  };
+  auto reader = RemoteOutputReader();
+  auto output = KeySequence();
+  const auto receive = [&]() {
+    output.clear();
+    const auto& datagram = datagrams.back();
+    return reader.read(datagram.data(), datagram.size(), output);
+  };
+
+  auto writer = RemoteOutputWriter(1);
+  writer.add(KeyEvent(Key::A, KeyState::Down));
+  writer.flush(send, Clock::now());
+  CHECK(receive());
+  CHECK(format_sequence(output) == "+A");
+
+  writer = RemoteOutputWriter(2);
+  writer.add(KeyEvent(Key::B, KeyState::Down));
+  writer.flush(send, Clock::now());
+  CHECK(receive());
+  CHECK(format_sequence(output) == "-A +B");
+
+  // large batches are split
+  for (auto i = 0u; i < RemoteOutputWriter::max_events; ++i) {
+    writer.add(KeyEvent(Key::C, KeyState::Down));
+    writer.add(KeyEvent(Key::C, KeyState::Up));
+  }
+  datagrams.clear();
+  writer.flush(send, Clock::now());
+  CHECK(datagrams.size() == 2);
+
+  output.clear();
+  reader.release_keys(output);
+  CHECK(format_sequence(output) == "-B");
+  CHECK(!reader.has_keys_down());
+}
+
+//--------------------------------------------------------------------
+
+#if !defined(_WIN32)
+TEST_CASE("Connect client and server in one process", "[Server]") {
+  class LocalState : public ServerState {
+  public:
+    using ServerState::ServerState;
+    KeySequence output;
+
+  private:
+    bool on_send_key(const KeyEvent& event) override {
+      output.push_back(event);
+      return true;
+    }
+    void on_exit_requested() override { }
+    void on_grab_device_filters_message(std::vector<GrabDeviceFilter>) override { }
+  };
+
+  class Client : public ServerPort::MessageHandler {
+  public:
+    std::vector<int> actions;
+    KeySequence virtual_key_states;
+
+  private:
+    void on_execute_action_message(int action_index) override {
+      actions.push_back(action_index);
+    }
+    void on_virtual_key_state_message(Key key, KeyState state) override {
+      virtual_key_states.emplace_back(key, state);
+    }
+    void on_next_key_info_message(Key, DeviceDesc) override { }
+    void on_statistics_message(const std::string&) override { }
+    void on_input_profiles_message(const InputProfiles&) override { }
+  };
+
+  const auto is_readable = [](int fd) {
+    auto poll_fd = pollfd{ fd, POLLIN, 0 };
+    return (::poll(&poll_fd, 1, 0) > 0);
+  };
+
+  auto channel = std::make_shared<LocalChannel>();
+  auto state = LocalState(std::make_unique<LocalClientPort>(channel));
+  auto server = LocalServerPort(channel);
+  auto client = Client();
+
+  const auto listen_socket = state.listen_for_client_connections();
+  REQUIRE(listen_socket);
+  CHECK(!is_readable(*listen_socket));
+  CHECK(server.connect());
+  CHECK(is_readable(*listen_socket));
+  CHECK(state.accept_client_connection());
+  CHECK(!is_readable(*listen_socket));
+
+  auto stream = std::stringstream(R"(
+    A >> B
+    C >> $(ls)
+    D >> Virtual1
+  )");
+  CHECK(!is_readable(state.client_socket()));
+  CHECK(server.send_config(ParseConfig()(stream)));
+  CHECK(server.send_active_contexts({ 0 }, { }));
+  CHECK(is_readable(state.client_socket()));
+  CHECK(state.read_client_messages());
+  CHECK(!is_readable(state.client_socket()));
+  CHECK(state.has_configuration());
+
+  const auto apply = [&](KeyEvent event) {
+    state.translate_input(event, 0);
+    state.flush_send_buffer();
+    return format_sequence(std::exchange(state.output, { }));
+  };
+  CHECK(apply(KeyEvent(Key::A, KeyState::Down)) == "+B");
+  CHECK(apply(KeyEvent(Key::A, KeyState::Up)) == "-B");
+  CHECK(apply(KeyEvent(Key::C, KeyState::Down)) == "");
+  CHECK(apply(KeyEvent(Key::C, KeyState::Up)) == "");
+  CHECK(apply(KeyEvent(Key::D, KeyState::Down)) == "");
+  CHECK(apply(KeyEvent(Key::D, KeyState::Up)) == "");
+
+  CHECK(is_readable(server.socket()));
+  CHECK(server.read_messages(client, Duration::zero()));
+  CHECK(!is_readable(server.socket()));
+  CHECK(client.actions == std::vector<int>{ 0 });
+  CHECK(format_sequence(client.virtual_key_states) == "+Virtual1");
+
+  // virtual keys set by the client are toggled
+  CHECK(server.send_set_virtual_key_state(
+    static_cast<Key>(*Key::first_virtual + 1), KeyState::Up));
+  CHECK(state.read_client_messages());
+  CHECK(server.read_messages(client, Duration::zero()));
+  CHECK(format_sequence(client.virtual_key_states) == "+Virtual1 -Virtual1");
+
+  // the client can only connect again, once the server disconnected
+  server.disconnect();
+  CHECK(is_readable(state.client_socket()));
+  CHECK(!state.read_client_messages());
+  CHECK(!server.send_active_contexts({ 0 }, { }));
+  CHECK(!server.connect());
+  state.disconnect();
+  CHECK(is_readable(server.socket()));
+  CHECK(!server.read_messages(client, Duration::zero()));
+  CHECK(server.connect());
+  CHECK(state.accept_client_connection());
+}
+#endif
@@ -81,3 +81,117 @@ TEST_CASE("Fuzz no might match", "[Fuzz]") {
     REQUIRE(stage.history_size() < 8);
   }
 }
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Fuzz optimized matching against reference", "[Fuzz]") {
+  const auto device_index = 0;
+  auto config = R"(
+    A{B} >> X
+    (C D) >> Y
+    ? A C >> Z
+    !A B >> Virtual1
+    Virtual1{C} >> W
+    D 200ms >> V
+    [modifier = "ShiftLeft"]
+    A >> !ShiftLeft U
+    C{Any} >> T
+    [stage]
+    X >> S
+    Y{W} >> R
+  )";
+  auto reference = create_multi_stage(config);
+  auto optimized = create_multi_stage(config);
+  reference->set_reference_matching(true);
+  auto indices = std::vector<int>();
+  for (auto i = 0; i < static_cast<int>(reference->context_count()); ++i)
+    indices.push_back(i);
+  reference->set_active_client_contexts(indices);
+  optimized->set_active_client_contexts(indices);
+
+  auto keys = std::vector<Key>();
+  for (auto k : { "A", "B", "C", "D", "ShiftLeft", "E" })
+    keys.push_back(parse_input(k).front().key);
+  auto pressed = std::set<Key>();
+
+  auto rand = std::mt19937(0);
+  auto dist = std::uniform_int_distribution<size_t>(0, keys.size() - 1);
+  auto reference_output = KeySequence();
+  auto output = KeySequence();
+  for (auto i = 0; i < 2000; i++) {
+    // reply to requested timeouts
+    auto event = KeyEvent();
+    if (!output.empty() && output.back().key == Key::timeout) {
+      event = reply_timeout_ms(i % 2 ? 200 : 100);
+    }
+    else {
+      const auto key = keys[dist(rand)];
+      const auto down = pressed.insert(key).second;
+      if (!down)
+        pressed.erase(key);
+      event = KeyEvent(key, down ? KeyState::Down : KeyState::Up);
+    }
+    reference_output.clear();
+    output.clear();
+    reference->update(event, device_index, reference_output);
+    optimized->update(event, device_index, output);
+    INFO(i << ": " << format_sequence({ event }));
+    REQUIRE(format_sequence(reference_output) == format_sequence(output));
+    REQUIRE(reference->is_clear() == optimized->is_clear());
+  }
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Fuzz against first release", "[Fuzz]") {
+  const auto device_index = 0;
+  auto config = R"(
+    ShiftRight{300ms} >>
+    A !200ms >> Virtual1
+    C >> $(command)
+    [stage]
+    B D >> $(command)
+    !ShiftLeft B >> !A A
+    [stage]
+    E{Any} >>
+    C{Any} >> (A ControlLeft)
+  )";
+  auto reference = create_reference_multi_stage(config);
+  auto optimized = create_multi_stage(config);
+  auto indices = std::vector<int>();
+  for (auto i = 0; i < static_cast<int>(reference->context_count()); ++i)
+    indices.push_back(i);
+  reference->set_active_client_contexts(indices);
+  optimized->set_active_client_contexts(indices);
+
+  auto keys = std::vector<Key>();
+  for (auto k : { "A", "B", "C", "D", "E", "ShiftLeft", "ShiftRight" })
+    keys.push_back(parse_input(k).front().key);
+  auto pressed = std::set<Key>();
+
+  auto rand = std::mt19937(0);
+  auto dist = std::uniform_int_distribution<size_t>(0, keys.size() - 1);
+  auto reference_output = KeySequence();
+  auto output = KeySequence();
+  for (auto i = 0; i < 2000; i++) {
+    // reply to requested timeouts
+    auto event = KeyEvent();
+    if (!reference_output.empty() &&
+        reference_output.back().key == Key::timeout) {
+      event = reply_timeout_ms(i % 2 ? 300 : 100);
+    }
+    else {
+      const auto key = keys[dist(rand)];
+      const auto down = pressed.insert(key).second;
+      if (!down)
+        pressed.erase(key);
+      event = KeyEvent(key, down ? KeyState::Down : KeyState::Up);
+    }
+    output.clear();
+    reference_output = reference->update(event, device_index);
+    optimized->update(event, device_index, output);
+    INFO(i << ": " << format_sequence({ event }));
+    REQUIRE(format_sequence(reference_output) == format_sequence(output));
+    REQUIRE(reference->is_clear() == optimized->is_clear());
+  }
+}
@@ -0,0 +1,355 @@
+
+#include "test.h"
+#include "config/ParseConfig.h"
+#include "client/AnalyzeConfig.h"
+#include "client/ServerPort.h"
+#include "server/ClientPort.h"
+#include "common/CompactSequence.h"
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+
+#if defined(__linux__)
+# include <unistd.h>
+#endif
+
+namespace {
+  const char* const keys[] = {
+    "A", "B", "C", "D", "E", "F", "G", "H", "I", "J", "K", "L", "M",
+    "N", "O", "P", "Q", "R", "S", "T", "U", "V", "W", "X", "Y", "Z",
+    "0", "1", "2", "3", "4", "5", "6", "7", "8", "9",
+  };
+  const auto key_count = sizeof(keys) / sizeof(keys[0]);
+
+  const char* const modifiers[] = {
+    "ShiftLeft", "ControlLeft", "AltLeft", "MetaLeft",
+  };
+  const auto modifier_count = sizeof(modifiers) / sizeof(modifiers[0]);
+
+  struct ConfigSize {
+    int contexts;
+    int mappings;
+    int stages;
+  };
+
+  struct Measurement {
+    size_t mappings;
+    double parse_seconds;
+    double read_seconds;
+    size_t message_size;
+    // resident memory of the received stages, 0 when unknown
+    size_t memory;
+  };
+
+  // contexts of each stage have window and device filters,
+  // the mappings are sequences, chords and macro invocations
+  std::string generate_config(const ConfigSize& size) {
+    auto string = std::string(
+      "twice = $0 $0\n"
+      "chord = $0{$1} >> $2\n");
+    for (auto stage = 0; stage < size.stages; ++stage) {
+      if (stage)
+        string += "[stage]\n";
+      for (auto context = 0; context < size.contexts; ++context) {
+        const auto id = std::to_string(stage * size.contexts + context);
+        switch (context % 4) {
+          case 0: string += "[title=\"Window " + id + "\"]\n"; break;
+          case 1: string += "[class=\"class" + id + "\" device=\"Device" +
+            id + "\"]\n"; break;
+          case 2: string += "[device-id=/id" + id + "/]\n"; break;
+          case 3: string += "[path=\"/usr/bin/app" + id + "\"]\n"; break;
+        }
+        for (auto i = 0; i < size.mappings; ++i) {
+          const auto n = static_cast<size_t>(i + context);
+          const auto modifier = modifiers[n % modifier_count];
+          const auto key = keys[(n / modifier_count) % key_count];
+          const auto next = keys[(n / modifier_count / key_count) % key_count];
+          const auto output = keys[n % key_count];
+          switch (i % 3) {
+            case 0:
+              string += std::string(modifier) + "{" + key + "} " + next +
+                " >> " + output + "\n";
+              break;
+            case 1:
+              string += std::string(key) + " " + next + " >> twice[" +
+                output + "]\n";
+              break;
+            case 2:
+              string += std::string("chord[") + modifier + ", " + key +
+                ", " + output + "]\n";
+              break;
+          }
+        }
+      }
+    }
+    return string;
+  }
+
+  size_t get_resident_memory() {
+#if defined(__linux__)
+    auto statm = std::ifstream("/proc/self/statm");
+    auto pages = size_t{ };
+    auto resident = size_t{ };
+    if (statm >> pages >> resident)
+      return resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+    return 0;
+  }
+
+  struct ConfigurationHandler : IClientPort::MessageHandler {
+    MultiStagePtr stage;
+
+    void on_configuration_message(MultiStagePtr stage) override {
+      this->stage = std::move(stage);
+    }
+    void on_grab_device_filters_message(std::vector<GrabDeviceFilter>) override { }
+    void on_directives_message(const std::vector<std::string>&) override { }
+    void on_active_contexts_message(const std::vector<int>&,
+      const ContextSwitchTimes&) override { }
+    void on_set_virtual_key_state_message(Key, KeyState) override { }
+    void on_validate_state_message() override { }
+    void on_request_next_key_info_message() override { }
+    void on_inject_input_message(const KeySequence&) override { }
+    void on_inject_output_message(const KeySequence&) override { }
+    void on_request_statistics_message(bool) override { }
+    void on_request_input_profiles_message() override { }
+  };
+
+  // parses, serializes and reads the configuration like the client and
+  // server do, without connecting them
+  Measurement measure(const ConfigSize& size) {
+    using Seconds = std::chrono::duration<double>;
+    auto result = Measurement{ };
+    auto stream = std::stringstream(generate_config(size));
+    auto parse = ParseConfig();
+
+    auto start = Clock::now();
+    const auto config = parse(stream);
+    result.parse_seconds = Seconds(Clock::now() - start).count();
+    for (const auto& context : config.contexts)
+      result.mappings += context.inputs.size();
+
+    auto server = ServerPort();
+    auto s = Serializer();
+    server.write_config(s, config);
+    result.message_size = s.size();
+
+    auto d = Deserializer(std::vector<char>(s.data(), s.data() + s.size()));
+    REQUIRE(d.read<MessageType>() == MessageType::configuration);
+    auto client = ClientPort();
+    auto handler = ConfigurationHandler();
+    const auto memory_before = get_resident_memory();
+    start = Clock::now();
+    REQUIRE(client.read_configuration(d, handler, false));
+    result.read_seconds = Seconds(Clock::now() - start).count();
+    const auto memory_after = get_resident_memory();
+    if (memory_before && memory_after > memory_before)
+      result.memory = memory_after - memory_before;
+
+    REQUIRE(handler.stage);
+    CHECK(handler.stage->context_count() == config.contexts.size());
+    return result;
+  }
+} // namespace
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Generate large configurations", "[Scaling]") {
+  const auto size = ConfigSize{ 8, 12, 2 };
+  auto stream = std::stringstream(generate_config(size));
+  const auto config = ParseConfig()(stream);
+  auto mapped_contexts = 0;
+  auto stages = 1;
+  for (const auto& context : config.contexts) {
+    if (!context.inputs.empty()) {
+      ++mapped_contexts;
+      CHECK(context.inputs.size() == 12);
+    }
+    if (context.begin_stage)
+      ++stages;
+  }
+  CHECK(mapped_contexts == 16);
+  CHECK(stages == 2);
+  REQUIRE(config.contexts.size() >= 3);
+  CHECK(config.contexts[0].window_title_filter.string == "Window 0");
+  CHECK(config.contexts[1].device_filter.string == "Device1");
+  CHECK(config.contexts[2].device_id_filter.string == "/id2/");
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Duplicate sequences are sent once", "[Scaling]") {
+  // the first configuration of a connection
+  const auto serialize = [](ServerPort& server, int contexts) {
+    auto string = std::string();
+    for (auto i = 0; i < contexts; ++i)
+      string += "[title=\"Window" + std::to_string(i) + "\"]\n"
+        "ControlLeft{C} >> ControlLeft{Insert}\n";
+    auto stream = std::stringstream(string);
+    auto s = Serializer();
+    server.write_config(s, ParseConfig()(stream));
+    return std::vector<char>(s.data(), s.data() + s.size());
+  };
+
+  // only the references grow with the number of contexts
+  auto server = ServerPort();
+  const auto one = serialize(server, 1).size();
+  auto other_server = ServerPort();
+  const auto many = serialize(other_server, 50);
+  CHECK(many.size() - one < 49 * 64);
+
+  auto d = Deserializer(many);
+  REQUIRE(d.read<MessageType>() == MessageType::configuration);
+  auto client = ClientPort();
+  auto handler = ConfigurationHandler();
+  REQUIRE(client.read_configuration(d, handler, false));
+  REQUIRE(handler.stage);
+  const auto& contexts = handler.stage->stages().at(0)->contexts();
+  REQUIRE(contexts.size() == 50);
+  CHECK(format_sequence(contexts[49].inputs.at(0).input) ==
+    format_sequence(contexts[0].inputs.at(0).input));
+  CHECK(format_sequence(contexts[49].outputs.at(0)) ==
+    "+ControlLeft +Insert -Insert -ControlLeft");
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Configuration chunks", "[Scaling]") {
+  auto stream = std::stringstream(generate_config({ 32, 256, 4 }));
+  const auto config = ParseConfig()(stream);
+  auto server = ServerPort();
+  auto message = Serializer();
+  server.write_config(message, config);
+  REQUIRE(message.size() > 2 * configuration_chunk_size);
+
+  // split like ServerPort::send_config
+  auto client = ClientPort();
+  auto handler = ConfigurationHandler();
+  for (auto offset = size_t{ }; offset < message.size(); ) {
+    const auto size = std::min(configuration_chunk_size,
+      message.size() - offset);
+    const auto last = (offset + size == message.size());
+    auto s = Serializer();
+    s.write(last);
+    s.write(static_cast<uint32_t>(size));
+    s.write(message.data() + offset, size);
+    auto d = Deserializer(std::vector<char>(s.data(), s.data() + s.size()));
+    CHECK(client.read_configuration_chunk(d, handler) == last);
+    CHECK(!d.can_read(1));
+    CHECK(static_cast<bool>(handler.stage) == last);
+    offset += size;
+  }
+  REQUIRE(handler.stage);
+  CHECK(handler.stage->context_count() == config.contexts.size());
+
+  // an incomplete chunk discards the received ones
+  auto s = Serializer();
+  s.write(true);
+  s.write(static_cast<uint32_t>(16));
+  auto d = Deserializer(std::vector<char>(s.data(), s.data() + s.size()));
+  CHECK(!client.read_configuration_chunk(d, handler));
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Compact encoding", "[Scaling]") {
+  const auto values = std::vector<int32_t>{ 0, 1, -1, 63, -64, 64, 300,
+    -300, 0x7FFFFFFF, -0x7FFFFFFF - 1 };
+  auto s = Serializer();
+  for (auto value : values) {
+    s.write_varint(static_cast<uint32_t>(value));
+    s.write_signed_varint(value);
+  }
+  const auto sequence = KeySequence{
+    { Key::ShiftLeft, KeyState::Down }, { Key::A, KeyState::Down },
+    { Key::A, KeyState::Up }, { Key::ShiftLeft, KeyState::Up },
+    { Key::timeout, KeyState::Not, 1000 },
+    { Key::first_virtual, KeyState::DownMatched },
+    { Key::none, KeyState::Up },
+  };
+  const auto sequence_begin = s.size();
+  write_compact_sequence(s, sequence);
+  const auto sequence_size = s.size() - sequence_begin;
+  CHECK(sequence_size < sequence.size() * sizeof(KeyEvent));
+
+  auto d = Deserializer(std::vector<char>(s.data(), s.data() + s.size()));
+  for (auto value : values) {
+    CHECK(d.read_varint() == static_cast<uint32_t>(value));
+    CHECK(d.read_signed_varint() == value);
+  }
+  CHECK(read_compact_sequence(d) == sequence);
+  CHECK(!d.can_read(1));
+
+  // small values take a single byte
+  s.truncate(0);
+  s.write_varint(127);
+  s.write_signed_varint(-64);
+  CHECK(s.size() == 2);
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Analyze configuration", "[Scaling]") {
+  auto stream = std::stringstream(R"(
+    A >> B
+    ShiftLeft{C} >> D
+    Any >> E
+    (A B C D)    >> F
+    [stage]
+    ? A >> G
+  )");
+  const auto report = analyze_config(ParseConfig()(stream));
+  CHECK(report.find("stage 0: 1 contexts") != std::string::npos);
+  CHECK(report.find("stage 1: 1 contexts") != std::string::npos);
+  CHECK(report.find("line 4: Any is tried") != std::string::npos);
+  CHECK(report.find("line 5: 4 unordered") != std::string::npos);
+  CHECK(report.find("line 7: no-might-match") != std::string::npos);
+  CHECK(report.find("line 2:") == std::string::npos);
+
+  stream = std::stringstream("A >> B\n");
+  CHECK(analyze_config(ParseConfig()(stream)).find(
+    "No mappings slow down matching") != std::string::npos);
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Configuration scaling budgets", "[Scaling]") {
+  // the budgets are generous, to also hold for debug builds
+  const auto result = measure({ 16, 64, 4 });
+  CHECK(result.mappings == 16 * 64 * 4);
+  const auto mappings = static_cast<double>(result.mappings);
+  CHECK(result.parse_seconds / mappings < 250e-6);
+  CHECK(result.read_seconds / mappings < 250e-6);
+  CHECK(static_cast<double>(result.message_size) / mappings < 16);
+  CHECK(static_cast<double>(result.memory) / mappings < 4096);
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Configuration scaling benchmark", "[.][benchmark]") {
+  std::printf("%10s %12s %12s %12s %12s\n", "mappings",
+    "parse ms", "read ms", "message KB", "memory KB");
+  auto previous = std::optional<Measurement>();
+  for (auto size : { ConfigSize{ 8, 64, 2 }, ConfigSize{ 16, 64, 4 },
+                     ConfigSize{ 32, 128, 4 }, ConfigSize{ 64, 128, 8 } }) {
+    const auto result = measure(size);
+    std::printf("%10zu %12.1f %12.1f %12.1f %12.1f\n", result.mappings,
+      result.parse_seconds * 1000, result.read_seconds * 1000,
+      static_cast<double>(result.message_size) / 1024,
+      static_cast<double>(result.memory) / 1024);
+
+    // the time per mapping should not grow with the size
+    if (previous) {
+      const auto per_mapping = [](const Measurement& m, double seconds) {
+        return seconds / static_cast<double>(m.mappings);
+      };
+      CHECK(per_mapping(result, result.parse_seconds) <
+        3 * per_mapping(*previous, previous->parse_seconds));
+      CHECK(per_mapping(result, result.read_seconds) <
+        3 * per_mapping(*previous, previous->read_seconds));
+    }
+    previous = result;
+  }
+}
+
+//--------------------------------------------------------------------